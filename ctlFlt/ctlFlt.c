@@ -1,22 +1,158 @@
 #include <windows.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wctype.h>
+#include <io.h>
+#include <fcntl.h>
+#include "ruleCompiler.h"
+#include "traceReplay.h"
+#include "../kernel/ruleOps.h"
 
 #define DEVICE_NAME L"\\\\.\\FileTracker"
-#define IOCTL_ADD_TRACKED_FILE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_ANY_ACCESS)
-#define IOCTL_REMOVE_TRACKED_FILE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_ADD_TRACKED_FILE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define IOCTL_REMOVE_TRACKED_FILE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define IOCTL_SET_PATTERN_RULES CTL_CODE(FILE_DEVICE_UNKNOWN, 0x803, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define IOCTL_GET_CACHE_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x804, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_GET_FILTER_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_SET_QUEUE_CONFIG CTL_CODE(FILE_DEVICE_UNKNOWN, 0x809, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define IOCTL_GET_QUEUE_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_UPDATE_TRACKED_FILES CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80B, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define IOCTL_GET_MEMORY_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_GET_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80D, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _DECISION_CACHE_STATS {
+    ULONG64 Hits;
+    ULONG64 Misses;
+    ULONG64 VolumeSkips;
+} DECISION_CACHE_STATS;
+
+typedef struct _PATH_FILTER_STATS {
+    ULONG64 Rejected;
+    ULONG64 Admitted;
+    ULONG64 FalsePositives;
+    ULONG64 MemoryBytes;
+    ULONG KeyCount;
+    ULONG Capacity;
+} PATH_FILTER_STATS;
+
+typedef struct _MEMORY_USAGE {
+    ULONG Tag;
+    ULONG Reserved;
+    ULONG64 Count;
+    ULONG64 Bytes;
+    ULONG64 UsedBytes;
+} MEMORY_USAGE;
+
+// The records of MEMORY_STATS, in the driver's order
+static const wchar_t* MemoryParts[] = {
+    L"Rule entries", L"Bucket table", L"Directory trie", L"Prefilter", L"Rule image", L"Wildcard DFA",
+    L"Message queue", L"Mapped ring", L"Intern table", L"Process cache"
+};
+
+typedef struct _MEMORY_STATS {
+    MEMORY_USAGE Parts[_countof(MemoryParts)];
+} MEMORY_STATS;
+
+// The counters and histograms of PERF_STATS, in the driver's order
+static const wchar_t* PerfCounters[] = {
+    L"Name query failures", L"Cache hits", L"Cache misses", L"Volume skips", L"Denied", L"Enqueued", L"Dropped",
+    L"Filter rejected", L"Filter admitted", L"Filter false pos"
+};
+static const wchar_t* PerfHistograms[] = { L"Pre-operation", L"Post-operation", L"Name query", L"Rule lookup" };
+
+#define PERF_HISTOGRAM_BUCKETS 32
+
+typedef struct _PERF_HISTOGRAM {
+    ULONG64 Count;
+    ULONG64 TotalTicks;
+    ULONG64 Buckets[PERF_HISTOGRAM_BUCKETS];
+} PERF_HISTOGRAM;
+
+typedef struct _PERF_STATS {
+    ULONG64 TicksPerSecond;
+    ULONG Processors;
+    ULONG Reserved;
+    ULONG64 Counters[_countof(PerfCounters)];
+    PERF_HISTOGRAM Histograms[_countof(PerfHistograms)];
+} PERF_STATS;
+
+#pragma pack(push, 1)
+typedef struct _MESSAGE_QUEUE_CONFIG {
+    ULONG Size;
+    ULONG Policy;
+} MESSAGE_QUEUE_CONFIG;
+
+typedef struct _MESSAGE_QUEUE_STATS {
+    ULONG Size;
+    ULONG Policy;
+    ULONG64 Dropped;
+    ULONG UsedBytes;
+    ULONG MappedSize;
+} MESSAGE_QUEUE_STATS;
+
+typedef struct _RULE_UPDATE {
+    USHORT Operation;
+    USHORT Flags;
+    USHORT PathLength;
+    WCHAR Path[1];
+} RULE_UPDATE;
+
+typedef struct _RULE_UPDATE_BATCH {
+    ULONG Count;
+    ULONG Reserved;
+} RULE_UPDATE_BATCH;
+#pragma pack(pop)
+
+#define RULE_UPDATE_ADD 0
+#define RULE_UPDATE_REMOVE 1
+#define RULE_UPDATE_PROTECTED 0x1
+#define RULE_UPDATE_OPERATIONS 0x2
+#define RULE_UPDATE_OPERATIONS_SHIFT 8
+
+// Records start 8-byte aligned from the batch
+#define RULE_UPDATE_SIZE(PathLength) ((FIELD_OFFSET(RULE_UPDATE, Path) + (ULONG)(PathLength) + 7) & ~7UL)
+
+// Bytes of rules sent per IOCTL, so a large rule file takes a handful of calls
+#define RULE_BATCH_SIZE (1024 * 1024)
+#define RULE_BATCH_MAX_COUNT ((RULE_BATCH_SIZE - sizeof(RULE_UPDATE_BATCH)) / RULE_UPDATE_SIZE(sizeof(WCHAR)))
+
+// Overflow policies by their QUEUE_OVERFLOW_POLICY value
+static const wchar_t* PolicyNames[] = { L"oldest", L"newest", L"denied" };
+
+// Device names of the drive letters, queried once per letter
+static wchar_t* DevicePaths[26];
+
+static const wchar_t* DevicePathOf(wchar_t letter) {
+    wchar_t driveLetter[3] = { towupper(letter), L':', L'\0' };
+    if (driveLetter[0] < L'A' || driveLetter[0] > L'Z') {
+        wprintf(L"Not a drive letter path\n");
+        return NULL;
+    }
+
+    wchar_t** cached = &DevicePaths[driveLetter[0] - L'A'];
+    if (!*cached) {
+        wchar_t devicePath[MAX_PATH];
+        if (QueryDosDeviceW(driveLetter, devicePath, MAX_PATH) == 0) {
+            wprintf(L"Failed to query device path: %d\n", GetLastError());
+            return NULL;
+        }
+        *cached = _wcsdup(devicePath);
+    }
+    return *cached;
+}
 
 static BOOL ConvertWin32ToNtPath(const wchar_t* win32Path, wchar_t* ntPath, size_t ntPathSize) {
     wchar_t fullPath[MAX_PATH];
-    wchar_t driveLetter[3] = { win32Path[0], L':', L'\0' };
-    wchar_t devicePath[MAX_PATH];
 
     if (!GetFullPathNameW(win32Path, MAX_PATH, fullPath, NULL)) {
         wprintf(L"Failed to get full path: %d\n", GetLastError());
         return FALSE;
     }
 
-    if (QueryDosDeviceW(driveLetter, devicePath, MAX_PATH) == 0) {
-        wprintf(L"Failed to query device path: %d\n", GetLastError());
+    // The drive of the full path, since a relative path does not start with one
+    const wchar_t* devicePath = DevicePathOf(fullPath[0]);
+    if (!devicePath) {
         return FALSE;
     }
 
@@ -32,21 +168,776 @@ static BOOL ConvertWin32ToNtPath(const wchar_t* win32Path, wchar_t* ntPath, size
     return TRUE;
 }
 
+// Splits the ":ops" suffix off a path, e.g. C:\Data\:dRW, and returns its RULE_* bits: a letter of RULE_OP_LETTERS
+// in lowercase tracks the operation, in uppercase denies it. Returns 0 and leaves the path alone without a suffix.
+static LONG SplitOperations(wchar_t* path) {
+    wchar_t* colon = wcsrchr(path, L':');
+    LONG operations = 0;
+
+    // The colon of a drive letter is followed by a separator, never by letters alone
+    if (!colon || colon == path || colon[1] == L'\0') {
+        return 0;
+    }
+    for (const wchar_t* letter = colon + 1; *letter; letter++) {
+        const char* op = *letter > 0x7F ? NULL : strchr(RULE_OP_LETTERS, (char)towlower(*letter));
+        if (!op) {
+            return 0;
+        }
+        operations |= iswlower(*letter) ? RULE_TRACK(op - RULE_OP_LETTERS) : RULE_DENY(op - RULE_OP_LETTERS);
+    }
+    *colon = L'\0';
+    return operations;
+}
+
+// Makes every operation a rule tracks a denied one, as -p does
+static LONG DenyOperations(LONG operations) {
+    for (LONG op = 0; op < RULE_OP_COUNT; op++) {
+        if (operations & RULE_TRACK(op)) {
+            operations = (operations & ~RULE_TRACK(op)) | RULE_DENY(op);
+        }
+    }
+    return operations;
+}
+
+// Formats the ":ops" suffix the driver parses; a plain rule gets none
+static void FormatOperations(LONG operations, wchar_t* suffix, size_t suffixSize) {
+    size_t length = 0;
+    suffix[0] = L'\0';
+    if (operations == RULE_DEFAULT || suffixSize < 2 + 2 * RULE_OP_COUNT) {
+        return;
+    }
+    suffix[length++] = L':';
+    for (LONG op = 0; op < RULE_OP_COUNT; op++) {
+        if (operations & RULE_TRACK(op)) suffix[length++] = (wchar_t)RULE_OP_LETTERS[op];
+        if (operations & RULE_DENY(op)) suffix[length++] = (wchar_t)towupper(RULE_OP_LETTERS[op]);
+    }
+    suffix[length] = L'\0';
+}
+
+// The RULE_UPDATE flags of a rule; rules that only track or deny deletions keep the older encoding
+static USHORT RuleUpdateFlags(LONG operations) {
+    if (operations == RULE_DEFAULT) {
+        return 0;
+    }
+    if (operations == RULE_DENY(RULE_OP_DELETE)) {
+        return RULE_UPDATE_PROTECTED;
+    }
+    return (USHORT)(RULE_UPDATE_OPERATIONS | (operations << RULE_UPDATE_OPERATIONS_SHIFT));
+}
+
+// Microseconds below which a share of the samples fell: the upper bound of the bucket that reaches it
+static double HistogramPercentile(const PERF_HISTOGRAM* histogram, double share, ULONG64 ticksPerSecond) {
+    ULONG64 wanted = (ULONG64)(share * histogram->Count + 0.5);
+    ULONG64 seen = 0;
+    ULONG bucket = 0;
+    for (; bucket < PERF_HISTOGRAM_BUCKETS - 1; bucket++) {
+        seen += histogram->Buckets[bucket];
+        if (seen >= wanted) break;
+    }
+    return 1e6 * (double)(1ULL << bucket) / ticksPerSecond;
+}
+
+// The samples a histogram took between two snapshots
+static void HistogramInterval(const PERF_HISTOGRAM* before, const PERF_HISTOGRAM* after, PERF_HISTOGRAM* interval) {
+    interval->Count = after->Count - before->Count;
+    interval->TotalTicks = after->TotalTicks - before->TotalTicks;
+    for (ULONG b = 0; b < PERF_HISTOGRAM_BUCKETS; b++) {
+        interval->Buckets[b] = after->Buckets[b] - before->Buckets[b];
+    }
+}
+
+// Shows what happened between two snapshots of the driver's counters
+static void PrintPerfStats(const PERF_STATS* before, const PERF_STATS* after, double seconds) {
+    wprintf(L"%lu processors, %.1f s sampled\n", after->Processors, seconds);
+    wprintf(L"%-20s %16s %12s\n", L"Counter", L"Total", L"Per second");
+    for (ULONG i = 0; i < _countof(PerfCounters); i++) {
+        wprintf(L"%-20s %16llu %12.1f\n", PerfCounters[i], after->Counters[i],
+            (after->Counters[i] - before->Counters[i]) / seconds);
+    }
+
+    wprintf(L"%-20s %16s %12s %10s %10s %10s\n", L"Latency (us)", L"Samples", L"Per second", L"Mean", L"p50", L"p99");
+    for (ULONG i = 0; i < _countof(PerfHistograms); i++) {
+        PERF_HISTOGRAM interval;
+        HistogramInterval(&before->Histograms[i], &after->Histograms[i], &interval);
+        if (!interval.Count || !after->TicksPerSecond) {
+            wprintf(L"%-20s %16llu %12.1f %10s %10s %10s\n", PerfHistograms[i], after->Histograms[i].Count, 0.0,
+                L"-", L"-", L"-");
+            continue;
+        }
+        wprintf(L"%-20s %16llu %12.1f %10.2f %10.2f %10.2f\n", PerfHistograms[i], after->Histograms[i].Count,
+            interval.Count / seconds, 1e6 * interval.TotalTicks / interval.Count / after->TicksPerSecond,
+            HistogramPercentile(&interval, 0.5, after->TicksPerSecond),
+            HistogramPercentile(&interval, 0.99, after->TicksPerSecond));
+    }
+}
+
+// Prints a display name as a JSON key: lowercase, with '_' for spaces and dashes
+static void PrintJsonKey(const wchar_t* name) {
+    putwchar(L'"');
+    for (; *name; name++) {
+        putwchar(*name == L' ' || *name == L'-' ? L'_' : towlower(*name));
+    }
+    wprintf(L"\":");
+}
+
+// The same as PrintPerfStats as a single JSON object on one line, with each histogram's buckets over the interval,
+// for scripts that track the numbers from run to run
+static void PrintPerfStatsJson(const PERF_STATS* before, const PERF_STATS* after, double seconds) {
+    wprintf(L"{\"processors\":%lu,\"seconds\":%.3f,\"ticks_per_second\":%llu,\"counters\":{",
+        after->Processors, seconds, after->TicksPerSecond);
+    for (ULONG i = 0; i < _countof(PerfCounters); i++) {
+        if (i) putwchar(L',');
+        PrintJsonKey(PerfCounters[i]);
+        wprintf(L"{\"total\":%llu,\"per_second\":%.1f}", after->Counters[i],
+            (after->Counters[i] - before->Counters[i]) / seconds);
+    }
+
+    wprintf(L"},\"histograms\":{");
+    for (ULONG i = 0; i < _countof(PerfHistograms); i++) {
+        PERF_HISTOGRAM interval;
+        HistogramInterval(&before->Histograms[i], &after->Histograms[i], &interval);
+        BOOL timed = interval.Count && after->TicksPerSecond;
+
+        if (i) putwchar(L',');
+        PrintJsonKey(PerfHistograms[i]);
+        wprintf(L"{\"total\":%llu,\"per_second\":%.1f,\"mean_us\":%.3f,\"p50_us\":%.3f,\"p99_us\":%.3f,\"buckets\":[",
+            after->Histograms[i].Count, interval.Count / seconds,
+            timed ? 1e6 * interval.TotalTicks / interval.Count / after->TicksPerSecond : 0.0,
+            timed ? HistogramPercentile(&interval, 0.5, after->TicksPerSecond) : 0.0,
+            timed ? HistogramPercentile(&interval, 0.99, after->TicksPerSecond) : 0.0);
+        for (ULONG b = 0; b < PERF_HISTOGRAM_BUCKETS; b++) {
+            wprintf(b ? L",%llu" : L"%llu", interval.Buckets[b]);
+        }
+        wprintf(L"]}");
+    }
+    wprintf(L"}}\n");
+}
+
+// Replays a trace, with the driver's counters over the run if it is loaded
+static int RunReplay(const wchar_t* fileName, const wchar_t* directory, BOOL paced) {
+    PERF_STATS before;
+    PERF_STATS after;
+    TRACE_REPLAY_RESULT result;
+    DWORD bytesReturned;
+
+    HANDLE hDevice = CreateFileW(DEVICE_NAME, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+    BOOL counted = hDevice != INVALID_HANDLE_VALUE
+        && DeviceIoControl(hDevice, IOCTL_GET_STATS, NULL, 0, &before, sizeof(before), &bytesReturned, NULL);
+    if (!counted) {
+        wprintf(L"Driver counters unavailable (%d); replaying without them\n", GetLastError());
+    }
+
+    if (!ReplayTrace(fileName, directory, paced, &result)) {
+        if (hDevice != INVALID_HANDLE_VALUE) CloseHandle(hDevice);
+        return 1;
+    }
+    counted = counted && DeviceIoControl(hDevice, IOCTL_GET_STATS, NULL, 0, &after, sizeof(after), &bytesReturned, NULL);
+    if (hDevice != INVALID_HANDLE_VALUE) CloseHandle(hDevice);
+
+    wprintf(L"Replayed %lu events in %.3f s (%.0f per second), %lu failed (%lu denied), %lu skipped\n",
+        result.Events, result.Seconds, result.Seconds > 0 ? result.Events / result.Seconds : 0.0,
+        result.Failed, result.Denied, result.Skipped);
+    if (result.Events) {
+        wprintf(L"Per event: %.2f us creating the file, %.2f us in the operation\n",
+            1e6 * result.PrepareSeconds / result.Events, 1e6 * result.OperationSeconds / result.Events);
+    }
+    if (counted) {
+        PrintPerfStats(&before, &after, result.Seconds > 0 ? result.Seconds : 1.0);
+    }
+    return 0;
+}
+
+// Reads one pattern per line into a list of null-terminated strings ended by an empty one.
+// Blank lines and lines starting with '#' are skipped.
+static wchar_t* ReadPatternFile(const wchar_t* fileName, DWORD* size) {
+    FILE* file;
+    if (_wfopen_s(&file, fileName, L"r, ccs=UTF-8") != 0) {
+        wprintf(L"Failed to open %s\n", fileName);
+        return NULL;
+    }
+
+    size_t capacity = 4096;
+    size_t used = 0;
+    wchar_t* list = malloc(capacity * sizeof(wchar_t));
+    wchar_t line[1024];
+    while (list && fgetws(line, _countof(line), file)) {
+        size_t length = wcslen(line);
+        while (length > 0 && iswspace(line[length - 1])) {
+            line[--length] = L'\0';
+        }
+        if (length == 0 || line[0] == L'#') {
+            continue;
+        }
+
+        if (used + length + 2 > capacity) {
+            capacity = (used + length + 2) * 2;
+            wchar_t* grown = realloc(list, capacity * sizeof(wchar_t));
+            if (!grown) {
+                free(list);
+                list = NULL;
+                break;
+            }
+            list = grown;
+        }
+        wcscpy_s(list + used, capacity - used, line);
+        used += length + 1;
+    }
+    fclose(file);
+
+    if (!list) {
+        wprintf(L"Out of memory reading %s\n", fileName);
+        return NULL;
+    }
+    list[used++] = L'\0';
+    *size = (DWORD)(used * sizeof(wchar_t));
+    return list;
+}
+
+// Sends the rules collected in batch and counts their results; lines holds the line number of each rule
+static BOOL SendRuleBatch(HANDLE hDevice, UCHAR* batch, DWORD size, const ULONG* lines, LONG* results,
+    ULONG* applied, ULONG* failed) {
+    ULONG count = ((RULE_UPDATE_BATCH*)batch)->Count;
+    DWORD bytesReturned;
+
+    if (!DeviceIoControl(hDevice, IOCTL_UPDATE_TRACKED_FILES, batch, size, results, count * sizeof(LONG), &bytesReturned, NULL)) {
+        wprintf(L"Failed to apply the rules of lines %lu to %lu: %d\n", lines[0], lines[count - 1], GetLastError());
+        return FALSE;
+    }
+
+    for (ULONG i = 0; i < count; i++) {
+        if (results[i] >= 0) {
+            (*applied)++;
+        }
+        else {
+            wprintf(L"Line %lu: rejected with status 0x%08lX\n", lines[i], (ULONG)results[i]);
+            (*failed)++;
+        }
+    }
+    return TRUE;
+}
+
+// Opens a rule file, or stdin for "-"
+static FILE* OpenRuleFile(const wchar_t* fileName) {
+    FILE* file = stdin;
+    if (wcscmp(fileName, L"-") == 0) {
+        _setmode(_fileno(stdin), _O_U8TEXT);
+    }
+    else if (_wfopen_s(&file, fileName, L"r, ccs=UTF-8") != 0) {
+        wprintf(L"Failed to open %s\n", fileName);
+        return NULL;
+    }
+    return file;
+}
+
+// Reads the next "-a|-p|-r <path>[:ops]" line of a rule file and converts its path to an NT path. Blank lines and
+// lines starting with '#' are skipped; malformed lines are reported and counted in failed. Returns FALSE at the
+// end of the file.
+static BOOL ReadRuleLine(FILE* file, ULONG* lineNumber, USHORT* operation, USHORT* flags, wchar_t* ntPath,
+    size_t ntPathSize, ULONG* failed) {
+    wchar_t line[1100];
+
+    while (fgetws(line, _countof(line), file)) {
+        (*lineNumber)++;
+        size_t length = wcslen(line);
+        if (length == _countof(line) - 1 && line[length - 1] != L'\n') {
+            wprintf(L"Line %lu: too long\n", *lineNumber);
+            (*failed)++;
+            while (fgetws(line, _countof(line), file) && line[wcslen(line) - 1] != L'\n') {
+            }
+            continue;
+        }
+        while (length > 0 && iswspace(line[length - 1])) {
+            line[--length] = L'\0';
+        }
+
+        wchar_t* command = line + wcsspn(line, L" \t");
+        if (*command == L'\0' || *command == L'#') {
+            continue;
+        }
+        wchar_t* path = command + wcscspn(command, L" \t");
+        if (*path) {
+            *path++ = L'\0';
+            path += wcsspn(path, L" \t");
+        }
+        if (*path == L'"') {
+            size_t pathLength = wcslen(++path);
+            if (pathLength > 0 && path[pathLength - 1] == L'"') {
+                path[pathLength - 1] = L'\0';
+            }
+        }
+
+        BOOL known = wcscmp(command, L"-a") == 0 || wcscmp(command, L"-p") == 0 || wcscmp(command, L"-r") == 0;
+        if (!known || *path == L'\0') {
+            wprintf(L"Line %lu: expected -a, -p or -r followed by a path\n", *lineNumber);
+            (*failed)++;
+            continue;
+        }
+        LONG operations = SplitOperations(path);
+        if (!ConvertWin32ToNtPath(path, ntPath, ntPathSize)) {
+            wprintf(L"Line %lu: failed to convert path: %s\n", *lineNumber, path);
+            (*failed)++;
+            continue;
+        }
+        if (!operations) {
+            operations = RULE_DEFAULT;
+        }
+        if (wcscmp(command, L"-p") == 0) {
+            operations = DenyOperations(operations);
+        }
+        *operation = wcscmp(command, L"-r") == 0 ? RULE_UPDATE_REMOVE : RULE_UPDATE_ADD;
+        *flags = *operation == RULE_UPDATE_REMOVE ? 0 : RuleUpdateFlags(operations);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+// Applies the rules of a file, or of stdin for "-", one "-a|-p|-r <path>[:ops]" per line. Blank lines and lines
+// starting with '#' are skipped. The rules are sent RULE_BATCH_SIZE bytes at a time.
+static int LoadRuleFile(HANDLE hDevice, const wchar_t* fileName) {
+    FILE* file = OpenRuleFile(fileName);
+    if (!file) {
+        return 1;
+    }
+
+    UCHAR* batch = malloc(RULE_BATCH_SIZE);
+    ULONG* lines = malloc(RULE_BATCH_MAX_COUNT * sizeof(ULONG));
+    LONG* results = malloc(RULE_BATCH_MAX_COUNT * sizeof(LONG));
+    if (!batch || !lines || !results) {
+        wprintf(L"Out of memory\n");
+        free(batch);
+        free(lines);
+        free(results);
+        if (file != stdin) fclose(file);
+        return 1;
+    }
+
+    LARGE_INTEGER frequency, start, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    RULE_UPDATE_BATCH* header = (RULE_UPDATE_BATCH*)batch;
+    DWORD used = sizeof(RULE_UPDATE_BATCH);
+    ULONG applied = 0;
+    ULONG failed = 0;
+    ULONG lineNumber = 0;
+    BOOL success = TRUE;
+    USHORT operation;
+    USHORT flags;
+    wchar_t ntPath[1024];
+    header->Count = 0;
+    header->Reserved = 0;
+
+    while (success && ReadRuleLine(file, &lineNumber, &operation, &flags, ntPath, _countof(ntPath), &failed)) {
+        USHORT pathLength = (USHORT)(wcslen(ntPath) * sizeof(WCHAR));
+        if (used + RULE_UPDATE_SIZE(pathLength) > RULE_BATCH_SIZE) {
+            success = SendRuleBatch(hDevice, batch, used, lines, results, &applied, &failed);
+            used = sizeof(RULE_UPDATE_BATCH);
+            header->Count = 0;
+        }
+
+        RULE_UPDATE* record = (RULE_UPDATE*)(batch + used);
+        record->Operation = operation;
+        record->Flags = flags;
+        record->PathLength = pathLength;
+        memcpy(record->Path, ntPath, pathLength);
+        lines[header->Count++] = lineNumber;
+        used += RULE_UPDATE_SIZE(pathLength);
+    }
+    if (success && header->Count > 0) {
+        success = SendRuleBatch(hDevice, batch, used, lines, results, &applied, &failed);
+    }
+
+    QueryPerformanceCounter(&end);
+    double seconds = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+    wprintf(L"Applied %lu rules, %lu failed, in %.3f s (%.0f rules/s)\n",
+        applied, failed, seconds, seconds > 0 ? applied / seconds : 0.0);
+
+    free(batch);
+    free(lines);
+    free(results);
+    if (file != stdin) fclose(file);
+    return success && failed == 0 ? 0 : 1;
+}
+
+// The driver upcases names with RtlUpcaseUnicodeChar, so the image must be folded with the same table
+typedef WCHAR (NTAPI* RTL_UPCASE_UNICODE_CHAR)(WCHAR);
+static RTL_UPCASE_UNICODE_CHAR UpcaseChar;
+
+static WCHAR FoldChar(WCHAR ch) {
+    return UpcaseChar(ch);
+}
+
+// Frees the paths collected by BuildRuleImage
+static void FreeRules(RULE_IMAGE_RULE* rules, ULONG count) {
+    for (ULONG i = 0; i < count; i++) {
+        free((void*)rules[i].Path);
+    }
+    free(rules);
+}
+
+// Compiles the "-a|-p <path>[:ops]" rules of a file, or of stdin for "-", into an image the driver loads at startup,
+// then checks the image by looking every rule up in it. Prints the build time, the image size and the lookup
+// cost.
+static int BuildRuleImage(const wchar_t* fileName, const wchar_t* imageName) {
+    UpcaseChar = (RTL_UPCASE_UNICODE_CHAR)GetProcAddress(GetModuleHandleW(L"ntdll.dll"), "RtlUpcaseUnicodeChar");
+    if (!UpcaseChar) {
+        wprintf(L"Failed to find RtlUpcaseUnicodeChar: %d\n", GetLastError());
+        return 1;
+    }
+    FILE* file = OpenRuleFile(fileName);
+    if (!file) {
+        return 1;
+    }
+
+    ULONG count = 0;
+    ULONG capacity = 0;
+    ULONG failed = 0;
+    ULONG lineNumber = 0;
+    RULE_IMAGE_RULE* rules = NULL;
+    USHORT operation;
+    USHORT flags;
+    wchar_t ntPath[1024];
+
+    while (ReadRuleLine(file, &lineNumber, &operation, &flags, ntPath, _countof(ntPath), &failed)) {
+        if (operation == RULE_UPDATE_REMOVE) {
+            wprintf(L"Line %lu: an image only holds -a and -p rules\n", lineNumber);
+            failed++;
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+            RULE_IMAGE_RULE* grown = realloc(rules, capacity * sizeof(RULE_IMAGE_RULE));
+            if (!grown) {
+                break;
+            }
+            rules = grown;
+        }
+        rules[count].Path = _wcsdup(ntPath);
+        if (!rules[count].Path) {
+            break;
+        }
+        rules[count].Length = (USHORT)(wcslen(ntPath) * sizeof(WCHAR));
+        rules[count].Flags = (flags & RULE_UPDATE_OPERATIONS)
+            ? (USHORT)(RULE_IMAGE_OPERATIONS | ((flags >> RULE_UPDATE_OPERATIONS_SHIFT) << RULE_IMAGE_OPERATIONS_SHIFT))
+            : ((flags & RULE_UPDATE_PROTECTED) ? RULE_IMAGE_PROTECTED : 0);
+        count++;
+    }
+    BOOL complete = feof(file);
+    if (file != stdin) fclose(file);
+    if (!complete || failed) {
+        wprintf(complete ? L"%lu rules failed, no image written\n" : L"Out of memory reading the rules\n", failed);
+        FreeRules(rules, count);
+        return 1;
+    }
+
+    LARGE_INTEGER frequency, start, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+    RULE_IMAGE_BUILD build;
+    BOOL success = CompileRuleImage(rules, count, FoldChar, &build);
+    QueryPerformanceCounter(&end);
+    if (!success) {
+        wprintf(L"Failed to compile %lu rules\n", count);
+        FreeRules(rules, count);
+        return 1;
+    }
+    double buildSeconds = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+
+    // Every file rule must be found with its flags, as the driver will look it up
+    RULE_IMAGE_VIEW view;
+    ULONG missing = 0;
+    ULONG lookups = 0;
+    success = RuleImageOpen(&view, build.Image, build.ImageSize);
+    QueryPerformanceCounter(&start);
+    for (ULONG i = 0; success && i < count; i++) {
+        if (rules[i].Path[rules[i].Length / sizeof(WCHAR) - 1] == L'\\') {
+            continue;
+        }
+        if (!RuleImageLookup(&view, rules[i].Path, rules[i].Length, FoldChar, NULL)) {
+            missing++;
+        }
+        lookups++;
+    }
+    QueryPerformanceCounter(&end);
+    double lookupSeconds = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+    if (!success || missing) {
+        wprintf(L"The compiled image is inconsistent, %lu names missing\n", missing);
+        free(build.Image);
+        FreeRules(rules, count);
+        return 1;
+    }
+
+    FILE* image;
+    if (_wfopen_s(&image, imageName, L"wb") != 0) {
+        wprintf(L"Failed to create %s\n", imageName);
+        success = FALSE;
+    }
+    else {
+        success = fwrite(build.Image, 1, build.ImageSize, image) == build.ImageSize;
+        success = fclose(image) == 0 && success;
+        if (!success) {
+            wprintf(L"Failed to write %s\n", imageName);
+        }
+    }
+
+    if (success) {
+        wprintf(L"Compiled %lu names and %lu directories (%lu duplicates dropped) in %.3f s, %lu seed(s)\n",
+            build.NameCount, build.DirectoryCount, build.Duplicates, buildSeconds, build.Attempts);
+        wprintf(L"Wrote %s: %lu bytes, %.1f bytes per rule; %.0f ns per lookup\n", imageName, build.ImageSize,
+            count ? (double)build.ImageSize / (build.NameCount + build.DirectoryCount) : 0.0,
+            lookups ? lookupSeconds * 1e9 / lookups : 0.0);
+    }
+    free(build.Image);
+    FreeRules(rules, count);
+    return success ? 0 : 1;
+}
+
 int wmain(int argc, wchar_t* argv[]) {
-    if (argc < 3) {
-        wprintf(L"Usage: %s [-a|-r|-p] <file_path>\n", argv[0]);
+    BOOL showStats = argc == 2 && wcscmp(argv[1], L"-c") == 0;
+    BOOL showMemory = argc == 2 && wcscmp(argv[1], L"-m") == 0;
+    BOOL showPerf = argc >= 2 && wcscmp(argv[1], L"-s") == 0;
+    if (argc < 3 && !showStats && !showMemory && !showPerf) {
+        wprintf(L"Usage: %s [-a|-r|-p] <file_path>[:ops]\n", argv[0]);
         wprintf(L"  -a: Add file to tracking\n");
         wprintf(L"  -r: Remove file from tracking\n");
-        wprintf(L"  -p: Add file with protection (prevents deletion)\n");
+        wprintf(L"  -p: Add file with protection (prevents the operations instead of logging them)\n");
+        wprintf(L"  A path ending in '\\' applies to the whole directory, e.g. C:\\Data\\\n");
+        wprintf(L"  ops: letters of the operations the rule covers: d=delete, r=rename, w=overwrite, c=delete on close;\n");
+        wprintf(L"       lowercase logs, uppercase blocks, e.g. C:\\Data\\:dRW. Without it, deletions are covered\n");
+        wprintf(L"Usage: %s -f <rules_file|->\n", argv[0]);
+        wprintf(L"  -f: Apply many rules at once, one '-a|-p|-r <path>[:ops]' per line, read from the file or stdin\n");
+        wprintf(L"Usage: %s -b <rules_file|-> <image_file>\n", argv[0]);
+        wprintf(L"  -b: Compile '-a|-p <path>[:ops]' rules into an image the driver loads at startup\n");
+        wprintf(L"      (the RuleImage value of its Parameters key)\n");
+        wprintf(L"Usage: %s -g <rules_file>\n", argv[0]);
+        wprintf(L"  -g: Replace the wildcard rules with the NT path patterns in the file, one per line\n");
+        wprintf(L"      (append :ops as above, or :p to protect); an empty file removes all wildcard rules\n");
+        wprintf(L"Usage: %s -q <bytes> [oldest|newest|denied]\n", argv[0]);
+        wprintf(L"  -q: Resize the message queue (0 keeps the size) and choose what a full queue drops:\n");
+        wprintf(L"      the oldest messages, new messages, or audit messages in favor of denied deletions\n");
+        wprintf(L"Usage: %s -c\n", argv[0]);
+        wprintf(L"  -c: Show decision cache, prefilter and message queue counters\n");
+        wprintf(L"Usage: %s -m\n", argv[0]);
+        wprintf(L"  -m: Show the memory held by each part of the driver\n");
+        wprintf(L"Usage: %s -s [seconds] [json]\n", argv[0]);
+        wprintf(L"  -s: Show the hot-path counters and callback latencies, with rates over the interval (1 s);\n");
+        wprintf(L"      json prints them as one JSON object per run, the interval's latency buckets included\n");
+        wprintf(L"Usage: %s -n <cleanup|rotate|mass> <count> <trace_file>\n", argv[0]);
+        wprintf(L"  -n: Write a synthetic trace of count operations: a build tree cleanup, log rotation, or mass deletion\n");
+        wprintf(L"Usage: %s -l <trace_file> <directory> [paced]\n", argv[0]);
+        wprintf(L"  -l: Replay a trace (from -n or watchFlt -t) below the directory, at full speed or at the recorded\n");
+        wprintf(L"      pace, and show the replay's timings with the driver's counters over the run\n");
         return 1;
     }
 
+    // Compiling an image does not need the driver
+    if (wcscmp(argv[1], L"-b") == 0) {
+        if (argc < 4) {
+            wprintf(L"Usage: %s -b <rules_file|-> <image_file>\n", argv[0]);
+            return 1;
+        }
+        return BuildRuleImage(argv[2], argv[3]);
+    }
+
+    if (wcscmp(argv[1], L"-n") == 0) {
+        if (argc < 5) {
+            wprintf(L"Usage: %s -n <cleanup|rotate|mass> <count> <trace_file>\n", argv[0]);
+            return 1;
+        }
+        return GenerateTrace(argv[2], wcstoul(argv[3], NULL, 0), argv[4]);
+    }
+
+    // A replay without the driver measures the file system alone, for comparison
+    if (wcscmp(argv[1], L"-l") == 0) {
+        if (argc < 4) {
+            wprintf(L"Usage: %s -l <trace_file> <directory> [paced]\n", argv[0]);
+            return 1;
+        }
+        return RunReplay(argv[2], argv[3], argc > 4 && _wcsicmp(argv[4], L"paced") == 0);
+    }
+
     HANDLE hDevice = CreateFileW(DEVICE_NAME, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
     if (hDevice == INVALID_HANDLE_VALUE) {
         wprintf(L"Failed to open device: %d\n", GetLastError());
         return 1;
     }
 
+    if (showStats) {
+        DECISION_CACHE_STATS stats;
+        DWORD bytesReturned;
+        BOOL success = DeviceIoControl(hDevice, IOCTL_GET_CACHE_STATS, NULL, 0, &stats, sizeof(stats), &bytesReturned, NULL);
+        if (success) {
+            ULONG64 total = stats.Hits + stats.Misses;
+            wprintf(L"Decision cache: %llu hits, %llu misses (%.1f%% hit rate)\n",
+                stats.Hits, stats.Misses, total ? 100.0 * stats.Hits / total : 0.0);
+            wprintf(L"Volumes without rules: %llu operations passed through\n", stats.VolumeSkips);
+        }
+        else {
+            wprintf(L"Failed to read cache stats: %d\n", GetLastError());
+        }
+
+        PATH_FILTER_STATS filter;
+        if (success) {
+            success = DeviceIoControl(hDevice, IOCTL_GET_FILTER_STATS, NULL, 0, &filter, sizeof(filter), &bytesReturned, NULL);
+            if (success) {
+                ULONG64 negatives = filter.Rejected + filter.FalsePositives;
+                wprintf(L"Prefilter: %llu rejected, %llu passed, %llu false positives (%.3f%% FPR)\n",
+                    filter.Rejected, filter.Admitted, filter.FalsePositives,
+                    negatives ? 100.0 * filter.FalsePositives / negatives : 0.0);
+                wprintf(L"Prefilter: %lu keys (sized for %lu), %llu bytes\n",
+                    filter.KeyCount, filter.Capacity, filter.MemoryBytes);
+            }
+            else {
+                wprintf(L"Failed to read prefilter stats: %d\n", GetLastError());
+            }
+        }
+
+        MESSAGE_QUEUE_STATS queue;
+        if (success) {
+            success = DeviceIoControl(hDevice, IOCTL_GET_QUEUE_STATS, NULL, 0, &queue, sizeof(queue), &bytesReturned, NULL);
+            if (success) {
+                wprintf(L"Message queue: %lu bytes, drops %s, %lu bytes pending, %llu messages dropped\n",
+                    queue.Size, queue.Policy < _countof(PolicyNames) ? PolicyNames[queue.Policy] : L"?",
+                    queue.UsedBytes, queue.Dropped);
+                if (queue.MappedSize) {
+                    wprintf(L"Message queue: consumer reads a mapped ring of %lu bytes\n", queue.MappedSize);
+                }
+            }
+            else {
+                wprintf(L"Failed to read message queue stats: %d\n", GetLastError());
+            }
+        }
+        CloseHandle(hDevice);
+        return success ? 0 : 1;
+    }
+
+    if (showMemory) {
+        MEMORY_STATS memory;
+        DWORD bytesReturned;
+        BOOL success = DeviceIoControl(hDevice, IOCTL_GET_MEMORY_STATS, NULL, 0, &memory, sizeof(memory), &bytesReturned, NULL);
+        if (success) {
+            ULONG64 total = 0;
+            wprintf(L"%-16s %-4s %12s %14s %14s\n", L"Part", L"Tag", L"Objects", L"Bytes", L"Used bytes");
+            for (ULONG i = 0; i < _countof(MemoryParts); i++) {
+                const MEMORY_USAGE* usage = &memory.Parts[i];
+                char tag[5] = { 0 };
+                memcpy(tag, &usage->Tag, sizeof(usage->Tag));
+                wprintf(L"%-16s %-4hs %12llu %14llu %14llu\n", MemoryParts[i], tag, usage->Count, usage->Bytes, usage->UsedBytes);
+                total += usage->Bytes;
+            }
+            wprintf(L"%-16s %-4s %12s %14llu\n", L"Total", L"", L"", total);
+        }
+        else {
+            wprintf(L"Failed to read memory stats: %d\n", GetLastError());
+        }
+        CloseHandle(hDevice);
+        return success ? 0 : 1;
+    }
+
+    if (showPerf) {
+        PERF_STATS before;
+        PERF_STATS after;
+        LARGE_INTEGER frequency;
+        LARGE_INTEGER start;
+        LARGE_INTEGER end;
+        DWORD bytesReturned;
+        DWORD milliseconds = 1000;
+        BOOL json = FALSE;
+
+        for (int i = 2; i < argc; i++) {
+            if (_wcsicmp(argv[i], L"json") == 0) {
+                json = TRUE;
+            }
+            else {
+                milliseconds = (DWORD)(wcstod(argv[i], NULL) * 1000);
+            }
+        }
+
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&start);
+        BOOL success = DeviceIoControl(hDevice, IOCTL_GET_STATS, NULL, 0, &before, sizeof(before), &bytesReturned, NULL);
+        if (success) {
+            Sleep(milliseconds ? milliseconds : 1);
+            QueryPerformanceCounter(&end);
+            success = DeviceIoControl(hDevice, IOCTL_GET_STATS, NULL, 0, &after, sizeof(after), &bytesReturned, NULL);
+        }
+        if (success) {
+            double seconds = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+            if (json) {
+                PrintPerfStatsJson(&before, &after, seconds);
+            }
+            else {
+                PrintPerfStats(&before, &after, seconds);
+            }
+        }
+        else {
+            wprintf(L"Failed to read performance stats: %d\n", GetLastError());
+        }
+        CloseHandle(hDevice);
+        return success ? 0 : 1;
+    }
+
+    if (wcscmp(argv[1], L"-q") == 0) {
+        MESSAGE_QUEUE_STATS current;
+        MESSAGE_QUEUE_CONFIG config;
+        DWORD bytesReturned;
+        BOOL success = DeviceIoControl(hDevice, IOCTL_GET_QUEUE_STATS, NULL, 0, &current, sizeof(current), &bytesReturned, NULL);
+
+        // Without a policy argument the current one is kept
+        config.Size = wcstoul(argv[2], NULL, 0);
+        config.Policy = success ? current.Policy : 0;
+        if (argc > 3) {
+            config.Policy = _countof(PolicyNames);
+            for (ULONG i = 0; i < _countof(PolicyNames); i++) {
+                if (_wcsicmp(argv[3], PolicyNames[i]) == 0) {
+                    config.Policy = i;
+                }
+            }
+            if (config.Policy == _countof(PolicyNames)) {
+                wprintf(L"Unknown overflow policy: %s\n", argv[3]);
+                CloseHandle(hDevice);
+                return 1;
+            }
+        }
+
+        success = DeviceIoControl(hDevice, IOCTL_SET_QUEUE_CONFIG, &config, sizeof(config), NULL, 0, &bytesReturned, NULL);
+        if (success) {
+            wprintf(L"Message queue configured, drops %s; sizes round down to a power of two\n", PolicyNames[config.Policy]);
+        }
+        else {
+            wprintf(L"Failed to configure the message queue: %d\n", GetLastError());
+        }
+        CloseHandle(hDevice);
+        return success ? 0 : 1;
+    }
+
+    if (wcscmp(argv[1], L"-f") == 0) {
+        int result = LoadRuleFile(hDevice, argv[2]);
+        CloseHandle(hDevice);
+        return result;
+    }
+
+    if (wcscmp(argv[1], L"-g") == 0) {
+        DWORD size;
+        wchar_t* patterns = ReadPatternFile(argv[2], &size);
+        if (!patterns) {
+            CloseHandle(hDevice);
+            return 1;
+        }
+
+        DWORD bytesReturned;
+        BOOL success = DeviceIoControl(hDevice, IOCTL_SET_PATTERN_RULES, patterns, size, NULL, 0, &bytesReturned, NULL);
+        if (success) {
+            wprintf(L"Installed wildcard rules from %s\n", argv[2]);
+        }
+        else {
+            wprintf(L"Failed to install wildcard rules from %s: %d\n", argv[2], GetLastError());
+        }
+        free(patterns);
+        CloseHandle(hDevice);
+        return success ? 0 : 1;
+    }
+
     BOOL protect = FALSE;
     DWORD ioCode;
     if (wcscmp(argv[1], L"-a") == 0) {
@@ -66,14 +957,24 @@ int wmain(int argc, wchar_t* argv[]) {
     }
 
     WCHAR filePath[1024];
+    WCHAR suffix[2 + 2 * RULE_OP_COUNT];
+    LONG operations = SplitOperations(argv[2]);
 
     if (!ConvertWin32ToNtPath(argv[2], filePath, MAX_PATH)) {
         wprintf(L"Failed to convert path: %s\n", argv[2]);
         return 1;
     }
 
+    // The driver reads the rule's operations from a suffix, ":D" for a plain -p
+    if (!operations) {
+        operations = RULE_DEFAULT;
+    }
     if (protect) {
-        wcscat_s(filePath, 1024, L":p"); // Append ":p" to indicate protection
+        operations = DenyOperations(operations);
+    }
+    if (ioCode == IOCTL_ADD_TRACKED_FILE) {
+        FormatOperations(operations, suffix, _countof(suffix));
+        wcscat_s(filePath, 1024, suffix);
     }
 
     DWORD bytesReturned;
@@ -0,0 +1,309 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ruleCompiler.h"
+
+
+// Average names per bucket; larger buckets make the image smaller and the pilots harder to find
+#define BUCKET_LOAD 4
+
+// One spare slot per this many names, so the last buckets still find free slots quickly
+#define SLOT_SLACK 100
+
+// Pilots tried for one bucket before the compiler gives up on the seed
+#define MAX_PILOT (1u << 20)
+
+// Seeds tried before the compiler gives up; a second one is rarely needed
+#define MAX_ATTEMPTS 32
+
+#define ALIGN_SECTION(n) (((n) + 7) & ~(ULONG64)7)
+
+typedef struct _KEY {
+    ULONG64 Hash;            // RuleImageHash of the upcased path
+    ULONG Rule;              // Index of the rule, so the first of two equal paths is the one kept
+    ULONG Offset;            // Offset of the upcased path in the folded pool
+    USHORT Length;
+    USHORT Flags;
+} KEY, *PKEY;
+
+static int
+CompareKeys(const void* Left, const void* Right)
+{
+    const KEY* left = Left;
+    const KEY* right = Right;
+    if (left->Hash != right->Hash) return left->Hash < right->Hash ? -1 : 1;
+    return left->Rule < right->Rule ? -1 : left->Rule > right->Rule;
+}
+
+static BOOL
+SamePath(const UCHAR* Pool, const KEY* Left, const KEY* Right)
+{
+    return Left->Length == Right->Length && memcmp(Pool + Left->Offset, Pool + Right->Offset, Left->Length) == 0;
+}
+
+// Sorts the keys by hash and keeps the first rule of each path. Returns the number of keys kept.
+static ULONG
+DropDuplicates(PKEY Keys, ULONG Count, const UCHAR* Pool)
+{
+    ULONG kept = 0;
+
+    qsort(Keys, Count, sizeof(KEY), CompareKeys);
+    for (ULONG i = 0; i < Count; i++) {
+        // Equal paths have equal hashes, so only the kept keys of the same hash need a compare
+        BOOL duplicate = FALSE;
+        for (ULONG j = kept; j > 0 && Keys[j - 1].Hash == Keys[i].Hash && !duplicate; j--) {
+            duplicate = SamePath(Pool, &Keys[j - 1], &Keys[i]);
+        }
+        if (!duplicate) {
+            Keys[kept++] = Keys[i];
+        }
+    }
+    return kept;
+}
+
+// Places every name with the hashes of Seed. Fills Pilots and the slot of each key, or returns FALSE if some
+// bucket cannot be placed, including when two names have the same hash.
+static BOOL
+PlaceNames(PKEY Keys, ULONG Count, ULONG BucketCount, ULONG SlotCount, ULONG* Pilots, ULONG* Slots)
+{
+    ULONG* starts = calloc((size_t)BucketCount + 1, sizeof(ULONG));
+    ULONG* members = malloc((size_t)Count * sizeof(ULONG));
+    ULONG* order = malloc((size_t)BucketCount * sizeof(ULONG));
+    UCHAR* taken = calloc(SlotCount, 1);
+    ULONG maxSize = 0;
+    BOOL placed = starts && members && order && taken;
+
+    // Group the keys by bucket
+    for (ULONG i = 0; placed && i < Count; i++) {
+        starts[RuleImageBucket(Keys[i].Hash, BucketCount) + 1]++;
+    }
+    for (ULONG b = 0; placed && b < BucketCount; b++) {
+        maxSize = max(maxSize, starts[b + 1]);
+        starts[b + 1] += starts[b];
+    }
+    for (ULONG i = 0; placed && i < Count; i++) {
+        ULONG bucket = RuleImageBucket(Keys[i].Hash, BucketCount);
+        members[starts[bucket]++] = i;
+    }
+    for (ULONG b = BucketCount; placed && b > 0; b--) {
+        starts[b] = starts[b - 1];
+    }
+    if (placed) starts[0] = 0;
+
+    // Largest buckets first, while most slots are still free
+    ULONG ordered = 0;
+    for (ULONG size = maxSize; placed && size > 0; size--) {
+        for (ULONG b = 0; b < BucketCount; b++) {
+            if (starts[b + 1] - starts[b] == size) {
+                order[ordered++] = b;
+            }
+        }
+    }
+
+    for (ULONG o = 0; placed && o < ordered; o++) {
+        ULONG bucket = order[o];
+        const ULONG* bucketKeys = members + starts[bucket];
+        ULONG size = starts[bucket + 1] - starts[bucket];
+
+        // Names with the same hash land on the same slot whatever the pilot
+        for (ULONG i = 0; placed && i < size; i++) {
+            for (ULONG j = 0; j < i; j++) {
+                if (Keys[bucketKeys[i]].Hash == Keys[bucketKeys[j]].Hash) {
+                    placed = FALSE;
+                }
+            }
+        }
+
+        ULONG pilot = 0;
+        for (; placed && pilot < MAX_PILOT; pilot++) {
+            ULONG i = 0;
+            for (; i < size; i++) {
+                ULONG slot = RuleImageSlot(Keys[bucketKeys[i]].Hash, pilot, SlotCount);
+                if (taken[slot]) break;
+                taken[slot] = 1;
+                Slots[bucketKeys[i]] = slot;
+            }
+            if (i == size) break;
+
+            // Release the slots this pilot took before the clash
+            while (i > 0) {
+                taken[Slots[bucketKeys[--i]]] = 0;
+            }
+        }
+        Pilots[bucket] = pilot;
+        placed = placed && pilot < MAX_PILOT;
+    }
+
+    free(starts);
+    free(members);
+    free(order);
+    free(taken);
+    return placed;
+}
+
+// Lays the image out from the placed names and the directory rules
+static BOOL
+WriteImage(const KEY* Names, ULONG NameCount, const KEY* Directories, ULONG DirectoryCount, const UCHAR* Pool,
+    ULONG64 Seed, ULONG BucketCount, ULONG SlotCount, const ULONG* Pilots, const ULONG* Slots, PRULE_IMAGE_BUILD Build)
+{
+    ULONG64 stringsSize = 0;
+    for (ULONG i = 0; i < NameCount; i++) stringsSize += Names[i].Length;
+    for (ULONG i = 0; i < DirectoryCount; i++) stringsSize += Directories[i].Length;
+
+    ULONG64 pilotsOffset = ALIGN_SECTION(sizeof(RULE_IMAGE_HEADER));
+    ULONG64 remapOffset = ALIGN_SECTION(pilotsOffset + (ULONG64)BucketCount * sizeof(ULONG));
+    ULONG64 namesOffset = ALIGN_SECTION(remapOffset + (ULONG64)(SlotCount - NameCount) * sizeof(ULONG));
+    ULONG64 directoriesOffset = ALIGN_SECTION(namesOffset + (ULONG64)NameCount * sizeof(RULE_IMAGE_ENTRY));
+    ULONG64 stringsOffset = ALIGN_SECTION(directoriesOffset + (ULONG64)DirectoryCount * sizeof(RULE_IMAGE_ENTRY));
+    ULONG64 imageSize = ALIGN_SECTION(stringsOffset + stringsSize);
+    if (imageSize > RULE_IMAGE_MAX_SIZE) {
+        return FALSE;
+    }
+
+    UCHAR* image = calloc((size_t)imageSize, 1);
+    if (!image) {
+        return FALSE;
+    }
+
+    RULE_IMAGE_HEADER* header = (RULE_IMAGE_HEADER*)image;
+    header->Magic = RULE_IMAGE_MAGIC;
+    header->Version = RULE_IMAGE_VERSION;
+    header->HeaderSize = sizeof(RULE_IMAGE_HEADER);
+    header->ImageSize = (ULONG)imageSize;
+    header->Seed = Seed;
+    header->NameCount = NameCount;
+    header->BucketCount = BucketCount;
+    header->SlotCount = SlotCount;
+    header->DirectoryCount = DirectoryCount;
+    header->PilotsOffset = (ULONG)pilotsOffset;
+    header->RemapOffset = (ULONG)remapOffset;
+    header->NamesOffset = (ULONG)namesOffset;
+    header->DirectoriesOffset = (ULONG)directoriesOffset;
+    header->StringsOffset = (ULONG)stringsOffset;
+    header->StringsSize = (ULONG)stringsSize;
+    memcpy(image + pilotsOffset, Pilots, (size_t)BucketCount * sizeof(ULONG));
+
+    // Slots past NameCount move to the slots below it that no name took
+    ULONG* remap = (ULONG*)(image + remapOffset);
+    ULONG freeSlot = 0;
+    UCHAR* taken = calloc((size_t)SlotCount + 1, 1);
+    if (!taken) {
+        free(image);
+        return FALSE;
+    }
+    for (ULONG i = 0; i < NameCount; i++) taken[Slots[i]] = 1;
+    for (ULONG slot = NameCount; slot < SlotCount; slot++) {
+        if (taken[slot]) {
+            while (taken[freeSlot]) freeSlot++;
+            remap[slot - NameCount] = freeSlot++;
+        }
+    }
+    free(taken);
+
+    RULE_IMAGE_ENTRY* names = (RULE_IMAGE_ENTRY*)(image + namesOffset);
+    RULE_IMAGE_ENTRY* directories = (RULE_IMAGE_ENTRY*)(image + directoriesOffset);
+    ULONG used = 0;
+    for (ULONG i = 0; i < NameCount; i++) {
+        RULE_IMAGE_ENTRY* entry = &names[Slots[i] < NameCount ? Slots[i] : remap[Slots[i] - NameCount]];
+        entry->StringOffset = used;
+        entry->Length = Names[i].Length;
+        entry->Flags = Names[i].Flags;
+        memcpy(image + stringsOffset + used, Pool + Names[i].Offset, Names[i].Length);
+        used += Names[i].Length;
+    }
+    for (ULONG i = 0; i < DirectoryCount; i++) {
+        directories[i].StringOffset = used;
+        directories[i].Length = Directories[i].Length;
+        directories[i].Flags = Directories[i].Flags;
+        memcpy(image + stringsOffset + used, Pool + Directories[i].Offset, Directories[i].Length);
+        used += Directories[i].Length;
+    }
+
+    Build->Image = image;
+    Build->ImageSize = (ULONG)imageSize;
+    return TRUE;
+}
+
+BOOL
+CompileRuleImage(const RULE_IMAGE_RULE* Rules, ULONG Count, RULE_IMAGE_FOLD Fold, PRULE_IMAGE_BUILD Build)
+{
+    ULONG64 poolSize = 0;
+    memset(Build, 0, sizeof(RULE_IMAGE_BUILD));
+    for (ULONG i = 0; i < Count; i++) {
+        if (Rules[i].Length == 0 || Rules[i].Length % sizeof(WCHAR) != 0) {
+            return FALSE;
+        }
+        poolSize += Rules[i].Length;
+    }
+    if (poolSize > RULE_IMAGE_MAX_SIZE) {
+        return FALSE;
+    }
+
+    UCHAR* pool = malloc((size_t)poolSize + 1);
+    PKEY names = malloc(((size_t)Count + 1) * sizeof(KEY));
+    PKEY directories = malloc(((size_t)Count + 1) * sizeof(KEY));
+    ULONG nameCount = 0;
+    ULONG directoryCount = 0;
+    ULONG* pilots = NULL;
+    ULONG* slots = NULL;
+    BOOL success = pool && names && directories;
+
+    // Upcase every path once; the image stores and hashes the upcased form
+    ULONG offset = 0;
+    for (ULONG i = 0; success && i < Count; i++) {
+        WCHAR* folded = (WCHAR*)(pool + offset);
+        USHORT chars = Rules[i].Length / sizeof(WCHAR);
+        for (USHORT c = 0; c < chars; c++) {
+            folded[c] = Fold(Rules[i].Path[c]);
+        }
+
+        BOOL directory = folded[chars - 1] == L'\\';
+        PKEY key = directory ? &directories[directoryCount++] : &names[nameCount++];
+        key->Hash = RuleImageHash(folded, Rules[i].Length, 0, NULL);
+        key->Rule = i;
+        key->Offset = offset;
+        key->Length = Rules[i].Length;
+        key->Flags = Rules[i].Flags;
+        offset += Rules[i].Length;
+    }
+
+    if (success) {
+        ULONG total = nameCount + directoryCount;
+        nameCount = DropDuplicates(names, nameCount, pool);
+        directoryCount = DropDuplicates(directories, directoryCount, pool);
+        Build->Duplicates = total - nameCount - directoryCount;
+    }
+
+    ULONG bucketCount = nameCount ? (nameCount + BUCKET_LOAD - 1) / BUCKET_LOAD : 0;
+    ULONG slotCount = nameCount + nameCount / SLOT_SLACK;
+    if (success) {
+        pilots = malloc(((size_t)bucketCount + 1) * sizeof(ULONG));
+        slots = malloc(((size_t)nameCount + 1) * sizeof(ULONG));
+        success = pilots && slots;
+    }
+
+    // A seed fails only when some bucket finds no pilot; the next one hashes every name differently
+    ULONG64 seed = 0;
+    BOOL placed = nameCount == 0;
+    for (ULONG attempt = 0; success && !placed && attempt < MAX_ATTEMPTS; attempt++) {
+        seed = 0x9e3779b97f4a7c15ull * (attempt + 1);
+        for (ULONG i = 0; i < nameCount; i++) {
+            names[i].Hash = RuleImageHash((const WCHAR*)(pool + names[i].Offset), names[i].Length, seed, NULL);
+        }
+        placed = PlaceNames(names, nameCount, bucketCount, slotCount, pilots, slots);
+        Build->Attempts = attempt + 1;
+    }
+
+    success = success && placed
+        && WriteImage(names, nameCount, directories, directoryCount, pool, seed, bucketCount, slotCount, pilots, slots, Build);
+    if (success) {
+        Build->NameCount = nameCount;
+        Build->DirectoryCount = directoryCount;
+    }
+
+    free(pool);
+    free(names);
+    free(directories);
+    free(pilots);
+    free(slots);
+    return success;
+}
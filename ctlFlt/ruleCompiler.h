@@ -0,0 +1,47 @@
+/**
+ * @file ruleCompiler.h
+ * @brief Compiles a ruleset into an image the driver loads at startup (see kernel/ruleImage.h).
+ *
+ * Portable C over the standard library, so the compiler can be built and measured on any host.
+ */
+
+#pragma once
+#include "../kernel/ruleImage.h"
+
+/**
+ * @struct _RULE_IMAGE_RULE
+ * @brief One rule to compile.
+ */
+typedef struct _RULE_IMAGE_RULE {
+    const WCHAR* Path;       ///< NT path of the file, or of the directory if it ends in a backslash; any case.
+    USHORT Length;           ///< Bytes in Path, not 0.
+    USHORT Flags;            ///< RULE_IMAGE_PROTECTED, RULE_IMAGE_OPERATIONS and its mask, or 0.
+} RULE_IMAGE_RULE, *PRULE_IMAGE_RULE;
+
+/**
+ * @struct _RULE_IMAGE_BUILD
+ * @brief What a compilation produced.
+ */
+typedef struct _RULE_IMAGE_BUILD {
+    VOID* Image;             ///< The image, allocated with malloc; the caller frees it.
+    ULONG ImageSize;         ///< Bytes in Image.
+    ULONG NameCount;         ///< File names in the image.
+    ULONG DirectoryCount;    ///< Directory rules in the image.
+    ULONG Duplicates;        ///< Rules dropped because an earlier rule had the same path, in any case.
+    ULONG Attempts;          ///< Seeds tried until every bucket could be placed.
+} RULE_IMAGE_BUILD, *PRULE_IMAGE_BUILD;
+
+/**
+ * @brief Compiles rules into an image.
+ *
+ * Upcases the paths with Fold, drops the rules whose path an earlier rule already has, and builds a minimal
+ * perfect hash over the file names. The result only depends on the rules and their order.
+ *
+ * @param[in] Rules Array of Count rules; only read during the call.
+ * @param[in] Count Number of rules.
+ * @param[in] Fold Upcases one character; it must agree with the driver's RtlUpcaseUnicodeChar.
+ * @param[out] Build Receives the image and its counts.
+ * @return BOOL TRUE on success; FALSE if a path is empty, memory ran out, or the rules do not fit in
+ *         RULE_IMAGE_MAX_SIZE bytes.
+ */
+BOOL CompileRuleImage(const RULE_IMAGE_RULE* Rules, ULONG Count, RULE_IMAGE_FOLD Fold, PRULE_IMAGE_BUILD Build);
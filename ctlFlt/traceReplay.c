@@ -0,0 +1,308 @@
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "traceReplay.h"
+#include "../kernel/ruleOps.h"
+
+
+// Longest path a replay builds, in characters; "\\?\" paths may be this long
+#define REPLAY_PATH_CHARS 32768
+
+// Process the synthetic records are attributed to
+#define GENERATED_PROCESS_ID 4242
+
+// Generations a rotated log keeps, app.log.1 to app.log.ROTATE_GENERATIONS
+#define ROTATE_GENERATIONS 5
+
+// Services whose logs rotate in turn
+#define ROTATE_SERVICES 8
+
+// Object files per directory of a build tree
+#define CLEANUP_FILES_PER_DIRECTORY 40
+
+// Writes one record; returns FALSE if the file could not take it
+static BOOL WriteRecord(FILE* file, LONG64 time, UCHAR operation, const wchar_t* process, const wchar_t* path) {
+    FILE_TRACE_RECORD record;
+
+    record.Time = time;
+    record.ProcessId = GENERATED_PROCESS_ID;
+    record.Operation = operation;
+    record.Flags = 0;
+    record.ProcessNameLength = (USHORT)(wcslen(process) * sizeof(WCHAR));
+    record.PathLength = (USHORT)(wcslen(path) * sizeof(WCHAR));
+    return fwrite(&record, FIELD_OFFSET(FILE_TRACE_RECORD, Names), 1, file) == 1
+        && fwrite(process, 1, record.ProcessNameLength, file) == record.ProcessNameLength
+        && fwrite(path, 1, record.PathLength, file) == record.PathLength;
+}
+
+int GenerateTrace(const wchar_t* scenario, ULONG count, const wchar_t* fileName) {
+    static const wchar_t* scenarios[] = { L"cleanup", L"rotate", L"mass" };
+    ULONG kind = 0;
+    while (kind < _countof(scenarios) && _wcsicmp(scenario, scenarios[kind]) != 0) {
+        kind++;
+    }
+    if (kind == _countof(scenarios)) {
+        wprintf(L"Unknown scenario: %s (cleanup, rotate or mass)\n", scenario);
+        return 1;
+    }
+
+    FILE* file;
+    if (_wfopen_s(&file, fileName, L"wb") != 0) {
+        wprintf(L"Failed to create %s\n", fileName);
+        return 1;
+    }
+
+    FILE_TRACE_HEADER header = { FILE_TRACE_MAGIC, FILE_TRACE_VERSION };
+    BOOL success = fwrite(&header, sizeof(header), 1, file) == 1;
+    wchar_t path[MAX_PATH];
+    LONG64 time = 0;
+
+    for (ULONG i = 0; success && i < count; i++) {
+        switch (kind) {
+        case 0:
+            // A build tool deletes its outputs directory by directory, 50us apart
+            swprintf_s(path, _countof(path), L"\\Device\\HarddiskVolume1\\Replay\\build\\obj\\module%04lu\\unit%05lu.obj",
+                i / CLEANUP_FILES_PER_DIRECTORY, i);
+            time += 500;
+            success = WriteRecord(file, time, RULE_OP_DELETE, L"\\Device\\HarddiskVolume1\\Tools\\msbuild.exe", path);
+            break;
+
+        case 1: {
+            // Every 100ms a service drops its oldest log, shifts the others up and starts the live one over
+            ULONG step = i % (ROTATE_GENERATIONS + 2);
+            ULONG service = i / (ROTATE_GENERATIONS + 2) % ROTATE_SERVICES;
+            UCHAR operation = RULE_OP_RENAME;
+            int length = swprintf_s(path, _countof(path), L"\\Device\\HarddiskVolume1\\Replay\\logs\\service%lu\\app.log",
+                service);
+            if (step == 0) {
+                swprintf_s(path + length, _countof(path) - length, L".%d", ROTATE_GENERATIONS);
+                operation = RULE_OP_DELETE;
+                time += 1000000;
+            }
+            else if (step <= ROTATE_GENERATIONS) {
+                // app.log.4 to app.log.1, then app.log itself
+                if (step < ROTATE_GENERATIONS) {
+                    swprintf_s(path + length, _countof(path) - length, L".%lu", ROTATE_GENERATIONS - step);
+                }
+                time += 100;
+            }
+            else {
+                operation = RULE_OP_OVERWRITE;
+                time += 100;
+            }
+            success = WriteRecord(file, time, operation, L"\\Device\\HarddiskVolume1\\Services\\logrotate.exe", path);
+            break;
+        }
+
+        default:
+            // A recursive delete of one large flat directory
+            swprintf_s(path, _countof(path), L"\\Device\\HarddiskVolume1\\Replay\\mass\\item%07lu.dat", i);
+            time += 50;
+            success = WriteRecord(file, time, RULE_OP_DELETE, L"\\Device\\HarddiskVolume1\\Windows\\System32\\cmd.exe", path);
+            break;
+        }
+    }
+
+    if (fclose(file) != 0 || !success) {
+        wprintf(L"Failed to write %s\n", fileName);
+        return 1;
+    }
+    wprintf(L"Wrote %lu %s records to %s\n", count, scenarios[kind], fileName);
+    return 0;
+}
+
+// Reads a whole trace and checks its header; returns NULL after printing the error
+static UCHAR* ReadTrace(const wchar_t* fileName, ULONG* size) {
+    FILE* file;
+    if (_wfopen_s(&file, fileName, L"rb") != 0) {
+        wprintf(L"Failed to open %s\n", fileName);
+        return NULL;
+    }
+
+    UCHAR* trace = NULL;
+    long length = -1;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        length = ftell(file);
+    }
+    if (length >= (long)sizeof(FILE_TRACE_HEADER) && fseek(file, 0, SEEK_SET) == 0) {
+        trace = malloc(length);
+    }
+    if (!trace || fread(trace, 1, length, file) != (size_t)length) {
+        wprintf(L"Failed to read %s\n", fileName);
+        free(trace);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+
+    PFILE_TRACE_HEADER header = (PFILE_TRACE_HEADER)trace;
+    if (header->Magic != FILE_TRACE_MAGIC || header->Version != FILE_TRACE_VERSION) {
+        wprintf(L"%s is not a trace of version %d\n", fileName, FILE_TRACE_VERSION);
+        free(trace);
+        return NULL;
+    }
+    *size = (ULONG)length;
+    return trace;
+}
+
+// Creates the directories of a path that do not exist yet, remembering the last one created so the files of one
+// directory cost a single comparison. The path starts with the replay root, which exists.
+static void CreateParents(wchar_t* path, size_t rootLength, wchar_t* lastParent) {
+    wchar_t* end = wcsrchr(path, L'\\');
+    if (!end || (size_t)(end - path) <= rootLength) {
+        return;
+    }
+
+    *end = L'\0';
+    if (wcscmp(path, lastParent) != 0) {
+        for (wchar_t* separator = wcschr(path + rootLength + 1, L'\\'); ; separator = wcschr(separator + 1, L'\\')) {
+            if (separator) *separator = L'\0';
+            CreateDirectoryW(path, NULL);
+            if (!separator) break;
+            *separator = L'\\';
+        }
+        wcscpy_s(lastParent, REPLAY_PATH_CHARS, path);
+    }
+    *end = L'\\';
+}
+
+// Performs a recorded operation on a file that exists; returns the error, or ERROR_SUCCESS
+static DWORD ReplayOperation(UCHAR operation, const wchar_t* path, wchar_t* scratch) {
+    HANDLE file;
+
+    switch (operation) {
+    case RULE_OP_DELETE:
+        return DeleteFileW(path) ? ERROR_SUCCESS : GetLastError();
+
+    case RULE_OP_RENAME:
+        swprintf_s(scratch, REPLAY_PATH_CHARS, L"%s~", path);
+        return MoveFileExW(path, scratch, MOVEFILE_REPLACE_EXISTING) ? ERROR_SUCCESS : GetLastError();
+
+    case RULE_OP_OVERWRITE:
+        file = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        break;
+
+    case RULE_OP_DELETE_ON_CLOSE:
+        file = CreateFileW(path, DELETE, FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_DELETE_ON_CLOSE, NULL);
+        break;
+
+    default:
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    if (file == INVALID_HANDLE_VALUE) {
+        return GetLastError();
+    }
+    CloseHandle(file);
+    return ERROR_SUCCESS;
+}
+
+BOOL ReplayTrace(const wchar_t* fileName, const wchar_t* directory, BOOL paced, PTRACE_REPLAY_RESULT result) {
+    ULONG size;
+    UCHAR* trace = ReadTrace(fileName, &size);
+    if (!trace) {
+        return FALSE;
+    }
+
+    wchar_t* path = malloc(3 * REPLAY_PATH_CHARS * sizeof(wchar_t));
+    if (!path) {
+        wprintf(L"Out of memory\n");
+        free(trace);
+        return FALSE;
+    }
+    wchar_t* scratch = path + REPLAY_PATH_CHARS;
+    wchar_t* lastParent = scratch + REPLAY_PATH_CHARS;
+    lastParent[0] = L'\0';
+
+    // Long paths go through "\\?\", which takes the full path as it is
+    wcscpy_s(path, REPLAY_PATH_CHARS, L"\\\\?\\");
+    DWORD rootLength = GetFullPathNameW(directory, REPLAY_PATH_CHARS - 4, path + 4, NULL);
+    if (!rootLength || rootLength >= REPLAY_PATH_CHARS - 4) {
+        wprintf(L"Failed to get full path: %d\n", GetLastError());
+        free(path);
+        free(trace);
+        return FALSE;
+    }
+    rootLength += 4;
+    if (path[rootLength - 1] == L'\\') {
+        path[--rootLength] = L'\0';
+    }
+    CreateDirectoryW(path, NULL);
+
+    LARGE_INTEGER frequency, start, before, middle, after;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+    memset(result, 0, sizeof(*result));
+
+    LONG64 firstTime = 0;
+    LONG64 prepareTicks = 0;
+    LONG64 operationTicks = 0;
+    ULONG offset = sizeof(FILE_TRACE_HEADER);
+    while (offset + FIELD_OFFSET(FILE_TRACE_RECORD, Names) <= size) {
+        PFILE_TRACE_RECORD record = (PFILE_TRACE_RECORD)(trace + offset);
+        ULONG recordSize = FILE_TRACE_RECORD_SIZE(record->ProcessNameLength, record->PathLength);
+        if (recordSize > size - offset) {
+            wprintf(L"Trace ends inside the record at offset %lu\n", offset);
+            break;
+        }
+        offset += recordSize;
+
+        // The volume is the first two components of the NT path, e.g. \Device\HarddiskVolume3
+        const WCHAR* recordPath = record->Names + record->ProcessNameLength / sizeof(WCHAR);
+        ULONG pathChars = record->PathLength / sizeof(WCHAR);
+        ULONG separators = 0;
+        ULONG volumeEnd = 0;
+        while (volumeEnd < pathChars && (recordPath[volumeEnd] != L'\\' || ++separators < 3)) {
+            volumeEnd++;
+        }
+        if (volumeEnd + 1 >= pathChars || rootLength + pathChars - volumeEnd >= REPLAY_PATH_CHARS) {
+            result->Skipped++;
+            continue;
+        }
+        memcpy(path + rootLength, recordPath + volumeEnd, (pathChars - volumeEnd) * sizeof(WCHAR));
+        path[rootLength + pathChars - volumeEnd] = L'\0';
+
+        // Recorded pacing is kept relative to the first record; a replay that falls behind catches up at full speed
+        if (!result->Events) {
+            firstTime = record->Time;
+        }
+        if (paced) {
+            LARGE_INTEGER now;
+            QueryPerformanceCounter(&now);
+            LONG64 dueMs = (record->Time - firstTime) / 10000 - (now.QuadPart - start.QuadPart) * 1000 / frequency.QuadPart;
+            if (dueMs > 0) {
+                Sleep((DWORD)dueMs);
+            }
+        }
+
+        QueryPerformanceCounter(&before);
+        // Opening an existing file as it is keeps the preparation from being an overwrite itself
+        CreateParents(path, rootLength, lastParent);
+        HANDLE file = CreateFileW(path, GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+        QueryPerformanceCounter(&middle);
+        DWORD error = ReplayOperation(record->Operation, path, scratch);
+        QueryPerformanceCounter(&after);
+
+        prepareTicks += middle.QuadPart - before.QuadPart;
+        operationTicks += after.QuadPart - middle.QuadPart;
+        result->Events++;
+        if (error != ERROR_SUCCESS) {
+            result->Failed++;
+            if (error == ERROR_ACCESS_DENIED) {
+                result->Denied++;
+            }
+        }
+    }
+
+    QueryPerformanceCounter(&after);
+    result->Seconds = (double)(after.QuadPart - start.QuadPart) / frequency.QuadPart;
+    result->PrepareSeconds = (double)prepareTicks / frequency.QuadPart;
+    result->OperationSeconds = (double)operationTicks / frequency.QuadPart;
+    free(path);
+    free(trace);
+    return TRUE;
+}
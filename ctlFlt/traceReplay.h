@@ -0,0 +1,52 @@
+/**
+ * @file traceReplay.h
+ * @brief Generates and replays traces of file operations (see watchFlt/fileTrace.h) to put load on the driver.
+ */
+
+#pragma once
+#include <windows.h>
+#include "../watchFlt/fileTrace.h"
+
+/**
+ * @struct _TRACE_REPLAY_RESULT
+ * @brief What a replay did and how long its stages took.
+ */
+typedef struct _TRACE_REPLAY_RESULT {
+    ULONG Events;            ///< Records replayed.
+    ULONG Failed;            ///< Operations that failed, the denied ones included.
+    ULONG Denied;            ///< Operations that failed with ERROR_ACCESS_DENIED, as a protecting rule fails them.
+    ULONG Skipped;           ///< Records whose path names no file below a volume.
+    double Seconds;          ///< Wall time of the whole replay, pacing included.
+    double PrepareSeconds;   ///< Time spent creating the files and directories the operations act on.
+    double OperationSeconds; ///< Time spent in the operations themselves.
+} TRACE_REPLAY_RESULT, *PTRACE_REPLAY_RESULT;
+
+/**
+ * @brief Writes a synthetic trace of a common load pattern.
+ *
+ * "cleanup" deletes a build tree, a few dozen object files per directory; "rotate" rotates the logs of a few
+ * services: the oldest generation is deleted, the others renamed and the live log overwritten; "mass" deletes
+ * a flat directory as fast as a recursive delete does. Paths are on \Device\HarddiskVolume1\Replay.
+ *
+ * @param[in] scenario "cleanup", "rotate" or "mass".
+ * @param[in] count Number of records to write.
+ * @param[in] fileName Trace file to create.
+ * @return int 0 on success, 1 after printing the error.
+ */
+int GenerateTrace(const wchar_t* scenario, ULONG count, const wchar_t* fileName);
+
+/**
+ * @brief Replays a trace below a directory.
+ *
+ * Every record's path has its volume replaced by the directory. The file is created first if it does not exist,
+ * along with its directories, then the recorded operation is performed on it: a deletion, a rename to the same name
+ * with '~' appended, an overwrite, or an open with FILE_FLAG_DELETE_ON_CLOSE. Denied records are replayed like the
+ * others.
+ *
+ * @param[in] fileName Trace to replay.
+ * @param[in] directory Directory to replay below; it should be covered by a rule for the driver to see the load.
+ * @param[in] paced TRUE to keep the recorded time between records, FALSE to replay at full speed.
+ * @param[out] result Receives the counts and timings.
+ * @return BOOL FALSE after printing the error if the trace could not be read.
+ */
+BOOL ReplayTrace(const wchar_t* fileName, const wchar_t* directory, BOOL paced, PTRACE_REPLAY_RESULT result);
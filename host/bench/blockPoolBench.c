@@ -0,0 +1,213 @@
+/**
+ * @file blockPoolBench.c
+ * @brief Memory and time of the tracked-name entries, each one block of the size-classed pool, against the two
+ *        allocations per entry (the entry, then its name) they used to take.
+ *
+ * Three runs: the allocators alone, replacing blocks of entry-like sizes at random; insert and remove churn
+ * through AddTrackedFile and RemoveTrackedFile over a rolling window of names; and 1M resident names loaded with
+ * UpdateTrackedFiles, reporting the pool's counters per name. On the host both allocators end in the C library,
+ * so the times compare call patterns rather than the kernel's lookaside lists. The footprint of the old layout is
+ * computed, counting the 16-byte header and 16-byte rounding of a small nonpaged pool allocation; the new one is
+ * counted the same way, a lookaside block being a pool allocation of its class size.
+ */
+
+#include "hostBench.h"
+#include "fileList.h"
+
+#define PATH_CHARS 96
+#define POOL_HEADER 16
+#define POOL_ROUND(n) (((n) + 15) & ~(SIZE_T)15)
+
+static const char* Folders[] = { "Documents", "Projects\\current\\src", "AppData\\Local\\Cache\\blobs", "Desktop" };
+
+// Tracked names of the kind a ruleset lists, with folder depths that spread them over several classes
+static PCWSTR
+TrackedPath(PWCHAR Buffer, ULONG Index)
+{
+    return HostPath(Buffer, PATH_CHARS, "\\Device\\HarddiskVolume1\\Users\\u%03u\\%s\\file%07u.%s", Index % 300,
+        Folders[(Index / 7) % ARRAYSIZE(Folders)], Index, (Index & 1) ? "docx" : "txt");
+}
+
+// Pool bytes of one entry in the old layout: the entry without its name, then the name as its own allocation
+static SIZE_T
+SplitEntryBytes(SIZE_T NameLength)
+{
+    return POOL_HEADER + POOL_ROUND(FIELD_OFFSET(TRACKED_FILE_ENTRY, Name))
+        + POOL_HEADER + POOL_ROUND(NameLength + sizeof(WCHAR));
+}
+
+// Replaces Slots blocks of entry sizes at random, Operations times, with one block per entry or with two
+static double
+TimeAllocator(ULONG Slots, ULONG Operations, BOOLEAN Split, PULONG Failures)
+{
+    BLOCK_POOL pool;
+    PVOID* entries = calloc(Slots, sizeof(PVOID));
+    PVOID* names = calloc(Slots, sizeof(PVOID));
+    SIZE_T* lengths = calloc(Slots, sizeof(SIZE_T));
+    ULONG64 state = 0x9E3779B97F4A7C15ull;
+
+    BlockPoolInitialize(&pool, 'eFtL');
+    ULONG64 start = HostNow();
+    for (ULONG i = 0; i < Operations; i++) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        ULONG slot = (ULONG)((state >> 33) % Slots);
+        if (entries[slot]) {
+            if (Split) {
+                ExFreePoolWithTag(names[slot], 'nFtL');
+                ExFreePoolWithTag(entries[slot], 'eFtL');
+            }
+            else {
+                BlockPoolFree(&pool, entries[slot], TRACKED_FILE_ENTRY_SIZE(lengths[slot]));
+            }
+        }
+
+        // Names of 60 to 160 characters, as the paths of TrackedPath
+        lengths[slot] = (60 + (state >> 20) % 100) * sizeof(WCHAR);
+        if (Split) {
+            entries[slot] = ExAllocatePool2(POOL_FLAG_NON_PAGED, FIELD_OFFSET(TRACKED_FILE_ENTRY, Name), 'eFtL');
+            names[slot] = ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED,
+                lengths[slot] + sizeof(WCHAR), 'nFtL');
+        }
+        else {
+            entries[slot] = BlockPoolAllocate(&pool, TRACKED_FILE_ENTRY_SIZE(lengths[slot]));
+        }
+        if (!entries[slot] || (Split && !names[slot])) {
+            (*Failures)++;
+            break;
+        }
+    }
+    double ns = (double)(HostNow() - start) / Operations;
+
+    for (ULONG slot = 0; slot < Slots; slot++) {
+        if (Split) {
+            ExFreePool(names[slot]);
+            ExFreePool(entries[slot]);
+        }
+        else if (entries[slot]) {
+            BlockPoolFree(&pool, entries[slot], TRACKED_FILE_ENTRY_SIZE(lengths[slot]));
+        }
+    }
+    BlockPoolDelete(&pool);
+    free(lengths);
+    free(names);
+    free(entries);
+    return ns;
+}
+
+// Keeps Window names tracked while Operations more are added, each add retiring the oldest name
+static int
+RunChurn(ULONG Window, ULONG Operations)
+{
+    TRACKED_FILES files;
+    WCHAR path[PATH_CHARS];
+    ULONG failures = 0;
+    MEMORY_USAGE entries;
+    TRACKED_FILES_MEMORY memory;
+
+    InitializeTrackedFiles(&files);
+    for (ULONG i = 0; i < Window; i++) {
+        failures += !NT_SUCCESS(AddTrackedFile(&files, TrackedPath(path, i), RULE_DEFAULT));
+    }
+
+    ULONG64 start = HostNow();
+    for (ULONG i = Window; i < Window + Operations; i++) {
+        failures += !NT_SUCCESS(RemoveTrackedFile(&files, TrackedPath(path, i - Window)));
+        failures += !NT_SUCCESS(AddTrackedFile(&files, TrackedPath(path, i), RULE_DEFAULT));
+    }
+    double ns = (double)(HostNow() - start) / Operations;
+
+    GetTrackedFilesMemory(&files, &memory);
+    entries = memory.Entries;
+    printf("churn     %8u resident  %8u replaced  %9.1f ns/remove+add  %llu entries  %7.1f KB\n", Window, Operations,
+        ns, (unsigned long long)entries.Count, (double)entries.Bytes / 1024);
+    DeleteTrackedFiles(&files);
+
+    if (failures || entries.Count != Window) {
+        fprintf(stderr, "blockPoolBench: %u failed updates, %llu entries left of %u\n", failures,
+            (unsigned long long)entries.Count, Window);
+        return 1;
+    }
+    return 0;
+}
+
+// Loads Size names at once and reports what their entries hold, then removes them all
+static int
+RunResident(ULONG Size)
+{
+    TRACKED_FILES files;
+    PTRACKED_FILE_UPDATE updates = calloc(Size, sizeof(TRACKED_FILE_UPDATE));
+    PWCHAR names = calloc((SIZE_T)Size, PATH_CHARS * sizeof(WCHAR));
+    TRACKED_FILES_MEMORY memory;
+    ULONG64 splitBytes = 0;
+    ULONG64 pooledBytes = 0;
+    ULONG applied = 0;
+    ULONG removed = 0;
+    ULONG wrong = 0;
+
+    if (!updates || !names || !NT_SUCCESS(InitializeTrackedFiles(&files))) {
+        fprintf(stderr, "blockPoolBench: out of memory\n");
+        return 1;
+    }
+    for (ULONG i = 0; i < Size; i++) {
+        RtlInitUnicodeString(&updates[i].Path, TrackedPath(names + (SIZE_T)i * PATH_CHARS, i));
+        updates[i].Operations = RULE_DEFAULT;
+        splitBytes += SplitEntryBytes(updates[i].Path.Length);
+    }
+
+    ULONG64 start = HostNow();
+    UpdateTrackedFiles(&files, updates, Size, &applied);
+    double loadMs = (double)(HostNow() - start) / 1e6;
+
+    GetTrackedFilesMemory(&files, &memory);
+    pooledBytes = memory.Entries.Bytes + memory.Entries.Count * POOL_HEADER;
+    for (ULONG i = 0; i < Size; i += 997) {
+        wrong += GetTrackedFile(&files, &updates[i].Path) != RULE_DEFAULT;
+    }
+
+    printf("resident  %8u names  load %8.1f ms  blocks %7.1f MB (%5.1f%% rounding)  %6.1f B/name  "
+        "split %6.1f B/name  (%.0f%% saved)\n", applied, loadMs, (double)pooledBytes / (1024 * 1024),
+        100.0 * (double)(memory.Entries.Bytes - memory.Entries.UsedBytes) / (double)max(memory.Entries.Bytes, 1),
+        (double)pooledBytes / max(applied, 1), (double)splitBytes / Size,
+        100.0 * (1.0 - (double)pooledBytes / (double)splitBytes));
+
+    for (ULONG i = 0; i < Size; i++) {
+        updates[i].Remove = TRUE;
+    }
+    start = HostNow();
+    UpdateTrackedFiles(&files, updates, Size, &removed);
+    double unloadMs = (double)(HostNow() - start) / 1e6;
+    GetTrackedFilesMemory(&files, &memory);
+    printf("resident  %8u removed  %8.1f ms  %llu blocks left\n", removed, unloadMs,
+        (unsigned long long)memory.Entries.Count);
+
+    DeleteTrackedFiles(&files);
+    free(names);
+    free(updates);
+    if (wrong || applied != Size || removed != Size || memory.Entries.Count != 0 || memory.Entries.Bytes != 0) {
+        fprintf(stderr, "blockPoolBench: %u wrong lookups, %u loaded and %u removed of %u\n", wrong, applied,
+            removed, Size);
+        return 1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    BOOLEAN quick = HostQuick(argc, argv);
+    ULONG operations = quick ? 20000 : 2000000;
+    ULONG failures = 0;
+    int result = 0;
+
+    double pooledNs = TimeAllocator(10000, operations, FALSE, &failures);
+    double splitNs = TimeAllocator(10000, operations, TRUE, &failures);
+    printf("allocator %8u blocks    pooled %7.1f ns/replace  split %7.1f ns/replace\n", 10000, pooledNs, splitNs);
+    if (failures) {
+        fprintf(stderr, "blockPoolBench: %u allocations failed\n", failures);
+        result = 1;
+    }
+
+    result |= RunChurn(quick ? 1000 : 100000, quick ? 5000 : 500000);
+    result |= RunResident(quick ? 20000 : 1000000);
+    return result;
+}
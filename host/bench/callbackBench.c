@@ -0,0 +1,259 @@
+/**
+ * @file callbackBench.c
+ * @brief Cost per set-information call of the pre- and post-operation callbacks that decide once in pre-op and
+ *        hand the name over, against deciding in both callbacks and querying the name again in post-op as they
+ *        did before.
+ *
+ * Each call is made on a freshly opened handle, as a deletion usually is, to one of three workloads: deletions of
+ * files no rule names, deletions of tracked files, and end-of-file changes to files of which half are tracked. The
+ * rules audit deletions of 20k files. The current path runs PreOperationCallback and, when it asks for it,
+ * PostOperationCallback. The baseline reproduces the callbacks before the change with today's calls: pre-op takes
+ * the verdict of a deletion, post-op takes the verdict of every call, then queries the name of a tracked deletion
+ * and logs it. LogOperation's messages are counted rather than queued, and the baseline's are made through the
+ * same process cache lookup. The name queries per call come from the driver's NAME_QUERY histogram; on the host
+ * a query is a string copy, in the kernel FltGetFileNameInformation costs microseconds. Both paths must log every
+ * tracked deletion exactly once and nothing else.
+ */
+
+#include "hostBench.h"
+#include "callbacks.h"
+#include "decisionCache.h"
+#include "fileList.h"
+#include "perfStats.h"
+#include "processCache.h"
+
+#define PATH_CHARS 96
+#define BATCH 4096
+
+PFLT_FILTER gFilterHandle;
+TRACKED_FILES TrackedFiles;
+
+typedef struct _CALL_SIM {
+    HOST_FILE File;
+    WCHAR Path[PATH_CHARS];
+    FILE_OBJECT FileObject;
+    FLT_IO_PARAMETER_BLOCK Iopb;
+    FLT_CALLBACK_DATA Data;
+    FLT_RELATED_OBJECTS Objects;
+    FILE_DISPOSITION_INFORMATION Disposition;
+    LARGE_INTEGER EndOfFile;
+} CALL_SIM;
+
+typedef struct _WORKLOAD {
+    const char* Name;
+    FILE_INFORMATION_CLASS InfoClass;
+    ULONG TrackedPercent;    // Calls naming one of the rules' files
+} WORKLOAD;
+
+static FLT_INSTANCE Instance;
+static FLT_VOLUME Volume;
+static EPROCESS Process;
+static ULONG64 Logged;
+
+// LogOperation's messages are counted; the queue has benches of its own
+NTSTATUS
+SendToUser(PUNICODE_STRING processName, HANDLE processId, LONG64 processCreateTime, PUNICODE_STRING name,
+    LONG operation, BOOLEAN denied)
+{
+    UNREFERENCED_PARAMETER(processName);
+    UNREFERENCED_PARAMETER(processId);
+    UNREFERENCED_PARAMETER(processCreateTime);
+    UNREFERENCED_PARAMETER(name);
+    UNREFERENCED_PARAMETER(operation);
+    UNREFERENCED_PARAMETER(denied);
+    Logged++;
+    return STATUS_SUCCESS;
+}
+
+static PCWSTR
+FilePath(PWCHAR Buffer, ULONG Index)
+{
+    return HostPath(Buffer, PATH_CHARS, "\\Device\\HarddiskVolume1\\Users\\u%03u\\Documents\\report%07u.docx",
+        Index % 300, Index);
+}
+
+// Opens a handle for the workload's next call; returns TRUE if it names a tracked file
+static BOOLEAN
+OpenCall(CALL_SIM* Sim, const WORKLOAD* Workload, ULONG64* State, ULONG Rules)
+{
+    *State = *State * 6364136223846793005ull + 1442695040888963407ull;
+    BOOLEAN tracked = (ULONG)((*State >> 33) % 100) < Workload->TrackedPercent;
+    ULONG index = (ULONG)((*State >> 7) % Rules) + (tracked ? 0 : Rules);
+
+    RtlZeroMemory(Sim, FIELD_OFFSET(CALL_SIM, Path));
+    RtlZeroMemory(&Sim->FileObject, sizeof(*Sim) - FIELD_OFFSET(CALL_SIM, FileObject));
+    Sim->File.Name = HostString(FilePath(Sim->Path, index));
+    Sim->FileObject.File = &Sim->File;
+    Sim->Iopb.TargetFileObject = &Sim->FileObject;
+    Sim->Iopb.TargetInstance = &Instance;
+    Sim->Iopb.MajorFunction = IRP_MJ_SET_INFORMATION;
+    Sim->Iopb.Parameters.SetFileInformation.FileInformationClass = Workload->InfoClass;
+    if (Workload->InfoClass == FileDispositionInformation) {
+        Sim->Disposition.DeleteFile = TRUE;
+        Sim->Iopb.Parameters.SetFileInformation.Length = sizeof(Sim->Disposition);
+        Sim->Iopb.Parameters.SetFileInformation.InfoBuffer = &Sim->Disposition;
+    }
+    else {
+        Sim->Iopb.Parameters.SetFileInformation.Length = sizeof(Sim->EndOfFile);
+        Sim->Iopb.Parameters.SetFileInformation.InfoBuffer = &Sim->EndOfFile;
+    }
+    Sim->Data.Iopb = &Sim->Iopb;
+    Sim->Objects.Size = sizeof(Sim->Objects);
+    Sim->Objects.Volume = &Volume;
+    Sim->Objects.Instance = &Instance;
+    Sim->Objects.FileObject = &Sim->FileObject;
+    return tracked;
+}
+
+// The callbacks as they are: decided once in pre-op, post-op only when asked for
+static VOID
+Current(CALL_SIM* Sim)
+{
+    PVOID context;
+
+    if (PreOperationCallback(&Sim->Data, &Sim->Objects, &context) == FLT_PREOP_SUCCESS_WITH_CALLBACK) {
+        Sim->Data.IoStatus.Status = STATUS_SUCCESS;
+        PostOperationCallback(&Sim->Data, &Sim->Objects, context, 0);
+    }
+}
+
+static VOID
+BaselineLog(PUNICODE_STRING Name)
+{
+    PEPROCESS process = PsGetCurrentProcess();
+    PPROCESS_NAME_ENTRY processEntry = LookupProcessName(process);
+
+    SendToUser(processEntry ? &processEntry->Name : NULL, PsGetProcessId(process),
+        PsGetProcessCreateTimeQuadPart(process), Name, RULE_OP_DELETE, FALSE);
+    if (processEntry) {
+        ReleaseProcessName(processEntry);
+    }
+}
+
+// The callbacks before the change: a verdict in pre-op for a deletion, another in post-op for every call, then
+// the name again for a tracked deletion. The rules only audit, so pre-op never denies.
+static VOID
+Baseline(CALL_SIM* Sim)
+{
+    BOOLEAN deletion = Sim->Iopb.Parameters.SetFileInformation.FileInformationClass == FileDispositionInformation;
+
+    if (deletion) {
+        GetFileDecision(&Sim->Data, &Sim->Objects, NULL);
+    }
+    Sim->Data.IoStatus.Status = STATUS_SUCCESS;
+    if (!(GetFileDecision(&Sim->Data, &Sim->Objects, NULL) & RULE_OP_BITS(RULE_OP_DELETE)) || !deletion) {
+        return;
+    }
+    PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
+    if (NT_SUCCESS(QueryOpenedName(&Sim->Data, &nameInfo))) {
+        BaselineLog(&nameInfo->Name);
+        FltReleaseFileNameInformation(nameInfo);
+    }
+}
+
+// Runs the batch's calls one way; adds the time taken, the name queries and the messages logged
+static VOID
+RunBatch(CALL_SIM* Sims, BOOLEAN Baselined, PULONG64 Elapsed, PULONG64 Queries, PULONG64 Messages)
+{
+    PERF_STATS before;
+    PERF_STATS after;
+
+    Logged = 0;
+    QueryPerfStats(&before);
+    ULONG64 start = HostNow();
+    for (ULONG i = 0; i < BATCH; i++) {
+        Baselined ? Baseline(&Sims[i]) : Current(&Sims[i]);
+    }
+    *Elapsed += HostNow() - start;
+    QueryPerfStats(&after);
+    *Queries += after.Histograms[PERF_HISTOGRAM_NAME_QUERY].Count - before.Histograms[PERF_HISTOGRAM_NAME_QUERY].Count;
+    *Messages += Logged;
+
+    for (ULONG i = 0; i < BATCH; i++) {
+        HostCloseFileObject(&Sims[i].FileObject);
+    }
+}
+
+static int
+RunWorkload(const WORKLOAD* Workload, ULONG Rules, ULONG Calls, CALL_SIM* Sims)
+{
+    ULONG64 elapsed[2] = { 0 };
+    ULONG64 queries[2] = { 0 };
+    ULONG64 messages[2] = { 0 };
+    ULONG64 expected = 0;
+    ULONG batches = (Calls + BATCH - 1) / BATCH;
+    ULONG64 state = 0x9E3779B97F4A7C15ull;
+
+    for (ULONG b = 0; b < batches; b++) {
+        // The same calls both ways, the current callbacks first
+        ULONG64 batchState = state;
+        for (ULONG pass = 0; pass < 2; pass++) {
+            state = batchState;
+            for (ULONG i = 0; i < BATCH; i++) {
+                BOOLEAN tracked = OpenCall(&Sims[i], Workload, &state, Rules);
+                expected += pass == 0 && tracked && Workload->InfoClass == FileDispositionInformation;
+            }
+            RunBatch(Sims, pass == 1, &elapsed[pass], &queries[pass], &messages[pass]);
+        }
+    }
+
+    double count = (double)batches * BATCH;
+    printf("%-22s decided in pre-op %6.1f ns/call %5.3f queries/call  in both callbacks %6.1f ns/call "
+        "%5.3f queries/call  %5.1f%% logged\n", Workload->Name, elapsed[0] / count, queries[0] / count,
+        elapsed[1] / count, queries[1] / count, 100.0 * messages[0] / count);
+
+    if (messages[0] != expected || messages[1] != expected) {
+        fprintf(stderr, "callbackBench: %s: %llu and %llu calls logged of %llu tracked deletions\n", Workload->Name,
+            (unsigned long long)messages[0], (unsigned long long)messages[1], (unsigned long long)expected);
+        return 1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    BOOLEAN quick = HostQuick(argc, argv);
+    ULONG rules = quick ? 2000 : 20000;
+    ULONG calls = quick ? 20000 : 2000000;
+    CALL_SIM* sims = calloc(BATCH, sizeof(CALL_SIM));
+    static const WORKLOAD workloads[] = {
+        { "untracked deletes", FileDispositionInformation, 0 },
+        { "tracked deletes", FileDispositionInformation, 100 },
+        { "end-of-file changes", FileEndOfFileInformation, 50 },
+    };
+    FLT_RELATED_OBJECTS objects = { sizeof(objects) };
+    WCHAR path[PATH_CHARS];
+    int result = 0;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializePerfStats());
+    CHECK_STATUS(STATUS_SUCCESS, InitializeTrackedFiles(&TrackedFiles));
+    CHECK_STATUS(STATUS_SUCCESS, InitializeProcessCache());
+    CHECK_STATUS(STATUS_SUCCESS, InitializeCallbacks());
+    for (ULONG i = 0; i < rules; i++) {
+        AddTrackedFile(&TrackedFiles, FilePath(path, i), RULE_TRACK(RULE_OP_DELETE));
+    }
+    Volume.Name = HostString(L"\\Device\\HarddiskVolume1");
+    objects.Volume = &Volume;
+    objects.Instance = &Instance;
+    CHECK_STATUS(STATUS_SUCCESS, SetupVolumeDecision(&objects));
+    Process.ProcessId = ULongToHandle(4242);
+    Process.CreateTime = 1;
+    Process.ImageName = HostString(L"\\Device\\HarddiskVolume1\\Tools\\msbuild.exe");
+    HostSetCurrentProcess(&Process);
+
+    printf("%u rules auditing deletions, %u set-information calls per workload on fresh handles\n", rules, calls);
+    for (ULONG i = 0; i < ARRAYSIZE(workloads); i++) {
+        result |= RunWorkload(&workloads[i], rules, calls, sims);
+    }
+
+    HostSetCurrentProcess(NULL);
+    HostExitProcess(&Process);
+    HostTeardownInstance(&Instance);
+    free(sims);
+    CleanupCallbacks();
+    CleanupProcessCache();
+    DeleteTrackedFiles(&TrackedFiles);
+    CleanupPerfStats();
+    return result | HostTestResult();
+}
@@ -0,0 +1,427 @@
+/**
+ * @file codecBench.c
+ * @brief Bytes per event and encode and decode cost of the interned deletion messages on a delete storm: the
+ *        deletions of a trace written by watchFlt -t when one is named on the command line, otherwise a generated
+ *        storm in which a few processes empty a build tree directory by directory. The driver's encoder fills a
+ *        queue that is drained with DequeueBatch and decoded by watchFlt's decoder, first in turns on one thread,
+ *        then with 1 to 8 producer threads encoding while the main thread drains and decodes.
+ *
+ * Every batch is decoded a second time, untimed, with a table of its own, to check each name against the event
+ * it came from.
+ */
+
+#include "hostBench.h"
+#include "eventEncoder.h"
+#include "eventDecoder.h"
+#include "fileTrace.h"
+#include "ruleOps.h"
+
+#define QUEUE_SIZE (4 * 1024 * 1024)
+#define CHUNK_EVENTS 8192
+#define DRAIN_BUFFER_SIZE (1024 * 1024)
+#define MAX_PATH_CHARS 96
+
+typedef struct _STORM_EVENT {
+    UNICODE_STRING ProcessName;
+    UNICODE_STRING Path;
+} STORM_EVENT;
+
+typedef struct _STORM {
+    STORM_EVENT* Events;
+    ULONG Count;
+    PVOID Storage;
+} STORM;
+
+// What the consumer saw
+typedef struct _DECODE_TOTALS {
+    ULONG64 Messages;
+    ULONG64 Bytes;
+    ULONG64 Unknown;
+    ULONG64 Wrong;
+    ULONG64 Nanoseconds;
+} DECODE_TOTALS;
+
+typedef struct _CONSUMER {
+    EVENT_STRING_TABLE Table;
+    EVENT_STRING_TABLE Check;
+    PUCHAR Buffer;
+    DECODE_TOTALS Totals;
+} CONSUMER;
+
+// Keeps the deletions of a trace; returns FALSE if it cannot be read or has none
+static BOOLEAN
+LoadTrace(STORM* Storm, const char* Name)
+{
+    FILE_TRACE_HEADER header;
+    FILE* file = fopen(Name, "rb");
+    if (!file) {
+        return FALSE;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file) - (long)sizeof(header);
+    fseek(file, 0, SEEK_SET);
+    if (size < 0 || fread(&header, sizeof(header), 1, file) != 1 || header.Magic != FILE_TRACE_MAGIC
+        || header.Version != FILE_TRACE_VERSION) {
+        fclose(file);
+        return FALSE;
+    }
+
+    PUCHAR records = malloc(size ? size : 1);
+    BOOLEAN read = fread(records, 1, size, file) == (size_t)size;
+    fclose(file);
+    if (!read) {
+        free(records);
+        return FALSE;
+    }
+
+    ULONG capacity = 1024;
+    Storm->Storage = records;
+    Storm->Events = malloc(capacity * sizeof(STORM_EVENT));
+    for (long offset = 0; offset + (long)FIELD_OFFSET(FILE_TRACE_RECORD, Names) <= size; ) {
+        PFILE_TRACE_RECORD record = (PFILE_TRACE_RECORD)(records + offset);
+        ULONG recordSize = FILE_TRACE_RECORD_SIZE(record->ProcessNameLength, record->PathLength);
+        if (offset + (long)recordSize > size) {
+            break;
+        }
+        offset += recordSize;
+        if (record->Operation != RULE_OP_DELETE && record->Operation != RULE_OP_DELETE_ON_CLOSE) {
+            continue;
+        }
+
+        if (Storm->Count == capacity) {
+            capacity *= 2;
+            Storm->Events = realloc(Storm->Events, capacity * sizeof(STORM_EVENT));
+        }
+        STORM_EVENT* event = &Storm->Events[Storm->Count++];
+        event->ProcessName.Buffer = record->Names;
+        event->ProcessName.Length = event->ProcessName.MaximumLength = record->ProcessNameLength;
+        event->Path.Buffer = record->Names + record->ProcessNameLength / sizeof(WCHAR);
+        event->Path.Length = event->Path.MaximumLength = record->PathLength;
+    }
+    return Storm->Count != 0;
+}
+
+// Three processes take turns emptying a build tree, 500 files per directory, and a service deletes a temporary
+// file now and then
+static VOID
+GenerateStorm(STORM* Storm, ULONG Count)
+{
+    static const char* Processes[] = {
+        "\\Device\\HarddiskVolume3\\Windows\\explorer.exe",
+        "\\Device\\HarddiskVolume3\\Program Files\\Git\\usr\\bin\\rm.exe",
+        "\\Device\\HarddiskVolume3\\Program Files\\Microsoft Visual Studio\\MSBuild\\Current\\Bin\\MSBuild.exe",
+        "\\Device\\HarddiskVolume3\\Windows\\System32\\svchost.exe",
+    };
+
+    PWCHAR names = malloc(((SIZE_T)Count + ARRAYSIZE(Processes)) * MAX_PATH_CHARS * sizeof(WCHAR));
+    PWCHAR paths = names + ARRAYSIZE(Processes) * MAX_PATH_CHARS;
+    Storm->Storage = names;
+    Storm->Events = malloc(Count * sizeof(STORM_EVENT));
+    Storm->Count = Count;
+    for (ULONG i = 0; i < ARRAYSIZE(Processes); i++) {
+        HostPath(names + i * MAX_PATH_CHARS, MAX_PATH_CHARS, "%s", Processes[i]);
+    }
+
+    for (ULONG i = 0; i < Count; i++) {
+        PWCHAR path = paths + (SIZE_T)i * MAX_PATH_CHARS;
+        ULONG process = (i / 50000) % 3;
+        if (i % 97 == 0) {
+            process = 3;
+            HostPath(path, MAX_PATH_CHARS, "\\Device\\HarddiskVolume3\\Windows\\Temp\\tmp%04X.tmp", i & 0xFFFF);
+        }
+        else {
+            HostPath(path, MAX_PATH_CHARS, "\\Device\\HarddiskVolume3\\Projects\\engine\\build\\obj\\module%04u\\unit%03u.obj",
+                i / 500, i % 500);
+        }
+        Storm->Events[i].ProcessName = HostString(names + process * MAX_PATH_CHARS);
+        Storm->Events[i].Path = HostString(path);
+    }
+}
+
+// Queues an event the way SendToUser does; the message id leads back to it
+static BOOLEAN
+EncodeEvent(PEVENT_STRINGS Strings, PCIRCULAR_QUEUE Queue, STORM* Storm, ULONG Index)
+{
+    QUEUE_RESERVATION reservation;
+    STORM_EVENT* event = &Storm->Events[Index];
+    PDELETE_MESSAGE message = ReserveDeleteMessage(Strings, Queue, &event->ProcessName, &event->Path, 0, &reservation);
+    if (!message) {
+        return FALSE;
+    }
+    message->MessageId = Index + 1;
+    message->Flags = 0;
+    message->ProcessId = 4;
+    message->ProcessCreateTime = 0;
+    message->SystemTime = 0;
+    message->InterruptTime = Index;
+    EndEnqueue(Queue, &reservation);
+    return TRUE;
+}
+
+static BOOLEAN
+SameName(const WCHAR* Name, USHORT Length, PCWCH Expected, USHORT ExpectedLength)
+{
+    return Length == ExpectedLength && memcmp(Name, Expected, Length) == 0;
+}
+
+// Decodes a batch without looking at the names, as the timed part
+static VOID
+DecodeBatch(CONSUMER* Consumer, ULONG Count, ULONG Length)
+{
+    DECODED_EVENT event;
+
+    for (ULONG offset = 0, i = 0; i < Count; i++) {
+        PDELETE_MESSAGE message = (PDELETE_MESSAGE)(Consumer->Buffer + offset);
+        offset = (offset + message->Size + QUEUE_BATCH_ALIGNMENT - 1) & ~(QUEUE_BATCH_ALIGNMENT - 1);
+        if (message->MessageId != 0
+            && DecodeDeleteMessage(&Consumer->Table, message, Length - (ULONG)((PUCHAR)message - Consumer->Buffer),
+                &event)) {
+            Consumer->Totals.Messages++;
+            Consumer->Totals.Bytes += message->Size;
+        }
+    }
+}
+
+// Decodes the batch again with the second table, which has seen the same messages, and checks every name
+static VOID
+CheckBatch(CONSUMER* Consumer, STORM* Storm, ULONG Count, ULONG Length)
+{
+    DECODED_EVENT event;
+
+    for (ULONG offset = 0, i = 0; i < Count; i++) {
+        PDELETE_MESSAGE message = (PDELETE_MESSAGE)(Consumer->Buffer + offset);
+        offset = (offset + message->Size + QUEUE_BATCH_ALIGNMENT - 1) & ~(QUEUE_BATCH_ALIGNMENT - 1);
+        if (message->MessageId == 0) {
+            continue;
+        }
+        if (message->MessageId > Storm->Count
+            || !DecodeDeleteMessage(&Consumer->Check, message, Length - (ULONG)((PUCHAR)message - Consumer->Buffer),
+                &event)) {
+            Consumer->Totals.Wrong++;
+            continue;
+        }
+
+        STORM_EVENT* source = &Storm->Events[message->MessageId - 1];
+        USHORT directoryLength = source->Path.Length - event.FileNameLength;
+        if (!event.ProcessName || !event.Directory) {
+            Consumer->Totals.Unknown++;
+        }
+        if ((event.ProcessName && !SameName(event.ProcessName, event.ProcessNameLength, source->ProcessName.Buffer,
+                source->ProcessName.Length))
+            || (event.Directory && !SameName(event.Directory, event.DirectoryLength, source->Path.Buffer,
+                directoryLength))
+            || event.FileNameLength > source->Path.Length
+            || !SameName(event.FileName, event.FileNameLength, source->Path.Buffer + directoryLength / sizeof(WCHAR),
+                event.FileNameLength)) {
+            Consumer->Totals.Wrong++;
+        }
+    }
+}
+
+// Drains one batch; returns FALSE if the queue was empty
+static BOOLEAN
+Consume(CONSUMER* Consumer, PCIRCULAR_QUEUE Queue, STORM* Storm)
+{
+    ULONG count;
+    ULONG length;
+
+    if (!NT_SUCCESS(DequeueBatch(Queue, Consumer->Buffer, DRAIN_BUFFER_SIZE, &count, &length))) {
+        return FALSE;
+    }
+    ULONG64 start = HostNow();
+    DecodeBatch(Consumer, count, length);
+    Consumer->Totals.Nanoseconds += HostNow() - start;
+    CheckBatch(Consumer, Storm, count, length);
+    return TRUE;
+}
+
+static CONSUMER*
+CreateConsumer(VOID)
+{
+    CONSUMER* consumer = calloc(1, sizeof(CONSUMER));
+    consumer->Buffer = malloc(DRAIN_BUFFER_SIZE);
+    return consumer;
+}
+
+static VOID
+DeleteConsumer(CONSUMER* Consumer)
+{
+    ClearEventStrings(&Consumer->Table);
+    ClearEventStrings(&Consumer->Check);
+    free(Consumer->Buffer);
+    free(Consumer);
+}
+
+static int
+ReportErrors(const char* Run, DECODE_TOTALS* Totals, ULONG64 Sent)
+{
+    if (Totals->Messages != Sent || Totals->Unknown || Totals->Wrong) {
+        fprintf(stderr, "codecBench: %s: %llu of %llu messages decoded, %llu unknown names, %llu wrong\n", Run,
+            (unsigned long long)Totals->Messages, (unsigned long long)Sent, (unsigned long long)Totals->Unknown,
+            (unsigned long long)Totals->Wrong);
+        return 1;
+    }
+    return 0;
+}
+
+// Encodes the storm in chunks that fit the queue, draining after each, so encode and decode are timed apart
+static int
+RunSingle(STORM* Storm)
+{
+    EVENT_STRINGS strings;
+    CIRCULAR_QUEUE queue;
+    CONSUMER* consumer = CreateConsumer();
+    ULONG64 encodeTime = 0;
+    ULONG64 sent = 0;
+    ULONG64 fullBytes = 0;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeEventStrings(&strings));
+    CHECK_STATUS(STATUS_SUCCESS, InitializeQueue(&queue, QUEUE_SIZE));
+    SetQueuePolicy(&queue, QueueDropNewest);
+
+    for (ULONG first = 0; first < Storm->Count; first += CHUNK_EVENTS) {
+        ULONG last = min(Storm->Count, first + CHUNK_EVENTS);
+        ULONG64 start = HostNow();
+        for (ULONG i = first; i < last; i++) {
+            sent += EncodeEvent(&strings, &queue, Storm, i);
+        }
+        encodeTime += HostNow() - start;
+        while (Consume(consumer, &queue, Storm)) {
+        }
+    }
+
+    // Without interning every message carries both names in full
+    for (ULONG i = 0; i < Storm->Count; i++) {
+        fullBytes += DELETE_MESSAGE_HEADER_SIZE + Storm->Events[i].ProcessName.Length + Storm->Events[i].Path.Length;
+    }
+
+    DECODE_TOTALS* totals = &consumer->Totals;
+    printf("%u events, %.1f bytes per event interned, %.1f in full (%.1fx), %u string epochs\n", Storm->Count,
+        (double)totals->Bytes / (double)max(totals->Messages, 1), (double)fullBytes / Storm->Count,
+        (double)fullBytes / (double)max(totals->Bytes, 1), (ULONG)strings.Table.Epoch);
+    printf("encode %6.1f ns/event   decode %6.1f ns/event  %8.1f MB/s  %6.2f Mevents/s\n",
+        (double)encodeTime / (double)max(sent, 1), (double)totals->Nanoseconds / (double)max(totals->Messages, 1),
+        (double)totals->Bytes * 1e3 / (double)max(totals->Nanoseconds, 1),
+        (double)totals->Messages * 1e3 / (double)max(totals->Nanoseconds, 1));
+
+    int result = ReportErrors("one thread", totals, sent);
+    DeleteConsumer(consumer);
+    CleanupQueue(&queue);
+    CleanupEventStrings(&strings);
+    return result;
+}
+
+typedef struct _ENCODER_RUN {
+    EVENT_STRINGS Strings;
+    CIRCULAR_QUEUE Queue;
+    STORM* Storm;
+    ULONG Producers;
+    volatile LONG ProducersDone;
+    volatile LONG64 Sent;
+} ENCODER_RUN;
+
+typedef struct _ENCODER {
+    ENCODER_RUN* Run;
+    ULONG Index;
+} ENCODER;
+
+// Each producer deletes its own slice of the storm, so directories change as often as in the whole
+static void*
+Encoder(void* Context)
+{
+    ENCODER* encoder = Context;
+    ENCODER_RUN* run = encoder->Run;
+    ULONG first = (ULONG)((ULONG64)run->Storm->Count * encoder->Index / run->Producers);
+    ULONG last = (ULONG)((ULONG64)run->Storm->Count * (encoder->Index + 1) / run->Producers);
+    LONG64 sent = 0;
+
+    for (ULONG i = first; i < last; i++) {
+        sent += EncodeEvent(&run->Strings, &run->Queue, run->Storm, i);
+    }
+    InterlockedAdd64(&run->Sent, sent);
+    InterlockedIncrement(&run->ProducersDone);
+    return NULL;
+}
+
+static int
+RunProducers(STORM* Storm, ULONG Producers)
+{
+    static ENCODER_RUN run;
+    pthread_t threads[8];
+    ENCODER encoders[8];
+    CONSUMER* consumer = CreateConsumer();
+
+    RtlZeroMemory(&run, sizeof(run));
+    run.Storm = Storm;
+    run.Producers = Producers;
+    CHECK_STATUS(STATUS_SUCCESS, InitializeEventStrings(&run.Strings));
+    CHECK_STATUS(STATUS_SUCCESS, InitializeQueue(&run.Queue, QUEUE_SIZE));
+    SetQueuePolicy(&run.Queue, QueueDropNewest);
+
+    ULONG64 start = HostNow();
+    for (ULONG i = 0; i < Producers; i++) {
+        encoders[i].Run = &run;
+        encoders[i].Index = i;
+        pthread_create(&threads[i], NULL, Encoder, &encoders[i]);
+    }
+    for (;;) {
+        BOOLEAN done = ReadAcquire(&run.ProducersDone) == (LONG)Producers;
+        BOOLEAN read = Consume(consumer, &run.Queue, Storm);
+        if (done && !read) {
+            break;
+        }
+        if (!read) {
+            sched_yield();
+        }
+    }
+    double seconds = (double)(HostNow() - start) / 1e9;
+    for (ULONG i = 0; i < Producers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    DECODE_TOTALS* totals = &consumer->Totals;
+    printf("%u producers  %6.2f Mevents/s  %6.1f bytes per event  %6.2f%% dropped  %u string epochs\n", Producers,
+        (double)totals->Messages / seconds / 1e6, (double)totals->Bytes / (double)max(totals->Messages, 1),
+        100.0 * (double)(Storm->Count - run.Sent) / Storm->Count, (ULONG)run.Strings.Table.Epoch);
+
+    int result = ReportErrors("producers", totals, (ULONG64)run.Sent);
+    DeleteConsumer(consumer);
+    CleanupQueue(&run.Queue);
+    CleanupEventStrings(&run.Strings);
+    return result;
+}
+
+int
+main(int argc, char** argv)
+{
+    BOOLEAN quick = HostQuick(argc, argv);
+    ULONG producers[] = { 1, 2, 4, 8 };
+    STORM storm = { 0 };
+    const char* trace = NULL;
+    int result = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") != 0) {
+            trace = argv[i];
+        }
+    }
+    if (trace) {
+        if (!LoadTrace(&storm, trace)) {
+            fprintf(stderr, "codecBench: %s is not a trace with deletions\n", trace);
+            return 1;
+        }
+        printf("%u deletions from %s\n", storm.Count, trace);
+    }
+    else {
+        GenerateStorm(&storm, quick ? 20000 : 400000);
+        printf("generated delete storm, %ld processors\n", sysconf(_SC_NPROCESSORS_ONLN));
+    }
+
+    result |= RunSingle(&storm);
+    for (ULONG i = 0; i < ARRAYSIZE(producers); i++) {
+        result |= RunProducers(&storm, producers[i]);
+    }
+    free(storm.Events);
+    free(storm.Storage);
+    return result | HostTestResult();
+}
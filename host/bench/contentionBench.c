@@ -0,0 +1,112 @@
+/**
+ * @file contentionBench.c
+ * @brief Lookup throughput of 1 to 64 reader threads on the tracked files table while one writer keeps adding
+ *        and removing names, and the writer's own rate. Readers only enter a read section, so their cost should
+ *        stay flat as the writer runs; the writer pays a grace period per change.
+ */
+
+#include "hostBench.h"
+#include "fileList.h"
+
+#define PATH_CHARS 80
+#define TABLE_NAMES 10000
+
+typedef struct _CONTENTION {
+    TRACKED_FILES Files;
+    volatile LONG Stop;
+    volatile LONG64 Lookups;
+    volatile LONG64 Changes;
+    volatile LONG Wrong;
+} CONTENTION;
+
+static void*
+Reader(void* Context)
+{
+    CONTENTION* run = Context;
+    WCHAR path[PATH_CHARS];
+    UNICODE_STRING name;
+    LONG64 lookups = 0;
+    ULONG i = 0;
+
+    while (!ReadAcquire(&run->Stop)) {
+        // Half the lookups hit a stable name, half miss
+        ULONG n = (i++ * 2654435761u) % TABLE_NAMES;
+        BOOLEAN hit = (i & 1) != 0;
+        RtlInitUnicodeString(&name, HostPath(path, PATH_CHARS, hit
+            ? "\\Device\\HarddiskVolume1\\Stable\\file%05u.dat" : "\\Device\\HarddiskVolume1\\Other\\file%05u.dat", n));
+        if ((GetTrackedFile(&run->Files, &name) != 0) != hit) {
+            InterlockedIncrement(&run->Wrong);
+        }
+        lookups++;
+    }
+    InterlockedAdd64(&run->Lookups, lookups);
+    return NULL;
+}
+
+static void*
+Writer(void* Context)
+{
+    CONTENTION* run = Context;
+    WCHAR path[PATH_CHARS];
+    LONG64 changes = 0;
+
+    for (ULONG i = 0; !ReadAcquire(&run->Stop); i++) {
+        HostPath(path, PATH_CHARS, "\\Device\\HarddiskVolume1\\Churn\\file%05u.dat", i % 1000);
+        AddTrackedFile(&run->Files, path, RULE_DEFAULT);
+        RemoveTrackedFile(&run->Files, path);
+        changes += 2;
+    }
+    InterlockedAdd64(&run->Changes, changes);
+    return NULL;
+}
+
+static int
+RunReaders(ULONG Readers, ULONG Milliseconds)
+{
+    static CONTENTION run;
+    pthread_t threads[65];
+    WCHAR path[PATH_CHARS];
+
+    RtlZeroMemory(&run, sizeof(run));
+    InitializeTrackedFiles(&run.Files);
+    for (ULONG i = 0; i < TABLE_NAMES; i++) {
+        AddTrackedFile(&run.Files, HostPath(path, PATH_CHARS, "\\Device\\HarddiskVolume1\\Stable\\file%05u.dat", i),
+            RULE_DEFAULT);
+    }
+
+    for (ULONG i = 0; i < Readers; i++) {
+        pthread_create(&threads[i], NULL, Reader, &run);
+    }
+    pthread_create(&threads[Readers], NULL, Writer, &run);
+    ULONG64 start = HostNow();
+    struct timespec pause = { Milliseconds / 1000, (Milliseconds % 1000) * 1000000L };
+    nanosleep(&pause, NULL);
+    WriteRelease(&run.Stop, 1);
+    for (ULONG i = 0; i <= Readers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double seconds = (double)(HostNow() - start) / 1e9;
+
+    printf("%2u readers  %12.0f lookups/s  %9.1f ns/lookup/thread  writer %9.0f changes/s\n", Readers,
+        run.Lookups / seconds, seconds * 1e9 * Readers / (double)max(run.Lookups, 1), run.Changes / seconds);
+    DeleteTrackedFiles(&run.Files);
+    if (run.Wrong) {
+        fprintf(stderr, "contentionBench: %d wrong answers\n", run.Wrong);
+        return 1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    BOOLEAN quick = HostQuick(argc, argv);
+    ULONG readers[] = { 1, 2, 4, 8, 16, 32, 64 };
+    int result = 0;
+
+    printf("%ld processors\n", sysconf(_SC_NPROCESSORS_ONLN));
+    for (ULONG i = 0; i < (quick ? 3 : ARRAYSIZE(readers)); i++) {
+        result |= RunReaders(readers[i], quick ? 100 : 2000);
+    }
+    return result;
+}
@@ -0,0 +1,99 @@
+/**
+ * @file decisionBench.c
+ * @brief Cost of GetFileDecision over a simulated stream of callbacks on many open handles, and its hit rate,
+ *        as the share of renames in the stream grows. Every rename invalidates every cached verdict on its volume, which
+ *        here holds all the handles.
+ */
+
+#include "hostBench.h"
+#include "decisionCache.h"
+#include "fileList.h"
+#include "perfStats.h"
+
+#define PATH_CHARS 80
+
+PFLT_FILTER gFilterHandle;
+TRACKED_FILES TrackedFiles;
+
+typedef struct _HANDLE_SIM {
+    HOST_FILE File;
+    WCHAR Path[PATH_CHARS];
+    FILE_OBJECT FileObject;
+    FLT_IO_PARAMETER_BLOCK Iopb;
+    FLT_CALLBACK_DATA Data;
+    FLT_RELATED_OBJECTS Objects;
+} HANDLE_SIM;
+
+static FLT_INSTANCE Instance;
+static FLT_VOLUME Volume;
+
+static VOID
+RunStream(HANDLE_SIM* Handles, ULONG HandleCount, ULONG Operations, ULONG RenamesPerMillion)
+{
+    DECISION_CACHE_STATS before;
+    DECISION_CACHE_STATS after;
+    ULONG64 state = 0x9E3779B97F4A7C15ull;
+    ULONG renames = 0;
+
+    GetDecisionCacheStats(&before);
+    ULONG64 start = HostNow();
+    for (ULONG i = 0; i < Operations; i++) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        HANDLE_SIM* handle = &Handles[(state >> 33) % HandleCount];
+        if ((state >> 12) % 1000000 < RenamesPerMillion) {
+            // What PostSetInformation does after a rename; the name itself stays, only the verdicts go
+            InvalidateFileDecisions(&handle->Objects);
+            renames++;
+        }
+        GetFileDecision(&handle->Data, &handle->Objects, NULL);
+    }
+    double ns = (double)(HostNow() - start) / Operations;
+    GetDecisionCacheStats(&after);
+
+    ULONG64 hits = after.Hits - before.Hits;
+    ULONG64 misses = after.Misses - before.Misses;
+    printf("renames %6.3f%%  %8u renames  %7.1f ns/decision  hit rate %6.2f%%\n", RenamesPerMillion / 1e4, renames,
+        ns, 100.0 * hits / (double)max(hits + misses, 1));
+}
+
+int
+main(int argc, char** argv)
+{
+    BOOLEAN quick = HostQuick(argc, argv);
+    ULONG handleCount = quick ? 100 : 10000;
+    ULONG operations = quick ? 20000 : 5000000;
+    ULONG renameRates[] = { 0, 10, 100, 1000, 10000 };
+    HANDLE_SIM* handles = calloc(handleCount, sizeof(HANDLE_SIM));
+
+    Volume.Name = HostString(L"\\Device\\HarddiskVolume1");
+    InitializePerfStats();
+    InitializeTrackedFiles(&TrackedFiles);
+    for (ULONG i = 0; i < handleCount; i++) {
+        HANDLE_SIM* handle = &handles[i];
+        HostPath(handle->Path, PATH_CHARS, "\\Device\\HarddiskVolume1\\Data\\dir%03u\\file%06u.txt", i % 100, i);
+        handle->File.Name = HostString(handle->Path);
+        handle->FileObject.File = &handle->File;
+        handle->Iopb.TargetFileObject = &handle->FileObject;
+        handle->Iopb.TargetInstance = &Instance;
+        handle->Data.Iopb = &handle->Iopb;
+        handle->Objects.Instance = &Instance;
+        handle->Objects.Volume = &Volume;
+        handle->Objects.FileObject = &handle->FileObject;
+        if (i % 10 == 0) {
+            AddTrackedFile(&TrackedFiles, handle->Path, RULE_DEFAULT);
+        }
+    }
+
+    printf("%u handles, %u decisions per run\n", handleCount, operations);
+    for (ULONG i = 0; i < ARRAYSIZE(renameRates); i++) {
+        RunStream(handles, handleCount, operations, renameRates[i]);
+    }
+
+    for (ULONG i = 0; i < handleCount; i++) {
+        HostCloseFileObject(&handles[i].FileObject);
+    }
+    free(handles);
+    DeleteTrackedFiles(&TrackedFiles);
+    CleanupPerfStats();
+    return 0;
+}
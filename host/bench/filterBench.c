@@ -0,0 +1,110 @@
+/**
+ * @file filterBench.c
+ * @brief What the prefilter saves on a corpus of untracked paths: the cost of a rejected GetTrackedFile next to
+ *        a full lookup, the share of the corpus rejected, and the false-positive rate, at several ruleset sizes.
+ *        The counters come from GetTrackedFilesFilterStats, i.e. from the per-processor slots.
+ */
+
+#include "hostBench.h"
+#include "fileList.h"
+#include "pathFilter.h"
+#include "perfStats.h"
+
+#define PATH_CHARS 96
+
+static const char* Extensions[] = { "dll", "txt", "log", "tmp", "dat", "json", "pf", "etl" };
+
+// Paths like the ones a busy system deletes and renames: temp files, logs and caches, some close to the rules
+static PCWSTR
+CorpusPath(PWCHAR Buffer, ULONG Index)
+{
+    switch (Index % 4) {
+    case 0:
+        return HostPath(Buffer, PATH_CHARS, "\\Device\\HarddiskVolume1\\Users\\u%03u\\AppData\\Local\\Temp\\~tmp%07u.%s",
+            Index % 50, Index, Extensions[Index % ARRAYSIZE(Extensions)]);
+    case 1:
+        return HostPath(Buffer, PATH_CHARS, "\\Device\\HarddiskVolume1\\Windows\\Logs\\CBS\\trace%07u.%s",
+            Index, Extensions[Index % ARRAYSIZE(Extensions)]);
+    case 2:
+        // Same directories as the rules, other names
+        return HostPath(Buffer, PATH_CHARS, "\\Device\\HarddiskVolume1\\Users\\u%03u\\Documents\\draft%07u.docx",
+            Index % 300, Index);
+    default:
+        return HostPath(Buffer, PATH_CHARS, "\\Device\\HarddiskVolume2\\Cache\\%02x\\%08x.bin", Index & 0xFF, Index);
+    }
+}
+
+static int
+RunRules(ULONG Names, ULONG Directories, ULONG CorpusSize)
+{
+    TRACKED_FILES files;
+    WCHAR path[PATH_CHARS];
+    PATH_FILTER_STATS before;
+    PATH_FILTER_STATS after;
+    PUNICODE_STRING corpus = calloc(CorpusSize, sizeof(UNICODE_STRING));
+    PWCHAR corpusText = calloc(CorpusSize, PATH_CHARS * sizeof(WCHAR));
+    ULONG wrong = 0;
+
+    InitializeTrackedFiles(&files);
+    for (ULONG i = 0; i < Names; i++) {
+        AddTrackedFile(&files, HostPath(path, PATH_CHARS, "\\Device\\HarddiskVolume1\\Users\\u%03u\\Documents\\report%07u.docx",
+            i % 300, i), RULE_DEFAULT);
+    }
+    for (ULONG i = 0; i < Directories; i++) {
+        AddTrackedDirectory(&files, HostPath(path, PATH_CHARS, "\\Device\\HarddiskVolume1\\Projects\\p%05u\\", i), RULE_DEFAULT);
+    }
+    for (ULONG i = 0; i < CorpusSize; i++) {
+        RtlInitUnicodeString(&corpus[i], CorpusPath(corpusText + (SIZE_T)i * PATH_CHARS, i));
+    }
+
+    GetTrackedFilesFilterStats(&files, &before);
+    ULONG64 start = HostNow();
+    for (ULONG i = 0; i < CorpusSize; i++) {
+        wrong += GetTrackedFile(&files, &corpus[i]) != 0;
+    }
+    double lookupNs = (double)(HostNow() - start) / CorpusSize;
+    GetTrackedFilesFilterStats(&files, &after);
+
+    // The filter's own cost, which is what a rejected lookup pays on top of entering the read section
+    start = HostNow();
+    ULONG admitted = 0;
+    for (ULONG i = 0; i < CorpusSize; i++) {
+        admitted += PathFilterMayContain(files.Filter, &corpus[i]);
+    }
+    double filterNs = (double)(HostNow() - start) / CorpusSize;
+
+    ULONG64 rejected = after.Rejected - before.Rejected;
+    ULONG64 falsePositives = after.FalsePositives - before.FalsePositives;
+    printf("%8u names %6u dirs  filter %6.1f ns  lookup %6.1f ns  rejected %6.2f%%  false positives %6.3f%%  %7.1f KB\n",
+        Names, Directories, filterNs, lookupNs, 100.0 * rejected / CorpusSize,
+        100.0 * falsePositives / (double)max(rejected + falsePositives, 1), after.MemoryBytes / 1024.0);
+
+    DeleteTrackedFiles(&files);
+    free(corpusText);
+    free(corpus);
+    if (wrong) {
+        fprintf(stderr, "filterBench: %u corpus paths matched a rule\n", wrong);
+        return 1;
+    }
+    if (admitted != after.Admitted - before.Admitted) {
+        fprintf(stderr, "filterBench: the filter admitted %u paths but the counters say %llu\n", admitted,
+            (unsigned long long)(after.Admitted - before.Admitted));
+        return 1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    BOOLEAN quick = HostQuick(argc, argv);
+    ULONG corpus = quick ? 20000 : 1000000;
+    int result = 0;
+
+    InitializePerfStats();
+    result |= RunRules(10, 1, corpus);
+    result |= RunRules(1000, 10, corpus);
+    result |= RunRules(quick ? 5000 : 100000, 100, corpus);
+    CleanupPerfStats();
+    return result;
+}
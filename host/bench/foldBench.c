@@ -0,0 +1,199 @@
+/**
+ * @file foldBench.c
+ * @brief Cost of upcasing and comparing names with the SSE2 loops of foldedName.c against the scalar loops other
+ *        targets take, and against the case-insensitive RtlEqualUnicodeString lookups made before names were stored
+ *        upcased.
+ *
+ * Names of 16 to 250 characters are folded with FoldNameChars and compared with FoldedNamesEqual, and the same
+ * work is done by copies of the scalar loops, built with the auto-vectorizer off so they stay scalar as on a
+ * target without SSE2. The fold-and-compare row is what a lookup pays per candidate name: the old path compared
+ * the queried name with RtlEqualUnicodeString(..., TRUE), upcasing both sides of every character. Names of the
+ * last row carry a non-ASCII character in every block of eight, which sends each block down the table path. The
+ * SSE2 results are checked against the scalar ones for every name. Built without _M_AMD64 both columns run the
+ * scalar loops.
+ */
+
+#include "hostBench.h"
+#include "foldedName.h"
+
+#define NAMES 64
+#define MAX_CHARS 256
+
+typedef struct _NAME_SET {
+    UNICODE_STRING Names[NAMES];     // In mixed case
+    UNICODE_STRING Folded[NAMES];    // The same names upcased
+    WCHAR Text[NAMES][MAX_CHARS];
+    WCHAR FoldedText[NAMES][MAX_CHARS];
+} NAME_SET;
+
+static volatile ULONG Sink;
+
+// The loops foldedName.c takes without SSE2
+static WCHAR
+ScalarFoldChar(WCHAR Ch)
+{
+    if (Ch < L'a') return Ch;
+    if (Ch <= L'z') return Ch - (L'a' - L'A');
+    if (Ch < 0x80) return Ch;
+    return RtlUpcaseUnicodeChar(Ch);
+}
+
+__attribute__((noinline, optimize("no-tree-vectorize")))
+static VOID
+ScalarFold(PWCH Destination, PCWCH Source, ULONG Count)
+{
+    for (ULONG i = 0; i < Count; i++) {
+        Destination[i] = ScalarFoldChar(Source[i]);
+    }
+}
+
+__attribute__((noinline, optimize("no-tree-vectorize")))
+static BOOLEAN
+ScalarEqual(PCUNICODE_STRING Left, PCUNICODE_STRING Right)
+{
+    if (Left->Length != Right->Length) {
+        return FALSE;
+    }
+    const UCHAR* left = (const UCHAR*)Left->Buffer;
+    const UCHAR* right = (const UCHAR*)Right->Buffer;
+    for (ULONG i = 0; i < Left->Length; i++) {
+        if (left[i] != right[i]) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Names of Chars characters that differ in their last ones, as the candidates of one directory do
+static VOID
+MakeNames(NAME_SET* Set, ULONG Chars, BOOLEAN NonAscii)
+{
+    static const char Alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789\\._-";
+
+    for (ULONG n = 0; n < NAMES; n++) {
+        for (ULONG i = 0; i < Chars; i++) {
+            Set->Text[n][i] = (WCHAR)Alphabet[(i * 7 + (i + 8 >= Chars ? n * 13 : 0)) % (sizeof(Alphabet) - 1)];
+            if (NonAscii && i % 8 == 3) {
+                Set->Text[n][i] = 0xE9;
+            }
+        }
+        Set->Names[n].Buffer = Set->Text[n];
+        Set->Names[n].Length = Set->Names[n].MaximumLength = (USHORT)(Chars * sizeof(WCHAR));
+        ScalarFold(Set->FoldedText[n], Set->Text[n], Chars);
+        Set->Folded[n] = Set->Names[n];
+        Set->Folded[n].Buffer = Set->FoldedText[n];
+    }
+}
+
+// The SSE2 loops must give the scalar loops' answers
+static ULONG
+CheckNames(NAME_SET* Set, ULONG Chars)
+{
+    WCHAR folded[MAX_CHARS];
+    ULONG wrong = 0;
+
+    for (ULONG n = 0; n < NAMES; n++) {
+        FoldNameChars(folded, Set->Text[n], Chars);
+        wrong += memcmp(folded, Set->FoldedText[n], Chars * sizeof(WCHAR)) != 0;
+        for (ULONG m = 0; m < NAMES; m++) {
+            BOOLEAN equal = FoldedNamesEqual(&Set->Folded[n], &Set->Folded[m]);
+            wrong += equal != ScalarEqual(&Set->Folded[n], &Set->Folded[m]) || equal != (n == m);
+        }
+    }
+    return wrong;
+}
+
+typedef enum _FOLD_WORK {
+    WorkFold,
+    WorkCompare,
+    WorkLookup,
+} FOLD_WORK;
+
+// Mean ns of one unit of work over Rounds passes of the names; a compare is of two equal names, read in full
+static double
+TimeWork(NAME_SET* Set, ULONG Chars, FOLD_WORK Work, BOOLEAN Vector, ULONG Rounds)
+{
+    WCHAR folded[MAX_CHARS];
+    UNICODE_STRING foldedName = { (USHORT)(Chars * sizeof(WCHAR)), sizeof(folded), folded };
+    ULONG count = 0;
+
+    ULONG64 start = HostNow();
+    for (ULONG round = 0; round < Rounds; round++) {
+        for (ULONG n = 0; n < NAMES; n++) {
+            switch (Work) {
+            case WorkFold:
+                Vector ? FoldNameChars(folded, Set->Text[n], Chars) : ScalarFold(folded, Set->Text[n], Chars);
+                count += folded[Chars - 1];
+                break;
+            case WorkCompare:
+                count += Vector ? FoldedNamesEqual(&Set->Folded[n], &Set->Folded[n])
+                    : ScalarEqual(&Set->Folded[n], &Set->Folded[n]);
+                break;
+            default:
+                Vector ? FoldNameChars(folded, Set->Text[n], Chars) : ScalarFold(folded, Set->Text[n], Chars);
+                count += Vector ? FoldedNamesEqual(&foldedName, &Set->Folded[n])
+                    : ScalarEqual(&foldedName, &Set->Folded[n]);
+                break;
+            }
+        }
+    }
+    double ns = (double)(HostNow() - start) / ((double)Rounds * NAMES);
+    Sink += count;
+    return ns;
+}
+
+// The lookup before names were stored upcased: both sides upcased on every compare
+static double
+TimeCaseInsensitive(NAME_SET* Set, ULONG Rounds)
+{
+    ULONG count = 0;
+    ULONG64 start = HostNow();
+    for (ULONG round = 0; round < Rounds; round++) {
+        for (ULONG n = 0; n < NAMES; n++) {
+            count += RtlEqualUnicodeString(&Set->Names[n], &Set->Folded[n], TRUE);
+        }
+    }
+    double ns = (double)(HostNow() - start) / ((double)Rounds * NAMES);
+    Sink += count;
+    return ns;
+}
+
+int
+main(int argc, char** argv)
+{
+    BOOLEAN quick = HostQuick(argc, argv);
+    static const ULONG lengths[] = { 16, 62, 128, 250 };
+    NAME_SET* set = calloc(1, sizeof(NAME_SET));
+    ULONG wrong = 0;
+
+#ifdef _M_AMD64
+    printf("SSE2 loops against scalar loops\n");
+#else
+    printf("no _M_AMD64: both columns run the scalar loops\n");
+#endif
+    for (ULONG row = 0; row <= ARRAYSIZE(lengths); row++) {
+        BOOLEAN nonAscii = row == ARRAYSIZE(lengths);
+        ULONG chars = nonAscii ? 62 : lengths[row];
+        ULONG rounds = (quick ? 20000 : 2000000) / chars;
+
+        MakeNames(set, chars, nonAscii);
+        wrong += CheckNames(set, chars);
+        double foldVector = TimeWork(set, chars, WorkFold, TRUE, rounds);
+        double foldScalar = TimeWork(set, chars, WorkFold, FALSE, rounds);
+        double compareVector = TimeWork(set, chars, WorkCompare, TRUE, rounds);
+        double compareScalar = TimeWork(set, chars, WorkCompare, FALSE, rounds);
+        double lookupVector = TimeWork(set, chars, WorkLookup, TRUE, rounds);
+        double lookupScalar = TimeWork(set, chars, WorkLookup, FALSE, rounds);
+        double caseInsensitive = TimeCaseInsensitive(set, rounds);
+        printf("%3u chars%s  fold %6.1f / %6.1f ns  compare %6.1f / %6.1f ns  fold+compare %6.1f / %6.1f ns  "
+            "case-insensitive compare %6.1f ns\n", chars, nonAscii ? " non-ASCII" : "          ", foldVector,
+            foldScalar, compareVector, compareScalar, lookupVector, lookupScalar, caseInsensitive);
+    }
+
+    free(set);
+    if (wrong) {
+        fprintf(stderr, "foldBench: %u answers differ from the scalar loops'\n", wrong);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,239 @@
+/**
+ * @file globBench.c
+ * @brief Cost of matching a path against 100, 1000 and 10k wildcard rules: the compiled DFA of globRules.c, one
+ *        table step per character, against a loop that tries every pattern in turn with a backtracking matcher.
+ *
+ * The rules are what a site would write: per-project patterns below a common root, plus a few with '**\' and
+ * '*' directories. They are all anchored: an unanchored pattern is live in every state of the DFA, so the same
+ * 10k rules with one such as "*\logs\*.tmp" among them multiply the states past GLOB_MAX_STATES. Half the probes
+ * match some rule and half match none; every DFA answer is checked against the loop's.
+ */
+
+#include "hostBench.h"
+#include "globRules.h"
+
+#define PATH_CHARS 96
+
+typedef struct _RULESET {
+    GLOB_PATTERN* Patterns;
+    PWCHAR Text;
+    ULONG Count;
+} RULESET;
+
+// Upcases Length characters of Source, as both matchers compare
+static VOID
+Upcase(PWCHAR Destination, PCWCH Source, ULONG Length)
+{
+    for (ULONG i = 0; i < Length; i++) {
+        Destination[i] = RtlUpcaseUnicodeChar(Source[i]);
+    }
+}
+
+// The semantics GlobRulesCompile documents, by backtracking over upcased text
+static BOOLEAN
+NaiveMatch(PCWCH Pattern, ULONG PatternLength, PCWCH Path, ULONG PathLength)
+{
+    while (PatternLength) {
+        if (Pattern[0] == L'*' && PatternLength > 1 && Pattern[1] == L'*') {
+            if (PatternLength > 2 && Pattern[2] == L'\\') {
+                // Zero or more whole directories
+                if (NaiveMatch(Pattern + 3, PatternLength - 3, Path, PathLength)) {
+                    return TRUE;
+                }
+                for (ULONG k = 0; k < PathLength; k++) {
+                    if (Path[k] == L'\\' && NaiveMatch(Pattern + 3, PatternLength - 3, Path + k + 1, PathLength - k - 1)) {
+                        return TRUE;
+                    }
+                }
+                return FALSE;
+            }
+            for (ULONG k = 0; k <= PathLength; k++) {
+                if (NaiveMatch(Pattern + 2, PatternLength - 2, Path + k, PathLength - k)) {
+                    return TRUE;
+                }
+            }
+            return FALSE;
+        }
+        if (Pattern[0] == L'*') {
+            for (ULONG k = 0; k <= PathLength; k++) {
+                if (NaiveMatch(Pattern + 1, PatternLength - 1, Path + k, PathLength - k)) {
+                    return TRUE;
+                }
+                if (k < PathLength && Path[k] == L'\\') {
+                    break;
+                }
+            }
+            return FALSE;
+        }
+        if (PathLength == 0 || (Pattern[0] == L'?' ? Path[0] == L'\\' : Pattern[0] != Path[0])) {
+            return FALSE;
+        }
+        Pattern++;
+        PatternLength--;
+        Path++;
+        PathLength--;
+    }
+    return PathLength == 0;
+}
+
+// Tries every pattern, as a matcher without the DFA would; an unanchored pattern may start in any directory
+static LONG
+NaiveRulesMatch(RULESET* Rules, PCUNICODE_STRING Path)
+{
+    WCHAR path[PATH_CHARS];
+    ULONG length = Path->Length / sizeof(WCHAR);
+    LONG flags = 0;
+
+    Upcase(path, Path->Buffer, length);
+    for (ULONG p = 0; p < Rules->Count; p++) {
+        PCWCH pattern = Rules->Patterns[p].Pattern.Buffer;
+        ULONG patternLength = Rules->Patterns[p].Pattern.Length / sizeof(WCHAR);
+        BOOLEAN match = NaiveMatch(pattern, patternLength, path, length);
+        for (ULONG k = 0; !match && pattern[0] != L'\\' && k < length; k++) {
+            match = path[k] == L'\\' && NaiveMatch(pattern, patternLength, path + k + 1, length - k - 1);
+        }
+        if (match) {
+            flags |= Rules->Patterns[p].Flags;
+        }
+    }
+    return flags;
+}
+
+// Count rules: a handful of general ones, the rest one per project directory
+static VOID
+BuildRules(RULESET* Rules, ULONG Count)
+{
+    static const char* General[] = {
+        "\\Device\\HarddiskVolume1\\Services\\**\\logs\\*.tmp",
+        "\\Device\\HarddiskVolume*\\Finance\\**\\*.xlsx",
+        "\\Device\\HarddiskVolume1\\Windows\\System32\\config\\*",
+        "\\Device\\HarddiskVolume1\\Users\\*\\Documents\\*.bak",
+    };
+
+    Rules->Patterns = calloc(Count, sizeof(GLOB_PATTERN));
+    Rules->Text = calloc(Count, PATH_CHARS * sizeof(WCHAR));
+    Rules->Count = Count;
+    for (ULONG i = 0; i < Count; i++) {
+        PWCHAR text = Rules->Text + (SIZE_T)i * PATH_CHARS;
+        if (i < ARRAYSIZE(General)) {
+            HostPath(text, PATH_CHARS, "%s", General[i]);
+        }
+        else {
+            HostPath(text, PATH_CHARS, "\\Device\\HarddiskVolume1\\Projects\\p%05u\\*.%s", i,
+                (i & 1) ? "obj" : "pdb");
+        }
+        // Both matchers see the patterns upcased; the DFA upcases them itself
+        Rules->Patterns[i].Pattern = HostString(text);
+        Upcase(text, text, Rules->Patterns[i].Pattern.Length / sizeof(WCHAR));
+        Rules->Patterns[i].Flags = (i % 5 == 0) ? GLOB_RULE_PROTECTED : GLOB_RULE_TRACKED;
+    }
+}
+
+// Probes alternate between paths some rule matches and paths none does
+static VOID
+BuildProbes(PUNICODE_STRING Probes, PWCHAR Text, ULONG Probe, ULONG Rules)
+{
+    for (ULONG i = 0; i < Probe; i++) {
+        PWCHAR text = Text + (SIZE_T)i * PATH_CHARS;
+        ULONG project = (ULONG)(((ULONG64)i * 2654435761u) % Rules);
+        switch (i % 6) {
+        case 0:
+            HostPath(text, PATH_CHARS, "\\Device\\HarddiskVolume1\\Projects\\p%05u\\unit%u.%s", project, i,
+                (project & 1) ? "obj" : "pdb");
+            break;
+        case 1:
+            HostPath(text, PATH_CHARS, "\\Device\\HarddiskVolume2\\Finance\\2024\\q%u\\ledger.xlsx", i % 4);
+            break;
+        case 2:
+            HostPath(text, PATH_CHARS, "\\Device\\HarddiskVolume1\\Services\\svc%u\\logs\\run%u.tmp", i % 50, i);
+            break;
+        case 3:
+            HostPath(text, PATH_CHARS, "\\Device\\HarddiskVolume1\\Projects\\p%05u\\src\\main%u.c", project, i);
+            break;
+        case 4:
+            HostPath(text, PATH_CHARS, "\\Device\\HarddiskVolume1\\Users\\u%03u\\Documents\\report%u.docx", i % 300, i);
+            break;
+        default:
+            HostPath(text, PATH_CHARS, "\\Device\\HarddiskVolume1\\Services\\svc%u\\logs\\run%u.txt", i % 50, i);
+            break;
+        }
+        Probes[i] = HostString(text);
+    }
+}
+
+static int
+RunSize(ULONG Count, ULONG Probes, ULONG Rounds)
+{
+    RULESET rules;
+    PGLOB_RULES compiled = NULL;
+    PUNICODE_STRING probes = calloc(Probes, sizeof(UNICODE_STRING));
+    PWCHAR probeText = calloc(Probes, PATH_CHARS * sizeof(WCHAR));
+    LONG* expected = calloc(Probes, sizeof(LONG));
+    ULONG matched = 0;
+    ULONG wrong = 0;
+    LONG sink = 0;
+
+    BuildRules(&rules, Count);
+    BuildProbes(probes, probeText, Probes, Count);
+
+    ULONG64 start = HostNow();
+    NTSTATUS status = GlobRulesCompile(rules.Patterns, rules.Count, &compiled);
+    double compileMs = (double)(HostNow() - start) / 1e6;
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "globBench: compiling %u rules failed, 0x%08x\n", Count, status);
+        return 1;
+    }
+
+    // The loop gets fewer rounds: at 10k rules one of its lookups costs as much as thousands of the DFA's
+    ULONG naiveRounds = max(1, Rounds * 100 / Count);
+    start = HostNow();
+    for (ULONG round = 0; round < naiveRounds; round++) {
+        for (ULONG i = 0; i < Probes; i++) {
+            expected[i] = NaiveRulesMatch(&rules, &probes[i]);
+        }
+    }
+    double naiveNs = (double)(HostNow() - start) / ((double)Probes * naiveRounds);
+
+    start = HostNow();
+    for (ULONG round = 0; round < Rounds; round++) {
+        for (ULONG i = 0; i < Probes; i++) {
+            sink += GlobRulesMatch(compiled, &probes[i]);
+        }
+    }
+    double dfaNs = (double)(HostNow() - start) / ((double)Probes * Rounds);
+
+    for (ULONG i = 0; i < Probes; i++) {
+        LONG flags = GlobRulesMatch(compiled, &probes[i]);
+        matched += flags != 0;
+        wrong += flags != expected[i];
+    }
+
+    printf("%6u rules  %6u states  %8.1f KB  compile %8.1f ms  dfa %7.1f ns/op  loop %10.1f ns/op  (%.0fx)  "
+        "%u%% matched\n", Count, compiled->StateCount, (double)GlobRulesSize(compiled) / 1024, compileMs, dfaNs,
+        naiveNs, naiveNs / dfaNs, matched * 100 / Probes);
+
+    GlobRulesFree(compiled);
+    free(expected);
+    free(probeText);
+    free(probes);
+    free(rules.Text);
+    free(rules.Patterns);
+    if (wrong || !sink) {
+        fprintf(stderr, "globBench: %u of %u DFA answers differ from the loop's\n", wrong, Probes);
+        return 1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    BOOLEAN quick = HostQuick(argc, argv);
+    ULONG sizes[] = { 100, 1000, 10000 };
+    int result = 0;
+
+    for (ULONG i = 0; i < ARRAYSIZE(sizes) - (quick ? 1 : 0); i++) {
+        result |= RunSize(sizes[i], quick ? 600 : 6000, quick ? 5 : 50);
+    }
+    return result;
+}
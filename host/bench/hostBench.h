@@ -0,0 +1,32 @@
+/**
+ * @file hostBench.h
+ * @brief Timing and argument helpers shared by the host benchmarks.
+ *
+ * Every benchmark takes --quick, which shrinks its sizes so ctest can run it as a smoke test.
+ */
+
+#pragma once
+#include "hostTest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static inline ULONG64
+HostNow(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (ULONG64)now.tv_sec * 1000000000ull + (ULONG64)now.tv_nsec;
+}
+
+static inline BOOLEAN
+HostQuick(int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
@@ -0,0 +1,325 @@
+/**
+ * @file kernelBench.c
+ * @brief Regression suite over the driver's hot paths, one JSON object per line so runs can be logged and
+ *        compared: a record through BeginEnqueue/EndEnqueue and Dequeue, the same drained with DequeueBatch,
+ *        GetTrackedFile hits and misses at several table sizes, the deletion message as SendToUser packs it,
+ *        and 1 to 64 producer threads against a consumer thread.
+ *
+ * Every line has "bench" and "ns_per_op" or "ops_per_s"; the first line describes the run.
+ */
+
+#include "hostBench.h"
+#include "circularQ.h"
+#include "eventEncoder.h"
+#include "fileList.h"
+
+#define RECORD_LENGTH 128
+#define QUEUE_SIZE (1024 * 1024)
+#define BATCH_BUFFER_SIZE (256 * 1024)
+#define PATH_CHARS 80
+
+static double
+NsPerOp(ULONG64 Start, ULONG64 Operations)
+{
+    return (double)(HostNow() - Start) / (double)max(Operations, 1);
+}
+
+static BOOLEAN
+EnqueueRecord(PCIRCULAR_QUEUE Queue, ULONG Index)
+{
+    QUEUE_RESERVATION reservation;
+    PULONG record = BeginEnqueue(Queue, RECORD_LENGTH, 0, &reservation);
+    if (!record) {
+        return FALSE;
+    }
+    // A second word of 0 would read as a QUEUE_GAP_MARKER
+    record[0] = RECORD_LENGTH;
+    record[1] = Index + 1;
+    memset(record + 2, (UCHAR)Index, RECORD_LENGTH - 2 * sizeof(ULONG));
+    EndEnqueue(Queue, &reservation);
+    return TRUE;
+}
+
+// Counts the records of a batch, leaving out the gap markers that report drops
+static ULONG
+CountRecords(PUCHAR Buffer, ULONG Count)
+{
+    ULONG records = 0;
+    for (ULONG offset = 0, i = 0; i < Count; i++) {
+        PULONG record = (PULONG)(Buffer + offset);
+        records += record[1] != 0;
+        offset = (offset + record[0] + QUEUE_BATCH_ALIGNMENT - 1) & ~(QUEUE_BATCH_ALIGNMENT - 1);
+    }
+    return records;
+}
+
+// One record in, one record out, so the queue never holds more than one
+static int
+BenchQueuePair(ULONG Operations)
+{
+    CIRCULAR_QUEUE queue;
+    UCHAR buffer[RECORD_LENGTH];
+    ULONG length;
+    ULONG wrong = 0;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeQueue(&queue, QUEUE_SIZE));
+    ULONG64 start = HostNow();
+    for (ULONG i = 0; i < Operations; i++) {
+        EnqueueRecord(&queue, i);
+        if (!NT_SUCCESS(Dequeue(&queue, buffer, sizeof(buffer), &length)) || ((PULONG)buffer)[1] != i + 1) {
+            wrong++;
+        }
+    }
+    printf("{\"bench\":\"queue_pair\",\"record_bytes\":%u,\"ops\":%u,\"ns_per_op\":%.1f}\n", RECORD_LENGTH,
+        Operations, NsPerOp(start, Operations));
+    CleanupQueue(&queue);
+    if (wrong) {
+        fprintf(stderr, "kernelBench: queue_pair: %u records lost or out of order\n", wrong);
+        return 1;
+    }
+    return 0;
+}
+
+// Fills half the queue, then drains it with DequeueBatch; the cost is per record, both sides included
+static int
+BenchQueueBatch(ULONG Operations)
+{
+    CIRCULAR_QUEUE queue;
+    PUCHAR buffer = malloc(BATCH_BUFFER_SIZE);
+    ULONG perRound = QUEUE_SIZE / 2 / (RECORD_LENGTH + 32);
+    ULONG64 sent = 0;
+    ULONG64 received = 0;
+    ULONG count;
+    ULONG length;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeQueue(&queue, QUEUE_SIZE));
+    ULONG64 start = HostNow();
+    for (ULONG done = 0; done < Operations; done += perRound) {
+        for (ULONG i = 0; i < perRound; i++) {
+            sent += EnqueueRecord(&queue, done + i);
+        }
+        while (NT_SUCCESS(DequeueBatch(&queue, buffer, BATCH_BUFFER_SIZE, &count, &length))) {
+            received += CountRecords(buffer, count);
+        }
+    }
+    printf("{\"bench\":\"queue_batch\",\"record_bytes\":%u,\"ops\":%llu,\"ns_per_op\":%.1f}\n", RECORD_LENGTH,
+        (unsigned long long)sent, NsPerOp(start, sent));
+    CleanupQueue(&queue);
+    free(buffer);
+    if (received != sent) {
+        fprintf(stderr, "kernelBench: queue_batch: %llu of %llu records received\n", (unsigned long long)received,
+            (unsigned long long)sent);
+        return 1;
+    }
+    return 0;
+}
+
+// Hits cycle through the table in a scattered order; misses are under a directory with no rule
+static int
+BenchLookup(ULONG Size, ULONG Probes)
+{
+    TRACKED_FILES files;
+    PTRACKED_FILE_UPDATE updates = calloc(Size, sizeof(TRACKED_FILE_UPDATE));
+    PWCHAR names = calloc((SIZE_T)Size, PATH_CHARS * sizeof(WCHAR));
+    PUNICODE_STRING misses = calloc(Probes, sizeof(UNICODE_STRING));
+    PWCHAR missNames = calloc(Probes, PATH_CHARS * sizeof(WCHAR));
+    ULONG applied = 0;
+    ULONG wrong = 0;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeTrackedFiles(&files));
+    for (ULONG i = 0; i < Size; i++) {
+        RtlInitUnicodeString(&updates[i].Path, HostPath(names + (SIZE_T)i * PATH_CHARS, PATH_CHARS,
+            "\\Device\\HarddiskVolume1\\Users\\u%03u\\Documents\\report%07u.docx", i % 300, i));
+        updates[i].Operations = RULE_DEFAULT;
+    }
+    UpdateTrackedFiles(&files, updates, Size, &applied);
+    for (ULONG i = 0; i < Probes; i++) {
+        RtlInitUnicodeString(&misses[i], HostPath(missNames + (SIZE_T)i * PATH_CHARS, PATH_CHARS,
+            "\\Device\\HarddiskVolume1\\Users\\u%03u\\Documents\\draft%07u.docx", i % 300, i));
+    }
+
+    ULONG64 start = HostNow();
+    for (ULONG i = 0; i < Probes; i++) {
+        wrong += GetTrackedFile(&files, &updates[(ULONG)(((ULONG64)i * 2654435761u) % Size)].Path) == 0;
+    }
+    double hitNs = NsPerOp(start, Probes);
+    start = HostNow();
+    for (ULONG i = 0; i < Probes; i++) {
+        wrong += GetTrackedFile(&files, &misses[i]) != 0;
+    }
+    double missNs = NsPerOp(start, Probes);
+    printf("{\"bench\":\"lookup_hit\",\"names\":%u,\"ops\":%u,\"ns_per_op\":%.1f}\n", applied, Probes, hitNs);
+    printf("{\"bench\":\"lookup_miss\",\"names\":%u,\"ops\":%u,\"ns_per_op\":%.1f}\n", applied, Probes, missNs);
+
+    DeleteTrackedFiles(&files);
+    free(missNames);
+    free(misses);
+    free(names);
+    free(updates);
+    if (wrong || applied != Size) {
+        fprintf(stderr, "kernelBench: lookup: %u wrong answers, %u of %u names loaded\n", wrong, applied, Size);
+        return 1;
+    }
+    return 0;
+}
+
+// What SendToUser does for a deletion once it has the names: reserve, pack and publish the message. Files
+// change every time, the directory every 100 deletions, so most messages send the directory by id.
+static int
+BenchMessage(ULONG Operations)
+{
+    EVENT_STRINGS strings;
+    CIRCULAR_QUEUE queue;
+    QUEUE_RESERVATION reservation;
+    PUCHAR buffer = malloc(BATCH_BUFFER_SIZE);
+    PWCHAR paths = calloc(1000, PATH_CHARS * sizeof(WCHAR));
+    UNICODE_STRING processName = HostString(L"\\Device\\HarddiskVolume1\\Windows\\explorer.exe");
+    UNICODE_STRING path;
+    ULONG64 sent = 0;
+    ULONG64 bytes = 0;
+    ULONG64 elapsed = 0;
+    ULONG count;
+    ULONG length;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeEventStrings(&strings));
+    CHECK_STATUS(STATUS_SUCCESS, InitializeQueue(&queue, QUEUE_SIZE));
+    SetQueuePolicy(&queue, QueueDropNewest);
+    for (ULONG done = 0; done < Operations; done += 1000) {
+        for (ULONG i = 0; i < 1000; i++) {
+            HostPath(paths + i * PATH_CHARS, PATH_CHARS, "\\Device\\HarddiskVolume1\\Build\\obj%05u\\unit%03u.obj",
+                (done + i) / 100, i % 100);
+        }
+
+        // Draining stays outside the clock
+        ULONG64 start = HostNow();
+        for (ULONG i = 0; i < 1000; i++) {
+            path = HostString(paths + i * PATH_CHARS);
+            PDELETE_MESSAGE message = ReserveDeleteMessage(&strings, &queue, &processName, &path, 0, &reservation);
+            if (!message) {
+                continue;
+            }
+            message->MessageId = done + i + 1;
+            message->Flags = 0;
+            message->ProcessId = 4;
+            message->ProcessCreateTime = 0;
+            message->SystemTime = 0;
+            message->InterruptTime = done + i;
+            bytes += message->Size;
+            EndEnqueue(&queue, &reservation);
+            sent++;
+        }
+        elapsed += HostNow() - start;
+        while (NT_SUCCESS(DequeueBatch(&queue, buffer, BATCH_BUFFER_SIZE, &count, &length))) {
+        }
+    }
+    printf("{\"bench\":\"delete_message\",\"ops\":%llu,\"bytes_per_op\":%.1f,\"ns_per_op\":%.1f}\n",
+        (unsigned long long)sent, (double)bytes / (double)max(sent, 1), (double)elapsed / (double)max(sent, 1));
+
+    CleanupQueue(&queue);
+    CleanupEventStrings(&strings);
+    free(paths);
+    free(buffer);
+    if (sent != (Operations + 999) / 1000 * 1000) {
+        fprintf(stderr, "kernelBench: delete_message: %llu messages queued\n", (unsigned long long)sent);
+        return 1;
+    }
+    return 0;
+}
+
+typedef struct _CONTENTION_RUN {
+    CIRCULAR_QUEUE Queue;
+    ULONG RecordsPerProducer;
+    volatile LONG ProducersDone;
+    volatile LONG64 Sent;
+} CONTENTION_RUN;
+
+static void*
+Producer(void* Context)
+{
+    CONTENTION_RUN* run = Context;
+    LONG64 sent = 0;
+
+    for (ULONG i = 0; i < run->RecordsPerProducer; i++) {
+        sent += EnqueueRecord(&run->Queue, i);
+    }
+    InterlockedAdd64(&run->Sent, sent);
+    InterlockedIncrement(&run->ProducersDone);
+    return NULL;
+}
+
+// Producers drop records rather than wait when the consumer falls behind, as the driver does; ops_per_s is what
+// they offered, delivered_per_s what the consumer got
+static int
+BenchContention(ULONG Producers, ULONG RecordsPerProducer)
+{
+    static CONTENTION_RUN run;
+    pthread_t threads[64];
+    PUCHAR buffer = malloc(BATCH_BUFFER_SIZE);
+    ULONG64 received = 0;
+    ULONG count;
+    ULONG length;
+
+    RtlZeroMemory(&run, sizeof(run));
+    run.RecordsPerProducer = RecordsPerProducer;
+    CHECK_STATUS(STATUS_SUCCESS, InitializeQueue(&run.Queue, QUEUE_SIZE));
+    SetQueuePolicy(&run.Queue, QueueDropNewest);
+
+    ULONG64 start = HostNow();
+    for (ULONG i = 0; i < Producers; i++) {
+        pthread_create(&threads[i], NULL, Producer, &run);
+    }
+    for (;;) {
+        BOOLEAN done = ReadAcquire(&run.ProducersDone) == (LONG)Producers;
+        BOOLEAN read = NT_SUCCESS(DequeueBatch(&run.Queue, buffer, BATCH_BUFFER_SIZE, &count, &length));
+        if (read) {
+            received += CountRecords(buffer, count);
+        }
+        else if (done) {
+            break;
+        }
+        else {
+            sched_yield();
+        }
+    }
+    double seconds = (double)(HostNow() - start) / 1e9;
+    for (ULONG i = 0; i < Producers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    ULONG64 offered = (ULONG64)Producers * RecordsPerProducer;
+    printf("{\"bench\":\"contention\",\"producers\":%u,\"ops\":%llu,\"ops_per_s\":%.0f,\"delivered_per_s\":%.0f,"
+        "\"dropped_pct\":%.2f}\n", Producers, (unsigned long long)offered, (double)offered / seconds,
+        (double)received / seconds, 100.0 * (double)(offered - received) / (double)offered);
+
+    CleanupQueue(&run.Queue);
+    free(buffer);
+    if (received != (ULONG64)run.Sent) {
+        fprintf(stderr, "kernelBench: contention: %llu of %lld records received\n", (unsigned long long)received,
+            (long long)run.Sent);
+        return 1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    BOOLEAN quick = HostQuick(argc, argv);
+    ULONG sizes[] = { 10, 1000, 100000 };
+    ULONG producers[] = { 1, 2, 4, 8, 16, 32, 64 };
+    ULONG operations = quick ? 20000 : 2000000;
+    int result = 0;
+
+    printf("{\"bench\":\"run\",\"processors\":%ld,\"quick\":%s}\n", sysconf(_SC_NPROCESSORS_ONLN),
+        quick ? "true" : "false");
+    result |= BenchQueuePair(operations);
+    result |= BenchQueueBatch(operations);
+    for (ULONG i = 0; i < ARRAYSIZE(sizes); i++) {
+        result |= BenchLookup(quick ? min(sizes[i], 1000) : sizes[i], quick ? 10000 : 1000000);
+    }
+    result |= BenchMessage(operations / 2);
+    for (ULONG i = 0; i < ARRAYSIZE(producers); i++) {
+        result |= BenchContention(producers[i], operations / producers[i]);
+    }
+    return result | HostTestResult();
+}
@@ -0,0 +1,94 @@
+/**
+ * @file lookupBench.c
+ * @brief Cost of GetTrackedFile against 10, 10k and 1M tracked names, for names that are tracked, names on
+ *        a tracked directory's volume that are not, and names the prefilter rejects.
+ */
+
+#include "hostBench.h"
+#include "fileList.h"
+
+#define PATH_CHARS 80
+
+// Tracked names are spread over a few hundred directories, like a real ruleset
+static PCWSTR
+TrackedPath(PWCHAR Buffer, ULONG Index)
+{
+    return HostPath(Buffer, PATH_CHARS, "\\Device\\HarddiskVolume1\\Users\\u%03u\\Documents\\report%07u.docx",
+        Index % 300, Index);
+}
+
+static double
+TimeLookups(PTRACKED_FILES Files, PUNICODE_STRING Paths, ULONG Count, ULONG Rounds, LONG Expected, PULONG Wrong)
+{
+    ULONG64 start = HostNow();
+    for (ULONG round = 0; round < Rounds; round++) {
+        for (ULONG i = 0; i < Count; i++) {
+            if ((GetTrackedFile(Files, &Paths[i]) != 0) != (Expected != 0)) {
+                (*Wrong)++;
+            }
+        }
+    }
+    return (double)(HostNow() - start) / ((double)Count * Rounds);
+}
+
+static int
+RunSize(ULONG Size, ULONG Probes, ULONG Rounds)
+{
+    TRACKED_FILES files;
+    PTRACKED_FILE_UPDATE updates = calloc(Size, sizeof(TRACKED_FILE_UPDATE));
+    PWCHAR names = calloc((SIZE_T)Size, PATH_CHARS * sizeof(WCHAR));
+    PUNICODE_STRING hits = calloc(Probes, sizeof(UNICODE_STRING));
+    PUNICODE_STRING misses = calloc(Probes, sizeof(UNICODE_STRING));
+    PWCHAR missNames = calloc(Probes, PATH_CHARS * sizeof(WCHAR));
+    ULONG applied = 0;
+    ULONG wrong = 0;
+
+    if (!updates || !names || !hits || !misses || !missNames || !NT_SUCCESS(InitializeTrackedFiles(&files))) {
+        fprintf(stderr, "lookupBench: out of memory\n");
+        return 1;
+    }
+    for (ULONG i = 0; i < Size; i++) {
+        RtlInitUnicodeString(&updates[i].Path, TrackedPath(names + (SIZE_T)i * PATH_CHARS, i));
+        updates[i].Operations = RULE_DEFAULT;
+    }
+    ULONG64 start = HostNow();
+    UpdateTrackedFiles(&files, updates, Size, &applied);
+    double loadMs = (double)(HostNow() - start) / 1e6;
+
+    // Probes cycle through the table in a scattered order, so the cache sees a realistic spread
+    for (ULONG i = 0; i < Probes; i++) {
+        ULONG index = (ULONG)(((ULONG64)i * 2654435761u) % Size);
+        hits[i] = updates[index].Path;
+        RtlInitUnicodeString(&misses[i], HostPath(missNames + (SIZE_T)i * PATH_CHARS, PATH_CHARS,
+            "\\Device\\HarddiskVolume1\\Windows\\Temp\\scratch%07u.tmp", i));
+    }
+
+    double hitNs = TimeLookups(&files, hits, Probes, Rounds, RULE_DEFAULT, &wrong);
+    double missNs = TimeLookups(&files, misses, Probes, Rounds, 0, &wrong);
+    printf("%9u names  load %8.1f ms  hit %7.1f ns/op  miss %7.1f ns/op\n", applied, loadMs, hitNs, missNs);
+
+    DeleteTrackedFiles(&files);
+    free(missNames);
+    free(misses);
+    free(hits);
+    free(names);
+    free(updates);
+    if (wrong || applied != Size) {
+        fprintf(stderr, "lookupBench: %u wrong answers, %u of %u names loaded\n", wrong, applied, Size);
+        return 1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    BOOLEAN quick = HostQuick(argc, argv);
+    ULONG sizes[] = { 10, 10000, quick ? 20000 : 1000000 };
+    int result = 0;
+
+    for (ULONG i = 0; i < ARRAYSIZE(sizes); i++) {
+        result |= RunSize(sizes[i], quick ? 1000 : 100000, quick ? 2 : 20);
+    }
+    return result;
+}
@@ -0,0 +1,280 @@
+/**
+ * @file opMixBench.c
+ * @brief Cost per operation of the create and set-information callbacks under a mix of plain opens, overwrites,
+ *        delete-on-close opens, deletions and renames, gated on the summary mask of the rules' operations, against
+ *        a name query and rule lookup on every callback as before the rules named operations.
+ *
+ * The mix is 75% plain opens, 8% overwrites, 2% delete-on-close opens, 10% deletions and 5% renames, each on a
+ * fresh handle; a deletion or rename is an open followed by a set-information call, so 115 callbacks make 100
+ * operations. Half the operations name one of 20k tracked files. The rules track deletions only, then deletions
+ * and overwrites, then all four operations; the callbacks decide each mix against PreCreateCallback,
+ * PostCreateCallback, PreOperationCallback and PostOperationCallback, and LogOperation's messages are counted
+ * rather than queued. The baseline queries the name and calls GetTrackedFile once per callback. The name queries
+ * per operation come from the driver's NAME_QUERY histogram; on the host a query is a string copy, in the kernel
+ * FltGetFileNameInformation costs microseconds. Every operation a rule covers must be logged exactly once.
+ */
+
+#include "hostBench.h"
+#include "callbacks.h"
+#include "decisionCache.h"
+#include "fileList.h"
+#include "perfStats.h"
+#include "processCache.h"
+
+#define PATH_CHARS 96
+#define BATCH 4096
+
+PFLT_FILTER gFilterHandle;
+TRACKED_FILES TrackedFiles;
+
+typedef struct _OPERATION_SIM {
+    HOST_FILE File;
+    WCHAR Path[PATH_CHARS];
+    FILE_OBJECT FileObject;
+    FLT_IO_PARAMETER_BLOCK Iopb;
+    FLT_CALLBACK_DATA Data;
+    FLT_RELATED_OBJECTS Objects;
+    FILE_DISPOSITION_INFORMATION Disposition;
+    LONG Operation;        // RULE_OP_*, or -1 for a plain open
+    BOOLEAN Tracked;       // One of the rules' names
+} OPERATION_SIM;
+
+typedef struct _RULESET {
+    const char* Name;
+    LONG Operations;
+} RULESET;
+
+static FLT_INSTANCE Instance;
+static FLT_VOLUME Volume;
+static EPROCESS Process;
+static ULONG64 Logged;
+
+// LogOperation's messages are counted; the queue has benches of its own
+NTSTATUS
+SendToUser(PUNICODE_STRING processName, HANDLE processId, LONG64 processCreateTime, PUNICODE_STRING name,
+    LONG operation, BOOLEAN denied)
+{
+    UNREFERENCED_PARAMETER(processName);
+    UNREFERENCED_PARAMETER(processId);
+    UNREFERENCED_PARAMETER(processCreateTime);
+    UNREFERENCED_PARAMETER(name);
+    UNREFERENCED_PARAMETER(operation);
+    UNREFERENCED_PARAMETER(denied);
+    Logged++;
+    return STATUS_SUCCESS;
+}
+
+static PCWSTR
+FilePath(PWCHAR Buffer, ULONG Index)
+{
+    return HostPath(Buffer, PATH_CHARS, "\\Device\\HarddiskVolume1\\Users\\u%03u\\Documents\\report%07u.docx",
+        Index % 300, Index);
+}
+
+// Draws the next operation of the mix on a fresh handle
+static VOID
+OpenOperation(OPERATION_SIM* Sim, ULONG64* State, ULONG Rules)
+{
+    *State = *State * 6364136223846793005ull + 1442695040888963407ull;
+    ULONG pick = (ULONG)((*State >> 33) % 100);
+    ULONG index = (ULONG)((*State >> 7) % (2 * Rules));
+
+    RtlZeroMemory(Sim, FIELD_OFFSET(OPERATION_SIM, Path));
+    RtlZeroMemory(&Sim->FileObject, sizeof(*Sim) - FIELD_OFFSET(OPERATION_SIM, FileObject));
+    Sim->File.Name = HostString(FilePath(Sim->Path, index));
+    Sim->FileObject.File = &Sim->File;
+    Sim->Iopb.TargetFileObject = &Sim->FileObject;
+    Sim->Iopb.TargetInstance = &Instance;
+    Sim->Data.Iopb = &Sim->Iopb;
+    Sim->Objects.Size = sizeof(Sim->Objects);
+    Sim->Objects.Volume = &Volume;
+    Sim->Objects.Instance = &Instance;
+    Sim->Objects.FileObject = &Sim->FileObject;
+    Sim->Operation = pick < 75 ? -1 : pick < 83 ? RULE_OP_OVERWRITE : pick < 85 ? RULE_OP_DELETE_ON_CLOSE
+        : pick < 95 ? RULE_OP_DELETE : RULE_OP_RENAME;
+    Sim->Tracked = index < Rules;
+}
+
+static VOID
+Create(OPERATION_SIM* Sim, ULONG Options, ULONG_PTR Information)
+{
+    PVOID context;
+
+    Sim->Iopb.MajorFunction = IRP_MJ_CREATE;
+    Sim->Iopb.Parameters.Create.Options = Options;
+    if (PreCreateCallback(&Sim->Data, &Sim->Objects, &context) == FLT_PREOP_SUCCESS_WITH_CALLBACK) {
+        Sim->Data.IoStatus.Status = STATUS_SUCCESS;
+        Sim->Data.IoStatus.Information = Information;
+        PostCreateCallback(&Sim->Data, &Sim->Objects, context, 0);
+    }
+}
+
+static VOID
+SetInformation(OPERATION_SIM* Sim, FILE_INFORMATION_CLASS InfoClass)
+{
+    PVOID context;
+
+    RtlZeroMemory(&Sim->Iopb.Parameters, sizeof(Sim->Iopb.Parameters));
+    RtlZeroMemory(&Sim->Data.IoStatus, sizeof(Sim->Data.IoStatus));
+    Sim->Iopb.MajorFunction = IRP_MJ_SET_INFORMATION;
+    Sim->Iopb.Parameters.SetFileInformation.FileInformationClass = InfoClass;
+    Sim->Iopb.Parameters.SetFileInformation.Length = sizeof(Sim->Disposition);
+    Sim->Iopb.Parameters.SetFileInformation.InfoBuffer = &Sim->Disposition;
+    Sim->Disposition.DeleteFile = TRUE;
+    if (PreOperationCallback(&Sim->Data, &Sim->Objects, &context) == FLT_PREOP_SUCCESS_WITH_CALLBACK) {
+        Sim->Data.IoStatus.Status = STATUS_SUCCESS;
+        PostOperationCallback(&Sim->Data, &Sim->Objects, context, 0);
+    }
+}
+
+// The callbacks the filter manager issues for the operation
+static VOID
+Issue(OPERATION_SIM* Sim)
+{
+    switch (Sim->Operation) {
+    case RULE_OP_OVERWRITE:
+        Create(Sim, FILE_OVERWRITE_IF << 24, FILE_OVERWRITTEN);
+        break;
+    case RULE_OP_DELETE_ON_CLOSE:
+        Create(Sim, (FILE_OPEN << 24) | FILE_DELETE_ON_CLOSE, FILE_OPENED);
+        break;
+    case RULE_OP_DELETE:
+        Create(Sim, FILE_OPEN << 24, FILE_OPENED);
+        SetInformation(Sim, FileDispositionInformation);
+        break;
+    case RULE_OP_RENAME:
+        Create(Sim, FILE_OPEN << 24, FILE_OPENED);
+        SetInformation(Sim, FileRenameInformation);
+        break;
+    default:
+        Create(Sim, FILE_OPEN << 24, FILE_OPENED);
+        break;
+    }
+}
+
+// What every callback paid before the summary mask: the name, then the rule
+static ULONG
+LookUp(OPERATION_SIM* Sim)
+{
+    ULONG callbacks = Sim->Operation == RULE_OP_DELETE || Sim->Operation == RULE_OP_RENAME ? 2 : 1;
+    ULONG found = 0;
+
+    for (ULONG i = 0; i < callbacks; i++) {
+        PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
+        if (NT_SUCCESS(FltGetFileNameInformation(&Sim->Data, FLT_FILE_NAME_OPENED | FLT_FILE_NAME_QUERY_DEFAULT,
+            &nameInfo))) {
+            found += GetTrackedFile(&TrackedFiles, &nameInfo->Name) != 0;
+            FltReleaseFileNameInformation(nameInfo);
+        }
+    }
+    return found;
+}
+
+static int
+RunRuleset(const RULESET* Ruleset, ULONG Rules, ULONG Operations, OPERATION_SIM* Sims)
+{
+    WCHAR path[PATH_CHARS];
+    PERF_STATS before;
+    PERF_STATS after;
+    ULONG64 elapsed[2] = { 0 };
+    ULONG64 expected = 0;
+    ULONG64 found = 0;
+    ULONG batches = (Operations + BATCH - 1) / BATCH;
+    ULONG64 state = 0x9E3779B97F4A7C15ull;
+
+    for (ULONG i = 0; i < Rules; i++) {
+        AddTrackedFile(&TrackedFiles, FilePath(path, i), Ruleset->Operations);
+    }
+    Logged = 0;
+    QueryPerfStats(&before);
+    for (ULONG b = 0; b < batches; b++) {
+        ULONG64 batchState = state;
+        for (ULONG i = 0; i < BATCH; i++) {
+            OpenOperation(&Sims[i], &state, Rules);
+            expected += Sims[i].Tracked && Sims[i].Operation >= 0
+                && (Ruleset->Operations & RULE_TRACK(Sims[i].Operation));
+        }
+        ULONG64 start = HostNow();
+        for (ULONG i = 0; i < BATCH; i++) {
+            Issue(&Sims[i]);
+        }
+        elapsed[0] += HostNow() - start;
+        for (ULONG i = 0; i < BATCH; i++) {
+            HostCloseFileObject(&Sims[i].FileObject);
+        }
+
+        state = batchState;
+        for (ULONG i = 0; i < BATCH; i++) {
+            OpenOperation(&Sims[i], &state, Rules);
+        }
+        start = HostNow();
+        for (ULONG i = 0; i < BATCH; i++) {
+            found += LookUp(&Sims[i]);
+        }
+        elapsed[1] += HostNow() - start;
+    }
+    QueryPerfStats(&after);
+
+    double count = (double)batches * BATCH;
+    ULONG64 queries = after.Histograms[PERF_HISTOGRAM_NAME_QUERY].Count
+        - before.Histograms[PERF_HISTOGRAM_NAME_QUERY].Count;
+    printf("%-22s gated %6.1f ns/op %5.3f queries/op  lookup per callback %6.1f ns/op 1.150 queries/op  "
+        "%5.2f%% logged\n", Ruleset->Name, elapsed[0] / count, queries / count, elapsed[1] / count,
+        100.0 * Logged / count);
+
+    for (ULONG i = 0; i < Rules; i++) {
+        RemoveTrackedFile(&TrackedFiles, FilePath(path, i));
+    }
+    if (Logged != expected || found == 0) {
+        fprintf(stderr, "opMixBench: %s: %llu operations logged of %llu covered\n", Ruleset->Name,
+            (unsigned long long)Logged, (unsigned long long)expected);
+        return 1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    BOOLEAN quick = HostQuick(argc, argv);
+    ULONG rules = quick ? 2000 : 20000;
+    ULONG operations = quick ? 20000 : 2000000;
+    OPERATION_SIM* sims = calloc(BATCH, sizeof(OPERATION_SIM));
+    static const RULESET rulesets[] = {
+        { "deletes", RULE_TRACK(RULE_OP_DELETE) },
+        { "deletes + overwrites", RULE_TRACK(RULE_OP_DELETE) | RULE_TRACK(RULE_OP_OVERWRITE) },
+        { "every operation", RULE_TRACK(RULE_OP_DELETE) | RULE_TRACK(RULE_OP_RENAME) | RULE_TRACK(RULE_OP_OVERWRITE)
+            | RULE_TRACK(RULE_OP_DELETE_ON_CLOSE) },
+    };
+    FLT_RELATED_OBJECTS objects = { sizeof(objects) };
+    int result = 0;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializePerfStats());
+    CHECK_STATUS(STATUS_SUCCESS, InitializeTrackedFiles(&TrackedFiles));
+    CHECK_STATUS(STATUS_SUCCESS, InitializeProcessCache());
+    CHECK_STATUS(STATUS_SUCCESS, InitializeCallbacks());
+    Volume.Name = HostString(L"\\Device\\HarddiskVolume1");
+    objects.Volume = &Volume;
+    objects.Instance = &Instance;
+    CHECK_STATUS(STATUS_SUCCESS, SetupVolumeDecision(&objects));
+    Process.ProcessId = ULongToHandle(4242);
+    Process.CreateTime = 1;
+    Process.ImageName = HostString(L"\\Device\\HarddiskVolume1\\Tools\\msbuild.exe");
+    HostSetCurrentProcess(&Process);
+
+    printf("%u rules, %u operations: 75%% opens, 8%% overwrites, 2%% delete-on-close, 10%% deletes, 5%% renames\n",
+        rules, operations);
+    for (ULONG i = 0; i < ARRAYSIZE(rulesets); i++) {
+        result |= RunRuleset(&rulesets[i], rules, operations, sims);
+    }
+
+    HostSetCurrentProcess(NULL);
+    HostExitProcess(&Process);
+    HostTeardownInstance(&Instance);
+    free(sims);
+    CleanupCallbacks();
+    CleanupProcessCache();
+    DeleteTrackedFiles(&TrackedFiles);
+    CleanupPerfStats();
+    return result | HostTestResult();
+}
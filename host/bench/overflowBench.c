@@ -0,0 +1,190 @@
+/**
+ * @file overflowBench.c
+ * @brief Each overflow policy under producers offering 2, 4 and 8 times what the consumer drains. Rounds keep the
+ *        ratio exact: every round the producers enqueue their share, then the consumer dequeues a fixed number of
+ *        records. Reports what was delivered, what was dropped, how stale the delivered records were, and whether
+ *        a priority record was ever refused; one in 16 records is a denied operation. Priority records may still be
+ *        overwritten later, like any old record, but a full queue must always make room for a new one.
+ */
+
+#include "hostBench.h"
+#include "circularQ.h"
+
+#define PRODUCERS 4
+#define DRAIN_PER_ROUND 32
+#define PRIORITY_EVERY 16
+#define QUEUE_BYTES (64 * 1024)
+
+typedef struct _OVERFLOW_RECORD {
+    ULONG Size;
+    ULONG Id;              // Never 0, which marks a gap
+    ULONG Producer;
+    ULONG Round;
+    ULONG Priority;
+    UCHAR Fill[28];
+} OVERFLOW_RECORD;
+
+typedef struct _OVERFLOW_RUN {
+    CIRCULAR_QUEUE Queue;
+    pthread_barrier_t Start;
+    pthread_barrier_t Done;
+    ULONG Rounds;
+    ULONG PerProducer;     // Records each producer offers per round
+    volatile LONG Round;
+    volatile LONG64 Produced;
+    volatile LONG64 PriorityProduced;
+    volatile LONG64 PriorityRefused;
+} OVERFLOW_RUN;
+
+typedef struct _OVERFLOW_PRODUCER {
+    OVERFLOW_RUN* Run;
+    ULONG Index;
+} OVERFLOW_PRODUCER;
+
+static void*
+OverflowProducer(void* Context)
+{
+    OVERFLOW_PRODUCER* producer = Context;
+    OVERFLOW_RUN* run = producer->Run;
+    QUEUE_RESERVATION reservation;
+    ULONG sequence = 0;
+
+    for (ULONG round = 0; round < run->Rounds; round++) {
+        pthread_barrier_wait(&run->Start);
+        for (ULONG i = 0; i < run->PerProducer; i++) {
+            BOOLEAN priority = (++sequence % PRIORITY_EVERY) == 0;
+            OVERFLOW_RECORD* record = BeginEnqueue(&run->Queue, sizeof(OVERFLOW_RECORD),
+                priority ? QUEUE_ENQUEUE_PRIORITY : 0, &reservation);
+            InterlockedIncrement64(&run->Produced);
+            if (priority) {
+                InterlockedIncrement64(&run->PriorityProduced);
+            }
+            if (!record) {
+                if (priority) {
+                    InterlockedIncrement64(&run->PriorityRefused);
+                }
+                continue;
+            }
+            record->Size = sizeof(OVERFLOW_RECORD);
+            record->Id = sequence;
+            record->Producer = producer->Index;
+            record->Round = round;
+            record->Priority = priority;
+            memset(record->Fill, (UCHAR)sequence, sizeof(record->Fill));
+            EndEnqueue(&run->Queue, &reservation);
+        }
+        pthread_barrier_wait(&run->Done);
+    }
+    return NULL;
+}
+
+static int
+RunPolicy(QUEUE_OVERFLOW_POLICY Policy, ULONG Multiple, ULONG Rounds)
+{
+    static const char* PolicyNames[] = { "oldest", "newest", "priority" };
+    static OVERFLOW_RUN run;
+    pthread_t threads[PRODUCERS];
+    OVERFLOW_PRODUCER producers[PRODUCERS];
+    UCHAR buffer[sizeof(OVERFLOW_RECORD)];
+    ULONG64 received = 0;
+    ULONG64 priorityReceived = 0;
+    ULONG64 lost = 0;
+    ULONG64 age = 0;
+    ULONG64 maxAge = 0;
+    ULONG corrupt = 0;
+    ULONG length;
+
+    RtlZeroMemory(&run, sizeof(run));
+    CHECK_STATUS(STATUS_SUCCESS, InitializeQueue(&run.Queue, QUEUE_BYTES));
+    SetQueuePolicy(&run.Queue, Policy);
+    run.Rounds = Rounds;
+    run.PerProducer = DRAIN_PER_ROUND * Multiple / PRODUCERS;
+    pthread_barrier_init(&run.Start, NULL, PRODUCERS + 1);
+    pthread_barrier_init(&run.Done, NULL, PRODUCERS + 1);
+    for (ULONG p = 0; p < PRODUCERS; p++) {
+        producers[p].Run = &run;
+        producers[p].Index = p;
+        pthread_create(&threads[p], NULL, OverflowProducer, &producers[p]);
+    }
+
+    ULONG64 start = HostNow();
+    for (ULONG round = 0; round <= Rounds; round++) {
+        // One extra round drains what is left, with nothing new offered
+        if (round < Rounds) {
+            pthread_barrier_wait(&run.Start);
+            pthread_barrier_wait(&run.Done);
+        }
+        for (ULONG drained = 0; round == Rounds || drained < DRAIN_PER_ROUND; ) {
+            if (!NT_SUCCESS(Dequeue(&run.Queue, buffer, sizeof(buffer), &length))) {
+                break;
+            }
+            OVERFLOW_RECORD* record = (OVERFLOW_RECORD*)buffer;
+            if (length >= sizeof(QUEUE_GAP_MARKER) && record->Id == 0) {
+                lost += ((PQUEUE_GAP_MARKER)buffer)->Lost;
+                continue;
+            }
+            if (length != sizeof(OVERFLOW_RECORD) || record->Fill[sizeof(record->Fill) - 1] != (UCHAR)record->Id) {
+                corrupt++;
+            }
+            received++;
+            priorityReceived += record->Priority != 0;
+            ULONG64 recordAge = round - min(record->Round, round);
+            age += recordAge;
+            maxAge = max(maxAge, recordAge);
+            drained++;
+        }
+    }
+    double seconds = (double)(HostNow() - start) / 1e9;
+    for (ULONG p = 0; p < PRODUCERS; p++) {
+        pthread_join(threads[p], NULL);
+    }
+
+    lost += (ULONG64)run.Queue.Lost;
+    ULONG64 produced = (ULONG64)run.Produced;
+    ULONG64 priorityLost = (ULONG64)run.PriorityProduced - priorityReceived;
+    ULONG64 priorityRefused = (ULONG64)run.PriorityRefused;
+    printf("%-8s %ux drain  delivered %6.2f%%  dropped %6.2f%%  overwritten %6llu  age %5.1f rounds (max %3llu)  "
+        "priority refused %5llu lost %5llu  %6.2f Mrecords/s\n",
+        PolicyNames[Policy], Multiple, 100.0 * received / produced, 100.0 * lost / produced,
+        (unsigned long long)run.Queue.Overwritten, (double)age / (double)max(received, 1), (unsigned long long)maxAge,
+        (unsigned long long)priorityRefused, (unsigned long long)priorityLost, produced / seconds / 1e6);
+
+    int result = 0;
+    if (corrupt || received + lost != produced) {
+        fprintf(stderr, "overflowBench: %u corrupt, %llu received and %llu lost of %llu\n", corrupt,
+            (unsigned long long)received, (unsigned long long)lost, (unsigned long long)produced);
+        result = 1;
+    }
+
+    // A round's records take a quarter of the queue at most, so the oldest record is always published and a denied
+    // operation can always make room
+    if (Policy != QueueDropNewest && priorityRefused) {
+        fprintf(stderr, "overflowBench: %llu priority records refused under %s\n", (unsigned long long)priorityRefused,
+            PolicyNames[Policy]);
+        result = 1;
+    }
+    if (Policy == QueueDropNewest && run.Queue.Overwritten) {
+        fprintf(stderr, "overflowBench: records overwritten under newest\n");
+        result = 1;
+    }
+
+    pthread_barrier_destroy(&run.Start);
+    pthread_barrier_destroy(&run.Done);
+    CleanupQueue(&run.Queue);
+    return result;
+}
+
+int
+main(int argc, char** argv)
+{
+    BOOLEAN quick = HostQuick(argc, argv);
+    ULONG multiples[] = { 2, 4, 8 };
+    int result = 0;
+
+    for (ULONG policy = 0; policy < QueueOverflowPolicyCount; policy++) {
+        for (ULONG i = 0; i < ARRAYSIZE(multiples); i++) {
+            result |= RunPolicy((QUEUE_OVERFLOW_POLICY)policy, multiples[i], quick ? 200 : 20000);
+        }
+    }
+    return result | HostTestResult();
+}
@@ -0,0 +1,187 @@
+/**
+ * @file pathTrieBench.c
+ * @brief Cost of matching names against directory rules in the path trie, as the rule count and the path depth
+ *        grow, against listing the same files one by one in the hash table.
+ *
+ * Each directory rule covers the files below it; the hash table is given one file of each directory instead, so
+ * both answer the same lookups. Half the lookups name a covered file, half a file of a directory with no rule, and
+ * every answer is checked. The trie is timed through PathTrieLookup alone and through GetTrackedFile, which tries
+ * the table first. The last rows protect one data directory of 200k files with a single directory rule and with
+ * 200k file rules, as the only way to cover them was before directory rules, and compare the time to add the
+ * rules, their memory and the lookups.
+ */
+
+#include "hostBench.h"
+#include "fileList.h"
+#include "pathTrie.h"
+
+#define PATH_CHARS 320
+#define NAMES 4096
+
+typedef struct _SHAPE {
+    ULONG Rules;
+    ULONG Depth;    // Components of a looked-up file name
+} SHAPE;
+
+// The directory of rule Index, deep enough for the names below it to have Depth components
+static const char*
+DirectoryText(char* Narrow, ULONG Index, ULONG Depth)
+{
+    int length = snprintf(Narrow, PATH_CHARS, "\\Device\\HarddiskVolume1\\Data\\r%06u", Index);
+    for (ULONG level = 5; level < Depth; level++) {
+        length += snprintf(Narrow + length, PATH_CHARS - length, "\\level%u", level);
+    }
+    return Narrow;
+}
+
+static PCWSTR
+DirectoryPath(PWCHAR Buffer, ULONG Index, ULONG Depth)
+{
+    char narrow[PATH_CHARS];
+    return HostPath(Buffer, PATH_CHARS, "%s", DirectoryText(narrow, Index, Depth));
+}
+
+static PCWSTR
+FilePath(PWCHAR Buffer, ULONG Index, ULONG Depth)
+{
+    char narrow[PATH_CHARS];
+    return HostPath(Buffer, PATH_CHARS, "%s\\Report %u.docx", DirectoryText(narrow, Index, Depth), Index);
+}
+
+static ULONG64
+RuleBytes(PTRACKED_FILES Files)
+{
+    TRACKED_FILES_MEMORY memory;
+    GetTrackedFilesMemory(Files, &memory);
+    return memory.Entries.Bytes + memory.Table.Bytes + memory.Directories.Bytes + memory.Filter.Bytes;
+}
+
+// Mean ns of a lookup over Rounds passes of the names, which must be found exactly when they are not Missing
+static double
+TimeLookups(PTRACKED_FILES Files, BOOLEAN TrieOnly, PUNICODE_STRING Names, PBOOLEAN Missing, ULONG Rounds,
+    PULONG Wrong)
+{
+    ULONG64 start = HostNow();
+    for (ULONG round = 0; round < Rounds; round++) {
+        for (ULONG i = 0; i < NAMES; i++) {
+            LONG found = TrieOnly ? PathTrieLookup(Files->Directories, &Names[i]) : GetTrackedFile(Files, &Names[i]);
+            *Wrong += (found != 0) == Missing[i];
+        }
+    }
+    return (double)(HostNow() - start) / ((double)Rounds * NAMES);
+}
+
+// Half the names below a ruled directory, half below the directory of the same depth Rules places further on
+static VOID
+PickNames(PWCHAR Text, PUNICODE_STRING Names, PBOOLEAN Missing, ULONG Rules, ULONG Depth)
+{
+    ULONG64 state = 0x9E3779B97F4A7C15ull;
+    for (ULONG i = 0; i < NAMES; i++) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        Missing[i] = (state >> 20) & 1;
+        ULONG index = (ULONG)((state >> 33) % Rules) + (Missing[i] ? Rules : 0);
+        RtlInitUnicodeString(&Names[i], FilePath(Text + (SIZE_T)i * PATH_CHARS, index, Depth));
+    }
+}
+
+static ULONG
+RunShape(const SHAPE* Shape, PWCHAR Text, PUNICODE_STRING Names, PBOOLEAN Missing, ULONG Rounds)
+{
+    WCHAR path[PATH_CHARS];
+    TRACKED_FILES directories;
+    TRACKED_FILES files;
+    ULONG wrong = 0;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeTrackedFiles(&directories));
+    CHECK_STATUS(STATUS_SUCCESS, InitializeTrackedFiles(&files));
+    for (ULONG i = 0; i < Shape->Rules; i++) {
+        wrong += !NT_SUCCESS(AddTrackedDirectory(&directories, DirectoryPath(path, i, Shape->Depth), RULE_DEFAULT));
+        wrong += !NT_SUCCESS(AddTrackedFile(&files, FilePath(path, i, Shape->Depth), RULE_DEFAULT));
+    }
+    PickNames(Text, Names, Missing, Shape->Rules, Shape->Depth);
+
+    double trieNs = TimeLookups(&directories, TRUE, Names, Missing, Rounds, &wrong);
+    double directoryNs = TimeLookups(&directories, FALSE, Names, Missing, Rounds, &wrong);
+    double fileNs = TimeLookups(&files, FALSE, Names, Missing, Rounds, &wrong);
+    printf("%7u rules  depth %2u  PathTrieLookup %6.1f ns  GetTrackedFile: directory rules %6.1f ns  "
+        "file rules %6.1f ns  %8.1f / %8.1f KB\n", Shape->Rules, Shape->Depth, trieNs, directoryNs, fileNs,
+        (double)RuleBytes(&directories) / 1024, (double)RuleBytes(&files) / 1024);
+
+    DeleteTrackedFiles(&files);
+    DeleteTrackedFiles(&directories);
+    return wrong;
+}
+
+// One data directory of Count files: one directory rule against a rule per file
+static ULONG
+RunDataDirectory(ULONG Count, PWCHAR Text, PUNICODE_STRING Names, PBOOLEAN Missing, ULONG Rounds)
+{
+    WCHAR path[PATH_CHARS];
+    TRACKED_FILES directories;
+    TRACKED_FILES files;
+    ULONG wrong = 0;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeTrackedFiles(&directories));
+    CHECK_STATUS(STATUS_SUCCESS, InitializeTrackedFiles(&files));
+    ULONG64 start = HostNow();
+    wrong += !NT_SUCCESS(AddTrackedDirectory(&directories, L"\\Device\\HarddiskVolume3\\Data\\", RULE_DEFAULT));
+    double directoryMs = (double)(HostNow() - start) / 1e6;
+    start = HostNow();
+    for (ULONG i = 0; i < Count; i++) {
+        PCWSTR name = HostPath(path, PATH_CHARS, "\\Device\\HarddiskVolume3\\Data\\record%07u.dat", i);
+        wrong += !NT_SUCCESS(AddTrackedFile(&files, name, RULE_DEFAULT));
+    }
+    double filesMs = (double)(HostNow() - start) / 1e6;
+
+    ULONG64 state = 0x9E3779B97F4A7C15ull;
+    for (ULONG i = 0; i < NAMES; i++) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        Missing[i] = (state >> 20) & 1;
+        RtlInitUnicodeString(&Names[i], HostPath(Text + (SIZE_T)i * PATH_CHARS, PATH_CHARS,
+            "\\Device\\HarddiskVolume3\\%s\\record%07u.dat", Missing[i] ? "Scratch" : "Data",
+            (ULONG)((state >> 33) % Count)));
+    }
+    double directoryNs = TimeLookups(&directories, FALSE, Names, Missing, Rounds, &wrong);
+    double fileNs = TimeLookups(&files, FALSE, Names, Missing, Rounds, &wrong);
+    printf("%u files in one directory  directory rule: add %8.3f ms  %8.1f KB  GetTrackedFile %6.1f ns\n", Count,
+        directoryMs, (double)RuleBytes(&directories) / 1024, directoryNs);
+    printf("%u files in one directory  file rules:     add %8.3f ms  %8.1f KB  GetTrackedFile %6.1f ns\n", Count,
+        filesMs, (double)RuleBytes(&files) / 1024, fileNs);
+
+    DeleteTrackedFiles(&files);
+    DeleteTrackedFiles(&directories);
+    return wrong;
+}
+
+int
+main(int argc, char** argv)
+{
+    BOOLEAN quick = HostQuick(argc, argv);
+    ULONG rounds = max((quick ? 20000 : 2000000) / NAMES, 1);
+    PWCHAR text = calloc((SIZE_T)NAMES * PATH_CHARS, sizeof(WCHAR));
+    PUNICODE_STRING names = calloc(NAMES, sizeof(UNICODE_STRING));
+    PBOOLEAN missing = calloc(NAMES, sizeof(BOOLEAN));
+    static const SHAPE shapes[] = {
+        { 10, 8 }, { 1000, 8 }, { 100000, 8 },
+        { 1000, 5 }, { 1000, 16 }, { 1000, 32 },
+    };
+    ULONG wrong = 0;
+
+    for (ULONG i = 0; i < ARRAYSIZE(shapes); i++) {
+        SHAPE shape = shapes[i];
+        if (quick) {
+            shape.Rules = min(shape.Rules, 2000);
+        }
+        wrong += RunShape(&shape, text, names, missing, rounds);
+    }
+    wrong += RunDataDirectory(quick ? 20000 : 200000, text, names, missing, rounds);
+
+    free(missing);
+    free(names);
+    free(text);
+    if (wrong) {
+        fprintf(stderr, "pathTrieBench: %u wrong answers or failed adds\n", wrong);
+        return 1;
+    }
+    return HostTestResult();
+}
@@ -0,0 +1,193 @@
+/**
+ * @file processBench.c
+ * @brief Cost of naming the process behind each event, through the process cache against a
+ *        SeLocateProcessImageName call per event as LogDeletion made before, under process storms.
+ *
+ * A few long-lived processes (services, explorer) raise half the events; the other half comes from short-lived
+ * processes, each raising a few events and exiting, its ID then reused by a new process with a later creation
+ * time, as build tools and installers do. Each scenario replays the same event sequence both ways and reports the
+ * cost per event, the share of events that had to query the image name, and the most names the cache held, which
+ * must stay within PROCESS_CACHE_BUCKETS * PROCESS_CACHE_WAYS. Every name returned is checked against the process
+ * that raised the event. On the host a query is an allocation and a copy; in the kernel it also walks the
+ * process's section object, so the time saved is larger there. The host's interrupt time, which a hit reads to
+ * age its entry, is a clock_gettime call rather than a read of shared user data, so its cost is printed too; the
+ * cost of reading the clock around each event is measured and taken off both paths.
+ */
+
+#include "hostBench.h"
+#include "processCache.h"
+
+#define NAME_CHARS 96
+#define LONG_LIVED 16
+
+typedef struct _STORM_PROCESS {
+    EPROCESS Process;
+    ULONG EventsLeft;      // Events a short-lived process raises before it exits
+    WCHAR Name[NAME_CHARS];
+} STORM_PROCESS;
+
+typedef struct _STORM {
+    const char* Name;
+    ULONG ShortLived;      // Short-lived processes alive at once
+    ULONG Lifetime;        // Events each raises, on average
+} STORM;
+
+typedef struct _STORM_RESULT {
+    double Ns;
+    LONG64 Queries;
+    ULONG64 MaxCached;
+    ULONG Wrong;
+} STORM_RESULT;
+
+// The mean cost of an empty HostNow pair, taken off every timed event
+static double
+ClockOverhead(VOID)
+{
+    ULONG64 total = 0;
+    for (ULONG i = 0; i < 100000; i++) {
+        ULONG64 start = HostNow();
+        total += HostNow() - start;
+    }
+    return (double)total / 100000;
+}
+
+// The mean cost of the KeQueryInterruptTime call a hit makes
+static double
+InterruptTimeCost(VOID)
+{
+    volatile ULONG64 sink = 0;
+    ULONG64 start = HostNow();
+    for (ULONG i = 0; i < 100000; i++) {
+        sink += KeQueryInterruptTime();
+    }
+    return (double)(HostNow() - start) / 100000;
+}
+
+static VOID
+StartProcess(STORM_PROCESS* Process, ULONG Id, LONG64 CreateTime, ULONG Lifetime, const char* Image)
+{
+    Process->Process.ProcessId = ULongToHandle(Id);
+    Process->Process.CreateTime = CreateTime;
+    Process->EventsLeft = Lifetime;
+    Process->Process.ImageName = HostString(HostPath(Process->Name, NAME_CHARS,
+        "\\Device\\HarddiskVolume1\\%s%lld.exe", Image, (long long)CreateTime));
+}
+
+// What LogOperation needs of a process: its name, copied into the message
+static BOOLEAN
+NameEvent(STORM_PROCESS* Process, BOOLEAN Cached, PWCHAR Copy)
+{
+    BOOLEAN right;
+
+    if (Cached) {
+        PPROCESS_NAME_ENTRY entry = LookupProcessName(&Process->Process);
+        if (!entry) {
+            return FALSE;
+        }
+        RtlCopyMemory(Copy, entry->Name.Buffer, entry->Name.Length);
+        right = RtlEqualUnicodeString(&entry->Name, &Process->Process.ImageName, FALSE);
+        ReleaseProcessName(entry);
+    }
+    else {
+        PUNICODE_STRING name = NULL;
+        if (!NT_SUCCESS(SeLocateProcessImageName(&Process->Process, &name))) {
+            return FALSE;
+        }
+        RtlCopyMemory(Copy, name->Buffer, name->Length);
+        right = RtlEqualUnicodeString(name, &Process->Process.ImageName, FALSE);
+        ExFreePool(name);
+    }
+    return right;
+}
+
+static VOID
+RunStorm(const STORM* Storm, ULONG Events, BOOLEAN Cached, double Overhead, STORM_RESULT* Result)
+{
+    STORM_PROCESS* processes = calloc(LONG_LIVED + Storm->ShortLived, sizeof(STORM_PROCESS));
+    WCHAR copy[NAME_CHARS];
+    ULONG64 state = 0x9E3779B97F4A7C15ull;
+    LONG64 createTime = 1;
+    ULONG64 elapsed = 0;
+    MEMORY_USAGE usage;
+
+    RtlZeroMemory(Result, sizeof(*Result));
+    if (Cached) {
+        InitializeProcessCache();
+    }
+    for (ULONG i = 0; i < LONG_LIVED; i++) {
+        StartProcess(&processes[i], 4 * (i + 100), createTime++, MAXULONG, "Windows\\System32\\svc");
+    }
+    for (ULONG i = 0; i < Storm->ShortLived; i++) {
+        StartProcess(&processes[LONG_LIVED + i], 4 * (i + 1000), createTime++, 1 + i % (2 * Storm->Lifetime),
+            "Tools\\cl");
+    }
+
+    LONG64 queries = HostImageNameQueries();
+    for (ULONG i = 0; i < Events; i++) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        ULONG pick = (ULONG)(state >> 33);
+        STORM_PROCESS* process = Storm->ShortLived && (pick & 1)
+            ? &processes[LONG_LIVED + (pick >> 1) % Storm->ShortLived]
+            : &processes[(pick >> 1) % LONG_LIVED];
+
+        ULONG64 start = HostNow();
+        BOOLEAN right = NameEvent(process, Cached, copy);
+        elapsed += HostNow() - start;
+        Result->Wrong += !right;
+
+        // The exit notification and the next process under the same ID stay outside the clock
+        if (process->EventsLeft != MAXULONG && --process->EventsLeft == 0) {
+            if (Cached) {
+                HostExitProcess(&process->Process);
+            }
+            StartProcess(process, HandleToULong(process->Process.ProcessId), createTime++,
+                1 + (pick >> 8) % (2 * Storm->Lifetime), "Tools\\cl");
+        }
+        if (Cached && (i & 255) == 0) {
+            QueryProcessCacheUsage(&usage);
+            Result->MaxCached = max(Result->MaxCached, usage.Count);
+        }
+    }
+    Result->Queries = HostImageNameQueries() - queries;
+    Result->Ns = max((double)elapsed / Events - Overhead, 0.0);
+
+    if (Cached) {
+        CleanupProcessCache();
+    }
+    free(processes);
+}
+
+int
+main(int argc, char** argv)
+{
+    BOOLEAN quick = HostQuick(argc, argv);
+    ULONG events = quick ? 20000 : 2000000;
+    static const STORM storms[] = {
+        { "steady", 0, 0 },
+        { "builds", 64, 8 },
+        { "storm", 400, 4 },
+        { "flood", 4000, 2 },
+    };
+    double overhead = ClockOverhead();
+    int result = 0;
+
+    printf("%u long-lived processes, %u events per run, clock pair %.1f ns taken off, interrupt time %.1f ns\n",
+        LONG_LIVED, events, overhead, InterruptTimeCost());
+    for (ULONG i = 0; i < ARRAYSIZE(storms); i++) {
+        STORM_RESULT cached;
+        STORM_RESULT uncached;
+        RunStorm(&storms[i], events, TRUE, overhead, &cached);
+        RunStorm(&storms[i], events, FALSE, overhead, &uncached);
+        printf("%-7s %5u short-lived  cached %7.1f ns/event  %6.2f%% queried  %4llu names max  "
+            "uncached %7.1f ns/event\n", storms[i].Name, storms[i].ShortLived, cached.Ns,
+            100.0 * (double)cached.Queries / events, (unsigned long long)cached.MaxCached, uncached.Ns);
+
+        if (cached.Wrong || uncached.Wrong || uncached.Queries != events
+            || cached.MaxCached > PROCESS_CACHE_BUCKETS * PROCESS_CACHE_WAYS) {
+            fprintf(stderr, "processBench: %s: %u wrong names cached, %u uncached, %llu names held\n",
+                storms[i].Name, cached.Wrong, uncached.Wrong, (unsigned long long)cached.MaxCached);
+            result = 1;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,715 @@
+/**
+ * @file replayBench.c
+ * @brief Replays a file trace through the driver's own callbacks on the host shim: every record becomes the
+ *        create and set-information callbacks the filter manager would issue for it, so PreCreateCallback,
+ *        PostCreateCallback, PreOperationCallback and PostOperationCallback decide it against the rules,
+ *        LogOperation names the process, and the message goes through the driver's encoder into a queue of the
+ *        driver's default size that a second thread drains and decodes as watchFlt does.
+ *
+ * The trace is the file named on the command line, written by watchFlt -t or ctlFlt -n, or else each of the
+ * scenarios ctlFlt generates in turn: a build tree cleanup, log rotation and a mass delete. --generate writes
+ * such a trace instead of replaying it. Records are replayed at full speed, or with --paced at the spacing they
+ * were recorded with.
+ *
+ * Per scenario it reports events per second, the mean cost of each stage from the driver's perf histograms and
+ * its own timing of the enqueue and the decode, and what the queue dropped. It fails if a message is neither
+ * delivered nor reported lost, if an event was not logged exactly once, or if a message does not decode.
+ */
+
+#include "hostBench.h"
+#include "callbacks.h"
+#include "decisionCache.h"
+#include "eventEncoder.h"
+#include "eventDecoder.h"
+#include "fileList.h"
+#include "fileTrace.h"
+#include "perfStats.h"
+#include "processCache.h"
+#include "userApi.h"
+
+#define DRAIN_BUFFER_SIZE (1024 * 1024)
+#define MAX_PATH_CHARS 128
+#define MAX_VOLUMES 16
+#define MAX_PROCESSES 256
+
+// What ctlFlt's generator attributes its records to, and how it shapes them
+#define GENERATED_PROCESS_ID 4242
+#define ROTATE_GENERATIONS 5
+#define ROTATE_SERVICES 8
+#define CLEANUP_FILES_PER_DIRECTORY 40
+
+PFLT_FILTER gFilterHandle;
+TRACKED_FILES TrackedFiles;
+
+typedef struct _REPLAY_EVENT {
+    LONG64 Time;
+    ULONG ProcessId;
+    UCHAR Operation;
+    UCHAR Flags;
+    UNICODE_STRING ProcessName;
+    UNICODE_STRING Path;
+} REPLAY_EVENT;
+
+// A trace in the format of fileTrace.h, header included, and its records
+typedef struct _TRACE {
+    PUCHAR Data;
+    SIZE_T Size;
+    SIZE_T Capacity;
+    REPLAY_EVENT* Events;
+    ULONG Count;
+} TRACE;
+
+// One volume the trace touches: the instance the callbacks see it through, and the directory rule over all of it
+typedef struct _REPLAY_VOLUME {
+    FLT_VOLUME Volume;
+    FLT_INSTANCE Instance;
+    WCHAR Name[MAX_PATH_CHARS];
+} REPLAY_VOLUME;
+
+// What the filter manager hands the callbacks for one operation
+typedef struct _OPERATION_SIM {
+    HOST_FILE File;
+    FILE_OBJECT FileObject;
+    FLT_IO_PARAMETER_BLOCK Iopb;
+    FLT_CALLBACK_DATA Data;
+    FLT_RELATED_OBJECTS Objects;
+    FILE_DISPOSITION_INFORMATION Disposition;
+} OPERATION_SIM;
+
+// The queue LogOperation sends to, through SendToUser below
+typedef struct _REPLAY_QUEUE {
+    EVENT_STRINGS Strings;
+    CIRCULAR_QUEUE Queue;
+    ULONG64 EnqueueNanoseconds;
+    ULONG64 Logged;
+} REPLAY_QUEUE;
+
+typedef struct _CONSUMER {
+    REPLAY_QUEUE* Queue;
+    EVENT_STRING_TABLE Table;
+    PUCHAR Buffer;
+    volatile LONG Done;
+    ULONG64 Messages;
+    ULONG64 Lost;
+    ULONG64 Unknown;
+    ULONG64 Wrong;
+    ULONG64 Nanoseconds;
+} CONSUMER;
+
+static REPLAY_QUEUE* CurrentQueue;
+static REPLAY_VOLUME Volumes[MAX_VOLUMES];
+static ULONG VolumeCount;
+static EPROCESS Processes[MAX_PROCESSES];
+static ULONG ProcessCount;
+
+// Stands in for the driver's SendToUser, which needs the device and its sections: the same encoder, into the
+// replay's queue, with the same counters
+NTSTATUS
+SendToUser(PUNICODE_STRING processName, HANDLE processId, LONG64 processCreateTime, PUNICODE_STRING name,
+    LONG operation, BOOLEAN denied)
+{
+    REPLAY_QUEUE* queue = CurrentQueue;
+    ULONG64 start = HostNow();
+    NTSTATUS status = QueueDeleteMessage(&queue->Strings, &queue->Queue, processName, processId, processCreateTime,
+        name, operation, denied);
+    queue->EnqueueNanoseconds += HostNow() - start;
+    queue->Logged++;
+    PerfCount(NT_SUCCESS(status) ? PERF_COUNTER_ENQUEUED : PERF_COUNTER_DROPPED);
+    return status;
+}
+
+static VOID
+AppendRecord(TRACE* Trace, LONG64 Time, ULONG ProcessId, UCHAR Operation, UCHAR Flags, PCWSTR ProcessName,
+    PCWSTR Path)
+{
+    UNICODE_STRING processName = HostString(ProcessName);
+    UNICODE_STRING path = HostString(Path);
+    ULONG size = FILE_TRACE_RECORD_SIZE(processName.Length, path.Length);
+    if (Trace->Size + size > Trace->Capacity) {
+        Trace->Capacity = max(Trace->Capacity * 2, Trace->Size + size);
+        Trace->Data = realloc(Trace->Data, Trace->Capacity);
+    }
+
+    PFILE_TRACE_RECORD record = (PFILE_TRACE_RECORD)(Trace->Data + Trace->Size);
+    record->Time = Time;
+    record->ProcessId = ProcessId;
+    record->Operation = Operation;
+    record->Flags = Flags;
+    record->ProcessNameLength = processName.Length;
+    record->PathLength = path.Length;
+    memcpy(record->Names, processName.Buffer, processName.Length);
+    memcpy((PUCHAR)record->Names + processName.Length, path.Buffer, path.Length);
+    Trace->Size += size;
+}
+
+// The records ctlFlt -n writes for the same scenario and count
+static BOOLEAN
+GenerateTrace(TRACE* Trace, const char* Scenario, ULONG Count)
+{
+    static const char* Scenarios[] = { "cleanup", "rotate", "mass" };
+    ULONG kind = 0;
+    while (kind < ARRAYSIZE(Scenarios) && strcmp(Scenario, Scenarios[kind]) != 0) {
+        kind++;
+    }
+    if (kind == ARRAYSIZE(Scenarios)) {
+        return FALSE;
+    }
+
+    FILE_TRACE_HEADER header = { FILE_TRACE_MAGIC, FILE_TRACE_VERSION };
+    WCHAR path[MAX_PATH_CHARS];
+    WCHAR process[MAX_PATH_CHARS];
+    LONG64 time = 0;
+
+    Trace->Capacity = sizeof(header) + (SIZE_T)Count * FILE_TRACE_RECORD_SIZE(64, 160);
+    Trace->Data = malloc(Trace->Capacity);
+    memcpy(Trace->Data, &header, sizeof(header));
+    Trace->Size = sizeof(header);
+
+    for (ULONG i = 0; i < Count; i++) {
+        UCHAR operation = RULE_OP_DELETE;
+        switch (kind) {
+        case 0:
+            HostPath(path, MAX_PATH_CHARS, "\\Device\\HarddiskVolume1\\Replay\\build\\obj\\module%04u\\unit%05u.obj",
+                i / CLEANUP_FILES_PER_DIRECTORY, i);
+            HostPath(process, MAX_PATH_CHARS, "\\Device\\HarddiskVolume1\\Tools\\msbuild.exe");
+            time += 500;
+            break;
+
+        case 1: {
+            ULONG step = i % (ROTATE_GENERATIONS + 2);
+            ULONG service = i / (ROTATE_GENERATIONS + 2) % ROTATE_SERVICES;
+            HostPath(process, MAX_PATH_CHARS, "\\Device\\HarddiskVolume1\\Services\\logrotate.exe");
+            if (step == 0) {
+                HostPath(path, MAX_PATH_CHARS, "\\Device\\HarddiskVolume1\\Replay\\logs\\service%u\\app.log.%u",
+                    service, ROTATE_GENERATIONS);
+                time += 1000000;
+            }
+            else if (step < ROTATE_GENERATIONS) {
+                HostPath(path, MAX_PATH_CHARS, "\\Device\\HarddiskVolume1\\Replay\\logs\\service%u\\app.log.%u",
+                    service, ROTATE_GENERATIONS - step);
+                operation = RULE_OP_RENAME;
+                time += 100;
+            }
+            else {
+                HostPath(path, MAX_PATH_CHARS, "\\Device\\HarddiskVolume1\\Replay\\logs\\service%u\\app.log", service);
+                operation = step == ROTATE_GENERATIONS ? RULE_OP_RENAME : RULE_OP_OVERWRITE;
+                time += 100;
+            }
+            break;
+        }
+
+        default:
+            HostPath(path, MAX_PATH_CHARS, "\\Device\\HarddiskVolume1\\Replay\\mass\\item%07u.dat", i);
+            HostPath(process, MAX_PATH_CHARS, "\\Device\\HarddiskVolume1\\Windows\\System32\\cmd.exe");
+            time += 50;
+            break;
+        }
+        AppendRecord(Trace, time, GENERATED_PROCESS_ID, operation, 0, process, path);
+    }
+    return TRUE;
+}
+
+static BOOLEAN
+LoadTrace(TRACE* Trace, const char* Name)
+{
+    FILE* file = fopen(Name, "rb");
+    if (!file) {
+        return FALSE;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    Trace->Data = malloc(size > 0 ? size : 1);
+    Trace->Size = Trace->Capacity = size > 0 ? (SIZE_T)size : 0;
+    BOOLEAN read = size >= (long)sizeof(FILE_TRACE_HEADER) && fread(Trace->Data, 1, size, file) == (size_t)size;
+    fclose(file);
+    return read;
+}
+
+// Points the events at the records; returns FALSE if the header is not a trace's
+static BOOLEAN
+ParseTrace(TRACE* Trace)
+{
+    PFILE_TRACE_HEADER header = (PFILE_TRACE_HEADER)Trace->Data;
+    if (Trace->Size < sizeof(*header) || header->Magic != FILE_TRACE_MAGIC || header->Version != FILE_TRACE_VERSION) {
+        return FALSE;
+    }
+
+    ULONG capacity = 1024;
+    Trace->Events = malloc(capacity * sizeof(REPLAY_EVENT));
+    for (SIZE_T offset = sizeof(*header); offset + FIELD_OFFSET(FILE_TRACE_RECORD, Names) <= Trace->Size; ) {
+        PFILE_TRACE_RECORD record = (PFILE_TRACE_RECORD)(Trace->Data + offset);
+        ULONG recordSize = FILE_TRACE_RECORD_SIZE(record->ProcessNameLength, record->PathLength);
+        if (offset + recordSize > Trace->Size || record->Operation >= RULE_OP_COUNT) {
+            break;
+        }
+        offset += recordSize;
+
+        if (Trace->Count == capacity) {
+            capacity *= 2;
+            Trace->Events = realloc(Trace->Events, capacity * sizeof(REPLAY_EVENT));
+        }
+        REPLAY_EVENT* event = &Trace->Events[Trace->Count++];
+        event->Time = record->Time;
+        event->ProcessId = record->ProcessId;
+        event->Operation = record->Operation;
+        event->Flags = record->Flags;
+        event->ProcessName.Buffer = record->Names;
+        event->ProcessName.Length = event->ProcessName.MaximumLength = record->ProcessNameLength;
+        event->Path.Buffer = (PWCH)((PUCHAR)record->Names + record->ProcessNameLength);
+        event->Path.Length = event->Path.MaximumLength = record->PathLength;
+    }
+    return Trace->Count != 0;
+}
+
+static VOID
+FreeTrace(TRACE* Trace)
+{
+    free(Trace->Events);
+    free(Trace->Data);
+    RtlZeroMemory(Trace, sizeof(*Trace));
+}
+
+// Length in bytes of the "\Device\Name" a path starts with, 0 if it has none
+static USHORT
+VolumeLength(PCUNICODE_STRING Path)
+{
+    ULONG separators = 0;
+    for (USHORT i = 0; i < Path->Length / sizeof(WCHAR); i++) {
+        if (Path->Buffer[i] == L'\\' && ++separators == 3) {
+            return i * sizeof(WCHAR);
+        }
+    }
+    return 0;
+}
+
+static REPLAY_VOLUME*
+FindVolume(PCUNICODE_STRING Path)
+{
+    USHORT length = VolumeLength(Path);
+    for (ULONG i = 0; length && i < VolumeCount; i++) {
+        if (Volumes[i].Volume.Name.Length == length && memcmp(Volumes[i].Name, Path->Buffer, length) == 0) {
+            return &Volumes[i];
+        }
+    }
+    return NULL;
+}
+
+// Adds or removes the rules of the files whose operations the trace shows denied; a file denied more than one
+// operation keeps the rule of the first, the others are audited
+static VOID
+SetDenyRules(TRACE* Trace, BOOLEAN Add)
+{
+    for (ULONG i = 0; i < Trace->Count; i++) {
+        REPLAY_EVENT* event = &Trace->Events[i];
+        if ((event->Flags & FILE_TRACE_DENIED) && event->Path.Length / sizeof(WCHAR) < MAX_PATH_CHARS) {
+            WCHAR path[MAX_PATH_CHARS];
+            memcpy(path, event->Path.Buffer, event->Path.Length);
+            path[event->Path.Length / sizeof(WCHAR)] = L'\0';
+            if (Add) {
+                AddTrackedFile(&TrackedFiles, path, RULE_OP_BITS(event->Operation));
+            }
+            else {
+                RemoveTrackedFile(&TrackedFiles, path);
+            }
+        }
+    }
+}
+
+// Every volume of the trace gets an instance and a rule that audits every operation on it
+static BOOLEAN
+SetupRules(TRACE* Trace)
+{
+    for (ULONG i = 0; i < Trace->Count; i++) {
+        REPLAY_EVENT* event = &Trace->Events[i];
+        USHORT length = VolumeLength(&event->Path);
+        if (!length || FindVolume(&event->Path)) {
+            continue;
+        }
+        if (VolumeCount == MAX_VOLUMES || length / sizeof(WCHAR) + 2 > MAX_PATH_CHARS) {
+            fprintf(stderr, "replayBench: too many or too long volume names in the trace\n");
+            return FALSE;
+        }
+
+        REPLAY_VOLUME* volume = &Volumes[VolumeCount++];
+        memcpy(volume->Name, event->Path.Buffer, length);
+        volume->Name[length / sizeof(WCHAR)] = L'\\';
+        volume->Name[length / sizeof(WCHAR) + 1] = L'\0';
+        volume->Volume.Name.Buffer = volume->Name;
+        volume->Volume.Name.Length = volume->Volume.Name.MaximumLength = length;
+
+        LONG all = RULE_TRACK(RULE_OP_DELETE) | RULE_TRACK(RULE_OP_RENAME) | RULE_TRACK(RULE_OP_OVERWRITE)
+            | RULE_TRACK(RULE_OP_DELETE_ON_CLOSE);
+        FLT_RELATED_OBJECTS objects = { sizeof(objects) };
+        objects.Volume = &volume->Volume;
+        objects.Instance = &volume->Instance;
+        CHECK_STATUS(STATUS_SUCCESS, AddTrackedDirectory(&TrackedFiles, volume->Name, all));
+        CHECK_STATUS(STATUS_SUCCESS, SetupVolumeDecision(&objects));
+    }
+
+    SetDenyRules(Trace, TRUE);
+    return VolumeCount != 0;
+}
+
+// The process a record names; the trace's process id with a different image is a different process
+static PEPROCESS
+FindProcess(REPLAY_EVENT* Event)
+{
+    static ULONG last;
+    for (ULONG n = 0; n < ProcessCount; n++) {
+        ULONG i = (last + n) % ProcessCount;
+        PEPROCESS process = &Processes[i];
+        if (HandleToULong(process->ProcessId) == Event->ProcessId
+            && RtlEqualUnicodeString(&process->ImageName, &Event->ProcessName, FALSE)) {
+            last = i;
+            return process;
+        }
+    }
+    if (ProcessCount == MAX_PROCESSES) {
+        return NULL;
+    }
+
+    PEPROCESS process = &Processes[ProcessCount];
+    process->ProcessId = ULongToHandle(Event->ProcessId);
+    process->CreateTime = ProcessCount + 1;
+    process->ImageName = Event->ProcessName;
+    last = ProcessCount++;
+    return process;
+}
+
+static VOID
+ExitProcesses(VOID)
+{
+    HostSetCurrentProcess(NULL);
+    for (ULONG i = 0; i < ProcessCount; i++) {
+        HostExitProcess(&Processes[i]);
+    }
+    ProcessCount = 0;
+}
+
+static VOID
+OpenOperation(OPERATION_SIM* Sim, REPLAY_EVENT* Event, REPLAY_VOLUME* Volume)
+{
+    RtlZeroMemory(Sim, sizeof(*Sim));
+    Sim->File.Name = Event->Path;
+    Sim->FileObject.File = &Sim->File;
+    Sim->Iopb.TargetFileObject = &Sim->FileObject;
+    Sim->Iopb.TargetInstance = &Volume->Instance;
+    Sim->Data.Iopb = &Sim->Iopb;
+    Sim->Objects.Size = sizeof(Sim->Objects);
+    Sim->Objects.Volume = &Volume->Volume;
+    Sim->Objects.Instance = &Volume->Instance;
+    Sim->Objects.FileObject = &Sim->FileObject;
+}
+
+// A create with the given options, and its completion with the given result if the filter asks for it
+static VOID
+Create(OPERATION_SIM* Sim, ULONG Options, ULONG_PTR Information)
+{
+    PVOID context;
+
+    Sim->Iopb.MajorFunction = IRP_MJ_CREATE;
+    Sim->Iopb.Parameters.Create.Options = Options;
+    if (PreCreateCallback(&Sim->Data, &Sim->Objects, &context) == FLT_PREOP_SUCCESS_WITH_CALLBACK) {
+        Sim->Data.IoStatus.Status = STATUS_SUCCESS;
+        Sim->Data.IoStatus.Information = Information;
+        PostCreateCallback(&Sim->Data, &Sim->Objects, context, 0);
+    }
+}
+
+// A set-information call of the given class, and its completion if the filter asks for it
+static VOID
+SetInformation(OPERATION_SIM* Sim, FILE_INFORMATION_CLASS InfoClass)
+{
+    PVOID context;
+
+    RtlZeroMemory(&Sim->Iopb.Parameters, sizeof(Sim->Iopb.Parameters));
+    RtlZeroMemory(&Sim->Data.IoStatus, sizeof(Sim->Data.IoStatus));
+    Sim->Iopb.MajorFunction = IRP_MJ_SET_INFORMATION;
+    Sim->Iopb.Parameters.SetFileInformation.FileInformationClass = InfoClass;
+    Sim->Iopb.Parameters.SetFileInformation.Length = sizeof(Sim->Disposition);
+    Sim->Iopb.Parameters.SetFileInformation.InfoBuffer = &Sim->Disposition;
+    Sim->Disposition.DeleteFile = TRUE;
+    if (PreOperationCallback(&Sim->Data, &Sim->Objects, &context) == FLT_PREOP_SUCCESS_WITH_CALLBACK) {
+        Sim->Data.IoStatus.Status = STATUS_SUCCESS;
+        PostOperationCallback(&Sim->Data, &Sim->Objects, context, 0);
+    }
+}
+
+// Issues what the filter manager sees for the record: a deletion or rename opens the file and then sets its
+// disposition or renames it through that handle, an overwrite or delete-on-close is a single create
+static BOOLEAN
+ReplayEvent(REPLAY_EVENT* Event)
+{
+    OPERATION_SIM sim;
+    REPLAY_VOLUME* volume = FindVolume(&Event->Path);
+    if (!volume) {
+        return FALSE;
+    }
+
+    HostSetCurrentProcess(FindProcess(Event));
+    OpenOperation(&sim, Event, volume);
+    switch (Event->Operation) {
+    case RULE_OP_DELETE:
+        Create(&sim, FILE_OPEN << 24, FILE_OPENED);
+        SetInformation(&sim, FileDispositionInformation);
+        break;
+    case RULE_OP_RENAME:
+        Create(&sim, FILE_OPEN << 24, FILE_OPENED);
+        SetInformation(&sim, FileRenameInformation);
+        break;
+    case RULE_OP_OVERWRITE:
+        Create(&sim, FILE_OVERWRITE_IF << 24, FILE_OVERWRITTEN);
+        break;
+    default:
+        Create(&sim, (FILE_OPEN << 24) | FILE_DELETE_ON_CLOSE, FILE_OPENED);
+        break;
+    }
+    HostCloseFileObject(&sim.FileObject);
+    return TRUE;
+}
+
+// Drains one batch the way watchFlt does; returns FALSE if the queue was empty
+static BOOLEAN
+Consume(CONSUMER* Consumer)
+{
+    DECODED_EVENT event;
+    ULONG count;
+    ULONG length;
+
+    if (!NT_SUCCESS(DequeueBatch(&Consumer->Queue->Queue, Consumer->Buffer, DRAIN_BUFFER_SIZE, &count, &length))) {
+        return FALSE;
+    }
+    ULONG64 start = HostNow();
+    for (ULONG offset = 0, i = 0; i < count; i++) {
+        PDELETE_MESSAGE message = (PDELETE_MESSAGE)(Consumer->Buffer + offset);
+        offset = (offset + message->Size + QUEUE_BATCH_ALIGNMENT - 1) & ~(QUEUE_BATCH_ALIGNMENT - 1);
+        if (message->MessageId == 0) {
+            Consumer->Lost += ((PQUEUE_GAP_MARKER)message)->Lost;
+        }
+        else if (!DecodeDeleteMessage(&Consumer->Table, message,
+            length - (ULONG)((PUCHAR)message - Consumer->Buffer), &event)) {
+            Consumer->Wrong++;
+        }
+        else {
+            Consumer->Messages++;
+            Consumer->Unknown += !event.ProcessName || !event.Directory;
+        }
+    }
+    Consumer->Nanoseconds += HostNow() - start;
+    return TRUE;
+}
+
+static void*
+Consumer(void* Context)
+{
+    CONSUMER* consumer = Context;
+    for (;;) {
+        BOOLEAN done = ReadAcquire(&consumer->Done) != 0;
+        if (!Consume(consumer)) {
+            if (done) {
+                break;
+            }
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+// Waits until the record's offset from the first one has passed since the replay started
+static VOID
+Pace(REPLAY_EVENT* Event, LONG64 FirstTime, ULONG64 Start)
+{
+    ULONG64 due = Start + (ULONG64)(Event->Time - FirstTime) * 100;
+    for (ULONG64 now = HostNow(); now < due; now = HostNow()) {
+        if (due - now > 100000) {
+            usleep((useconds_t)((due - now) / 1000 - 50));
+        }
+    }
+}
+
+static VOID
+PrintStage(const char* Stage, PERF_STATS* Before, PERF_STATS* After, ULONG Histogram)
+{
+    ULONG64 count = After->Histograms[Histogram].Count - Before->Histograms[Histogram].Count;
+    ULONG64 ticks = After->Histograms[Histogram].TotalTicks - Before->Histograms[Histogram].TotalTicks;
+    printf("  %-16s %10llu %10.1f\n", Stage, (unsigned long long)count,
+        (double)ticks * 1e9 / (double)After->TicksPerSecond / (double)max(count, 1));
+}
+
+static ULONG64
+CounterDelta(PERF_STATS* Before, PERF_STATS* After, ULONG Counter)
+{
+    return After->Counters[Counter] - Before->Counters[Counter];
+}
+
+static int
+Replay(const char* Name, TRACE* Trace, QUEUE_OVERFLOW_POLICY Policy, BOOLEAN Paced)
+{
+    static REPLAY_QUEUE queue;
+    static CONSUMER consumer;
+    static PERF_STATS before;
+    static PERF_STATS after;
+    pthread_t thread;
+    ULONG replayed = 0;
+    int result = 0;
+
+    if (!SetupRules(Trace)) {
+        fprintf(stderr, "replayBench: %s: no record names a volume\n", Name);
+        return 1;
+    }
+    RtlZeroMemory(&queue, sizeof(queue));
+    RtlZeroMemory(&consumer, sizeof(consumer));
+    CHECK_STATUS(STATUS_SUCCESS, InitializeEventStrings(&queue.Strings));
+    CHECK_STATUS(STATUS_SUCCESS, InitializeQueue(&queue.Queue, MESSAGE_QUEUE_SIZE));
+    SetQueuePolicy(&queue.Queue, Policy);
+    CurrentQueue = &queue;
+    consumer.Queue = &queue;
+    consumer.Buffer = malloc(DRAIN_BUFFER_SIZE);
+    pthread_create(&thread, NULL, Consumer, &consumer);
+
+    QueryPerfStats(&before);
+    ULONG64 start = HostNow();
+    for (ULONG i = 0; i < Trace->Count; i++) {
+        if (Paced) {
+            Pace(&Trace->Events[i], Trace->Events[0].Time, start);
+        }
+        replayed += ReplayEvent(&Trace->Events[i]);
+    }
+    double seconds = (double)(HostNow() - start) / 1e9;
+    QueryPerfStats(&after);
+    WriteRelease(&consumer.Done, 1);
+    pthread_join(thread, NULL);
+
+    ULONG64 dropped = ReadAcquire64(&queue.Queue.Dropped);
+    ULONG64 unreported = ReadAcquire64(&queue.Queue.Lost);
+    printf("%s: %u events in %.3f s, %.0f events/s%s, %ld processors\n", Name, replayed, seconds,
+        (double)replayed / seconds, Paced ? " paced" : "", sysconf(_SC_NPROCESSORS_ONLN));
+    printf("  %-16s %10s %10s\n", "stage", "calls", "mean ns");
+    PrintStage("pre-operation", &before, &after, PERF_HISTOGRAM_PRE_OPERATION);
+    PrintStage("post-operation", &before, &after, PERF_HISTOGRAM_POST_OPERATION);
+    PrintStage("name query", &before, &after, PERF_HISTOGRAM_NAME_QUERY);
+    PrintStage("rule lookup", &before, &after, PERF_HISTOGRAM_RULE_LOOKUP);
+    printf("  %-16s %10llu %10.1f\n", "enqueue", (unsigned long long)queue.Logged,
+        (double)queue.EnqueueNanoseconds / (double)max(queue.Logged, 1));
+    printf("  %-16s %10llu %10.1f\n", "decode", (unsigned long long)consumer.Messages,
+        (double)consumer.Nanoseconds / (double)max(consumer.Messages, 1));
+    printf("  queue: %llu logged, %llu delivered, %llu dropped (%.2f%%), %llu denied, %llu unknown names; "
+        "decision cache %llu hits, %llu misses\n",
+        (unsigned long long)queue.Logged, (unsigned long long)consumer.Messages, (unsigned long long)dropped,
+        100.0 * (double)dropped / (double)max(queue.Logged, 1),
+        (unsigned long long)CounterDelta(&before, &after, PERF_COUNTER_DENIED),
+        (unsigned long long)consumer.Unknown,
+        (unsigned long long)CounterDelta(&before, &after, PERF_COUNTER_CACHE_HITS),
+        (unsigned long long)CounterDelta(&before, &after, PERF_COUNTER_CACHE_MISSES));
+
+    // Every record is below a rule, so each is logged once, and every message is delivered or reported lost
+    ULONG64 sent = CounterDelta(&before, &after, PERF_COUNTER_ENQUEUED)
+        + CounterDelta(&before, &after, PERF_COUNTER_DROPPED);
+    if (queue.Logged != replayed || sent != replayed || consumer.Messages + consumer.Lost + unreported != sent
+        || dropped != consumer.Lost + unreported || consumer.Wrong) {
+        fprintf(stderr, "replayBench: %s: %u events, %llu logged, %llu queued, %llu delivered, %llu lost, %llu "
+            "dropped, %llu undecodable\n", Name, replayed, (unsigned long long)queue.Logged,
+            (unsigned long long)sent, (unsigned long long)consumer.Messages,
+            (unsigned long long)(consumer.Lost + unreported), (unsigned long long)dropped,
+            (unsigned long long)consumer.Wrong);
+        result = 1;
+    }
+
+    CurrentQueue = NULL;
+    ExitProcesses();
+    for (ULONG i = 0; i < VolumeCount; i++) {
+        CHECK_STATUS(STATUS_SUCCESS, RemoveTrackedDirectory(&TrackedFiles, Volumes[i].Name));
+        HostTeardownInstance(&Volumes[i].Instance);
+    }
+    VolumeCount = 0;
+    SetDenyRules(Trace, FALSE);
+    ClearEventStrings(&consumer.Table);
+    free(consumer.Buffer);
+    CleanupQueue(&queue.Queue);
+    CleanupEventStrings(&queue.Strings);
+    return result;
+}
+
+static int
+Usage(VOID)
+{
+    fprintf(stderr, "usage: replayBench [--quick] [--paced] [--policy oldest|newest|priority] [TRACE]\n"
+        "       replayBench --generate cleanup|rotate|mass COUNT TRACE\n");
+    return 1;
+}
+
+int
+main(int argc, char** argv)
+{
+    static const char* Policies[] = { "oldest", "newest", "priority" };
+    static const char* Scenarios[] = { "cleanup", "rotate", "mass" };
+    BOOLEAN quick = HostQuick(argc, argv);
+    BOOLEAN paced = FALSE;
+    QUEUE_OVERFLOW_POLICY policy = QueueDropOldest;
+    const char* traceName = NULL;
+    TRACE trace = { 0 };
+    int result = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--generate") == 0) {
+            if (argc - i != 4 || !GenerateTrace(&trace, argv[i + 1], strtoul(argv[i + 2], NULL, 0))) {
+                return Usage();
+            }
+            FILE* file = fopen(argv[i + 3], "wb");
+            BOOLEAN written = file && fwrite(trace.Data, 1, trace.Size, file) == trace.Size;
+            if (file && fclose(file) != 0) {
+                written = FALSE;
+            }
+            if (!written) {
+                fprintf(stderr, "replayBench: failed to write %s\n", argv[i + 3]);
+            }
+            FreeTrace(&trace);
+            return written ? 0 : 1;
+        }
+        else if (strcmp(argv[i], "--paced") == 0) {
+            paced = TRUE;
+        }
+        else if (strcmp(argv[i], "--policy") == 0 && i + 1 < argc) {
+            i++;
+            for (policy = 0; policy < ARRAYSIZE(Policies) && strcmp(argv[i], Policies[policy]) != 0; policy++) {
+            }
+            if (policy == ARRAYSIZE(Policies)) {
+                return Usage();
+            }
+        }
+        else if (strcmp(argv[i], "--quick") != 0) {
+            traceName = argv[i];
+        }
+    }
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializePerfStats());
+    CHECK_STATUS(STATUS_SUCCESS, InitializeTrackedFiles(&TrackedFiles));
+    CHECK_STATUS(STATUS_SUCCESS, InitializeProcessCache());
+    CHECK_STATUS(STATUS_SUCCESS, InitializeCallbacks());
+
+    if (traceName) {
+        if (!LoadTrace(&trace, traceName) || !ParseTrace(&trace)) {
+            fprintf(stderr, "replayBench: %s is not a trace with records\n", traceName);
+            result = 1;
+        }
+        else {
+            result |= Replay(traceName, &trace, policy, paced);
+        }
+        FreeTrace(&trace);
+    }
+    else {
+        for (ULONG i = 0; i < ARRAYSIZE(Scenarios); i++) {
+            GenerateTrace(&trace, Scenarios[i], quick ? 20000 : 200000);
+            ParseTrace(&trace);
+            result |= Replay(Scenarios[i], &trace, policy, paced);
+            FreeTrace(&trace);
+        }
+    }
+
+    CleanupCallbacks();
+    CleanupProcessCache();
+    DeleteTrackedFiles(&TrackedFiles);
+    CleanupPerfStats();
+    return result | HostTestResult();
+}
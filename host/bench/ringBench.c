@@ -0,0 +1,312 @@
+/**
+ * @file ringBench.c
+ * @brief Throughput of 1 to 64 producer threads writing deletion-sized records into a shared ring that a consumer
+ *        thread reads in place through its read-only view, next to the same load on a driver-owned queue drained
+ *        with DequeueBatch. Producers zero the space the consumer released, so that cost shows up on their side.
+ *
+ * For comparison, the same events also go through a model of the queue the records replaced: a spinlock over
+ * slots of the old fixed 1084-byte DELETE_MESSAGE, two 260-character names and a date copied whole in and out,
+ * one message per dequeue. Every run reports the bytes each event occupies in the ring.
+ */
+
+#include "hostBench.h"
+#include "circularQ.h"
+
+#define PAYLOAD_LENGTH 200
+#define RING_SIZE (1024 * 1024)
+#define BATCH_BUFFER_SIZE (256 * 1024)
+
+// Bytes a record of the payload takes in the ring, header and alignment included
+#define RECORD_SIZE ((sizeof(QUEUE_RECORD_HEADER) + PAYLOAD_LENGTH + QUEUE_RECORD_ALIGNMENT - 1) \
+    & ~(QUEUE_RECORD_ALIGNMENT - 1))
+
+// The message of the fixed-slot queue: an id, ProcessName[260], FilePath[260] and DateTime[20]
+#define SLOT_NAME_CHARS 260
+#define SLOT_MESSAGE_SIZE (sizeof(ULONG) + (2 * SLOT_NAME_CHARS + 20) * sizeof(WCHAR))
+
+typedef enum _RING_KIND {
+    RingMapped,
+    RingBatched,
+    RingSlots
+} RING_KIND;
+
+// The queue before variable-length records, as circularQ.c had it: full slots overwrite the oldest message
+typedef struct _SLOT_QUEUE {
+    KSPIN_LOCK Lock;
+    PUCHAR Buffer;
+    ULONG MaxMessages;
+    ULONG Head;
+    ULONG Tail;
+    ULONG Count;
+    LONG64 Overwritten;
+} SLOT_QUEUE;
+
+typedef struct _RING_RUN {
+    CIRCULAR_QUEUE Queue;
+    QUEUE_USER_MAPPING Mapping;
+    SLOT_QUEUE Slots;
+    RING_KIND Kind;
+    ULONG RecordsPerProducer;
+    volatile LONG ProducersDone;
+    volatile LONG64 Enqueued;
+    LONG64 Received;
+    LONG64 Lost;
+    LONG Corrupt;
+    ULONG Producers;
+} RING_RUN;
+
+typedef struct _PRODUCER {
+    RING_RUN* Run;
+    ULONG Index;
+} PRODUCER;
+
+static void*
+Producer(void* Context)
+{
+    PRODUCER* producer = Context;
+    RING_RUN* run = producer->Run;
+    QUEUE_RESERVATION reservation;
+    LONG64 enqueued = 0;
+
+    for (ULONG i = 0; i < run->RecordsPerProducer; i++) {
+        PULONG payload = BeginEnqueue(&run->Queue, PAYLOAD_LENGTH, 0, &reservation);
+        if (!payload) {
+            continue;
+        }
+        payload[0] = PAYLOAD_LENGTH;
+        payload[1] = i + 1;
+        payload[2] = producer->Index;
+        memset(payload + 3, (UCHAR)i, PAYLOAD_LENGTH - 3 * sizeof(ULONG));
+        EndEnqueue(&run->Queue, &reservation);
+        enqueued++;
+    }
+    InterlockedAdd64(&run->Enqueued, enqueued);
+    InterlockedIncrement(&run->ProducersDone);
+    return NULL;
+}
+
+static VOID
+SlotEnqueue(SLOT_QUEUE* Queue, const UCHAR* Message)
+{
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&Queue->Lock, &oldIrql);
+    RtlCopyMemory(Queue->Buffer + (SIZE_T)Queue->Tail * SLOT_MESSAGE_SIZE, Message, SLOT_MESSAGE_SIZE);
+    Queue->Tail = (Queue->Tail + 1) % Queue->MaxMessages;
+    if (Queue->Count == Queue->MaxMessages) {
+        Queue->Head = (Queue->Head + 1) % Queue->MaxMessages;
+        Queue->Overwritten++;
+    }
+    else {
+        Queue->Count++;
+    }
+    KeReleaseSpinLock(&Queue->Lock, oldIrql);
+}
+
+static BOOLEAN
+SlotDequeue(SLOT_QUEUE* Queue, PUCHAR Message)
+{
+    KIRQL oldIrql;
+    BOOLEAN result = FALSE;
+    KeAcquireSpinLock(&Queue->Lock, &oldIrql);
+    if (Queue->Count > 0) {
+        RtlCopyMemory(Message, Queue->Buffer + (SIZE_T)Queue->Head * SLOT_MESSAGE_SIZE, SLOT_MESSAGE_SIZE);
+        Queue->Head = (Queue->Head + 1) % Queue->MaxMessages;
+        Queue->Count--;
+        result = TRUE;
+    }
+    KeReleaseSpinLock(&Queue->Lock, oldIrql);
+    return result;
+}
+
+// The same event as Producer writes, in a zeroed fixed-size message as the old SendToUser built it
+static void*
+SlotProducer(void* Context)
+{
+    PRODUCER* producer = Context;
+    RING_RUN* run = producer->Run;
+    UCHAR message[SLOT_MESSAGE_SIZE];
+
+    for (ULONG i = 0; i < run->RecordsPerProducer; i++) {
+        PULONG words = (PULONG)message;
+        RtlZeroMemory(message, sizeof(message));
+        words[0] = PAYLOAD_LENGTH;
+        words[1] = i + 1;
+        words[2] = producer->Index;
+        memset(words + 3, (UCHAR)i, PAYLOAD_LENGTH - 3 * sizeof(ULONG));
+        SlotEnqueue(&run->Slots, message);
+    }
+    InterlockedAdd64(&run->Enqueued, run->RecordsPerProducer);
+    InterlockedIncrement(&run->ProducersDone);
+    return NULL;
+}
+
+// Counts a payload, or the records a gap marker reports
+static VOID
+Receive(RING_RUN* Run, const UCHAR* Payload, ULONG Length)
+{
+    const ULONG* words = (const ULONG*)Payload;
+    if (Length >= sizeof(QUEUE_GAP_MARKER) && words[1] == 0) {
+        Run->Lost += (LONG64)((const QUEUE_GAP_MARKER*)Payload)->Lost;
+    }
+    else if (Length != PAYLOAD_LENGTH || words[0] != PAYLOAD_LENGTH || Payload[Length - 1] != (UCHAR)(words[1] - 1)) {
+        Run->Corrupt++;
+    }
+    else {
+        Run->Received++;
+    }
+}
+
+// Reads the shared ring in place, as sharedQueue.h describes; returns whether anything was read
+static BOOLEAN
+ConsumeShared(RING_RUN* Run)
+{
+    PQUEUE_SHARED_HEADER header = Run->Mapping.Header;
+    const UCHAR* data = Run->Mapping.Data;
+    LONG64 first = header->Head;
+    LONG64 head = first;
+    LONG64 start = head;
+
+    for (;;) {
+        const QUEUE_RECORD_HEADER* record = (const QUEUE_RECORD_HEADER*)(data + (head & (header->Capacity - 1)));
+        if (ReadAcquire64(&record->Stamp) != head + 1) {
+            break;
+        }
+        if (record->Length != QUEUE_PAD_RECORD) {
+            Receive(Run, (const UCHAR*)(record + 1), record->Length);
+        }
+        head += record->Size;
+
+        // Handing space back in slices keeps the producers from stalling on a full ring
+        if (head - start >= RING_SIZE / 8) {
+            WriteRelease64(&header->Head, head);
+            start = head;
+        }
+    }
+    WriteRelease64(&header->Head, head);
+    return head != first;
+}
+
+static BOOLEAN
+ConsumeBatch(RING_RUN* Run, PUCHAR Buffer)
+{
+    ULONG count;
+    ULONG length;
+    if (!NT_SUCCESS(DequeueBatch(&Run->Queue, Buffer, BATCH_BUFFER_SIZE, &count, &length))) {
+        return FALSE;
+    }
+
+    // Payloads start with their size, each aligned to QUEUE_BATCH_ALIGNMENT
+    for (ULONG offset = 0, i = 0; i < count; i++) {
+        ULONG size = *(PULONG)(Buffer + offset);
+        Receive(Run, Buffer + offset, size);
+        offset = (offset + size + QUEUE_BATCH_ALIGNMENT - 1) & ~(QUEUE_BATCH_ALIGNMENT - 1);
+    }
+    return TRUE;
+}
+
+// Takes one message per call, as IOCTL_GET_DELETE_MESSAGE did
+static BOOLEAN
+ConsumeSlots(RING_RUN* Run, PUCHAR Buffer)
+{
+    if (!SlotDequeue(&Run->Slots, Buffer)) {
+        return FALSE;
+    }
+    Receive(Run, Buffer, PAYLOAD_LENGTH);
+    return TRUE;
+}
+
+static int
+RunRing(RING_KIND Kind, ULONG Producers, ULONG RecordsPerProducer)
+{
+    static RING_RUN run;
+    pthread_t threads[64];
+    PRODUCER producers[64];
+    PUCHAR batch = malloc(BATCH_BUFFER_SIZE);
+
+    RtlZeroMemory(&run, sizeof(run));
+    run.Kind = Kind;
+    run.Producers = Producers;
+    run.RecordsPerProducer = RecordsPerProducer;
+    if (Kind == RingMapped) {
+        CHECK_STATUS(STATUS_SUCCESS, InitializeSharedQueue(&run.Queue, RING_SIZE));
+        CHECK_STATUS(STATUS_SUCCESS, MapQueue(&run.Queue, &run.Mapping));
+    }
+    else if (Kind == RingBatched) {
+        CHECK_STATUS(STATUS_SUCCESS, InitializeQueue(&run.Queue, RING_SIZE));
+        SetQueuePolicy(&run.Queue, QueueDropNewest);
+    }
+    else {
+        KeInitializeSpinLock(&run.Slots.Lock);
+        run.Slots.MaxMessages = RING_SIZE / SLOT_MESSAGE_SIZE;
+        run.Slots.Buffer = malloc((SIZE_T)run.Slots.MaxMessages * SLOT_MESSAGE_SIZE);
+    }
+
+    ULONG64 start = HostNow();
+    for (ULONG i = 0; i < Producers; i++) {
+        producers[i].Run = &run;
+        producers[i].Index = i;
+        pthread_create(&threads[i], NULL, Kind == RingSlots ? SlotProducer : Producer, &producers[i]);
+    }
+
+    // The consumer runs on the main thread until every producer is done and the ring is empty
+    for (;;) {
+        BOOLEAN done = ReadAcquire(&run.ProducersDone) == (LONG)Producers;
+        BOOLEAN read = Kind == RingMapped ? ConsumeShared(&run)
+            : Kind == RingBatched ? ConsumeBatch(&run, batch) : ConsumeSlots(&run, batch);
+        if (done && !read) {
+            break;
+        }
+        if (!read) {
+            sched_yield();
+        }
+    }
+    double seconds = (double)(HostNow() - start) / 1e9;
+    for (ULONG i = 0; i < Producers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Losses not yet reported by a marker stay in the queue; the fixed slots overwrite without a marker
+    static const char* Names[] = { "mapped", "batched", "slots" };
+    LONG64 total = (LONG64)Producers * RecordsPerProducer;
+    LONG64 lost = run.Lost + run.Queue.Lost + run.Slots.Overwritten;
+    LONG64 queued = run.Enqueued - run.Slots.Overwritten;
+    ULONG bytes = Kind == RingSlots ? (ULONG)SLOT_MESSAGE_SIZE : (ULONG)RECORD_SIZE;
+    printf("%-7s %u producers  %10.0f offered/s  %10.0f records/s  %7.1f MB/s  %5u bytes/event  %6.2f%% dropped\n",
+        Names[Kind], Producers, total / seconds, run.Received / seconds,
+        run.Received * (double)PAYLOAD_LENGTH / seconds / 1e6, bytes, 100.0 * (double)lost / (double)total);
+
+    int result = 0;
+    if (run.Corrupt || run.Received != queued || run.Received + lost != total) {
+        fprintf(stderr, "ringBench: %d corrupt, %lld received, %lld enqueued, %lld lost of %lld\n", run.Corrupt,
+            (long long)run.Received, (long long)run.Enqueued, (long long)lost, (long long)total);
+        result = 1;
+    }
+    if (Kind == RingMapped) {
+        UnmapQueue(&run.Queue, &run.Mapping);
+    }
+    if (Kind == RingSlots) {
+        free(run.Slots.Buffer);
+    }
+    else {
+        CleanupQueue(&run.Queue);
+    }
+    free(batch);
+    return result;
+}
+
+int
+main(int argc, char** argv)
+{
+    BOOLEAN quick = HostQuick(argc, argv);
+    ULONG producers[] = { 1, 2, 4, 8, 16, 32, 64 };
+    ULONG records = quick ? 64000 : 4000000;
+    int result = 0;
+
+    printf("%ld processors, %u-byte payloads, %u-byte ring\n", sysconf(_SC_NPROCESSORS_ONLN), PAYLOAD_LENGTH, RING_SIZE);
+    for (ULONG i = 0; i < ARRAYSIZE(producers); i++) {
+        result |= RunRing(RingMapped, producers[i], records / producers[i]);
+        result |= RunRing(RingBatched, producers[i], records / producers[i]);
+        result |= RunRing(RingSlots, producers[i], records / producers[i]);
+    }
+    return result | HostTestResult();
+}
@@ -0,0 +1,175 @@
+/**
+ * @file ruleImageBench.c
+ * @brief Build, load and lookup cost of a precompiled rule image of 1M names, against loading the same names into
+ *        the hash table with UpdateTrackedFiles.
+ *
+ * The rules are file names spread over users and folders of several depths, as a large ruleset lists them. The
+ * bench compiles them with CompileRuleImage, as ctlFlt -b does, and reports the build time, the image's bytes per
+ * rule and the share of the string pool; RuleImageOpen's checks are timed as DriverEntry's load. Lookups go through
+ * RuleImageLookup alone and through GetTrackedFile with the image loaded, in random order and in another case than
+ * compiled, for names in the image and for names next to them that are not; the table loaded with the same names
+ * is timed the same way. Every lookup's answer is checked.
+ */
+
+#include "hostBench.h"
+#include "fileList.h"
+#include "foldedName.h"
+#include "ruleCompiler.h"
+
+#define PATH_CHARS 96
+#define LOOKUPS 1000000
+
+static const char* Folders[] = { "Documents", "Projects\\current\\src", "AppData\\Local\\Cache\\blobs", "Desktop" };
+
+// Rule Index, or the untracked name next to it when Missing; Upper spells it in another case
+static PCWSTR
+RulePath(PWCHAR Buffer, ULONG Index, BOOLEAN Missing, BOOLEAN Upper)
+{
+    return HostPath(Buffer, PATH_CHARS, Upper ? "\\DEVICE\\HARDDISKVOLUME1\\USERS\\U%03u\\%s\\FILE%07u.%s"
+        : "\\Device\\HarddiskVolume1\\Users\\u%03u\\%s\\file%07u.%s", Index % 300,
+        Folders[(Index / 7) % ARRAYSIZE(Folders)], Index, Missing ? "bak" : (Index & 1) ? "docx" : "txt");
+}
+
+// Index Count random rules, half of them with Missing set
+static VOID
+PickLookups(PULONG Picks, PBOOLEAN Missing, ULONG Count, ULONG Rules)
+{
+    ULONG64 state = 0x9E3779B97F4A7C15ull;
+    for (ULONG i = 0; i < Count; i++) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        Picks[i] = (ULONG)((state >> 33) % Rules);
+        Missing[i] = (state >> 20) & 1;
+    }
+}
+
+static ULONG64
+TablesBytes(PTRACKED_FILES Files)
+{
+    TRACKED_FILES_MEMORY memory;
+    GetTrackedFilesMemory(Files, &memory);
+    return memory.Entries.Bytes + memory.Table.Bytes + memory.Directories.Bytes + memory.Filter.Bytes
+        + memory.Image.Bytes + memory.Patterns.Bytes;
+}
+
+// Mean ns of GetTrackedFile over the picks, which must find exactly the names that are tracked
+static double
+TimeTable(PTRACKED_FILES Files, PUNICODE_STRING Paths, PBOOLEAN Missing, ULONG Count, PULONG Wrong)
+{
+    ULONG64 start = HostNow();
+    for (ULONG i = 0; i < Count; i++) {
+        *Wrong += (GetTrackedFile(Files, &Paths[i]) != 0) == Missing[i];
+    }
+    return (double)(HostNow() - start) / Count;
+}
+
+int
+main(int argc, char** argv)
+{
+    BOOLEAN quick = HostQuick(argc, argv);
+    ULONG count = quick ? 20000 : 1000000;
+    ULONG lookups = quick ? 20000 : LOOKUPS;
+    PRULE_IMAGE_RULE rules = calloc(count, sizeof(RULE_IMAGE_RULE));
+    PTRACKED_FILE_UPDATE updates = calloc(count, sizeof(TRACKED_FILE_UPDATE));
+    PWCHAR names = calloc((SIZE_T)count, PATH_CHARS * sizeof(WCHAR));
+    PWCHAR lookupNames = calloc((SIZE_T)lookups, PATH_CHARS * sizeof(WCHAR));
+    PUNICODE_STRING paths = calloc(lookups, sizeof(UNICODE_STRING));
+    PULONG picks = calloc(lookups, sizeof(ULONG));
+    PBOOLEAN missing = calloc(lookups, sizeof(BOOLEAN));
+    RULE_IMAGE_BUILD build;
+    RULE_IMAGE_VIEW view;
+    TRACKED_FILES imageFiles;
+    TRACKED_FILES tableFiles;
+    ULONG wrong = 0;
+    ULONG applied = 0;
+    int result = 0;
+
+    if (!rules || !updates || !names || !lookupNames || !paths || !picks || !missing) {
+        fprintf(stderr, "ruleImageBench: out of memory\n");
+        return 1;
+    }
+    ULONG64 stringBytes = 0;
+    for (ULONG i = 0; i < count; i++) {
+        PCWSTR name = RulePath(names + (SIZE_T)i * PATH_CHARS, i, FALSE, FALSE);
+        RtlInitUnicodeString(&updates[i].Path, name);
+        updates[i].Operations = RULE_DEFAULT;
+        rules[i].Path = name;
+        rules[i].Length = updates[i].Path.Length;
+        stringBytes += rules[i].Length;
+    }
+    PickLookups(picks, missing, lookups, count);
+    for (ULONG i = 0; i < lookups; i++) {
+        RtlInitUnicodeString(&paths[i], RulePath(lookupNames + (SIZE_T)i * PATH_CHARS, picks[i], missing[i], TRUE));
+    }
+
+    // ctlFlt -b
+    ULONG64 start = HostNow();
+    if (!CompileRuleImage(rules, count, FoldNameChar, &build)) {
+        fprintf(stderr, "ruleImageBench: %u rules did not compile\n", count);
+        return 1;
+    }
+    double buildMs = (double)(HostNow() - start) / 1e6;
+    printf("build   %8u rules  %8.1f ms  %7.1f MB  %6.1f B/rule (%4.1f%% strings)  %u seed(s)\n", build.NameCount,
+        buildMs, (double)build.ImageSize / (1024 * 1024), (double)build.ImageSize / count,
+        100.0 * (double)stringBytes / build.ImageSize, build.Attempts);
+
+    // DriverEntry's load: one copy into nonpaged pool, checked once
+    PVOID image = ExAllocatePool2(POOL_FLAG_NON_PAGED, build.ImageSize, 'mItL');
+    memcpy(image, build.Image, build.ImageSize);
+    free(build.Image);
+    start = HostNow();
+    BOOLEAN opened = RuleImageOpen(&view, image, build.ImageSize);
+    double openMs = (double)(HostNow() - start) / 1e6;
+
+    // Names found and names not found in separate passes, so the clock stays out of each lookup
+    double lookupNs[2] = { 0 };
+    for (ULONG pass = 0; opened && pass < 2; pass++) {
+        ULONG done = 0;
+        start = HostNow();
+        for (ULONG i = 0; i < lookups; i++) {
+            if (missing[i] == pass) {
+                wrong += RuleImageLookup(&view, paths[i].Buffer, paths[i].Length, FoldNameChar, NULL) == missing[i];
+                done++;
+            }
+        }
+        lookupNs[pass] = (double)(HostNow() - start) / max(done, 1);
+    }
+    printf("open    %8u rules  %8.1f ms  lookup %6.1f ns found  %6.1f ns not found\n", build.NameCount, openMs,
+        lookupNs[0], lookupNs[1]);
+
+    // Through the table, the image backing it
+    InitializeTrackedFiles(&imageFiles);
+    start = HostNow();
+    NTSTATUS status = LoadTrackedFilesImage(&imageFiles, image, build.ImageSize);
+    double loadMs = (double)(HostNow() - start) / 1e6;
+    if (!NT_SUCCESS(status)) {
+        ExFreePool(image);
+    }
+    double imageNs = TimeTable(&imageFiles, paths, missing, lookups, &wrong);
+    printf("image   %8u rules  load %8.1f ms  %7.1f MB  GetTrackedFile %6.1f ns\n", build.NameCount, loadMs,
+        (double)TablesBytes(&imageFiles) / (1024 * 1024), imageNs);
+
+    // The same names as table entries
+    InitializeTrackedFiles(&tableFiles);
+    start = HostNow();
+    UpdateTrackedFiles(&tableFiles, updates, count, &applied);
+    loadMs = (double)(HostNow() - start) / 1e6;
+    double tableNs = TimeTable(&tableFiles, paths, missing, lookups, &wrong);
+    printf("table   %8u rules  load %8.1f ms  %7.1f MB  GetTrackedFile %6.1f ns\n", applied, loadMs,
+        (double)TablesBytes(&tableFiles) / (1024 * 1024), tableNs);
+
+    DeleteTrackedFiles(&tableFiles);
+    DeleteTrackedFiles(&imageFiles);
+    if (!opened || !NT_SUCCESS(status) || build.NameCount != count || applied != count || wrong) {
+        fprintf(stderr, "ruleImageBench: image %s, %u names compiled and %u loaded of %u, %u wrong lookups\n",
+            opened && NT_SUCCESS(status) ? "loaded" : "rejected", build.NameCount, applied, count, wrong);
+        result = 1;
+    }
+    free(missing);
+    free(picks);
+    free(paths);
+    free(lookupNames);
+    free(names);
+    free(updates);
+    free(rules);
+    return result;
+}
@@ -0,0 +1,260 @@
+/**
+ * @file timestampBench.c
+ * @brief Producer cost of a deletion message with its time formatted in the driver, as LogDeletion and SendToUser
+ *        did before, against the raw KeQuerySystemTime and KeQueryInterruptTimePrecise stamps they queue now.
+ *
+ * Both messages are the full-name layout of that change: a 56-byte header holding a 20-character local date and
+ * time, or a 32-byte header holding the two clock readings, then the process name and the path. The formatted path
+ * queries the system time, subtracts the time-zone bias as ExSystemTimeToLocalTime does, splits the result into
+ * fields as RtlTimeToTimeFields does and prints "YYYY-MM-DD hh:mm:ss" as RtlUnicodeStringPrintf did; the host has no
+ * wide printf for the driver's 16-bit WCHAR, so it prints narrow characters and widens them. For reference the
+ * bench also times today's QueueDeleteMessage, which sends interned names by id. The consumer drains outside the
+ * clock; the formatted times are checked against the C library's.
+ */
+
+#include "hostBench.h"
+#include "circularQ.h"
+#include "eventEncoder.h"
+#include "ruleOps.h"
+
+#define QUEUE_SIZE (1024 * 1024)
+#define BATCH_BUFFER_SIZE (256 * 1024)
+#define PATH_CHARS 80
+#define PATHS 1000
+#define DATE_TIME_CHARS 20
+
+// 100ns units from 1601 to 1970
+#define UNIX_EPOCH_TIME 116444736000000000LL
+
+#pragma pack(push, 1)
+typedef struct _FORMATTED_MESSAGE {
+    ULONG Size;
+    ULONG MessageId;
+    ULONG Flags;
+    WCHAR DateTime[DATE_TIME_CHARS];
+    USHORT ProcessNameLength;
+    USHORT FilePathLength;
+    WCHAR Names[ANYSIZE_ARRAY];
+} FORMATTED_MESSAGE;
+
+typedef struct _STAMPED_MESSAGE {
+    ULONG Size;
+    ULONG MessageId;
+    LONG64 SystemTime;
+    ULONG64 InterruptTime;
+    ULONG Flags;
+    USHORT ProcessNameLength;
+    USHORT FilePathLength;
+    WCHAR Names[ANYSIZE_ARRAY];
+} STAMPED_MESSAGE;
+#pragma pack(pop)
+
+typedef struct _TIME_PARTS {
+    LONG Year;
+    LONG Month;
+    LONG Day;
+    LONG Hour;
+    LONG Minute;
+    LONG Second;
+} TIME_PARTS;
+
+// Read on every event, as the kernel reads the bias from shared user data; UTC here
+static volatile LONG64 TimeZoneBias;
+
+// The date of a time in 100ns units since 1601, as RtlTimeToTimeFields splits it
+static VOID
+TimeToParts(LONG64 Time, TIME_PARTS* Parts)
+{
+    LONG64 seconds = (Time - UNIX_EPOCH_TIME) / 10000000;
+    LONG64 days = seconds / 86400;
+    LONG64 rest = seconds % 86400;
+
+    // Civil date from days since 1970, in 400-year eras starting on March 1st
+    days += 719468;
+    LONG64 era = days / 146097;
+    LONG64 dayOfEra = days - era * 146097;
+    LONG64 yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    LONG64 dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    LONG64 monthIndex = (5 * dayOfYear + 2) / 153;
+    Parts->Day = (LONG)(dayOfYear - (153 * monthIndex + 2) / 5 + 1);
+    Parts->Month = (LONG)(monthIndex < 10 ? monthIndex + 3 : monthIndex - 9);
+    Parts->Year = (LONG)(yearOfEra + era * 400 + (Parts->Month <= 2));
+    Parts->Hour = (LONG)(rest / 3600);
+    Parts->Minute = (LONG)(rest / 60 % 60);
+    Parts->Second = (LONG)(rest % 60);
+}
+
+// The old LogDeletion: local time, fields, then a printed string
+static VOID
+FormatNow(PWCHAR DateTime)
+{
+    LARGE_INTEGER systemTime;
+    TIME_PARTS parts;
+    char text[DATE_TIME_CHARS];
+
+    KeQuerySystemTime(&systemTime);
+    TimeToParts(systemTime.QuadPart - TimeZoneBias, &parts);
+    int length = snprintf(text, sizeof(text), "%04d-%02d-%02d %02d:%02d:%02d", parts.Year, parts.Month, parts.Day,
+        parts.Hour, parts.Minute, parts.Second);
+    for (int i = 0; i < DATE_TIME_CHARS; i++) {
+        DateTime[i] = i < length ? (WCHAR)text[i] : 0;
+    }
+}
+
+static BOOLEAN
+QueueFormatted(PCIRCULAR_QUEUE Queue, PCUNICODE_STRING ProcessName, PCUNICODE_STRING Path, ULONG Id)
+{
+    QUEUE_RESERVATION reservation;
+    WCHAR dateTime[DATE_TIME_CHARS];
+    ULONG size = FIELD_OFFSET(FORMATTED_MESSAGE, Names) + ProcessName->Length + Path->Length;
+
+    FormatNow(dateTime);
+    FORMATTED_MESSAGE* message = BeginEnqueue(Queue, size, 0, &reservation);
+    if (!message) {
+        return FALSE;
+    }
+    message->Size = size;
+    message->MessageId = Id;
+    message->Flags = 0;
+    RtlCopyMemory(message->DateTime, dateTime, sizeof(dateTime));
+    message->ProcessNameLength = ProcessName->Length;
+    message->FilePathLength = Path->Length;
+    RtlCopyMemory(message->Names, ProcessName->Buffer, ProcessName->Length);
+    RtlCopyMemory((PUCHAR)message->Names + ProcessName->Length, Path->Buffer, Path->Length);
+    EndEnqueue(Queue, &reservation);
+    return TRUE;
+}
+
+static BOOLEAN
+QueueStamped(PCIRCULAR_QUEUE Queue, PCUNICODE_STRING ProcessName, PCUNICODE_STRING Path, ULONG Id)
+{
+    QUEUE_RESERVATION reservation;
+    LARGE_INTEGER systemTime;
+    ULONG64 qpcTimeStamp;
+    ULONG size = FIELD_OFFSET(STAMPED_MESSAGE, Names) + ProcessName->Length + Path->Length;
+
+    STAMPED_MESSAGE* message = BeginEnqueue(Queue, size, 0, &reservation);
+    if (!message) {
+        return FALSE;
+    }
+    message->Size = size;
+    message->MessageId = Id;
+    message->Flags = 0;
+    KeQuerySystemTime(&systemTime);
+    message->SystemTime = systemTime.QuadPart;
+    message->InterruptTime = KeQueryInterruptTimePrecise(&qpcTimeStamp);
+    message->ProcessNameLength = ProcessName->Length;
+    message->FilePathLength = Path->Length;
+    RtlCopyMemory(message->Names, ProcessName->Buffer, ProcessName->Length);
+    RtlCopyMemory((PUCHAR)message->Names + ProcessName->Length, Path->Buffer, Path->Length);
+    EndEnqueue(Queue, &reservation);
+    return TRUE;
+}
+
+typedef enum _MESSAGE_KIND {
+    MessageFormatted,
+    MessageStamped,
+    MessageInterned,
+} MESSAGE_KIND;
+
+static const char* KindNames[] = { "formatted", "raw", "interned" };
+
+// Queues Operations deletions of the given kind and prints the mean cost of one, draining outside the clock
+static int
+RunKind(MESSAGE_KIND Kind, PUNICODE_STRING Paths, ULONG Operations)
+{
+    EVENT_STRINGS strings;
+    CIRCULAR_QUEUE queue;
+    PUCHAR buffer = malloc(BATCH_BUFFER_SIZE);
+    UNICODE_STRING processName = HostString(L"\\Device\\HarddiskVolume1\\Windows\\explorer.exe");
+    ULONG64 elapsed = 0;
+    ULONG64 sent = 0;
+    ULONG64 bytes = 0;
+    ULONG count;
+    ULONG length;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeEventStrings(&strings));
+    CHECK_STATUS(STATUS_SUCCESS, InitializeQueue(&queue, QUEUE_SIZE));
+    SetQueuePolicy(&queue, QueueDropNewest);
+    for (ULONG done = 0; done < Operations; done += PATHS) {
+        ULONG64 start = HostNow();
+        for (ULONG i = 0; i < PATHS; i++) {
+            BOOLEAN queued;
+            switch (Kind) {
+            case MessageFormatted:
+                queued = QueueFormatted(&queue, &processName, &Paths[i], done + i + 1);
+                break;
+            case MessageStamped:
+                queued = QueueStamped(&queue, &processName, &Paths[i], done + i + 1);
+                break;
+            default:
+                queued = NT_SUCCESS(QueueDeleteMessage(&strings, &queue, &processName, ULongToHandle(4), 0,
+                    &Paths[i], RULE_OP_DELETE, FALSE));
+                break;
+            }
+            sent += queued;
+        }
+        elapsed += HostNow() - start;
+        while (NT_SUCCESS(DequeueBatch(&queue, buffer, BATCH_BUFFER_SIZE, &count, &length))) {
+            bytes += length;
+        }
+    }
+    printf("%-9s  %8llu messages  %7.1f ns/message  %6.1f bytes/message\n", KindNames[Kind],
+        (unsigned long long)sent, (double)elapsed / (double)max(sent, 1), (double)bytes / (double)max(sent, 1));
+
+    CleanupQueue(&queue);
+    CleanupEventStrings(&strings);
+    free(buffer);
+    if (sent != (Operations + PATHS - 1) / PATHS * PATHS) {
+        fprintf(stderr, "timestampBench: %s: %llu messages queued\n", KindNames[Kind], (unsigned long long)sent);
+        return 1;
+    }
+    return 0;
+}
+
+// The field split must agree with the C library's for dates either side of leap days and century years
+static int
+CheckTimeParts(VOID)
+{
+    static const LONG64 samples[] = { 0, 951782400, 951868799, 1078099199, 1740925845, 4107542399LL, 2147483647 };
+    int wrong = 0;
+
+    for (ULONG i = 0; i < ARRAYSIZE(samples); i++) {
+        time_t seconds = (time_t)samples[i];
+        struct tm expected;
+        TIME_PARTS parts;
+        gmtime_r(&seconds, &expected);
+        TimeToParts(samples[i] * 10000000 + UNIX_EPOCH_TIME, &parts);
+        if (parts.Year != expected.tm_year + 1900 || parts.Month != expected.tm_mon + 1
+            || parts.Day != expected.tm_mday || parts.Hour != expected.tm_hour || parts.Minute != expected.tm_min
+            || parts.Second != expected.tm_sec) {
+            fprintf(stderr, "timestampBench: %lld seconds split as %04d-%02d-%02d %02d:%02d:%02d\n",
+                (long long)samples[i], parts.Year, parts.Month, parts.Day, parts.Hour, parts.Minute, parts.Second);
+            wrong = 1;
+        }
+    }
+    return wrong;
+}
+
+int
+main(int argc, char** argv)
+{
+    BOOLEAN quick = HostQuick(argc, argv);
+    ULONG operations = quick ? 20000 : 2000000;
+    PUNICODE_STRING paths = calloc(PATHS, sizeof(UNICODE_STRING));
+    PWCHAR text = calloc(PATHS, PATH_CHARS * sizeof(WCHAR));
+    int result = CheckTimeParts();
+
+    // Files change every time, the directory every 100 deletions
+    for (ULONG i = 0; i < PATHS; i++) {
+        paths[i] = HostString(HostPath(text + i * PATH_CHARS, PATH_CHARS,
+            "\\Device\\HarddiskVolume1\\Build\\obj%05u\\unit%03u.obj", i / 100, i % 100));
+    }
+    for (ULONG kind = MessageFormatted; kind <= MessageInterned; kind++) {
+        result |= RunKind((MESSAGE_KIND)kind, paths, operations);
+    }
+
+    free(text);
+    free(paths);
+    return result | HostTestResult();
+}
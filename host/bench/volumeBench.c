@@ -0,0 +1,231 @@
+/**
+ * @file volumeBench.c
+ * @brief Cost of deciding a deletion on 64 volumes whose rules are skewed onto a few of them, with the per-volume
+ *        gate of GetVolumeDecision in front of GetFileDecision and without it.
+ *
+ * Each of 64 instances gets a VOLUME_CONTEXT from SetupVolumeDecision. The rules are file names placed on the
+ * first K volumes with weights 1, 1/2, 1/3 and so on, so the first volume holds the most. Operations fall on the
+ * volumes uniformly, each on a freshly opened handle as a deletion usually is, so every decision that is not
+ * gated off queries the file name. The last scenario adds a pattern that names no volume, which makes every
+ * volume look ruled and turns the gate off. Both paths decide the same operations, and their verdicts must
+ * agree. On the host a name query is a copy of a string, where FltGetFileNameInformation costs microseconds, so
+ * the name queries per operation are the figure that carries over to the kernel.
+ */
+
+#include "hostBench.h"
+#include "decisionCache.h"
+#include "fileList.h"
+#include "perfStats.h"
+
+#define VOLUMES 64
+#define PATH_CHARS 96
+#define BATCH 4096
+
+PFLT_FILTER gFilterHandle;
+TRACKED_FILES TrackedFiles;
+
+typedef struct _VOLUME_SIM {
+    FLT_INSTANCE Instance;
+    FLT_VOLUME Volume;
+    WCHAR Name[32];
+} VOLUME_SIM;
+
+typedef struct _HANDLE_SIM {
+    HOST_FILE File;
+    WCHAR Path[PATH_CHARS];
+    FILE_OBJECT FileObject;
+    FLT_IO_PARAMETER_BLOCK Iopb;
+    FLT_CALLBACK_DATA Data;
+    FLT_RELATED_OBJECTS Objects;
+} HANDLE_SIM;
+
+typedef struct _SKEW {
+    const char* Name;
+    ULONG RuledVolumes;    // Volumes holding the rules
+    BOOLEAN Unscoped;      // A pattern that may match on any volume
+} SKEW;
+
+static VOLUME_SIM Volumes[VOLUMES];
+
+static PCWSTR
+RulePath(PWCHAR Buffer, ULONG Volume, ULONG Index)
+{
+    return HostPath(Buffer, PATH_CHARS, "\\Device\\HarddiskVolume%u\\Users\\u%03u\\Documents\\report%07u.docx",
+        Volume + 1, Index % 300, Index);
+}
+
+// Spreads Rules names over the first RuledVolumes volumes, volume v getting a share proportional to 1 / (v + 1)
+static VOID
+LoadRules(const SKEW* Skew, ULONG Rules)
+{
+    WCHAR path[PATH_CHARS];
+    double total = 0;
+
+    for (ULONG v = 0; v < Skew->RuledVolumes; v++) {
+        total += 1.0 / (v + 1);
+    }
+    ULONG index = 0;
+    for (ULONG v = 0; v < Skew->RuledVolumes; v++) {
+        ULONG share = v + 1 == Skew->RuledVolumes ? Rules - index : (ULONG)(Rules / total / (v + 1));
+        for (ULONG i = 0; i < share; i++, index++) {
+            AddTrackedFile(&TrackedFiles, RulePath(path, v, index), RULE_DEFAULT);
+        }
+    }
+    if (Skew->Unscoped) {
+        GLOB_PATTERN pattern = { HostString(L"*.tmp"), RULE_TRACK(RULE_OP_DELETE) };
+        SetTrackedPatterns(&TrackedFiles, &pattern, 1);
+    }
+}
+
+// Opens a handle on a random volume, to a name that half the time is one of the rules' if it is on that volume
+static VOID
+OpenHandle(HANDLE_SIM* Handle, ULONG64* State, ULONG Rules)
+{
+    *State = *State * 6364136223846793005ull + 1442695040888963407ull;
+    ULONG volume = (ULONG)((*State >> 33) % VOLUMES);
+    ULONG index = (ULONG)((*State >> 7) % (2 * Rules));
+
+    Handle->File.Name = HostString(RulePath(Handle->Path, volume, index));
+    RtlZeroMemory(&Handle->FileObject, sizeof(Handle->FileObject));
+    Handle->FileObject.File = &Handle->File;
+    Handle->Iopb.TargetFileObject = &Handle->FileObject;
+    Handle->Iopb.TargetInstance = &Volumes[volume].Instance;
+    Handle->Data.Iopb = &Handle->Iopb;
+    Handle->Objects.Instance = &Volumes[volume].Instance;
+    Handle->Objects.Volume = &Volumes[volume].Volume;
+    Handle->Objects.FileObject = &Handle->FileObject;
+}
+
+// Decides a batch of deletions with the gate or without it, and returns the time taken
+static ULONG64
+DecideBatch(HANDLE_SIM* Handles, PLONG Verdicts, BOOLEAN Gated)
+{
+    ULONG64 start = HostNow();
+    for (ULONG i = 0; i < BATCH; i++) {
+        Verdicts[i] = Gated && !GetVolumeDecision(&Handles[i].Objects) ? 0
+            : GetFileDecision(&Handles[i].Data, &Handles[i].Objects, NULL);
+    }
+    ULONG64 elapsed = HostNow() - start;
+
+    for (ULONG i = 0; i < BATCH; i++) {
+        HostCloseFileObject(&Handles[i].FileObject);
+    }
+    return elapsed;
+}
+
+// Instances come up with the rules loaded, as after a restart; a verdict cached under another ruleset of the
+// same generation must not survive into the next scenario
+static BOOLEAN
+SetupVolumes(VOID)
+{
+    for (ULONG v = 0; v < VOLUMES; v++) {
+        FLT_RELATED_OBJECTS objects = { 0 };
+        Volumes[v].Volume.Name = HostString(HostPath(Volumes[v].Name, ARRAYSIZE(Volumes[v].Name),
+            "\\Device\\HarddiskVolume%u", v + 1));
+        objects.Instance = &Volumes[v].Instance;
+        objects.Volume = &Volumes[v].Volume;
+        if (!NT_SUCCESS(SetupVolumeDecision(&objects))) {
+            fprintf(stderr, "volumeBench: no context for volume %u\n", v + 1);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static VOID
+TeardownVolumes(VOID)
+{
+    for (ULONG v = 0; v < VOLUMES; v++) {
+        HostTeardownInstance(&Volumes[v].Instance);
+    }
+}
+
+static int
+RunSkew(const SKEW* Skew, ULONG Rules, ULONG Operations, HANDLE_SIM* Handles)
+{
+    LONG gatedVerdicts[BATCH];
+    LONG verdicts[BATCH];
+    DECISION_CACHE_STATS before;
+    DECISION_CACHE_STATS middle;
+    DECISION_CACHE_STATS after;
+    ULONG64 elapsed[2] = { 0 };
+    ULONG64 misses[2] = { 0 };
+    ULONG64 skips = 0;
+    ULONG64 tracked = 0;
+    ULONG wrong = 0;
+
+    InitializeTrackedFiles(&TrackedFiles);
+    LoadRules(Skew, Rules);
+    if (!SetupVolumes()) {
+        DeleteTrackedFiles(&TrackedFiles);
+        return 1;
+    }
+
+    ULONG batches = (Operations + BATCH - 1) / BATCH;
+    ULONG64 state = 0x9E3779B97F4A7C15ull;
+    for (ULONG b = 0; b < batches; b++) {
+        // The same operations both ways, ungated first
+        ULONG64 batchState = state;
+        for (ULONG i = 0; i < BATCH; i++) {
+            OpenHandle(&Handles[i], &state, Rules);
+        }
+        GetDecisionCacheStats(&before);
+        elapsed[0] += DecideBatch(Handles, verdicts, FALSE);
+        GetDecisionCacheStats(&middle);
+
+        state = batchState;
+        for (ULONG i = 0; i < BATCH; i++) {
+            OpenHandle(&Handles[i], &state, Rules);
+        }
+        elapsed[1] += DecideBatch(Handles, gatedVerdicts, TRUE);
+        GetDecisionCacheStats(&after);
+
+        misses[0] += middle.Misses - before.Misses;
+        misses[1] += after.Misses - middle.Misses;
+        skips += after.VolumeSkips - middle.VolumeSkips;
+        for (ULONG i = 0; i < BATCH; i++) {
+            wrong += verdicts[i] != gatedVerdicts[i];
+            tracked += verdicts[i] != 0;
+        }
+    }
+
+    double count = (double)batches * BATCH;
+    printf("%-18s %2u ruled volumes  ungated %6.1f ns/op %5.3f queries/op  gated %6.1f ns/op %5.3f queries/op  "
+        "%5.1f%% passed through  %4.1f%% tracked\n", Skew->Name, Skew->RuledVolumes, elapsed[0] / count,
+        misses[0] / count, elapsed[1] / count, misses[1] / count, 100.0 * skips / count, 100.0 * tracked / count);
+
+    TeardownVolumes();
+    DeleteTrackedFiles(&TrackedFiles);
+    if (wrong) {
+        fprintf(stderr, "volumeBench: %s: %u verdicts differ with the gate\n", Skew->Name, wrong);
+        return 1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    BOOLEAN quick = HostQuick(argc, argv);
+    ULONG rules = quick ? 2000 : 20000;
+    ULONG operations = quick ? 20000 : 2000000;
+    HANDLE_SIM* handles = calloc(BATCH, sizeof(HANDLE_SIM));
+    static const SKEW skews[] = {
+        { "1 volume", 1, FALSE },
+        { "4 volumes", 4, FALSE },
+        { "16 volumes", 16, FALSE },
+        { "every volume", VOLUMES, FALSE },
+        { "4 volumes + *.tmp", 4, TRUE },
+    };
+    int result = 0;
+
+    InitializePerfStats();
+    printf("%u rules, %u volumes, %u operations on fresh handles\n", rules, VOLUMES, operations);
+    for (ULONG i = 0; i < ARRAYSIZE(skews); i++) {
+        result |= RunSkew(&skews[i], rules, operations, handles);
+    }
+
+    free(handles);
+    CleanupPerfStats();
+    return result;
+}
@@ -0,0 +1,361 @@
+/**
+ * @file waitBench.c
+ * @brief Delivery latency of queued events to the consumer: the parked wait of IOCTL_WAIT_DELETE_MESSAGES against
+ *        the polling loop watchFlt used before it, at 100 and 10k events per second.
+ *
+ * The wait is modelled on userApi.c. A producer publishes a record, issues a full barrier and, if a request is
+ * parked, runs NotifyWaiters: it queues the DPC at once when MinBytes are pending or MaxLatencyMs is 0, otherwise
+ * arms the one-shot timer, the first message of a batch starting it. A notifier thread stands in for the DPC and
+ * the timer; it cancels the timer and completes the parked request, and the consumer drains a batch. The consumer
+ * parks as IoctlWaitDelMsgs does, counting itself a waiter before it checks the queue again. The polling consumer
+ * drains the queue, then sleeps for its interval. Each record carries the time it was published; the consumer
+ * reports the 50th and 99th percentile and the worst of the time to delivery, and how often it woke.
+ */
+
+#include "hostBench.h"
+#include "circularQ.h"
+
+#define QUEUE_BYTES (1024 * 1024)
+#define BATCH_BYTES (64 * 1024)
+
+typedef struct _WAIT_RECORD {
+    ULONG Size;
+    ULONG Id;              // Never 0, which marks a gap
+    ULONG64 Stamp;         // HostNow() when published
+    UCHAR Fill[192];       // About a deletion message with a short path
+} WAIT_RECORD;
+
+typedef struct _WAIT_POLICY {
+    const char* Name;
+    ULONG PollMs;          // Sleep between polls; 0 for the parked wait
+    ULONG MinBytes;
+    ULONG MaxLatencyMs;
+} WAIT_POLICY;
+
+typedef struct _WAIT_RUN {
+    CIRCULAR_QUEUE Queue;
+    const WAIT_POLICY* Policy;
+    ULONG Total;
+    ULONG Rate;
+    ULONG64* Latencies;
+    volatile LONG Delivered;
+    volatile LONG Stop;
+    ULONG Wakeups;
+
+    // The parked request and the waiter count of userApi.c
+    volatile LONG Waiters;
+    volatile LONG TimerArmed;
+    BOOLEAN Parked;
+    pthread_mutex_t ConsumerLock;
+    pthread_cond_t ConsumerWake;
+
+    // The DPC and the timer
+    BOOLEAN DpcQueued;
+    ULONG64 TimerDue;      // 0 when not set
+    pthread_mutex_t NotifierLock;
+    pthread_cond_t NotifierWake;
+} WAIT_RUN;
+
+static VOID
+InsertQueueDpc(WAIT_RUN* Run)
+{
+    pthread_mutex_lock(&Run->NotifierLock);
+    Run->DpcQueued = TRUE;
+    pthread_cond_signal(&Run->NotifierWake);
+    pthread_mutex_unlock(&Run->NotifierLock);
+}
+
+static VOID
+SetTimer(WAIT_RUN* Run, ULONG Milliseconds)
+{
+    pthread_mutex_lock(&Run->NotifierLock);
+    Run->TimerDue = HostNow() + (ULONG64)Milliseconds * 1000000;
+    pthread_cond_signal(&Run->NotifierWake);
+    pthread_mutex_unlock(&Run->NotifierLock);
+}
+
+// NotifyWaiters of userApi.c
+static VOID
+NotifyWaiters(WAIT_RUN* Run)
+{
+    ULONG used = QueueUsedBytes(&Run->Queue);
+
+    if (used == 0) {
+        return;
+    }
+    if (Run->Policy->MaxLatencyMs == 0 || used >= Run->Policy->MinBytes) {
+        InsertQueueDpc(Run);
+    }
+    else if (!InterlockedExchange(&Run->TimerArmed, 1)) {
+        SetTimer(Run, Run->Policy->MaxLatencyMs);
+    }
+}
+
+// NotifyDpcRoutine of userApi.c: the timer is cancelled and the parked request completed
+static VOID
+NotifyDpcRoutine(WAIT_RUN* Run)
+{
+    InterlockedExchange(&Run->TimerArmed, 0);
+    InterlockedIncrement(&Run->Waiters);
+    pthread_mutex_lock(&Run->ConsumerLock);
+    if (Run->Parked) {
+        Run->Parked = FALSE;
+        InterlockedDecrement(&Run->Waiters);
+        pthread_cond_signal(&Run->ConsumerWake);
+    }
+    pthread_mutex_unlock(&Run->ConsumerLock);
+    InterlockedDecrement(&Run->Waiters);
+}
+
+// Runs the DPC whenever it is queued or the timer expires
+static void*
+Notifier(void* Context)
+{
+    WAIT_RUN* run = Context;
+
+    pthread_mutex_lock(&run->NotifierLock);
+    for (;;) {
+        while (!run->DpcQueued && !run->Stop && (run->TimerDue == 0 || HostNow() < run->TimerDue)) {
+            if (run->TimerDue) {
+                struct timespec due = { (time_t)(run->TimerDue / 1000000000), (long)(run->TimerDue % 1000000000) };
+                pthread_cond_timedwait(&run->NotifierWake, &run->NotifierLock, &due);
+            }
+            else {
+                pthread_cond_wait(&run->NotifierWake, &run->NotifierLock);
+            }
+        }
+        if (run->Stop) {
+            break;
+        }
+        run->DpcQueued = FALSE;
+        run->TimerDue = 0;
+        pthread_mutex_unlock(&run->NotifierLock);
+        NotifyDpcRoutine(run);
+        pthread_mutex_lock(&run->NotifierLock);
+    }
+    pthread_mutex_unlock(&run->NotifierLock);
+    return NULL;
+}
+
+// Publishes Total records at Rate per second, each spaced by half to one and a half times the mean interval
+static void*
+Producer(void* Context)
+{
+    WAIT_RUN* run = Context;
+    QUEUE_RESERVATION reservation;
+    ULONG64 interval = 1000000000ull / run->Rate;
+    ULONG64 next = HostNow();
+    ULONG64 state = 0x9E3779B97F4A7C15ull;
+
+    for (ULONG i = 0; i < run->Total; i++) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        next += interval / 2 + (state >> 33) % interval;
+        struct timespec due = { (time_t)(next / 1000000000), (long)(next % 1000000000) };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+
+        WAIT_RECORD* record = BeginEnqueue(&run->Queue, sizeof(WAIT_RECORD), 0, &reservation);
+        if (!record) {
+            continue;
+        }
+        record->Size = sizeof(WAIT_RECORD);
+        record->Id = i + 1;
+        record->Stamp = HostNow();
+        EndEnqueue(&run->Queue, &reservation);
+
+        // As SendToUser: either this sees the waiter or the waiter sees the record
+        KeMemoryBarrier();
+        if (ReadNoFence(&run->Waiters)) {
+            NotifyWaiters(run);
+        }
+    }
+    return NULL;
+}
+
+// Dequeues one batch and records how long each record waited; returns FALSE if the queue was empty
+static BOOLEAN
+Drain(WAIT_RUN* Run, PUCHAR Buffer)
+{
+    ULONG count;
+    ULONG length;
+    ULONG offset = 0;
+
+    if (!NT_SUCCESS(DequeueBatch(&Run->Queue, Buffer, BATCH_BYTES, &count, &length))) {
+        return FALSE;
+    }
+    ULONG64 now = HostNow();
+    for (ULONG i = 0; i < count; i++) {
+        offset = (offset + QUEUE_BATCH_ALIGNMENT - 1) & ~(QUEUE_BATCH_ALIGNMENT - 1);
+        WAIT_RECORD* record = (WAIT_RECORD*)(Buffer + offset);
+        if (record->Id != 0 && (ULONG)Run->Delivered < Run->Total) {
+            Run->Latencies[Run->Delivered] = now - record->Stamp;
+            InterlockedIncrement(&Run->Delivered);
+        }
+        offset += record->Size;
+    }
+    return TRUE;
+}
+
+static BOOLEAN
+Finished(WAIT_RUN* Run)
+{
+    return (ULONG)ReadNoFence(&Run->Delivered) >= Run->Total || ReadNoFence(&Run->Stop);
+}
+
+static void*
+PollingConsumer(void* Context)
+{
+    WAIT_RUN* run = Context;
+    PUCHAR buffer = malloc(BATCH_BYTES);
+
+    while (!Finished(run)) {
+        run->Wakeups++;
+        while (Drain(run, buffer)) {
+        }
+        if (!Finished(run)) {
+            usleep(run->Policy->PollMs * 1000);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+static void*
+WaitingConsumer(void* Context)
+{
+    WAIT_RUN* run = Context;
+    PUCHAR buffer = malloc(BATCH_BYTES);
+
+    while (!Finished(run)) {
+        // IoctlWaitDelMsgs: completes at once if the request is already due and something is queued
+        if ((run->Policy->MaxLatencyMs == 0 || QueueUsedBytes(&run->Queue) >= run->Policy->MinBytes)
+            && Drain(run, buffer)) {
+            run->Wakeups++;
+            continue;
+        }
+
+        // Otherwise parks, then looks for messages published before it was parked
+        pthread_mutex_lock(&run->ConsumerLock);
+        run->Parked = TRUE;
+        InterlockedIncrement(&run->Waiters);
+        pthread_mutex_unlock(&run->ConsumerLock);
+        NotifyWaiters(run);
+
+        pthread_mutex_lock(&run->ConsumerLock);
+        while (run->Parked && !ReadNoFence(&run->Stop)) {
+            pthread_cond_wait(&run->ConsumerWake, &run->ConsumerLock);
+        }
+        if (run->Parked) {
+            run->Parked = FALSE;
+            InterlockedDecrement(&run->Waiters);
+        }
+        pthread_mutex_unlock(&run->ConsumerLock);
+
+        // The completed request carries one batch
+        run->Wakeups++;
+        Drain(run, buffer);
+    }
+    free(buffer);
+    return NULL;
+}
+
+static int
+CompareLatency(const void* Left, const void* Right)
+{
+    ULONG64 left = *(const ULONG64*)Left;
+    ULONG64 right = *(const ULONG64*)Right;
+    return left < right ? -1 : left > right;
+}
+
+static int
+RunPolicy(const WAIT_POLICY* Policy, ULONG Rate, ULONG Total)
+{
+    WAIT_RUN* run = calloc(1, sizeof(WAIT_RUN));
+    pthread_condattr_t monotonic;
+    pthread_t producer;
+    pthread_t consumer;
+    pthread_t notifier;
+
+    if (!run || !NT_SUCCESS(InitializeQueue(&run->Queue, QUEUE_BYTES))) {
+        fprintf(stderr, "waitBench: out of memory\n");
+        return 1;
+    }
+    SetQueuePolicy(&run->Queue, QueueDropNewest);
+    run->Policy = Policy;
+    run->Rate = Rate;
+    run->Total = Total;
+    run->Latencies = calloc(Total, sizeof(ULONG64));
+    pthread_condattr_init(&monotonic);
+    pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+    pthread_mutex_init(&run->ConsumerLock, NULL);
+    pthread_cond_init(&run->ConsumerWake, NULL);
+    pthread_mutex_init(&run->NotifierLock, NULL);
+    pthread_cond_init(&run->NotifierWake, &monotonic);
+
+    ULONG64 start = HostNow();
+    pthread_create(&notifier, NULL, Notifier, run);
+    pthread_create(&consumer, NULL, Policy->PollMs ? PollingConsumer : WaitingConsumer, run);
+    pthread_create(&producer, NULL, Producer, run);
+    pthread_join(producer, NULL);
+
+    // Every record is due within the longest interval; past a second, whatever is missing is lost
+    ULONG64 deadline = HostNow() + 1000000000ull;
+    while ((ULONG)ReadNoFence(&run->Delivered) < Total && HostNow() < deadline) {
+        usleep(1000);
+    }
+    double seconds = (double)(HostNow() - start) / 1e9;
+    InterlockedExchange(&run->Stop, 1);
+    pthread_mutex_lock(&run->ConsumerLock);
+    pthread_cond_signal(&run->ConsumerWake);
+    pthread_mutex_unlock(&run->ConsumerLock);
+    pthread_mutex_lock(&run->NotifierLock);
+    pthread_cond_signal(&run->NotifierWake);
+    pthread_mutex_unlock(&run->NotifierLock);
+    pthread_join(consumer, NULL);
+    pthread_join(notifier, NULL);
+
+    ULONG delivered = (ULONG)run->Delivered;
+    qsort(run->Latencies, delivered, sizeof(ULONG64), CompareLatency);
+    double p50 = delivered ? (double)run->Latencies[delivered / 2] / 1e6 : 0;
+    double p99 = delivered ? (double)run->Latencies[(ULONG64)delivered * 99 / 100] / 1e6 : 0;
+    double worst = delivered ? (double)run->Latencies[delivered - 1] / 1e6 : 0;
+    printf("%-14s %6u events/s  %7u delivered  p50 %8.3f ms  p99 %8.3f ms  max %8.3f ms  %8.1f wakeups/s\n",
+        Policy->Name, Rate, delivered, p50, p99, worst, run->Wakeups / seconds);
+
+    ULONG64 dropped = run->Queue.Dropped;
+    CleanupQueue(&run->Queue);
+    pthread_cond_destroy(&run->NotifierWake);
+    pthread_mutex_destroy(&run->NotifierLock);
+    pthread_cond_destroy(&run->ConsumerWake);
+    pthread_mutex_destroy(&run->ConsumerLock);
+    pthread_condattr_destroy(&monotonic);
+    free(run->Latencies);
+    free(run);
+    if (delivered != Total || dropped) {
+        fprintf(stderr, "waitBench: %s delivered %u of %u records, %llu dropped\n", Policy->Name, delivered, Total,
+            (unsigned long long)dropped);
+        return 1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    BOOLEAN quick = HostQuick(argc, argv);
+    static const WAIT_POLICY policies[] = {
+        { "poll 100ms", 100, 0, 0 },
+        { "poll 10ms", 10, 0, 0 },
+        { "wait any", 0, 1, 0 },
+        { "wait 16KB/10ms", 0, 16 * 1024, 10 },
+    };
+    ULONG rates[] = { 100, 10000 };
+    double seconds = quick ? 0.1 : 3;
+    int result = 0;
+
+    for (ULONG r = 0; r < ARRAYSIZE(rates); r++) {
+        for (ULONG p = 0; p < ARRAYSIZE(policies); p++) {
+            result |= RunPolicy(&policies[p], rates[r], (ULONG)(rates[r] * seconds));
+        }
+    }
+    return result;
+}
@@ -0,0 +1,148 @@
+/**
+ * @file blockPoolTest.c
+ * @brief Tests of the size-classed block pool: rounding to the classes, the usage counters, blocks past the
+ *        largest class, and allocations and frees from several threads at once.
+ */
+
+#include "hostTest.h"
+#include <string.h>
+#include "blockPool.h"
+
+#define CHURN_THREADS 4
+#define CHURN_SLOTS 256
+
+static BLOCK_POOL Pool;
+
+// Allocates a block, checks its alignment and writes every byte of it, which a sanitizer checks against the class
+static PVOID
+Allocate(SIZE_T Size)
+{
+    PUCHAR block = BlockPoolAllocate(&Pool, Size);
+    CHECK(block != NULL);
+    if (block) {
+        CHECK(((ULONG_PTR)block & (MEMORY_ALLOCATION_ALIGNMENT - 1)) == 0);
+        memset(block, 0x5A, Size);
+    }
+    return block;
+}
+
+static VOID
+CheckUsage(ULONG64 Count, ULONG64 Bytes, ULONG64 UsedBytes)
+{
+    MEMORY_USAGE usage;
+    BlockPoolQueryUsage(&Pool, &usage);
+    CHECK(usage.Tag == 'tseT');
+    CHECK(usage.Count == Count);
+    CHECK(usage.Bytes == Bytes);
+    CHECK(usage.UsedBytes == UsedBytes);
+}
+
+static VOID
+TestClassRounding(VOID)
+{
+    static const SIZE_T sizes[] = { 1, 64, 65, 100, 300, 1000, BLOCK_POOL_MAX_BLOCK };
+    static const SIZE_T rounded[] = { 64, 64, 96, 128, 320, 1024, BLOCK_POOL_MAX_BLOCK };
+    PVOID blocks[ARRAYSIZE(sizes)];
+    ULONG64 bytes = 0;
+    ULONG64 used = 0;
+
+    CHECK_STATUS(STATUS_SUCCESS, BlockPoolInitialize(&Pool, 'tseT'));
+    CheckUsage(0, 0, 0);
+    for (ULONG i = 0; i < ARRAYSIZE(sizes); i++) {
+        blocks[i] = Allocate(sizes[i]);
+        bytes += rounded[i];
+        used += sizes[i];
+        CheckUsage(i + 1, bytes, used);
+    }
+
+    // Freeing passes the requested size back, which must land in the same class
+    for (ULONG i = 0; i < ARRAYSIZE(sizes); i++) {
+        BlockPoolFree(&Pool, blocks[i], sizes[i]);
+        bytes -= rounded[i];
+        used -= sizes[i];
+        CheckUsage(ARRAYSIZE(sizes) - i - 1, bytes, used);
+    }
+    BlockPoolDelete(&Pool);
+}
+
+static VOID
+TestLargeBlocks(VOID)
+{
+    CHECK_STATUS(STATUS_SUCCESS, BlockPoolInitialize(&Pool, 'tseT'));
+
+    // Past the largest class a block is exactly as large as asked, with nothing lost to rounding
+    PVOID large = Allocate(BLOCK_POOL_MAX_BLOCK + 1);
+    PVOID huge = Allocate(64 * 1024);
+    CheckUsage(2, BLOCK_POOL_MAX_BLOCK + 1 + 64 * 1024, BLOCK_POOL_MAX_BLOCK + 1 + 64 * 1024);
+    BlockPoolFree(&Pool, large, BLOCK_POOL_MAX_BLOCK + 1);
+    BlockPoolFree(&Pool, huge, 64 * 1024);
+    CheckUsage(0, 0, 0);
+
+    // Deleting twice is harmless
+    BlockPoolDelete(&Pool);
+    BlockPoolDelete(&Pool);
+    CHECK(!Pool.Initialized);
+}
+
+// Each thread keeps a set of blocks of varying sizes and replaces them at random, checking none was overwritten
+static void*
+Churn(void* Argument)
+{
+    ULONG seed = (ULONG)(ULONG_PTR)Argument;
+    PUCHAR blocks[CHURN_SLOTS] = { 0 };
+    SIZE_T sizes[CHURN_SLOTS] = { 0 };
+
+    for (ULONG i = 0; i < 20000; i++) {
+        seed = seed * 1103515245 + 12345;
+        ULONG slot = (seed >> 8) % CHURN_SLOTS;
+        if (blocks[slot]) {
+            for (SIZE_T k = 0; k < sizes[slot]; k++) {
+                if (blocks[slot][k] != (UCHAR)slot) {
+                    CHECK(!"block overwritten");
+                    break;
+                }
+            }
+            BlockPoolFree(&Pool, blocks[slot], sizes[slot]);
+        }
+        sizes[slot] = 1 + (seed >> 4) % (BLOCK_POOL_MAX_BLOCK + 200);
+        blocks[slot] = BlockPoolAllocate(&Pool, sizes[slot]);
+        if (!blocks[slot]) {
+            CHECK(!"allocation failed");
+            break;
+        }
+        memset(blocks[slot], (UCHAR)slot, sizes[slot]);
+    }
+    for (ULONG slot = 0; slot < CHURN_SLOTS; slot++) {
+        if (blocks[slot]) {
+            BlockPoolFree(&Pool, blocks[slot], sizes[slot]);
+        }
+    }
+    return NULL;
+}
+
+static VOID
+TestConcurrentChurn(VOID)
+{
+    pthread_t threads[CHURN_THREADS];
+
+    CHECK_STATUS(STATUS_SUCCESS, BlockPoolInitialize(&Pool, 'tseT'));
+    for (ULONG i = 0; i < CHURN_THREADS; i++) {
+        pthread_create(&threads[i], NULL, Churn, (void*)(ULONG_PTR)(i + 1));
+    }
+    for (ULONG i = 0; i < CHURN_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // The counters are interlocked, so they balance once every thread has freed its blocks
+    CheckUsage(0, 0, 0);
+    BlockPoolDelete(&Pool);
+}
+
+int
+main(void)
+{
+    RUN_TEST(TestClassRounding);
+    RUN_TEST(TestLargeBlocks);
+    RUN_TEST(TestConcurrentChurn);
+    return HostTestResult();
+}
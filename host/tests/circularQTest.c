@@ -0,0 +1,513 @@
+#include "hostTest.h"
+#include <stdlib.h>
+#include "circularQ.h"
+
+// Payload of a test record; like the driver's messages it starts with its size and a nonzero id
+typedef struct _TEST_RECORD {
+    ULONG Size;
+    ULONG Id;
+    ULONG Producer;
+    ULONG Sequence;
+    UCHAR Fill[1];
+} TEST_RECORD, *PTEST_RECORD;
+
+#define TEST_RECORD_MIN FIELD_OFFSET(TEST_RECORD, Fill)
+
+static BOOLEAN
+Enqueue(PCIRCULAR_QUEUE Queue, ULONG Length, ULONG Producer, ULONG Sequence, ULONG Flags)
+{
+    QUEUE_RESERVATION reservation;
+    PTEST_RECORD record = BeginEnqueue(Queue, Length, Flags, &reservation);
+    if (!record) {
+        return FALSE;
+    }
+    record->Size = Length;
+    record->Id = Sequence + 1;
+    record->Producer = Producer;
+    record->Sequence = Sequence;
+    memset(record->Fill, (UCHAR)Sequence, Length - TEST_RECORD_MIN);
+    EndEnqueue(Queue, &reservation);
+    return TRUE;
+}
+
+// Checks a dequeued payload's fill pattern
+static BOOLEAN
+RecordIntact(const TEST_RECORD* Record, ULONG Length)
+{
+    if (Record->Size != Length) {
+        return FALSE;
+    }
+    for (ULONG i = 0; i < Length - TEST_RECORD_MIN; i++) {
+        if (Record->Fill[i] != (UCHAR)Record->Sequence) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static VOID
+TestFifoAcrossWraps(VOID)
+{
+    CIRCULAR_QUEUE queue;
+    UCHAR buffer[512];
+    ULONG length;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeQueue(&queue, 4096));
+    CHECK(queue.Capacity == 4096);
+    CHECK_STATUS(STATUS_NO_MORE_ENTRIES, Dequeue(&queue, buffer, sizeof(buffer), &length));
+
+    // Odd sizes make records straddle the end of the ring over and over, which takes a filler each time
+    for (ULONG i = 0; i < 2000; i++) {
+        ULONG size = TEST_RECORD_MIN + (i * 37) % 300;
+        CHECK(Enqueue(&queue, size, 0, i, 0));
+        CHECK(QueueHasRecord(&queue));
+        CHECK_STATUS(STATUS_SUCCESS, Dequeue(&queue, buffer, sizeof(buffer), &length));
+        CHECK(length == size);
+        CHECK(((PTEST_RECORD)buffer)->Sequence == i);
+        CHECK(RecordIntact((PTEST_RECORD)buffer, length));
+    }
+    CHECK(!QueueHasRecord(&queue));
+    CHECK(QueueUsedBytes(&queue) == 0);
+    CHECK(queue.Dropped == 0);
+    CleanupQueue(&queue);
+}
+
+static VOID
+TestBufferTooSmall(VOID)
+{
+    CIRCULAR_QUEUE queue;
+    UCHAR buffer[256];
+    ULONG length;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeQueue(&queue, 4096));
+    CHECK(Enqueue(&queue, 200, 0, 7, 0));
+    CHECK_STATUS(STATUS_BUFFER_TOO_SMALL, Dequeue(&queue, buffer, 100, &length));
+    CHECK(length == 200);
+
+    // The record stays queued for a large enough buffer
+    CHECK_STATUS(STATUS_SUCCESS, Dequeue(&queue, buffer, sizeof(buffer), &length));
+    CHECK(((PTEST_RECORD)buffer)->Sequence == 7);
+
+    // Records larger than the limit never get in
+    CHECK(!Enqueue(&queue, QueueMaxRecordLength(&queue) + 1, 0, 8, 0));
+    CHECK(queue.Dropped == 1);
+    CleanupQueue(&queue);
+}
+
+// Dequeues everything into Sequences (up to Max) and returns the count; gap markers add to *Lost
+static ULONG
+Drain(PCIRCULAR_QUEUE Queue, PULONG Sequences, ULONG Max, PULONG64 Lost)
+{
+    static UCHAR buffer[64 * 1024];
+    ULONG count = 0;
+    ULONG records;
+    ULONG length;
+
+    while (NT_SUCCESS(DequeueBatch(Queue, buffer, sizeof(buffer), &records, &length))) {
+        ULONG offset = 0;
+        for (ULONG i = 0; i < records; i++) {
+            offset = (offset + QUEUE_BATCH_ALIGNMENT - 1) & ~(QUEUE_BATCH_ALIGNMENT - 1);
+            PTEST_RECORD record = (PTEST_RECORD)(buffer + offset);
+            if (record->Id == 0) {
+                PQUEUE_GAP_MARKER marker = (PQUEUE_GAP_MARKER)record;
+                *Lost += marker->Lost;
+            }
+            else if (count < Max) {
+                Sequences[count++] = record->Sequence;
+            }
+            offset += record->Size;
+        }
+    }
+    return count;
+}
+
+// A batch bigger than one hold of the lock still comes out whole and in order
+static VOID
+TestLargeBatch(VOID)
+{
+    CIRCULAR_QUEUE queue;
+    PUCHAR buffer = malloc(1024 * 1024);
+    ULONG records;
+    ULONG length;
+    ULONG enqueued = 0;
+    ULONG offset = 0;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeQueue(&queue, 256 * 1024));
+    SetQueuePolicy(&queue, QueueDropNewest);
+    while (Enqueue(&queue, TEST_RECORD_MIN + (enqueued * 37) % 900, 0, enqueued, 0)) {
+        enqueued++;
+    }
+    CHECK(enqueued > 256);
+
+    CHECK_STATUS(STATUS_SUCCESS, DequeueBatch(&queue, buffer, 1024 * 1024, &records, &length));
+    CHECK(records == enqueued);
+    for (ULONG i = 0; i < records; i++) {
+        offset = (offset + QUEUE_BATCH_ALIGNMENT - 1) & ~(QUEUE_BATCH_ALIGNMENT - 1);
+        PTEST_RECORD record = (PTEST_RECORD)(buffer + offset);
+        CHECK(record->Sequence == i);
+        CHECK(RecordIntact(record, TEST_RECORD_MIN + (i * 37) % 900));
+        offset += record->Size;
+    }
+    CHECK(offset == length);
+    CHECK(!QueueHasRecord(&queue));
+    CHECK(QueueUsedBytes(&queue) == 0);
+    CleanupQueue(&queue);
+    free(buffer);
+}
+
+static VOID
+TestOverflowPolicies(VOID)
+{
+    CIRCULAR_QUEUE queue;
+    ULONG sequences[64];
+    ULONG64 lost = 0;
+
+    // Each record takes 64 bytes of a 1 KB ring
+    CHECK_STATUS(STATUS_SUCCESS, InitializeQueue(&queue, 1024));
+    for (ULONG i = 0; i < 40; i++) {
+        CHECK(Enqueue(&queue, 48, 0, i, 0));
+    }
+
+    // Drop oldest: the newest records survive, behind a marker counting the overwritten ones
+    ULONG count = Drain(&queue, sequences, ARRAYSIZE(sequences), &lost);
+    CHECK(count > 0 && sequences[count - 1] == 39);
+    CHECK(count + lost == 40);
+    CHECK((ULONG64)queue.Overwritten == lost);
+    for (ULONG i = 1; i < count; i++) {
+        CHECK(sequences[i] == sequences[i - 1] + 1);
+    }
+
+    // Drop newest: the oldest survive, and the marker goes in front of the first record after the loss
+    SetQueuePolicy(&queue, QueueDropNewest);
+    lost = 0;
+    ULONG accepted = 0;
+    for (ULONG i = 0; i < 40; i++) {
+        accepted += Enqueue(&queue, 48, 0, 100 + i, 0);
+    }
+    CHECK(accepted < 40);
+    count = Drain(&queue, sequences, ARRAYSIZE(sequences), &lost);
+    CHECK(count == accepted && sequences[0] == 100 && lost == 0);
+    CHECK(Enqueue(&queue, 48, 0, 200, 0));
+    count = Drain(&queue, sequences, ARRAYSIZE(sequences), &lost);
+    CHECK(count == 1 && sequences[0] == 200 && lost == 40 - accepted);
+
+    // Prefer priority: only a priority record may push old ones out
+    SetQueuePolicy(&queue, QueuePreferPriority);
+    lost = 0;
+    accepted = 0;
+    for (ULONG i = 0; i < 40; i++) {
+        accepted += Enqueue(&queue, 48, 0, 300 + i, 0);
+    }
+    CHECK(accepted < 40);
+    CHECK(!Enqueue(&queue, 48, 0, 400, 0));
+    CHECK(Enqueue(&queue, 48, 0, 401, QUEUE_ENQUEUE_PRIORITY));
+    count = Drain(&queue, sequences, ARRAYSIZE(sequences), &lost);
+    CHECK(count > 0 && sequences[count - 1] == 401);
+    CleanupQueue(&queue);
+}
+
+static VOID
+TestMoveQueue(VOID)
+{
+    CIRCULAR_QUEUE from;
+    CIRCULAR_QUEUE to;
+    ULONG sequences[64];
+    ULONG64 lost = 0;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeQueue(&from, 4096));
+    CHECK_STATUS(STATUS_SUCCESS, InitializeQueue(&to, 8192));
+    CHECK(Enqueue(&to, 40, 0, 0, 0));
+    for (ULONG i = 1; i <= 10; i++) {
+        CHECK(Enqueue(&from, 40 + i, 0, i, 0));
+    }
+    MoveQueue(&to, &from);
+    CHECK(!QueueHasRecord(&from));
+
+    ULONG count = Drain(&to, sequences, ARRAYSIZE(sequences), &lost);
+    CHECK(count == 11 && lost == 0);
+    for (ULONG i = 0; i < count; i++) {
+        CHECK(sequences[i] == i);
+    }
+    CleanupQueue(&from);
+    CleanupQueue(&to);
+}
+
+// Concurrent producers against one draining consumer: every record arrives intact and in per-producer order,
+// or is accounted for by a gap marker
+
+#define PRODUCERS 4
+#define RECORDS_PER_PRODUCER 50000
+
+typedef struct _PRODUCER_CONTEXT {
+    PCIRCULAR_QUEUE Queue;
+    ULONG Producer;
+} PRODUCER_CONTEXT;
+
+static volatile LONG ProducersDone;
+
+static void*
+ProducerThread(void* Argument)
+{
+    PRODUCER_CONTEXT* context = Argument;
+    for (ULONG i = 0; i < RECORDS_PER_PRODUCER; i++) {
+        Enqueue(context->Queue, TEST_RECORD_MIN + (i * 13 + context->Producer * 7) % 200, context->Producer, i,
+            (i & 7) == 0 ? QUEUE_ENQUEUE_PRIORITY : 0);
+
+        // Lets the consumer in now and then even on a single processor, so the ring both fills and drains
+        if ((i & 255) == 0) {
+            sched_yield();
+        }
+    }
+    InterlockedIncrement(&ProducersDone);
+    return NULL;
+}
+
+static VOID
+RunConcurrent(QUEUE_OVERFLOW_POLICY Policy)
+{
+    static UCHAR buffer[16 * 1024];
+    CIRCULAR_QUEUE queue;
+    pthread_t threads[PRODUCERS];
+    PRODUCER_CONTEXT contexts[PRODUCERS];
+    LONG64 next[PRODUCERS] = { 0 };
+    ULONG64 received = 0;
+    ULONG64 lost = 0;
+    BOOLEAN ordered = TRUE;
+    BOOLEAN intact = TRUE;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeQueue(&queue, 64 * 1024));
+    SetQueuePolicy(&queue, Policy);
+    ProducersDone = 0;
+    for (ULONG p = 0; p < PRODUCERS; p++) {
+        contexts[p].Queue = &queue;
+        contexts[p].Producer = p;
+        pthread_create(&threads[p], NULL, ProducerThread, &contexts[p]);
+    }
+
+    for (;;) {
+        BOOLEAN done = ReadAcquire(&ProducersDone) == PRODUCERS;
+        ULONG records;
+        ULONG length;
+        while (NT_SUCCESS(DequeueBatch(&queue, buffer, sizeof(buffer), &records, &length))) {
+            ULONG offset = 0;
+            for (ULONG i = 0; i < records; i++) {
+                offset = (offset + QUEUE_BATCH_ALIGNMENT - 1) & ~(QUEUE_BATCH_ALIGNMENT - 1);
+                PTEST_RECORD record = (PTEST_RECORD)(buffer + offset);
+                if (record->Id == 0) {
+                    lost += ((PQUEUE_GAP_MARKER)record)->Lost;
+                }
+                else {
+                    received++;
+                    intact &= RecordIntact(record, record->Size);
+                    ordered &= record->Producer < PRODUCERS && (LONG64)record->Sequence >= next[record->Producer];
+                    next[record->Producer % PRODUCERS] = (LONG64)record->Sequence + 1;
+                }
+                offset += record->Size;
+            }
+        }
+        if (done) {
+            break;
+        }
+        sched_yield();
+    }
+
+    for (ULONG p = 0; p < PRODUCERS; p++) {
+        pthread_join(threads[p], NULL);
+    }
+
+    // Losses not yet reported by a marker stay in Lost until the next record
+    lost += (ULONG64)queue.Lost;
+    CHECK(intact);
+    CHECK(ordered);
+    CHECK(received + lost == (ULONG64)PRODUCERS * RECORDS_PER_PRODUCER);
+    CHECK((ULONG64)queue.Dropped == lost);
+    CleanupQueue(&queue);
+}
+
+static VOID
+TestConcurrentDropOldest(VOID)
+{
+    RunConcurrent(QueueDropOldest);
+}
+
+static VOID
+TestConcurrentDropNewest(VOID)
+{
+    RunConcurrent(QueueDropNewest);
+}
+
+static VOID
+TestConcurrentPreferPriority(VOID)
+{
+    RunConcurrent(QueuePreferPriority);
+}
+
+// A shared ring consumed in place as sharedQueue.h describes, by a thread standing in for the user-mode process
+
+typedef struct _SHARED_CONSUMER {
+    PQUEUE_SHARED_HEADER Header;
+    const UCHAR* Data;
+    ULONG64 Received;
+    ULONG64 Lost;
+    BOOLEAN Ordered;
+    BOOLEAN Intact;
+} SHARED_CONSUMER;
+
+static VOID
+ConsumeShared(SHARED_CONSUMER* Consumer, LONG64 Next[PRODUCERS])
+{
+    PQUEUE_SHARED_HEADER header = Consumer->Header;
+    LONG64 head = header->Head;
+
+    for (;;) {
+        const QUEUE_RECORD_HEADER* record = (const QUEUE_RECORD_HEADER*)(Consumer->Data + (head & (header->Capacity - 1)));
+        if (ReadAcquire64(&record->Stamp) != head + 1) {
+            break;
+        }
+        ULONG size = record->Size;
+        if (record->Length != QUEUE_PAD_RECORD) {
+            const TEST_RECORD* payload = (const TEST_RECORD*)(record + 1);
+            if (payload->Id == 0) {
+                Consumer->Lost += ((PQUEUE_GAP_MARKER)payload)->Lost;
+            }
+            else {
+                Consumer->Received++;
+                Consumer->Intact &= RecordIntact(payload, record->Length);
+                Consumer->Ordered &= payload->Producer < PRODUCERS && (LONG64)payload->Sequence >= Next[payload->Producer];
+                Next[payload->Producer % PRODUCERS] = (LONG64)payload->Sequence + 1;
+            }
+        }
+        head += size;
+        WriteRelease64(&header->Head, head);
+    }
+}
+
+static VOID
+TestSharedRing(VOID)
+{
+    CIRCULAR_QUEUE queue;
+    pthread_t threads[PRODUCERS];
+    PRODUCER_CONTEXT contexts[PRODUCERS];
+    LONG64 next[PRODUCERS] = { 0 };
+    SHARED_CONSUMER consumer = { 0 };
+    QUEUE_USER_MAPPING mapping;
+
+    CHECK_STATUS(STATUS_INVALID_PARAMETER, InitializeSharedQueue(&queue, PAGE_SIZE / 2));
+    CHECK_STATUS(STATUS_SUCCESS, InitializeSharedQueue(&queue, 64 * 1024));
+    CHECK_STATUS(STATUS_SUCCESS, MapQueue(&queue, &mapping));
+
+    // The consumer's views are separate from the driver's; the records one is mapped read-only, so a consumer that
+    // wrote to it, as version 2 consumers did, would fault here
+    consumer.Header = mapping.Header;
+    consumer.Data = mapping.Data;
+    CHECK(consumer.Header != NULL && (PVOID)consumer.Header != (PVOID)queue.Shared);
+    CHECK(consumer.Data != NULL && consumer.Data != queue.Buffer);
+    CHECK(consumer.Header->Version == QUEUE_SHARED_VERSION);
+    CHECK(consumer.Header->Capacity == 64 * 1024);
+    consumer.Ordered = TRUE;
+    consumer.Intact = TRUE;
+
+    // The policy is ignored: a shared ring never overtakes its consumer
+    SetQueuePolicy(&queue, QueueDropOldest);
+    ProducersDone = 0;
+    for (ULONG p = 0; p < PRODUCERS; p++) {
+        contexts[p].Queue = &queue;
+        contexts[p].Producer = p;
+        pthread_create(&threads[p], NULL, ProducerThread, &contexts[p]);
+    }
+    for (;;) {
+        BOOLEAN done = ReadAcquire(&ProducersDone) == PRODUCERS;
+        ConsumeShared(&consumer, next);
+        if (done) {
+            break;
+        }
+        sched_yield();
+    }
+    for (ULONG p = 0; p < PRODUCERS; p++) {
+        pthread_join(threads[p], NULL);
+    }
+
+    CHECK(consumer.Intact);
+    CHECK(consumer.Ordered);
+    CHECK(queue.Overwritten == 0);
+    CHECK(consumer.Received + consumer.Lost + (ULONG64)queue.Lost == (ULONG64)PRODUCERS * RECORDS_PER_PRODUCER);
+
+    // A consumer position from nowhere is clamped to what was handed out
+    WriteRelease64(&consumer.Header->Head, queue.Tail + 12345);
+    CHECK(QueueUsedBytes(&queue) == 0);
+    WriteRelease64(&consumer.Header->Head, -1000000);
+    CHECK(QueueUsedBytes(&queue) == queue.Capacity);
+
+    UnmapQueue(&queue, &mapping);
+    CleanupQueue(&queue);
+}
+
+// Payloads full of the stamps the next lap will wait for: if released space were handed out again without being
+// zeroed, the consumer would take a reserved but unwritten record for a published one
+static VOID
+TestSharedRingReuse(VOID)
+{
+    CIRCULAR_QUEUE queue;
+    QUEUE_USER_MAPPING mapping;
+    QUEUE_RESERVATION reservation;
+    const ULONG capacity = PAGE_SIZE;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeSharedQueue(&queue, capacity));
+    CHECK_STATUS(STATUS_SUCCESS, MapQueue(&queue, &mapping));
+
+    // First lap: 48-byte payloads whose words hold their own position one lap later, plus one
+    for (;;) {
+        PLONG64 payload = BeginEnqueue(&queue, 48, 0, &reservation);
+        if (!payload) {
+            break;
+        }
+        for (ULONG i = 0; i < 6; i++) {
+            payload[i] = reservation.Position + (LONG64)sizeof(QUEUE_RECORD_HEADER) + 8 * i + capacity + 1;
+        }
+        EndEnqueue(&queue, &reservation);
+    }
+    WriteRelease64(&mapping.Header->Head, queue.Tail);
+
+    // Second lap: 16-byte payloads put record headers where the old payload words were
+    ULONG fooled = 0;
+    ULONG records = 0;
+    while (queue.Tail < 2 * (LONG64)capacity - 64) {
+        PVOID payload = BeginEnqueue(&queue, 16, 0, &reservation);
+        CHECK(payload != NULL);
+        if (!payload) {
+            break;
+        }
+
+        // The consumer, caught up, polls the reserved slot; the first one follows the marker of the lap-one drop
+        LONG64 position = reservation.Position;
+        const QUEUE_RECORD_HEADER* record = (const QUEUE_RECORD_HEADER*)((const UCHAR*)mapping.Data + (position & (capacity - 1)));
+        fooled += ReadAcquire64(&record->Stamp) == position + 1;
+        memset(payload, 0, 16);
+        EndEnqueue(&queue, &reservation);
+        CHECK(ReadAcquire64(&record->Stamp) == position + 1);
+        WriteRelease64(&mapping.Header->Head, position + record->Size);
+        records++;
+    }
+    CHECK(records > 100);
+    CHECK(fooled == 0);
+    CHECK(queue.Dropped == 1);
+
+    UnmapQueue(&queue, &mapping);
+    CleanupQueue(&queue);
+}
+
+int
+main(void)
+{
+    RUN_TEST(TestFifoAcrossWraps);
+    RUN_TEST(TestBufferTooSmall);
+    RUN_TEST(TestLargeBatch);
+    RUN_TEST(TestOverflowPolicies);
+    RUN_TEST(TestMoveQueue);
+    RUN_TEST(TestConcurrentDropOldest);
+    RUN_TEST(TestConcurrentDropNewest);
+    RUN_TEST(TestConcurrentPreferPriority);
+    RUN_TEST(TestSharedRing);
+    RUN_TEST(TestSharedRingReuse);
+    return HostTestResult();
+}
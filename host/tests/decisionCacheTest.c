@@ -0,0 +1,255 @@
+/**
+ * @file decisionCacheTest.c
+ * @brief Tests of the per-handle verdict cache against a simulated stream of callbacks: hits while nothing
+ *        changes, a fresh lookup after a rule change or after a rename through any handle on the same volume, and
+ *        the name a miss on a tracked file hands back.
+ */
+
+#include "hostTest.h"
+#include "decisionCache.h"
+#include "fileList.h"
+#include "perfStats.h"
+
+PFLT_FILTER gFilterHandle;
+TRACKED_FILES TrackedFiles;
+
+typedef struct _HANDLE_SIM {
+    FILE_OBJECT FileObject;
+    FLT_IO_PARAMETER_BLOCK Iopb;
+    FLT_CALLBACK_DATA Data;
+    FLT_RELATED_OBJECTS Objects;
+} HANDLE_SIM;
+
+static FLT_INSTANCE Instance;
+static FLT_VOLUME Volume;
+
+static VOID
+OpenHandle(HANDLE_SIM* Handle, PHOST_FILE File)
+{
+    RtlZeroMemory(Handle, sizeof(*Handle));
+    Handle->FileObject.File = File;
+    Handle->Iopb.TargetFileObject = &Handle->FileObject;
+    Handle->Iopb.TargetInstance = &Instance;
+    Handle->Data.Iopb = &Handle->Iopb;
+    Handle->Objects.Instance = &Instance;
+    Handle->Objects.Volume = &Volume;
+    Handle->Objects.FileObject = &Handle->FileObject;
+}
+
+static ULONG64
+Misses(VOID)
+{
+    DECISION_CACHE_STATS stats;
+    GetDecisionCacheStats(&stats);
+    return stats.Misses;
+}
+
+static LONG
+Decide(HANDLE_SIM* Handle)
+{
+    return GetFileDecision(&Handle->Data, &Handle->Objects, NULL);
+}
+
+// What PostSetInformation does once a rename through any handle has succeeded
+static VOID
+Rename(HANDLE_SIM* Handle, PCWSTR NewName)
+{
+    Handle->FileObject.File->Name = HostString(NewName);
+    InvalidateFileDecisions(&Handle->Objects);
+}
+
+static VOID
+TestHitsUntilRulesChange(VOID)
+{
+    HOST_FILE file = { HostString(L"\\Device\\HarddiskVolume1\\Data\\a.txt") };
+    HANDLE_SIM handle;
+    OpenHandle(&handle, &file);
+
+    ULONG64 misses = Misses();
+    CHECK(Decide(&handle) == 0);
+    CHECK(Decide(&handle) == 0);
+    CHECK(Misses() == misses + 1);
+
+    // A new rule bumps the generation, so the cached "untracked" is not trusted any more
+    CHECK_STATUS(STATUS_SUCCESS, AddTrackedFile(&TrackedFiles, L"\\Device\\HarddiskVolume1\\Data\\a.txt", RULE_DEFAULT));
+    CHECK(Decide(&handle) == RULE_DEFAULT);
+    CHECK(Decide(&handle) == RULE_DEFAULT);
+    CHECK(Misses() == misses + 2);
+    CHECK_STATUS(STATUS_SUCCESS, RemoveTrackedFile(&TrackedFiles, L"\\Device\\HarddiskVolume1\\Data\\a.txt"));
+    CHECK(Decide(&handle) == 0);
+    HostCloseFileObject(&handle.FileObject);
+}
+
+static VOID
+TestRenameThroughAnotherHandle(VOID)
+{
+    LONG deny = RULE_TRACK(RULE_OP_DELETE) | RULE_DENY(RULE_OP_DELETE);
+    HOST_FILE file = { HostString(L"\\Device\\HarddiskVolume1\\Scratch\\b.txt") };
+    HANDLE_SIM first;
+    HANDLE_SIM second;
+
+    CHECK_STATUS(STATUS_SUCCESS, AddTrackedDirectory(&TrackedFiles, L"\\Device\\HarddiskVolume1\\Protected\\", deny));
+    OpenHandle(&first, &file);
+    OpenHandle(&second, &file);
+
+    // Both handles cache "untracked" for the file's old name
+    CHECK(Decide(&first) == 0);
+    CHECK(Decide(&second) == 0);
+
+    // Moved into the protected directory through the second handle; the first must not keep its verdict
+    Rename(&second, L"\\Device\\HarddiskVolume1\\Protected\\b.txt");
+    CHECK(Decide(&first) == deny);
+    CHECK(Decide(&second) == deny);
+
+    // And out again: the deny verdict must not outlive the move either
+    Rename(&second, L"\\Device\\HarddiskVolume1\\Scratch\\b.txt");
+    CHECK(Decide(&first) == 0);
+
+    CHECK_STATUS(STATUS_SUCCESS, RemoveTrackedDirectory(&TrackedFiles, L"\\Device\\HarddiskVolume1\\Protected\\"));
+    HostCloseFileObject(&first.FileObject);
+    HostCloseFileObject(&second.FileObject);
+}
+
+static VOID
+TestParentDirectoryRename(VOID)
+{
+    HOST_FILE file = { HostString(L"\\Device\\HarddiskVolume1\\Work\\Logs\\c.log") };
+    HANDLE_SIM handle;
+
+    CHECK_STATUS(STATUS_SUCCESS, AddTrackedDirectory(&TrackedFiles, L"\\Device\\HarddiskVolume1\\Audit\\", RULE_DEFAULT));
+    OpenHandle(&handle, &file);
+    CHECK(Decide(&handle) == 0);
+
+    // Renaming \Work to \Audit renames the file without any operation on its own handle
+    Rename(&handle, L"\\Device\\HarddiskVolume1\\Audit\\Logs\\c.log");
+    CHECK(Decide(&handle) == RULE_DEFAULT);
+
+    CHECK_STATUS(STATUS_SUCCESS, RemoveTrackedDirectory(&TrackedFiles, L"\\Device\\HarddiskVolume1\\Audit\\"));
+    HostCloseFileObject(&handle.FileObject);
+}
+
+static VOID
+TestRenameOnAnotherVolume(VOID)
+{
+    static FLT_INSTANCE otherInstance;
+    static FLT_VOLUME otherVolume;
+    HOST_FILE file = { HostString(L"\\Device\\HarddiskVolume1\\Data\\f.txt") };
+    HOST_FILE otherFile = { HostString(L"\\Device\\HarddiskVolume2\\Data\\g.txt") };
+    HANDLE_SIM handle;
+    HANDLE_SIM other;
+
+    otherVolume.Name = HostString(L"\\Device\\HarddiskVolume2");
+    OpenHandle(&handle, &file);
+    OpenHandle(&other, &otherFile);
+    other.Iopb.TargetInstance = &otherInstance;
+    other.Objects.Instance = &otherInstance;
+    other.Objects.Volume = &otherVolume;
+    CHECK_STATUS(STATUS_SUCCESS, SetupVolumeDecision(&handle.Objects));
+    CHECK_STATUS(STATUS_SUCCESS, SetupVolumeDecision(&other.Objects));
+
+    CHECK(Decide(&handle) == 0);
+    CHECK(Decide(&other) == 0);
+
+    // A rename on the second volume cannot move a file of the first, whose handle keeps its verdict
+    ULONG64 misses = Misses();
+    Rename(&other, L"\\Device\\HarddiskVolume2\\Data\\h.txt");
+    CHECK(Decide(&handle) == 0);
+    CHECK(Misses() == misses);
+    CHECK(Decide(&other) == 0);
+    CHECK(Misses() == misses + 1);
+
+    // While one on the first volume still reaches every handle there
+    Rename(&handle, L"\\Device\\HarddiskVolume1\\Data\\i.txt");
+    CHECK(Decide(&handle) == 0);
+    CHECK(Decide(&other) == 0);
+    CHECK(Misses() == misses + 2);
+
+    HostTeardownInstance(&Instance);
+    HostTeardownInstance(&otherInstance);
+    HostCloseFileObject(&handle.FileObject);
+    HostCloseFileObject(&other.FileObject);
+}
+
+static VOID
+TestNameQueryFailure(VOID)
+{
+    HOST_FILE file = { HostString(L"\\Device\\HarddiskVolume1\\Data\\d.txt") };
+    HANDLE_SIM handle;
+
+    CHECK_STATUS(STATUS_SUCCESS, AddTrackedFile(&TrackedFiles, L"\\Device\\HarddiskVolume1\\Data\\d.txt", RULE_DEFAULT));
+    OpenHandle(&handle, &file);
+
+    // A failed query decides nothing and caches nothing, so the next operation asks again
+    HostFailNameQueries(1, STATUS_OBJECT_NAME_INVALID);
+    CHECK(Decide(&handle) == 0);
+    CHECK(Decide(&handle) == RULE_DEFAULT);
+
+    CHECK_STATUS(STATUS_SUCCESS, RemoveTrackedFile(&TrackedFiles, L"\\Device\\HarddiskVolume1\\Data\\d.txt"));
+    HostCloseFileObject(&handle.FileObject);
+}
+
+static VOID
+TestNameHandedBack(VOID)
+{
+    HOST_FILE tracked = { HostString(L"\\Device\\HarddiskVolume1\\Data\\f.txt") };
+    HOST_FILE untracked = { HostString(L"\\Device\\HarddiskVolume1\\Data\\g.txt") };
+    PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
+    HANDLE_SIM handle;
+    HANDLE_SIM other;
+
+    CHECK_STATUS(STATUS_SUCCESS, AddTrackedFile(&TrackedFiles, L"\\Device\\HarddiskVolume1\\Data\\f.txt", RULE_DEFAULT));
+    OpenHandle(&handle, &tracked);
+    OpenHandle(&other, &untracked);
+
+    // A miss on a tracked file hands its name over; a hit has none to give, nor has an untracked file
+    CHECK(GetFileDecision(&handle.Data, &handle.Objects, &nameInfo) == RULE_DEFAULT);
+    CHECK(nameInfo && RtlEqualUnicodeString(&nameInfo->Name, &tracked.Name, FALSE));
+    if (nameInfo) {
+        FltReleaseFileNameInformation(nameInfo);
+    }
+    CHECK(GetFileDecision(&handle.Data, &handle.Objects, &nameInfo) == RULE_DEFAULT);
+    CHECK(nameInfo == NULL);
+    CHECK(GetFileDecision(&other.Data, &other.Objects, &nameInfo) == 0);
+    CHECK(nameInfo == NULL);
+
+    CHECK_STATUS(STATUS_SUCCESS, RemoveTrackedFile(&TrackedFiles, L"\\Device\\HarddiskVolume1\\Data\\f.txt"));
+    HostCloseFileObject(&handle.FileObject);
+    HostCloseFileObject(&other.FileObject);
+}
+
+static VOID
+TestVolumeDecision(VOID)
+{
+    HOST_FILE file = { HostString(L"\\Device\\HarddiskVolume1\\Data\\e.txt") };
+    HANDLE_SIM handle;
+    OpenHandle(&handle, &file);
+
+    CHECK_STATUS(STATUS_SUCCESS, SetupVolumeDecision(&handle.Objects));
+    CHECK(!GetVolumeDecision(&handle.Objects));
+    CHECK_STATUS(STATUS_SUCCESS, AddTrackedFile(&TrackedFiles, L"\\Device\\HarddiskVolume1\\Data\\e.txt", RULE_DEFAULT));
+    CHECK(GetVolumeDecision(&handle.Objects));
+    CHECK_STATUS(STATUS_SUCCESS, RemoveTrackedFile(&TrackedFiles, L"\\Device\\HarddiskVolume1\\Data\\e.txt"));
+    CHECK(!GetVolumeDecision(&handle.Objects));
+    HostTeardownInstance(&Instance);
+    HostCloseFileObject(&handle.FileObject);
+}
+
+int
+main(void)
+{
+    Volume.Name = HostString(L"\\Device\\HarddiskVolume1");
+    CHECK_STATUS(STATUS_SUCCESS, InitializePerfStats());
+    CHECK_STATUS(STATUS_SUCCESS, InitializeTrackedFiles(&TrackedFiles));
+
+    RUN_TEST(TestHitsUntilRulesChange);
+    RUN_TEST(TestRenameThroughAnotherHandle);
+    RUN_TEST(TestParentDirectoryRename);
+    RUN_TEST(TestRenameOnAnotherVolume);
+    RUN_TEST(TestNameQueryFailure);
+    RUN_TEST(TestNameHandedBack);
+    RUN_TEST(TestVolumeDecision);
+
+    DeleteTrackedFiles(&TrackedFiles);
+    CleanupPerfStats();
+    return HostTestResult();
+}
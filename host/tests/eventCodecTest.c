@@ -0,0 +1,343 @@
+/**
+ * @file eventCodecTest.c
+ * @brief Tests of the interned strings of deletion messages, encoded by the driver's eventEncoder.c and decoded
+ *        by watchFlt's eventDecoder.c: a name is resolved or unknown, never wrong, and it is never unknown unless
+ *        its definition was overwritten.
+ */
+
+#include "hostTest.h"
+#include <stdlib.h>
+#include <string.h>
+#include "eventEncoder.h"
+#include "eventDecoder.h"
+
+#define DRAIN_BUFFER_SIZE (256 * 1024)
+
+// Messages carry the indexes of their names in ProcessId and ProcessCreateTime, so a decoded name can be checked
+typedef struct _TEST_NAMES {
+    WCHAR Process[64];
+    WCHAR Path[96];
+    UNICODE_STRING ProcessName;
+    UNICODE_STRING PathName;
+} TEST_NAMES;
+
+static VOID
+MakeNames(TEST_NAMES* Names, ULONG Process, ULONG Directory, ULONG File)
+{
+    HostPath(Names->Process, ARRAYSIZE(Names->Process), "\\Device\\HarddiskVolume1\\Tools\\proc%03u.exe", Process);
+    HostPath(Names->Path, ARRAYSIZE(Names->Path), "\\Device\\HarddiskVolume1\\Data\\dir%04u\\file%06u.txt",
+        Directory, File);
+    Names->ProcessName = HostString(Names->Process);
+    Names->PathName = HostString(Names->Path);
+}
+
+static BOOLEAN
+Encode(PEVENT_STRINGS Strings, PCIRCULAR_QUEUE Queue, ULONG Process, ULONG Directory, ULONG File, PULONG Size)
+{
+    TEST_NAMES names;
+    QUEUE_RESERVATION reservation;
+
+    MakeNames(&names, Process, Directory, File);
+    PDELETE_MESSAGE message = ReserveDeleteMessage(Strings, Queue, &names.ProcessName, &names.PathName, 0, &reservation);
+    if (!message) {
+        return FALSE;
+    }
+    message->MessageId = File + 1;
+    message->ProcessId = Process;
+    message->ProcessCreateTime = Directory;
+    message->Flags = 0;
+    if (Size) {
+        *Size = message->Size;
+    }
+    EndEnqueue(Queue, &reservation);
+    return TRUE;
+}
+
+typedef struct _DRAIN_RESULT {
+    ULONG Messages;
+    ULONG Unknown;
+    ULONG Wrong;
+} DRAIN_RESULT;
+
+// Compares a decoded name with the one the message was built from; an unresolved name only counts as unknown
+static VOID
+CheckName(DRAIN_RESULT* Result, const WCHAR* Decoded, USHORT DecodedLength, const WCHAR* Expected, USHORT ExpectedLength)
+{
+    if (!Decoded) {
+        Result->Unknown++;
+    }
+    else if (DecodedLength != ExpectedLength || memcmp(Decoded, Expected, ExpectedLength) != 0) {
+        Result->Wrong++;
+    }
+}
+
+// Dequeues what the queue holds and decodes it in order
+static BOOLEAN
+Drain(PCIRCULAR_QUEUE Queue, PEVENT_STRING_TABLE Table, PUCHAR Buffer, DRAIN_RESULT* Result)
+{
+    ULONG count;
+    ULONG length;
+
+    if (!NT_SUCCESS(DequeueBatch(Queue, Buffer, DRAIN_BUFFER_SIZE, &count, &length))) {
+        return FALSE;
+    }
+    for (ULONG offset = 0, i = 0; i < count; i++) {
+        PDELETE_MESSAGE message = (PDELETE_MESSAGE)(Buffer + offset);
+        offset = (offset + message->Size + QUEUE_BATCH_ALIGNMENT - 1) & ~(QUEUE_BATCH_ALIGNMENT - 1);
+        if (message->MessageId == 0) {
+            continue;
+        }
+
+        DECODED_EVENT event;
+        TEST_NAMES names;
+        if (!DecodeDeleteMessage(Table, message, length - (ULONG)((PUCHAR)message - Buffer), &event)) {
+            Result->Wrong++;
+            continue;
+        }
+        MakeNames(&names, message->ProcessId, (ULONG)message->ProcessCreateTime, message->MessageId - 1);
+        USHORT directoryLength = names.PathName.Length - message->FileNameLength;
+        CheckName(Result, event.ProcessName, event.ProcessNameLength, names.Process, names.ProcessName.Length);
+        CheckName(Result, event.Directory, event.DirectoryLength, names.Path, directoryLength);
+        CheckName(Result, event.FileName, event.FileNameLength, names.Path + directoryLength / sizeof(WCHAR),
+            message->FileNameLength);
+        Result->Messages++;
+    }
+    return TRUE;
+}
+
+static VOID
+TestRoundTrip(VOID)
+{
+    EVENT_STRINGS strings;
+    EVENT_STRING_TABLE table = { 0 };
+    CIRCULAR_QUEUE queue;
+    DRAIN_RESULT result = { 0 };
+    PUCHAR buffer = malloc(DRAIN_BUFFER_SIZE);
+    ULONG first = 0;
+    ULONG second = 0;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeEventStrings(&strings));
+    CHECK_STATUS(STATUS_SUCCESS, InitializeQueue(&queue, 256 * 1024));
+    SetQueuePolicy(&queue, QueueDropNewest);
+
+    // The first message sends both strings in full, the next one of the same directory only their ids
+    CHECK(Encode(&strings, &queue, 1, 1, 0, &first));
+    CHECK(Encode(&strings, &queue, 1, 1, 1, &second));
+    CHECK(first == second + strings.Table.Strings[0]->Length + strings.Table.Strings[1]->Length);
+    for (ULONG i = 0; i < 600; i++) {
+        CHECK(Encode(&strings, &queue, i / 200, i / 20, i + 2, NULL));
+    }
+    while (Drain(&queue, &table, buffer, &result)) {
+    }
+    CHECK(result.Messages == 602);
+    CHECK(result.Unknown == 0);
+    CHECK(result.Wrong == 0);
+
+    ClearEventStrings(&table);
+    CleanupQueue(&queue);
+    CleanupEventStrings(&strings);
+    free(buffer);
+}
+
+static VOID
+TestReaderChanges(VOID)
+{
+    EVENT_STRINGS strings;
+    CIRCULAR_QUEUE queue;
+    int first;
+    int second;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeEventStrings(&strings));
+    CHECK_STATUS(STATUS_SUCCESS, InitializeQueue(&queue, 64 * 1024));
+    CHECK(Encode(&strings, &queue, 1, 1, 0, NULL));
+    LONG epoch = strings.Table.Epoch;
+
+    // Only a different reader starts a new epoch; one that reads again, or another handle opened meanwhile, does not
+    SetEventStringsReader(&strings, &first);
+    CHECK(strings.Table.Epoch == epoch + 1);
+    SetEventStringsReader(&strings, &first);
+    CHECK(strings.Table.Epoch == epoch + 1);
+    ReleaseEventStringsReader(&strings, &second);
+    CHECK(strings.Table.Epoch == epoch + 1);
+    SetEventStringsReader(&strings, &second);
+    CHECK(strings.Table.Epoch == epoch + 2);
+
+    // A closed reader's successor starts over even if it lands at the same address
+    ReleaseEventStringsReader(&strings, &second);
+    SetEventStringsReader(&strings, &second);
+    CHECK(strings.Table.Epoch == epoch + 3);
+
+    // The next message starts the epoch of its queue, and freeing a queue only resets the epoch that went to it
+    CHECK(Encode(&strings, &queue, 1, 1, 1, NULL));
+    CHECK(strings.Table.Epoch == epoch + 4);
+    DetachEventStrings(&strings, NULL);
+    CHECK(strings.Table.Epoch == epoch + 4);
+    DetachEventStrings(&strings, &queue);
+    CHECK(strings.Table.Epoch == epoch + 5);
+
+    CleanupQueue(&queue);
+    CleanupEventStrings(&strings);
+}
+
+static VOID
+TestOverwrittenDefinitions(VOID)
+{
+    EVENT_STRINGS strings;
+    EVENT_STRING_TABLE table = { 0 };
+    CIRCULAR_QUEUE queue;
+    DRAIN_RESULT result = { 0 };
+    PUCHAR buffer = malloc(DRAIN_BUFFER_SIZE);
+
+    // A small ring under drop-oldest loses definitions; the messages after a loss define their strings again
+    CHECK_STATUS(STATUS_SUCCESS, InitializeEventStrings(&strings));
+    CHECK_STATUS(STATUS_SUCCESS, InitializeQueue(&queue, 4096));
+    for (ULONG round = 0; round < 20; round++) {
+        for (ULONG i = 0; i < 150; i++) {
+            CHECK(Encode(&strings, &queue, i % 3, (round * 7 + i) % 11, round * 1000 + i, NULL));
+        }
+        while (Drain(&queue, &table, buffer, &result)) {
+        }
+    }
+    CHECK(queue.Overwritten > 0);
+    CHECK(strings.Table.Epoch > 20);
+    CHECK(result.Messages > 0);
+    CHECK(result.Wrong == 0);
+
+    ClearEventStrings(&table);
+    CleanupQueue(&queue);
+    CleanupEventStrings(&strings);
+    free(buffer);
+}
+
+static VOID
+TestDroppedAndFullEpochs(VOID)
+{
+    EVENT_STRINGS strings;
+    EVENT_STRING_TABLE table = { 0 };
+    CIRCULAR_QUEUE queue;
+    DRAIN_RESULT result = { 0 };
+    PUCHAR buffer = malloc(DRAIN_BUFFER_SIZE);
+    ULONG sent = 0;
+
+    // Drop-newest takes back the ids of dropped definitions, and 3000 directories fill the table twice over
+    CHECK_STATUS(STATUS_SUCCESS, InitializeEventStrings(&strings));
+    CHECK_STATUS(STATUS_SUCCESS, InitializeQueue(&queue, 16 * 1024));
+    SetQueuePolicy(&queue, QueueDropNewest);
+    for (ULONG i = 0; i < 30000; i++) {
+        sent += Encode(&strings, &queue, i % 5, (i * 7) % 3000, i, NULL);
+        if (i % 500 == 499) {
+            while (Drain(&queue, &table, buffer, &result)) {
+            }
+        }
+    }
+    while (Drain(&queue, &table, buffer, &result)) {
+    }
+    CHECK(sent < 30000);
+    CHECK(queue.Overwritten == 0);
+    CHECK(result.Messages == sent);
+    CHECK(result.Unknown == 0);
+    CHECK(result.Wrong == 0);
+
+    ClearEventStrings(&table);
+    CleanupQueue(&queue);
+    CleanupEventStrings(&strings);
+    free(buffer);
+}
+
+// Producers share the strings while the reader changes under them. Nothing is overwritten, so every name must
+// resolve: a message found by id must follow its definition and precede the next epoch.
+#define ENCODERS 4
+#define ENCODER_MESSAGES 40000
+
+typedef struct _ENCODER_RUN {
+    EVENT_STRINGS Strings;
+    CIRCULAR_QUEUE Queue;
+    volatile LONG Done;
+    volatile LONG Sent;
+} ENCODER_RUN;
+
+static ENCODER_RUN EncoderRun;
+
+// Switches readers as fast as it can, so resets land between the lookups and reservations of the encoders
+static void*
+ReaderSwitcher(void* Context)
+{
+    int readers[2];
+    UNREFERENCED_PARAMETER(Context);
+
+    for (ULONG i = 0; ReadAcquire(&EncoderRun.Done) < ENCODERS; i++) {
+        SetEventStringsReader(&EncoderRun.Strings, &readers[i % 2]);
+        if (i % 16 == 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void*
+Encoder(void* Context)
+{
+    ULONG seed = (ULONG)(ULONG_PTR)Context * 2654435761u + 1;
+    LONG sent = 0;
+
+    for (ULONG i = 0; i < ENCODER_MESSAGES; i++) {
+        seed = seed * 1103515245 + 12345;
+        ULONG directory = (seed >> 8) % 1500;
+        sent += Encode(&EncoderRun.Strings, &EncoderRun.Queue, (seed >> 20) % 8, directory, i, NULL);
+    }
+    InterlockedAdd(&EncoderRun.Sent, sent);
+    InterlockedIncrement(&EncoderRun.Done);
+    return NULL;
+}
+
+static VOID
+TestConcurrentEncoders(VOID)
+{
+    EVENT_STRING_TABLE table = { 0 };
+    DRAIN_RESULT result = { 0 };
+    PUCHAR buffer = malloc(DRAIN_BUFFER_SIZE);
+    pthread_t threads[ENCODERS];
+    pthread_t switcher;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeEventStrings(&EncoderRun.Strings));
+    CHECK_STATUS(STATUS_SUCCESS, InitializeQueue(&EncoderRun.Queue, 256 * 1024));
+    SetQueuePolicy(&EncoderRun.Queue, QueueDropNewest);
+    for (ULONG i = 0; i < ENCODERS; i++) {
+        pthread_create(&threads[i], NULL, Encoder, (PVOID)(ULONG_PTR)i);
+    }
+    pthread_create(&switcher, NULL, ReaderSwitcher, NULL);
+
+    for (;;) {
+        BOOLEAN done = ReadAcquire(&EncoderRun.Done) == ENCODERS;
+        if (!Drain(&EncoderRun.Queue, &table, buffer, &result)) {
+            if (done) {
+                break;
+            }
+            sched_yield();
+        }
+    }
+    for (ULONG i = 0; i < ENCODERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_join(switcher, NULL);
+    CHECK(result.Messages == (ULONG)EncoderRun.Sent);
+    CHECK(result.Unknown == 0);
+    CHECK(result.Wrong == 0);
+    CHECK(EncoderRun.Strings.Table.Epoch > 2);
+
+    ClearEventStrings(&table);
+    CleanupQueue(&EncoderRun.Queue);
+    CleanupEventStrings(&EncoderRun.Strings);
+    free(buffer);
+}
+
+int
+main(void)
+{
+    RUN_TEST(TestRoundTrip);
+    RUN_TEST(TestReaderChanges);
+    RUN_TEST(TestOverwrittenDefinitions);
+    RUN_TEST(TestDroppedAndFullEpochs);
+    RUN_TEST(TestConcurrentEncoders);
+    return HostTestResult();
+}
@@ -0,0 +1,281 @@
+#include "hostTest.h"
+#include <stdlib.h>
+#include "fileList.h"
+#include "ruleCompiler.h"
+#include "foldedName.h"
+#include "perfStats.h"
+
+static LONG
+Lookup(PTRACKED_FILES Files, PCWSTR Path)
+{
+    UNICODE_STRING path = HostString(Path);
+    return GetTrackedFile(Files, &path);
+}
+
+static VOID
+TestNamesAndDirectories(VOID)
+{
+    TRACKED_FILES files;
+    CHECK_STATUS(STATUS_SUCCESS, InitializeTrackedFiles(&files));
+    LONG64 generation = GetTrackedFilesGeneration(&files);
+    CHECK(GetTrackedOperations(&files) == 0);
+
+    CHECK_STATUS(STATUS_SUCCESS, AddTrackedFile(&files, L"\\Device\\HarddiskVolume3\\Data\\a.txt", RULE_DEFAULT));
+    CHECK_STATUS(STATUS_ALREADY_REGISTERED, AddTrackedFile(&files, L"\\DEVICE\\HARDDISKVOLUME3\\DATA\\A.TXT", RULE_DEFAULT));
+    CHECK_STATUS(STATUS_INVALID_PARAMETER, AddTrackedFile(&files, L"\\Device\\HarddiskVolume3\\b.txt", 0));
+    CHECK(GetTrackedFilesGeneration(&files) > generation);
+    CHECK(GetTrackedOperations(&files) == RULE_DEFAULT);
+
+    // Names match in any case; other files on the volume do not
+    CHECK(Lookup(&files, L"\\device\\harddiskvolume3\\data\\A.txt") == RULE_DEFAULT);
+    CHECK(Lookup(&files, L"\\Device\\HarddiskVolume3\\Data\\b.txt") == 0);
+
+    // A directory rule covers everything below it, a deeper one wins, and a name wins over both
+    LONG deny = RULE_DENY(RULE_OP_DELETE) | RULE_TRACK(RULE_OP_DELETE);
+    LONG rename = RULE_TRACK(RULE_OP_RENAME);
+    CHECK_STATUS(STATUS_SUCCESS, AddTrackedDirectory(&files, L"\\Device\\HarddiskVolume3\\Data\\", deny));
+    CHECK_STATUS(STATUS_SUCCESS, AddTrackedDirectory(&files, L"\\Device\\HarddiskVolume3\\Data\\Logs", rename));
+    CHECK_STATUS(STATUS_ALREADY_REGISTERED, AddTrackedDirectory(&files, L"\\device\\harddiskvolume3\\data", deny));
+    CHECK(Lookup(&files, L"\\Device\\HarddiskVolume3\\Data\\b.txt") == deny);
+    CHECK(Lookup(&files, L"\\Device\\HarddiskVolume3\\Data\\Logs\\x\\y.log") == rename);
+    CHECK(Lookup(&files, L"\\Device\\HarddiskVolume3\\Data\\a.txt") == RULE_DEFAULT);
+    CHECK(Lookup(&files, L"\\Device\\HarddiskVolume3\\DataX\\b.txt") == 0);
+    CHECK(GetTrackedOperations(&files) == (RULE_DEFAULT | deny | rename));
+
+    UNICODE_STRING volume = HostString(L"\\DEVICE\\HARDDISKVOLUME3");
+    UNICODE_STRING otherVolume = HostString(L"\\DEVICE\\HARDDISKVOLUME4");
+    CHECK(GetTrackedVolume(&files, &volume));
+    CHECK(!GetTrackedVolume(&files, &otherVolume));
+
+    // Removing the name leaves the file to its directory
+    CHECK_STATUS(STATUS_SUCCESS, RemoveTrackedFile(&files, L"\\DEVICE\\HARDDISKVOLUME3\\DATA\\A.TXT"));
+    CHECK_STATUS(STATUS_NOT_FOUND, RemoveTrackedFile(&files, L"\\Device\\HarddiskVolume3\\Data\\a.txt"));
+    CHECK(Lookup(&files, L"\\Device\\HarddiskVolume3\\Data\\a.txt") == deny);
+    CHECK_STATUS(STATUS_SUCCESS, RemoveTrackedDirectory(&files, L"\\Device\\HarddiskVolume3\\Data\\Logs\\"));
+    CHECK_STATUS(STATUS_SUCCESS, RemoveTrackedDirectory(&files, L"\\Device\\HarddiskVolume3\\Data"));
+    CHECK(Lookup(&files, L"\\Device\\HarddiskVolume3\\Data\\Logs\\x\\y.log") == 0);
+    CHECK(GetTrackedOperations(&files) == 0);
+    CHECK(!GetTrackedVolume(&files, &volume));
+
+    DeleteTrackedFiles(&files);
+}
+
+static VOID
+TestBatchAndGrowth(VOID)
+{
+    TRACKED_FILES files;
+    WCHAR path[128];
+    ULONG applied;
+    const ULONG count = 5000;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeTrackedFiles(&files));
+    PTRACKED_FILE_UPDATE updates = calloc(count + 1, sizeof(TRACKED_FILE_UPDATE));
+    PWCHAR paths = calloc(count, 64 * sizeof(WCHAR));
+    for (ULONG i = 0; i < count; i++) {
+        HostPath(paths + i * 64, 64, "\\Device\\HarddiskVolume2\\Batch\\file%u.dat", i);
+        RtlInitUnicodeString(&updates[i].Path, paths + i * 64);
+        updates[i].Operations = RULE_DEFAULT;
+    }
+
+    // A duplicate in the same batch fails alone
+    updates[count] = updates[0];
+    CHECK_STATUS(STATUS_SUCCESS, UpdateTrackedFiles(&files, updates, count + 1, &applied));
+    CHECK(applied == count);
+    CHECK_STATUS(STATUS_ALREADY_REGISTERED, updates[count].Status);
+    CHECK(files.EntryCount == count);
+    CHECK(files.Table->BucketCount * TRACKED_FILES_MAX_LOAD >= count);
+
+    ULONG found = 0;
+    for (ULONG i = 0; i < count; i++) {
+        found += Lookup(&files, HostPath(path, ARRAYSIZE(path), "\\DEVICE\\HARDDISKVOLUME2\\BATCH\\FILE%u.DAT", i)) == RULE_DEFAULT;
+    }
+    CHECK(found == count);
+    CHECK(Lookup(&files, L"\\Device\\HarddiskVolume2\\Batch\\file5000.dat") == 0);
+
+    // The prefilter answers most untracked lookups alone
+    PATH_FILTER_STATS stats;
+    for (ULONG i = 0; i < 1000; i++) {
+        Lookup(&files, HostPath(path, ARRAYSIZE(path), "\\Device\\HarddiskVolume2\\Other\\file%u.dat", i));
+    }
+    GetTrackedFilesFilterStats(&files, &stats);
+    CHECK(stats.Rejected >= 990);
+    CHECK(stats.KeyCount >= count);
+
+    for (ULONG i = 0; i < count; i++) {
+        updates[i].Remove = TRUE;
+    }
+    CHECK_STATUS(STATUS_SUCCESS, UpdateTrackedFiles(&files, updates, count, &applied));
+    CHECK(applied == count && files.EntryCount == 0);
+    CHECK(Lookup(&files, L"\\Device\\HarddiskVolume2\\Batch\\file1.dat") == 0);
+
+    free(updates);
+    free(paths);
+    DeleteTrackedFiles(&files);
+}
+
+static VOID
+TestPatternsAndImage(VOID)
+{
+    TRACKED_FILES files;
+    GLOB_PATTERN patterns[1];
+    RULE_IMAGE_RULE rules[2];
+    RULE_IMAGE_BUILD build;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeTrackedFiles(&files));
+    patterns[0].Pattern = HostString(L"*.tmp");
+    patterns[0].Flags = RULE_TRACK(RULE_OP_OVERWRITE);
+    CHECK_STATUS(STATUS_SUCCESS, SetTrackedPatterns(&files, patterns, 1));
+    CHECK(Lookup(&files, L"\\Device\\HarddiskVolume1\\x\\y.TMP") == RULE_TRACK(RULE_OP_OVERWRITE));
+
+    rules[0].Path = L"\\Device\\HarddiskVolume1\\Image\\keep.txt";
+    rules[0].Length = (USHORT)(HostLength(rules[0].Path) * sizeof(WCHAR));
+    rules[0].Flags = RULE_IMAGE_PROTECTED;
+    rules[1].Path = L"\\Device\\HarddiskVolume1\\ImageDir\\";
+    rules[1].Length = (USHORT)(HostLength(rules[1].Path) * sizeof(WCHAR));
+    rules[1].Flags = 0;
+    CHECK(CompileRuleImage(rules, ARRAYSIZE(rules), FoldNameChar, &build));
+
+    // The image is handed over in pool memory
+    PVOID image = ExAllocatePool2(POOL_FLAG_NON_PAGED, build.ImageSize, 'mItL');
+    memcpy(image, build.Image, build.ImageSize);
+    free(build.Image);
+    CHECK_STATUS(STATUS_SUCCESS, LoadTrackedFilesImage(&files, image, build.ImageSize));
+    CHECK(Lookup(&files, L"\\device\\harddiskvolume1\\image\\KEEP.txt") == (RULE_DEFAULT | RULE_DENY(RULE_OP_DELETE)));
+    CHECK(Lookup(&files, L"\\Device\\HarddiskVolume1\\ImageDir\\a\\b") == RULE_DEFAULT);
+
+    // The table overrides the image, in both directions
+    CHECK_STATUS(STATUS_SUCCESS, RemoveTrackedFile(&files, L"\\Device\\HarddiskVolume1\\Image\\keep.txt"));
+    CHECK(Lookup(&files, L"\\Device\\HarddiskVolume1\\Image\\keep.txt") == 0);
+    CHECK_STATUS(STATUS_SUCCESS, AddTrackedFile(&files, L"\\Device\\HarddiskVolume1\\Image\\keep.txt", RULE_TRACK(RULE_OP_RENAME)));
+    CHECK(Lookup(&files, L"\\Device\\HarddiskVolume1\\Image\\keep.txt") == RULE_TRACK(RULE_OP_RENAME));
+
+    DeleteTrackedFiles(&files);
+}
+
+// Read sections: readers look names up without a lock while a writer keeps adding, removing and resizing, and
+// frees what it unlinked after each grace period. A reader that saw freed memory would read a poisoned entry.
+
+#define READERS 4
+#define STABLE_NAMES 64
+#define WRITER_ROUNDS 200
+
+static volatile LONG WriterDone;
+static volatile LONG64 ReaderMisses;
+static volatile LONG64 ReaderLookups;
+
+static void*
+ReaderThread(void* Argument)
+{
+    PTRACKED_FILES files = Argument;
+    WCHAR path[128];
+    ULONG i = 0;
+
+    while (!ReadAcquire(&WriterDone)) {
+        // Stable names are always tracked with their own bits; churned names may or may not be
+        ULONG stable = i % STABLE_NAMES;
+        LONG expected = RULE_TRACK(stable % RULE_OP_COUNT);
+        if (Lookup(files, HostPath(path, ARRAYSIZE(path), "\\Device\\HarddiskVolume5\\Stable\\%u", stable)) != expected) {
+            InterlockedIncrement64(&ReaderMisses);
+        }
+        LONG churned = Lookup(files, HostPath(path, ARRAYSIZE(path), "\\Device\\HarddiskVolume5\\Churn\\%u", i % 997));
+        if (churned != 0 && churned != RULE_DEFAULT) {
+            InterlockedIncrement64(&ReaderMisses);
+        }
+        InterlockedIncrement64(&ReaderLookups);
+        if ((++i & 63) == 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static VOID
+TestReadSectionsUnderChurn(VOID)
+{
+    TRACKED_FILES files;
+    pthread_t readers[READERS];
+    WCHAR path[128];
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeTrackedFiles(&files));
+    for (ULONG i = 0; i < STABLE_NAMES; i++) {
+        CHECK_STATUS(STATUS_SUCCESS, AddTrackedFile(&files,
+            HostPath(path, ARRAYSIZE(path), "\\Device\\HarddiskVolume5\\Stable\\%u", i), RULE_TRACK(i % RULE_OP_COUNT)));
+    }
+
+    WriterDone = 0;
+    ReaderMisses = 0;
+    ReaderLookups = 0;
+    for (ULONG r = 0; r < READERS; r++) {
+        pthread_create(&readers[r], NULL, ReaderThread, &files);
+    }
+
+    for (ULONG round = 0; round < WRITER_ROUNDS; round++) {
+        // Enough names per round to resize the table, and directory rules to split and merge trie nodes
+        for (ULONG i = 0; i < 50; i++) {
+            AddTrackedFile(&files, HostPath(path, ARRAYSIZE(path), "\\Device\\HarddiskVolume5\\Churn\\%u", (round * 50 + i) % 997), RULE_DEFAULT);
+        }
+        AddTrackedDirectory(&files, HostPath(path, ARRAYSIZE(path), "\\Device\\HarddiskVolume5\\Dir\\%u\\Sub", round % 7), RULE_DEFAULT);
+        AddTrackedDirectory(&files, HostPath(path, ARRAYSIZE(path), "\\Device\\HarddiskVolume5\\Dir\\%u", round % 7), RULE_DEFAULT);
+        for (ULONG i = 0; i < 50; i++) {
+            RemoveTrackedFile(&files, HostPath(path, ARRAYSIZE(path), "\\Device\\HarddiskVolume5\\Churn\\%u", (round * 50 + i * 3) % 997));
+        }
+        RemoveTrackedDirectory(&files, HostPath(path, ARRAYSIZE(path), "\\Device\\HarddiskVolume5\\Dir\\%u", round % 7));
+        RemoveTrackedDirectory(&files, HostPath(path, ARRAYSIZE(path), "\\Device\\HarddiskVolume5\\Dir\\%u\\Sub", round % 7));
+        sched_yield();
+    }
+
+    WriteRelease(&WriterDone, 1);
+    for (ULONG r = 0; r < READERS; r++) {
+        pthread_join(readers[r], NULL);
+    }
+    CHECK(ReaderLookups > 0);
+    CHECK(ReaderMisses == 0);
+    DeleteTrackedFiles(&files);
+}
+
+// After FilterUnload the control device is still open: every call an IOCTL makes must fail or find nothing,
+// without touching freed read sections or a deleted pool, until DriverUnload deletes the table
+static VOID
+TestCleanupIsFinal(VOID)
+{
+    TRACKED_FILES files;
+    ULONG applied;
+    TRACKED_FILE_UPDATE update;
+    PATH_FILTER_STATS stats;
+    TRACKED_FILES_MEMORY memory;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeTrackedFiles(&files));
+    CHECK_STATUS(STATUS_SUCCESS, AddTrackedFile(&files, L"\\Device\\HarddiskVolume1\\a", RULE_DEFAULT));
+    CleanupTrackedFiles(&files);
+    CleanupTrackedFiles(&files);
+
+    RtlInitUnicodeString(&update.Path, L"\\Device\\HarddiskVolume1\\b");
+    update.Remove = FALSE;
+    update.Operations = RULE_DEFAULT;
+    CHECK_STATUS(STATUS_DELETE_PENDING, UpdateTrackedFiles(&files, &update, 1, &applied));
+    CHECK(AddTrackedFile(&files, L"\\Device\\HarddiskVolume1\\c", RULE_DEFAULT) == STATUS_DELETE_PENDING);
+    CHECK(!NT_SUCCESS(RemoveTrackedFile(&files, L"\\Device\\HarddiskVolume1\\a")));
+    CHECK(!NT_SUCCESS(AddTrackedDirectory(&files, L"\\Device\\HarddiskVolume1\\Dir", RULE_DEFAULT)));
+    CHECK(!NT_SUCCESS(RemoveTrackedDirectory(&files, L"\\Device\\HarddiskVolume1\\Dir")));
+    CHECK(Lookup(&files, L"\\Device\\HarddiskVolume1\\a") == 0);
+    GetTrackedFilesFilterStats(&files, &stats);
+    CHECK(stats.KeyCount == 0);
+    GetTrackedFilesMemory(&files, &memory);
+
+    DeleteTrackedFiles(&files);
+    DeleteTrackedFiles(&files);
+}
+
+int
+main(void)
+{
+    // The prefilter counts into the per-processor slots
+    CHECK_STATUS(STATUS_SUCCESS, InitializePerfStats());
+    RUN_TEST(TestNamesAndDirectories);
+    RUN_TEST(TestBatchAndGrowth);
+    RUN_TEST(TestPatternsAndImage);
+    RUN_TEST(TestReadSectionsUnderChurn);
+    RUN_TEST(TestCleanupIsFinal);
+    CleanupPerfStats();
+    return HostTestResult();
+}
@@ -0,0 +1,159 @@
+/**
+ * @file globRulesTest.c
+ * @brief Tests of the glob DFA: wildcard semantics, case folding, flag unions and the compile limits.
+ */
+
+#include "hostTest.h"
+#include "globRules.h"
+
+static LONG
+Match(PGLOB_RULES Rules, PCWSTR Path)
+{
+    UNICODE_STRING path = HostString(Path);
+    return GlobRulesMatch(Rules, &path);
+}
+
+static PGLOB_RULES
+Compile(PCWSTR* Patterns, const LONG* Flags, ULONG Count)
+{
+    GLOB_PATTERN patterns[16];
+    PGLOB_RULES rules = NULL;
+    for (ULONG i = 0; i < Count; i++) {
+        patterns[i].Pattern = HostString(Patterns[i]);
+        patterns[i].Flags = Flags[i];
+    }
+    CHECK_STATUS(STATUS_SUCCESS, GlobRulesCompile(patterns, Count, &rules));
+    return rules;
+}
+
+static VOID
+TestWildcards(VOID)
+{
+    PCWSTR patterns[] = {
+        L"\\Device\\V\\Logs\\*.log",
+        L"\\Device\\V\\Data\\**\\keep?.bin",
+        L"\\Device\\V\\Deep\\**",
+    };
+    LONG flags[] = { GLOB_RULE_TRACKED, GLOB_RULE_PROTECTED, GLOB_RULE_TRACKED };
+    PGLOB_RULES rules = Compile(patterns, flags, ARRAYSIZE(patterns));
+    CHECK(rules != NULL);
+    CHECK(rules->StateCount > 1);
+    CHECK(GlobRulesSize(rules) > sizeof(GLOB_RULES));
+
+    // '*' stays within a component
+    CHECK(Match(rules, L"\\Device\\V\\Logs\\app.log") == GLOB_RULE_TRACKED);
+    CHECK(Match(rules, L"\\Device\\V\\Logs\\.log") == GLOB_RULE_TRACKED);
+    CHECK(Match(rules, L"\\Device\\V\\Logs\\sub\\app.log") == 0);
+    CHECK(Match(rules, L"\\Device\\V\\Logs\\app.log.old") == 0);
+
+    // '**\' spans zero or more directories, '?' exactly one character
+    CHECK(Match(rules, L"\\Device\\V\\Data\\keep1.bin") == GLOB_RULE_PROTECTED);
+    CHECK(Match(rules, L"\\Device\\V\\Data\\a\\b\\c\\keepX.bin") == GLOB_RULE_PROTECTED);
+    CHECK(Match(rules, L"\\Device\\V\\Data\\keep.bin") == 0);
+    CHECK(Match(rules, L"\\Device\\V\\Data\\keep12.bin") == 0);
+
+    // '**' spans separators
+    CHECK(Match(rules, L"\\Device\\V\\Deep\\x\\y\\z") == GLOB_RULE_TRACKED);
+    CHECK(Match(rules, L"\\Device\\V\\Deeper\\x") == 0);
+    GlobRulesFree(rules);
+}
+
+static VOID
+TestCaseAndUnions(VOID)
+{
+    PCWSTR patterns[] = {
+        L"*.TMP",
+        L"\\Device\\V\\Cache\\*",
+        L"\\Device\\V\\\x00E9t\x00E9\\*.txt",
+    };
+    LONG flags[] = { GLOB_RULE_TRACKED, GLOB_RULE_PROTECTED, GLOB_RULE_PROTECTED };
+    PGLOB_RULES rules = Compile(patterns, flags, ARRAYSIZE(patterns));
+
+    // A pattern without a leading separator matches at any depth, in any case
+    CHECK(Match(rules, L"\\Device\\V\\a\\b\\x.tmp") == GLOB_RULE_TRACKED);
+    CHECK(Match(rules, L"\\Device\\V\\x.TmP") == GLOB_RULE_TRACKED);
+
+    // Every pattern that matches contributes its flags
+    CHECK(Match(rules, L"\\device\\v\\cache\\x.tmp") == (GLOB_RULE_TRACKED | GLOB_RULE_PROTECTED));
+    CHECK(Match(rules, L"\\Device\\V\\Cache\\x.dat") == GLOB_RULE_PROTECTED);
+
+    // Non-ASCII characters get classes of their own and fold like RtlUpcaseUnicodeChar
+    CHECK(rules->WideCount > 0);
+    CHECK(Match(rules, L"\\Device\\V\\\x00C9T\x00C9\\notes.txt") == GLOB_RULE_PROTECTED);
+    CHECK(Match(rules, L"\\Device\\V\\ete\\notes.txt") == 0);
+    GlobRulesFree(rules);
+}
+
+static VOID
+TestCompileErrors(VOID)
+{
+    GLOB_PATTERN pattern = { 0 };
+    PGLOB_RULES rules = (PGLOB_RULES)1;
+
+    CHECK_STATUS(STATUS_SUCCESS, GlobRulesCompile(NULL, 0, &rules));
+    CHECK(rules == NULL);
+    pattern.Flags = GLOB_RULE_TRACKED;
+    CHECK_STATUS(STATUS_INVALID_PARAMETER, GlobRulesCompile(&pattern, 1, &rules));
+
+    // Unanchored patterns with many wildcards blow the subset construction up; compilation gives up, it does not grow
+    GLOB_PATTERN patterns[8];
+    WCHAR text[8][64];
+    for (ULONG i = 0; i < ARRAYSIZE(patterns); i++) {
+        HostPath(text[i], ARRAYSIZE(text[i]), "**%c*?*%c*?**%c?*", 'a' + i, 'b' + i, 'c' + i);
+        patterns[i].Pattern = HostString(text[i]);
+        patterns[i].Flags = GLOB_RULE_TRACKED;
+    }
+    CHECK_STATUS(STATUS_IMPLEMENTATION_LIMIT, GlobRulesCompile(patterns, ARRAYSIZE(patterns), &rules));
+}
+
+// Many threads matching one compiled ruleset, which is never written after compilation
+#define SHARED_READERS 4
+
+static PGLOB_RULES SharedRules;
+static LONG SharedMisses;
+
+static void*
+SharedReader(void* Context)
+{
+    WCHAR path[64];
+    UNREFERENCED_PARAMETER(Context);
+    for (ULONG i = 0; i < 20000; i++) {
+        HostPath(path, ARRAYSIZE(path), "\\Device\\V\\Logs\\file%u.log", i);
+        if (Match(SharedRules, path) != GLOB_RULE_TRACKED) {
+            InterlockedIncrement(&SharedMisses);
+        }
+        HostPath(path, ARRAYSIZE(path), "\\Device\\V\\Logs\\file%u.txt", i);
+        if (Match(SharedRules, path) != 0) {
+            InterlockedIncrement(&SharedMisses);
+        }
+    }
+    return NULL;
+}
+
+static VOID
+TestSharedReaders(VOID)
+{
+    PCWSTR patterns[] = { L"\\Device\\V\\Logs\\*.log" };
+    LONG flags[] = { GLOB_RULE_TRACKED };
+    pthread_t readers[SHARED_READERS];
+
+    SharedRules = Compile(patterns, flags, ARRAYSIZE(patterns));
+    for (ULONG i = 0; i < SHARED_READERS; i++) {
+        pthread_create(&readers[i], NULL, SharedReader, NULL);
+    }
+    for (ULONG i = 0; i < SHARED_READERS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    CHECK(SharedMisses == 0);
+    GlobRulesFree(SharedRules);
+}
+
+int
+main(void)
+{
+    RUN_TEST(TestWildcards);
+    RUN_TEST(TestCaseAndUnions);
+    RUN_TEST(TestCompileErrors);
+    RUN_TEST(TestSharedReaders);
+    return HostTestResult();
+}
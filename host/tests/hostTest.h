@@ -0,0 +1,89 @@
+/**
+ * @file hostTest.h
+ * @brief Checks and helpers shared by the host tests.
+ *
+ * A failed CHECK prints where and what, and the test's exit status counts the failures, so ctest reports it.
+ */
+
+#pragma once
+#include <fltKernel.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+
+static int HostTestFailures;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            HostTestFailures++; \
+        } \
+    } while (0)
+
+#define CHECK_STATUS(expected, status) \
+    do { \
+        NTSTATUS actual_ = (status); \
+        if (actual_ != (expected)) { \
+            fprintf(stderr, "%s:%d: %s returned 0x%08x, expected 0x%08x\n", __FILE__, __LINE__, #status, \
+                (unsigned)actual_, (unsigned)(expected)); \
+            HostTestFailures++; \
+        } \
+    } while (0)
+
+// Runs a test function and reports its name if it failed
+#define RUN_TEST(test) \
+    do { \
+        int before_ = HostTestFailures; \
+        test(); \
+        fprintf(stderr, "%s %s\n", HostTestFailures == before_ ? "PASS" : "FAIL", #test); \
+    } while (0)
+
+static inline int
+HostTestResult(void)
+{
+    return HostTestFailures ? 1 : 0;
+}
+
+// Characters before the terminating null; the C library's wide functions assume a 32-bit wchar_t
+static inline ULONG
+HostLength(PCWSTR Text)
+{
+    ULONG length = 0;
+    while (Text[length]) {
+        length++;
+    }
+    return length;
+}
+
+// Points a UNICODE_STRING at a literal
+static inline UNICODE_STRING
+HostString(PCWSTR Text)
+{
+    UNICODE_STRING string;
+    RtlInitUnicodeString(&string, Text);
+    return string;
+}
+
+// Builds a wide path from ASCII printf arguments into Buffer, which holds Count characters
+static inline PCWSTR
+HostPath(PWCHAR Buffer, ULONG Count, const char* Format, ...) __attribute__((format(printf, 3, 4)));
+
+#include <stdarg.h>
+
+static inline PCWSTR
+HostPath(PWCHAR Buffer, ULONG Count, const char* Format, ...)
+{
+    char narrow[1024];
+    va_list args;
+    va_start(args, Format);
+    vsnprintf(narrow, sizeof(narrow), Format, args);
+    va_end(args);
+
+    ULONG i = 0;
+    for (; narrow[i] && i + 1 < Count; i++) {
+        Buffer[i] = (WCHAR)(UCHAR)narrow[i];
+    }
+    Buffer[i] = L'\0';
+    return Buffer;
+}
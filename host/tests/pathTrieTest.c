@@ -0,0 +1,277 @@
+/**
+ * @file pathTrieTest.c
+ * @brief Tests of the directory trie: longest-prefix matching, edge splits and merges, indexed wide directories, and
+ *        lock-free readers.
+ */
+
+#include "hostTest.h"
+#include "pathTrie.h"
+
+static LONG
+Lookup(PPATH_TRIE_NODE Root, PCWSTR Path)
+{
+    UNICODE_STRING path = HostString(Path);
+    return PathTrieLookup(Root, &path);
+}
+
+static NTSTATUS
+Insert(PPATH_TRIE_NODE Root, PCWSTR Path, LONG Flags, PPATH_TRIE_NODE* Retired)
+{
+    UNICODE_STRING path = HostString(Path);
+    return PathTrieInsert(Root, &path, Flags, Retired);
+}
+
+static NTSTATUS
+Remove(PPATH_TRIE_NODE Root, PCWSTR Path, PPATH_TRIE_NODE* Retired, PLONG Flags)
+{
+    UNICODE_STRING path = HostString(Path);
+    return PathTrieRemove(Root, &path, Retired, Flags);
+}
+
+static VOID
+TestLongestMatch(VOID)
+{
+    PPATH_TRIE_NODE root = PathTrieCreate();
+    PPATH_TRIE_NODE retired = NULL;
+    CHECK(root != NULL);
+
+    CHECK_STATUS(STATUS_SUCCESS, Insert(root, L"\\Device\\HarddiskVolume1\\Data", PATH_TRIE_TRACKED, &retired));
+    CHECK_STATUS(STATUS_SUCCESS, Insert(root, L"\\Device\\HarddiskVolume1\\Data\\Keep\\", PATH_TRIE_PROTECTED, &retired));
+    CHECK_STATUS(STATUS_ALREADY_REGISTERED, Insert(root, L"\\device\\harddiskvolume1\\DATA", PATH_TRIE_TRACKED, &retired));
+    CHECK_STATUS(STATUS_INVALID_PARAMETER, Insert(root, L"\\\\", PATH_TRIE_TRACKED, &retired));
+
+    CHECK(Lookup(root, L"\\Device\\HarddiskVolume1\\Data\\a.txt") == PATH_TRIE_TRACKED);
+    CHECK(Lookup(root, L"\\DEVICE\\harddiskvolume1\\data\\sub\\a.txt") == PATH_TRIE_TRACKED);
+    CHECK(Lookup(root, L"\\Device\\HarddiskVolume1\\Data\\Keep\\a.txt") == PATH_TRIE_PROTECTED);
+    CHECK(Lookup(root, L"\\Device\\HarddiskVolume1\\Data\\Keeper\\a.txt") == PATH_TRIE_TRACKED);
+
+    // Only whole components match
+    CHECK(Lookup(root, L"\\Device\\HarddiskVolume1\\Database\\a.txt") == 0);
+    CHECK(Lookup(root, L"\\Device\\HarddiskVolume1\\Dat") == 0);
+    CHECK(Lookup(root, L"\\Device\\HarddiskVolume2\\Data\\a.txt") == 0);
+
+    PathTrieFreeRetired(retired);
+    PathTrieDestroy(root);
+}
+
+static VOID
+TestSplitAndMerge(VOID)
+{
+    PPATH_TRIE_NODE root = PathTrieCreate();
+    PPATH_TRIE_NODE retired = NULL;
+    LONG flags = 0;
+    ULONG64 nodes = 0;
+    ULONG64 bytes = 0;
+
+    // The second rule splits the first one's edge at \A\B, the third branches below it
+    CHECK_STATUS(STATUS_SUCCESS, Insert(root, L"\\A\\B\\C\\D", PATH_TRIE_TRACKED, &retired));
+    CHECK_STATUS(STATUS_SUCCESS, Insert(root, L"\\A\\B", PATH_TRIE_PROTECTED, &retired));
+    CHECK_STATUS(STATUS_SUCCESS, Insert(root, L"\\A\\B\\E", PATH_TRIE_TRACKED | PATH_TRIE_PROTECTED, &retired));
+    CHECK(retired != NULL);
+    PathTrieFreeRetired(retired);
+    retired = NULL;
+
+    CHECK(Lookup(root, L"\\A\\B\\C\\D\\f") == PATH_TRIE_TRACKED);
+    CHECK(Lookup(root, L"\\A\\B\\C\\f") == PATH_TRIE_PROTECTED);
+    CHECK(Lookup(root, L"\\A\\B\\E\\f") == (PATH_TRIE_TRACKED | PATH_TRIE_PROTECTED));
+    PathTrieQueryUsage(root, &nodes, &bytes);
+    CHECK(nodes == 4);
+    CHECK(bytes > 0);
+
+    // The middle rule's node stays while it branches; once a branch goes, it merges with the remaining child
+    CHECK_STATUS(STATUS_SUCCESS, Remove(root, L"\\a\\b", &retired, &flags));
+    CHECK(flags == PATH_TRIE_PROTECTED);
+    CHECK_STATUS(STATUS_NOT_FOUND, Remove(root, L"\\A\\B", &retired, NULL));
+    CHECK(Lookup(root, L"\\A\\B\\C\\f") == 0);
+    CHECK_STATUS(STATUS_SUCCESS, Remove(root, L"\\A\\B\\E", &retired, NULL));
+    CHECK(Lookup(root, L"\\A\\B\\C\\D\\f") == PATH_TRIE_TRACKED);
+    PathTrieFreeRetired(retired);
+    retired = NULL;
+    PathTrieQueryUsage(root, &nodes, &bytes);
+    CHECK(nodes == 2);
+
+    CHECK_STATUS(STATUS_SUCCESS, Remove(root, L"\\A\\B\\C\\D", &retired, NULL));
+    PathTrieFreeRetired(retired);
+    PathTrieQueryUsage(root, &nodes, &bytes);
+    CHECK(nodes == 1);
+    CHECK(Lookup(root, L"\\A\\B\\C\\D\\f") == 0);
+    PathTrieDestroy(root);
+}
+
+// A directory with a rule on each of many subdirectories: its children are indexed, and the index follows the
+// splits, merges and removals that move them
+static VOID
+TestWideDirectory(VOID)
+{
+    PPATH_TRIE_NODE root = PathTrieCreate();
+    PPATH_TRIE_NODE retired = NULL;
+    ULONG64 nodes = 0;
+    ULONG64 bytes = 0;
+    ULONG64 listBytes;
+    WCHAR path[64];
+    ULONG wrong = 0;
+
+    for (ULONG i = 0; i < 1000; i++) {
+        CHECK_STATUS(STATUS_SUCCESS, Insert(root, HostPath(path, ARRAYSIZE(path), "\\Device\\W\\Data\\d%u", i),
+            (i & 1) ? PATH_TRIE_PROTECTED : PATH_TRIE_TRACKED, &retired));
+    }
+    CHECK_STATUS(STATUS_ALREADY_REGISTERED, Insert(root, L"\\DEVICE\\W\\DATA\\D999", PATH_TRIE_TRACKED, &retired));
+    PathTrieQueryUsage(root, &nodes, &bytes);
+    // The nodes alone: labels DEVICE\W\DATA and D0 to D999, the root's empty
+    listBytes = nodes * FIELD_OFFSET(PATH_TRIE_NODE, Label) + (13 + 10 * 2 + 90 * 3 + 900 * 4) * sizeof(WCHAR);
+    CHECK(nodes == 1002);
+    CHECK(bytes > listBytes);
+
+    // Splitting the edge above them gives the copy of the directory an index of its own, merging copies it again
+    CHECK_STATUS(STATUS_SUCCESS, Insert(root, L"\\Device\\W\\Other", PATH_TRIE_TRACKED, &retired));
+    for (ULONG i = 0; i < 1000; i++) {
+        wrong += Lookup(root, HostPath(path, ARRAYSIZE(path), "\\device\\w\\data\\D%u\\f.txt", i))
+            != ((i & 1) ? PATH_TRIE_PROTECTED : PATH_TRIE_TRACKED);
+    }
+    CHECK(Lookup(root, L"\\Device\\W\\Other\\f.txt") == PATH_TRIE_TRACKED);
+    CHECK(Lookup(root, L"\\Device\\W\\Data\\d1000\\f.txt") == 0);
+    CHECK(Lookup(root, L"\\Device\\W\\Data\\d1\\") == PATH_TRIE_PROTECTED);
+    CHECK_STATUS(STATUS_SUCCESS, Remove(root, L"\\Device\\W\\Other", &retired, NULL));
+
+    // Down to a few children the index is dropped, and the rest are still found through the sibling list
+    for (ULONG i = 0; i < 1000; i++) {
+        if (i % 200 != 7) {
+            CHECK_STATUS(STATUS_SUCCESS, Remove(root, HostPath(path, ARRAYSIZE(path), "\\Device\\W\\Data\\d%u", i),
+                &retired, NULL));
+        }
+    }
+    for (ULONG i = 0; i < 1000; i++) {
+        LONG expected = i % 200 != 7 ? 0 : (i & 1) ? PATH_TRIE_PROTECTED : PATH_TRIE_TRACKED;
+        wrong += Lookup(root, HostPath(path, ARRAYSIZE(path), "\\Device\\W\\Data\\d%u\\f.txt", i)) != expected;
+    }
+    CHECK(wrong == 0);
+    PathTrieFreeRetired(retired);
+    PathTrieQueryUsage(root, &nodes, &bytes);
+    CHECK(nodes == 7);
+    CHECK(bytes == 7 * FIELD_OFFSET(PATH_TRIE_NODE, Label) + (13 + 2 + 4 * 4) * sizeof(WCHAR));
+    PathTrieDestroy(root);
+}
+
+typedef struct _VISITED {
+    ULONG Count;
+    LONG FlagsSeen;
+    BOOLEAN SawNested;
+} VISITED;
+
+static VOID
+Visit(PVOID Context, PCUNICODE_STRING Path, LONG Flags)
+{
+    VISITED* visited = Context;
+    UNICODE_STRING nested = HostString(L"DEVICE\\X\\NESTED");
+    visited->Count++;
+    visited->FlagsSeen |= Flags;
+    if (RtlEqualUnicodeString(Path, &nested, FALSE)) {
+        visited->SawNested = TRUE;
+    }
+}
+
+static VOID
+TestEnumerate(VOID)
+{
+    PPATH_TRIE_NODE root = PathTrieCreate();
+    PPATH_TRIE_NODE retired = NULL;
+    VISITED visited = { 0 };
+    WCHAR path[64];
+
+    for (ULONG i = 0; i < 100; i++) {
+        CHECK_STATUS(STATUS_SUCCESS, Insert(root, HostPath(path, ARRAYSIZE(path), "\\Device\\X\\Dir%u", i),
+            PATH_TRIE_TRACKED, &retired));
+    }
+    CHECK_STATUS(STATUS_SUCCESS, Insert(root, L"\\Device\\X\\Nested\\", PATH_TRIE_PROTECTED, &retired));
+    PathTrieFreeRetired(retired);
+
+    CHECK_STATUS(STATUS_SUCCESS, PathTrieEnumerate(root, Visit, &visited));
+    CHECK(visited.Count == 101);
+    CHECK(visited.FlagsSeen == (PATH_TRIE_TRACKED | PATH_TRIE_PROTECTED));
+    CHECK(visited.SawNested);
+    PathTrieDestroy(root);
+}
+
+// Readers walk the trie without a lock while one writer splits and merges the edges around their rules.
+// Retired nodes are only freed once the readers are done, which stands in for the driver's grace period.
+#define CHURN_READERS 3
+#define CHURN_ROUNDS 2000
+
+typedef struct _CHURN {
+    PPATH_TRIE_NODE Root;
+    volatile LONG Done;
+    LONG64 Lookups;
+    LONG Misses;
+} CHURN;
+
+static void*
+ChurnReader(void* Context)
+{
+    CHURN* churn = Context;
+    WCHAR path[64];
+    ULONG i = 0;
+
+    while (!ReadAcquire(&churn->Done)) {
+        ULONG n = i++ % 16;
+        HostPath(path, ARRAYSIZE(path), "\\Device\\V\\Stable%u\\Sub\\file.txt", n);
+        if (Lookup(churn->Root, path) != PATH_TRIE_PROTECTED) {
+            InterlockedIncrement(&churn->Misses);
+        }
+        InterlockedIncrement64(&churn->Lookups);
+        if ((i & 63) == 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static VOID
+TestReadersUnderChurn(VOID)
+{
+    CHURN churn = { 0 };
+    pthread_t readers[CHURN_READERS];
+    PPATH_TRIE_NODE retired = NULL;
+    WCHAR path[64];
+
+    churn.Root = PathTrieCreate();
+    for (ULONG i = 0; i < 16; i++) {
+        Insert(churn.Root, HostPath(path, ARRAYSIZE(path), "\\Device\\V\\Stable%u", i), PATH_TRIE_PROTECTED, &retired);
+    }
+    for (ULONG i = 0; i < CHURN_READERS; i++) {
+        pthread_create(&readers[i], NULL, ChurnReader, &churn);
+    }
+
+    // Rules above, below and beside the stable ones split and merge the edges the readers follow
+    for (ULONG round = 0; round < CHURN_ROUNDS; round++) {
+        ULONG n = round % 16;
+        HostPath(path, ARRAYSIZE(path), "\\Device\\V\\Stable%u\\Sub\\Deeper", n);
+        CHECK_STATUS(STATUS_SUCCESS, Insert(churn.Root, path, PATH_TRIE_TRACKED, &retired));
+        CHECK_STATUS(STATUS_SUCCESS, Remove(churn.Root, path, &retired, NULL));
+        HostPath(path, ARRAYSIZE(path), "\\Device\\V\\Stable%uX", n);
+        CHECK_STATUS(STATUS_SUCCESS, Insert(churn.Root, path, PATH_TRIE_TRACKED, &retired));
+        CHECK_STATUS(STATUS_SUCCESS, Remove(churn.Root, path, &retired, NULL));
+        if ((round & 15) == 0) {
+            sched_yield();
+        }
+    }
+
+    WriteRelease(&churn.Done, 1);
+    for (ULONG i = 0; i < CHURN_READERS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    PathTrieFreeRetired(retired);
+    CHECK(churn.Lookups > 0);
+    CHECK(churn.Misses == 0);
+    PathTrieDestroy(churn.Root);
+}
+
+int
+main(void)
+{
+    RUN_TEST(TestLongestMatch);
+    RUN_TEST(TestSplitAndMerge);
+    RUN_TEST(TestWideDirectory);
+    RUN_TEST(TestEnumerate);
+    RUN_TEST(TestReadersUnderChurn);
+    return HostTestResult();
+}
@@ -0,0 +1,175 @@
+/**
+ * @file perfStatsTest.c
+ * @brief Tests of the per-processor counters and histograms: exact totals under concurrent updates, log2 bucket
+ *        placement, silence once the slots are freed, and the cost an update adds to a callback.
+ */
+
+#include "hostTest.h"
+#include <time.h>
+#include "perfStats.h"
+
+#define UPDATERS 8
+#define UPDATES 100000
+
+// Loose enough for sanitizer builds and a loaded host; a slot update that costs more has lost its point
+#define MAX_COUNT_NS 1000
+#define MAX_RECORD_NS 2000
+
+static ULONG64
+NowNs(VOID)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (ULONG64)now.tv_sec * 1000000000ull + (ULONG64)now.tv_nsec;
+}
+
+static void*
+Updater(void* Context)
+{
+    ULONG index = (ULONG)(ULONG_PTR)Context;
+
+    // Half the threads claim a processor of their own, the rest share whatever processor they run on
+    if (index % 2 == 0) {
+        HostSetProcessor(index);
+    }
+    for (ULONG i = 0; i < UPDATES; i++) {
+        PerfCount(PERF_COUNTER_CACHE_HITS);
+        PerfCount(index % PERF_COUNTER_COUNT);
+        PerfRecord(PERF_HISTOGRAM_RULE_LOOKUP, PerfTimestamp());
+    }
+    HostSetProcessor(MAXULONG);
+    return NULL;
+}
+
+static VOID
+TestExactTotals(VOID)
+{
+    pthread_t threads[UPDATERS];
+    PERF_STATS stats;
+    ULONG64 expected[PERF_COUNTER_COUNT] = { 0 };
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializePerfStats());
+    for (ULONG i = 0; i < UPDATERS; i++) {
+        pthread_create(&threads[i], NULL, Updater, (PVOID)(ULONG_PTR)i);
+        expected[PERF_COUNTER_CACHE_HITS] += UPDATES;
+        expected[i % PERF_COUNTER_COUNT] += UPDATES;
+    }
+    for (ULONG i = 0; i < UPDATERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    QueryPerfStats(&stats);
+    CHECK(stats.Processors == KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS));
+    CHECK(stats.TicksPerSecond > 0);
+    for (ULONG c = 0; c < PERF_COUNTER_COUNT; c++) {
+        CHECK(stats.Counters[c] == expected[c]);
+        CHECK(PerfCounterTotal(c) == expected[c]);
+    }
+
+    PPERF_HISTOGRAM histogram = &stats.Histograms[PERF_HISTOGRAM_RULE_LOOKUP];
+    ULONG64 bucketed = 0;
+    for (ULONG b = 0; b < PERF_HISTOGRAM_BUCKETS; b++) {
+        bucketed += histogram->Buckets[b];
+    }
+    CHECK(histogram->Count == (ULONG64)UPDATERS * UPDATES);
+    CHECK(bucketed == histogram->Count);
+    CHECK(stats.Histograms[PERF_HISTOGRAM_NAME_QUERY].Count == 0);
+    CleanupPerfStats();
+}
+
+// The bucket of a sample of Ticks: 0 for none, i for 2^(i-1) up to 2^i - 1, the last one for the rest
+static ULONG
+RecordedBucket(ULONG64 Ticks)
+{
+    PERF_STATS before;
+    PERF_STATS after;
+
+    QueryPerfStats(&before);
+    PerfRecord(PERF_HISTOGRAM_NAME_QUERY, PerfTimestamp() - Ticks);
+    QueryPerfStats(&after);
+    PULONG64 was = before.Histograms[PERF_HISTOGRAM_NAME_QUERY].Buckets;
+    PULONG64 now = after.Histograms[PERF_HISTOGRAM_NAME_QUERY].Buckets;
+    for (ULONG b = 0; b < PERF_HISTOGRAM_BUCKETS; b++) {
+        if (now[b] != was[b]) {
+            return b;
+        }
+    }
+    return MAXULONG;
+}
+
+static VOID
+TestBuckets(VOID)
+{
+    CHECK_STATUS(STATUS_SUCCESS, InitializePerfStats());
+
+    // The ticks between the two readings are far below each sample, so they stay in its bucket
+    CHECK(RecordedBucket(1ULL << 20) == 21);
+    CHECK(RecordedBucket((1ULL << 24) + (1ULL << 22)) == 25);
+    CHECK(RecordedBucket(1ULL << 40) == PERF_HISTOGRAM_BUCKETS - 1);
+
+    // A start read on another processor, a little ahead, counts as no time at all
+    PERF_STATS stats;
+    PerfRecord(PERF_HISTOGRAM_NAME_QUERY, PerfTimestamp() + (1ULL << 30));
+    QueryPerfStats(&stats);
+    CHECK(stats.Histograms[PERF_HISTOGRAM_NAME_QUERY].Buckets[0] == 1);
+    CHECK(stats.Histograms[PERF_HISTOGRAM_NAME_QUERY].Count == 4);
+    CleanupPerfStats();
+}
+
+static VOID
+TestFreedSlots(VOID)
+{
+    PERF_STATS stats;
+
+    // Callbacks racing the driver's unload find no slots and update nothing
+    PerfCount(PERF_COUNTER_DENIED);
+    PerfRecord(PERF_HISTOGRAM_PRE_OPERATION, PerfTimestamp());
+    QueryPerfStats(&stats);
+    CHECK(stats.Processors == 0);
+    CHECK(stats.Histograms[PERF_HISTOGRAM_PRE_OPERATION].Count == 0);
+    CHECK(PerfCounterTotal(PERF_COUNTER_DENIED) == 0);
+}
+
+static VOID
+TestOverhead(VOID)
+{
+    ULONG updates = 1000000;
+    CHECK_STATUS(STATUS_SUCCESS, InitializePerfStats());
+
+    // The clock read alone, which a timed sample pays twice
+    volatile ULONG64 sink = 0;
+    ULONG64 start = NowNs();
+    for (ULONG i = 0; i < updates; i++) {
+        sink += PerfTimestamp();
+    }
+    double timestampNs = (double)(NowNs() - start) / updates;
+
+    start = NowNs();
+    for (ULONG i = 0; i < updates; i++) {
+        PerfCount(PERF_COUNTER_CACHE_HITS);
+    }
+    double countNs = (double)(NowNs() - start) / updates;
+
+    start = NowNs();
+    for (ULONG i = 0; i < updates; i++) {
+        PerfRecord(PERF_HISTOGRAM_PRE_OPERATION, PerfTimestamp());
+    }
+    double recordNs = (double)(NowNs() - start) / updates;
+
+    printf("PerfTimestamp %.1f ns, PerfCount %.1f ns, PerfTimestamp + PerfRecord %.1f ns\n", timestampNs, countNs,
+        recordNs);
+    CHECK(PerfCounterTotal(PERF_COUNTER_CACHE_HITS) == updates);
+    CHECK(countNs < MAX_COUNT_NS);
+    CHECK(recordNs < MAX_RECORD_NS);
+    CleanupPerfStats();
+}
+
+int
+main(void)
+{
+    RUN_TEST(TestExactTotals);
+    RUN_TEST(TestBuckets);
+    RUN_TEST(TestFreedSlots);
+    RUN_TEST(TestOverhead);
+    return HostTestResult();
+}
@@ -0,0 +1,213 @@
+/**
+ * @file processCacheTest.c
+ * @brief Tests of the process name cache: hits after the first lookup, reused IDs, the bound on cached names,
+ *        least-recently-used eviction within a bucket, entries outliving their eviction, and exit notifications.
+ */
+
+#include "hostTest.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include "processCache.h"
+
+#define NAME_CHARS 64
+
+// The image name carries a count of the lookups made for the process, so a name served from the cache is told
+// apart from a freshly queried one by that count alone
+typedef struct _PROCESS_SIM {
+    EPROCESS Process;
+    ULONG Bucket;
+    ULONG Round;
+    ULONG Lookups;
+    WCHAR Name[NAME_CHARS];
+} PROCESS_SIM;
+
+// The image name the process had after Lookups lookups
+static UNICODE_STRING
+NameAt(PROCESS_SIM* Sim, ULONG Lookups, PWCHAR Buffer)
+{
+    return HostString(HostPath(Buffer, NAME_CHARS, "\\Device\\HarddiskVolume1\\Apps\\p%u_%u_%lld\\%u.exe",
+        Sim->Bucket, Sim->Round, (long long)Sim->Process.CreateTime, Lookups));
+}
+
+// A process whose ID falls in Bucket; Round picks one of the IDs sharing it
+static VOID
+MakeProcess(PROCESS_SIM* Sim, ULONG Bucket, ULONG Round, LONG64 CreateTime)
+{
+    RtlZeroMemory(Sim, sizeof(*Sim));
+    Sim->Process.ProcessId = ULongToHandle(4 * (Bucket + PROCESS_CACHE_BUCKETS * Round));
+    Sim->Process.CreateTime = CreateTime;
+    Sim->Bucket = Bucket;
+    Sim->Round = Round;
+    Sim->Process.ImageName = NameAt(Sim, 0, Sim->Name);
+}
+
+static ULONG64
+CachedNames(VOID)
+{
+    MEMORY_USAGE usage;
+    QueryProcessCacheUsage(&usage);
+    return usage.Count;
+}
+
+// Looks a process up and checks the name returned belongs to it; returns whether it came from the cache
+static BOOLEAN
+Lookup(PROCESS_SIM* Sim)
+{
+    BOOLEAN cached = FALSE;
+    WCHAR expected[NAME_CHARS];
+
+    Sim->Lookups++;
+    Sim->Process.ImageName = NameAt(Sim, Sim->Lookups, Sim->Name);
+    PPROCESS_NAME_ENTRY entry = LookupProcessName(&Sim->Process);
+    CHECK(entry != NULL);
+    if (!entry) {
+        return FALSE;
+    }
+    CHECK(entry->ProcessId == Sim->Process.ProcessId && entry->CreateTime == Sim->Process.CreateTime);
+    if (!RtlEqualUnicodeString(&entry->Name, &Sim->Process.ImageName, FALSE)) {
+        // Only an earlier lookup of the same process may have cached the name
+        BOOLEAN found = FALSE;
+        for (ULONG lookups = 0; lookups < Sim->Lookups && !found; lookups++) {
+            UNICODE_STRING earlier = NameAt(Sim, lookups, expected);
+            found = RtlEqualUnicodeString(&entry->Name, &earlier, FALSE);
+        }
+        CHECK(found);
+        cached = TRUE;
+    }
+    ReleaseProcessName(entry);
+
+    // Interrupt time ticks every 100ns; keep the lookups apart so their order decides eviction
+    usleep(1);
+    return cached;
+}
+
+static VOID
+TestHitAndReusedId(VOID)
+{
+    PROCESS_SIM first;
+    PROCESS_SIM reused;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeProcessCache());
+    MakeProcess(&first, 3, 0, 1000);
+    CHECK(!Lookup(&first));
+    CHECK(CachedNames() == 1);
+
+    // The second lookup is answered from the cache, not from the process
+    PPROCESS_NAME_ENTRY entry = LookupProcessName(&first.Process);
+    PPROCESS_NAME_ENTRY again = LookupProcessName(&first.Process);
+    CHECK(entry != NULL && entry == again);
+    ReleaseProcessName(again);
+    ReleaseProcessName(entry);
+
+    // The same ID with a later creation time is another process and never gets the old name
+    MakeProcess(&reused, 3, 0, 2000);
+    CHECK(!Lookup(&reused));
+    CHECK(CachedNames() == 2);
+    CleanupProcessCache();
+    CHECK(CachedNames() == 0);
+}
+
+static VOID
+TestEvictionBound(VOID)
+{
+    ULONG count = PROCESS_CACHE_BUCKETS * PROCESS_CACHE_WAYS * 4;
+    PROCESS_SIM* sims = calloc(count, sizeof(PROCESS_SIM));
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeProcessCache());
+    for (ULONG i = 0; i < count; i++) {
+        MakeProcess(&sims[i], i % PROCESS_CACHE_BUCKETS, i / PROCESS_CACHE_BUCKETS, 1);
+        PPROCESS_NAME_ENTRY entry = LookupProcessName(&sims[i].Process);
+        CHECK(entry != NULL);
+        if (entry) {
+            ReleaseProcessName(entry);
+        }
+        CHECK(CachedNames() <= PROCESS_CACHE_BUCKETS * PROCESS_CACHE_WAYS);
+    }
+
+    // Every bucket filled up, then kept evicting
+    CHECK(CachedNames() == PROCESS_CACHE_BUCKETS * PROCESS_CACHE_WAYS);
+    CleanupProcessCache();
+    free(sims);
+}
+
+static VOID
+TestLeastRecentlyUsed(VOID)
+{
+    PROCESS_SIM sims[PROCESS_CACHE_WAYS + 1];
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeProcessCache());
+    for (ULONG i = 0; i < ARRAYSIZE(sims); i++) {
+        MakeProcess(&sims[i], 7, i, 1);
+    }
+    for (ULONG i = 0; i < PROCESS_CACHE_WAYS; i++) {
+        CHECK(!Lookup(&sims[i]));
+    }
+
+    // The first process was used again, so the second is the oldest when the bucket overflows
+    CHECK(Lookup(&sims[0]));
+    CHECK(!Lookup(&sims[PROCESS_CACHE_WAYS]));
+    CHECK(CachedNames() == PROCESS_CACHE_WAYS);
+    CHECK(Lookup(&sims[0]));
+    CHECK(Lookup(&sims[2]));
+    CHECK(Lookup(&sims[PROCESS_CACHE_WAYS]));
+    CHECK(!Lookup(&sims[1]));
+    CleanupProcessCache();
+}
+
+static VOID
+TestEntryOutlivesEviction(VOID)
+{
+    PROCESS_SIM held;
+    PROCESS_SIM others[PROCESS_CACHE_WAYS];
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeProcessCache());
+    MakeProcess(&held, 11, 0, 5);
+    PPROCESS_NAME_ENTRY entry = LookupProcessName(&held.Process);
+    CHECK(entry != NULL);
+    usleep(1);
+
+    // A full bucket's worth of newer processes evicts it while the caller still copies its name
+    for (ULONG i = 0; i < ARRAYSIZE(others); i++) {
+        MakeProcess(&others[i], 11, i + 1, 5);
+        CHECK(!Lookup(&others[i]));
+    }
+    CHECK(!Lookup(&held));
+    WCHAR original[NAME_CHARS];
+    UNICODE_STRING name = NameAt(&held, 0, original);
+    CHECK(entry != NULL && RtlEqualUnicodeString(&entry->Name, &name, FALSE));
+    if (entry) {
+        ReleaseProcessName(entry);
+    }
+    CleanupProcessCache();
+}
+
+static VOID
+TestExitDropsEntries(VOID)
+{
+    PROCESS_SIM first;
+    PROCESS_SIM second;
+
+    CHECK_STATUS(STATUS_SUCCESS, InitializeProcessCache());
+    MakeProcess(&first, 20, 0, 9);
+    MakeProcess(&second, 20, 1, 9);
+    CHECK(!Lookup(&first));
+    CHECK(!Lookup(&second));
+    CHECK(CachedNames() == 2);
+
+    HostExitProcess(&first.Process);
+    CHECK(CachedNames() == 1);
+    CHECK(Lookup(&second));
+    CHECK(!Lookup(&first));
+    CleanupProcessCache();
+}
+
+int
+main(void)
+{
+    RUN_TEST(TestHitAndReusedId);
+    RUN_TEST(TestEvictionBound);
+    RUN_TEST(TestLeastRecentlyUsed);
+    RUN_TEST(TestEntryOutlivesEviction);
+    RUN_TEST(TestExitDropsEntries);
+    return HostTestResult();
+}
@@ -0,0 +1,185 @@
+/**
+ * @file ruleImageTest.c
+ * @brief Tests of the precompiled ruleset image: the perfect hash finds every name, and RuleImageOpen rejects
+ *        images that would let a lookup read outside them.
+ */
+
+#include "hostTest.h"
+#include <stdlib.h>
+#include "foldedName.h"
+#include "ruleCompiler.h"
+
+#define NAME_COUNT 20000
+
+typedef struct _TEST_IMAGE {
+    RULE_IMAGE_RULE* Rules;
+    WCHAR (*Paths)[64];
+    RULE_IMAGE_BUILD Build;
+} TEST_IMAGE;
+
+static BOOLEAN
+BuildImage(TEST_IMAGE* Image, ULONG Count)
+{
+    Image->Rules = calloc(Count + 2, sizeof(RULE_IMAGE_RULE));
+    Image->Paths = calloc(Count + 2, sizeof(*Image->Paths));
+    for (ULONG i = 0; i < Count; i++) {
+        HostPath(Image->Paths[i], 64, "\\Device\\HarddiskVolume1\\Data\\file%05u.txt", i);
+        Image->Rules[i].Path = Image->Paths[i];
+        Image->Rules[i].Length = (USHORT)(HostLength(Image->Paths[i]) * sizeof(WCHAR));
+        Image->Rules[i].Flags = (i % 3 == 0) ? RULE_IMAGE_PROTECTED : 0;
+    }
+
+    // A directory rule, and a duplicate in another case that the compiler drops
+    HostPath(Image->Paths[Count], 64, "\\Device\\HarddiskVolume1\\Tree\\");
+    HostPath(Image->Paths[Count + 1], 64, "\\DEVICE\\HARDDISKVOLUME1\\DATA\\FILE00000.TXT");
+    for (ULONG i = Count; i < Count + 2; i++) {
+        Image->Rules[i].Path = Image->Paths[i];
+        Image->Rules[i].Length = (USHORT)(HostLength(Image->Paths[i]) * sizeof(WCHAR));
+    }
+    return CompileRuleImage(Image->Rules, Count + 2, FoldNameChar, &Image->Build) != FALSE;
+}
+
+static VOID
+FreeImage(TEST_IMAGE* Image)
+{
+    free(Image->Build.Image);
+    free(Image->Paths);
+    free(Image->Rules);
+}
+
+static VOID
+TestEveryNameIsFound(VOID)
+{
+    TEST_IMAGE image = { 0 };
+    RULE_IMAGE_VIEW view;
+    WCHAR path[64];
+    USHORT flags = 0;
+
+    CHECK(BuildImage(&image, NAME_COUNT));
+    CHECK(image.Build.NameCount == NAME_COUNT);
+    CHECK(image.Build.DirectoryCount == 1);
+    CHECK(image.Build.Duplicates == 1);
+    CHECK(RuleImageOpen(&view, image.Build.Image, image.Build.ImageSize));
+    CHECK(view.Header->SlotCount >= NAME_COUNT);
+
+    ULONG missing = 0;
+    ULONG wrongFlags = 0;
+    for (ULONG i = 0; i < NAME_COUNT; i++) {
+        // Looked up in another case than it was compiled in
+        HostPath(path, ARRAYSIZE(path), "\\device\\harddiskvolume1\\DATA\\FILE%05u.TXT", i);
+        if (!RuleImageLookup(&view, path, (USHORT)(HostLength(path) * sizeof(WCHAR)), FoldNameChar, &flags)) {
+            missing++;
+        }
+        else if (flags != ((i % 3 == 0) ? RULE_IMAGE_PROTECTED : 0)) {
+            wrongFlags++;
+        }
+    }
+    CHECK(missing == 0);
+    CHECK(wrongFlags == 0);
+
+    // Names that are not in the image land on some entry, which must not compare equal
+    ULONG falseHits = 0;
+    for (ULONG i = NAME_COUNT; i < 2 * NAME_COUNT; i++) {
+        HostPath(path, ARRAYSIZE(path), "\\Device\\HarddiskVolume1\\Data\\file%05u.txt", i);
+        if (RuleImageLookup(&view, path, (USHORT)(HostLength(path) * sizeof(WCHAR)), FoldNameChar, NULL)) {
+            falseHits++;
+        }
+    }
+    CHECK(falseHits == 0);
+    HostPath(path, ARRAYSIZE(path), "\\Device\\HarddiskVolume1\\Tree\\");
+    CHECK(!RuleImageLookup(&view, path, (USHORT)(HostLength(path) * sizeof(WCHAR)), FoldNameChar, NULL));
+    FreeImage(&image);
+}
+
+static VOID
+TestOpenRejectsDamage(VOID)
+{
+    TEST_IMAGE image = { 0 };
+    RULE_IMAGE_VIEW view;
+    CHECK(BuildImage(&image, 500));
+    PUCHAR bytes = image.Build.Image;
+    ULONG size = image.Build.ImageSize;
+    PUCHAR copy = malloc(size);
+    PRULE_IMAGE_HEADER header = (PRULE_IMAGE_HEADER)copy;
+
+    CHECK(!RuleImageOpen(&view, bytes, sizeof(RULE_IMAGE_HEADER) - 1));
+    CHECK(!RuleImageOpen(&view, bytes, size - 8));
+
+    memcpy(copy, bytes, size);
+    header->Magic ^= 1;
+    CHECK(!RuleImageOpen(&view, copy, size));
+
+    memcpy(copy, bytes, size);
+    header->Version++;
+    CHECK(!RuleImageOpen(&view, copy, size));
+
+    memcpy(copy, bytes, size);
+    header->StringsSize += 8;
+    CHECK(!RuleImageOpen(&view, copy, size));
+
+    memcpy(copy, bytes, size);
+    header->NameCount++;
+    CHECK(!RuleImageOpen(&view, copy, size));
+
+    // A name pointing past the string pool
+    memcpy(copy, bytes, size);
+    ((PRULE_IMAGE_ENTRY)(copy + header->NamesOffset))[7].StringOffset = header->StringsSize;
+    CHECK(!RuleImageOpen(&view, copy, size));
+
+    // A pilot that sends a name to someone else's entry
+    memcpy(copy, bytes, size);
+    ((PULONG)(copy + header->PilotsOffset))[0] ^= 0x5A5A;
+    CHECK(!RuleImageOpen(&view, copy, size));
+
+    memcpy(copy, bytes, size);
+    CHECK(RuleImageOpen(&view, copy, size));
+    free(copy);
+    FreeImage(&image);
+}
+
+// Concurrent lookups touch nothing but the image, which the driver never writes after loading it
+#define IMAGE_READERS 4
+
+static RULE_IMAGE_VIEW SharedView;
+static LONG SharedMisses;
+
+static void*
+ImageReader(void* Context)
+{
+    WCHAR path[64];
+    ULONG first = (ULONG)(ULONG_PTR)Context;
+    for (ULONG i = first; i < NAME_COUNT; i += IMAGE_READERS) {
+        HostPath(path, ARRAYSIZE(path), "\\Device\\HarddiskVolume1\\Data\\file%05u.txt", i);
+        if (!RuleImageLookup(&SharedView, path, (USHORT)(HostLength(path) * sizeof(WCHAR)), FoldNameChar, NULL)) {
+            InterlockedIncrement(&SharedMisses);
+        }
+    }
+    return NULL;
+}
+
+static VOID
+TestSharedLookups(VOID)
+{
+    TEST_IMAGE image = { 0 };
+    pthread_t readers[IMAGE_READERS];
+
+    CHECK(BuildImage(&image, NAME_COUNT));
+    CHECK(RuleImageOpen(&SharedView, image.Build.Image, image.Build.ImageSize));
+    for (ULONG i = 0; i < IMAGE_READERS; i++) {
+        pthread_create(&readers[i], NULL, ImageReader, (PVOID)(ULONG_PTR)i);
+    }
+    for (ULONG i = 0; i < IMAGE_READERS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    CHECK(SharedMisses == 0);
+    FreeImage(&image);
+}
+
+int
+main(void)
+{
+    RUN_TEST(TestEveryNameIsFound);
+    RUN_TEST(TestOpenRejectsDamage);
+    RUN_TEST(TestSharedLookups);
+    return HostTestResult();
+}
@@ -0,0 +1,643 @@
+/**
+ * @file fltKernel.h
+ * @brief User-mode stand-in for the parts of the WDK the driver sources use, so they build and run on a Linux host.
+ *
+ * Only the kernel sources include it; host/CMakeLists.txt puts this directory first on their include path. Types
+ * keep their Windows widths (LONG is 32 bits, WCHAR 16 bits with -fshort-wchar), interlocked operations map to the
+ * compiler's atomics, and locks, lookaside lists and rundown references are built on pthreads and spinning. The
+ * behaviour the driver relies on is kept: pool allocations are zeroed unless POOL_FLAG_UNINITIALIZED is given and
+ * start on a page when they are a page or larger, and a rundown reference refuses new acquires once a wait began.
+ * IRQLs do not exist; raising one is a no-op.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if !defined(__SIZEOF_WCHAR_T__) || __SIZEOF_WCHAR_T__ != 2
+#error The host build needs a 16-bit wchar_t (-fshort-wchar)
+#endif
+
+// Annotations and MSVC keywords
+
+#define _In_
+#define _In_opt_
+#define _Inout_
+#define _Out_
+#define _Acquires_lock_(lock)
+#define _Releases_lock_(lock)
+#define _IRQL_raises_(irql)
+#define _IRQL_requires_(irql)
+#define _Flt_CompletionContext_Outptr_
+#define _Function_class_(name)
+
+#define DECLSPEC_CACHEALIGN __attribute__((aligned(64)))
+#define FORCEINLINE static inline __attribute__((always_inline))
+#define __forceinline inline __attribute__((always_inline))
+#define C_ASSERT(e) _Static_assert(e, #e)
+#define UNREFERENCED_PARAMETER(p) ((void)(p))
+#define FlagOn(flags, flag) ((flags) & (flag))
+
+// Structured exception handling has nothing to catch here: the guarded block always runs, the handler never does
+#define __try if (1)
+#define __except(filter) else
+#define EXCEPTION_EXECUTE_HANDLER 1
+
+// Base types
+
+typedef void VOID, *PVOID;
+typedef char CHAR, *PCHAR;
+typedef unsigned char UCHAR, *PUCHAR;
+typedef short SHORT, *PSHORT;
+typedef unsigned short USHORT, *PUSHORT;
+typedef int LONG, *PLONG;
+typedef unsigned int ULONG, *PULONG;
+typedef long long LONG64, *PLONG64, LONGLONG;
+typedef unsigned long long ULONG64, *PULONG64, ULONGLONG;
+typedef intptr_t LONG_PTR;
+typedef uintptr_t ULONG_PTR, SIZE_T, *PSIZE_T;
+typedef wchar_t WCHAR, *PWCHAR, *PWCH, *PWSTR;
+typedef const wchar_t *PCWCH, *PCWSTR;
+typedef const char *PCSTR;
+typedef UCHAR BOOLEAN, *PBOOLEAN;
+typedef int BOOL;
+typedef LONG NTSTATUS, *PNTSTATUS;
+typedef UCHAR KIRQL, *PKIRQL;
+typedef PVOID HANDLE;
+typedef const VOID* PCVOID;
+
+typedef union _LARGE_INTEGER {
+    struct {
+        ULONG LowPart;
+        LONG HighPart;
+    };
+    LONG64 QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+#define TRUE 1
+#define FALSE 0
+#ifndef NULL
+#define NULL ((void*)0)
+#endif
+
+#define ANYSIZE_ARRAY 1
+#define MAXUSHORT 0xFFFF
+#define MAXULONG 0xFFFFFFFFu
+#define MAXLONG 0x7FFFFFFF
+#define MAXLONG64 0x7FFFFFFFFFFFFFFFLL
+#define PAGE_SIZE 4096
+#define MEMORY_ALLOCATION_ALIGNMENT 16
+#define SYSTEM_CACHE_ALIGNMENT_SIZE 64
+
+#define FIELD_OFFSET(type, field) ((LONG)offsetof(type, field))
+#define CONTAINING_RECORD(address, type, field) ((type*)((PUCHAR)(address) - offsetof(type, field)))
+#define ARRAYSIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define RTL_NUMBER_OF(a) ARRAYSIZE(a)
+#ifndef max
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+#ifndef min
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+#define HandleToULong(h) ((ULONG)(ULONG_PTR)(h))
+#define ULongToHandle(u) ((HANDLE)(ULONG_PTR)(u))
+
+// Status codes
+
+#define NT_SUCCESS(status) (((NTSTATUS)(status)) >= 0)
+
+#define STATUS_SUCCESS                   ((NTSTATUS)0x00000000L)
+#define STATUS_PENDING                   ((NTSTATUS)0x00000103L)
+#define STATUS_NO_MORE_ENTRIES           ((NTSTATUS)0x8000001AL)
+#define STATUS_UNSUCCESSFUL              ((NTSTATUS)0xC0000001L)
+#define STATUS_INVALID_PARAMETER         ((NTSTATUS)0xC000000DL)
+#define STATUS_END_OF_FILE               ((NTSTATUS)0xC0000011L)
+#define STATUS_ACCESS_DENIED             ((NTSTATUS)0xC0000022L)
+#define STATUS_BUFFER_TOO_SMALL          ((NTSTATUS)0xC0000023L)
+#define STATUS_OBJECT_TYPE_MISMATCH      ((NTSTATUS)0xC0000024L)
+#define STATUS_OBJECT_NAME_INVALID       ((NTSTATUS)0xC0000033L)
+#define STATUS_DELETE_PENDING            ((NTSTATUS)0xC0000056L)
+#define STATUS_INSUFFICIENT_RESOURCES    ((NTSTATUS)0xC000009AL)
+#define STATUS_INVALID_DEVICE_REQUEST    ((NTSTATUS)0xC0000010L)
+#define STATUS_INVALID_IMAGE_FORMAT      ((NTSTATUS)0xC000007BL)
+#define STATUS_DEVICE_BUSY               ((NTSTATUS)0x80000011L)
+#define STATUS_CANCELLED                 ((NTSTATUS)0xC0000120L)
+#define STATUS_IMPLEMENTATION_LIMIT      ((NTSTATUS)0xC000042BL)
+#define STATUS_NOT_FOUND                 ((NTSTATUS)0xC0000225L)
+#define STATUS_ALREADY_REGISTERED        ((NTSTATUS)0xC0000718L)
+
+// Strings
+
+typedef struct _UNICODE_STRING {
+    USHORT Length;
+    USHORT MaximumLength;
+    PWCH Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+typedef const UNICODE_STRING* PCUNICODE_STRING;
+
+#define UNICODE_STRING_MAX_BYTES ((USHORT)65534)
+
+VOID RtlInitUnicodeString(PUNICODE_STRING Destination, PCWSTR Source);
+VOID RtlCopyUnicodeString(PUNICODE_STRING Destination, PCUNICODE_STRING Source);
+BOOLEAN RtlEqualUnicodeString(PCUNICODE_STRING String1, PCUNICODE_STRING String2, BOOLEAN CaseInSensitive);
+NTSTATUS RtlUpcaseUnicodeString(PUNICODE_STRING Destination, PCUNICODE_STRING Source, BOOLEAN AllocateDestination);
+VOID RtlFreeUnicodeString(PUNICODE_STRING String);
+
+/**
+ * @brief Upcases ASCII and Latin-1 like the kernel's table does; other characters come back unchanged.
+ */
+WCHAR RtlUpcaseUnicodeChar(WCHAR SourceCharacter);
+
+#define RtlCopyMemory(d, s, n) memcpy((d), (s), (n))
+#define RtlMoveMemory(d, s, n) memmove((d), (s), (n))
+#define RtlZeroMemory(d, n) memset((d), 0, (n))
+#define RtlFillMemory(d, n, v) memset((d), (v), (n))
+#define RtlEqualMemory(a, b, n) (memcmp((a), (b), (n)) == 0)
+#define RtlCompareMemory(a, b, n) ((SIZE_T)(memcmp((a), (b), (n)) == 0 ? (n) : 0))
+
+ULONG DbgPrint(PCSTR Format, ...);
+
+// Pool
+
+typedef ULONG64 POOL_FLAGS;
+typedef enum _POOL_TYPE {
+    NonPagedPool,
+    PagedPool,
+    NonPagedPoolNx = 512
+} POOL_TYPE;
+
+#define POOL_FLAG_UNINITIALIZED  0x0000000000000002ULL
+#define POOL_FLAG_CACHE_ALIGNED  0x0000000000000004ULL
+#define POOL_FLAG_NON_PAGED      0x0000000000000040ULL
+#define POOL_FLAG_PAGED          0x0000000000000100ULL
+
+PVOID ExAllocatePool2(POOL_FLAGS Flags, SIZE_T NumberOfBytes, ULONG Tag);
+VOID ExFreePool(PVOID P);
+VOID ExFreePoolWithTag(PVOID P, ULONG Tag);
+
+// Blocks come straight from the heap; using a list after ExDeleteLookasideListEx aborts
+typedef struct _LOOKASIDE_LIST_EX {
+    SIZE_T Size;
+    ULONG Tag;
+    BOOLEAN Active;
+} LOOKASIDE_LIST_EX, *PLOOKASIDE_LIST_EX;
+
+NTSTATUS ExInitializeLookasideListEx(PLOOKASIDE_LIST_EX Lookaside, PVOID Allocate, PVOID Free, POOL_TYPE PoolType,
+    ULONG Flags, SIZE_T Size, ULONG Tag, USHORT Depth);
+VOID ExDeleteLookasideListEx(PLOOKASIDE_LIST_EX Lookaside);
+PVOID ExAllocateFromLookasideListEx(PLOOKASIDE_LIST_EX Lookaside);
+VOID ExFreeToLookasideListEx(PLOOKASIDE_LIST_EX Lookaside, PVOID Entry);
+
+// Interlocked operations and ordered accesses, all sequentially consistent unless named otherwise
+
+FORCEINLINE LONG InterlockedIncrement(volatile LONG* Target) { return __atomic_add_fetch(Target, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedDecrement(volatile LONG* Target) { return __atomic_sub_fetch(Target, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedAdd(volatile LONG* Target, LONG Value) { return __atomic_add_fetch(Target, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedExchange(volatile LONG* Target, LONG Value) { return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedOr(volatile LONG* Target, LONG Value) { return __atomic_fetch_or(Target, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedCompareExchange(volatile LONG* Target, LONG Exchange, LONG Comparand)
+{
+    __atomic_compare_exchange_n(Target, &Comparand, Exchange, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+FORCEINLINE LONG64 InterlockedIncrement64(volatile LONG64* Target) { return __atomic_add_fetch(Target, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedDecrement64(volatile LONG64* Target) { return __atomic_sub_fetch(Target, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedAdd64(volatile LONG64* Target, LONG64 Value) { return __atomic_add_fetch(Target, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedExchange64(volatile LONG64* Target, LONG64 Value) { return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedOr64(volatile LONG64* Target, LONG64 Value) { return __atomic_fetch_or(Target, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedCompareExchange64(volatile LONG64* Target, LONG64 Exchange, LONG64 Comparand)
+{
+    __atomic_compare_exchange_n(Target, &Comparand, Exchange, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+FORCEINLINE PVOID InterlockedExchangePointer(PVOID volatile* Target, PVOID Value) { return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE PVOID InterlockedCompareExchangePointer(PVOID volatile* Target, PVOID Exchange, PVOID Comparand)
+{
+    __atomic_compare_exchange_n(Target, &Comparand, Exchange, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+FORCEINLINE LONG ReadNoFence(const volatile LONG* Source) { return __atomic_load_n(Source, __ATOMIC_RELAXED); }
+FORCEINLINE LONG ReadAcquire(const volatile LONG* Source) { return __atomic_load_n(Source, __ATOMIC_ACQUIRE); }
+FORCEINLINE VOID WriteNoFence(volatile LONG* Destination, LONG Value) { __atomic_store_n(Destination, Value, __ATOMIC_RELAXED); }
+FORCEINLINE VOID WriteRelease(volatile LONG* Destination, LONG Value) { __atomic_store_n(Destination, Value, __ATOMIC_RELEASE); }
+FORCEINLINE LONG64 ReadNoFence64(const volatile LONG64* Source) { return __atomic_load_n(Source, __ATOMIC_RELAXED); }
+FORCEINLINE LONG64 ReadAcquire64(const volatile LONG64* Source) { return __atomic_load_n(Source, __ATOMIC_ACQUIRE); }
+FORCEINLINE VOID WriteNoFence64(volatile LONG64* Destination, LONG64 Value) { __atomic_store_n(Destination, Value, __ATOMIC_RELAXED); }
+FORCEINLINE VOID WriteRelease64(volatile LONG64* Destination, LONG64 Value) { __atomic_store_n(Destination, Value, __ATOMIC_RELEASE); }
+FORCEINLINE PVOID ReadPointerAcquire(PVOID const volatile* Source) { return __atomic_load_n(Source, __ATOMIC_ACQUIRE); }
+FORCEINLINE PVOID ReadPointerNoFence(PVOID const volatile* Source) { return __atomic_load_n(Source, __ATOMIC_RELAXED); }
+FORCEINLINE VOID WritePointerRelease(PVOID volatile* Destination, PVOID Value) { __atomic_store_n(Destination, Value, __ATOMIC_RELEASE); }
+FORCEINLINE VOID WritePointerNoFence(PVOID volatile* Destination, PVOID Value) { __atomic_store_n(Destination, Value, __ATOMIC_RELAXED); }
+
+#define KeMemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define MemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define YieldProcessor() _mm_pause()
+#define ReadTimeStampCounter() ((ULONG64)__rdtsc())
+#else
+#define YieldProcessor() __asm__ __volatile__("" ::: "memory")
+#endif
+
+FORCEINLINE BOOLEAN BitScanReverse(PULONG Index, ULONG Mask)
+{
+    if (!Mask) {
+        return FALSE;
+    }
+    *Index = 31 - (ULONG)__builtin_clz(Mask);
+    return TRUE;
+}
+
+FORCEINLINE BOOLEAN BitScanForward(PULONG Index, ULONG Mask)
+{
+    if (!Mask) {
+        return FALSE;
+    }
+    *Index = (ULONG)__builtin_ctz(Mask);
+    return TRUE;
+}
+
+// Locks. There are no IRQLs; the levels are kept so the callers' bookkeeping compiles.
+
+#define PASSIVE_LEVEL  0
+#define APC_LEVEL      1
+#define DISPATCH_LEVEL 2
+
+KIRQL KeGetCurrentIrql(VOID);
+
+typedef volatile LONG KSPIN_LOCK, *PKSPIN_LOCK;
+
+VOID KeInitializeSpinLock(PKSPIN_LOCK SpinLock);
+VOID KeAcquireSpinLockRaw(PKSPIN_LOCK SpinLock);
+VOID KeReleaseSpinLockRaw(PKSPIN_LOCK SpinLock);
+#define KeAcquireSpinLock(lock, oldIrql) (*(oldIrql) = PASSIVE_LEVEL, KeAcquireSpinLockRaw(lock))
+#define KeReleaseSpinLock(lock, oldIrql) ((void)(oldIrql), KeReleaseSpinLockRaw(lock))
+#define KeAcquireSpinLockAtDpcLevel(lock) KeAcquireSpinLockRaw(lock)
+#define KeReleaseSpinLockFromDpcLevel(lock) KeReleaseSpinLockRaw(lock)
+
+// Readers add 2, a writer holds bit 0
+typedef volatile LONG EX_SPIN_LOCK, *PEX_SPIN_LOCK;
+
+KIRQL ExAcquireSpinLockShared(PEX_SPIN_LOCK SpinLock);
+VOID ExReleaseSpinLockShared(PEX_SPIN_LOCK SpinLock, KIRQL OldIrql);
+KIRQL ExAcquireSpinLockExclusive(PEX_SPIN_LOCK SpinLock);
+VOID ExReleaseSpinLockExclusive(PEX_SPIN_LOCK SpinLock, KIRQL OldIrql);
+
+// Embedded, since the WDK has no call that would free a separate allocation
+typedef struct _FAST_MUTEX {
+    pthread_mutex_t Mutex;
+} FAST_MUTEX, *PFAST_MUTEX;
+
+VOID ExInitializeFastMutex(PFAST_MUTEX FastMutex);
+VOID ExAcquireFastMutex(PFAST_MUTEX FastMutex);
+VOID ExReleaseFastMutex(PFAST_MUTEX FastMutex);
+
+// A cache-aware rundown reference: one count for the host, with bit 0 set once a wait for rundown began
+typedef struct _EX_RUNDOWN_REF_CACHE_AWARE {
+    volatile LONG64 Count;
+} EX_RUNDOWN_REF_CACHE_AWARE, *PEX_RUNDOWN_REF_CACHE_AWARE;
+
+PEX_RUNDOWN_REF_CACHE_AWARE ExAllocateCacheAwareRundownProtection(POOL_TYPE PoolType, ULONG PoolTag);
+VOID ExFreeCacheAwareRundownProtection(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware);
+BOOLEAN ExAcquireRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware);
+VOID ExReleaseRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware);
+VOID ExWaitForRundownProtectionReleaseCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware);
+VOID ExReInitializeRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware);
+
+// Processors and clocks
+
+#define ALL_PROCESSOR_GROUPS 0xFFFF
+
+typedef struct _PROCESSOR_NUMBER {
+    USHORT Group;
+    UCHAR Number;
+    UCHAR Reserved;
+} PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+
+ULONG KeQueryMaximumProcessorCountEx(USHORT GroupNumber);
+
+/**
+ * @brief The processor the calling thread runs on, or the one a test pinned it to with HostSetProcessor.
+ */
+ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber);
+
+/**
+ * @brief Makes KeGetCurrentProcessorNumberEx return Number on the calling thread; MAXULONG undoes it.
+ */
+VOID HostSetProcessor(ULONG Number);
+
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency);
+VOID KeQuerySystemTime(PLARGE_INTEGER CurrentTime);
+ULONG64 KeQueryInterruptTime(VOID);
+ULONG64 KeQueryInterruptTimePrecise(PULONG64 QpcTimeStamp);
+
+// Processes. The calling thread acts for whichever process the host made current; without one it is the System
+// process, which has no image name.
+
+/**
+ * @brief Host-only layout: what the Ps and Se queries return for a process.
+ */
+typedef struct _EPROCESS {
+    HANDLE ProcessId;
+    LONG64 CreateTime;
+    UNICODE_STRING ImageName;        ///< Host-only: what SeLocateProcessImageName copies; empty for none.
+} EPROCESS, *PEPROCESS;
+
+typedef VOID (*PCREATE_PROCESS_NOTIFY_ROUTINE)(HANDLE ParentId, HANDLE ProcessId, BOOLEAN Create);
+
+PEPROCESS PsGetCurrentProcess(VOID);
+HANDLE PsGetProcessId(PEPROCESS Process);
+LONG64 PsGetProcessCreateTimeQuadPart(PEPROCESS Process);
+NTSTATUS SeLocateProcessImageName(PEPROCESS Process, PUNICODE_STRING* ImageFileName);
+
+/**
+ * @brief Keeps a single routine; HostExitProcess calls it.
+ */
+NTSTATUS PsSetCreateProcessNotifyRoutine(PCREATE_PROCESS_NOTIFY_ROUTINE NotifyRoutine, BOOLEAN Remove);
+
+/**
+ * @brief Host-only: makes PsGetCurrentProcess return Process on the calling thread; NULL goes back to System.
+ */
+VOID HostSetCurrentProcess(PEPROCESS Process);
+
+/**
+ * @brief Host-only: reports the exit of Process to the registered notify routine.
+ */
+VOID HostExitProcess(PEPROCESS Process);
+
+/**
+ * @brief Host-only: the number of SeLocateProcessImageName calls so far.
+ */
+LONG64 HostImageNameQueries(VOID);
+
+// Memory descriptor lists. The host has a single address space, so a "user" mapping is the buffer itself.
+
+typedef enum _KPROCESSOR_MODE {
+    KernelMode,
+    UserMode
+} KPROCESSOR_MODE, MODE;
+
+typedef enum _MEMORY_CACHING_TYPE {
+    MmNonCached,
+    MmCached
+} MEMORY_CACHING_TYPE;
+
+typedef enum _MM_PAGE_PRIORITY {
+    LowPagePriority,
+    NormalPagePriority = 16,
+    HighPagePriority = 32
+} MM_PAGE_PRIORITY;
+
+#define MdlMappingNoWrite   0x80000000
+#define MdlMappingNoExecute 0x40000000
+
+#define MM_DONT_ZERO_ALLOCATION    0x00000001
+#define MM_ALLOCATE_FULLY_REQUIRED 0x00000004
+
+typedef LARGE_INTEGER PHYSICAL_ADDRESS;
+
+// An MDL from MmAllocatePagesForMdlEx describes a shared memory file, so every mapping of it is a separate view of
+// the same pages, with its own protection
+typedef struct _MDL {
+    PVOID StartVa;         ///< First byte described, or NULL for allocated pages.
+    ULONG ByteCount;       ///< Bytes described.
+    int PagesFd;           ///< Memory file holding the allocated pages, or -1.
+    PVOID MappedSystemVa;  ///< System mapping of the allocated pages, once made.
+} MDL, *PMDL;
+
+#define MmGetMdlByteCount(mdl) ((mdl)->ByteCount)
+#define MmGetMdlVirtualAddress(mdl) ((mdl)->StartVa)
+
+PMDL IoAllocateMdl(PVOID VirtualAddress, ULONG Length, BOOLEAN SecondaryBuffer, BOOLEAN ChargeQuota, PVOID Irp);
+VOID IoFreeMdl(PMDL Mdl);
+VOID MmBuildMdlForNonPagedPool(PMDL MemoryDescriptorList);
+PVOID MmMapLockedPagesSpecifyCache(PMDL MemoryDescriptorList, KPROCESSOR_MODE AccessMode, MEMORY_CACHING_TYPE CacheType,
+    PVOID RequestedAddress, ULONG BugCheckOnFailure, ULONG Priority);
+VOID MmUnmapLockedPages(PVOID BaseAddress, PMDL MemoryDescriptorList);
+PMDL MmAllocatePagesForMdlEx(PHYSICAL_ADDRESS LowAddress, PHYSICAL_ADDRESS HighAddress, PHYSICAL_ADDRESS SkipBytes,
+    SIZE_T TotalBytes, MEMORY_CACHING_TYPE CacheType, ULONG Flags);
+VOID MmFreePagesFromMdl(PMDL MemoryDescriptorList);
+PVOID MmGetSystemAddressForMdlSafe(PMDL Mdl, ULONG Priority);
+
+// Filter manager. A file object carries the stream handle context of the single instance the host simulates, and
+// the name FltGetFileNameInformation reports is that of the HOST_FILE it was opened on, so a test renames a file
+// for every handle at once by changing HOST_FILE::Name. Contexts are reference counted as in FltMgr.
+
+// Only declared, for the prototypes of the dispatch routines; the host has no I/O manager to call them
+typedef struct _DEVICE_OBJECT DEVICE_OBJECT, *PDEVICE_OBJECT;
+typedef struct _IRP IRP, *PIRP;
+
+typedef struct _IO_STATUS_BLOCK {
+    NTSTATUS Status;
+    ULONG_PTR Information;
+} IO_STATUS_BLOCK, *PIO_STATUS_BLOCK;
+
+/**
+ * @brief Host-only: the file a FILE_OBJECT is open on; its Name is what name queries return for every handle.
+ */
+typedef struct _HOST_FILE {
+    UNICODE_STRING Name;
+} HOST_FILE, *PHOST_FILE;
+
+typedef struct _FILE_OBJECT {
+    PHOST_FILE File;                 ///< Host-only: the file opened.
+    PVOID StreamHandleContext;       ///< Host-only: the context FltSetStreamHandleContext attached.
+    UNICODE_STRING FileName;
+    ULONG Flags;
+} FILE_OBJECT, *PFILE_OBJECT;
+
+#define FO_VOLUME_OPEN 0x00400000
+
+// Create options: the disposition is in the top byte
+#define FILE_SUPERSEDE          0x00000000
+#define FILE_OPEN               0x00000001
+#define FILE_CREATE             0x00000002
+#define FILE_OPEN_IF            0x00000003
+#define FILE_OVERWRITE          0x00000004
+#define FILE_OVERWRITE_IF       0x00000005
+#define FILE_DELETE_ON_CLOSE    0x00001000
+
+// What a create did, in IoStatus.Information
+#define FILE_SUPERSEDED         0x00000000
+#define FILE_OPENED             0x00000001
+#define FILE_CREATED            0x00000002
+#define FILE_OVERWRITTEN        0x00000003
+
+#define SL_OPEN_PAGING_FILE     0x02
+#define SL_OPEN_TARGET_DIRECTORY 0x04
+
+typedef struct _FILE_DISPOSITION_INFORMATION {
+    BOOLEAN DeleteFile;
+} FILE_DISPOSITION_INFORMATION, *PFILE_DISPOSITION_INFORMATION;
+
+typedef struct _FILE_DISPOSITION_INFORMATION_EX {
+    ULONG Flags;
+} FILE_DISPOSITION_INFORMATION_EX, *PFILE_DISPOSITION_INFORMATION_EX;
+
+#define FILE_DISPOSITION_DELETE 0x00000001
+
+typedef struct _FLT_FILTER* PFLT_FILTER;
+typedef struct _FLT_VOLUME {
+    UNICODE_STRING Name;             ///< Host-only: what FltGetVolumeName copies.
+} FLT_VOLUME, *PFLT_VOLUME;
+typedef struct _FLT_INSTANCE {
+    PVOID InstanceContext;           ///< Host-only: the context FltSetInstanceContext attached.
+} FLT_INSTANCE, *PFLT_INSTANCE;
+typedef PVOID PFLT_CONTEXT;
+
+typedef enum _FILE_INFORMATION_CLASS {
+    FileRenameInformation = 10,
+    FileLinkInformation = 11,
+    FileDispositionInformation = 13,
+    FileEndOfFileInformation = 20,
+    FileRenameInformationEx = 65,
+    FileDispositionInformationEx = 64
+} FILE_INFORMATION_CLASS;
+
+typedef union _FLT_PARAMETERS {
+    struct {
+        PVOID SecurityContext;
+        ULONG Options;
+        USHORT FileAttributes;
+        USHORT ShareAccess;
+        ULONG EaLength;
+        PVOID EaBuffer;
+        LARGE_INTEGER AllocationSize;
+    } Create;
+    struct {
+        ULONG Length;
+        FILE_INFORMATION_CLASS FileInformationClass;
+        PFILE_OBJECT ParentOfTarget;
+        union {
+            struct {
+                BOOLEAN ReplaceIfExists;
+                BOOLEAN AdvanceOnly;
+            };
+            ULONG ClusterCount;
+            HANDLE DeleteHandle;
+        };
+        PVOID InfoBuffer;
+    } SetFileInformation;
+} FLT_PARAMETERS, *PFLT_PARAMETERS;
+
+typedef struct _FLT_IO_PARAMETER_BLOCK {
+    ULONG IrpFlags;
+    UCHAR MajorFunction;
+    UCHAR MinorFunction;
+    UCHAR OperationFlags;
+    UCHAR Reserved;
+    PFILE_OBJECT TargetFileObject;
+    PFLT_INSTANCE TargetInstance;
+    FLT_PARAMETERS Parameters;
+} FLT_IO_PARAMETER_BLOCK, *PFLT_IO_PARAMETER_BLOCK;
+
+typedef struct _FLT_CALLBACK_DATA {
+    ULONG Flags;
+    PVOID Thread;
+    PFLT_IO_PARAMETER_BLOCK Iopb;
+    IO_STATUS_BLOCK IoStatus;
+    KPROCESSOR_MODE RequestorMode;
+} FLT_CALLBACK_DATA, *PFLT_CALLBACK_DATA;
+
+typedef struct _FLT_RELATED_OBJECTS {
+    USHORT Size;
+    USHORT TransactionContext;
+    PFLT_FILTER Filter;
+    PFLT_VOLUME Volume;
+    PFLT_INSTANCE Instance;
+    PFILE_OBJECT FileObject;
+    PVOID Transaction;
+} FLT_RELATED_OBJECTS, *PFLT_RELATED_OBJECTS;
+typedef const FLT_RELATED_OBJECTS* PCFLT_RELATED_OBJECTS;
+
+#define IRP_MJ_CREATE           0x00
+#define IRP_MJ_SET_INFORMATION  0x06
+
+typedef enum _FLT_PREOP_CALLBACK_STATUS {
+    FLT_PREOP_SUCCESS_WITH_CALLBACK,
+    FLT_PREOP_SUCCESS_NO_CALLBACK,
+    FLT_PREOP_PENDING,
+    FLT_PREOP_DISALLOW_FASTIO,
+    FLT_PREOP_COMPLETE,
+    FLT_PREOP_SYNCHRONIZE
+} FLT_PREOP_CALLBACK_STATUS;
+
+typedef enum _FLT_POSTOP_CALLBACK_STATUS {
+    FLT_POSTOP_FINISHED_PROCESSING,
+    FLT_POSTOP_MORE_PROCESSING_REQUIRED
+} FLT_POSTOP_CALLBACK_STATUS;
+
+typedef ULONG FLT_POST_OPERATION_FLAGS;
+#define FLTFL_POST_OPERATION_DRAINING 0x00000001
+
+typedef USHORT FLT_CONTEXT_TYPE;
+#define FLT_VOLUME_CONTEXT        0x0001
+#define FLT_INSTANCE_CONTEXT      0x0002
+#define FLT_FILE_CONTEXT          0x0004
+#define FLT_STREAM_CONTEXT        0x0008
+#define FLT_STREAMHANDLE_CONTEXT  0x0010
+
+typedef enum _FLT_SET_CONTEXT_OPERATION {
+    FLT_SET_CONTEXT_REPLACE_IF_EXISTS,
+    FLT_SET_CONTEXT_KEEP_IF_EXISTS
+} FLT_SET_CONTEXT_OPERATION;
+
+typedef ULONG FLT_FILE_NAME_OPTIONS;
+#define FLT_FILE_NAME_NORMALIZED     0x01
+#define FLT_FILE_NAME_OPENED         0x02
+#define FLT_FILE_NAME_SHORT          0x03
+#define FLT_FILE_NAME_QUERY_DEFAULT  0x0100
+
+typedef struct _FLT_FILE_NAME_INFORMATION {
+    USHORT Size;
+    USHORT NamesParsed;
+    FLT_FILE_NAME_OPTIONS Format;
+    UNICODE_STRING Name;
+    UNICODE_STRING Volume;
+    UNICODE_STRING Share;
+    UNICODE_STRING Extension;
+    UNICODE_STRING Stream;
+    UNICODE_STRING FinalComponent;
+    UNICODE_STRING ParentDir;
+} FLT_FILE_NAME_INFORMATION, *PFLT_FILE_NAME_INFORMATION;
+
+#define STATUS_FLT_CONTEXT_ALREADY_DEFINED ((NTSTATUS)0xC01C0002L)
+#define STATUS_NOT_SUPPORTED               ((NTSTATUS)0xC00000BBL)
+
+NTSTATUS FltAllocateContext(PFLT_FILTER Filter, FLT_CONTEXT_TYPE ContextType, SIZE_T ContextSize, POOL_TYPE PoolType,
+    PFLT_CONTEXT* ReturnedContext);
+VOID FltReferenceContext(PFLT_CONTEXT Context);
+VOID FltReleaseContext(PFLT_CONTEXT Context);
+NTSTATUS FltGetStreamHandleContext(PFLT_INSTANCE Instance, PFILE_OBJECT FileObject, PFLT_CONTEXT* Context);
+NTSTATUS FltSetStreamHandleContext(PFLT_INSTANCE Instance, PFILE_OBJECT FileObject, FLT_SET_CONTEXT_OPERATION Operation,
+    PFLT_CONTEXT NewContext, PFLT_CONTEXT* OldContext);
+NTSTATUS FltGetInstanceContext(PFLT_INSTANCE Instance, PFLT_CONTEXT* Context);
+NTSTATUS FltSetInstanceContext(PFLT_INSTANCE Instance, FLT_SET_CONTEXT_OPERATION Operation, PFLT_CONTEXT NewContext,
+    PFLT_CONTEXT* OldContext);
+NTSTATUS FltGetVolumeName(PFLT_VOLUME Volume, PUNICODE_STRING VolumeName, PULONG BufferSizeNeeded);
+NTSTATUS FltGetFileNameInformation(PFLT_CALLBACK_DATA CallbackData, FLT_FILE_NAME_OPTIONS NameOptions,
+    PFLT_FILE_NAME_INFORMATION* FileNameInformation);
+VOID FltReleaseFileNameInformation(PFLT_FILE_NAME_INFORMATION FileNameInformation);
+
+/**
+ * @brief Host-only: closes a handle, releasing the stream handle context attached to it, as FltMgr does at cleanup.
+ */
+VOID HostCloseFileObject(PFILE_OBJECT FileObject);
+
+/**
+ * @brief Host-only: releases the context attached to an instance, as FltMgr does at teardown.
+ */
+VOID HostTeardownInstance(PFLT_INSTANCE Instance);
+
+/**
+ * @brief Host-only: makes the next Count name queries fail with Status, to drive the failure paths.
+ */
+VOID HostFailNameQueries(ULONG Count, NTSTATUS Status);
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "fltKernel.h"
+
+
+// Every context is preceded by its header; the caller only sees what follows it
+typedef struct _HOST_CONTEXT {
+    volatile LONG References;
+    FLT_CONTEXT_TYPE Type;
+    SIZE_T Size;
+    LONG64 Body[1];
+} HOST_CONTEXT, *PHOST_CONTEXT;
+
+#define HOST_CONTEXT_OF(context) ((PHOST_CONTEXT)((PUCHAR)(context) - FIELD_OFFSET(HOST_CONTEXT, Body)))
+
+static volatile LONG NameQueryFailures;
+static volatile NTSTATUS NameQueryStatus;
+
+NTSTATUS
+FltAllocateContext(PFLT_FILTER Filter, FLT_CONTEXT_TYPE ContextType, SIZE_T ContextSize, POOL_TYPE PoolType,
+    PFLT_CONTEXT* ReturnedContext)
+{
+    UNREFERENCED_PARAMETER(Filter);
+    UNREFERENCED_PARAMETER(PoolType);
+    PHOST_CONTEXT context = ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED,
+        FIELD_OFFSET(HOST_CONTEXT, Body) + ContextSize, 'xCtH');
+    if (!context) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    context->References = 1;
+    context->Type = ContextType;
+    context->Size = ContextSize;
+    *ReturnedContext = context->Body;
+    return STATUS_SUCCESS;
+}
+
+VOID
+FltReferenceContext(PFLT_CONTEXT Context)
+{
+    InterlockedIncrement(&HOST_CONTEXT_OF(Context)->References);
+}
+
+VOID
+FltReleaseContext(PFLT_CONTEXT Context)
+{
+    LONG references = InterlockedDecrement(&HOST_CONTEXT_OF(Context)->References);
+    if (references < 0) {
+        fprintf(stderr, "fltShim: context released more often than referenced\n");
+        abort();
+    }
+    if (references == 0) {
+        ExFreePool(HOST_CONTEXT_OF(Context));
+    }
+}
+
+// Attaches NewContext to Slot unless one is there already, in which case that one is referenced into OldContext
+static NTSTATUS
+SetContext(PVOID volatile* Slot, FLT_SET_CONTEXT_OPERATION Operation, PFLT_CONTEXT NewContext, PFLT_CONTEXT* OldContext)
+{
+    FltReferenceContext(NewContext);
+    for (;;) {
+        PVOID existing = ReadPointerAcquire(Slot);
+        if (existing && Operation == FLT_SET_CONTEXT_KEEP_IF_EXISTS) {
+            FltReleaseContext(NewContext);
+            if (OldContext) {
+                FltReferenceContext(existing);
+                *OldContext = existing;
+            }
+            return STATUS_FLT_CONTEXT_ALREADY_DEFINED;
+        }
+        if (InterlockedCompareExchangePointer(Slot, NewContext, existing) == existing) {
+            if (existing) {
+                if (OldContext) {
+                    *OldContext = existing;
+                }
+                else {
+                    FltReleaseContext(existing);
+                }
+            }
+            return STATUS_SUCCESS;
+        }
+    }
+}
+
+// The host never tears a context down while a callback runs, so a plain reference under the read is enough
+static NTSTATUS
+GetContext(PVOID volatile* Slot, PFLT_CONTEXT* Context)
+{
+    PVOID context = ReadPointerAcquire(Slot);
+    if (!context) {
+        return STATUS_NOT_FOUND;
+    }
+    FltReferenceContext(context);
+    *Context = context;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+FltGetStreamHandleContext(PFLT_INSTANCE Instance, PFILE_OBJECT FileObject, PFLT_CONTEXT* Context)
+{
+    UNREFERENCED_PARAMETER(Instance);
+    return GetContext(&FileObject->StreamHandleContext, Context);
+}
+
+NTSTATUS
+FltSetStreamHandleContext(PFLT_INSTANCE Instance, PFILE_OBJECT FileObject, FLT_SET_CONTEXT_OPERATION Operation,
+    PFLT_CONTEXT NewContext, PFLT_CONTEXT* OldContext)
+{
+    UNREFERENCED_PARAMETER(Instance);
+    return SetContext(&FileObject->StreamHandleContext, Operation, NewContext, OldContext);
+}
+
+NTSTATUS
+FltGetInstanceContext(PFLT_INSTANCE Instance, PFLT_CONTEXT* Context)
+{
+    return GetContext(&Instance->InstanceContext, Context);
+}
+
+NTSTATUS
+FltSetInstanceContext(PFLT_INSTANCE Instance, FLT_SET_CONTEXT_OPERATION Operation, PFLT_CONTEXT NewContext,
+    PFLT_CONTEXT* OldContext)
+{
+    return SetContext(&Instance->InstanceContext, Operation, NewContext, OldContext);
+}
+
+NTSTATUS
+FltGetVolumeName(PFLT_VOLUME Volume, PUNICODE_STRING VolumeName, PULONG BufferSizeNeeded)
+{
+    if (BufferSizeNeeded) {
+        *BufferSizeNeeded = Volume->Name.Length;
+    }
+    if (VolumeName->MaximumLength < Volume->Name.Length) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    RtlCopyUnicodeString(VolumeName, &Volume->Name);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+FltGetFileNameInformation(PFLT_CALLBACK_DATA CallbackData, FLT_FILE_NAME_OPTIONS NameOptions,
+    PFLT_FILE_NAME_INFORMATION* FileNameInformation)
+{
+    UNREFERENCED_PARAMETER(NameOptions);
+    LONG failures = ReadAcquire(&NameQueryFailures);
+    while (failures > 0) {
+        if (InterlockedCompareExchange(&NameQueryFailures, failures - 1, failures) == failures) {
+            return NameQueryStatus;
+        }
+        failures = ReadAcquire(&NameQueryFailures);
+    }
+
+    PFILE_OBJECT fileObject = CallbackData->Iopb->TargetFileObject;
+    PCUNICODE_STRING name = fileObject->File ? &fileObject->File->Name : &fileObject->FileName;
+    PFLT_FILE_NAME_INFORMATION nameInfo = ExAllocatePool2(POOL_FLAG_PAGED,
+        sizeof(FLT_FILE_NAME_INFORMATION) + name->Length + sizeof(WCHAR), 'nFtH');
+    if (!nameInfo) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    nameInfo->Size = sizeof(FLT_FILE_NAME_INFORMATION);
+    nameInfo->Format = FLT_FILE_NAME_OPENED;
+    nameInfo->Name.Buffer = (PWCH)(nameInfo + 1);
+    nameInfo->Name.MaximumLength = name->Length + sizeof(WCHAR);
+    RtlCopyUnicodeString(&nameInfo->Name, name);
+    *FileNameInformation = nameInfo;
+    return STATUS_SUCCESS;
+}
+
+VOID
+FltReleaseFileNameInformation(PFLT_FILE_NAME_INFORMATION FileNameInformation)
+{
+    ExFreePool(FileNameInformation);
+}
+
+VOID
+HostCloseFileObject(PFILE_OBJECT FileObject)
+{
+    PVOID context = InterlockedExchangePointer(&FileObject->StreamHandleContext, NULL);
+    if (context) {
+        FltReleaseContext(context);
+    }
+}
+
+VOID
+HostTeardownInstance(PFLT_INSTANCE Instance)
+{
+    PVOID context = InterlockedExchangePointer(&Instance->InstanceContext, NULL);
+    if (context) {
+        FltReleaseContext(context);
+    }
+}
+
+VOID
+HostFailNameQueries(ULONG Count, NTSTATUS Status)
+{
+    NameQueryStatus = Status;
+    WriteRelease(&NameQueryFailures, (LONG)Count);
+}
@@ -0,0 +1,607 @@
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "fltKernel.h"
+
+
+// Strings
+
+VOID
+RtlInitUnicodeString(PUNICODE_STRING Destination, PCWSTR Source)
+{
+    SIZE_T length = 0;
+    while (Source && Source[length]) {
+        length++;
+    }
+    Destination->Buffer = (PWCH)Source;
+    Destination->Length = (USHORT)(length * sizeof(WCHAR));
+    Destination->MaximumLength = Source ? (USHORT)(Destination->Length + sizeof(WCHAR)) : 0;
+}
+
+VOID
+RtlCopyUnicodeString(PUNICODE_STRING Destination, PCUNICODE_STRING Source)
+{
+    USHORT length = Source ? min(Source->Length, Destination->MaximumLength) : 0;
+    if (length) {
+        memmove(Destination->Buffer, Source->Buffer, length);
+    }
+    Destination->Length = length;
+    if (length + sizeof(WCHAR) <= Destination->MaximumLength) {
+        Destination->Buffer[length / sizeof(WCHAR)] = L'\0';
+    }
+}
+
+WCHAR
+RtlUpcaseUnicodeChar(WCHAR SourceCharacter)
+{
+    if (SourceCharacter >= L'a' && SourceCharacter <= L'z') {
+        return SourceCharacter - (L'a' - L'A');
+    }
+    if (SourceCharacter >= 0xE0 && SourceCharacter <= 0xFE && SourceCharacter != 0xF7) {
+        return SourceCharacter - 0x20;
+    }
+    if (SourceCharacter == 0xFF) {
+        return 0x178;
+    }
+    return SourceCharacter;
+}
+
+BOOLEAN
+RtlEqualUnicodeString(PCUNICODE_STRING String1, PCUNICODE_STRING String2, BOOLEAN CaseInSensitive)
+{
+    if (String1->Length != String2->Length) {
+        return FALSE;
+    }
+    for (USHORT i = 0; i < String1->Length / sizeof(WCHAR); i++) {
+        WCHAR left = String1->Buffer[i];
+        WCHAR right = String2->Buffer[i];
+        if (CaseInSensitive) {
+            left = RtlUpcaseUnicodeChar(left);
+            right = RtlUpcaseUnicodeChar(right);
+        }
+        if (left != right) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+NTSTATUS
+RtlUpcaseUnicodeString(PUNICODE_STRING Destination, PCUNICODE_STRING Source, BOOLEAN AllocateDestination)
+{
+    if (AllocateDestination) {
+        Destination->Buffer = ExAllocatePool2(POOL_FLAG_PAGED, Source->Length + sizeof(WCHAR), 'rtSU');
+        if (!Destination->Buffer) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        Destination->MaximumLength = Source->Length;
+    }
+    else if (Destination->MaximumLength < Source->Length) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    for (USHORT i = 0; i < Source->Length / sizeof(WCHAR); i++) {
+        Destination->Buffer[i] = RtlUpcaseUnicodeChar(Source->Buffer[i]);
+    }
+    Destination->Length = Source->Length;
+    return STATUS_SUCCESS;
+}
+
+VOID
+RtlFreeUnicodeString(PUNICODE_STRING String)
+{
+    if (String->Buffer) {
+        ExFreePool(String->Buffer);
+        String->Buffer = NULL;
+    }
+    String->Length = String->MaximumLength = 0;
+}
+
+ULONG
+DbgPrint(PCSTR Format, ...)
+{
+    // Quiet unless asked for, so test and benchmark output stays readable
+    static int enabled = -1;
+    if (enabled < 0) {
+        enabled = getenv("HOST_DBGPRINT") != NULL;
+    }
+    if (enabled) {
+        va_list args;
+        va_start(args, Format);
+        vfprintf(stderr, Format, args);
+        va_end(args);
+    }
+    return 0;
+}
+
+// Pool
+
+PVOID
+ExAllocatePool2(POOL_FLAGS Flags, SIZE_T NumberOfBytes, ULONG Tag)
+{
+    PVOID block = NULL;
+    SIZE_T alignment = NumberOfBytes >= PAGE_SIZE ? PAGE_SIZE
+        : (Flags & POOL_FLAG_CACHE_ALIGNED) ? SYSTEM_CACHE_ALIGNMENT_SIZE : MEMORY_ALLOCATION_ALIGNMENT;
+
+    UNREFERENCED_PARAMETER(Tag);
+    if (posix_memalign(&block, alignment, max(NumberOfBytes, (SIZE_T)1)) != 0) {
+        return NULL;
+    }
+    if (!(Flags & POOL_FLAG_UNINITIALIZED)) {
+        memset(block, 0, NumberOfBytes);
+    }
+    return block;
+}
+
+// Freed blocks are poisoned, so a reader that outlives its grace period trips over garbage instead of stale data
+VOID
+ExFreePool(PVOID P)
+{
+    if (P) {
+        memset(P, 0xDD, malloc_usable_size(P));
+        free(P);
+    }
+}
+
+VOID
+ExFreePoolWithTag(PVOID P, ULONG Tag)
+{
+    UNREFERENCED_PARAMETER(Tag);
+    ExFreePool(P);
+}
+
+NTSTATUS
+ExInitializeLookasideListEx(PLOOKASIDE_LIST_EX Lookaside, PVOID Allocate, PVOID Free, POOL_TYPE PoolType,
+    ULONG Flags, SIZE_T Size, ULONG Tag, USHORT Depth)
+{
+    UNREFERENCED_PARAMETER(Allocate);
+    UNREFERENCED_PARAMETER(Free);
+    UNREFERENCED_PARAMETER(PoolType);
+    UNREFERENCED_PARAMETER(Flags);
+    UNREFERENCED_PARAMETER(Depth);
+    Lookaside->Size = Size;
+    Lookaside->Tag = Tag;
+    Lookaside->Active = TRUE;
+    return STATUS_SUCCESS;
+}
+
+VOID
+ExDeleteLookasideListEx(PLOOKASIDE_LIST_EX Lookaside)
+{
+    if (!Lookaside->Active) {
+        fprintf(stderr, "wdkShim: lookaside list deleted twice\n");
+        abort();
+    }
+    Lookaside->Active = FALSE;
+}
+
+PVOID
+ExAllocateFromLookasideListEx(PLOOKASIDE_LIST_EX Lookaside)
+{
+    if (!Lookaside->Active) {
+        fprintf(stderr, "wdkShim: allocation from a deleted lookaside list\n");
+        abort();
+    }
+    return ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, Lookaside->Size, Lookaside->Tag);
+}
+
+VOID
+ExFreeToLookasideListEx(PLOOKASIDE_LIST_EX Lookaside, PVOID Entry)
+{
+    UNREFERENCED_PARAMETER(Lookaside);
+    ExFreePool(Entry);
+}
+
+// Locks
+
+KIRQL
+KeGetCurrentIrql(VOID)
+{
+    return PASSIVE_LEVEL;
+}
+
+VOID
+KeInitializeSpinLock(PKSPIN_LOCK SpinLock)
+{
+    *SpinLock = 0;
+}
+
+VOID
+KeAcquireSpinLockRaw(PKSPIN_LOCK SpinLock)
+{
+    while (__atomic_exchange_n(SpinLock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(SpinLock, __ATOMIC_RELAXED)) {
+            // The holder may be preempted on the host, unlike at DISPATCH_LEVEL
+            sched_yield();
+        }
+    }
+}
+
+VOID
+KeReleaseSpinLockRaw(PKSPIN_LOCK SpinLock)
+{
+    __atomic_store_n(SpinLock, 0, __ATOMIC_RELEASE);
+}
+
+KIRQL
+ExAcquireSpinLockShared(PEX_SPIN_LOCK SpinLock)
+{
+    for (;;) {
+        LONG value = __atomic_load_n(SpinLock, __ATOMIC_RELAXED);
+        if (!(value & 1) && __atomic_compare_exchange_n(SpinLock, &value, value + 2, FALSE,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return PASSIVE_LEVEL;
+        }
+        sched_yield();
+    }
+}
+
+VOID
+ExReleaseSpinLockShared(PEX_SPIN_LOCK SpinLock, KIRQL OldIrql)
+{
+    UNREFERENCED_PARAMETER(OldIrql);
+    __atomic_sub_fetch(SpinLock, 2, __ATOMIC_RELEASE);
+}
+
+KIRQL
+ExAcquireSpinLockExclusive(PEX_SPIN_LOCK SpinLock)
+{
+    // Claim the lock first so no new reader gets in, then wait for the readers inside to leave
+    for (;;) {
+        LONG value = __atomic_load_n(SpinLock, __ATOMIC_RELAXED);
+        if (!(value & 1) && __atomic_compare_exchange_n(SpinLock, &value, value | 1, FALSE,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+        sched_yield();
+    }
+    while (__atomic_load_n(SpinLock, __ATOMIC_ACQUIRE) != 1) {
+        sched_yield();
+    }
+    return PASSIVE_LEVEL;
+}
+
+VOID
+ExReleaseSpinLockExclusive(PEX_SPIN_LOCK SpinLock, KIRQL OldIrql)
+{
+    UNREFERENCED_PARAMETER(OldIrql);
+    __atomic_store_n(SpinLock, 0, __ATOMIC_RELEASE);
+}
+
+VOID
+ExInitializeFastMutex(PFAST_MUTEX FastMutex)
+{
+    pthread_mutex_init(&FastMutex->Mutex, NULL);
+}
+
+VOID
+ExAcquireFastMutex(PFAST_MUTEX FastMutex)
+{
+    pthread_mutex_lock(&FastMutex->Mutex);
+}
+
+VOID
+ExReleaseFastMutex(PFAST_MUTEX FastMutex)
+{
+    pthread_mutex_unlock(&FastMutex->Mutex);
+}
+
+// Rundown references: each holder adds 2, bit 0 says a wait began and no new holder is admitted
+
+PEX_RUNDOWN_REF_CACHE_AWARE
+ExAllocateCacheAwareRundownProtection(POOL_TYPE PoolType, ULONG PoolTag)
+{
+    UNREFERENCED_PARAMETER(PoolType);
+    return ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED, sizeof(EX_RUNDOWN_REF_CACHE_AWARE), PoolTag);
+}
+
+VOID
+ExFreeCacheAwareRundownProtection(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware)
+{
+    // Left refusing acquires, so a use after free is more likely to fail loudly than to pass
+    RunRefCacheAware->Count = 1;
+    ExFreePool(RunRefCacheAware);
+}
+
+BOOLEAN
+ExAcquireRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware)
+{
+    LONG64 value = __atomic_load_n(&RunRefCacheAware->Count, __ATOMIC_RELAXED);
+    while (!(value & 1)) {
+        if (__atomic_compare_exchange_n(&RunRefCacheAware->Count, &value, value + 2, FALSE,
+            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+VOID
+ExReleaseRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware)
+{
+    if (__atomic_sub_fetch(&RunRefCacheAware->Count, 2, __ATOMIC_SEQ_CST) < 0) {
+        fprintf(stderr, "wdkShim: rundown reference released more often than acquired\n");
+        abort();
+    }
+}
+
+VOID
+ExWaitForRundownProtectionReleaseCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware)
+{
+    __atomic_fetch_or(&RunRefCacheAware->Count, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&RunRefCacheAware->Count, __ATOMIC_SEQ_CST) != 1) {
+        sched_yield();
+    }
+}
+
+VOID
+ExReInitializeRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware)
+{
+    __atomic_store_n(&RunRefCacheAware->Count, 0, __ATOMIC_SEQ_CST);
+}
+
+// Processors and clocks
+
+static __thread ULONG PinnedProcessor = MAXULONG;
+
+ULONG
+KeQueryMaximumProcessorCountEx(USHORT GroupNumber)
+{
+    UNREFERENCED_PARAMETER(GroupNumber);
+    long count = sysconf(_SC_NPROCESSORS_CONF);
+    return count > 0 ? (ULONG)count : 1;
+}
+
+ULONG
+KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber)
+{
+    ULONG number = PinnedProcessor;
+    if (number == MAXULONG) {
+        int cpu = sched_getcpu();
+        number = cpu >= 0 ? (ULONG)cpu : 0;
+    }
+    if (ProcNumber) {
+        ProcNumber->Group = 0;
+        ProcNumber->Number = (UCHAR)number;
+        ProcNumber->Reserved = 0;
+    }
+    return number;
+}
+
+VOID
+HostSetProcessor(ULONG Number)
+{
+    PinnedProcessor = Number;
+}
+
+static LONG64
+ClockNanoseconds(clockid_t Clock)
+{
+    struct timespec now;
+    clock_gettime(Clock, &now);
+    return (LONG64)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+LARGE_INTEGER
+KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency)
+{
+    LARGE_INTEGER counter;
+    if (PerformanceFrequency) {
+        PerformanceFrequency->QuadPart = 1000000000;
+    }
+    counter.QuadPart = ClockNanoseconds(CLOCK_MONOTONIC);
+    return counter;
+}
+
+VOID
+KeQuerySystemTime(PLARGE_INTEGER CurrentTime)
+{
+    // 100ns units since 1601, like the kernel's system time
+    CurrentTime->QuadPart = ClockNanoseconds(CLOCK_REALTIME) / 100 + 116444736000000000LL;
+}
+
+ULONG64
+KeQueryInterruptTime(VOID)
+{
+    return (ULONG64)ClockNanoseconds(CLOCK_MONOTONIC) / 100;
+}
+
+ULONG64
+KeQueryInterruptTimePrecise(PULONG64 QpcTimeStamp)
+{
+    LONG64 now = ClockNanoseconds(CLOCK_MONOTONIC);
+    if (QpcTimeStamp) {
+        *QpcTimeStamp = (ULONG64)now;
+    }
+    return (ULONG64)now / 100;
+}
+
+// Processes
+
+static EPROCESS SystemProcess = { ULongToHandle(4), 0, { 0, 0, NULL } };
+static __thread PEPROCESS CurrentProcess;
+static PCREATE_PROCESS_NOTIFY_ROUTINE volatile ProcessNotifyRoutine;
+
+PEPROCESS
+PsGetCurrentProcess(VOID)
+{
+    return CurrentProcess ? CurrentProcess : &SystemProcess;
+}
+
+HANDLE
+PsGetProcessId(PEPROCESS Process)
+{
+    return Process->ProcessId;
+}
+
+LONG64
+PsGetProcessCreateTimeQuadPart(PEPROCESS Process)
+{
+    return Process->CreateTime;
+}
+
+static volatile LONG64 ImageNameQueries;
+
+NTSTATUS
+SeLocateProcessImageName(PEPROCESS Process, PUNICODE_STRING* ImageFileName)
+{
+    InterlockedIncrement64(&ImageNameQueries);
+
+    // One allocation for the string and its buffer, which the caller frees with ExFreePool
+    PUNICODE_STRING name = ExAllocatePool2(POOL_FLAG_PAGED, sizeof(UNICODE_STRING) + Process->ImageName.Length,
+        'nPtH');
+    if (!name) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    name->Buffer = (PWCH)(name + 1);
+    name->Length = 0;
+    name->MaximumLength = Process->ImageName.Length;
+    RtlCopyUnicodeString(name, &Process->ImageName);
+    *ImageFileName = name;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+PsSetCreateProcessNotifyRoutine(PCREATE_PROCESS_NOTIFY_ROUTINE NotifyRoutine, BOOLEAN Remove)
+{
+    if (Remove) {
+        return InterlockedCompareExchangePointer((PVOID volatile*)&ProcessNotifyRoutine, NULL, (PVOID)NotifyRoutine)
+            == (PVOID)NotifyRoutine ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+    }
+    return InterlockedCompareExchangePointer((PVOID volatile*)&ProcessNotifyRoutine, (PVOID)NotifyRoutine, NULL)
+        == NULL ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+}
+
+VOID
+HostSetCurrentProcess(PEPROCESS Process)
+{
+    CurrentProcess = Process;
+}
+
+LONG64
+HostImageNameQueries(VOID)
+{
+    return ReadAcquire64(&ImageNameQueries);
+}
+
+VOID
+HostExitProcess(PEPROCESS Process)
+{
+    PCREATE_PROCESS_NOTIFY_ROUTINE routine = (PCREATE_PROCESS_NOTIFY_ROUTINE)ReadPointerAcquire(
+        (PVOID volatile*)&ProcessNotifyRoutine);
+    if (routine) {
+        routine(NULL, Process->ProcessId, FALSE);
+    }
+}
+
+// Memory descriptor lists
+
+PMDL
+IoAllocateMdl(PVOID VirtualAddress, ULONG Length, BOOLEAN SecondaryBuffer, BOOLEAN ChargeQuota, PVOID Irp)
+{
+    UNREFERENCED_PARAMETER(SecondaryBuffer);
+    UNREFERENCED_PARAMETER(ChargeQuota);
+    UNREFERENCED_PARAMETER(Irp);
+    PMDL mdl = ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(MDL), 'ldM');
+    if (mdl) {
+        mdl->StartVa = VirtualAddress;
+        mdl->ByteCount = Length;
+        mdl->PagesFd = -1;
+    }
+    return mdl;
+}
+
+VOID
+IoFreeMdl(PMDL Mdl)
+{
+    ExFreePool(Mdl);
+}
+
+VOID
+MmBuildMdlForNonPagedPool(PMDL MemoryDescriptorList)
+{
+    UNREFERENCED_PARAMETER(MemoryDescriptorList);
+}
+
+// Pages are zeroed unless MM_DONT_ZERO_ALLOCATION is given, and a memory file always starts out zeroed
+PMDL
+MmAllocatePagesForMdlEx(PHYSICAL_ADDRESS LowAddress, PHYSICAL_ADDRESS HighAddress, PHYSICAL_ADDRESS SkipBytes,
+    SIZE_T TotalBytes, MEMORY_CACHING_TYPE CacheType, ULONG Flags)
+{
+    UNREFERENCED_PARAMETER(LowAddress);
+    UNREFERENCED_PARAMETER(HighAddress);
+    UNREFERENCED_PARAMETER(SkipBytes);
+    UNREFERENCED_PARAMETER(CacheType);
+    UNREFERENCED_PARAMETER(Flags);
+
+    SIZE_T size = (TotalBytes + PAGE_SIZE - 1) & ~(SIZE_T)(PAGE_SIZE - 1);
+    if (!size || size > MAXULONG) {
+        return NULL;
+    }
+
+    PMDL mdl = IoAllocateMdl(NULL, (ULONG)size, FALSE, FALSE, NULL);
+    if (!mdl) {
+        return NULL;
+    }
+    mdl->PagesFd = memfd_create("mdl", MFD_CLOEXEC);
+    if (mdl->PagesFd < 0 || ftruncate(mdl->PagesFd, (off_t)size) != 0) {
+        if (mdl->PagesFd >= 0) {
+            close(mdl->PagesFd);
+        }
+        IoFreeMdl(mdl);
+        return NULL;
+    }
+    return mdl;
+}
+
+VOID
+MmFreePagesFromMdl(PMDL MemoryDescriptorList)
+{
+    close(MemoryDescriptorList->PagesFd);
+    MemoryDescriptorList->PagesFd = -1;
+}
+
+PVOID
+MmMapLockedPagesSpecifyCache(PMDL MemoryDescriptorList, KPROCESSOR_MODE AccessMode, MEMORY_CACHING_TYPE CacheType,
+    PVOID RequestedAddress, ULONG BugCheckOnFailure, ULONG Priority)
+{
+    UNREFERENCED_PARAMETER(AccessMode);
+    UNREFERENCED_PARAMETER(CacheType);
+    UNREFERENCED_PARAMETER(RequestedAddress);
+    UNREFERENCED_PARAMETER(BugCheckOnFailure);
+
+    if (MemoryDescriptorList->PagesFd < 0) {
+        return MemoryDescriptorList->StartVa;
+    }
+
+    // A view without write access faults on a write, as the consumer's read-only mapping does
+    int protection = (Priority & MdlMappingNoWrite) ? PROT_READ : PROT_READ | PROT_WRITE;
+    PVOID address = mmap(NULL, MemoryDescriptorList->ByteCount, protection, MAP_SHARED, MemoryDescriptorList->PagesFd, 0);
+    return address == MAP_FAILED ? NULL : address;
+}
+
+PVOID
+MmGetSystemAddressForMdlSafe(PMDL Mdl, ULONG Priority)
+{
+    if (!Mdl->MappedSystemVa) {
+        Mdl->MappedSystemVa = MmMapLockedPagesSpecifyCache(Mdl, KernelMode, MmCached, NULL, FALSE, Priority);
+    }
+    return Mdl->MappedSystemVa;
+}
+
+VOID
+MmUnmapLockedPages(PVOID BaseAddress, PMDL MemoryDescriptorList)
+{
+    if (MemoryDescriptorList->PagesFd >= 0) {
+        munmap(BaseAddress, MemoryDescriptorList->ByteCount);
+        if (BaseAddress == MemoryDescriptorList->MappedSystemVa) {
+            MemoryDescriptorList->MappedSystemVa = NULL;
+        }
+    }
+}
@@ -0,0 +1,100 @@
+#include <fltKernel.h>
+#include <dontuse.h>
+#include "blockPool.h"
+
+
+// Block sizes of the classes, multiples of MEMORY_ALLOCATION_ALIGNMENT about an eighth apart, so rounding wastes
+// little of a block
+static const USHORT ClassSizes[BLOCK_POOL_CLASS_COUNT] = {
+    64, 96, 128, 160, 192, 224, 256, 320, 384, 448, 512, 640, 768, 896, BLOCK_POOL_MAX_BLOCK
+};
+
+// Index of the smallest class holding Size bytes, or BLOCK_POOL_CLASS_COUNT for a block served by the pool
+static ULONG
+ClassOf(SIZE_T Size)
+{
+    ULONG index = 0;
+    while (index < BLOCK_POOL_CLASS_COUNT && ClassSizes[index] < Size) {
+        index++;
+    }
+    return index;
+}
+
+static SIZE_T
+BlockSize(SIZE_T Size)
+{
+    ULONG index = ClassOf(Size);
+    return index < BLOCK_POOL_CLASS_COUNT ? ClassSizes[index] : Size;
+}
+
+NTSTATUS
+BlockPoolInitialize(PBLOCK_POOL Pool, ULONG Tag)
+{
+    RtlZeroMemory(Pool, sizeof(BLOCK_POOL));
+    Pool->Tag = Tag;
+
+    for (ULONG i = 0; i < BLOCK_POOL_CLASS_COUNT; i++) {
+        NTSTATUS status = ExInitializeLookasideListEx(&Pool->Classes[i], NULL, NULL, NonPagedPoolNx, 0,
+            ClassSizes[i], Tag, 0);
+        if (!NT_SUCCESS(status)) {
+            while (i-- > 0) {
+                ExDeleteLookasideListEx(&Pool->Classes[i]);
+            }
+            return status;
+        }
+    }
+    Pool->Initialized = TRUE;
+    return STATUS_SUCCESS;
+}
+
+VOID
+BlockPoolDelete(PBLOCK_POOL Pool)
+{
+    if (!Pool->Initialized) {
+        return;
+    }
+    for (ULONG i = 0; i < BLOCK_POOL_CLASS_COUNT; i++) {
+        ExDeleteLookasideListEx(&Pool->Classes[i]);
+    }
+    Pool->Initialized = FALSE;
+}
+
+PVOID
+BlockPoolAllocate(PBLOCK_POOL Pool, SIZE_T Size)
+{
+    ULONG index = ClassOf(Size);
+    PVOID block = index < BLOCK_POOL_CLASS_COUNT
+        ? ExAllocateFromLookasideListEx(&Pool->Classes[index])
+        : ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, Size, Pool->Tag);
+    if (block) {
+        InterlockedIncrement64(&Pool->Blocks);
+        InterlockedAdd64(&Pool->Bytes, (LONG64)BlockSize(Size));
+        InterlockedAdd64(&Pool->UsedBytes, (LONG64)Size);
+    }
+    return block;
+}
+
+VOID
+BlockPoolFree(PBLOCK_POOL Pool, PVOID Block, SIZE_T Size)
+{
+    ULONG index = ClassOf(Size);
+    if (index < BLOCK_POOL_CLASS_COUNT) {
+        ExFreeToLookasideListEx(&Pool->Classes[index], Block);
+    }
+    else {
+        ExFreePoolWithTag(Block, Pool->Tag);
+    }
+    InterlockedDecrement64(&Pool->Blocks);
+    InterlockedAdd64(&Pool->Bytes, -(LONG64)BlockSize(Size));
+    InterlockedAdd64(&Pool->UsedBytes, -(LONG64)Size);
+}
+
+VOID
+BlockPoolQueryUsage(PBLOCK_POOL Pool, PMEMORY_USAGE Usage)
+{
+    RtlZeroMemory(Usage, sizeof(MEMORY_USAGE));
+    Usage->Tag = Pool->Tag;
+    Usage->Count = (ULONG64)ReadNoFence64(&Pool->Blocks);
+    Usage->Bytes = (ULONG64)ReadNoFence64(&Pool->Bytes);
+    Usage->UsedBytes = (ULONG64)ReadNoFence64(&Pool->UsedBytes);
+}
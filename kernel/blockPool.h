@@ -0,0 +1,78 @@
+#pragma once
+#include <fltKernel.h>
+#include <dontuse.h>
+#include "memoryUsage.h"
+
+/**
+ * @def BLOCK_POOL_CLASS_COUNT
+ * @brief Number of block sizes a pool serves from lookaside lists, from 64 to BLOCK_POOL_MAX_BLOCK bytes.
+ */
+#define BLOCK_POOL_CLASS_COUNT 15
+
+/**
+ * @def BLOCK_POOL_MAX_BLOCK
+ * @brief Largest block served from a lookaside list; larger blocks come straight from the pool.
+ */
+#define BLOCK_POOL_MAX_BLOCK 1024
+
+/**
+ * @struct _BLOCK_POOL
+ * @brief Variable-size nonpaged blocks, served from one lookaside list per size class.
+ *
+ * A block is rounded up to the smallest class that holds it, so blocks of similar sizes share a list, freed
+ * blocks are reused without a trip to the pool, and each object takes one allocation instead of one per part.
+ * The caller passes the size of a block back when freeing it. Safe to use at IRQL <= DISPATCH_LEVEL, from any
+ * number of threads.
+ */
+typedef struct _BLOCK_POOL {
+    LOOKASIDE_LIST_EX Classes[BLOCK_POOL_CLASS_COUNT]; ///< One list per size class.
+    ULONG Tag;                                         ///< Pool tag of every block.
+    BOOLEAN Initialized;                               ///< The lists exist and must be deleted.
+    volatile LONG64 Blocks;                            ///< Blocks handed out and not freed yet.
+    volatile LONG64 Bytes;                             ///< Bytes of those blocks, rounded to their class.
+    volatile LONG64 UsedBytes;                         ///< Bytes of those blocks, as requested.
+} BLOCK_POOL, *PBLOCK_POOL;
+
+/**
+ * @brief Creates the lookaside lists of a pool. Must be called at PASSIVE_LEVEL.
+ *
+ * @param[out] Pool The pool, in nonpaged memory.
+ * @param[in] Tag Pool tag of the blocks.
+ * @return NTSTATUS STATUS_SUCCESS, or the failure of ExInitializeLookasideListEx.
+ */
+NTSTATUS BlockPoolInitialize(PBLOCK_POOL Pool, ULONG Tag);
+
+/**
+ * @brief Deletes the lookaside lists of a pool, returning their cached blocks to the system.
+ *
+ * Every block must have been freed. Does nothing if the pool is not initialized, so it may be called twice.
+ *
+ * @param[in,out] Pool The pool.
+ */
+VOID BlockPoolDelete(PBLOCK_POOL Pool);
+
+/**
+ * @brief Allocates a nonpaged block of at least Size bytes. The block is not zeroed.
+ *
+ * @param[in,out] Pool The pool.
+ * @param[in] Size Bytes needed.
+ * @return PVOID The block, aligned to MEMORY_ALLOCATION_ALIGNMENT, or NULL if memory ran out.
+ */
+PVOID BlockPoolAllocate(PBLOCK_POOL Pool, SIZE_T Size);
+
+/**
+ * @brief Frees a block of the pool.
+ *
+ * @param[in,out] Pool The pool the block came from.
+ * @param[in] Block The block.
+ * @param[in] Size The size it was allocated with.
+ */
+VOID BlockPoolFree(PBLOCK_POOL Pool, PVOID Block, SIZE_T Size);
+
+/**
+ * @brief Reports the blocks a pool has handed out.
+ *
+ * @param[in] Pool The pool.
+ * @param[out] Usage Receives the tag, the block count and their bytes.
+ */
+VOID BlockPoolQueryUsage(PBLOCK_POOL Pool, PMEMORY_USAGE Usage);
@@ -0,0 +1,320 @@
+#include <fltKernel.h>
+#include <dontuse.h>
+#include "callbacks.h"
+#include "fileList.h"
+#include "userApi.h"
+#include "decisionCache.h"
+#include "processCache.h"
+#include "perfStats.h"
+#include "debug.h"
+
+
+extern TRACKED_FILES TrackedFiles;
+
+// Names of the RULE_OP_* operations in the log; a denied operation gets the _DENIED suffix
+static const PCSTR OperationNames[RULE_OP_COUNT] = { "DELETE", "RENAME", "OVERWRITE", "DELETE_ON_CLOSE" };
+
+// Operations a tracked create logs once it completes
+#define CREATE_LOG_OVERWRITE        0x1
+#define CREATE_LOG_DELETE_ON_CLOSE  0x2
+
+// Completion context of a tracked create, from CreateContexts
+typedef struct _CREATE_CONTEXT {
+    PFLT_FILE_NAME_INFORMATION NameInfo;    // Released by the post-create callback
+    ULONG Log;                              // CREATE_LOG_* bits
+} CREATE_CONTEXT, * PCREATE_CONTEXT;
+
+static LOOKASIDE_LIST_EX CreateContexts;
+
+NTSTATUS
+InitializeCallbacks()
+{
+    return ExInitializeLookasideListEx(&CreateContexts, NULL, NULL, NonPagedPoolNx, 0, sizeof(CREATE_CONTEXT),
+        'xCtL', 0);
+}
+
+VOID
+CleanupCallbacks()
+{
+    ExDeleteLookasideListEx(&CreateContexts);
+}
+
+static VOID 
+LogOperation(PUNICODE_STRING name, LONG operation, BOOLEAN denied) {
+    PEPROCESS process = PsGetCurrentProcess();
+    PPROCESS_NAME_ENTRY processEntry = LookupProcessName(process);
+    UNICODE_STRING defaultProcessName;
+    PUNICODE_STRING processName = &defaultProcessName;
+
+    if (processEntry) {
+        processName = &processEntry->Name;
+    }
+    else {
+        RtlInitUnicodeString(&defaultProcessName, L"Unknown Process");
+    }
+
+    // The message is timestamped as it is queued; the consumer formats the time
+    SendToUser(processName, PsGetProcessId(process), PsGetProcessCreateTimeQuadPart(process), name, operation, denied);
+    // Log with process name, path, and operation
+    LOG("FileLogger: Operation=%s%s, Process=%wZ, Path=%wZ\n",
+        OperationNames[operation], denied ? "_DENIED" : "", processName, name);
+
+    if (processEntry) {
+        ReleaseProcessName(processEntry);
+    }
+}
+
+// Returns TRUE for a SetInformation call that marks the file for deletion
+static BOOLEAN
+IsDeleteRequest(PFLT_CALLBACK_DATA Data)
+{
+    PVOID infoBuffer = Data->Iopb->Parameters.SetFileInformation.InfoBuffer;
+    if (!infoBuffer) return FALSE;
+
+    switch (Data->Iopb->Parameters.SetFileInformation.FileInformationClass) {
+    case FileDispositionInformation:
+        return ((PFILE_DISPOSITION_INFORMATION)infoBuffer)->DeleteFile;
+    case FileDispositionInformationEx:
+        return (((PFILE_DISPOSITION_INFORMATION_EX)infoBuffer)->Flags & FILE_DISPOSITION_DELETE) != 0;
+    default:
+        return FALSE;
+    }
+}
+
+// The pre-operation callback decides everything; a tracked deletion or rename hands its name over as the
+// completion context, any other rename passes NULL so the cached verdicts can be dropped once it succeeds.
+static FLT_POSTOP_CALLBACK_STATUS
+PostSetInformation(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_opt_ PVOID CompletionContext,
+    _In_ FLT_POST_OPERATION_FLAGS Flags
+)
+{
+    PFLT_FILE_NAME_INFORMATION nameInfo = (PFLT_FILE_NAME_INFORMATION)CompletionContext;
+    BOOLEAN completed = NT_SUCCESS(Data->IoStatus.Status) && !FlagOn(Flags, FLTFL_POST_OPERATION_DRAINING);
+    FILE_INFORMATION_CLASS infoClass = Data->Iopb->Parameters.SetFileInformation.FileInformationClass;
+    BOOLEAN rename = infoClass == FileRenameInformation || infoClass == FileRenameInformationEx;
+
+    if (NT_SUCCESS(Data->IoStatus.Status) && rename) {
+        // Every handle to the file, or to any file below a renamed directory, now refers to a different name
+        InvalidateFileDecisions(FltObjects);
+    }
+    if (nameInfo) {
+        if (completed) {
+            LogOperation(&nameInfo->Name, rename ? RULE_OP_RENAME : RULE_OP_DELETE, FALSE);
+        }
+        FltReleaseFileNameInformation(nameInfo);
+    }
+    return FLT_POSTOP_FINISHED_PROCESSING;
+}
+
+static FLT_PREOP_CALLBACK_STATUS
+PreSetInformation(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Flt_CompletionContext_Outptr_ PVOID* CompletionContext
+) {
+    FILE_INFORMATION_CLASS infoClass = Data->Iopb->Parameters.SetFileInformation.FileInformationClass;
+    *CompletionContext = NULL;
+
+    // A single read of the summary tells whether any rule names the operation; if none does, the file name is
+    // not worth querying. A rename still needs its post-operation callback while any rule exists, for the
+    // verdicts cached on the handles of the files it moves.
+    LONG operations = GetTrackedOperations(&TrackedFiles);
+    BOOLEAN rename = infoClass == FileRenameInformation || infoClass == FileRenameInformationEx;
+    if (rename ? operations == 0 : (!(operations & RULE_OP_BITS(RULE_OP_DELETE)) || !IsDeleteRequest(Data))) {
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    // On a volume no rule can match, no handle holds a verdict worth invalidating and no file is tracked
+    if (!GetVolumeDecision(FltObjects)) {
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    // A rename is decided by the rule of the file's current name
+    LONG operation = rename ? RULE_OP_RENAME : RULE_OP_DELETE;
+    FLT_PREOP_CALLBACK_STATUS untracked = rename ? FLT_PREOP_SUCCESS_WITH_CALLBACK : FLT_PREOP_SUCCESS_NO_CALLBACK;
+    if (!(operations & RULE_OP_BITS(operation))) {
+        return untracked;
+    }
+    // A miss hands back the name it queried, which a fresh handle's deletion would otherwise query twice
+    PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
+    LONG rule = GetFileDecision(Data, FltObjects, &nameInfo);
+    if (!(rule & RULE_OP_BITS(operation))) {
+        if (nameInfo) {
+            FltReleaseFileNameInformation(nameInfo);
+        }
+        return untracked;
+    }
+
+    NTSTATUS status = nameInfo ? STATUS_SUCCESS : QueryOpenedName(Data, &nameInfo);
+
+    if (rule & RULE_DENY(operation)) {
+        if (NT_SUCCESS(status)) {
+            LogOperation(&nameInfo->Name, operation, TRUE);
+            FltReleaseFileNameInformation(nameInfo);
+        }
+        PerfCount(PERF_COUNTER_DENIED);
+        Data->IoStatus.Status = STATUS_ACCESS_DENIED;
+        Data->IoStatus.Information = 0;
+        return FLT_PREOP_COMPLETE;
+    }
+
+    if (!NT_SUCCESS(status)) {
+        return untracked;
+    }
+
+    // Released by the post-operation callback, which only has to check that the operation went through
+    *CompletionContext = nameInfo;
+    return FLT_PREOP_SUCCESS_WITH_CALLBACK;
+}
+
+// Logs the operations the pre-create callback found tracked, once the create shows they happened
+static FLT_POSTOP_CALLBACK_STATUS
+PostCreate(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_opt_ PVOID CompletionContext,
+    _In_ FLT_POST_OPERATION_FLAGS Flags
+)
+{
+    PCREATE_CONTEXT context = (PCREATE_CONTEXT)CompletionContext;
+    PFLT_FILE_NAME_INFORMATION nameInfo = context->NameInfo;
+    ULONG log = context->Log;
+    UNREFERENCED_PARAMETER(FltObjects);
+
+    ExFreeToLookasideListEx(&CreateContexts, context);
+
+    if (NT_SUCCESS(Data->IoStatus.Status) && !FlagOn(Flags, FLTFL_POST_OPERATION_DRAINING)) {
+        // An overwrite disposition that found no file created one instead
+        ULONG_PTR information = Data->IoStatus.Information;
+        if ((log & CREATE_LOG_OVERWRITE) && (information == FILE_OVERWRITTEN || information == FILE_SUPERSEDED)) {
+            LogOperation(&nameInfo->Name, RULE_OP_OVERWRITE, FALSE);
+        }
+        if (log & CREATE_LOG_DELETE_ON_CLOSE) {
+            LogOperation(&nameInfo->Name, RULE_OP_DELETE_ON_CLOSE, FALSE);
+        }
+    }
+    FltReleaseFileNameInformation(nameInfo);
+    return FLT_POSTOP_FINISHED_PROCESSING;
+}
+
+// Every create on the box comes through here, so the common case must cost no more than the read of the summary:
+// creates only matter to rules that name overwrites or FILE_DELETE_ON_CLOSE. The file is not open yet, so there
+// is no handle to cache a verdict on; the rules are consulted directly. Denial happens before the file system
+// runs, so an overwrite-if or supersede of a denied name is refused even if the file does not exist yet.
+static FLT_PREOP_CALLBACK_STATUS
+PreCreate(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Flt_CompletionContext_Outptr_ PVOID* CompletionContext
+)
+{
+    *CompletionContext = NULL;
+
+    LONG operations = GetTrackedOperations(&TrackedFiles);
+    if (!(operations & (RULE_OP_BITS(RULE_OP_OVERWRITE) | RULE_OP_BITS(RULE_OP_DELETE_ON_CLOSE)))) {
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    ULONG options = Data->Iopb->Parameters.Create.Options;
+    ULONG disposition = options >> 24;
+    LONG wanted = 0;
+    if (disposition == FILE_SUPERSEDE || disposition == FILE_OVERWRITE || disposition == FILE_OVERWRITE_IF) {
+        wanted |= RULE_OP_BITS(RULE_OP_OVERWRITE);
+    }
+    if (FlagOn(options, FILE_DELETE_ON_CLOSE)) {
+        wanted |= RULE_OP_BITS(RULE_OP_DELETE_ON_CLOSE);
+    }
+    wanted &= operations;
+    if (!wanted || FlagOn(Data->Iopb->OperationFlags, SL_OPEN_TARGET_DIRECTORY | SL_OPEN_PAGING_FILE)
+        || FlagOn(FltObjects->FileObject->Flags, FO_VOLUME_OPEN) || !GetVolumeDecision(FltObjects)) {
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
+    if (!NT_SUCCESS(QueryOpenedName(Data, &nameInfo))) {
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    LONG rule = LookupFileOperations(&nameInfo->Name) & wanted;
+    if (rule & (RULE_DENY(RULE_OP_OVERWRITE) | RULE_DENY(RULE_OP_DELETE_ON_CLOSE))) {
+        LogOperation(&nameInfo->Name,
+            (rule & RULE_DENY(RULE_OP_OVERWRITE)) ? RULE_OP_OVERWRITE : RULE_OP_DELETE_ON_CLOSE, TRUE);
+        FltReleaseFileNameInformation(nameInfo);
+        PerfCount(PERF_COUNTER_DENIED);
+        Data->IoStatus.Status = STATUS_ACCESS_DENIED;
+        Data->IoStatus.Information = 0;
+        return FLT_PREOP_COMPLETE;
+    }
+
+    ULONG log = ((rule & RULE_TRACK(RULE_OP_OVERWRITE)) ? CREATE_LOG_OVERWRITE : 0)
+        | ((rule & RULE_TRACK(RULE_OP_DELETE_ON_CLOSE)) ? CREATE_LOG_DELETE_ON_CLOSE : 0);
+    PCREATE_CONTEXT context = log ? (PCREATE_CONTEXT)ExAllocateFromLookasideListEx(&CreateContexts) : NULL;
+    if (!context) {
+        FltReleaseFileNameInformation(nameInfo);
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    // Freed by the post-create callback
+    context->NameInfo = nameInfo;
+    context->Log = log;
+    *CompletionContext = context;
+    return FLT_PREOP_SUCCESS_WITH_CALLBACK;
+}
+
+// The registered callbacks time the work of the ones above; the pre-operation histogram counts every callback seen
+FLT_PREOP_CALLBACK_STATUS
+PreCreateCallback(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Flt_CompletionContext_Outptr_ PVOID* CompletionContext
+)
+{
+    ULONG64 start = PerfTimestamp();
+    FLT_PREOP_CALLBACK_STATUS status = PreCreate(Data, FltObjects, CompletionContext);
+    PerfRecord(PERF_HISTOGRAM_PRE_OPERATION, start);
+    return status;
+}
+
+FLT_POSTOP_CALLBACK_STATUS
+PostCreateCallback(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_opt_ PVOID CompletionContext,
+    _In_ FLT_POST_OPERATION_FLAGS Flags
+)
+{
+    ULONG64 start = PerfTimestamp();
+    FLT_POSTOP_CALLBACK_STATUS status = PostCreate(Data, FltObjects, CompletionContext, Flags);
+    PerfRecord(PERF_HISTOGRAM_POST_OPERATION, start);
+    return status;
+}
+
+FLT_PREOP_CALLBACK_STATUS
+PreOperationCallback(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Flt_CompletionContext_Outptr_ PVOID* CompletionContext
+)
+{
+    ULONG64 start = PerfTimestamp();
+    FLT_PREOP_CALLBACK_STATUS status = PreSetInformation(Data, FltObjects, CompletionContext);
+    PerfRecord(PERF_HISTOGRAM_PRE_OPERATION, start);
+    return status;
+}
+
+FLT_POSTOP_CALLBACK_STATUS
+PostOperationCallback(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_opt_ PVOID CompletionContext,
+    _In_ FLT_POST_OPERATION_FLAGS Flags
+)
+{
+    ULONG64 start = PerfTimestamp();
+    FLT_POSTOP_CALLBACK_STATUS status = PostSetInformation(Data, FltObjects, CompletionContext, Flags);
+    PerfRecord(PERF_HISTOGRAM_POST_OPERATION, start);
+    return status;
+}
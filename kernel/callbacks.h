@@ -0,0 +1,46 @@
+#pragma once
+#include <fltKernel.h>
+#include <dontuse.h>
+
+/**
+ * @brief Sets up what the create callbacks allocate per operation.
+ *
+ * Must be called before the filter is registered.
+ *
+ * @return NTSTATUS STATUS_SUCCESS, or the failure of ExInitializeLookasideListEx.
+ */
+NTSTATUS InitializeCallbacks();
+
+/**
+ * @brief Frees what InitializeCallbacks set up.
+ *
+ * No callback may be running or follow, i.e. the filter is unregistered or was never registered.
+ */
+VOID CleanupCallbacks();
+
+/**
+ * @brief Pre-create callback: denies an overwrite or FILE_DELETE_ON_CLOSE create of a file whose rule denies it,
+ *        and asks for the post-create callback if the rule only audits it. Times itself.
+ */
+FLT_PREOP_CALLBACK_STATUS PreCreateCallback(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects,
+    PVOID* CompletionContext);
+
+/**
+ * @brief Post-create callback: logs the audited operations the create turned out to perform. Times itself.
+ */
+FLT_POSTOP_CALLBACK_STATUS PostCreateCallback(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects,
+    PVOID CompletionContext, FLT_POST_OPERATION_FLAGS Flags);
+
+/**
+ * @brief Pre-set-information callback: decides a deletion or rename by the file's rule, denying it or asking
+ *        for the post-operation callback to log it. Times itself.
+ */
+FLT_PREOP_CALLBACK_STATUS PreOperationCallback(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects,
+    PVOID* CompletionContext);
+
+/**
+ * @brief Post-set-information callback: logs an audited deletion or rename that succeeded, and drops the cached
+ *        verdicts after any rename. Times itself.
+ */
+FLT_POSTOP_CALLBACK_STATUS PostOperationCallback(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects,
+    PVOID CompletionContext, FLT_POST_OPERATION_FLAGS Flags);
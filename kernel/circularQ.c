@@ -1,82 +1,511 @@
 #include <ntddk.h>
 #include "circularQ.h"
- 
+
+#define ALIGN_RECORD(n) (((n) + QUEUE_RECORD_ALIGNMENT - 1) & ~(QUEUE_RECORD_ALIGNMENT - 1))
+
+// Most bytes of released space a producer zeroes ahead of its own reservation, bounding the time it holds the lock
+#define QUEUE_CLEAR_BATCH (64 * 1024)
+
+// Most bytes of records a consumer copies out per hold of the lock, which producers dropping the oldest also take
+#define QUEUE_DEQUEUE_BATCH (64 * 1024)
+
 // Initialize the circular queue
-NTSTATUS InitializeQueue(PCIRCULAR_QUEUE Queue, ULONG MessageSize, ULONG MaxMessages) {
+NTSTATUS InitializeQueue(PCIRCULAR_QUEUE Queue, ULONG Capacity) {
+    // Round down to a power of two so positions can be masked
+    while (Capacity & (Capacity - 1)) {
+        Capacity &= Capacity - 1;
+    }
+
     // Validate input parameters
-    if (MessageSize == 0 || MaxMessages == 0) {
+    if (Capacity < 4 * sizeof(QUEUE_RECORD_HEADER)) {
         return STATUS_INVALID_PARAMETER;
     }
 
-    // Allocate memory for the buffer
-    Queue->Buffer = (PUCHAR)ExAllocatePool2(POOL_FLAG_NON_PAGED, MessageSize * MaxMessages, 'cQ');
+    // Allocate memory for the buffer; it must start out zeroed so no stamp looks published
+    Queue->Buffer = (PUCHAR)ExAllocatePool2(POOL_FLAG_NON_PAGED, Capacity, 'cQ');
     if (!Queue->Buffer) {
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
     // Initialize queue metadata
     KeInitializeSpinLock(&Queue->Lock);
-    Queue->MessageSize = MessageSize;
-    Queue->MaxMessages = MaxMessages;
+    Queue->Capacity = Capacity;
+    Queue->Mask = Capacity - 1;
+    Queue->Head = 0;
+    Queue->Tail = 0;
+    Queue->Policy = QueueDropOldest;
+    Queue->Lost = 0;
+    Queue->Dropped = 0;
+    Queue->Overwritten = 0;
+    Queue->Cleared = 0;
+    Queue->Shared = NULL;
+    Queue->HeaderMdl = NULL;
+    Queue->DataMdl = NULL;
+
+    return STATUS_SUCCESS;
+}
+
+// Allocates zeroed pages that can be mapped into a process, and maps them into system space for the driver
+static PMDL AllocateSharedPages(ULONG Size, PVOID* SystemAddress) {
+    PHYSICAL_ADDRESS low;
+    PHYSICAL_ADDRESS high;
+    PHYSICAL_ADDRESS skip;
+
+    low.QuadPart = 0;
+    high.QuadPart = -1;
+    skip.QuadPart = 0;
+    PMDL mdl = MmAllocatePagesForMdlEx(low, high, skip, Size, MmCached, MM_ALLOCATE_FULLY_REQUIRED);
+    if (!mdl) {
+        return NULL;
+    }
+
+    *SystemAddress = MmGetMdlByteCount(mdl) == Size
+        ? MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute) : NULL;
+    if (!*SystemAddress) {
+        MmFreePagesFromMdl(mdl);
+        ExFreePool(mdl);
+        return NULL;
+    }
+    return mdl;
+}
+
+static VOID FreeSharedPages(PMDL Mdl, PVOID SystemAddress) {
+    MmUnmapLockedPages(SystemAddress, Mdl);
+    MmFreePagesFromMdl(Mdl);
+    ExFreePool(Mdl);
+}
+
+// Initialize a circular queue consumed in place by a user-mode process
+NTSTATUS InitializeSharedQueue(PCIRCULAR_QUEUE Queue, ULONG Capacity) {
+    C_ASSERT(QUEUE_SHARED_HEADER_SIZE % PAGE_SIZE == 0 && sizeof(QUEUE_SHARED_HEADER) <= QUEUE_SHARED_HEADER_SIZE);
+
+    while (Capacity & (Capacity - 1)) {
+        Capacity &= Capacity - 1;
+    }
+    if (Capacity < PAGE_SIZE) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Whole pages of their own, so nothing else the driver keeps is ever mapped along; the header and the
+    // records are separate allocations because the consumer gets write access to the header only
+    Queue->HeaderMdl = AllocateSharedPages(QUEUE_SHARED_HEADER_SIZE, (PVOID*)&Queue->Shared);
+    if (!Queue->HeaderMdl) {
+        Queue->Shared = NULL;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    Queue->DataMdl = AllocateSharedPages(Capacity, (PVOID*)&Queue->Buffer);
+    if (!Queue->DataMdl) {
+        FreeSharedPages(Queue->HeaderMdl, Queue->Shared);
+        Queue->HeaderMdl = NULL;
+        Queue->Shared = NULL;
+        Queue->Buffer = NULL;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Queue->Shared->Version = QUEUE_SHARED_VERSION;
+    Queue->Shared->Capacity = Capacity;
+
+    KeInitializeSpinLock(&Queue->Lock);
+    Queue->Capacity = Capacity;
+    Queue->Mask = Capacity - 1;
     Queue->Head = 0;
     Queue->Tail = 0;
-    Queue->Count = 0;
+    Queue->Policy = QueueDropNewest;
+    Queue->Lost = 0;
+    Queue->Dropped = 0;
+    Queue->Overwritten = 0;
+
+    // The pages come zeroed, so the whole first lap is ready
+    Queue->Cleared = Capacity;
 
     return STATUS_SUCCESS;
 }
 
 // Clean up the circular queue
 VOID CleanupQueue(PCIRCULAR_QUEUE Queue) {
+    if (Queue->DataMdl) {
+        FreeSharedPages(Queue->DataMdl, Queue->Buffer);
+        Queue->DataMdl = NULL;
+        Queue->Buffer = NULL;
+    }
+    if (Queue->HeaderMdl) {
+        FreeSharedPages(Queue->HeaderMdl, Queue->Shared);
+        Queue->HeaderMdl = NULL;
+        Queue->Shared = NULL;
+    }
     if (Queue->Buffer) {
         ExFreePoolWithTag(Queue->Buffer, 'cQ');
         Queue->Buffer = NULL;
     }
 }
 
-// Enqueue a message
-VOID Enqueue(PCIRCULAR_QUEUE Queue, PUCHAR Message) {
-    KIRQL oldIrql;
-    KeAcquireSpinLock(&Queue->Lock, &oldIrql);
+// Maps pages into the current process; NULL on failure
+static PVOID MapUserPages(PMDL Mdl, ULONG Priority) {
+    PVOID address;
 
-    // Copy the message into the buffer
-    ULONG offset = Queue->Tail * Queue->MessageSize;
-    RtlCopyMemory(Queue->Buffer + offset, Message, Queue->MessageSize);
+    // A user-mode mapping raises instead of returning NULL when it fails
+    __try {
+        address = MmMapLockedPagesSpecifyCache(Mdl, UserMode, MmCached, NULL, FALSE, Priority);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        address = NULL;
+    }
+    return address;
+}
 
-    Queue->Tail = (Queue->Tail + 1) % Queue->MaxMessages;
+NTSTATUS MapQueue(PCIRCULAR_QUEUE Queue, PQUEUE_USER_MAPPING Mapping) {
+    if (!Queue->HeaderMdl) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
 
-    if (Queue->Count == Queue->MaxMessages) {
-        // Queue is full, overwrite the oldest message
-        Queue->Head = (Queue->Head + 1) % Queue->MaxMessages;
+    Mapping->Header = MapUserPages(Queue->HeaderMdl, NormalPagePriority | MdlMappingNoExecute);
+    if (!Mapping->Header) {
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
-    else {
-        Queue->Count++;
+
+    // The consumer cannot forge or damage records, only move its own position
+    Mapping->Data = MapUserPages(Queue->DataMdl, NormalPagePriority | MdlMappingNoExecute | MdlMappingNoWrite);
+    if (!Mapping->Data) {
+        MmUnmapLockedPages(Mapping->Header, Queue->HeaderMdl);
+        Mapping->Header = NULL;
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
+    return STATUS_SUCCESS;
+}
 
-    KeReleaseSpinLock(&Queue->Lock, oldIrql);
+VOID UnmapQueue(PCIRCULAR_QUEUE Queue, PQUEUE_USER_MAPPING Mapping) {
+    MmUnmapLockedPages(Mapping->Data, Queue->DataMdl);
+    MmUnmapLockedPages(Mapping->Header, Queue->HeaderMdl);
+}
 
+ULONG QueueMaxRecordLength(PCIRCULAR_QUEUE Queue) {
+    return Queue->Capacity / 2 - sizeof(QUEUE_RECORD_HEADER) - QUEUE_GAP_RECORD_SIZE;
 }
 
-// Dequeue a message
-BOOLEAN Dequeue(PCIRCULAR_QUEUE Queue, PUCHAR Message) {
+VOID SetQueuePolicy(PCIRCULAR_QUEUE Queue, QUEUE_OVERFLOW_POLICY Policy) {
+    InterlockedExchange(&Queue->Policy, Policy);
+}
+
+// The consumer position of a shared ring comes from user mode, so it is aligned and clamped to what was handed out
+static LONG64 SharedHead(PCIRCULAR_QUEUE Queue, LONG64 Tail) {
+    LONG64 head = ReadAcquire64(&Queue->Shared->Head) & ~(LONG64)(QUEUE_RECORD_ALIGNMENT - 1);
+
+    if (head > Tail) {
+        return Tail;
+    }
+    if (head < Tail - Queue->Capacity) {
+        return Tail - Queue->Capacity;
+    }
+    return head;
+}
+
+ULONG QueueUsedBytes(PCIRCULAR_QUEUE Queue) {
+    if (Queue->Shared) {
+        LONG64 tail = ReadAcquire64(&Queue->Tail);
+        return (ULONG)(tail - SharedHead(Queue, tail));
+    }
+
+    // Head is read first, so a concurrent dequeue can only make the answer too large, never negative
+    LONG64 head = ReadAcquire64(&Queue->Head);
+    return (ULONG)(ReadAcquire64(&Queue->Tail) - head);
+}
+
+static PQUEUE_RECORD_HEADER RecordAt(PCIRCULAR_QUEUE Queue, LONG64 Position) {
+    return (PQUEUE_RECORD_HEADER)(Queue->Buffer + ((ULONG)Position & Queue->Mask));
+}
+
+// Zeroes the space a shared ring's consumer has released, up to Target, so it can be reserved again. Head is the
+// consumer position Target was derived from; everything before it is consumed, so no record in use is touched.
+// Stopping short of Head + Capacity leaves at least a record header of zeroes past the next reservation, and
+// stopping at it leaves the stale header of a record the consumer released: either way the slot the consumer
+// polls next never holds the stamp it is waiting for.
+static VOID ClearReleased(PCIRCULAR_QUEUE Queue, LONG64 Target) {
     KIRQL oldIrql;
-    BOOLEAN result = FALSE;
 
-    // Acquire the spinlock
     KeAcquireSpinLock(&Queue->Lock, &oldIrql);
+    LONG64 cleared = Queue->Cleared;
+    while (cleared < Target) {
+        ULONG offset = (ULONG)cleared & Queue->Mask;
+        ULONG length = (ULONG)min(Target - cleared, (LONG64)(Queue->Capacity - offset));
+        RtlZeroMemory(Queue->Buffer + offset, length);
+        cleared += length;
+    }
+
+    // Producers reserve only below Cleared, so the zeroes are visible before any record lands on them
+    if (cleared > Queue->Cleared) {
+        WriteRelease64(&Queue->Cleared, cleared);
+    }
+    KeReleaseSpinLock(&Queue->Lock, oldIrql);
+}
 
-    if (Queue->Count > 0) {
-        // Copy the message from the buffer
-        ULONG offset = Queue->Head * Queue->MessageSize;
-        RtlCopyMemory(Message, Queue->Buffer + offset, Queue->MessageSize);
+BOOLEAN QueueHasRecord(PCIRCULAR_QUEUE Queue) {
+    if (!Queue->Buffer) {
+        return FALSE;
+    }
+
+    LONG64 head = Queue->Shared ? SharedHead(Queue, ReadAcquire64(&Queue->Tail)) : ReadAcquire64(&Queue->Head);
+    return ReadAcquire64(&RecordAt(Queue, head)->Stamp) == head + 1;
+}
 
-        // Update queue metadata
-        Queue->Head = (Queue->Head + 1) % Queue->MaxMessages;
-        Queue->Count--;
-        result = TRUE;
+// Returns the published record at Head, or NULL. Must be called with the lock held.
+static PQUEUE_RECORD_HEADER PeekHead(PCIRCULAR_QUEUE Queue) {
+    PQUEUE_RECORD_HEADER header = RecordAt(Queue, Queue->Head);
+    return ReadAcquire64(&header->Stamp) == Queue->Head + 1 ? header : NULL;
+}
+
+// Frees the record at Head. Must be called with the lock held.
+static VOID ReleaseHead(PCIRCULAR_QUEUE Queue, PQUEUE_RECORD_HEADER Header) {
+    LONG64 next = Queue->Head + Header->Size;
+
+    // Producers rely on free space being zero, so a stale payload can never pass for a stamp
+    RtlZeroMemory(Header, Header->Size);
+    WriteRelease64(&Queue->Head, next);
+}
+
+// Counts lost records; the next record enqueued reports the unreported ones
+static VOID DropRecords(PCIRCULAR_QUEUE Queue, LONG64 Records, LONG64 Unreported) {
+    InterlockedAdd64(&Queue->Dropped, Records);
+    InterlockedAdd64(&Queue->Lost, Unreported);
+}
+
+// Whether a full queue may drop its oldest records to take a new one
+static BOOLEAN MayDropOldest(PCIRCULAR_QUEUE Queue, ULONG Flags) {
+    if (Queue->Shared) {
+        return FALSE;
+    }
+
+    switch (ReadNoFence(&Queue->Policy)) {
+    case QueueDropNewest:
+        return FALSE;
+    case QueuePreferPriority:
+        return (Flags & QUEUE_ENQUEUE_PRIORITY) != 0;
+    default:
+        return TRUE;
     }
+}
+
+// Drops published records until Head reaches Target. Fails if the oldest record is not published yet.
+static BOOLEAN MakeRoom(PCIRCULAR_QUEUE Queue, LONG64 Target) {
+    KIRQL oldIrql;
+    BOOLEAN result = TRUE;
+    LONG64 records = 0;
+    LONG64 unreported = 0;
 
-    // Release the spinlock
+    KeAcquireSpinLock(&Queue->Lock, &oldIrql);
+    while (Queue->Head < Target) {
+        PQUEUE_RECORD_HEADER header = PeekHead(Queue);
+        if (!header) {
+            result = FALSE;
+            break;
+        }
+
+        // Queue is full, overwrite the oldest message; an overwritten gap marker hands its count on
+        if (header->Length != QUEUE_PAD_RECORD) {
+            PQUEUE_GAP_MARKER marker = (PQUEUE_GAP_MARKER)(header + 1);
+            if (header->Length >= sizeof(QUEUE_GAP_MARKER) && marker->Id == 0) {
+                unreported += (LONG64)marker->Lost;
+            }
+            else {
+                records++;
+                unreported++;
+            }
+        }
+        ReleaseHead(Queue, header);
+    }
     KeReleaseSpinLock(&Queue->Lock, oldIrql);
 
+    if (unreported) {
+        DropRecords(Queue, records, unreported);
+    }
+    if (records) {
+        InterlockedAdd64(&Queue->Overwritten, records);
+    }
     return result;
 }
+
+// Reserve space for a record
+PVOID BeginEnqueue(PCIRCULAR_QUEUE Queue, ULONG Length, ULONG Flags, PQUEUE_RESERVATION Reservation) {
+    if (!Queue->Buffer) {
+        return NULL;
+    }
+    if (Length > QueueMaxRecordLength(Queue)) {
+        DropRecords(Queue, 1, 1);
+        return NULL;
+    }
+
+    ULONG size = ALIGN_RECORD(Length + sizeof(QUEUE_RECORD_HEADER));
+    ULONG gapSize;
+    LONG64 tail;
+    ULONG toEnd;
+
+    for (;;) {
+        tail = ReadNoFence64(&Queue->Tail);
+
+        // Records lost since the last gap marker are reported by a new one right before this record
+        gapSize = ReadNoFence64(&Queue->Lost) ? QUEUE_GAP_RECORD_SIZE : 0;
+        toEnd = Queue->Capacity - ((ULONG)tail & Queue->Mask);
+        if (toEnd >= gapSize + size) {
+            toEnd = 0;
+        }
+
+        // Not enough room before the end: the filler is reserved along with the record
+        LONG64 end = tail + toEnd + gapSize + size;
+        LONG64 head = Queue->Shared ? SharedHead(Queue, tail) : ReadAcquire64(&Queue->Head);
+        if (end - head > Queue->Capacity) {
+            // The consumer of a shared ring is never overtaken; the new record is dropped instead
+            if (!MayDropOldest(Queue, Flags) || !MakeRoom(Queue, end - Queue->Capacity)) {
+                DropRecords(Queue, 1, 1);
+                return NULL;
+            }
+            continue;
+        }
+
+        // Released space of a shared ring is zeroed in batches, ahead of the reservations that need it
+        if (Queue->Shared && end + (LONG64)sizeof(QUEUE_RECORD_HEADER) > ReadAcquire64(&Queue->Cleared)) {
+            LONG64 target = min(head + Queue->Capacity, end + QUEUE_CLEAR_BATCH);
+            if (target > ReadAcquire64(&Queue->Cleared)) {
+                ClearReleased(Queue, target);
+            }
+        }
+
+        if (InterlockedCompareExchange64(&Queue->Tail, end, tail) == tail) {
+            break;
+        }
+    }
+
+    if (toEnd) {
+        PQUEUE_RECORD_HEADER pad = RecordAt(Queue, tail);
+        pad->Size = toEnd;
+        pad->Length = QUEUE_PAD_RECORD;
+        WriteRelease64(&pad->Stamp, tail + 1);
+        tail += toEnd;
+    }
+
+    if (gapSize) {
+        PQUEUE_RECORD_HEADER gap = RecordAt(Queue, tail);
+        PQUEUE_GAP_MARKER marker = (PQUEUE_GAP_MARKER)(gap + 1);
+        LONG64 lost = InterlockedExchange64(&Queue->Lost, 0);
+
+        // Another producer may have reported the loss first; the space is then skipped as filler
+        gap->Size = gapSize;
+        gap->Length = lost ? sizeof(QUEUE_GAP_MARKER) : QUEUE_PAD_RECORD;
+        marker->Size = sizeof(QUEUE_GAP_MARKER);
+        marker->Id = 0;
+        marker->Lost = (ULONG64)lost;
+        WriteRelease64(&gap->Stamp, tail + 1);
+        tail += gapSize;
+    }
+
+    PQUEUE_RECORD_HEADER header = RecordAt(Queue, tail);
+    header->Size = size;
+    header->Length = Length;
+    Reservation->Position = tail;
+    return header + 1;
+}
+
+// Publish the reserved record
+VOID EndEnqueue(PCIRCULAR_QUEUE Queue, PQUEUE_RESERVATION Reservation) {
+    WriteRelease64(&RecordAt(Queue, Reservation->Position)->Stamp, Reservation->Position + 1);
+}
+
+// Publish the reserved record as filler
+VOID CancelEnqueue(PCIRCULAR_QUEUE Queue, PQUEUE_RESERVATION Reservation) {
+    PQUEUE_RECORD_HEADER header = RecordAt(Queue, Reservation->Position);
+    header->Length = QUEUE_PAD_RECORD;
+    WriteRelease64(&header->Stamp, Reservation->Position + 1);
+}
+
+VOID MoveQueue(PCIRCULAR_QUEUE To, PCIRCULAR_QUEUE From) {
+    KIRQL oldIrql;
+    PQUEUE_RECORD_HEADER header;
+    QUEUE_RESERVATION reservation;
+
+    KeAcquireSpinLock(&From->Lock, &oldIrql);
+    while ((header = PeekHead(From)) != NULL) {
+        if (header->Length != QUEUE_PAD_RECORD) {
+            PVOID payload = BeginEnqueue(To, header->Length, 0, &reservation);
+            if (payload) {
+                RtlCopyMemory(payload, header + 1, header->Length);
+                EndEnqueue(To, &reservation);
+            }
+        }
+        ReleaseHead(From, header);
+    }
+
+    InterlockedAdd64(&To->Lost, InterlockedExchange64(&From->Lost, 0));
+    InterlockedAdd64(&To->Dropped, InterlockedExchange64(&From->Dropped, 0));
+    KeReleaseSpinLock(&From->Lock, oldIrql);
+}
+
+// Copies up to MaxCount records into Buffer, each payload aligned to QUEUE_BATCH_ALIGNMENT. The lock is dropped
+// after every QUEUE_DEQUEUE_BATCH bytes of records, so a large buffer never stalls producers for the whole copy.
+static NTSTATUS DequeueRecords(PCIRCULAR_QUEUE Queue, PUCHAR Buffer, ULONG BufferLength, ULONG MaxCount,
+    PULONG Count, PULONG Length) {
+    KIRQL oldIrql;
+    NTSTATUS status = STATUS_NO_MORE_ENTRIES;
+    PQUEUE_RECORD_HEADER header;
+    ULONG offset = 0;
+    BOOLEAN more;
+
+    *Count = 0;
+    *Length = 0;
+    if (!Queue->Buffer || Queue->Shared) {
+        return status;
+    }
+
+    do {
+        ULONG held = 0;
+        more = FALSE;
+
+        // Acquire the spinlock
+        KeAcquireSpinLock(&Queue->Lock, &oldIrql);
+
+        while (*Count < MaxCount && (header = PeekHead(Queue)) != NULL) {
+            if (held >= QUEUE_DEQUEUE_BATCH) {
+                more = TRUE;
+                break;
+            }
+            held += header->Size;
+
+            if (header->Length == QUEUE_PAD_RECORD) {
+                ReleaseHead(Queue, header);
+                continue;
+            }
+
+            ULONG start = (offset + QUEUE_BATCH_ALIGNMENT - 1) & ~(QUEUE_BATCH_ALIGNMENT - 1);
+            if (start > BufferLength || header->Length > BufferLength - start) {
+                if (*Count == 0) {
+                    // Not even the oldest record fits; report what it needs
+                    *Length = header->Length;
+                    status = STATUS_BUFFER_TOO_SMALL;
+                }
+                break;
+            }
+
+            // Copy the message from the buffer and update queue metadata
+            RtlZeroMemory(Buffer + offset, start - offset);
+            RtlCopyMemory(Buffer + start, header + 1, header->Length);
+            offset = start + header->Length;
+            ReleaseHead(Queue, header);
+            (*Count)++;
+            *Length = offset;
+            status = STATUS_SUCCESS;
+        }
+
+        // Release the spinlock
+        KeReleaseSpinLock(&Queue->Lock, oldIrql);
+    } while (more);
+
+    return status;
+}
+
+// Dequeue a record
+NTSTATUS Dequeue(PCIRCULAR_QUEUE Queue, PVOID Buffer, ULONG BufferLength, PULONG Length) {
+    ULONG count;
+    return DequeueRecords(Queue, (PUCHAR)Buffer, BufferLength, 1, &count, Length);
+}
+
+// Dequeue as many records as fit
+NTSTATUS DequeueBatch(PCIRCULAR_QUEUE Queue, PVOID Buffer, ULONG BufferLength, PULONG Count, PULONG Length) {
+    return DequeueRecords(Queue, (PUCHAR)Buffer, BufferLength, MAXULONG, Count, Length);
+}
@@ -3,43 +3,110 @@
  * @brief A thread-safe circular queue implementation for the Windows Kernel.
  *
  * This module provides a simple circular queue that can be used in kernel-mode
- * drivers. The queue supports variable-sized messages and is protected by a
- * spinlock for thread safety.
- * 
+ * drivers. The queue stores variable-sized records back to back in a byte ring.
+ * Producers reserve and publish records without taking a lock; consumers are
+ * serialized by a spinlock. A shared ring is consumed in place by a user-mode
+ * process instead; see sharedQueue.h for its layout and protocol.
+ *
+ * Positions are byte offsets that only grow and are masked into the buffer. A
+ * producer reserves [Tail, Tail + Size) with a compare-exchange, writes the
+ * record and publishes it by storing its stamp (position + 1) with release
+ * semantics. The consumer reads a record only once the stamp at Head matches,
+ * then zeroes it before advancing Head, so free space never holds a valid stamp.
+ * In a shared ring the producers zero released space instead, since the
+ * consumer's view of the records is read-only.
+ *
  */
 
  #pragma once
 
  #include <ntddk.h>
- 
+ #include "sharedQueue.h"
+
+ /**
+  * @def QUEUE_BATCH_ALIGNMENT
+  * @brief Alignment of each payload in the buffer filled by DequeueBatch.
+  */
+ #define QUEUE_BATCH_ALIGNMENT 8
+
+ /**
+  * @def QUEUE_ENQUEUE_PRIORITY
+  * @brief BeginEnqueue flag for records QueuePreferPriority may make room for.
+  */
+ #define QUEUE_ENQUEUE_PRIORITY 0x1
+
+ /**
+  * @enum QUEUE_OVERFLOW_POLICY
+  * @brief What a full queue gives up to take a new record.
+  *
+  * A shared queue always behaves as QueueDropNewest, so its consumer is never overtaken.
+  */
+typedef enum _QUEUE_OVERFLOW_POLICY {
+    QueueDropOldest,       // Overwrite the oldest records
+    QueueDropNewest,       // Drop the new record
+    QueuePreferPriority,   // Overwrite the oldest records for a priority record, drop any other new record
+    QueueOverflowPolicyCount
+} QUEUE_OVERFLOW_POLICY, * PQUEUE_OVERFLOW_POLICY;
+
  /**
   * @struct CIRCULAR_QUEUE
   * @brief Represents a circular queue for storing messages.
+  *
+  * The producer and consumer positions are kept on separate cache lines, away
+  * from the fields that are only read after initialization. The drop counters
+  * share the consumer's line: records are only dropped when it falls behind.
   */
 typedef struct _CIRCULAR_QUEUE {
-    KSPIN_LOCK Lock;       // Spinlock for synchronization
     PUCHAR Buffer;         // Pointer to the circular buffer
-    ULONG MessageSize;     // Size of each message in bytes
-    ULONG MaxMessages;     // Maximum number of messages the queue can hold
-    ULONG Head;            // Index of the first message
-    ULONG Tail;            // Index of the next free slot
-    ULONG Count;           // Number of messages in the queue
+    ULONG Capacity;        // Size of the buffer in bytes, a power of two
+    ULONG Mask;            // Capacity - 1
+    volatile LONG Policy;  // QUEUE_OVERFLOW_POLICY
+
+    DECLSPEC_CACHEALIGN
+    volatile LONG64 Tail;  // Position after the last reserved record
+
+    DECLSPEC_CACHEALIGN
+    volatile LONG64 Head;  // Position of the oldest record
+    volatile LONG64 Cleared; // Shared ring: positions below this were zeroed for their lap or are in use
+    KSPIN_LOCK Lock;       // Serializes consumers, producers dropping old records and zeroing released space
+    volatile LONG64 Lost;  // Records dropped since the last gap marker was placed
+    volatile LONG64 Dropped; // Records dropped since the queue was created
+    volatile LONG64 Overwritten; // Published records among them, dropped to make room for newer ones
+
+    PQUEUE_SHARED_HEADER Shared; // Header of a ring consumed in place by another process, or NULL
+    PMDL HeaderMdl;        // Describes the header page of a shared ring
+    PMDL DataMdl;          // Describes the buffer of a shared ring
 } CIRCULAR_QUEUE, * PCIRCULAR_QUEUE;
- 
+
+ /**
+  * @struct QUEUE_USER_MAPPING
+  * @brief Where MapQueue mapped a shared ring in the consumer's address space.
+  */
+typedef struct _QUEUE_USER_MAPPING {
+    PQUEUE_SHARED_HEADER Header; // The header page, writable
+    PVOID Data;            // The records, read-only
+} QUEUE_USER_MAPPING, * PQUEUE_USER_MAPPING;
+
+ /**
+  * @struct QUEUE_RESERVATION
+  * @brief State carried from BeginEnqueue to EndEnqueue.
+  */
+typedef struct _QUEUE_RESERVATION {
+    LONG64 Position;       // Position of the reserved record
+} QUEUE_RESERVATION, * PQUEUE_RESERVATION;
+
  /**
   * @brief Initializes a circular queue.
   *
   * This function allocates memory for the queue buffer and initializes the queue
-  * metadata. The queue can hold up to `MaxMessages` messages, each of size
-  * `MessageSize`.
+  * metadata. Records of up to QueueMaxRecordLength bytes can be stored.
   *
   * @param Queue Pointer to the CIRCULAR_QUEUE structure to initialize.
-  * @param MessageSize Size of each message in bytes.
-  * @param MaxMessages Maximum number of messages the queue can hold.
+  * @param Capacity Size of the ring in bytes; rounded down to a power of two.
   * @return NTSTATUS STATUS_SUCCESS on success, or an error code on failure.
   */
- NTSTATUS InitializeQueue(PCIRCULAR_QUEUE Queue, ULONG MessageSize, ULONG MaxMessages);
- 
+ NTSTATUS InitializeQueue(PCIRCULAR_QUEUE Queue, ULONG Capacity);
+
  /**
   * @brief Cleans up a circular queue.
   *
@@ -49,28 +116,164 @@ typedef struct _CIRCULAR_QUEUE {
   * @param Queue Pointer to the CIRCULAR_QUEUE structure to clean up.
   */
  VOID CleanupQueue(PCIRCULAR_QUEUE Queue);
- 
+
+ /**
+  * @brief Initializes a queue whose records are consumed in place by a user-mode process.
+  *
+  * The ring and a QUEUE_SHARED_HEADER page are allocated as whole pages, apart from any
+  * pool allocation, so they can be mapped with MapQueue. The consumer position lives in
+  * the header; when the consumer falls a full ring behind, new records are dropped rather
+  * than old ones. Dequeue and DequeueBatch do not apply to a shared queue.
+  *
+  * @param Queue Pointer to the CIRCULAR_QUEUE structure to initialize.
+  * @param Capacity Size of the ring in bytes, at least a page; rounded down to a power of two.
+  * @return NTSTATUS STATUS_SUCCESS on success, or an appropriate error code.
+  */
+ NTSTATUS InitializeSharedQueue(PCIRCULAR_QUEUE Queue, ULONG Capacity);
+
+ /**
+  * @brief Maps a shared queue into the address space of the current process.
+  *
+  * The header page is mapped writable, for the consumer position; the records are mapped
+  * read-only. Must be called at PASSIVE_LEVEL in the context of the consumer process, which
+  * must not exit before UnmapQueue.
+  *
+  * @param Queue Pointer to a queue initialized by InitializeSharedQueue.
+  * @param Mapping Receives the user-mode addresses of the two views.
+  * @return NTSTATUS STATUS_SUCCESS, or STATUS_INSUFFICIENT_RESOURCES if either view could not be mapped.
+  */
+ NTSTATUS MapQueue(PCIRCULAR_QUEUE Queue, PQUEUE_USER_MAPPING Mapping);
+
  /**
-  * @brief Enqueues a message into the circular queue.
+  * @brief Removes a mapping made by MapQueue. Must be called in the context of the same process.
   *
-  * This function adds a message to the queue. If the queue is full, the oldest
-  * message is overwritten by the new message.
+  * @param Queue Pointer to the shared queue.
+  * @param Mapping The views returned by MapQueue.
+  */
+ VOID UnmapQueue(PCIRCULAR_QUEUE Queue, PQUEUE_USER_MAPPING Mapping);
+
+ /**
+  * @brief Checks whether a published record is waiting at the consumer position.
+  *
+  * Takes no lock. Callable at IRQL <= DISPATCH_LEVEL.
   *
   * @param Queue Pointer to the CIRCULAR_QUEUE structure.
-  * @param Message Pointer to the message to enqueue.
+  * @return BOOLEAN TRUE if the consumer has a record to read.
   */
- VOID Enqueue(PCIRCULAR_QUEUE Queue, PUCHAR Message);
- 
+ BOOLEAN QueueHasRecord(PCIRCULAR_QUEUE Queue);
+
+ /**
+  * @brief Sets the overflow policy. Records already queued are not affected.
+  *
+  * @param Queue Pointer to the CIRCULAR_QUEUE structure.
+  * @param Policy The new QUEUE_OVERFLOW_POLICY.
+  */
+ VOID SetQueuePolicy(PCIRCULAR_QUEUE Queue, QUEUE_OVERFLOW_POLICY Policy);
+
+ /**
+  * @brief Moves the records of one queue to the end of another.
+  *
+  * Losses not yet reported by a gap marker and the drop count move along. Records
+  * that To has no room for are dropped under its policy. Producers may still be
+  * adding to From; what they publish after the move stays there.
+  *
+  * @param To Queue receiving the records.
+  * @param From Queue to empty; must not be shared.
+  */
+ VOID MoveQueue(PCIRCULAR_QUEUE To, PCIRCULAR_QUEUE From);
+
+ /**
+  * @brief Returns the largest payload a single record may carry.
+  *
+  * Records, with a gap marker in front, are limited to half the ring so that a
+  * wrap can always be satisfied by dropping older records.
+  *
+  * @param Queue Pointer to the CIRCULAR_QUEUE structure.
+  * @return ULONG The maximum payload length in bytes.
+  */
+ ULONG QueueMaxRecordLength(PCIRCULAR_QUEUE Queue);
+
+ /**
+  * @brief Returns the bytes between Head and Tail, reserved records and padding included.
+  *
+  * Takes no lock, so the answer may be stale by the time it is used; it is meant
+  * for deciding whether it is worth waking a consumer. Zero means the queue was empty.
+  *
+  * @param Queue Pointer to the CIRCULAR_QUEUE structure.
+  * @return ULONG The bytes in use.
+  */
+ ULONG QueueUsedBytes(PCIRCULAR_QUEUE Queue);
+
+ /**
+  * @brief Reserves space for a record and returns where to write its payload.
+  *
+  * If the queue is full, the queue's overflow policy decides whether the oldest
+  * published records are dropped to make room or the new record is. Dropped
+  * records are counted and reported by a gap marker placed before the next
+  * record that is enqueued.
+  * The caller fills in the payload and must then call EndEnqueue. Until it does,
+  * the consumer cannot get past the record, so the payload should be written
+  * without delay. Callable at IRQL <= DISPATCH_LEVEL.
+  *
+  * @param Queue Pointer to the CIRCULAR_QUEUE structure.
+  * @param Length Payload length in bytes, at most QueueMaxRecordLength.
+  * @param Flags QUEUE_ENQUEUE_PRIORITY or 0.
+  * @param Reservation Receives the state EndEnqueue needs.
+  * @return PVOID Where to write the payload, or NULL if the record was dropped
+  *         (EndEnqueue must not be called then).
+  */
+ PVOID BeginEnqueue(PCIRCULAR_QUEUE Queue, ULONG Length, ULONG Flags, PQUEUE_RESERVATION Reservation);
+
+ /**
+  * @brief Publishes the record reserved by BeginEnqueue.
+  *
+  * @param Queue Pointer to the CIRCULAR_QUEUE structure.
+  * @param Reservation The state filled in by BeginEnqueue.
+  */
+ VOID EndEnqueue(PCIRCULAR_QUEUE Queue, PQUEUE_RESERVATION Reservation);
+
+ /**
+  * @brief Gives up the record reserved by BeginEnqueue instead of publishing it.
+  *
+  * The space is published as filler, which consumers skip; the record is not
+  * counted as dropped.
+  *
+  * @param Queue Pointer to the CIRCULAR_QUEUE structure.
+  * @param Reservation The state filled in by BeginEnqueue.
+  */
+ VOID CancelEnqueue(PCIRCULAR_QUEUE Queue, PQUEUE_RESERVATION Reservation);
+
+ /**
+  * @brief Dequeues a record from the circular queue.
+  *
+  * This function removes the oldest record from the queue and copies its payload
+  * into the provided buffer. A record that does not fit stays in the queue.
+  *
+  * @param Queue Pointer to the CIRCULAR_QUEUE structure.
+  * @param Buffer Pointer to the buffer receiving the payload; must be nonpaged.
+  * @param BufferLength Size of Buffer in bytes.
+  * @param Length Receives the payload length of the oldest record.
+  * @return NTSTATUS STATUS_SUCCESS if a record was dequeued, STATUS_NO_MORE_ENTRIES
+  *         if no published record is waiting, STATUS_BUFFER_TOO_SMALL if the record
+  *         does not fit.
+  */
+ NTSTATUS Dequeue(PCIRCULAR_QUEUE Queue, PVOID Buffer, ULONG BufferLength, PULONG Length);
+
  /**
-  * @brief Dequeues a message from the circular queue.
+  * @brief Dequeues as many records as fit into a buffer.
   *
-  * This function removes a message from the queue and copies it into the provided
-  * buffer. If the queue is empty, the function returns FALSE.
+  * The payloads are copied back to back in queue order, each starting at a multiple
+  * of QUEUE_BATCH_ALIGNMENT bytes from Buffer; the gaps between them are zeroed.
+  * The queue lock is released and taken again every 64 KB of records, so records
+  * enqueued meanwhile may be part of the batch.
   *
   * @param Queue Pointer to the CIRCULAR_QUEUE structure.
-  * @param Message Pointer to the buffer where the dequeued message will be stored.
-  * @return BOOLEAN TRUE if a message was dequeued successfully, FALSE if the
-  *         queue is empty.
+  * @param Buffer Pointer to the buffer receiving the payloads; must be nonpaged.
+  * @param BufferLength Size of Buffer in bytes.
+  * @param Count Receives the number of records dequeued.
+  * @param Length Receives the bytes used in Buffer, or if not even the oldest record
+  *        fits, its payload length.
+  * @return NTSTATUS STATUS_SUCCESS if at least one record was dequeued, otherwise as
+  *         for Dequeue.
   */
- BOOLEAN Dequeue(PCIRCULAR_QUEUE Queue, PUCHAR Message);
- 
\ No newline at end of file
+ NTSTATUS DequeueBatch(PCIRCULAR_QUEUE Queue, PVOID Buffer, ULONG BufferLength, PULONG Count, PULONG Length);
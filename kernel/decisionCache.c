@@ -0,0 +1,195 @@
+#include <fltKernel.h>
+#include <dontuse.h>
+#include "decisionCache.h"
+#include "fileList.h"
+#include "foldedName.h"
+#include "perfStats.h"
+#include "debug.h"
+
+
+#define VERDICT_FLAG_BITS      RULE_BIT_COUNT
+#define VERDICT_VOLUME_RULES   0x1
+
+extern PFLT_FILTER gFilterHandle;
+extern TRACKED_FILES TrackedFiles;
+
+// Counts successful renames on volumes whose instance has no VOLUME_CONTEXT; every other volume counts its own.
+// A rename through any handle, or of any parent directory, can move a file into or out of a rule while other
+// handles keep their verdicts, so a verdict is tagged with the sum of the ruleset generation and the rename counts
+// of its volume. All of them only grow, so the tag changes whenever any does. A rename never leaves its volume,
+// so the verdicts cached on other volumes survive it.
+static volatile LONG64 RenameEpoch;
+
+static LONG64
+CurrentVerdictTag(PCFLT_RELATED_OBJECTS FltObjects)
+{
+    LONG64 tag = GetTrackedFilesGeneration(&TrackedFiles) + ReadAcquire64(&RenameEpoch);
+    PVOLUME_CONTEXT context = NULL;
+
+    if (NT_SUCCESS(FltGetInstanceContext(FltObjects->Instance, (PFLT_CONTEXT*)&context))) {
+        tag += ReadAcquire64(&context->RenameEpoch);
+        FltReleaseContext(context);
+    }
+    return tag;
+}
+
+static VOID
+StoreVerdict(PCFLT_RELATED_OBJECTS FltObjects, LONG64 Verdict)
+{
+    PDECISION_CONTEXT context = NULL;
+    NTSTATUS status = FltGetStreamHandleContext(FltObjects->Instance, FltObjects->FileObject, (PFLT_CONTEXT*)&context);
+    if (!NT_SUCCESS(status)) {
+        status = FltAllocateContext(gFilterHandle, FLT_STREAMHANDLE_CONTEXT, sizeof(DECISION_CONTEXT),
+            NonPagedPoolNx, (PFLT_CONTEXT*)&context);
+        if (!NT_SUCCESS(status)) return;
+
+        PDECISION_CONTEXT existing = NULL;
+        context->Verdict = Verdict;
+        status = FltSetStreamHandleContext(FltObjects->Instance, FltObjects->FileObject,
+            FLT_SET_CONTEXT_KEEP_IF_EXISTS, context, (PFLT_CONTEXT*)&existing);
+        FltReleaseContext(context);
+        if (status != STATUS_FLT_CONTEXT_ALREADY_DEFINED) return;
+
+        // Another callback on the same handle attached its context first; update that one instead
+        context = existing;
+    }
+
+    InterlockedExchange64(&context->Verdict, Verdict);
+    FltReleaseContext(context);
+}
+
+NTSTATUS
+QueryOpenedName(PFLT_CALLBACK_DATA Data, PFLT_FILE_NAME_INFORMATION* NameInfo)
+{
+    ULONG64 start = PerfTimestamp();
+    NTSTATUS status = FltGetFileNameInformation(Data, FLT_FILE_NAME_OPENED | FLT_FILE_NAME_QUERY_DEFAULT, NameInfo);
+    if (NT_SUCCESS(status) && !(*NameInfo)->Name.Buffer) {
+        FltReleaseFileNameInformation(*NameInfo);
+        status = STATUS_OBJECT_NAME_INVALID;
+    }
+    PerfRecord(PERF_HISTOGRAM_NAME_QUERY, start);
+    if (!NT_SUCCESS(status)) {
+        PerfCount(PERF_COUNTER_NAME_QUERY_FAILURES);
+    }
+    return status;
+}
+
+LONG
+LookupFileOperations(PUNICODE_STRING Name)
+{
+    ULONG64 start = PerfTimestamp();
+    LONG operations = GetTrackedFile(&TrackedFiles, Name);
+    PerfRecord(PERF_HISTOGRAM_RULE_LOOKUP, start);
+    return operations;
+}
+
+LONG
+GetFileDecision(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects, PFLT_FILE_NAME_INFORMATION* NameInfo)
+{
+    // Read the tag before the name and the rules, so a rule change or rename made during the lookup leaves a
+    // stale tag and forces another miss rather than caching an old verdict under the new tag
+    LONG64 tag = CurrentVerdictTag(FltObjects);
+    PDECISION_CONTEXT context = NULL;
+
+    if (NameInfo) {
+        *NameInfo = NULL;
+    }
+    if (NT_SUCCESS(FltGetStreamHandleContext(FltObjects->Instance, FltObjects->FileObject, (PFLT_CONTEXT*)&context))) {
+        LONG64 verdict = ReadNoFence64(&context->Verdict);
+        FltReleaseContext(context);
+        if ((verdict >> VERDICT_FLAG_BITS) == tag) {
+            PerfCount(PERF_COUNTER_CACHE_HITS);
+            return (LONG)(verdict & RULE_ALL);
+        }
+    }
+    PerfCount(PERF_COUNTER_CACHE_MISSES);
+
+    PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
+    if (!NT_SUCCESS(QueryOpenedName(Data, &nameInfo))) {
+        return 0;
+    }
+
+    LONG operations = LookupFileOperations(&nameInfo->Name);
+    DEBUG("FileLogger: %wZ verdict operations=0x%02x\n", &nameInfo->Name, operations);
+    if (NameInfo && operations) {
+        *NameInfo = nameInfo;
+    }
+    else {
+        FltReleaseFileNameInformation(nameInfo);
+    }
+
+    StoreVerdict(FltObjects, (tag << VERDICT_FLAG_BITS) | operations);
+    return operations;
+}
+
+NTSTATUS
+SetupVolumeDecision(PCFLT_RELATED_OBJECTS FltObjects)
+{
+    PVOLUME_CONTEXT context = NULL;
+    NTSTATUS status = FltAllocateContext(gFilterHandle, FLT_INSTANCE_CONTEXT, sizeof(VOLUME_CONTEXT),
+        NonPagedPoolNx, (PFLT_CONTEXT*)&context);
+    if (!NT_SUCCESS(status)) return status;
+
+    context->Verdict = 0;
+    context->RenameEpoch = 0;
+    context->Name.Buffer = context->NameBuffer;
+    context->Name.Length = 0;
+    context->Name.MaximumLength = sizeof(context->NameBuffer);
+
+    // A name too long for the buffer could not have a slot in the rule counts either; the instance is left
+    // without a context and filters everything
+    status = FltGetVolumeName(FltObjects->Volume, &context->Name, NULL);
+    if (NT_SUCCESS(status)) {
+        FoldNameChars(context->Name.Buffer, context->Name.Buffer, context->Name.Length / sizeof(WCHAR));
+        status = FltSetInstanceContext(FltObjects->Instance, FLT_SET_CONTEXT_KEEP_IF_EXISTS, context, NULL);
+    }
+    FltReleaseContext(context);
+    return status;
+}
+
+BOOLEAN
+GetVolumeDecision(PCFLT_RELATED_OBJECTS FltObjects)
+{
+    // Read before the rule counts, for the same reason as in GetFileDecision
+    LONG64 generation = GetTrackedFilesGeneration(&TrackedFiles);
+    PVOLUME_CONTEXT context = NULL;
+
+    if (!NT_SUCCESS(FltGetInstanceContext(FltObjects->Instance, (PFLT_CONTEXT*)&context))) {
+        return TRUE;
+    }
+    LONG64 verdict = ReadNoFence64(&context->Verdict);
+    if ((verdict >> VERDICT_FLAG_BITS) != generation) {
+        verdict = (generation << VERDICT_FLAG_BITS)
+            | (GetTrackedVolume(&TrackedFiles, &context->Name) ? VERDICT_VOLUME_RULES : 0);
+        InterlockedExchange64(&context->Verdict, verdict);
+    }
+    FltReleaseContext(context);
+
+    if (!(verdict & VERDICT_VOLUME_RULES)) {
+        PerfCount(PERF_COUNTER_VOLUME_SKIPS);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+VOID
+InvalidateFileDecisions(PCFLT_RELATED_OBJECTS FltObjects)
+{
+    PVOLUME_CONTEXT context = NULL;
+
+    if (NT_SUCCESS(FltGetInstanceContext(FltObjects->Instance, (PFLT_CONTEXT*)&context))) {
+        InterlockedIncrement64(&context->RenameEpoch);
+        FltReleaseContext(context);
+    }
+    else {
+        InterlockedIncrement64(&RenameEpoch);
+    }
+}
+
+VOID
+GetDecisionCacheStats(PDECISION_CACHE_STATS Stats)
+{
+    Stats->Hits = PerfCounterTotal(PERF_COUNTER_CACHE_HITS);
+    Stats->Misses = PerfCounterTotal(PERF_COUNTER_CACHE_MISSES);
+    Stats->VolumeSkips = PerfCounterTotal(PERF_COUNTER_VOLUME_SKIPS);
+}
@@ -0,0 +1,116 @@
+#pragma once
+#include <fltKernel.h>
+#include <dontuse.h>
+#include "volumeRules.h"
+#include "ruleOps.h"
+
+/**
+ * @struct _DECISION_CONTEXT
+ * @brief Stream handle context caching the rule verdict for one open file.
+ *
+ * The verdict is a single 64-bit word so concurrent callbacks on the same handle can read and
+ * replace it without a lock: the low RULE_BIT_COUNT bits hold the RULE_* bits of the file's rule,
+ * and the remaining bits hold the tag it was computed under, the ruleset generation plus the number
+ * of renames so far on the file's volume.
+ */
+typedef struct _DECISION_CONTEXT {
+    LONG64 Verdict;  ///< Packed generation and flags; 0 never matches a live generation.
+} DECISION_CONTEXT, *PDECISION_CONTEXT;
+
+/**
+ * @struct _VOLUME_CONTEXT
+ * @brief Instance context caching whether any rule can match on the instance's volume.
+ *
+ * The verdict is packed like DECISION_CONTEXT's, except that the low bits only say whether the volume has rules.
+ */
+typedef struct _VOLUME_CONTEXT {
+    LONG64 Verdict;                   ///< Packed generation and flag; 0 never matches a live generation.
+    LONG64 RenameEpoch;               ///< Successful renames on the volume, part of its handles' verdict tags.
+    UNICODE_STRING Name;              ///< Upcased NT device name of the volume, in NameBuffer.
+    WCHAR NameBuffer[VOLUME_NAME_MAX_CHARS]; ///< Storage for Name.
+} VOLUME_CONTEXT, *PVOLUME_CONTEXT;
+
+/**
+ * @struct _DECISION_CACHE_STATS
+ * @brief Hit and miss counters of the decision cache, as returned by IOCTL_GET_CACHE_STATS.
+ *
+ * The same totals are among the counters of IOCTL_GET_STATS.
+ */
+typedef struct _DECISION_CACHE_STATS {
+    ULONG64 Hits;    ///< Lookups answered from a handle's cached verdict.
+    ULONG64 Misses;  ///< Lookups that had to query the file name and consult the rules.
+    ULONG64 VolumeSkips; ///< Operations let through untouched because their volume has no rules.
+} DECISION_CACHE_STATS, *PDECISION_CACHE_STATS;
+
+/**
+ * @brief Queries the opened name of the file targeted by an operation, timing the query.
+ *
+ * @param[in] Data Callback data of the operation.
+ * @param[out] NameInfo Receives the name information, to be released with FltReleaseFileNameInformation.
+ * @return NTSTATUS STATUS_SUCCESS, STATUS_OBJECT_NAME_INVALID for a name without a buffer, or the failure
+ *         of FltGetFileNameInformation.
+ */
+NTSTATUS QueryOpenedName(PFLT_CALLBACK_DATA Data, PFLT_FILE_NAME_INFORMATION* NameInfo);
+
+/**
+ * @brief Looks a file name up in the rules, timing the lookup.
+ *
+ * @param[in] Name The opened name of the file.
+ * @return LONG The RULE_* bits of the file's rule, as GetTrackedFile returns them.
+ */
+LONG LookupFileOperations(PUNICODE_STRING Name);
+
+/**
+ * @brief Returns the rule verdict for the file targeted by an operation.
+ *
+ * Uses the verdict cached on the stream handle while the ruleset generation is unchanged and no
+ * rename has succeeded on the same volume since; otherwise queries the opened file name, looks it up and caches the
+ * result on the handle.
+ *
+ * @param[in] Data Callback data of the operation.
+ * @param[in] FltObjects Related objects of the operation.
+ * @param[out] NameInfo Optional. Receives the name queried on a miss for a tracked file, to be released with
+ *             FltReleaseFileNameInformation, so a caller about to log the file need not query it again; NULL on a
+ *             hit or for an untracked file.
+ * @return LONG The RULE_* bits of the file's rule, 0 if it is not tracked or its name could not be queried.
+ */
+LONG GetFileDecision(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects, PFLT_FILE_NAME_INFORMATION* NameInfo);
+
+/**
+ * @brief Attaches a VOLUME_CONTEXT naming the volume to a new instance. Called from InstanceSetup.
+ *
+ * @param[in] FltObjects Related objects of the instance.
+ * @return NTSTATUS STATUS_SUCCESS, or the failure to query the volume name or to attach the context. An
+ *         instance without a context treats its volume as having rules.
+ */
+NTSTATUS SetupVolumeDecision(PCFLT_RELATED_OBJECTS FltObjects);
+
+/**
+ * @brief Checks whether any rule can match a file on the volume of an operation.
+ *
+ * Uses the answer cached on the instance while the ruleset generation is unchanged; otherwise asks the rules
+ * and caches the result. Counts a VolumeSkips for every FALSE.
+ *
+ * @param[in] FltObjects Related objects of the operation.
+ * @return BOOLEAN FALSE if the operation can pass without a look at its file name.
+ */
+BOOLEAN GetVolumeDecision(PCFLT_RELATED_OBJECTS FltObjects);
+
+/**
+ * @brief Discards the verdicts cached on every handle of a volume. Called after a rename on it succeeds.
+ *
+ * A rename changes the name of the file, or of every file below a directory, for all of its handles, not
+ * just the one it was made through; it never moves a file to another volume. Costs one interlocked increment
+ * on the instance context; the volume's handles miss on their next operation, those of other volumes keep
+ * their verdicts.
+ *
+ * @param[in] FltObjects Related objects of the rename.
+ */
+VOID InvalidateFileDecisions(PCFLT_RELATED_OBJECTS FltObjects);
+
+/**
+ * @brief Copies the current hit and miss counters.
+ *
+ * @param[out] Stats Pointer to the structure receiving the counters.
+ */
+VOID GetDecisionCacheStats(PDECISION_CACHE_STATS Stats);
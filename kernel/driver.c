@@ -1,144 +1,35 @@
 #include <fltKernel.h>
 #include <dontuse.h>
-#include <ntstrsafe.h>
+#include <wdmsec.h>
 #include "fileList.h"
 #include "userApi.h"
+#include "callbacks.h"
+#include "decisionCache.h"
+#include "processCache.h"
+#include "perfStats.h"
 #include "debug.h"
 
 
 #pragma comment(lib, "fltmgr.lib")
+#pragma comment(lib, "wdmsec.lib")
 
 
 PFLT_FILTER gFilterHandle = NULL;
 TRACKED_FILES TrackedFiles;
 PDEVICE_OBJECT gDeviceObject = NULL;
 
-
-static VOID 
-LogDeletion(PUNICODE_STRING name) {
-    PEPROCESS process = PsGetCurrentProcess();
-    PUNICODE_STRING processName = NULL;
-    NTSTATUS status = SeLocateProcessImageName(process, &processName);
-    UNICODE_STRING defaultProcessName;
-    LARGE_INTEGER systemTime;
-    LARGE_INTEGER localTime;
-    TIME_FIELDS timeFields;
-    WCHAR timeBuffer[64]; // Format datetime string (e.g., "2025-03-02 14:30:45")
-    UNICODE_STRING timeString;
-
-    if (!NT_SUCCESS(status) || !processName) {
-        RtlInitUnicodeString(&defaultProcessName, L"Unknown Process");
-        processName = &defaultProcessName;
-    }
-
-    // Get current time
-
-    KeQuerySystemTime(&systemTime);
-    ExSystemTimeToLocalTime(&systemTime, &localTime);
-    RtlTimeToTimeFields(&localTime, &timeFields);
+// Class of the control device, under which an administrator could override DEVICE_SDDL in the registry
+static const GUID DeviceClassGuid = { 0x5969d804, 0xf6f6, 0x4370, { 0xbb, 0x5f, 0xd1, 0xb4, 0x5c, 0x9d, 0xa0, 0x39 } };
 
 
-    timeString.Buffer = timeBuffer;
-    timeString.MaximumLength = sizeof(timeBuffer);
-    status = RtlUnicodeStringPrintf(&timeString,
-        L"%04d-%02d-%02d %02d:%02d:%02d",
-        timeFields.Year, timeFields.Month, timeFields.Day,
-        timeFields.Hour, timeFields.Minute, timeFields.Second);
-    if (NT_SUCCESS(status)) {
-        SendToUser(processName, name, &timeString);
-        // Log with process name, path, datetime, and operation
-        LOG("FileLogger: Operation=DELETE, Process=%wZ, Path=%wZ, DateTime=%wZ\n",
-            processName, name, &timeString);
-
-        // Free process name if it was allocated
-        if (processName != &defaultProcessName && processName->Buffer) {
-            ExFreePool(processName->Buffer);
-            ExFreePool(processName);
-        }
-    }
-}
-
-FLT_POSTOP_CALLBACK_STATUS
-PostOperationCallback(
-    _Inout_ PFLT_CALLBACK_DATA Data,
-    _In_ PCFLT_RELATED_OBJECTS FltObjects,
-    _In_opt_ PVOID CompletionContext,
-    _In_ FLT_POST_OPERATION_FLAGS Flags
-)
-{
-    UNREFERENCED_PARAMETER(FltObjects);
-    UNREFERENCED_PARAMETER(CompletionContext);
-    UNREFERENCED_PARAMETER(Flags);
-
-    PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
-    NTSTATUS status;
-    PFILE_DISPOSITION_INFORMATION dispInfo;
-
-    status = FltGetFileNameInformation(Data, 
-        FLT_FILE_NAME_OPENED | FLT_FILE_NAME_QUERY_DEFAULT, &nameInfo);
-    if (!NT_SUCCESS(status)) {
-        return FLT_POSTOP_FINISHED_PROCESSING;
-    }
-
-    if (!nameInfo->Name.Buffer) {
-        FltReleaseFileNameInformation(nameInfo);
-        return FLT_POSTOP_FINISHED_PROCESSING;
-    }
-
-    UNICODE_STRING filePath = nameInfo->Name;
-    BOOLEAN fileMatches = GetTrackedFile(&TrackedFiles, &filePath, NULL, NULL);
-
-    if (!fileMatches) {
-        DEBUG("FileLogger: %wZ is not being tracked.\n", &nameInfo->Name);
-        FltReleaseFileNameInformation(nameInfo);
-        return FLT_POSTOP_FINISHED_PROCESSING;
-    }
-
-    if (Data->Iopb->MajorFunction == IRP_MJ_SET_INFORMATION
-        && NT_SUCCESS(Data->IoStatus.Status)) {
-        dispInfo = Data->Iopb->Parameters.SetFileInformation.InfoBuffer;
-
-        if (dispInfo && dispInfo->DeleteFile) {
-            LogDeletion(&nameInfo->Name);
-        }
-    }
-
-    FltReleaseFileNameInformation(nameInfo);
-    return FLT_POSTOP_FINISHED_PROCESSING;
-}
-
-FLT_PREOP_CALLBACK_STATUS PreOperationCallback(
-    _Inout_ PFLT_CALLBACK_DATA Data,
-    _In_ PCFLT_RELATED_OBJECTS FltObjects,
-    _Flt_CompletionContext_Outptr_ PVOID* CompletionContext
-) {
-    UNREFERENCED_PARAMETER(FltObjects);
-    UNREFERENCED_PARAMETER(CompletionContext);
-
-    if (Data->Iopb->MajorFunction == IRP_MJ_SET_INFORMATION) {
-        PFILE_DISPOSITION_INFORMATION dispInfo = Data->Iopb->Parameters.SetFileInformation.InfoBuffer;
-        if (dispInfo && dispInfo->DeleteFile) {
-            PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
-            NTSTATUS status = FltGetFileNameInformation(Data, FLT_FILE_NAME_OPENED | FLT_FILE_NAME_QUERY_DEFAULT, &nameInfo);
-            if (NT_SUCCESS(status) && nameInfo->Name.Buffer) {
-                BOOLEAN protected = FALSE;
-                if (GetTrackedFile(&TrackedFiles, &nameInfo->Name, NULL, &protected) && protected) {
-                    LOG("FileTracker: Blocked deletion of protected file %wZ\n", &nameInfo->Name);
-                    FltReleaseFileNameInformation(nameInfo);
-                    Data->IoStatus.Status = STATUS_ACCESS_DENIED;
-                    return FLT_PREOP_COMPLETE;
-                }
-                FltReleaseFileNameInformation(nameInfo);
-            }
-        }
-    }
-
-    return FLT_PREOP_SUCCESS_WITH_CALLBACK;
-}
-
+const FLT_CONTEXT_REGISTRATION ContextRegistration[] = {
+    { FLT_STREAMHANDLE_CONTEXT, 0, NULL, sizeof(DECISION_CONTEXT), 'cDtL' },
+    { FLT_INSTANCE_CONTEXT, 0, NULL, sizeof(VOLUME_CONTEXT), 'cVtL' },
+    { FLT_CONTEXT_END }
+};
 
 const FLT_OPERATION_REGISTRATION Callbacks[] = {
-    //{ IRP_MJ_CREATE, 0, NULL, PostOperationCallback },
+    { IRP_MJ_CREATE, 0, PreCreateCallback, PostCreateCallback },
     { IRP_MJ_SET_INFORMATION, 0, PreOperationCallback, PostOperationCallback },
     //{ IRP_MJ_CLEANUP, 0, NULL, PostOperationCallback },
     { IRP_MJ_OPERATION_END }
@@ -151,12 +42,13 @@ FilterUnload(
 {
     UNREFERENCED_PARAMETER(Flags);
     DEBUG("FilterUnload called\n");
-    CleanupTrackedFiles(&TrackedFiles);
+    // Unregister first so no callback is still reading the table while it is torn down
     if (gFilterHandle) {
         FltUnregisterFilter(gFilterHandle);
         gFilterHandle = NULL;
         LOG("Filter unregistered\n");
     }
+    CleanupTrackedFiles(&TrackedFiles);
     return STATUS_SUCCESS;
 }
 
@@ -168,21 +60,27 @@ InstanceSetup(
     _In_ FLT_FILESYSTEM_TYPE VolumeFilesystemType
 )
 {
-    UNREFERENCED_PARAMETER(FltObjects);
     UNREFERENCED_PARAMETER(Flags);
     UNREFERENCED_PARAMETER(VolumeDeviceType);
     DEBUG("InstanceSetup called - FsType: %d\n", VolumeFilesystemType);
-    if (VolumeFilesystemType == FLT_FSTYPE_NTFS) {
-        return STATUS_SUCCESS;
+    if (VolumeFilesystemType != FLT_FSTYPE_NTFS) {
+        return STATUS_FLT_DO_NOT_ATTACH;
     }
-    return STATUS_FLT_DO_NOT_ATTACH;
+
+    // Rules may be added for the volume at any time, so the instance attaches either way; its context lets
+    // operations pass untouched for as long as the volume has none
+    NTSTATUS status = SetupVolumeDecision(FltObjects);
+    if (!NT_SUCCESS(status)) {
+        DEBUG("InstanceSetup: no volume context, 0x%08x\n", status);
+    }
+    return STATUS_SUCCESS;
 }
 
 const FLT_REGISTRATION FilterRegistration = {
     sizeof(FLT_REGISTRATION),
     FLT_REGISTRATION_VERSION,
     0,
-    NULL,
+    ContextRegistration,
     Callbacks,
     FilterUnload,
     InstanceSetup,
@@ -195,6 +93,148 @@ const FLT_REGISTRATION FilterRegistration = {
 };
 
 
+// The RuleImage value of the service's Parameters key: the image itself, or the NT path of a file holding it
+typedef struct _RULE_IMAGE_SOURCE {
+    PVOID Data;      ///< Copy of the value, null-terminated; 'mItL' nonpaged pool.
+    ULONG Size;      ///< Bytes in the value.
+    ULONG Type;      ///< REG_BINARY or REG_SZ.
+} RULE_IMAGE_SOURCE, *PRULE_IMAGE_SOURCE;
+
+static NTSTATUS
+RuleImageQueryRoutine(PWSTR ValueName, ULONG ValueType, PVOID ValueData, ULONG ValueLength, PVOID Context,
+    PVOID EntryContext)
+{
+    PRULE_IMAGE_SOURCE source = EntryContext;
+    UNREFERENCED_PARAMETER(ValueName);
+    UNREFERENCED_PARAMETER(Context);
+
+    // REG_EXPAND_SZ arrives expanded, as REG_SZ
+    if ((ValueType != REG_BINARY && ValueType != REG_SZ) || ValueLength == 0 || ValueLength > RULE_IMAGE_MAX_SIZE) {
+        return STATUS_OBJECT_TYPE_MISMATCH;
+    }
+    source->Data = ExAllocatePool2(POOL_FLAG_NON_PAGED, ValueLength + sizeof(WCHAR), 'mItL');
+    if (!source->Data) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlCopyMemory(source->Data, ValueData, ValueLength);
+    source->Size = ValueLength;
+    source->Type = ValueType;
+    return STATUS_SUCCESS;
+}
+
+// Reads a whole rule image file into nonpaged pool with a single read
+static NTSTATUS
+ReadRuleImageFile(PCWSTR Path, PVOID* Image, PULONG Size)
+{
+    UNICODE_STRING name;
+    OBJECT_ATTRIBUTES attributes;
+    IO_STATUS_BLOCK ioStatus;
+    FILE_STANDARD_INFORMATION info;
+    LARGE_INTEGER offset;
+    HANDLE file;
+    PVOID buffer = NULL;
+    NTSTATUS status;
+
+    *Image = NULL;
+    RtlInitUnicodeString(&name, Path);
+    InitializeObjectAttributes(&attributes, &name, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, NULL, NULL);
+    status = ZwCreateFile(&file, GENERIC_READ | SYNCHRONIZE, &attributes, &ioStatus, NULL, FILE_ATTRIBUTE_NORMAL,
+        FILE_SHARE_READ, FILE_OPEN, FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT | FILE_SEQUENTIAL_ONLY,
+        NULL, 0);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = ZwQueryInformationFile(file, &ioStatus, &info, sizeof(info), FileStandardInformation);
+    if (NT_SUCCESS(status) && (info.EndOfFile.QuadPart == 0 || info.EndOfFile.QuadPart > RULE_IMAGE_MAX_SIZE)) {
+        status = STATUS_INVALID_IMAGE_FORMAT;
+    }
+    if (NT_SUCCESS(status)) {
+        buffer = ExAllocatePool2(POOL_FLAG_NON_PAGED, info.EndOfFile.LowPart, 'mItL');
+        if (!buffer) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+    if (NT_SUCCESS(status)) {
+        offset.QuadPart = 0;
+        status = ZwReadFile(file, NULL, NULL, NULL, &ioStatus, buffer, info.EndOfFile.LowPart, &offset, NULL);
+        if (NT_SUCCESS(status) && ioStatus.Information != info.EndOfFile.LowPart) {
+            status = STATUS_END_OF_FILE;
+        }
+    }
+    ZwClose(file);
+
+    if (!NT_SUCCESS(status)) {
+        if (buffer) ExFreePoolWithTag(buffer, 'mItL');
+        return status;
+    }
+    *Image = buffer;
+    *Size = info.EndOfFile.LowPart;
+    return STATUS_SUCCESS;
+}
+
+// Loads the precompiled rules named by the RuleImage value, if there is one. A missing or bad image leaves the
+// driver running with the rules added at run time only.
+static VOID
+LoadRuleImage(PUNICODE_STRING RegistryPath)
+{
+    RTL_QUERY_REGISTRY_TABLE query[3];
+    RULE_IMAGE_SOURCE source = { 0 };
+    UNICODE_STRING path;
+    PVOID image;
+    ULONG size;
+    NTSTATUS status;
+
+    // RtlQueryRegistryValues takes a null-terminated path, which RegistryPath need not be
+    path.Length = 0;
+    path.MaximumLength = RegistryPath->Length + sizeof(WCHAR);
+    path.Buffer = ExAllocatePool2(POOL_FLAG_PAGED, path.MaximumLength, 'mItL');
+    if (!path.Buffer) {
+        return;
+    }
+    RtlCopyUnicodeString(&path, RegistryPath);
+
+    RtlZeroMemory(query, sizeof(query));
+    query[0].Flags = RTL_QUERY_REGISTRY_SUBKEY;
+    query[0].Name = L"Parameters";
+    query[1].QueryRoutine = RuleImageQueryRoutine;
+    query[1].Name = L"RuleImage";
+    query[1].EntryContext = &source;
+
+    status = RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE, path.Buffer, query, NULL, NULL);
+    ExFreePoolWithTag(path.Buffer, 'mItL');
+    if (!NT_SUCCESS(status) || !source.Data) {
+        if (source.Data) ExFreePoolWithTag(source.Data, 'mItL');
+        DEBUG("driverFlt: No rule image in the registry, status: 0x%08x\n", status);
+        return;
+    }
+
+    if (source.Type == REG_BINARY) {
+        image = source.Data;
+        size = source.Size;
+    }
+    else {
+        status = ReadRuleImageFile(source.Data, &image, &size);
+        if (!NT_SUCCESS(status)) {
+            LOG("driverFlt: Failed to read rule image %ws, 0x%08x\n", (PCWSTR)source.Data, status);
+            ExFreePoolWithTag(source.Data, 'mItL');
+            return;
+        }
+        ExFreePoolWithTag(source.Data, 'mItL');
+    }
+
+    // The table owns the image once it is loaded
+    status = LoadTrackedFilesImage(&TrackedFiles, image, size);
+    if (!NT_SUCCESS(status)) {
+        LOG("driverFlt: Failed to load rule image, 0x%08x\n", status);
+        ExFreePoolWithTag(image, 'mItL');
+        return;
+    }
+    LOG("driverFlt: Loaded rule image with %lu names and %lu directories\n",
+        TrackedFiles.Image->View.Header->NameCount, TrackedFiles.Image->View.Header->DirectoryCount);
+}
+
+
 // Driver unload routine
 VOID DriverUnload(
     _In_ PDRIVER_OBJECT DriverObject
@@ -204,6 +244,7 @@ VOID DriverUnload(
     UNICODE_STRING symlinkName;
     LOG("driverFlt: Driver unload routine.");
     IoctlClear();
+    CleanupProcessCache();
     RtlInitUnicodeString(&symlinkName, SYMLINK_NAME);
 
     IoDeleteSymbolicLink(&symlinkName);
@@ -212,7 +253,10 @@ VOID DriverUnload(
         IoDeleteDevice(gDeviceObject);
     }
 
-    CleanupTrackedFiles(&TrackedFiles);
+    CleanupPerfStats();
+    // The device is gone, so no IOCTL can reach the table's read sections any more
+    DeleteTrackedFiles(&TrackedFiles);
+    CleanupCallbacks();
     LOG("driverFlt: Driver unloaded.");
 }
 
@@ -225,24 +269,61 @@ DriverEntry(
 {
     NTSTATUS status;
     UNICODE_STRING deviceName;
+    UNICODE_STRING deviceSddl;
     UNICODE_STRING symlinkName;
 
     DEBUG("DriverEntry: Starting\n");
-    UNREFERENCED_PARAMETER(RegistryPath);
 
     status = InitializeTrackedFiles(&TrackedFiles);
     if (!NT_SUCCESS(status)) {
         DEBUG("InitializeTrackedFiles failed, 0x%08x\n", status);
         return status;
     }
+    LoadRuleImage(RegistryPath);
+
+    status = InitializeCallbacks();
+    if (!NT_SUCCESS(status)) {
+        DEBUG("InitializeCallbacks failed, 0x%08x\n", status);
+        DeleteTrackedFiles(&TrackedFiles);
+        return status;
+    }
+
+    // Names are still resolved without the exit notification, exited processes just linger until evicted
+    status = InitializeProcessCache();
+    if (!NT_SUCCESS(status)) {
+        LOG("driverFlt: Process exit notification unavailable, 0x%08x\n", status);
+    }
+
+    // Without the per-processor slots the driver runs as before and reports no counters
+    status = InitializePerfStats();
+    if (!NT_SUCCESS(status)) {
+        LOG("driverFlt: Performance counters unavailable, 0x%08x\n", status);
+    }
+
+    // The message queue must exist before the first IOCTL or deletion can reach it
+    status = IoctlInit(RegistryPath);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("driverFlt: Failed to create comm port: 0x%08x\n", status);
+        IoctlClear();
+        CleanupProcessCache();
+        CleanupPerfStats();
+        DeleteTrackedFiles(&TrackedFiles);
+        CleanupCallbacks();
+        return status;
+    }
     
-    // Create device object
+    // Create device object; only SYSTEM and administrators may open it for writing
     RtlInitUnicodeString(&deviceName, DEVICE_NAME);
-    status = IoCreateDevice(DriverObject, 0, &deviceName, FILE_DEVICE_UNKNOWN, 
-            0, FALSE, &gDeviceObject);
+    RtlInitUnicodeString(&deviceSddl, DEVICE_SDDL);
+    status = IoCreateDeviceSecure(DriverObject, 0, &deviceName, FILE_DEVICE_UNKNOWN,
+            0, FALSE, &deviceSddl, &DeviceClassGuid, &gDeviceObject);
     if (!NT_SUCCESS(status)) {
         LOG("driverFlt: Failed to create device, 0x%08x\n", status);
-        CleanupTrackedFiles(&TrackedFiles);
+        IoctlClear();
+        CleanupProcessCache();
+        CleanupPerfStats();
+        DeleteTrackedFiles(&TrackedFiles);
+        CleanupCallbacks();
         return status;
     }
 
@@ -252,18 +333,31 @@ DriverEntry(
     if (!NT_SUCCESS(status)) {
         LOG("driverFlt: Failed to create symlink, 0x%08x\n", status);
         IoDeleteDevice(gDeviceObject);
-        CleanupTrackedFiles(&TrackedFiles);
+        IoctlClear();
+        CleanupProcessCache();
+        CleanupPerfStats();
+        DeleteTrackedFiles(&TrackedFiles);
+        CleanupCallbacks();
         return status;
     }
 
     // Set up dispatch routines
     DriverObject->MajorFunction[IRP_MJ_CREATE] = IoctlCreateDispatch;
+    DriverObject->MajorFunction[IRP_MJ_CLEANUP] = IoctlCleanupDispatch;
     DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = IoctlControl;
     DriverObject->DriverUnload = DriverUnload;
 
     status = FltRegisterFilter(DriverObject, &FilterRegistration, &gFilterHandle);
     if (!NT_SUCCESS(status)) {
         DEBUG("driverFlt: FltRegisterFilter failed, 0x%08x\n", status);
+        // The process notification must not outlive the driver
+        IoDeleteSymbolicLink(&symlinkName);
+        IoDeleteDevice(gDeviceObject);
+        IoctlClear();
+        CleanupProcessCache();
+        CleanupPerfStats();
+        DeleteTrackedFiles(&TrackedFiles);
+        CleanupCallbacks();
         return status;
     }
     DEBUG("Filter registered\n");
@@ -273,18 +367,16 @@ DriverEntry(
         DEBUG("FltStartFiltering failed: 0x%08x\n", status);
         FltUnregisterFilter(gFilterHandle);
         gFilterHandle = NULL;
-        return status;
-    }
-    LOG("Filter started\n");
-    
-    status = IoctlInit();
-    if (!NT_SUCCESS(status)) {
-        DbgPrint("driverFlt: Failed to create comm port: 0x%08x\n", status);
         IoDeleteSymbolicLink(&symlinkName);
         IoDeleteDevice(gDeviceObject);
-        CleanupTrackedFiles(&TrackedFiles);
+        IoctlClear();
+        CleanupProcessCache();
+        CleanupPerfStats();
+        DeleteTrackedFiles(&TrackedFiles);
+        CleanupCallbacks();
         return status;
     }
+    LOG("Filter started\n");
     
     return STATUS_SUCCESS;
 }
\ No newline at end of file
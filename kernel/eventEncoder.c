@@ -0,0 +1,290 @@
+#include <fltKernel.h>
+#include <dontuse.h>
+#include "eventEncoder.h"
+
+
+C_ASSERT(DELETE_MESSAGE_MAX_STRING_ID == INTERN_TABLE_MAX_STRINGS);
+
+// A string of a message: sent in full, or only by id once the consumer has it
+typedef struct _MESSAGE_STRING {
+    UNICODE_STRING Text;
+    ULONG Hash;
+    USHORT Id;                  // Id in the current epoch, or 0 if the string is not interned
+    BOOLEAN Inline;             // Sent in full; a message sending an interned string in full defines its id
+} MESSAGE_STRING, * PMESSAGE_STRING;
+
+// The process name, then the directory of the path
+#define MESSAGE_STRING_COUNT 2
+
+NTSTATUS
+InitializeEventStrings(PEVENT_STRINGS Strings)
+{
+    Strings->Queue = NULL;
+    Strings->Overwritten = 0;
+    Strings->Reader = NULL;
+    return InitializeInternTable(&Strings->Table);
+}
+
+VOID
+CleanupEventStrings(PEVENT_STRINGS Strings)
+{
+    CleanupInternTable(&Strings->Table);
+}
+
+static BOOLEAN
+IsInternable(PMESSAGE_STRING Name)
+{
+    return Name->Text.Length != 0 && Name->Text.Length <= INTERN_MAX_STRING_LENGTH;
+}
+
+// Hashed here, before anything is looked up
+static VOID
+InitMessageString(PMESSAGE_STRING Name, PWCH Buffer, USHORT Length)
+{
+    Name->Text.Buffer = Buffer;
+    Name->Text.Length = Length;
+    Name->Text.MaximumLength = Length;
+    Name->Hash = IsInternable(Name) ? HashInternString(&Name->Text) : 0;
+    Name->Id = 0;
+    Name->Inline = TRUE;
+}
+
+// Starts a new epoch for definitions sent to Queue. Must be called with Table.Lock held. The epoch changes
+// first, so a lookup that sees the new queue also sees the new epoch.
+static VOID
+ResetEventStringsLocked(PEVENT_STRINGS Strings, PCIRCULAR_QUEUE Queue)
+{
+    ResetInternTable(&Strings->Table);
+    WriteNoFence64(&Strings->Overwritten, Queue ? ReadNoFence64(&Queue->Overwritten) : 0);
+    WritePointerNoFence((PVOID volatile*)&Strings->Queue, Queue);
+}
+
+// Whether definitions of the current epoch may have missed the consumer of Queue: they went to another queue,
+// or were overwritten in this one
+static BOOLEAN
+IsEpochStale(PEVENT_STRINGS Strings, PCIRCULAR_QUEUE Queue)
+{
+    return ReadPointerNoFence((PVOID const volatile*)&Strings->Queue) != Queue
+        || ReadNoFence64(&Queue->Overwritten) != ReadNoFence64(&Strings->Overwritten);
+}
+
+// Looks the strings up among the published ones, without a lock; returns FALSE if one is missing or the epoch
+// does not fit Queue
+static BOOLEAN
+FindMessageStrings(PEVENT_STRINGS Strings, PCIRCULAR_QUEUE Queue, PMESSAGE_STRING Names, ULONG Count)
+{
+    if (IsEpochStale(Strings, Queue)) {
+        return FALSE;
+    }
+
+    for (ULONG i = 0; i < Count; i++) {
+        if (IsInternable(&Names[i])) {
+            Names[i].Id = LookupInternedString(&Strings->Table, &Names[i].Text, Names[i].Hash);
+            if (!Names[i].Id) {
+                return FALSE;
+            }
+            Names[i].Inline = FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Interns the strings the current epoch lacks; returns FALSE if it is full. Must be called with Table.Lock held.
+static BOOLEAN
+DefineMessageStrings(PEVENT_STRINGS Strings, PMESSAGE_STRING Names, ULONG Count)
+{
+    for (ULONG i = 0; i < Count; i++) {
+        Names[i].Id = 0;
+        Names[i].Inline = TRUE;
+        if (!IsInternable(&Names[i])) {
+            continue;
+        }
+
+        Names[i].Id = FindInternedString(&Strings->Table, &Names[i].Text, Names[i].Hash);
+        if (Names[i].Id) {
+            Names[i].Inline = FALSE;
+            continue;
+        }
+
+        Names[i].Id = InternString(&Strings->Table, &Names[i].Text, Names[i].Hash);
+        if (!Names[i].Id) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Reserves a message sending the strings marked Inline in full, and writes its names
+static PDELETE_MESSAGE
+WriteDeleteMessage(PCIRCULAR_QUEUE Queue, PMESSAGE_STRING Names, PCWCH FileName, USHORT FileNameLength, ULONG Flags,
+    ULONG Epoch, PQUEUE_RESERVATION Reservation)
+{
+    USHORT processNameLength = Names[0].Inline ? Names[0].Text.Length : 0;
+    USHORT directoryLength = Names[1].Inline ? Names[1].Text.Length : 0;
+    ULONG size = DELETE_MESSAGE_HEADER_SIZE + processNameLength + directoryLength + FileNameLength;
+
+    PDELETE_MESSAGE message = (PDELETE_MESSAGE)BeginEnqueue(Queue, size, Flags, Reservation);
+    if (!message) {
+        return NULL;
+    }
+
+    // The names sent in full go back to back
+    message->Size = size;
+    message->StringEpoch = Epoch;
+    message->ProcessNameId = Names[0].Id;
+    message->DirectoryId = Names[1].Id;
+    message->ProcessNameLength = processNameLength;
+    message->DirectoryLength = directoryLength;
+    message->FileNameLength = FileNameLength;
+    PUCHAR names = (PUCHAR)message->Names;
+    if (processNameLength) RtlCopyMemory(names, Names[0].Text.Buffer, processNameLength);
+    names += processNameLength;
+    if (directoryLength) RtlCopyMemory(names, Names[1].Text.Buffer, directoryLength);
+    names += directoryLength;
+    if (FileNameLength) RtlCopyMemory(names, FileName, FileNameLength);
+    return message;
+}
+
+PDELETE_MESSAGE
+ReserveDeleteMessage(PEVENT_STRINGS Strings, PCIRCULAR_QUEUE Queue, PCUNICODE_STRING ProcessName,
+    PCUNICODE_STRING Path, ULONG Flags, PQUEUE_RESERVATION Reservation)
+{
+    MESSAGE_STRING names[MESSAGE_STRING_COUNT];
+    PDELETE_MESSAGE message;
+    KIRQL oldIrql;
+
+    // Only the path is shortened, and only if it would not fit in the ring at all
+    ULONG maxNames = QueueMaxRecordLength(Queue) - DELETE_MESSAGE_HEADER_SIZE;
+    USHORT processLength = (USHORT)min(ProcessName->Length, (maxNames / 2) & ~1UL);
+    USHORT pathLength = (USHORT)min(Path->Length, (maxNames - processLength) & ~1UL);
+
+    // The directory repeats across a bulk deletion and is interned like the process name; the file name is always sent
+    USHORT directoryLength = pathLength;
+    while (directoryLength && Path->Buffer[directoryLength / sizeof(WCHAR) - 1] != L'\\') {
+        directoryLength -= sizeof(WCHAR);
+    }
+    PCWCH fileName = Path->Buffer + directoryLength / sizeof(WCHAR);
+    USHORT fileNameLength = pathLength - directoryLength;
+    InitMessageString(&names[0], ProcessName->Buffer, processLength);
+    InitMessageString(&names[1], Path->Buffer, directoryLength);
+
+    // A message referring only to published ids takes no lock, so producers only meet at the queue's tail. If the
+    // epoch is still the same once the message is reserved, the message is ahead of the next reset and of every
+    // definition of the next epoch, so its ids cannot have been given to other strings.
+    LONG epoch = ReadAcquire(&Strings->Table.Epoch);
+    if (FindMessageStrings(Strings, Queue, names, ARRAYSIZE(names))) {
+        message = WriteDeleteMessage(Queue, names, fileName, fileNameLength, Flags, (ULONG)epoch, Reservation);
+        if (!message || ReadAcquire(&Strings->Table.Epoch) == epoch) {
+            return message;
+        }
+
+        // A reset got in between; the space is skipped as filler and the strings are defined again
+        CancelEnqueue(Queue, Reservation);
+    }
+
+    // Definitions are serialized, and published only once the message carrying them is reserved, so every message
+    // that finds them lands behind it
+    KeAcquireSpinLock(&Strings->Table.Lock, &oldIrql);
+    if (IsEpochStale(Strings, Queue)) {
+        ResetEventStringsLocked(Strings, Queue);
+    }
+
+    ULONG mark = Strings->Table.Count;
+    if (!DefineMessageStrings(Strings, names, ARRAYSIZE(names))) {
+        // The epoch is full; an empty one has room for any message
+        ResetEventStringsLocked(Strings, Queue);
+        mark = 0;
+        DefineMessageStrings(Strings, names, ARRAYSIZE(names));
+    }
+
+    message = WriteDeleteMessage(Queue, names, fileName, fileNameLength, Flags, (ULONG)Strings->Table.Epoch,
+        Reservation);
+    if (message) {
+        PublishInternedStrings(&Strings->Table);
+    }
+    else {
+        // Ids defined by a dropped message were never sent
+        UnwindInternTable(&Strings->Table, mark);
+    }
+    KeReleaseSpinLock(&Strings->Table.Lock, oldIrql);
+    return message;
+}
+
+NTSTATUS
+QueueDeleteMessage(PEVENT_STRINGS Strings, PCIRCULAR_QUEUE Queue, PCUNICODE_STRING ProcessName, HANDLE ProcessId,
+    LONG64 ProcessCreateTime, PCUNICODE_STRING Path, LONG Operation, BOOLEAN Denied)
+{
+    QUEUE_RESERVATION reservation;
+    LARGE_INTEGER systemTime;
+    ULONG64 qpcTimeStamp;
+
+    // Under QueuePreferPriority a denied operation may overwrite older messages, an audited one may not
+    PDELETE_MESSAGE message = ReserveDeleteMessage(Strings, Queue, ProcessName, Path,
+        Denied ? QUEUE_ENQUEUE_PRIORITY : 0, &reservation);
+    if (!message) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // Numbering a message by its position costs no shared write
+    message->MessageId = DeleteMessageIdAt(reservation.Position);
+    message->Flags = (Denied ? DELETE_MESSAGE_DENIED : 0) | ((ULONG)Operation << DELETE_MESSAGE_OPERATION_SHIFT);
+    message->ProcessId = HandleToULong(ProcessId);
+    message->ProcessCreateTime = ProcessCreateTime;
+
+    // Raw clock readings; converting to local time and formatting is left to the consumer
+    KeQuerySystemTime(&systemTime);
+    message->SystemTime = systemTime.QuadPart;
+    message->InterruptTime = KeQueryInterruptTimePrecise(&qpcTimeStamp);
+
+    EndEnqueue(Queue, &reservation);
+    return STATUS_SUCCESS;
+}
+
+ULONG
+DeleteMessageIdAt(LONG64 Position)
+{
+    ULONG id = (ULONG)(Position / QUEUE_RECORD_ALIGNMENT) + 1;
+    return id ? id : 1;
+}
+
+VOID
+DetachEventStrings(PEVENT_STRINGS Strings, PCIRCULAR_QUEUE Queue)
+{
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&Strings->Table.Lock, &oldIrql);
+    if (Strings->Queue == Queue) {
+        ResetEventStringsLocked(Strings, NULL);
+    }
+    KeReleaseSpinLock(&Strings->Table.Lock, oldIrql);
+}
+
+VOID
+SetEventStringsReader(PEVENT_STRINGS Strings, PVOID Reader)
+{
+    KIRQL oldIrql;
+
+    // Every read request checks; only a change of reader takes the lock
+    if (ReadPointerNoFence((PVOID const volatile*)&Strings->Reader) == Reader) {
+        return;
+    }
+
+    KeAcquireSpinLock(&Strings->Table.Lock, &oldIrql);
+    if (Strings->Reader != Reader) {
+        ResetEventStringsLocked(Strings, NULL);
+        WritePointerNoFence((PVOID volatile*)&Strings->Reader, Reader);
+    }
+    KeReleaseSpinLock(&Strings->Table.Lock, oldIrql);
+}
+
+VOID
+ReleaseEventStringsReader(PEVENT_STRINGS Strings, PVOID Reader)
+{
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&Strings->Table.Lock, &oldIrql);
+    if (Strings->Reader == Reader) {
+        WritePointerNoFence((PVOID volatile*)&Strings->Reader, NULL);
+    }
+    KeReleaseSpinLock(&Strings->Table.Lock, oldIrql);
+}
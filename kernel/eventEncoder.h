@@ -0,0 +1,108 @@
+#pragma once
+#include <fltKernel.h>
+#include <dontuse.h>
+#include "circularQ.h"
+#include "eventMessage.h"
+#include "internTable.h"
+
+/**
+ * @struct _EVENT_STRINGS
+ * @brief The string epoch of a message stream, see eventMessage.h, and where its definitions went.
+ *
+ * An epoch belongs to one queue and one reader: every message sent by id follows the one defining it in that
+ * queue, unless the definition was overwritten meanwhile, which makes the next definition start a new epoch.
+ * Messages that only refer to published ids are reserved without a lock; Table.Lock serializes the messages
+ * defining new ids, from interning them until the message is reserved, and every change of Queue and Reader.
+ */
+typedef struct _EVENT_STRINGS {
+    INTERN_TABLE Table;                     ///< Ids of the current epoch.
+    PCIRCULAR_QUEUE volatile Queue;         ///< Queue the definitions of the current epoch went to, or NULL.
+    volatile LONG64 Overwritten;            ///< Its overwrite count when the epoch started.
+    PVOID volatile Reader;                  ///< Handle the messages are read through, or NULL.
+} EVENT_STRINGS, *PEVENT_STRINGS;
+
+/**
+ * @brief Allocates the intern table and starts the first epoch.
+ *
+ * @param[out] Strings The state to initialize.
+ * @return NTSTATUS STATUS_SUCCESS, or STATUS_INSUFFICIENT_RESOURCES.
+ */
+NTSTATUS InitializeEventStrings(PEVENT_STRINGS Strings);
+
+/**
+ * @brief Frees the intern table. No message may be reserved afterwards.
+ *
+ * @param[in,out] Strings The state to clean up; may have failed to initialize.
+ */
+VOID CleanupEventStrings(PEVENT_STRINGS Strings);
+
+/**
+ * @brief Reserves a deletion message in Queue and writes its names: the process name and the directory of Path
+ *        by id if the current epoch has published them, in full otherwise, and the file name always in full.
+ *
+ * Fills in Size, StringEpoch, the string ids, the name lengths and Names. The caller fills in the other fields
+ * and publishes the message with EndEnqueue. The path is shortened only if the message would not fit in the
+ * queue at all. Callable at IRQL <= DISPATCH_LEVEL.
+ *
+ * @param[in,out] Strings The stream's string state.
+ * @param[in] Queue The queue to reserve the message in.
+ * @param[in] ProcessName Image name of the process performing the operation.
+ * @param[in] Path Path of the file.
+ * @param[in] Flags BeginEnqueue flags.
+ * @param[out] Reservation Receives the state EndEnqueue needs.
+ * @return PDELETE_MESSAGE The message, or NULL if the queue dropped it.
+ */
+PDELETE_MESSAGE ReserveDeleteMessage(PEVENT_STRINGS Strings, PCIRCULAR_QUEUE Queue, PCUNICODE_STRING ProcessName,
+    PCUNICODE_STRING Path, ULONG Flags, PQUEUE_RESERVATION Reservation);
+
+/**
+ * @brief Queues a complete deletion message: reserves it with ReserveDeleteMessage, numbers it by its position,
+ *        stamps it with the current time and publishes it. Callable at IRQL <= DISPATCH_LEVEL.
+ *
+ * @param[in,out] Strings The stream's string state.
+ * @param[in] Queue The queue to put the message in.
+ * @param[in] ProcessName Image name of the process performing the operation.
+ * @param[in] ProcessId ID of that process.
+ * @param[in] ProcessCreateTime Creation time of that process.
+ * @param[in] Path Path of the file.
+ * @param[in] Operation RULE_OP_* operation performed.
+ * @param[in] Denied Whether the operation was denied; a denied operation is queued with QUEUE_ENQUEUE_PRIORITY.
+ * @return NTSTATUS STATUS_SUCCESS, or STATUS_INSUFFICIENT_RESOURCES if the queue dropped the message.
+ */
+NTSTATUS QueueDeleteMessage(PEVENT_STRINGS Strings, PCIRCULAR_QUEUE Queue, PCUNICODE_STRING ProcessName,
+    HANDLE ProcessId, LONG64 ProcessCreateTime, PCUNICODE_STRING Path, LONG Operation, BOOLEAN Denied);
+
+/**
+ * @brief Returns the id of the message at a queue position. Ids increase in queue order, skip the sizes of the
+ *        records in between, and wrap around after 64 GB of records without ever being 0.
+ *
+ * @param[in] Position Queue position of the record, such as the queue's Tail for the next message.
+ * @return ULONG The message id.
+ */
+ULONG DeleteMessageIdAt(LONG64 Position);
+
+/**
+ * @brief Starts a new epoch if the current one belongs to Queue. Called before a queue is freed, so that one
+ *        allocated at the same address cannot inherit its definitions.
+ *
+ * @param[in,out] Strings The stream's string state.
+ * @param[in] Queue The queue about to be freed.
+ */
+VOID DetachEventStrings(PEVENT_STRINGS Strings, PCIRCULAR_QUEUE Queue);
+
+/**
+ * @brief Notes that messages are read through Reader, and starts a new epoch if they were read through another
+ *        handle before: that reader took the definitions sent so far with it. Cheap if Reader is unchanged.
+ *
+ * @param[in,out] Strings The stream's string state.
+ * @param[in] Reader The handle, a FILE_OBJECT in the driver.
+ */
+VOID SetEventStringsReader(PEVENT_STRINGS Strings, PVOID Reader);
+
+/**
+ * @brief Forgets Reader if messages are read through it, when it is closed. The next reader starts a new epoch.
+ *
+ * @param[in,out] Strings The stream's string state.
+ * @param[in] Reader The handle being closed.
+ */
+VOID ReleaseEventStringsReader(PEVENT_STRINGS Strings, PVOID Reader);
@@ -0,0 +1,67 @@
+/**
+ * @file eventMessage.h
+ * @brief Layout of the deletion messages the driver queues, and of their interned strings.
+ *
+ * Shared between the driver and its user-mode consumers, so it only uses the base types
+ * (ULONG, USHORT, WCHAR) that both <ntddk.h> and <windows.h> define; include one of those first.
+ *
+ * The process name and the directory of the path repeat across a bulk deletion, so each is sent
+ * in full once per string epoch, together with a small id, and by id alone afterwards:
+ *   - A message sending a string in full with a nonzero id defines that id in its epoch.
+ *   - A message sending only an id refers to the definition; it always follows the definition in
+ *     queue order, but the definition may have been lost with records dropped before it.
+ *   - A message of a newer epoch invalidates every id of the older ones. Epochs only grow, with
+ *     wraparound, and ids restart from 1 in each.
+ * The file name is always sent in full. A consumer that cannot resolve an id only loses that
+ * string, never reads a wrong one.
+ */
+
+#pragma once
+
+#pragma pack(push, 1)
+/**
+ * @struct _DELETE_MESSAGE
+ * @brief One operation on a tracked file, as queued by the driver.
+ */
+typedef struct _DELETE_MESSAGE {
+    ULONG Size;                 ///< Bytes in the whole message, names included.
+    ULONG MessageId;            ///< Never 0; a record with id 0 is a QUEUE_GAP_MARKER.
+    LONG64 SystemTime;          ///< UTC, in 100ns units since 1601, as returned by KeQuerySystemTime.
+    ULONG64 InterruptTime;      ///< 100ns units since boot, unaffected by clock changes; orders and spaces events precisely.
+    LONG64 ProcessCreateTime;   ///< With ProcessId, identifies the deleting process even after its ID is reused.
+    ULONG ProcessId;
+    ULONG Flags;                ///< DELETE_MESSAGE_DENIED or 0, and the RULE_OP_* above DELETE_MESSAGE_OPERATION_SHIFT.
+    ULONG StringEpoch;          ///< Epoch of the string ids below.
+    USHORT ProcessNameId;       ///< Id of the process name, or 0 if it is not interned.
+    USHORT DirectoryId;         ///< Id of the directory of the file path, or 0 if it is not interned.
+    USHORT ProcessNameLength;   ///< Bytes of the process name in Names; 0 if it is only sent by id.
+    USHORT DirectoryLength;     ///< Bytes of the directory, trailing backslash included, following it; 0 if only sent by id.
+    USHORT FileNameLength;      ///< Bytes of the last component of the file path, following the directory.
+    WCHAR Names[ANYSIZE_ARRAY]; ///< The names sent in full, back to back, none null-terminated.
+} DELETE_MESSAGE, * PDELETE_MESSAGE;
+#pragma pack(pop)
+
+/**
+ * @def DELETE_MESSAGE_HEADER_SIZE
+ * @brief Bytes of a message before its names.
+ */
+#define DELETE_MESSAGE_HEADER_SIZE FIELD_OFFSET(DELETE_MESSAGE, Names)
+
+/**
+ * @def DELETE_MESSAGE_DENIED
+ * @brief Flag: the operation was blocked because the file's rule denies it.
+ */
+#define DELETE_MESSAGE_DENIED 0x1
+
+/**
+ * @def DELETE_MESSAGE_OPERATION_SHIFT
+ * @brief Position of the operation's RULE_OP_* in Flags; RULE_OP_DELETE is 0, so consumers that predate it read
+ *        deletions.
+ */
+#define DELETE_MESSAGE_OPERATION_SHIFT 8
+
+/**
+ * @def DELETE_MESSAGE_MAX_STRING_ID
+ * @brief Highest string id the driver hands out in one epoch, INTERN_TABLE_MAX_STRINGS.
+ */
+#define DELETE_MESSAGE_MAX_STRING_ID 1024
@@ -1,101 +1,935 @@
 #include <fltKernel.h>
 #include <dontuse.h>
 #include "fileList.h"
+#include "foldedName.h"
+#include "perfStats.h"
 
 
-// Initialization function
-NTSTATUS InitializeTrackedFiles(PTRACKED_FILES TrackedFilesList)
+// FNV-1a over the upcased characters, so names differing only in case land in the same bucket. Folded says
+// FileName is upcased already.
+static ULONG
+HashFileName(PCUNICODE_STRING FileName, BOOLEAN Folded)
+{
+    ULONG hash = 2166136261u;
+    USHORT count = FileName->Length / sizeof(WCHAR);
+
+    for (USHORT i = 0; i < count; i++) {
+        WCHAR ch = Folded ? FileName->Buffer[i] : RtlUpcaseUnicodeChar(FileName->Buffer[i]);
+        hash = (hash ^ (ch & 0xFF)) * 16777619u;
+        hash = (hash ^ (ch >> 8)) * 16777619u;
+    }
+    return hash;
+}
+
+// RULE_* bits of a rule of the image. Images compiled before rules named operations only mark protected rules.
+static LONG
+ImageOperations(USHORT Flags)
+{
+    LONG operations = RULE_DEFAULT | ((Flags & RULE_IMAGE_PROTECTED) ? RULE_DENY(RULE_OP_DELETE) : 0);
+    if (Flags & RULE_IMAGE_OPERATIONS) {
+        operations = (Flags >> RULE_IMAGE_OPERATIONS_SHIFT) & RULE_ALL;
+    }
+    return operations ? operations : RULE_DEFAULT;
+}
+
+// Looks a name up in the rule image, if one is loaded, and returns its RULE_* bits or 0. Folded says FilePath is
+// upcased already.
+static LONG
+ImageLookup(PTRACKED_FILES_IMAGE Image, PCUNICODE_STRING FilePath, BOOLEAN Folded)
+{
+    USHORT flags;
+    if (!Image || !RuleImageLookup(&Image->View, FilePath->Buffer, FilePath->Length, Folded ? NULL : FoldNameChar, &flags)) {
+        return 0;
+    }
+    return ImageOperations(flags);
+}
+
+// Points String at the path of an entry of the image
+static VOID
+ImageString(PTRACKED_FILES_IMAGE Image, const RULE_IMAGE_ENTRY* Entry, PUNICODE_STRING String)
+{
+    String->Buffer = (PWCH)(Image->View.Strings + Entry->StringOffset);
+    String->Length = String->MaximumLength = Entry->Length;
+}
+
+static VOID
+FreeImage(PTRACKED_FILES_IMAGE Image)
+{
+    if (Image) {
+        ExFreePool(Image->Data);
+        ExFreePool(Image);
+    }
+}
+
+static PTRACKED_FILES_TABLE
+AllocateTable(ULONG BucketCount)
+{
+    // POOL_FLAG_NON_PAGED zeroes the allocation, so every bucket starts out empty
+    return ExAllocatePool2(POOL_FLAG_NON_PAGED,
+        FIELD_OFFSET(TRACKED_FILES_TABLE, Buckets) + BucketCount * sizeof(PTRACKED_FILE_ENTRY), 'kFtL');
+}
+
+static PTRACKED_FILE_ENTRY*
+BucketOf(PTRACKED_FILES_TABLE Table, ULONG Hash)
+{
+    return &Table->Buckets[Hash & (Table->BucketCount - 1)];
+}
+
+// Entries hold upcased names, so an upcased FilePath is compared as plain data; Folded says it is one
+static PTRACKED_FILE_ENTRY
+FindEntry(PTRACKED_FILES_TABLE Table, PCUNICODE_STRING FilePath, ULONG Hash, BOOLEAN Folded)
+{
+    PTRACKED_FILE_ENTRY fileEntry = ReadPointerAcquire((PVOID*)BucketOf(Table, Hash));
+    while (fileEntry) {
+        if (fileEntry->Hash == Hash && (Folded
+            ? FoldedNamesEqual(FilePath, &fileEntry->FileName)
+            : RtlEqualUnicodeString(FilePath, &fileEntry->FileName, TRUE))) {
+            return fileEntry;
+        }
+        fileEntry = ReadPointerAcquire((PVOID*)&fileEntry->Next);
+    }
+    return NULL;
+}
+
+// Waits until every reader that might still see memory unlinked before this call has left its read section.
+// New readers are steered to the other reference first, so the wait only covers readers already in flight.
+// Must be called with WriteLock held.
+static VOID
+SynchronizeReadersLocked(PTRACKED_FILES TrackedFilesList)
+{
+    LONG old = TrackedFilesList->ActiveReaders;
+    InterlockedExchange(&TrackedFilesList->ActiveReaders, old ^ 1);
+    ExWaitForRundownProtectionReleaseCacheAware(TrackedFilesList->Readers[old]);
+    ExReInitializeRundownProtectionCacheAware(TrackedFilesList->Readers[old]);
+}
+
+// Adds Sign times Rules, a count per RULE_* bit, to the rules having each bit, and republishes the bits some rule
+// has. Must be called with WriteLock held.
+static VOID
+AddOperationRulesLocked(PTRACKED_FILES TrackedFilesList, const LONG* Rules, LONG Sign)
+{
+    LONG operations = 0;
+    for (ULONG bit = 0; bit < RULE_BIT_COUNT; bit++) {
+        TrackedFilesList->OperationRules[bit] += Sign * Rules[bit];
+        if (TrackedFilesList->OperationRules[bit] > 0) operations |= 1 << bit;
+    }
+    WriteRelease(&TrackedFilesList->Operations, operations);
+}
+
+// Counts a rule with RULE_* bits Operations into Rules
+static VOID
+CountOperations(LONG Operations, PLONG Rules)
+{
+    for (ULONG bit = 0; bit < RULE_BIT_COUNT; bit++) {
+        if (Operations & (1 << bit)) Rules[bit]++;
+    }
+}
+
+// Counts a rule in or out on its volume and in the operation summary. Must be called with WriteLock held; count a
+// rule in before it is published and out after it is unpublished, so neither count says less than readers can find.
+static VOID
+CountRuleLocked(PTRACKED_FILES TrackedFilesList, PCUNICODE_STRING Path, LONG Operations, LONG Delta)
+{
+    LONG rules[RULE_BIT_COUNT] = { 0 };
+    CountOperations(Operations, rules);
+    VolumeRulesAdd(&TrackedFilesList->Volumes, Path, Delta);
+    AddOperationRulesLocked(TrackedFilesList, rules, Delta);
+}
+
+// Must be called with WriteLock held, after the change has been published
+static VOID
+RulesChangedLocked(PTRACKED_FILES TrackedFilesList)
+{
+    InterlockedIncrement64(&TrackedFilesList->Generation);
+}
+
+static PEX_RUNDOWN_REF_CACHE_AWARE
+EnterReadSection(PTRACKED_FILES TrackedFilesList)
+{
+    for (;;) {
+        LONG index = ReadAcquire(&TrackedFilesList->ActiveReaders);
+        PEX_RUNDOWN_REF_CACHE_AWARE readers = TrackedFilesList->Readers[index];
+        if (ExAcquireRundownProtectionCacheAware(readers)) {
+            // A writer may have flipped (and even re-armed this reference) between the read and the acquire;
+            // only stay if it is still the active one, otherwise the next writer would not wait for us.
+            if (ReadAcquire(&TrackedFilesList->ActiveReaders) == index) {
+                return readers;
+            }
+            ExReleaseRundownProtectionCacheAware(readers);
+        }
+        YieldProcessor();
+    }
+}
+
+static VOID
+FreeEntry(PTRACKED_FILES TrackedFilesList, PTRACKED_FILE_ENTRY fileEntry)
+{
+    BlockPoolFree(&TrackedFilesList->Entries, fileEntry, TRACKED_FILE_ENTRY_SIZE(fileEntry->FileName.Length));
+}
+
+// Allocates an entry holding a null-terminated copy of FileName, whose hash is Hash, in a single block
+static PTRACKED_FILE_ENTRY
+CreateEntry(PTRACKED_FILES TrackedFilesList, PCUNICODE_STRING FileName, ULONG Hash, LONG Operations)
+{
+    PTRACKED_FILE_ENTRY entry = BlockPoolAllocate(&TrackedFilesList->Entries, TRACKED_FILE_ENTRY_SIZE(FileName->Length));
+    if (!entry) return NULL;
+
+    entry->Next = NULL;
+    entry->Retired = NULL;
+    entry->FileName.Buffer = entry->Name;
+    entry->FileName.Length = FileName->Length;
+    entry->FileName.MaximumLength = FileName->Length + sizeof(WCHAR);
+    RtlCopyMemory(entry->Name, FileName->Buffer, FileName->Length);
+    entry->Name[FileName->Length / sizeof(WCHAR)] = L'\0';
+    entry->Operations = (UCHAR)Operations;
+    entry->Masked = FALSE;
+    entry->Hash = Hash;
+    return entry;
+}
+
+// Copies an entry, name included, for another table
+static PTRACKED_FILE_ENTRY
+CopyEntry(PTRACKED_FILES TrackedFilesList, PTRACKED_FILE_ENTRY Entry)
+{
+    SIZE_T size = TRACKED_FILE_ENTRY_SIZE(Entry->FileName.Length);
+    PTRACKED_FILE_ENTRY copy = BlockPoolAllocate(&TrackedFilesList->Entries, size);
+    if (copy) {
+        RtlCopyMemory(copy, Entry, size);
+        copy->FileName.Buffer = copy->Name;
+    }
+    return copy;
+}
+
+// Publishes an entry whose name is not in the table yet. Must be called with WriteLock held.
+static VOID
+InsertEntryLocked(PTRACKED_FILES TrackedFilesList, PTRACKED_FILES_TABLE Table, PTRACKED_FILE_ENTRY Entry)
+{
+    // The prefilter must admit the name before any reader can find the entry
+    PathFilterAddName(TrackedFilesList->Filter, &Entry->FileName);
+
+    // The entry is fully built before the release store makes it reachable
+    PTRACKED_FILE_ENTRY* bucket = BucketOf(Table, Entry->Hash);
+    Entry->Next = *bucket;
+    WritePointerRelease((PVOID*)bucket, Entry);
+    TrackedFilesList->EntryCount++;
+}
+
+// Unlinks an entry of the table and chains it onto RetiredEntries, to be freed once the readers have been
+// synchronized. Must be called with WriteLock held.
+static VOID
+UnlinkEntryLocked(PTRACKED_FILES TrackedFilesList, PTRACKED_FILES_TABLE Table, PTRACKED_FILE_ENTRY Entry,
+    PTRACKED_FILE_ENTRY* RetiredEntries)
+{
+    PTRACKED_FILE_ENTRY* link = BucketOf(Table, Entry->Hash);
+    while (*link != Entry) {
+        link = &(*link)->Next;
+    }
+
+    // Readers already on this entry can still follow its Next pointer, which stays intact
+    WritePointerRelease((PVOID*)link, Entry->Next);
+    TrackedFilesList->EntryCount--;
+    TrackedFilesList->FilterStale++;
+    Entry->Retired = *RetiredEntries;
+    *RetiredEntries = Entry;
+}
+
+// Tracks a file by name, in place of the entry that masks it, if any. Must be called with WriteLock held.
+static NTSTATUS
+AddEntryLocked(PTRACKED_FILES TrackedFilesList, PCUNICODE_STRING FilePath, LONG Operations,
+    PTRACKED_FILE_ENTRY* RetiredEntries)
+{
+    PTRACKED_FILES_TABLE table = TrackedFilesList->Table;
+    ULONG hash = HashFileName(FilePath, TRUE);
+    PTRACKED_FILE_ENTRY existing = FindEntry(table, FilePath, hash, TRUE);
+
+    if (existing ? !existing->Masked : ImageLookup(TrackedFilesList->Image, FilePath, TRUE) != 0) {
+        return STATUS_ALREADY_REGISTERED;
+    }
+
+    // Allocated under the lock, so a name that is already tracked costs nothing
+    PTRACKED_FILE_ENTRY fileEntry = CreateEntry(TrackedFilesList, FilePath, hash, Operations);
+    if (!fileEntry) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // Lookups stop at the first match, so the new entry takes over before the masked one goes
+    CountRuleLocked(TrackedFilesList, FilePath, Operations, 1);
+    InsertEntryLocked(TrackedFilesList, table, fileEntry);
+    if (existing) {
+        UnlinkEntryLocked(TrackedFilesList, table, existing, RetiredEntries);
+    }
+    return STATUS_SUCCESS;
+}
+
+// Stops tracking a file by name. A name the rule image holds gets a masked entry, since the image cannot
+// change. Must be called with WriteLock held.
+static NTSTATUS
+RemoveEntryLocked(PTRACKED_FILES TrackedFilesList, PCUNICODE_STRING FilePath, PTRACKED_FILE_ENTRY* RetiredEntries)
 {
-    InitializeListHead(&TrackedFilesList->FileListHead);
-    KeInitializeSpinLock(&TrackedFilesList->Lock);
+    PTRACKED_FILES_TABLE table = TrackedFilesList->Table;
+    ULONG hash = HashFileName(FilePath, TRUE);
+    PTRACKED_FILE_ENTRY existing = FindEntry(table, FilePath, hash, TRUE);
+    LONG imageOperations = ImageLookup(TrackedFilesList->Image, FilePath, TRUE);
+
+    if (existing ? existing->Masked : !imageOperations) {
+        return STATUS_NOT_FOUND;
+    }
+
+    LONG operations = existing ? existing->Operations : imageOperations;
+    if (imageOperations) {
+        PTRACKED_FILE_ENTRY mask = CreateEntry(TrackedFilesList, FilePath, hash, 0);
+        if (!mask) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        mask->Masked = TRUE;
+        InsertEntryLocked(TrackedFilesList, table, mask);
+    }
+    if (existing) {
+        UnlinkEntryLocked(TrackedFilesList, table, existing, RetiredEntries);
+    }
+    CountRuleLocked(TrackedFilesList, FilePath, operations, -1);
     return STATUS_SUCCESS;
 }
 
-NTSTATUS 
-AddTrackedFile(PTRACKED_FILES TrackedFilesList, PCWSTR FileName, BOOLEAN Protected) {
-    KIRQL oldIrql;
-    PTRACKED_FILE_ENTRY entry = ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(TRACKED_FILE_ENTRY), 'kFtL');
-    if (!entry) return STATUS_INSUFFICIENT_RESOURCES;
+// Inserts a directory rule, counted before readers can find it. Must be called with WriteLock held.
+static NTSTATUS
+InsertDirectoryLocked(PTRACKED_FILES TrackedFilesList, PCUNICODE_STRING Directory, LONG Flags,
+    PPATH_TRIE_NODE* RetiredNodes)
+{
+    CountRuleLocked(TrackedFilesList, Directory, Flags, 1);
+    NTSTATUS status = PathTrieInsert(TrackedFilesList->Directories, Directory, Flags, RetiredNodes);
+    if (!NT_SUCCESS(status)) {
+        CountRuleLocked(TrackedFilesList, Directory, Flags, -1);
+        return status;
+    }
+    PathFilterAddDirectory(TrackedFilesList->Filter, Directory);
+    TrackedFilesList->DirectoryCount++;
+    return STATUS_SUCCESS;
+}
+
+// Removes a directory rule. Must be called with WriteLock held.
+static NTSTATUS
+DeleteDirectoryLocked(PTRACKED_FILES TrackedFilesList, PCUNICODE_STRING Directory, PPATH_TRIE_NODE* RetiredNodes)
+{
+    LONG flags = 0;
+    NTSTATUS status = PathTrieRemove(TrackedFilesList->Directories, Directory, RetiredNodes, &flags);
+    if (NT_SUCCESS(status)) {
+        CountRuleLocked(TrackedFilesList, Directory, flags, -1);
+        TrackedFilesList->DirectoryCount--;
+        TrackedFilesList->FilterStale++;
+    }
+    return status;
+}
+
+// Counts the names of an image in or out. A name with an entry in the table is counted through
+// the entry, or not at all if the entry masks it. Must be called with WriteLock held.
+static VOID
+CountImageNamesLocked(PTRACKED_FILES TrackedFilesList, PTRACKED_FILES_IMAGE Image, LONG Delta)
+{
+    for (ULONG i = 0; Image && i < Image->View.Header->NameCount; i++) {
+        UNICODE_STRING name;
+        ImageString(Image, &Image->View.Names[i], &name);
+        if (!FindEntry(TrackedFilesList->Table, &name, HashFileName(&name, TRUE), TRUE)) {
+            CountRuleLocked(TrackedFilesList, &name, ImageOperations(Image->View.Names[i].Flags), Delta);
+        }
+    }
+}
+
+static VOID
+AddDirectoryToFilter(PVOID Context, PCUNICODE_STRING Path, LONG Flags)
+{
+    UNREFERENCED_PARAMETER(Flags);
+    PathFilterAddDirectory((PPATH_FILTER)Context, Path);
+}
+
+// Names and directory rules the prefilter has to admit. Must be called with WriteLock held.
+static ULONG
+KeyCountLocked(PTRACKED_FILES TrackedFilesList)
+{
+    PTRACKED_FILES_IMAGE image = TrackedFilesList->Image;
+    return TrackedFilesList->EntryCount + TrackedFilesList->DirectoryCount + (image ? image->View.Header->NameCount : 0);
+}
+
+// Replaces the prefilter with one built from the current names and directory rules, sized for twice as many keys.
+// Must be called with WriteLock held, after the change has been published; if anything fails the old filter stays,
+// which is only less selective.
+static VOID
+RebuildFilterLocked(PTRACKED_FILES TrackedFilesList)
+{
+    ULONG keys = KeyCountLocked(TrackedFilesList);
+    PPATH_FILTER filter = PathFilterCreate(max(keys * 2, TRACKED_FILES_INITIAL_BUCKETS * TRACKED_FILES_MAX_LOAD));
+    if (!filter) return;
+
+    PTRACKED_FILES_TABLE table = TrackedFilesList->Table;
+    for (ULONG i = 0; i < table->BucketCount; i++) {
+        for (PTRACKED_FILE_ENTRY fileEntry = table->Buckets[i]; fileEntry; fileEntry = fileEntry->Next) {
+            PathFilterAddName(filter, &fileEntry->FileName);
+        }
+    }
+    PTRACKED_FILES_IMAGE image = TrackedFilesList->Image;
+    for (ULONG i = 0; image && i < image->View.Header->NameCount; i++) {
+        UNICODE_STRING name;
+        ImageString(image, &image->View.Names[i], &name);
+        PathFilterAddName(filter, &name);
+    }
+    if (!NT_SUCCESS(PathTrieEnumerate(TrackedFilesList->Directories, AddDirectoryToFilter, filter))) {
+        PathFilterFree(filter);
+        return;
+    }
+
+    PPATH_FILTER oldFilter = TrackedFilesList->Filter;
+    WritePointerRelease((PVOID*)&TrackedFilesList->Filter, filter);
+    TrackedFilesList->FilterStale = 0;
+    SynchronizeReadersLocked(TrackedFilesList);
+    PathFilterFree(oldFilter);
+}
+
+// Rebuilds the prefilter once it holds more keys than it was sized for, or too many removed ones.
+// Must be called with WriteLock held.
+static VOID
+FilterChangedLocked(PTRACKED_FILES TrackedFilesList)
+{
+    PPATH_FILTER filter = TrackedFilesList->Filter;
+    ULONG keys = KeyCountLocked(TrackedFilesList);
+    if ((ULONG)filter->KeyCount > filter->Capacity
+        || TrackedFilesList->FilterStale * TRACKED_FILES_FILTER_SLACK > keys) {
+        RebuildFilterLocked(TrackedFilesList);
+    }
+}
+
+// Frees the entries of a table that was retired by a resize; the new table holds copies of them.
+static VOID
+FreeRetiredTable(PTRACKED_FILES TrackedFilesList, PTRACKED_FILES_TABLE Table)
+{
+    for (ULONG i = 0; i < Table->BucketCount; i++) {
+        PTRACKED_FILE_ENTRY fileEntry = Table->Buckets[i];
+        while (fileEntry) {
+            PTRACKED_FILE_ENTRY next = fileEntry->Next;
+            FreeEntry(TrackedFilesList, fileEntry);
+            fileEntry = next;
+        }
+    }
+    ExFreePool(Table);
+}
+
+// Grows the bucket array once the average chain gets too long, doubling it as often as needed at once after a
+// batch of adds. Readers may still be walking the current chains, so the entries are copied into a new table
+// instead of being relinked in place, and the old table is freed after a grace period. Must be called with
+// WriteLock held; if an allocation fails the table keeps working with longer chains.
+static VOID
+GrowTableLocked(PTRACKED_FILES TrackedFilesList)
+{
+    PTRACKED_FILES_TABLE oldTable = TrackedFilesList->Table;
+    ULONG newCount = oldTable->BucketCount;
+    while (TrackedFilesList->EntryCount > newCount * TRACKED_FILES_MAX_LOAD && newCount * 2 <= TRACKED_FILES_MAX_BUCKETS) {
+        newCount *= 2;
+    }
+    if (newCount == oldTable->BucketCount) {
+        return;
+    }
+
+    PTRACKED_FILES_TABLE newTable = AllocateTable(newCount);
+    if (!newTable) return;
+    newTable->BucketCount = newCount;
+
+    for (ULONG i = 0; i < oldTable->BucketCount; i++) {
+        for (PTRACKED_FILE_ENTRY fileEntry = oldTable->Buckets[i]; fileEntry; fileEntry = fileEntry->Next) {
+            PTRACKED_FILE_ENTRY copy = CopyEntry(TrackedFilesList, fileEntry);
+            if (!copy) {
+                FreeRetiredTable(TrackedFilesList, newTable);
+                return;
+            }
+            PTRACKED_FILE_ENTRY* bucket = BucketOf(newTable, copy->Hash);
+            copy->Next = *bucket;
+            *bucket = copy;
+        }
+    }
+
+    WritePointerRelease((PVOID*)&TrackedFilesList->Table, newTable);
+    SynchronizeReadersLocked(TrackedFilesList);
+    FreeRetiredTable(TrackedFilesList, oldTable);
+}
+
+// Initialization function
+NTSTATUS InitializeTrackedFiles(PTRACKED_FILES TrackedFilesList)
+{
+    RtlZeroMemory(TrackedFilesList, sizeof(TRACKED_FILES));
+    ExInitializeFastMutex(&TrackedFilesList->WriteLock);
+    TrackedFilesList->Generation = 1;
+
+    NTSTATUS status = BlockPoolInitialize(&TrackedFilesList->Entries, 'kFtL');
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    for (ULONG i = 0; i < ARRAYSIZE(TrackedFilesList->Readers); i++) {
+        TrackedFilesList->Readers[i] = ExAllocateCacheAwareRundownProtection(NonPagedPoolNx, 'kFtL');
+        if (!TrackedFilesList->Readers[i]) {
+            DeleteTrackedFiles(TrackedFilesList);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
 
-    SIZE_T pathLength = wcslen(FileName) * sizeof(WCHAR);
-    entry->FileName.Buffer = ExAllocatePool2(POOL_FLAG_NON_PAGED, pathLength + sizeof(WCHAR), 'kFtL');
-    if (!entry->FileName.Buffer) {
-        ExFreePool(entry);
+    PTRACKED_FILES_TABLE table = AllocateTable(TRACKED_FILES_INITIAL_BUCKETS);
+    if (!table) {
+        DeleteTrackedFiles(TrackedFilesList);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
+    table->BucketCount = TRACKED_FILES_INITIAL_BUCKETS;
+    TrackedFilesList->Table = table;
 
-    entry->FileName.Length = (USHORT)pathLength;
-    entry->FileName.MaximumLength = (USHORT)(pathLength + sizeof(WCHAR));
-    RtlCopyMemory(entry->FileName.Buffer, FileName, pathLength);
-    entry->FileName.Buffer[pathLength / sizeof(WCHAR)] = L'\0';
-    entry->Protected = Protected;
+    TrackedFilesList->Directories = PathTrieCreate();
+    if (!TrackedFilesList->Directories) {
+        DeleteTrackedFiles(TrackedFilesList);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-    KeAcquireSpinLock(&TrackedFilesList->Lock, &oldIrql);
-    InsertTailList(&TrackedFilesList->FileListHead, &entry->ListEntry);
-    KeReleaseSpinLock(&TrackedFilesList->Lock, oldIrql);
+    TrackedFilesList->Filter = PathFilterCreate(TRACKED_FILES_INITIAL_BUCKETS * TRACKED_FILES_MAX_LOAD);
+    if (!TrackedFilesList->Filter) {
+        DeleteTrackedFiles(TrackedFilesList);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
     return STATUS_SUCCESS;
 }
 
+// Single-name changes are batches of one, so they follow the same masking and publication rules
+NTSTATUS
+AddTrackedFile(PTRACKED_FILES TrackedFilesList, PCWSTR FileName, LONG Operations) {
+    TRACKED_FILE_UPDATE update;
+    ULONG applied;
+    RtlInitUnicodeString(&update.Path, FileName);
+    update.Remove = FALSE;
+    update.Operations = Operations;
+
+    NTSTATUS status = UpdateTrackedFiles(TrackedFilesList, &update, 1, &applied);
+    return NT_SUCCESS(status) ? update.Status : status;
+}
+
 NTSTATUS RemoveTrackedFile(PTRACKED_FILES TrackedFilesList, PCWSTR FilePath) {
+    TRACKED_FILE_UPDATE update;
+    ULONG applied;
+    RtlInitUnicodeString(&update.Path, FilePath);
+    update.Remove = TRUE;
+    update.Operations = 0;
+
+    NTSTATUS status = UpdateTrackedFiles(TrackedFilesList, &update, 1, &applied);
+    return NT_SUCCESS(status) ? update.Status : status;
+}
+
+NTSTATUS
+AddTrackedDirectory(PTRACKED_FILES TrackedFilesList, PCWSTR DirectoryPath, LONG Operations) {
+    NTSTATUS status = STATUS_DELETE_PENDING;
+    UNICODE_STRING directory;
+    PPATH_TRIE_NODE retired = NULL;
+    RtlInitUnicodeString(&directory, DirectoryPath);
+
+    if (Operations == 0 || (Operations & ~RULE_ALL) != 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ExAcquireFastMutex(&TrackedFilesList->WriteLock);
+    if (TrackedFilesList->Directories) {
+        status = InsertDirectoryLocked(TrackedFilesList, &directory, Operations, &retired);
+        if (NT_SUCCESS(status)) {
+            // Readers that miss the rule until the bits are set cache their verdict under the old generation
+            FilterChangedLocked(TrackedFilesList);
+            RulesChangedLocked(TrackedFilesList);
+        }
+        if (retired) {
+            SynchronizeReadersLocked(TrackedFilesList);
+        }
+    }
+    ExReleaseFastMutex(&TrackedFilesList->WriteLock);
+
+    PathTrieFreeRetired(retired);
+    return status;
+}
+
+NTSTATUS
+RemoveTrackedDirectory(PTRACKED_FILES TrackedFilesList, PCWSTR DirectoryPath) {
     NTSTATUS status = STATUS_NOT_FOUND;
-    KIRQL oldIrql;
-    UNICODE_STRING fileToRemove;
-    RtlInitUnicodeString(&fileToRemove, FilePath);
-
-    KeAcquireSpinLock(&TrackedFilesList->Lock, &oldIrql);
-    PLIST_ENTRY entry = TrackedFilesList->FileListHead.Flink;
-    while (entry != &TrackedFilesList->FileListHead) {
-        PTRACKED_FILE_ENTRY fileEntry = CONTAINING_RECORD(entry, TRACKED_FILE_ENTRY, ListEntry);
-        if (RtlEqualUnicodeString(&fileToRemove, &fileEntry->FileName, TRUE)) {
-            RemoveEntryList(&fileEntry->ListEntry);
-            if (fileEntry->FileName.Buffer) ExFreePool(fileEntry->FileName.Buffer);
-            ExFreePool(fileEntry);
-            status = STATUS_SUCCESS;
-            break;
-        }
-        entry = entry->Flink;
-    }
-    KeReleaseSpinLock(&TrackedFilesList->Lock, oldIrql);
+    UNICODE_STRING directory;
+    PPATH_TRIE_NODE retired = NULL;
+    RtlInitUnicodeString(&directory, DirectoryPath);
+
+    ExAcquireFastMutex(&TrackedFilesList->WriteLock);
+    if (TrackedFilesList->Directories) {
+        status = DeleteDirectoryLocked(TrackedFilesList, &directory, &retired);
+        if (NT_SUCCESS(status)) {
+            FilterChangedLocked(TrackedFilesList);
+            RulesChangedLocked(TrackedFilesList);
+        }
+        if (retired) {
+            SynchronizeReadersLocked(TrackedFilesList);
+        }
+    }
+    ExReleaseFastMutex(&TrackedFilesList->WriteLock);
+
+    PathTrieFreeRetired(retired);
+    return status;
+}
+
+// Applies one update of a batch. Must be called with WriteLock held, on a table that is not torn down.
+static NTSTATUS
+ApplyUpdateLocked(PTRACKED_FILES TrackedFilesList, PTRACKED_FILE_UPDATE Update,
+    PTRACKED_FILE_ENTRY* RetiredEntries, PPATH_TRIE_NODE* RetiredNodes)
+{
+    PCUNICODE_STRING path = &Update->Path;
+    NTSTATUS status;
+
+    if (path->Length == 0 || (!Update->Remove && (Update->Operations == 0 || (Update->Operations & ~RULE_ALL) != 0))) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // A trailing separator makes it a directory rule, as for the single-rule calls
+    if (path->Buffer[path->Length / sizeof(WCHAR) - 1] == L'\\') {
+        if (Update->Remove) {
+            return DeleteDirectoryLocked(TrackedFilesList, path, RetiredNodes);
+        }
+        return InsertDirectoryLocked(TrackedFilesList, path, Update->Operations, RetiredNodes);
+    }
+
+    // Entries hold the upcased name, so lookups can compare it as plain data
+    FOLDED_NAME folded;
+    status = FoldName(path, &folded);
+    if (NT_SUCCESS(status)) {
+        status = Update->Remove
+            ? RemoveEntryLocked(TrackedFilesList, &folded.String, RetiredEntries)
+            : AddEntryLocked(TrackedFilesList, &folded.String, Update->Operations, RetiredEntries);
+    }
+    ReleaseFoldedName(&folded);
+    return status;
+}
+
+NTSTATUS
+UpdateTrackedFiles(PTRACKED_FILES TrackedFilesList, PTRACKED_FILE_UPDATE Updates, ULONG Count, PULONG Applied) {
+    PTRACKED_FILE_ENTRY retiredEntries = NULL;
+    PPATH_TRIE_NODE retiredNodes = NULL;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    *Applied = 0;
+    ExAcquireFastMutex(&TrackedFilesList->WriteLock);
+    if (!TrackedFilesList->Table) {
+        status = STATUS_DELETE_PENDING;
+    }
+    else {
+        for (ULONG i = 0; i < Count; i++) {
+            Updates[i].Status = ApplyUpdateLocked(TrackedFilesList, &Updates[i], &retiredEntries, &retiredNodes);
+            if (NT_SUCCESS(Updates[i].Status)) {
+                (*Applied)++;
+            }
+
+            // The bucket array still doubles as the batch fills it, or every add would walk ever longer chains
+            // for its duplicate check; that is a grace period per doubling, not per add
+            if (TrackedFilesList->EntryCount > TrackedFilesList->Table->BucketCount * TRACKED_FILES_MAX_LOAD) {
+                GrowTableLocked(TrackedFilesList);
+            }
+        }
+
+        // The prefilter and the generation are brought up to date once for the whole batch, and one grace
+        // period covers everything it unlinked
+        if (*Applied) {
+            RulesChangedLocked(TrackedFilesList);
+            FilterChangedLocked(TrackedFilesList);
+        }
+        if (retiredEntries || retiredNodes) {
+            SynchronizeReadersLocked(TrackedFilesList);
+        }
+    }
+    ExReleaseFastMutex(&TrackedFilesList->WriteLock);
+
+    while (retiredEntries) {
+        PTRACKED_FILE_ENTRY next = retiredEntries->Retired;
+        FreeEntry(TrackedFilesList, retiredEntries);
+        retiredEntries = next;
+    }
+    PathTrieFreeRetired(retiredNodes);
+    return status;
+}
+
+NTSTATUS
+LoadTrackedFilesImage(PTRACKED_FILES TrackedFilesList, PVOID Image, ULONG Size) {
+    PTRACKED_FILES_IMAGE image = ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(TRACKED_FILES_IMAGE), 'kFtL');
+    PTRACKED_FILES_IMAGE oldImage = NULL;
+    PPATH_TRIE_NODE retiredNodes = NULL;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (!image) return STATUS_INSUFFICIENT_RESOURCES;
+
+    // Checked outside the lock; it takes time linear in the size of the image
+    if (!RuleImageOpen(&image->View, Image, Size)) {
+        ExFreePool(image);
+        return STATUS_INVALID_IMAGE_FORMAT;
+    }
+    image->Data = Image;
+
+    ExAcquireFastMutex(&TrackedFilesList->WriteLock);
+    if (!TrackedFilesList->Table) {
+        status = STATUS_DELETE_PENDING;
+    }
+    else {
+        // Directory rules join the trie, where they can be changed like any other
+        for (ULONG i = 0; i < image->View.Header->DirectoryCount; i++) {
+            const RULE_IMAGE_ENTRY* entry = &image->View.Directories[i];
+            UNICODE_STRING directory;
+            ImageString(image, entry, &directory);
+            InsertDirectoryLocked(TrackedFilesList, &directory, ImageOperations(entry->Flags), &retiredNodes);
+        }
+
+        // The prefilter must admit the names before any reader can find them; it is resized right after
+        for (ULONG i = 0; i < image->View.Header->NameCount; i++) {
+            UNICODE_STRING name;
+            ImageString(image, &image->View.Names[i], &name);
+            PathFilterAddName(TrackedFilesList->Filter, &name);
+        }
+
+        // The new names are counted before they are published and the old ones after they are gone, so a name in
+        // both images never leaves its volume without a count
+        oldImage = TrackedFilesList->Image;
+        CountImageNamesLocked(TrackedFilesList, image, 1);
+        WritePointerRelease((PVOID*)&TrackedFilesList->Image, image);
+        CountImageNamesLocked(TrackedFilesList, oldImage, -1);
+        if (oldImage) {
+            TrackedFilesList->FilterStale += oldImage->View.Header->NameCount;
+        }
+        RulesChangedLocked(TrackedFilesList);
+        FilterChangedLocked(TrackedFilesList);
+        if (oldImage || retiredNodes) {
+            SynchronizeReadersLocked(TrackedFilesList);
+        }
+    }
+    ExReleaseFastMutex(&TrackedFilesList->WriteLock);
+
+    PathTrieFreeRetired(retiredNodes);
+    if (!NT_SUCCESS(status)) {
+        ExFreePool(image);
+        return status;
+    }
+    FreeImage(oldImage);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+SetTrackedPatterns(PTRACKED_FILES TrackedFilesList, PGLOB_PATTERN Patterns, ULONG PatternCount) {
+    PGLOB_RULES rules = NULL;
+    NTSTATUS status = GlobRulesCompile(Patterns, PatternCount, &rules);
+    if (!NT_SUCCESS(status)) return status;
+
+    ExAcquireFastMutex(&TrackedFilesList->WriteLock);
+    PGLOB_RULES oldRules = TrackedFilesList->Patterns;
+    if (TrackedFilesList->Table) {
+        // Same order as for an image: the new patterns count before they are published, the old ones stop after
+        PVOLUME_RULES volumes = &TrackedFilesList->Volumes;
+        LONG operationRules[RULE_BIT_COUNT] = { 0 };
+        for (ULONG i = 0; i < PatternCount; i++) {
+            InterlockedIncrement(&VolumeRulesSlot(volumes, &Patterns[i].Pattern)->Rules);
+            CountOperations(Patterns[i].Flags, operationRules);
+        }
+        AddOperationRulesLocked(TrackedFilesList, operationRules, 1);
+        WritePointerRelease((PVOID*)&TrackedFilesList->Patterns, rules);
+        for (LONG i = -1; i < volumes->SlotCount; i++) {
+            PVOLUME_RULE_SLOT slot = i < 0 ? &volumes->Unscoped : &volumes->Volumes[i];
+            InterlockedAdd(&slot->Rules, -slot->Patterns);
+            slot->Patterns = 0;
+        }
+        AddOperationRulesLocked(TrackedFilesList, TrackedFilesList->PatternOperationRules, -1);
+        RtlCopyMemory(TrackedFilesList->PatternOperationRules, operationRules, sizeof(operationRules));
+        for (ULONG i = 0; i < PatternCount; i++) {
+            VolumeRulesSlot(volumes, &Patterns[i].Pattern)->Patterns++;
+        }
+        RulesChangedLocked(TrackedFilesList);
+        if (oldRules) {
+            SynchronizeReadersLocked(TrackedFilesList);
+        }
+    }
+    else {
+        status = STATUS_DELETE_PENDING;
+        oldRules = rules;
+    }
+    ExReleaseFastMutex(&TrackedFilesList->WriteLock);
+
+    GlobRulesFree(oldRules);
     return status;
 }
 
-// Cleanup function (updated to use simpler ExFreePool)
+// Tears the rules down; the read sections and the entry pool stay usable until DeleteTrackedFiles
 VOID CleanupTrackedFiles(PTRACKED_FILES TrackedFilesList)
 {
-    KIRQL oldIrql;
-    KeAcquireSpinLock(&TrackedFilesList->Lock, &oldIrql);
+    ExAcquireFastMutex(&TrackedFilesList->WriteLock);
+    PTRACKED_FILES_TABLE table = TrackedFilesList->Table;
+    PPATH_TRIE_NODE directories = TrackedFilesList->Directories;
+    PGLOB_RULES patterns = TrackedFilesList->Patterns;
+    PPATH_FILTER filter = TrackedFilesList->Filter;
+    PTRACKED_FILES_IMAGE image = TrackedFilesList->Image;
+    WritePointerRelease((PVOID*)&TrackedFilesList->Table, NULL);
+    WritePointerRelease((PVOID*)&TrackedFilesList->Directories, NULL);
+    WritePointerRelease((PVOID*)&TrackedFilesList->Patterns, NULL);
+    WritePointerRelease((PVOID*)&TrackedFilesList->Filter, NULL);
+    WritePointerRelease((PVOID*)&TrackedFilesList->Image, NULL);
+    TrackedFilesList->EntryCount = 0;
+    TrackedFilesList->DirectoryCount = 0;
+    RtlZeroMemory(TrackedFilesList->OperationRules, sizeof(TrackedFilesList->OperationRules));
+    RtlZeroMemory(TrackedFilesList->PatternOperationRules, sizeof(TrackedFilesList->PatternOperationRules));
+    WriteRelease(&TrackedFilesList->Operations, 0);
+    RulesChangedLocked(TrackedFilesList);
+    if (table || directories || patterns || filter || image) {
+        SynchronizeReadersLocked(TrackedFilesList);
+    }
+    ExReleaseFastMutex(&TrackedFilesList->WriteLock);
 
-    while (!IsListEmpty(&TrackedFilesList->FileListHead)) {
-        PLIST_ENTRY entry = RemoveHeadList(&TrackedFilesList->FileListHead);
-        PTRACKED_FILE_ENTRY fileEntry = CONTAINING_RECORD(entry, TRACKED_FILE_ENTRY, ListEntry);
+    PathTrieDestroy(directories);
+    GlobRulesFree(patterns);
+    PathFilterFree(filter);
+    FreeImage(image);
 
-        if (fileEntry->FileName.Buffer) {
-            ExFreePool(fileEntry->FileName.Buffer);
+    if (table) {
+        for (ULONG i = 0; i < table->BucketCount; i++) {
+            PTRACKED_FILE_ENTRY fileEntry = table->Buckets[i];
+            while (fileEntry) {
+                PTRACKED_FILE_ENTRY next = fileEntry->Next;
+                FreeEntry(TrackedFilesList, fileEntry);
+                fileEntry = next;
+            }
         }
-        ExFreePool(fileEntry);
+        ExFreePool(table);
     }
+}
+
+VOID DeleteTrackedFiles(PTRACKED_FILES TrackedFilesList)
+{
+    CleanupTrackedFiles(TrackedFilesList);
+    BlockPoolDelete(&TrackedFilesList->Entries);
+
+    // Only reached once the filter is unregistered and the control device deleted, so no caller can enter a
+    // section from here on
+    for (ULONG i = 0; i < ARRAYSIZE(TrackedFilesList->Readers); i++) {
+        if (TrackedFilesList->Readers[i]) {
+            ExFreeCacheAwareRundownProtection(TrackedFilesList->Readers[i]);
+            TrackedFilesList->Readers[i] = NULL;
+        }
+    }
+}
 
-    KeReleaseSpinLock(&TrackedFilesList->Lock, oldIrql);
+LONG64
+GetTrackedFilesGeneration(PTRACKED_FILES TrackedFilesList)
+{
+    return ReadAcquire64(&TrackedFilesList->Generation);
 }
 
-BOOLEAN 
-GetTrackedFile(PTRACKED_FILES TrackedFilesList, PUNICODE_STRING FilePath, 
-    PUNICODE_STRING FoundFilePath, PBOOLEAN Protected) {
-    KIRQL oldIrql;
-    BOOLEAN fileExists = FALSE;
+LONG
+GetTrackedFile(PTRACKED_FILES TrackedFilesList, PUNICODE_STRING FilePath) {
+    LONG operations = 0;
 
-    KeAcquireSpinLock(&TrackedFilesList->Lock, &oldIrql);
-    PLIST_ENTRY entry = TrackedFilesList->FileListHead.Flink;
-    while (entry != &TrackedFilesList->FileListHead) {
-        PTRACKED_FILE_ENTRY fileEntry = CONTAINING_RECORD(entry, TRACKED_FILE_ENTRY, ListEntry);
-        if (RtlEqualUnicodeString(FilePath, &fileEntry->FileName, TRUE)) {
-            fileExists = TRUE;
-            if (FoundFilePath) *FoundFilePath = fileEntry->FileName;
-            if (Protected) *Protected = fileEntry->Protected;
-            break;
+    PEX_RUNDOWN_REF_CACHE_AWARE readers = EnterReadSection(TrackedFilesList);
+    PPATH_FILTER filter = ReadPointerAcquire((PVOID*)&TrackedFilesList->Filter);
+    PGLOB_RULES patterns = ReadPointerAcquire((PVOID*)&TrackedFilesList->Patterns);
+
+    // Most paths are neither tracked by name nor below a tracked directory; the filter says so without a compare
+    if (filter && !PathFilterMayContain(filter, FilePath)) {
+        PerfCount(PERF_COUNTER_FILTER_REJECTED);
+    }
+    else {
+        PTRACKED_FILES_TABLE table = ReadPointerAcquire((PVOID*)&TrackedFilesList->Table);
+        PPATH_TRIE_NODE directories = ReadPointerAcquire((PVOID*)&TrackedFilesList->Directories);
+        PTRACKED_FILES_IMAGE image = ReadPointerAcquire((PVOID*)&TrackedFilesList->Image);
+
+        // The path is upcased once for the hash and every compare; a long path that finds no buffer for it is
+        // looked up unfolded instead, so that a tracked file is never missed
+        FOLDED_NAME folded;
+        BOOLEAN isFolded = NT_SUCCESS(FoldName(FilePath, &folded));
+        PCUNICODE_STRING name = isFolded ? &folded.String : FilePath;
+        PTRACKED_FILE_ENTRY fileEntry = table ? FindEntry(table, name, HashFileName(name, isFolded), isFolded) : NULL;
+
+        // The table overrides the image, and a masked entry, whose operations are 0, leaves the file to its directories
+        operations = fileEntry ? fileEntry->Operations : ImageLookup(image, name, isFolded);
+        ReleaseFoldedName(&folded);
+
+        // A file tracked by name overrides its directories, and a directory rule overrides the patterns
+        if (!operations && directories) {
+            operations = PathTrieLookup(directories, FilePath);
         }
-        entry = entry->Flink;
+
+        if (filter) {
+            PerfCount(PERF_COUNTER_FILTER_ADMITTED);
+            if (!operations) PerfCount(PERF_COUNTER_FILTER_FALSE_POSITIVES);
+        }
+    }
+
+    if (!operations && patterns) {
+        operations = GlobRulesMatch(patterns, FilePath);
     }
-    KeReleaseSpinLock(&TrackedFilesList->Lock, oldIrql);
-    return fileExists;
-}
\ No newline at end of file
+    ExReleaseRundownProtectionCacheAware(readers);
+    return operations;
+}
+
+LONG
+GetTrackedOperations(PTRACKED_FILES TrackedFilesList)
+{
+    return ReadNoFence(&TrackedFilesList->Operations);
+}
+
+BOOLEAN
+GetTrackedVolume(PTRACKED_FILES TrackedFilesList, PCUNICODE_STRING VolumeName)
+{
+    return VolumeRulesAny(&TrackedFilesList->Volumes, VolumeName);
+}
+
+VOID
+GetTrackedFilesFilterStats(PTRACKED_FILES TrackedFilesList, PPATH_FILTER_STATS Stats)
+{
+    RtlZeroMemory(Stats, sizeof(PATH_FILTER_STATS));
+    Stats->Rejected = PerfCounterTotal(PERF_COUNTER_FILTER_REJECTED);
+    Stats->Admitted = PerfCounterTotal(PERF_COUNTER_FILTER_ADMITTED);
+    Stats->FalsePositives = PerfCounterTotal(PERF_COUNTER_FILTER_FALSE_POSITIVES);
+
+    PEX_RUNDOWN_REF_CACHE_AWARE readers = EnterReadSection(TrackedFilesList);
+    PPATH_FILTER filter = ReadPointerAcquire((PVOID*)&TrackedFilesList->Filter);
+    if (filter) {
+        Stats->MemoryBytes = PathFilterSize(filter);
+        Stats->KeyCount = (ULONG)ReadNoFence(&filter->KeyCount);
+        Stats->Capacity = filter->Capacity;
+    }
+    ExReleaseRundownProtectionCacheAware(readers);
+}
+
+// Fills a usage record for a single allocation
+static VOID
+SetUsage(PMEMORY_USAGE Usage, ULONG Tag, ULONG64 Count, ULONG64 Bytes)
+{
+    Usage->Tag = Tag;
+    Usage->Count = Count;
+    Usage->Bytes = Bytes;
+    Usage->UsedBytes = Bytes;
+}
+
+VOID
+GetTrackedFilesMemory(PTRACKED_FILES TrackedFilesList, PTRACKED_FILES_MEMORY Memory)
+{
+    RtlZeroMemory(Memory, sizeof(TRACKED_FILES_MEMORY));
+    BlockPoolQueryUsage(&TrackedFilesList->Entries, &Memory->Entries);
+
+    ExAcquireFastMutex(&TrackedFilesList->WriteLock);
+    PTRACKED_FILES_TABLE table = TrackedFilesList->Table;
+    if (table) {
+        SetUsage(&Memory->Table, 'kFtL', table->BucketCount,
+            FIELD_OFFSET(TRACKED_FILES_TABLE, Buckets) + table->BucketCount * sizeof(PTRACKED_FILE_ENTRY));
+    }
+    if (TrackedFilesList->Directories) {
+        ULONG64 nodes;
+        ULONG64 bytes;
+        PathTrieQueryUsage(TrackedFilesList->Directories, &nodes, &bytes);
+        SetUsage(&Memory->Directories, 'tPtL', nodes, bytes);
+    }
+    if (TrackedFilesList->Filter) {
+        SetUsage(&Memory->Filter, 'fPtL', 1, PathFilterSize(TrackedFilesList->Filter));
+    }
+    if (TrackedFilesList->Image) {
+        const RULE_IMAGE_HEADER* header = TrackedFilesList->Image->View.Header;
+        SetUsage(&Memory->Image, 'mItL', (ULONG64)header->NameCount + header->DirectoryCount, header->ImageSize);
+    }
+    if (TrackedFilesList->Patterns) {
+        SetUsage(&Memory->Patterns, 'gGtL', TrackedFilesList->Patterns->StateCount,
+            GlobRulesSize(TrackedFilesList->Patterns));
+    }
+    ExReleaseFastMutex(&TrackedFilesList->WriteLock);
+}
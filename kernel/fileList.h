@@ -1,85 +1,344 @@
 #pragma once
 #include <fltKernel.h>
 #include <dontuse.h>
+#include "pathTrie.h"
+#include "globRules.h"
+#include "pathFilter.h"
+#include "ruleImage.h"
+#include "blockPool.h"
+#include "volumeRules.h"
+#include "ruleOps.h"
+
+/**
+ * @def TRACKED_FILES_INITIAL_BUCKETS
+ * @brief Number of hash buckets allocated when the table is initialized (power of two).
+ */
+#define TRACKED_FILES_INITIAL_BUCKETS 64
+
+/**
+ * @def TRACKED_FILES_MAX_BUCKETS
+ * @brief Upper bound on the bucket array; past this the chains simply grow longer.
+ */
+#define TRACKED_FILES_MAX_BUCKETS (1 << 22)
+
+/**
+ * @def TRACKED_FILES_MAX_LOAD
+ * @brief Average chain length that triggers doubling the bucket array.
+ */
+#define TRACKED_FILES_MAX_LOAD 2
+
+/**
+ * @def TRACKED_FILES_FILTER_SLACK
+ * @brief Fraction (1/n) of removed keys the prefilter may keep before it is rebuilt.
+ */
+#define TRACKED_FILES_FILTER_SLACK 4
 
 /**
  * @struct _TRACKED_FILE_ENTRY
- * @brief Structure to hold each tracked filename in the linked list.
+ * @brief Structure to hold each tracked filename in the hash table.
  *
- * This structure represents a single entry in the list of tracked files,
- * containing the filename, a flag indicating if the file is protected,
- * and a link to the next/previous entries.
+ * This structure represents a single entry in the table of tracked files,
+ * containing the filename, its case-folded hash, the operations its rule
+ * tracks or denies, and a link to the next entry in its bucket. The name is
+ * stored inline, so an entry is one block of TRACKED_FILE_ENTRY_SIZE bytes from
+ * the table's block pool. Entries are immutable once published; readers walk
+ * the chains without taking a lock.
  */
 typedef struct _TRACKED_FILE_ENTRY {
-    LIST_ENTRY ListEntry;    ///< Must be the first member for LIST_ENTRY compatibility with the linked list.
-    UNICODE_STRING FileName; ///< Stores the tracked filename as a UNICODE_STRING.
-    BOOLEAN Protected;       ///< Flag indicating if the file is protected from deletion.
+    struct _TRACKED_FILE_ENTRY* Next; ///< Next entry in the bucket chain, published with release semantics.
+    ULONG Hash;              ///< Case-folded hash of FileName, kept so the table can be resized without rehashing strings.
+    UNICODE_STRING FileName; ///< Stores the tracked filename, upcased, as a UNICODE_STRING.
+    UCHAR Operations;        ///< RULE_* bits of the file's rule, 0 for a masked entry.
+    BOOLEAN Masked;          ///< The name was removed while the rule image holds it; the entry hides the image's rule and tracks nothing.
+    struct _TRACKED_FILE_ENTRY* Retired; ///< Link in a writer's list of unlinked entries awaiting a grace period; never read by readers.
+    WCHAR Name[ANYSIZE_ARRAY]; ///< Buffer of FileName, null-terminated.
 } TRACKED_FILE_ENTRY, *PTRACKED_FILE_ENTRY;
 
+/**
+ * @def TRACKED_FILE_ENTRY_SIZE
+ * @brief Bytes of an entry whose name is NameLength bytes long.
+ */
+#define TRACKED_FILE_ENTRY_SIZE(NameLength) (FIELD_OFFSET(TRACKED_FILE_ENTRY, Name) + (SIZE_T)(NameLength) + sizeof(WCHAR))
+
+/**
+ * @struct _TRACKED_FILE_UPDATE
+ * @brief One change in a batch passed to UpdateTrackedFiles.
+ */
+typedef struct _TRACKED_FILE_UPDATE {
+    UNICODE_STRING Path; ///< NT path of the file, or of the directory if it ends in a backslash.
+    BOOLEAN Remove;      ///< TRUE to remove the name or directory rule, FALSE to add it.
+    LONG Operations;     ///< For an add, the RULE_* bits of the rule; must not be 0.
+    NTSTATUS Status;     ///< Set to the result of this change, as AddTrackedFile and the other single-rule calls return it.
+} TRACKED_FILE_UPDATE, *PTRACKED_FILE_UPDATE;
+
+/**
+ * @struct _TRACKED_FILES_TABLE
+ * @brief One published version of the bucket array.
+ *
+ * A table is replaced as a whole when it is resized or torn down; readers that
+ * still hold the old version keep a consistent view until the writer's grace
+ * period ends.
+ */
+typedef struct _TRACKED_FILES_TABLE {
+    ULONG BucketCount;                 ///< Number of buckets (always a power of two).
+    PTRACKED_FILE_ENTRY Buckets[1];    ///< Heads of the bucket chains, BucketCount entries long.
+} TRACKED_FILES_TABLE, *PTRACKED_FILES_TABLE;
+
+/**
+ * @struct _TRACKED_FILES_IMAGE
+ * @brief A precompiled rule image, looked up in place.
+ */
+typedef struct _TRACKED_FILES_IMAGE {
+    RULE_IMAGE_VIEW View;    ///< Sections of Data, checked by RuleImageOpen.
+    PVOID Data;              ///< The image, in nonpaged pool owned by the table.
+} TRACKED_FILES_IMAGE, *PTRACKED_FILES_IMAGE;
+
 /**
  * @struct _TRACKED_FILES
- * @brief Global structure to manage the list of tracked files.
+ * @brief Global structure to manage the table of tracked files.
  *
- * This structure holds the head of the linked list of tracked files and a spinlock
- * for thread-safe operations.
+ * Readers (the filter callbacks) take no lock: they enter a read section on the
+ * active cache-aware rundown reference, check the prefilter, then read the published
+ * table pointer and walk the chains, the directory trie and the pattern DFA. Writers (the IOCTL paths, at PASSIVE_LEVEL) serialize on a
+ * fast mutex, publish their change with a single pointer store, and before
+ * freeing anything they flip the active reference and wait for the readers
+ * that entered on the old one to drain.
  */
 typedef struct _TRACKED_FILES {
-    LIST_ENTRY FileListHead; ///< Head of the doubly-linked list of tracked file entries.
-    KSPIN_LOCK Lock;         ///< Spinlock for synchronizing access to the list.
+    PTRACKED_FILES_TABLE Table;              ///< Published table, NULL once the table has been cleaned up.
+    PPATH_TRIE_NODE Directories;             ///< Published root of the directory rules, NULL once cleaned up.
+    PGLOB_RULES Patterns;                    ///< Published compiled wildcard ruleset, NULL if none is set.
+    PPATH_FILTER Filter;                     ///< Published prefilter over the names and directory rules, NULL once cleaned up.
+    PTRACKED_FILES_IMAGE Image;              ///< Published rule image whose names back the table, NULL if none is loaded.
+    BLOCK_POOL Entries;                      ///< Serves the blocks of the entries.
+    VOLUME_RULES Volumes;                    ///< Rules counted per volume; updated under WriteLock, read without a lock.
+    LONG OperationRules[RULE_BIT_COUNT];     ///< Rules having each RULE_* bit, patterns included, protected by WriteLock.
+    LONG PatternOperationRules[RULE_BIT_COUNT]; ///< Share of OperationRules that comes from the patterns, protected by WriteLock.
+    volatile LONG Operations;                ///< RULE_* bits some rule has, published with release semantics.
+    PEX_RUNDOWN_REF_CACHE_AWARE Readers[2];  ///< Read-section references; only Readers[ActiveReaders] admits new readers.
+    LONG ActiveReaders;                      ///< Index of the reference new readers enter on.
+    ULONG EntryCount;                        ///< Number of tracked file entries, protected by WriteLock.
+    ULONG DirectoryCount;                    ///< Number of directory rules, protected by WriteLock.
+    ULONG FilterStale;                       ///< Keys removed since the prefilter was built, protected by WriteLock.
+    volatile LONG64 Generation;              ///< Bumped after every rule change; tags cached verdicts.
+    FAST_MUTEX WriteLock;                    ///< Serializes writers.
 } TRACKED_FILES, *PTRACKED_FILES;
 
 /**
- * @brief Initializes the tracked files list.
+ * @struct _TRACKED_FILES_MEMORY
+ * @brief Memory held by the rules, as returned by GetTrackedFilesMemory.
+ */
+typedef struct _TRACKED_FILES_MEMORY {
+    MEMORY_USAGE Entries;      ///< Entries of the table, names included.
+    MEMORY_USAGE Table;        ///< Bucket array; Count is its number of buckets.
+    MEMORY_USAGE Directories;  ///< Nodes of the directory trie.
+    MEMORY_USAGE Filter;       ///< Prefilter.
+    MEMORY_USAGE Image;        ///< Rule image; Count is its number of rules.
+    MEMORY_USAGE Patterns;     ///< Compiled wildcard rules; Count is their number of DFA states.
+} TRACKED_FILES_MEMORY, *PTRACKED_FILES_MEMORY;
+
+/**
+ * @brief Initializes the tracked files table.
  *
- * Sets up the linked list head and initializes the spinlock for thread-safe operations.
+ * Allocates the initial bucket array, the directory trie root and the read-section references,
+ * and initializes the writer lock and the entries' block pool.
  *
  * @param[in,out] TrackedFilesList Pointer to the TRACKED_FILES structure to initialize.
- * @return NTSTATUS STATUS_SUCCESS on success, or an appropriate error code.
+ * @return NTSTATUS STATUS_SUCCESS on success, STATUS_INSUFFICIENT_RESOURCES if allocation fails.
  */
 NTSTATUS InitializeTrackedFiles(PTRACKED_FILES TrackedFilesList);
 
 /**
- * @brief Adds a file to the tracked files list.
+ * @brief Adds a file to the tracked files table if it is not already present.
  *
- * Allocates a new entry, copies the provided filename, and inserts it into the list.
+ * Allocates a new entry, copies the provided filename, and publishes it at the head of its bucket.
+ * The duplicate check and the insert happen under a single writer section, so two
+ * concurrent adds of the same name cannot both succeed. Must be called at PASSIVE_LEVEL.
  *
- * @param[in,out] TrackedFilesList Pointer to the TRACKED_FILES structure managing the list.
+ * @param[in,out] TrackedFilesList Pointer to the TRACKED_FILES structure managing the table.
  * @param[in] FileName Pointer to a null-terminated wide-character string of the filename to track.
- * @param[in] Protected Flag indicating if the file is protected from deletion.
- * @return NTSTATUS STATUS_SUCCESS on success, STATUS_INSUFFICIENT_RESOURCES if allocation fails.
+ * @param[in] Operations RULE_* bits of the rule, e.g. RULE_DEFAULT; must not be 0.
+ * @return NTSTATUS STATUS_SUCCESS on success, STATUS_ALREADY_REGISTERED if the file is already
+ *         tracked, STATUS_INSUFFICIENT_RESOURCES if allocation fails.
  */
-NTSTATUS AddTrackedFile(PTRACKED_FILES TrackedFilesList, PCWSTR FileName, BOOLEAN Protected);
+NTSTATUS AddTrackedFile(PTRACKED_FILES TrackedFilesList, PCWSTR FileName, LONG Operations);
 
 /**
- * @brief Removes a file from the tracked files list.
+ * @brief Removes a file from the tracked files table.
  *
- * Searches for the specified file and removes it from the list if found, freeing its memory.
+ * Unlinks the entry from its bucket and frees it once no reader can still be looking at it. A name the
+ * rule image holds is hidden behind a masked entry instead. Must be called at PASSIVE_LEVEL.
  *
- * @param[in,out] TrackedFilesList Pointer to the TRACKED_FILES structure managing the list.
+ * @param[in,out] TrackedFilesList Pointer to the TRACKED_FILES structure managing the table.
  * @param[in] FilePath Pointer to a null-terminated wide-character string of the filename to remove.
  * @return NTSTATUS STATUS_SUCCESS if removed, STATUS_NOT_FOUND if not in the list.
  */
 NTSTATUS RemoveTrackedFile(PTRACKED_FILES TrackedFilesList, PCWSTR FilePath);
 
 /**
- * @brief Cleans up the tracked files list.
+ * @brief Adds a rule covering a directory and every file below it.
  *
- * Frees all entries in the list and resets the structure to an empty state.
+ * Files tracked individually with AddTrackedFile take precedence over directory rules, and a
+ * rule on a subdirectory takes precedence over one on its parent. Must be called at PASSIVE_LEVEL.
+ *
+ * @param[in,out] TrackedFilesList Pointer to the TRACKED_FILES structure managing the table.
+ * @param[in] DirectoryPath Pointer to a null-terminated wide-character string of the directory's NT path.
+ * @param[in] Operations RULE_* bits of the rule for the files below the directory; must not be 0.
+ * @return NTSTATUS STATUS_SUCCESS on success, STATUS_ALREADY_REGISTERED if the directory already
+ *         has a rule, STATUS_INSUFFICIENT_RESOURCES if allocation fails.
+ */
+NTSTATUS AddTrackedDirectory(PTRACKED_FILES TrackedFilesList, PCWSTR DirectoryPath, LONG Operations);
+
+/**
+ * @brief Removes the rule registered for a directory.
+ *
+ * Must be called at PASSIVE_LEVEL.
+ *
+ * @param[in,out] TrackedFilesList Pointer to the TRACKED_FILES structure managing the table.
+ * @param[in] DirectoryPath Pointer to a null-terminated wide-character string of the directory's NT path.
+ * @return NTSTATUS STATUS_SUCCESS if removed, STATUS_NOT_FOUND if the directory has no rule.
+ */
+NTSTATUS RemoveTrackedDirectory(PTRACKED_FILES TrackedFilesList, PCWSTR DirectoryPath);
+
+/**
+ * @brief Adds and removes a batch of file names and directory rules in one writer section.
+ *
+ * The updates are applied in order, each one as AddTrackedFile, RemoveTrackedFile, AddTrackedDirectory or
+ * RemoveTrackedDirectory would, and a failed update does not stop the others. The prefilter and the
+ * generation are updated once for the whole batch, the bucket array doubles as the batch fills it, and a single
+ * grace period covers every entry it removed, so loading a large ruleset costs one lock round trip instead of
+ * one per rule.
+ * Must be called at PASSIVE_LEVEL.
+ *
+ * @param[in,out] TrackedFilesList Pointer to the TRACKED_FILES structure managing the table.
+ * @param[in,out] Updates Array of Count updates; each one's Status receives its result. The paths need not be
+ *                null-terminated and are copied, so they may be freed afterwards.
+ * @param[in] Count Number of updates.
+ * @param[out] Applied Receives the number of updates that succeeded.
+ * @return NTSTATUS STATUS_SUCCESS once every update has been attempted, STATUS_DELETE_PENDING if the table
+ *         has been cleaned up.
+ */
+NTSTATUS UpdateTrackedFiles(PTRACKED_FILES TrackedFilesList, PTRACKED_FILE_UPDATE Updates, ULONG Count, PULONG Applied);
+
+/**
+ * @brief Loads a precompiled rule image.
+ *
+ * The image's names are looked up in place, after the table, so files added and removed later override it;
+ * its directory rules are added to the directory rules like AddTrackedDirectory would. A previously loaded
+ * image is replaced. Must be called at PASSIVE_LEVEL.
+ *
+ * @param[in,out] TrackedFilesList Pointer to the TRACKED_FILES structure managing the table.
+ * @param[in] Image The image, in nonpaged pool. On success the table owns it and frees it with ExFreePool.
+ * @param[in] Size Bytes in Image.
+ * @return NTSTATUS STATUS_SUCCESS on success, STATUS_INVALID_IMAGE_FORMAT if RuleImageOpen rejects the image,
+ *         STATUS_INSUFFICIENT_RESOURCES if allocation fails, STATUS_DELETE_PENDING if the table has been cleaned up.
+ */
+NTSTATUS LoadTrackedFilesImage(PTRACKED_FILES TrackedFilesList, PVOID Image, ULONG Size);
+
+/**
+ * @brief Replaces the wildcard ruleset.
+ *
+ * Compiles the patterns into a single DFA outside the writer lock, publishes it in place of the
+ * previous ruleset and frees the old one once no reader can still be using it. Patterns are only
+ * consulted for files that match neither a name nor a directory rule. Must be called at PASSIVE_LEVEL.
+ *
+ * @param[in,out] TrackedFilesList Pointer to the TRACKED_FILES structure managing the table.
+ * @param[in] Patterns Array of PatternCount patterns, see GLOB_PATTERN.
+ * @param[in] PatternCount Number of patterns; 0 removes the current ruleset.
+ * @return NTSTATUS STATUS_SUCCESS on success, or the error returned by GlobRulesCompile.
+ */
+NTSTATUS SetTrackedPatterns(PTRACKED_FILES TrackedFilesList, PGLOB_PATTERN Patterns, ULONG PatternCount);
+
+/**
+ * @brief Cleans up the tracked files table.
+ *
+ * Unpublishes the table, waits for in-flight readers, then frees all entries, the bucket array,
+ * the directory trie and the pattern ruleset. Afterwards lookups find nothing and changes fail with
+ * STATUS_DELETE_PENDING, but the read sections stay valid, so the control device may still be used until
+ * DeleteTrackedFiles. Must be called at PASSIVE_LEVEL; safe to call more than once.
  *
  * @param[in,out] TrackedFilesList Pointer to the TRACKED_FILES structure to clean up.
  */
 VOID CleanupTrackedFiles(PTRACKED_FILES TrackedFilesList);
 
 /**
- * @brief Checks if a file is in the tracked files list.
+ * @brief Cleans up the tracked files table if needed, then frees the read-section references and the entry pool.
+ *
+ * Must be called at PASSIVE_LEVEL, once nothing can call into the table any more: after the filter is
+ * unregistered and the control device deleted. Safe to call on a table whose initialization failed.
+ *
+ * @param[in,out] TrackedFilesList Pointer to the TRACKED_FILES structure to delete.
+ */
+VOID DeleteTrackedFiles(PTRACKED_FILES TrackedFilesList);
+
+/**
+ * @brief Returns the ruleset generation.
+ *
+ * The generation starts at 1 and is incremented after every change to the names, directory rules or
+ * patterns has been published, so a verdict computed after reading generation G is current as long as
+ * the generation still reads G.
+ *
+ * @param[in] TrackedFilesList Pointer to the TRACKED_FILES structure managing the table.
+ * @return LONG64 The current generation.
+ */
+LONG64 GetTrackedFilesGeneration(PTRACKED_FILES TrackedFilesList);
+
+/**
+ * @brief Finds the rule of a file, either by name or by a rule on one of its directories.
  *
- * Searches the list for a matching filename (case-insensitive).
+ * Paths the prefilter rules out skip straight to the wildcard ruleset. Otherwise hashes the case-folded
+ * filename and searches only the matching bucket (case-insensitive), then the rule image's perfect hash if the
+ * table has no entry for the name. If the file is not tracked by name, falls back to the longest matching
+ * directory rule and then to the wildcard ruleset, whose matching patterns combine their operations.
+ * Takes no lock and may be called at IRQL <= DISPATCH_LEVEL.
  *
- * @param[in] TrackedFilesList Pointer to the TRACKED_FILES structure managing the list.
+ * @param[in] TrackedFilesList Pointer to the TRACKED_FILES structure managing the table.
  * @param[in] FilePath Pointer to a UNICODE_STRING containing the filename to search for.
- * @param[out] FoundFilePath Optional pointer to a UNICODE_STRING to receive the matched filename (if found).
- * @param[out] Protected Optional pointer to a BOOLEAN to receive the protection status of the file (if found).
- * @return BOOLEAN TRUE if the file is found, FALSE otherwise.
+ * @return LONG The RULE_* bits of the most specific rule covering the file, 0 if it is not tracked.
+ */
+LONG GetTrackedFile(PTRACKED_FILES TrackedFilesList, PUNICODE_STRING FilePath);
+
+/**
+ * @brief Returns the RULE_* bits that at least one rule has, so a callback can skip operations no rule names.
+ *
+ * A change that adds a bit publishes it before the rule it comes from, and one that removes the last rule with
+ * a bit clears it after the rule is gone, so the mask never says less than a lookup could find. A single
+ * read without a lock; may be called at any IRQL.
+ *
+ * @param[in] TrackedFilesList Pointer to the TRACKED_FILES structure managing the table.
+ * @return LONG The union of the RULE_* bits of every name, directory rule and pattern.
+ */
+LONG GetTrackedOperations(PTRACKED_FILES TrackedFilesList);
+
+/**
+ * @brief Checks whether any rule can match a file on a volume.
+ *
+ * Counts every name, directory rule and pattern on the volume its path starts with; a pattern that names no
+ * literal volume counts on all of them. Takes no lock and may be called at IRQL <= DISPATCH_LEVEL. A change that
+ * adds the first rule of a volume bumps the generation, like any other.
+ *
+ * @param[in] TrackedFilesList Pointer to the TRACKED_FILES structure managing the table.
+ * @param[in] VolumeName The NT device name of the volume, upcased, e.g. \DEVICE\HARDDISKVOLUME3.
+ * @return BOOLEAN TRUE if some rule can match on the volume.
+ */
+BOOLEAN GetTrackedVolume(PTRACKED_FILES TrackedFilesList, PCUNICODE_STRING VolumeName);
+
+/**
+ * @brief Copies the prefilter counters and size.
+ *
+ * The counters are the PERF_COUNTER_FILTER_* totals, kept per processor so a lookup never writes a shared line.
+ *
+ * @param[in] TrackedFilesList Pointer to the TRACKED_FILES structure managing the table.
+ * @param[out] Stats Pointer to the structure receiving the counters.
+ */
+VOID GetTrackedFilesFilterStats(PTRACKED_FILES TrackedFilesList, PPATH_FILTER_STATS Stats);
+
+/**
+ * @brief Reports the memory held by the rules, part by part.
+ *
+ * Takes the writer lock, since the directory trie is walked to be measured. Must be called at PASSIVE_LEVEL.
+ *
+ * @param[in] TrackedFilesList Pointer to the TRACKED_FILES structure managing the table.
+ * @param[out] Memory Receives the usage of each part; parts that do not exist are zero.
  */
-BOOLEAN GetTrackedFile(PTRACKED_FILES TrackedFilesList, PUNICODE_STRING FilePath, 
-                       PUNICODE_STRING FoundFilePath, PBOOLEAN Protected);
\ No newline at end of file
+VOID GetTrackedFilesMemory(PTRACKED_FILES TrackedFilesList, PTRACKED_FILES_MEMORY Memory);
\ No newline at end of file
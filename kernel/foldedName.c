@@ -0,0 +1,116 @@
+#include <fltKernel.h>
+#include <dontuse.h>
+#include "foldedName.h"
+
+// x64 kernel code may use the XMM registers freely. The YMM registers of AVX2 would need
+// KeSaveExtendedProcessorState around every use, which costs more than the short names gain; x86 would need
+// KeSaveFloatingPointState even for SSE2. Other targets take the scalar loops.
+#if defined(_M_AMD64)
+#include <emmintrin.h>
+#define FOLDED_NAME_SSE2
+#endif
+
+
+WCHAR
+FoldNameChar(WCHAR Ch)
+{
+    if (Ch < L'a') return Ch;
+    if (Ch <= L'z') return Ch - (L'a' - L'A');
+    if (Ch < 0x80) return Ch;
+    return RtlUpcaseUnicodeChar(Ch);
+}
+
+VOID
+FoldNameChars(PWCH Destination, PCWCH Source, ULONG Count)
+{
+    ULONG i = 0;
+
+#ifdef FOLDED_NAME_SSE2
+    const __m128i nonAscii = _mm_set1_epi16((short)0xFF80);
+    const __m128i beforeA = _mm_set1_epi16(L'a' - 1);
+    const __m128i afterZ = _mm_set1_epi16(L'z' + 1);
+    const __m128i caseBit = _mm_set1_epi16(L'a' - L'A');
+
+    for (; i + 8 <= Count; i += 8) {
+        __m128i chars = _mm_loadu_si128((const __m128i*)(Source + i));
+
+        // A block with a non-ASCII character goes through the table one character at a time
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(chars, nonAscii), _mm_setzero_si128())) != 0xFFFF) {
+            for (ULONG j = i; j < i + 8; j++) {
+                Destination[j] = FoldNameChar(Source[j]);
+            }
+            continue;
+        }
+
+        // ASCII compares correctly as signed 16-bit values
+        __m128i lower = _mm_and_si128(_mm_cmpgt_epi16(chars, beforeA), _mm_cmplt_epi16(chars, afterZ));
+        _mm_storeu_si128((__m128i*)(Destination + i), _mm_sub_epi16(chars, _mm_and_si128(lower, caseBit)));
+    }
+#endif
+
+    for (; i < Count; i++) {
+        Destination[i] = FoldNameChar(Source[i]);
+    }
+}
+
+NTSTATUS
+FoldName(PCUNICODE_STRING Name, PFOLDED_NAME Folded)
+{
+    USHORT count = Name->Length / sizeof(WCHAR);
+
+    Folded->String.Buffer = Folded->Inline;
+    Folded->String.Length = 0;
+    Folded->String.MaximumLength = sizeof(Folded->Inline);
+    if (count > FOLDED_NAME_INLINE_CHARS) {
+        Folded->String.Buffer = ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, Name->Length, 'nFtL');
+        if (!Folded->String.Buffer) {
+            Folded->String.Buffer = Folded->Inline;
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        Folded->String.MaximumLength = Name->Length;
+    }
+
+    FoldNameChars(Folded->String.Buffer, Name->Buffer, count);
+    Folded->String.Length = count * sizeof(WCHAR);
+    return STATUS_SUCCESS;
+}
+
+VOID
+ReleaseFoldedName(PFOLDED_NAME Folded)
+{
+    if (Folded->String.Buffer != Folded->Inline) {
+        ExFreePoolWithTag(Folded->String.Buffer, 'nFtL');
+        Folded->String.Buffer = Folded->Inline;
+    }
+}
+
+BOOLEAN
+FoldedNamesEqual(PCUNICODE_STRING Left, PCUNICODE_STRING Right)
+{
+    // Most candidates sharing a bucket differ in length, which settles it without touching the strings
+    if (Left->Length != Right->Length) {
+        return FALSE;
+    }
+
+    const UCHAR* left = (const UCHAR*)Left->Buffer;
+    const UCHAR* right = (const UCHAR*)Right->Buffer;
+    ULONG length = Left->Length;
+    ULONG i = 0;
+
+#ifdef FOLDED_NAME_SSE2
+    for (; i + 16 <= length; i += 16) {
+        __m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(left + i)),
+            _mm_loadu_si128((const __m128i*)(right + i)));
+        if (_mm_movemask_epi8(equal) != 0xFFFF) {
+            return FALSE;
+        }
+    }
+#endif
+
+    for (; i < length; i++) {
+        if (left[i] != right[i]) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
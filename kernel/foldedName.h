@@ -0,0 +1,63 @@
+#pragma once
+#include <fltKernel.h>
+#include <dontuse.h>
+
+/**
+ * @def FOLDED_NAME_INLINE_CHARS
+ * @brief Characters a FOLDED_NAME holds without a pool allocation; most NT paths are shorter.
+ */
+#define FOLDED_NAME_INLINE_CHARS 256
+
+/**
+ * @struct _FOLDED_NAME
+ * @brief A name upcased once, so it can be hashed and compared as plain data afterwards.
+ *
+ * Lives on the caller's stack; a name longer than FOLDED_NAME_INLINE_CHARS gets a nonpaged buffer, which
+ * ReleaseFoldedName frees.
+ */
+typedef struct _FOLDED_NAME {
+    UNICODE_STRING String;                  ///< The upcased name; Buffer points to Inline or to a pool buffer.
+    WCHAR Inline[FOLDED_NAME_INLINE_CHARS]; ///< Storage for short names.
+} FOLDED_NAME, *PFOLDED_NAME;
+
+/**
+ * @brief Upcases one character the way RtlUpcaseUnicodeChar does, without the call for the ASCII range.
+ *
+ * @param[in] Ch The character.
+ * @return WCHAR The upcased character.
+ */
+WCHAR FoldNameChar(WCHAR Ch);
+
+/**
+ * @brief Upcases Count characters from Source into Destination, eight at a time where they are ASCII.
+ *
+ * @param[out] Destination Receives Count characters; may be Source.
+ * @param[in] Source The characters to upcase.
+ * @param[in] Count Number of characters.
+ */
+VOID FoldNameChars(PWCH Destination, PCWCH Source, ULONG Count);
+
+/**
+ * @brief Upcases a name into a FOLDED_NAME. Callable at IRQL <= DISPATCH_LEVEL.
+ *
+ * @param[in] Name The name, in any case.
+ * @param[out] Folded Receives the upcased name; release it with ReleaseFoldedName, even on failure.
+ * @return NTSTATUS STATUS_SUCCESS, or STATUS_INSUFFICIENT_RESOURCES if a long name found no buffer.
+ */
+NTSTATUS FoldName(PCUNICODE_STRING Name, PFOLDED_NAME Folded);
+
+/**
+ * @brief Frees the buffer of a long folded name.
+ *
+ * @param[in,out] Folded A name passed to FoldName.
+ */
+VOID ReleaseFoldedName(PFOLDED_NAME Folded);
+
+/**
+ * @brief Compares two upcased names exactly: lengths first, then sixteen bytes at a time.
+ *
+ * @param[in] Left An upcased name.
+ * @param[in] Right An upcased name.
+ * @return BOOLEAN TRUE if the names are equal.
+ */
+BOOLEAN FoldedNamesEqual(PCUNICODE_STRING Left, PCUNICODE_STRING Right);
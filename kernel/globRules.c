@@ -0,0 +1,466 @@
+#include <fltKernel.h>
+#include <dontuse.h>
+#include "globRules.h"
+
+
+#define CLASS_OTHER     0
+#define CLASS_SEPARATOR 1
+
+#define SET_HASH_SLOTS  (1 << 17)   // power of two, at least twice GLOB_MAX_STATES
+
+typedef enum _GLOB_TOKEN_TYPE {
+    GlobLiteral,
+    GlobOne,        // ?   one character within a component
+    GlobStar,       // *   any run of characters within a component
+    GlobAny,        // **  any run of characters, separators included
+    GlobAnyDirs,    // **\ nothing, or any run ending in a separator
+    GlobFinal       // end of a pattern
+} GLOB_TOKEN_TYPE;
+
+typedef struct _GLOB_TOKEN {
+    UCHAR Type;
+    USHORT Class;   // class of a literal
+    WCHAR Char;     // upcased literal
+    LONG Flags;     // rule flags of a final token
+} GLOB_TOKEN, *PGLOB_TOKEN;
+
+// Token t owns NFA states 2t (before the token) and 2t+1 (inside a '**\' run); a DFA state is a
+// sorted set of NFA states, interned in a hash table so every distinct set gets one DFA state.
+typedef struct _GLOB_COMPILER {
+    PGLOB_TOKEN Tokens;
+    ULONG TokenCount;
+    ULONG ClassCount;
+    USHORT AsciiClass[GLOB_ASCII_CLASSES];
+    PWCHAR WideChars;
+    ULONG WideCount;
+
+    PULONG Mark;            // generation stamp per NFA state, for deduplication
+    ULONG Generation;
+    PULONG Scratch;         // NFA states of the set being built
+    ULONG ScratchCount;
+
+    PULONG SetPool;         // all interned sets, back to back
+    ULONG SetPoolCount;
+    ULONG SetPoolCapacity;
+    PULONG SetOffset;       // per DFA state
+    PULONG SetLength;
+    PLONG Accept;
+    PUSHORT Transitions;
+    ULONG StateCount;
+    ULONG StateCapacity;
+    PULONG HashSlots;       // DFA state ids, 0 marks a free slot
+} GLOB_COMPILER, *PGLOB_COMPILER;
+
+
+static PVOID
+AllocatePaged(SIZE_T Size)
+{
+    return ExAllocatePool2(POOL_FLAG_PAGED, Size, 'gGtL');
+}
+
+// Reallocates a paged array so that it holds at least Needed elements
+static BOOLEAN
+GrowArray(PVOID* Array, ULONG Count, ULONG Needed, SIZE_T ElementSize)
+{
+    PVOID grown = AllocatePaged(Needed * ElementSize);
+    if (!grown) return FALSE;
+    if (*Array) {
+        RtlCopyMemory(grown, *Array, Count * ElementSize);
+        ExFreePool(*Array);
+    }
+    *Array = grown;
+    return TRUE;
+}
+
+static USHORT
+ClassOf(PUSHORT AsciiClass, PWCHAR WideChars, PUSHORT WideClasses, ULONG WideCount, WCHAR Ch)
+{
+    if (Ch < GLOB_ASCII_CLASSES) {
+        return AsciiClass[Ch];
+    }
+
+    ULONG low = 0;
+    ULONG high = WideCount;
+    while (low < high) {
+        ULONG mid = (low + high) / 2;
+        if (WideChars[mid] == Ch) return WideClasses ? WideClasses[mid] : (USHORT)mid;
+        if (WideChars[mid] < Ch) low = mid + 1;
+        else high = mid;
+    }
+    return CLASS_OTHER;
+}
+
+static VOID
+SortUlongs(PULONG Values, ULONG Count)
+{
+    for (ULONG gap = Count / 2; gap > 0; gap /= 2) {
+        for (ULONG i = gap; i < Count; i++) {
+            ULONG value = Values[i];
+            ULONG j = i;
+            while (j >= gap && Values[j - gap] > value) {
+                Values[j] = Values[j - gap];
+                j -= gap;
+            }
+            Values[j] = value;
+        }
+    }
+}
+
+static VOID
+SortWchars(PWCHAR Values, ULONG Count)
+{
+    for (ULONG gap = Count / 2; gap > 0; gap /= 2) {
+        for (ULONG i = gap; i < Count; i++) {
+            WCHAR value = Values[i];
+            ULONG j = i;
+            while (j >= gap && Values[j - gap] > value) {
+                Values[j] = Values[j - gap];
+                j -= gap;
+            }
+            Values[j] = value;
+        }
+    }
+}
+
+// Turns the patterns into one token array, each pattern ending in a final token carrying its flags
+static NTSTATUS
+Tokenize(PGLOB_COMPILER C, PGLOB_PATTERN Patterns, ULONG PatternCount)
+{
+    ULONG capacity = 0;
+    for (ULONG p = 0; p < PatternCount; p++) {
+        if (Patterns[p].Pattern.Length == 0) return STATUS_INVALID_PARAMETER;
+        capacity += Patterns[p].Pattern.Length / sizeof(WCHAR) + 2;
+    }
+    if (capacity > MAXULONG / 2 - 1) return STATUS_IMPLEMENTATION_LIMIT;
+
+    C->Tokens = AllocatePaged(capacity * sizeof(GLOB_TOKEN));
+    C->WideChars = AllocatePaged(capacity * sizeof(WCHAR));
+    if (!C->Tokens || !C->WideChars) return STATUS_INSUFFICIENT_RESOURCES;
+
+    for (ULONG p = 0; p < PatternCount; p++) {
+        PCWCH text = Patterns[p].Pattern.Buffer;
+        ULONG count = Patterns[p].Pattern.Length / sizeof(WCHAR);
+        ULONG i = 0;
+
+        // Unanchored patterns may start in any directory
+        if (text[0] != L'\\') {
+            C->Tokens[C->TokenCount++].Type = GlobAnyDirs;
+        }
+
+        while (i < count) {
+            PGLOB_TOKEN token = &C->Tokens[C->TokenCount++];
+            WCHAR ch = RtlUpcaseUnicodeChar(text[i]);
+            if (ch == L'*' && i + 1 < count && text[i + 1] == L'*') {
+                if (i + 2 < count && text[i + 2] == L'\\') {
+                    token->Type = GlobAnyDirs;
+                    i += 3;
+                }
+                else {
+                    token->Type = GlobAny;
+                    i += 2;
+                }
+            }
+            else if (ch == L'*') {
+                token->Type = GlobStar;
+                i++;
+            }
+            else if (ch == L'?') {
+                token->Type = GlobOne;
+                i++;
+            }
+            else {
+                token->Type = GlobLiteral;
+                token->Char = ch;
+                if (ch >= GLOB_ASCII_CLASSES) {
+                    C->WideChars[C->WideCount++] = ch;
+                }
+                i++;
+            }
+        }
+
+        PGLOB_TOKEN final = &C->Tokens[C->TokenCount++];
+        final->Type = GlobFinal;
+        final->Flags = Patterns[p].Flags;
+    }
+
+    // Every distinct literal gets its own class; ASCII first, then the sorted non-ASCII characters
+    C->ClassCount = CLASS_SEPARATOR + 1;
+    C->AsciiClass[L'\\'] = CLASS_SEPARATOR;
+    for (ULONG t = 0; t < C->TokenCount; t++) {
+        WCHAR ch = C->Tokens[t].Char;
+        if (C->Tokens[t].Type == GlobLiteral && ch < GLOB_ASCII_CLASSES && C->AsciiClass[ch] == CLASS_OTHER) {
+            C->AsciiClass[ch] = (USHORT)C->ClassCount++;
+        }
+    }
+
+    SortWchars(C->WideChars, C->WideCount);
+    ULONG unique = 0;
+    for (ULONG w = 0; w < C->WideCount; w++) {
+        if (unique == 0 || C->WideChars[unique - 1] != C->WideChars[w]) {
+            C->WideChars[unique++] = C->WideChars[w];
+        }
+    }
+    C->WideCount = unique;
+    if (C->ClassCount + C->WideCount > MAXUSHORT) return STATUS_IMPLEMENTATION_LIMIT;
+
+    for (ULONG t = 0; t < C->TokenCount; t++) {
+        if (C->Tokens[t].Type == GlobLiteral) {
+            WCHAR ch = C->Tokens[t].Char;
+            C->Tokens[t].Class = ch < GLOB_ASCII_CLASSES
+                ? C->AsciiClass[ch]
+                : (USHORT)(C->ClassCount + ClassOf(C->AsciiClass, C->WideChars, NULL, C->WideCount, ch));
+        }
+    }
+    C->ClassCount += C->WideCount;
+    return STATUS_SUCCESS;
+}
+
+// Adds an NFA state and everything reachable from it without consuming a character
+static VOID
+AddState(PGLOB_COMPILER C, ULONG State)
+{
+    for (;;) {
+        if (C->Mark[State] == C->Generation) return;
+        C->Mark[State] = C->Generation;
+        C->Scratch[C->ScratchCount++] = State;
+
+        if (State & 1) return;
+        UCHAR type = C->Tokens[State / 2].Type;
+        if (type != GlobStar && type != GlobAny && type != GlobAnyDirs) return;
+        State += 2;
+    }
+}
+
+static VOID
+Step(PGLOB_COMPILER C, ULONG State, ULONG Class)
+{
+    PGLOB_TOKEN token = &C->Tokens[State / 2];
+    ULONG next = (State / 2 + 1) * 2;
+
+    if (State & 1) {
+        // Inside a '**\' run: keep consuming, or leave it on a separator
+        AddState(C, State);
+        if (Class == CLASS_SEPARATOR) AddState(C, next);
+        return;
+    }
+
+    switch (token->Type) {
+    case GlobLiteral:
+        if (token->Class == Class) AddState(C, next);
+        break;
+    case GlobOne:
+        if (Class != CLASS_SEPARATOR) AddState(C, next);
+        break;
+    case GlobStar:
+        if (Class != CLASS_SEPARATOR) AddState(C, State);
+        break;
+    case GlobAny:
+        AddState(C, State);
+        break;
+    case GlobAnyDirs:
+        if (Class == CLASS_SEPARATOR) AddState(C, next);
+        AddState(C, State | 1);
+        break;
+    default:
+        break;
+    }
+}
+
+// Returns the DFA state for the set in Scratch, creating it if needed; 0 for the empty set, MAXULONG on failure
+static ULONG
+InternSet(PGLOB_COMPILER C, PNTSTATUS Status)
+{
+    if (C->ScratchCount == 0) return 0;
+    SortUlongs(C->Scratch, C->ScratchCount);
+
+    ULONG hash = 2166136261u;
+    for (ULONG i = 0; i < C->ScratchCount; i++) {
+        hash = (hash ^ C->Scratch[i]) * 16777619u;
+    }
+
+    ULONG slot = hash & (SET_HASH_SLOTS - 1);
+    while (C->HashSlots[slot]) {
+        ULONG state = C->HashSlots[slot];
+        if (C->SetLength[state] == C->ScratchCount
+            && RtlEqualMemory(&C->SetPool[C->SetOffset[state]], C->Scratch, C->ScratchCount * sizeof(ULONG))) {
+            return state;
+        }
+        slot = (slot + 1) & (SET_HASH_SLOTS - 1);
+    }
+
+    if (C->StateCount >= GLOB_MAX_STATES || (C->StateCount + 1) * C->ClassCount > GLOB_MAX_TRANSITIONS) {
+        *Status = STATUS_IMPLEMENTATION_LIMIT;
+        return MAXULONG;
+    }
+
+    if (C->StateCount == C->StateCapacity) {
+        ULONG capacity = min(C->StateCapacity * 2, GLOB_MAX_STATES + 1);
+        if (!GrowArray((PVOID*)&C->SetOffset, C->StateCount, capacity, sizeof(ULONG))
+            || !GrowArray((PVOID*)&C->SetLength, C->StateCount, capacity, sizeof(ULONG))
+            || !GrowArray((PVOID*)&C->Accept, C->StateCount, capacity, sizeof(LONG))
+            || !GrowArray((PVOID*)&C->Transitions, C->StateCount * C->ClassCount, capacity * C->ClassCount, sizeof(USHORT))) {
+            *Status = STATUS_INSUFFICIENT_RESOURCES;
+            return MAXULONG;
+        }
+        C->StateCapacity = capacity;
+    }
+
+    if (C->SetPoolCapacity - C->SetPoolCount < C->ScratchCount) {
+        ULONG capacity = max(C->SetPoolCapacity * 2, C->SetPoolCount + C->ScratchCount);
+        if (capacity < C->SetPoolCapacity || !GrowArray((PVOID*)&C->SetPool, C->SetPoolCount, capacity, sizeof(ULONG))) {
+            *Status = STATUS_INSUFFICIENT_RESOURCES;
+            return MAXULONG;
+        }
+        C->SetPoolCapacity = capacity;
+    }
+
+    ULONG state = C->StateCount++;
+    LONG accept = 0;
+    RtlCopyMemory(&C->SetPool[C->SetPoolCount], C->Scratch, C->ScratchCount * sizeof(ULONG));
+    for (ULONG i = 0; i < C->ScratchCount; i++) {
+        ULONG nfaState = C->Scratch[i];
+        if (!(nfaState & 1) && C->Tokens[nfaState / 2].Type == GlobFinal) {
+            accept |= C->Tokens[nfaState / 2].Flags;
+        }
+    }
+    C->SetOffset[state] = C->SetPoolCount;
+    C->SetLength[state] = C->ScratchCount;
+    C->SetPoolCount += C->ScratchCount;
+    C->Accept[state] = accept;
+    C->HashSlots[slot] = state;
+    return state;
+}
+
+static NTSTATUS
+BuildDfa(PGLOB_COMPILER C)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG nfaStates = C->TokenCount * 2;
+
+    C->Mark = AllocatePaged(nfaStates * sizeof(ULONG));
+    C->Scratch = AllocatePaged(nfaStates * sizeof(ULONG));
+    C->HashSlots = AllocatePaged(SET_HASH_SLOTS * sizeof(ULONG));
+    C->StateCapacity = 64;
+    C->SetOffset = AllocatePaged(C->StateCapacity * sizeof(ULONG));
+    C->SetLength = AllocatePaged(C->StateCapacity * sizeof(ULONG));
+    C->Accept = AllocatePaged(C->StateCapacity * sizeof(LONG));
+    C->Transitions = AllocatePaged(C->StateCapacity * C->ClassCount * sizeof(USHORT));
+    if (!C->Mark || !C->Scratch || !C->HashSlots || !C->SetOffset || !C->SetLength || !C->Accept || !C->Transitions) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // State 0 is the empty set: its row is already all zeros, so it rejects every continuation
+    C->StateCount = 1;
+
+    C->Generation++;
+    C->ScratchCount = 0;
+    for (ULONG t = 0; t < C->TokenCount; t++) {
+        if (t == 0 || C->Tokens[t - 1].Type == GlobFinal) {
+            AddState(C, t * 2);
+        }
+    }
+    if (InternSet(C, &status) == MAXULONG) return status;
+
+    for (ULONG state = 1; state < C->StateCount; state++) {
+        for (ULONG cls = 0; cls < C->ClassCount; cls++) {
+            C->Generation++;
+            C->ScratchCount = 0;
+            // SetPool may move while interning, so index it afresh for every class
+            for (ULONG i = 0; i < C->SetLength[state]; i++) {
+                Step(C, C->SetPool[C->SetOffset[state] + i], cls);
+            }
+            ULONG next = InternSet(C, &status);
+            if (next == MAXULONG) return status;
+            C->Transitions[state * C->ClassCount + cls] = (USHORT)next;
+        }
+    }
+    return STATUS_SUCCESS;
+}
+
+static VOID
+FreeCompiler(PGLOB_COMPILER C)
+{
+    PVOID arrays[] = { C->Tokens, C->WideChars, C->Mark, C->Scratch, C->SetPool,
+                       C->SetOffset, C->SetLength, C->Accept, C->Transitions, C->HashSlots };
+    for (ULONG i = 0; i < ARRAYSIZE(arrays); i++) {
+        if (arrays[i]) ExFreePool(arrays[i]);
+    }
+}
+
+NTSTATUS
+GlobRulesCompile(PGLOB_PATTERN Patterns, ULONG PatternCount, PGLOB_RULES* Rules)
+{
+    GLOB_COMPILER compiler = { 0 };
+    *Rules = NULL;
+    if (PatternCount == 0) return STATUS_SUCCESS;
+
+    NTSTATUS status = Tokenize(&compiler, Patterns, PatternCount);
+    if (NT_SUCCESS(status)) {
+        status = BuildDfa(&compiler);
+    }
+
+    if (NT_SUCCESS(status)) {
+        // Copy the result into one nonpaged block, widest members first to keep every array aligned
+        ULONG stateCount = compiler.StateCount;
+        ULONG classCount = compiler.ClassCount;
+        SIZE_T acceptOffset = sizeof(GLOB_RULES);
+        SIZE_T transitionsOffset = acceptOffset + stateCount * sizeof(LONG);
+        SIZE_T wideClassesOffset = transitionsOffset + (SIZE_T)stateCount * classCount * sizeof(USHORT);
+        SIZE_T wideCharsOffset = wideClassesOffset + compiler.WideCount * sizeof(USHORT);
+        SIZE_T size = wideCharsOffset + compiler.WideCount * sizeof(WCHAR);
+
+        PGLOB_RULES rules = ExAllocatePool2(POOL_FLAG_NON_PAGED, size, 'gGtL');
+        if (rules) {
+            rules->StateCount = stateCount;
+            rules->ClassCount = classCount;
+            rules->WideCount = compiler.WideCount;
+            rules->Accept = (PLONG)((PUCHAR)rules + acceptOffset);
+            rules->Transitions = (PUSHORT)((PUCHAR)rules + transitionsOffset);
+            rules->WideClasses = (PUSHORT)((PUCHAR)rules + wideClassesOffset);
+            rules->WideChars = (PWCHAR)((PUCHAR)rules + wideCharsOffset);
+            RtlCopyMemory(rules->Accept, compiler.Accept, stateCount * sizeof(LONG));
+            RtlCopyMemory(rules->Transitions, compiler.Transitions, (SIZE_T)stateCount * classCount * sizeof(USHORT));
+            RtlCopyMemory(rules->WideChars, compiler.WideChars, compiler.WideCount * sizeof(WCHAR));
+            RtlCopyMemory(rules->AsciiClass, compiler.AsciiClass, sizeof(rules->AsciiClass));
+            for (ULONG w = 0; w < compiler.WideCount; w++) {
+                rules->WideClasses[w] = (USHORT)(classCount - compiler.WideCount + w);
+            }
+            *Rules = rules;
+        }
+        else {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    FreeCompiler(&compiler);
+    return status;
+}
+
+LONG
+GlobRulesMatch(PGLOB_RULES Rules, PCUNICODE_STRING Path)
+{
+    USHORT count = Path->Length / sizeof(WCHAR);
+    ULONG state = 1;
+
+    for (USHORT i = 0; i < count; i++) {
+        WCHAR ch = RtlUpcaseUnicodeChar(Path->Buffer[i]);
+        USHORT cls = ClassOf(Rules->AsciiClass, Rules->WideChars, Rules->WideClasses, Rules->WideCount, ch);
+        state = Rules->Transitions[state * Rules->ClassCount + cls];
+        if (state == 0) return 0;
+    }
+    return Rules->Accept[state];
+}
+
+SIZE_T
+GlobRulesSize(PGLOB_RULES Rules)
+{
+    // The layout GlobRulesCompile copies the DFA into
+    return sizeof(GLOB_RULES) + Rules->StateCount * sizeof(LONG)
+        + (SIZE_T)Rules->StateCount * Rules->ClassCount * sizeof(USHORT)
+        + Rules->WideCount * (sizeof(USHORT) + sizeof(WCHAR));
+}
+
+VOID GlobRulesFree(PGLOB_RULES Rules)
+{
+    if (Rules) ExFreePool(Rules);
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include <fltKernel.h>
+#include <dontuse.h>
+
+/**
+ * @def GLOB_RULE_TRACKED
+ * @brief Rule flag: deletions of matching files are logged. The other bits of a pattern are RULE_* bits.
+ */
+#define GLOB_RULE_TRACKED   0x1
+
+/**
+ * @def GLOB_RULE_PROTECTED
+ * @brief Rule flag: deletions of matching files are blocked.
+ */
+#define GLOB_RULE_PROTECTED 0x2
+
+/**
+ * @def GLOB_MAX_STATES
+ * @brief Upper bound on the number of DFA states a ruleset may compile to.
+ */
+#define GLOB_MAX_STATES 0xFFFF
+
+/**
+ * @def GLOB_MAX_TRANSITIONS
+ * @brief Upper bound on states times character classes, i.e. on the size of the transition table.
+ */
+#define GLOB_MAX_TRANSITIONS (1 << 22)
+
+/**
+ * @def GLOB_ASCII_CLASSES
+ * @brief Characters below this value are mapped to their class through a direct table.
+ */
+#define GLOB_ASCII_CLASSES 128
+
+/**
+ * @struct _GLOB_PATTERN
+ * @brief One pattern of a ruleset submitted for compilation.
+ *
+ * '?' matches one character and '*' any run of characters within a path component, '**' any run
+ * including separators, and '**\' zero or more whole directories. Matching is case-insensitive and
+ * covers the whole path; a pattern that does not start with '\' may match at any directory depth.
+ */
+typedef struct _GLOB_PATTERN {
+    UNICODE_STRING Pattern;  ///< The pattern text.
+    LONG Flags;              ///< GLOB_RULE_* and RULE_* bits reported when a path matches this pattern.
+} GLOB_PATTERN, *PGLOB_PATTERN;
+
+/**
+ * @struct _GLOB_RULES
+ * @brief A ruleset compiled into a single DFA over character classes.
+ *
+ * Every character that appears literally in some pattern has its own class, '\' has one, and all
+ * other characters share one. The structure and its arrays live in a single nonpaged allocation and
+ * are never modified after compilation.
+ */
+typedef struct _GLOB_RULES {
+    ULONG StateCount;          ///< Number of states; state 0 rejects everything, state 1 is the start state.
+    ULONG ClassCount;          ///< Number of character classes, i.e. the width of a transition row.
+    ULONG WideCount;           ///< Number of non-ASCII characters with a class of their own.
+    PLONG Accept;              ///< GLOB_RULE_* flags per state, the union over every pattern accepting there.
+    PUSHORT Transitions;       ///< StateCount rows of ClassCount next states.
+    PWCHAR WideChars;          ///< Sorted, upcased non-ASCII characters with a class of their own.
+    PUSHORT WideClasses;       ///< Class of each entry of WideChars.
+    USHORT AsciiClass[GLOB_ASCII_CLASSES]; ///< Class of each upcased ASCII character.
+} GLOB_RULES, *PGLOB_RULES;
+
+/**
+ * @brief Compiles a ruleset into one DFA.
+ *
+ * Must be called at PASSIVE_LEVEL; the intermediate state sets are built in paged pool.
+ *
+ * @param[in] Patterns Array of PatternCount patterns.
+ * @param[in] PatternCount Number of patterns; 0 yields a NULL ruleset.
+ * @param[out] Rules Receives the compiled ruleset, to be released with GlobRulesFree.
+ * @return NTSTATUS STATUS_SUCCESS on success, STATUS_INVALID_PARAMETER for an empty pattern,
+ *         STATUS_IMPLEMENTATION_LIMIT if the DFA would exceed GLOB_MAX_STATES or GLOB_MAX_TRANSITIONS,
+ *         STATUS_INSUFFICIENT_RESOURCES if allocation fails.
+ */
+NTSTATUS GlobRulesCompile(PGLOB_PATTERN Patterns, ULONG PatternCount, PGLOB_RULES* Rules);
+
+/**
+ * @brief Matches a path against a compiled ruleset.
+ *
+ * One table lookup per character, independent of the number of patterns. Takes no lock.
+ *
+ * @param[in] Rules Compiled ruleset.
+ * @param[in] Path Pointer to a UNICODE_STRING with the NT path to match.
+ * @return LONG The GLOB_RULE_* flags of every pattern matching the path, 0 if none does.
+ */
+LONG GlobRulesMatch(PGLOB_RULES Rules, PCUNICODE_STRING Path);
+
+/**
+ * @brief Gives the size of a compiled ruleset's allocation.
+ *
+ * @param[in] Rules Compiled ruleset.
+ * @return SIZE_T Bytes of the allocation.
+ */
+SIZE_T GlobRulesSize(PGLOB_RULES Rules);
+
+/**
+ * @brief Frees a compiled ruleset.
+ *
+ * @param[in] Rules Compiled ruleset; may be NULL.
+ */
+VOID GlobRulesFree(PGLOB_RULES Rules);
@@ -0,0 +1,151 @@
+#include <fltKernel.h>
+#include <dontuse.h>
+#include "internTable.h"
+
+
+#define FNV32_OFFSET 0x811c9dc5u
+#define FNV32_PRIME 0x01000193u
+
+// Strings start 8-byte aligned in the arena
+#define ALIGN_STRING(n) (((n) + 7) & ~7UL)
+
+C_ASSERT((INTERN_TABLE_SLOTS & (INTERN_TABLE_SLOTS - 1)) == 0 && INTERN_TABLE_SLOTS <= MAXUSHORT + 1);
+C_ASSERT(INTERN_TABLE_MAX_STRINGS <= MAXUSHORT);
+
+NTSTATUS
+InitializeInternTable(PINTERN_TABLE Table)
+{
+    RtlZeroMemory(Table, sizeof(INTERN_TABLE));
+    KeInitializeSpinLock(&Table->Lock);
+    Table->Epoch = 1;
+
+    // Nonpaged, since lookups run at any IRQL and interning under a spin lock
+    Table->Arena = ExAllocatePool2(POOL_FLAG_NON_PAGED, INTERN_TABLE_ARENA_ALLOCATION, 'iTtL');
+    return Table->Arena ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+}
+
+VOID
+CleanupInternTable(PINTERN_TABLE Table)
+{
+    if (Table->Arena) {
+        ExFreePoolWithTag(Table->Arena, 'iTtL');
+        Table->Arena = NULL;
+    }
+    Table->Count = 0;
+    Table->ArenaUsed = 0;
+}
+
+ULONG
+HashInternString(PCUNICODE_STRING String)
+{
+    ULONG hash = FNV32_OFFSET;
+
+    for (USHORT i = 0; i < String->Length / sizeof(WCHAR); i++) {
+        hash = (hash ^ String->Buffer[i]) * FNV32_PRIME;
+    }
+
+    // The low bits that pick the slot only depend on the low bits of each character; fold the high bits in
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    return hash;
+}
+
+USHORT
+FindInternedString(PINTERN_TABLE Table, PCUNICODE_STRING String, ULONG Hash)
+{
+    // At most half the slots are used, so every probe sequence ends at a free one
+    for (ULONG slot = Hash & (INTERN_TABLE_SLOTS - 1); Table->Slots[slot]; slot = (slot + 1) & (INTERN_TABLE_SLOTS - 1)) {
+        PINTERNED_STRING entry = Table->Strings[Table->Slots[slot] - 1];
+        if (entry->Hash == Hash && entry->Length == String->Length
+            && RtlEqualMemory(entry->Buffer, String->Buffer, String->Length)) {
+            return Table->Slots[slot];
+        }
+    }
+    return 0;
+}
+
+USHORT
+LookupInternedString(PINTERN_TABLE Table, PCUNICODE_STRING String, ULONG Hash)
+{
+    // Ids below this were published by a release store after their strings were written
+    ULONG published = (ULONG)ReadAcquire(&Table->Published);
+    ULONG slot = Hash & (INTERN_TABLE_SLOTS - 1);
+
+    // A reset can change the slots under the probe, so it is bounded rather than trusted to reach a free slot
+    for (ULONG probe = 0; probe < INTERN_TABLE_SLOTS; probe++, slot = (slot + 1) & (INTERN_TABLE_SLOTS - 1)) {
+        USHORT id = Table->Slots[slot];
+        if (!id) {
+            break;
+        }
+        if (id > published) {
+            continue;
+        }
+        PINTERNED_STRING entry = Table->Strings[id - 1];
+        if (entry && entry->Hash == Hash && entry->Length == String->Length
+            && RtlEqualMemory(entry->Buffer, String->Buffer, String->Length)) {
+            return id;
+        }
+    }
+    return 0;
+}
+
+USHORT
+InternString(PINTERN_TABLE Table, PCUNICODE_STRING String, ULONG Hash)
+{
+    ULONG size = ALIGN_STRING(FIELD_OFFSET(INTERNED_STRING, Buffer) + String->Length);
+    ULONG slot = Hash & (INTERN_TABLE_SLOTS - 1);
+
+    if (!Table->Arena || Table->Count == INTERN_TABLE_MAX_STRINGS || size > INTERN_TABLE_ARENA_SIZE - Table->ArenaUsed) {
+        return 0;
+    }
+
+    while (Table->Slots[slot]) {
+        slot = (slot + 1) & (INTERN_TABLE_SLOTS - 1);
+    }
+
+    PINTERNED_STRING entry = (PINTERNED_STRING)(Table->Arena + Table->ArenaUsed);
+    entry->Hash = Hash;
+    entry->Slot = (USHORT)slot;
+    entry->Length = String->Length;
+    RtlCopyMemory(entry->Buffer, String->Buffer, String->Length);
+
+    Table->ArenaUsed += size;
+    Table->Strings[Table->Count++] = entry;
+    Table->Slots[slot] = (USHORT)Table->Count;
+    return (USHORT)Table->Count;
+}
+
+VOID
+PublishInternedStrings(PINTERN_TABLE Table)
+{
+    WriteRelease(&Table->Published, (LONG)Table->Count);
+}
+
+VOID
+UnwindInternTable(PINTERN_TABLE Table, ULONG Count)
+{
+    // Newest first: nothing was inserted after them, so no probe sequence runs through their slots
+    while (Table->Count > Count) {
+        PINTERNED_STRING entry = Table->Strings[--Table->Count];
+        Table->Slots[entry->Slot] = 0;
+        Table->Strings[Table->Count] = NULL;
+        Table->ArenaUsed = (ULONG)((PUCHAR)entry - Table->Arena);
+    }
+}
+
+VOID
+ResetInternTable(PINTERN_TABLE Table)
+{
+    // Interlocked, so a lookup that sees any slot cleared or reused below also sees the new epoch
+    InterlockedIncrement(&Table->Epoch);
+    WriteNoFence(&Table->Published, 0);
+
+    // Only the used slots are cleared, so frequent resets stay cheap
+    for (ULONG i = 0; i < Table->Count; i++) {
+        Table->Slots[Table->Strings[i]->Slot] = 0;
+        Table->Strings[i] = NULL;
+    }
+    Table->Count = 0;
+    Table->ArenaUsed = 0;
+}
@@ -0,0 +1,146 @@
+#pragma once
+#include <fltKernel.h>
+#include <dontuse.h>
+
+/**
+ * @def INTERN_TABLE_MAX_STRINGS
+ * @brief Strings one epoch of the table can hold; their ids run from 1 to this.
+ */
+#define INTERN_TABLE_MAX_STRINGS 1024
+
+/**
+ * @def INTERN_TABLE_SLOTS
+ * @brief Hash slots, a power of two at least twice INTERN_TABLE_MAX_STRINGS so probes stay short.
+ */
+#define INTERN_TABLE_SLOTS (2 * INTERN_TABLE_MAX_STRINGS)
+
+/**
+ * @def INTERN_TABLE_ARENA_SIZE
+ * @brief Bytes of string storage for one epoch.
+ */
+#define INTERN_TABLE_ARENA_SIZE (256 * 1024)
+
+/**
+ * @def INTERN_MAX_STRING_LENGTH
+ * @brief Longest string, in bytes, that is interned. Longer and empty strings are never given an id.
+ */
+#define INTERN_MAX_STRING_LENGTH 1024
+
+/**
+ * @def INTERN_TABLE_ARENA_ALLOCATION
+ * @brief Bytes allocated for the arena. A lookup racing a reset may compare a string against whatever the arena
+ *        holds by then; the extra INTERN_MAX_STRING_LENGTH bytes keep that read inside the allocation.
+ */
+#define INTERN_TABLE_ARENA_ALLOCATION (INTERN_TABLE_ARENA_SIZE + INTERN_MAX_STRING_LENGTH)
+
+/**
+ * @struct _INTERNED_STRING
+ * @brief A string with an id, stored in the table's arena.
+ */
+typedef struct _INTERNED_STRING {
+    ULONG Hash;                  ///< As returned by HashInternString.
+    USHORT Slot;                 ///< Hash slot holding the string's id.
+    USHORT Length;               ///< Bytes in Buffer.
+    WCHAR Buffer[ANYSIZE_ARRAY];
+} INTERNED_STRING, *PINTERNED_STRING;
+
+/**
+ * @struct _INTERN_TABLE
+ * @brief Assigns small ids to strings, so a stream can send each string once and refer to it afterwards.
+ *
+ * Ids are handed out in order, starting from 1 in every epoch. A reset forgets every string and starts a new
+ * epoch, so a receiver that keeps the (epoch, id) pairs it was sent can tell stale ids from current ones.
+ * Interning, publishing, unwinding and resets hold Lock. LookupInternedString takes no lock and only finds ids
+ * up to Published; its caller reads Epoch before and after, and a change means the id may belong to another
+ * string.
+ */
+typedef struct _INTERN_TABLE {
+    KSPIN_LOCK Lock;                                    ///< Serializes every change to the table.
+    volatile LONG Epoch;                                ///< Incremented by every reset, before anything is cleared.
+    volatile LONG Published;                            ///< Ids up to this one may be found without Lock.
+    ULONG Count;                                        ///< Strings interned in this epoch; the latest one has id Count.
+    ULONG ArenaUsed;                                    ///< Bytes of Arena in use.
+    PUCHAR Arena;                                       ///< Storage for the strings, INTERN_TABLE_ARENA_SIZE bytes.
+    PINTERNED_STRING volatile Strings[INTERN_TABLE_MAX_STRINGS]; ///< Interned strings, by id - 1.
+    volatile USHORT Slots[INTERN_TABLE_SLOTS];          ///< Id of the string in each hash slot, 0 if the slot is free.
+} INTERN_TABLE, *PINTERN_TABLE;
+
+/**
+ * @brief Allocates the arena and starts the first epoch.
+ *
+ * @param[out] Table The table to initialize.
+ * @return NTSTATUS STATUS_SUCCESS, or STATUS_INSUFFICIENT_RESOURCES.
+ */
+NTSTATUS InitializeInternTable(PINTERN_TABLE Table);
+
+/**
+ * @brief Frees the arena. The table must not be used afterwards.
+ *
+ * @param[in,out] Table The table to clean up; may have failed to initialize.
+ */
+VOID CleanupInternTable(PINTERN_TABLE Table);
+
+/**
+ * @brief Hashes a string for FindInternedString and InternString. Takes no lock.
+ *
+ * @param[in] String The string to hash.
+ * @return ULONG The hash.
+ */
+ULONG HashInternString(PCUNICODE_STRING String);
+
+/**
+ * @brief Looks up the id of a string, published or not. Must be called with Lock held.
+ *
+ * @param[in] Table The table to search.
+ * @param[in] String The string to look up.
+ * @param[in] Hash Its hash from HashInternString.
+ * @return USHORT The id of the string in the current epoch, or 0 if it is not interned.
+ */
+USHORT FindInternedString(PINTERN_TABLE Table, PCUNICODE_STRING String, ULONG Hash);
+
+/**
+ * @brief Looks up the id of a string among the published ones, without taking Lock. Callable at any IRQL.
+ *
+ * A reset running meanwhile can make the result wrong or make the string appear missing; the result is only
+ * valid if Epoch read before the call is still current afterwards.
+ *
+ * @param[in] Table The table to search.
+ * @param[in] String The string to look up, at most INTERN_MAX_STRING_LENGTH bytes long.
+ * @param[in] Hash Its hash from HashInternString.
+ * @return USHORT The id of the string, or 0 if it is not interned or not published yet.
+ */
+USHORT LookupInternedString(PINTERN_TABLE Table, PCUNICODE_STRING String, ULONG Hash);
+
+/**
+ * @brief Gives a string that is not interned yet the next id. Must be called with Lock held.
+ *
+ * @param[in,out] Table The table to add to.
+ * @param[in] String The string to intern, between 1 and INTERN_MAX_STRING_LENGTH bytes long.
+ * @param[in] Hash Its hash from HashInternString.
+ * @return USHORT The new id, or 0 if this epoch has no room left.
+ */
+USHORT InternString(PINTERN_TABLE Table, PCUNICODE_STRING String, ULONG Hash);
+
+/**
+ * @brief Lets LookupInternedString find every string interned so far. Must be called with Lock held, once the
+ *        ids can be referred to: a message defining them is ahead of any message reserved afterwards.
+ *
+ * @param[in,out] Table The table to publish.
+ */
+VOID PublishInternedStrings(PINTERN_TABLE Table);
+
+/**
+ * @brief Forgets the strings interned after the first Count, in the same epoch. Must be called with Lock held,
+ *        and only to take back ids that were never published.
+ *
+ * @param[in,out] Table The table to unwind.
+ * @param[in] Count The number of strings to keep.
+ */
+VOID UnwindInternTable(PINTERN_TABLE Table, ULONG Count);
+
+/**
+ * @brief Forgets every string and starts a new epoch. Must be called with Lock held.
+ *
+ * @param[in,out] Table The table to reset.
+ */
+VOID ResetInternTable(PINTERN_TABLE Table);
@@ -0,0 +1,15 @@
+#pragma once
+#include <fltKernel.h>
+#include <dontuse.h>
+
+/**
+ * @struct _MEMORY_USAGE
+ * @brief Memory held by one part of the driver, as reported by IOCTL_GET_MEMORY_STATS.
+ */
+typedef struct _MEMORY_USAGE {
+    ULONG Tag;               ///< Pool tag of the allocations.
+    ULONG Reserved;
+    ULONG64 Count;           ///< Objects held: entries, nodes, strings, buckets, or 1 for a single block.
+    ULONG64 Bytes;           ///< Bytes allocated for them.
+    ULONG64 UsedBytes;       ///< Of Bytes, those holding data; the rest is rounding to a block size or free space.
+} MEMORY_USAGE, *PMEMORY_USAGE;
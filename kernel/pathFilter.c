@@ -0,0 +1,186 @@
+#include <fltKernel.h>
+#include <dontuse.h>
+#include "pathFilter.h"
+
+
+#define FNV64_OFFSET_BASIS 14695981039346656037ull
+#define FNV64_PRIME        1099511628211ull
+
+// Folds one character the way RtlUpcaseUnicodeChar does, without the call for the ASCII range
+static __forceinline WCHAR
+FoldChar(WCHAR Ch)
+{
+    if (Ch < L'a') return Ch;
+    if (Ch <= L'z') return Ch - (L'a' - L'A');
+    if (Ch < 0x80) return Ch;
+    return RtlUpcaseUnicodeChar(Ch);
+}
+
+static __forceinline ULONG64
+HashStep(ULONG64 Hash, WCHAR Ch)
+{
+    return (Hash ^ Ch) * FNV64_PRIME;
+}
+
+// FNV only mixes upwards, so finish with the murmur3 finalizer before carving out block and bit indices
+static __forceinline ULONG64
+FinishHash(ULONG64 Hash)
+{
+    Hash ^= Hash >> 33;
+    Hash *= 0xff51afd7ed558ccdull;
+    Hash ^= Hash >> 33;
+    Hash *= 0xc4ceb9fe1a85ec53ull;
+    Hash ^= Hash >> 33;
+    return Hash;
+}
+
+static __forceinline PPATH_FILTER_BLOCK
+BlockOf(PPATH_FILTER Filter, ULONG64 Mixed)
+{
+    return &Filter->Blocks[(ULONG)(((Mixed & MAXULONG) * Filter->BlockCount) >> 32)];
+}
+
+// The bit indices come from the top bits of a second multiply, 9 bits (one of 512) per probe
+static __forceinline ULONG
+BitOf(ULONG64 Bits, ULONG Probe)
+{
+    return (ULONG)(Bits >> (64 - 9 * (Probe + 1))) & 511;
+}
+
+static BOOLEAN
+Probe(PPATH_FILTER Filter, ULONG64 Hash)
+{
+    ULONG64 mixed = FinishHash(Hash);
+    PPATH_FILTER_BLOCK block = BlockOf(Filter, mixed);
+    ULONG64 bits = mixed * 0x9e3779b97f4a7c15ull;
+
+    for (ULONG i = 0; i < PATH_FILTER_PROBES; i++) {
+        ULONG bit = BitOf(bits, i);
+        if (!(ReadNoFence64(&block->Words[bit >> 6]) & (LONG64)(1ull << (bit & 63)))) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static VOID
+Insert(PPATH_FILTER Filter, ULONG64 Hash)
+{
+    ULONG64 mixed = FinishHash(Hash);
+    PPATH_FILTER_BLOCK block = BlockOf(Filter, mixed);
+    ULONG64 bits = mixed * 0x9e3779b97f4a7c15ull;
+
+    for (ULONG i = 0; i < PATH_FILTER_PROBES; i++) {
+        ULONG bit = BitOf(bits, i);
+        InterlockedOr64(&block->Words[bit >> 6], (LONG64)(1ull << (bit & 63)));
+    }
+    InterlockedIncrement(&Filter->KeyCount);
+}
+
+// Hashes a key with its leading and trailing separators trimmed; returns the number of components
+static ULONG64
+HashKey(PCUNICODE_STRING Key, PULONG Components)
+{
+    PCWCH buffer = Key->Buffer;
+    USHORT count = Key->Length / sizeof(WCHAR);
+    ULONG64 hash = FNV64_OFFSET_BASIS;
+
+    while (count > 0 && buffer[0] == L'\\') {
+        buffer++;
+        count--;
+    }
+    while (count > 0 && buffer[count - 1] == L'\\') {
+        count--;
+    }
+
+    *Components = count > 0 ? 1 : 0;
+    for (USHORT i = 0; i < count; i++) {
+        if (buffer[i] == L'\\') (*Components)++;
+        hash = HashStep(hash, FoldChar(buffer[i]));
+    }
+    return hash;
+}
+
+static ULONG
+DepthBit(ULONG Components)
+{
+    return min(Components - 1, 63);
+}
+
+PPATH_FILTER
+PathFilterCreate(ULONG Capacity)
+{
+    ULONG blocks = (ULONG)(((ULONG64)max(Capacity, 1) * PATH_FILTER_BITS_PER_KEY + 511) / 512);
+    PPATH_FILTER filter = ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+        FIELD_OFFSET(PATH_FILTER, Blocks) + (SIZE_T)blocks * sizeof(PATH_FILTER_BLOCK), 'fPtL');
+    if (!filter) return NULL;
+
+    // The allocation is zeroed, so every block starts out empty
+    filter->BlockCount = blocks;
+    filter->Capacity = Capacity;
+    return filter;
+}
+
+VOID
+PathFilterFree(PPATH_FILTER Filter)
+{
+    if (Filter) ExFreePool(Filter);
+}
+
+SIZE_T
+PathFilterSize(PPATH_FILTER Filter)
+{
+    return FIELD_OFFSET(PATH_FILTER, Blocks) + (SIZE_T)Filter->BlockCount * sizeof(PATH_FILTER_BLOCK);
+}
+
+VOID
+PathFilterAddName(PPATH_FILTER Filter, PCUNICODE_STRING FileName)
+{
+    ULONG components;
+    Insert(Filter, HashKey(FileName, &components));
+}
+
+VOID
+PathFilterAddDirectory(PPATH_FILTER Filter, PCUNICODE_STRING DirectoryPath)
+{
+    ULONG components;
+    ULONG64 hash = HashKey(DirectoryPath, &components);
+    if (components == 0) return;
+
+    // Set the bits before the depth, so a reader probing at the new depth finds them
+    Insert(Filter, hash);
+    InterlockedOr64(&Filter->DepthMask, (LONG64)(1ull << DepthBit(components)));
+}
+
+BOOLEAN
+PathFilterMayContain(PPATH_FILTER Filter, PCUNICODE_STRING Path)
+{
+    PCWCH buffer = Path->Buffer;
+    USHORT count = Path->Length / sizeof(WCHAR);
+    ULONG64 hash = FNV64_OFFSET_BASIS;
+    ULONG64 depthMask = (ULONG64)ReadAcquire64(&Filter->DepthMask);
+    ULONG components = 1;
+
+    while (count > 0 && buffer[0] == L'\\') {
+        buffer++;
+        count--;
+    }
+    while (count > 0 && buffer[count - 1] == L'\\') {
+        count--;
+    }
+
+    for (USHORT i = 0; i < count; i++) {
+        WCHAR ch = buffer[i];
+        if (ch == L'\\') {
+            // The components so far name a directory; probe it only if some rule is that deep
+            if ((depthMask >> DepthBit(components)) & 1) {
+                if (Probe(Filter, hash)) return TRUE;
+            }
+            components++;
+        }
+        hash = HashStep(hash, FoldChar(ch));
+    }
+
+    // The whole path, as a file tracked by name or as a tracked directory itself
+    return count > 0 && Probe(Filter, hash);
+}
@@ -0,0 +1,104 @@
+#pragma once
+#include <fltKernel.h>
+#include <dontuse.h>
+
+/**
+ * @def PATH_FILTER_BITS_PER_KEY
+ * @brief Filter bits reserved per expected key; with PATH_FILTER_PROBES this gives a false-positive rate of about 0.1%.
+ */
+#define PATH_FILTER_BITS_PER_KEY 16
+
+/**
+ * @def PATH_FILTER_PROBES
+ * @brief Bits set per key, all within one cache-line block.
+ */
+#define PATH_FILTER_PROBES 6
+
+/**
+ * @struct _PATH_FILTER_BLOCK
+ * @brief One cache line of filter bits; every key lives entirely inside a single block.
+ */
+typedef struct DECLSPEC_CACHEALIGN _PATH_FILTER_BLOCK {
+    volatile LONG64 Words[8];
+} PATH_FILTER_BLOCK, *PPATH_FILTER_BLOCK;
+
+/**
+ * @struct _PATH_FILTER
+ * @brief Blocked Bloom filter over the case-folded names and directory rules of the tracked files.
+ *
+ * Answers "is this path possibly tracked by name or by one of its directories" without a lock or a
+ * string compare. Keys are hashed with their leading and trailing separators trimmed, so a directory
+ * rule is found by hashing the path one component at a time. Bits are only ever set in place; keys
+ * cannot be removed, the owner rebuilds the filter instead.
+ */
+typedef struct _PATH_FILTER {
+    ULONG BlockCount;           ///< Number of blocks.
+    ULONG Capacity;             ///< Keys the filter was sized for.
+    volatile LONG KeyCount;     ///< Keys added so far.
+    volatile LONG64 DepthMask;  ///< Bit n set if a directory rule has n + 1 components; bit 63 covers deeper rules.
+    PATH_FILTER_BLOCK Blocks[1];  ///< BlockCount blocks.
+} PATH_FILTER, *PPATH_FILTER;
+
+/**
+ * @struct _PATH_FILTER_STATS
+ * @brief Prefilter counters, as returned by IOCTL_GET_FILTER_STATS.
+ *
+ * Of the lookups for untracked files, FalsePositives / (Rejected + FalsePositives) got past the filter.
+ */
+typedef struct _PATH_FILTER_STATS {
+    ULONG64 Rejected;        ///< Lookups answered by the filter alone.
+    ULONG64 Admitted;        ///< Lookups the filter passed on to the table and the directory trie.
+    ULONG64 FalsePositives;  ///< Admitted lookups that matched neither a name nor a directory rule.
+    ULONG64 MemoryBytes;     ///< Size of the filter allocation.
+    ULONG KeyCount;          ///< Keys in the filter, including removed ones not yet rebuilt away.
+    ULONG Capacity;          ///< Keys the filter was sized for.
+} PATH_FILTER_STATS, *PPATH_FILTER_STATS;
+
+/**
+ * @brief Allocates an empty filter.
+ *
+ * @param[in] Capacity Number of keys to size the filter for; more can be added at a higher false-positive rate.
+ * @return PPATH_FILTER The filter, or NULL if the allocation fails.
+ */
+PPATH_FILTER PathFilterCreate(ULONG Capacity);
+
+/**
+ * @brief Frees a filter. Accepts NULL.
+ */
+VOID PathFilterFree(PPATH_FILTER Filter);
+
+/**
+ * @brief Returns the size of a filter's allocation in bytes.
+ */
+SIZE_T PathFilterSize(PPATH_FILTER Filter);
+
+/**
+ * @brief Adds the name of a file tracked by name.
+ *
+ * Safe while readers use the filter; writers must be serialized by the caller. The bits are set
+ * before the call returns, so the entry may be published right after.
+ *
+ * @param[in] Filter Filter to add to.
+ * @param[in] FileName Pointer to a UNICODE_STRING with the file's NT path.
+ */
+VOID PathFilterAddName(PPATH_FILTER Filter, PCUNICODE_STRING FileName);
+
+/**
+ * @brief Adds a directory rule. Same rules as PathFilterAddName.
+ *
+ * @param[in] Filter Filter to add to.
+ * @param[in] DirectoryPath Pointer to a UNICODE_STRING with the directory's NT path.
+ */
+VOID PathFilterAddDirectory(PPATH_FILTER Filter, PCUNICODE_STRING DirectoryPath);
+
+/**
+ * @brief Checks whether a path may be tracked by name or by one of its directories.
+ *
+ * Folds and hashes the path in a single pass, probing the filter at the end of the path and at each
+ * directory depth that has a rule. Takes no lock and may be called at IRQL <= DISPATCH_LEVEL.
+ *
+ * @param[in] Filter Filter to query.
+ * @param[in] Path Pointer to a UNICODE_STRING with the NT path.
+ * @return BOOLEAN FALSE if the path is definitely neither tracked by name nor inside a tracked directory.
+ */
+BOOLEAN PathFilterMayContain(PPATH_FILTER Filter, PCUNICODE_STRING Path);
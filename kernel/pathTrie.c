@@ -0,0 +1,581 @@
+#include <fltKernel.h>
+#include <dontuse.h>
+#include "pathTrie.h"
+
+// Children a node holds before it indexes them; below this, walking the sibling list is as fast
+#define PATH_TRIE_INDEX_MIN_CHILDREN 8
+
+/**
+ * @struct _PATH_TRIE_INDEX
+ * @brief Open-addressed table of a node's children, keyed on the hash of their first component.
+ *
+ * Slots are published with release semantics: a new child fills a free slot, a replacement node
+ * takes over its predecessor's slot, a removed child leaves a tombstone. Readers stop at an empty
+ * slot, of which at least a quarter are kept. A full or shrinking index is rebuilt from the sibling
+ * list and the old one retired like a node, through its husk.
+ */
+typedef struct _PATH_TRIE_INDEX {
+    PATH_TRIE_NODE Husk;         // Carries the index on a retire list; never linked into the trie
+    ULONG Mask;                  // Number of slots minus one, a power of two minus one
+    ULONG Used;                  // Slots holding a child or a tombstone; writer only
+    PPATH_TRIE_NODE Slots[1];
+} PATH_TRIE_INDEX, *PPATH_TRIE_INDEX;
+
+// Left in the slot of a removed child, so probes for the children placed after it go on
+static PATH_TRIE_NODE Tombstone;
+
+// FNV-1a over the first component, upcased first when Fold is set, as a label's first component is stored
+static ULONG
+ComponentHash(PCWCH Text, USHORT Count, BOOLEAN Fold)
+{
+    ULONG hash = 2166136261u;
+    for (USHORT i = 0; i < Count && Text[i] != L'\\'; i++) {
+        WCHAR ch = Fold ? RtlUpcaseUnicodeChar(Text[i]) : Text[i];
+        hash = (hash ^ ch) * 16777619u;
+    }
+    return hash;
+}
+
+static PPATH_TRIE_NODE
+AllocateNode(USHORT LabelLength)
+{
+    return ExAllocatePool2(POOL_FLAG_NON_PAGED,
+        FIELD_OFFSET(PATH_TRIE_NODE, Label) + LabelLength * sizeof(WCHAR), 'tPtL');
+}
+
+static PPATH_TRIE_NODE
+NewNode(PCWCH Label, USHORT LabelLength, LONG Flags)
+{
+    PPATH_TRIE_NODE node = AllocateNode(LabelLength);
+    if (node) {
+        RtlCopyMemory(node->Label, Label, LabelLength * sizeof(WCHAR));
+        node->LabelLength = LabelLength;
+        node->Flags = Flags;
+        node->Hash = ComponentHash(Label, LabelLength, FALSE);
+    }
+    return node;
+}
+
+static VOID
+Retire(PPATH_TRIE_NODE Node, PPATH_TRIE_NODE* Retired)
+{
+    Node->Retired = *Retired;
+    *Retired = Node;
+}
+
+// Retires a node replaced or unlinked from the trie, and its index with it
+static VOID
+RetireNode(PPATH_TRIE_NODE Node, PPATH_TRIE_NODE* Retired)
+{
+    Retire(Node, Retired);
+    if (Node->Index) {
+        Retire(&Node->Index->Husk, Retired);
+    }
+}
+
+// Writer-side: fills the first free slot on Child's probe sequence
+static VOID
+PlaceChild(PPATH_TRIE_INDEX Index, PPATH_TRIE_NODE Child)
+{
+    ULONG i = Child->Hash & Index->Mask;
+    while (Index->Slots[i] && Index->Slots[i] != &Tombstone) {
+        i = (i + 1) & Index->Mask;
+    }
+    if (!Index->Slots[i]) {
+        Index->Used++;
+    }
+    WritePointerRelease((PVOID*)&Index->Slots[i], Child);
+}
+
+// Writer-side: the slot holding Child, which must be in the index
+static PPATH_TRIE_NODE*
+ChildSlot(PPATH_TRIE_INDEX Index, PPATH_TRIE_NODE Child)
+{
+    ULONG i = Child->Hash & Index->Mask;
+    while (Index->Slots[i] != Child) {
+        i = (i + 1) & Index->Mask;
+    }
+    return &Index->Slots[i];
+}
+
+// Indexes Node's children at most half full, or returns NULL if there are few or the allocation fails;
+// without an index readers walk the sibling list, so a failure only costs time
+static PPATH_TRIE_INDEX
+BuildIndex(PPATH_TRIE_NODE Node)
+{
+    if (Node->ChildCount <= PATH_TRIE_INDEX_MIN_CHILDREN) return NULL;
+
+    ULONG slots = 4 * PATH_TRIE_INDEX_MIN_CHILDREN;
+    while (slots < 2 * Node->ChildCount) {
+        slots *= 2;
+    }
+    PPATH_TRIE_INDEX index = ExAllocatePool2(POOL_FLAG_NON_PAGED,
+        FIELD_OFFSET(PATH_TRIE_INDEX, Slots) + slots * sizeof(PPATH_TRIE_NODE), 'tPtL');
+    if (index) {
+        index->Mask = slots - 1;
+        for (PPATH_TRIE_NODE child = Node->Children; child; child = child->Sibling) {
+            PlaceChild(index, child);
+        }
+    }
+    return index;
+}
+
+// Replaces Node's index with one rebuilt from its sibling list
+static VOID
+RebuildIndex(PPATH_TRIE_NODE Node, PPATH_TRIE_NODE* Retired)
+{
+    PPATH_TRIE_INDEX index = Node->Index;
+    WritePointerRelease((PVOID*)&Node->Index, BuildIndex(Node));
+    if (index) {
+        Retire(&index->Husk, Retired);
+    }
+}
+
+// Gives a node that is not published yet the children of another, and an index of them if there are many
+static VOID
+AdoptChildren(PPATH_TRIE_NODE Node, PPATH_TRIE_NODE Children, ULONG ChildCount)
+{
+    Node->Children = Children;
+    Node->ChildCount = ChildCount;
+    if (Children) {
+        Children->Link = &Node->Children;
+    }
+    Node->Index = BuildIndex(Node);
+}
+
+// Publishes Node in place of Old in the sibling list and in Parent's index; Node has Old's first component
+static VOID
+ReplaceChild(PPATH_TRIE_NODE Parent, PPATH_TRIE_NODE Old, PPATH_TRIE_NODE Node)
+{
+    Node->Sibling = Old->Sibling;
+    Node->Link = Old->Link;
+    if (Node->Sibling) {
+        Node->Sibling->Link = &Node->Sibling;
+    }
+    WritePointerRelease((PVOID*)Node->Link, Node);
+    if (Parent->Index) {
+        WritePointerRelease((PVOID*)ChildSlot(Parent->Index, Old), Node);
+    }
+}
+
+// Publishes a new leaf at the head of Parent's children
+static VOID
+AddChild(PPATH_TRIE_NODE Parent, PPATH_TRIE_NODE Leaf, PPATH_TRIE_NODE* Retired)
+{
+    Leaf->Sibling = Parent->Children;
+    Leaf->Link = &Parent->Children;
+    if (Leaf->Sibling) {
+        Leaf->Sibling->Link = &Leaf->Sibling;
+    }
+    WritePointerRelease((PVOID*)&Parent->Children, Leaf);
+
+    Parent->ChildCount++;
+    PPATH_TRIE_INDEX index = Parent->Index;
+    if (index && (index->Used + 1) * 4 <= (index->Mask + 1) * 3) {
+        PlaceChild(index, Leaf);
+    }
+    else if (index || Parent->ChildCount > PATH_TRIE_INDEX_MIN_CHILDREN) {
+        RebuildIndex(Parent, Retired);
+    }
+}
+
+// Unlinks a child from Parent's sibling list and index
+static VOID
+RemoveChild(PPATH_TRIE_NODE Parent, PPATH_TRIE_NODE Child, PPATH_TRIE_NODE* Retired)
+{
+    WritePointerRelease((PVOID*)Child->Link, Child->Sibling);
+    if (Child->Sibling) {
+        Child->Sibling->Link = Child->Link;
+    }
+
+    Parent->ChildCount--;
+    if (Parent->Index) {
+        WritePointerRelease((PVOID*)ChildSlot(Parent->Index, Child), &Tombstone);
+        if (Parent->ChildCount <= PATH_TRIE_INDEX_MIN_CHILDREN) {
+            RebuildIndex(Parent, Retired);
+        }
+    }
+}
+
+// Skips leading and trailing separators so "\Device\X\" and "Device\X" name the same directory
+static VOID
+TrimSeparators(PCWCH* Buffer, USHORT* Count)
+{
+    while (*Count > 0 && (*Buffer)[0] == L'\\') {
+        (*Buffer)++;
+        (*Count)--;
+    }
+    while (*Count > 0 && (*Buffer)[*Count - 1] == L'\\') {
+        (*Count)--;
+    }
+}
+
+// Returns how many label characters Key shares with the node, cut back to a whole number of components:
+// LabelLength if the whole label matches, 0 if even the first component differs.
+static USHORT
+SharedComponents(PPATH_TRIE_NODE Node, PCWCH Key, USHORT KeyCount)
+{
+    USHORT max = min(Node->LabelLength, KeyCount);
+    USHORT matched = 0;
+    while (matched < max && Node->Label[matched] == Key[matched]) {
+        matched++;
+    }
+
+    if (matched == Node->LabelLength && (matched == KeyCount || Key[matched] == L'\\')) {
+        return matched;
+    }
+    if (matched == KeyCount && Node->Label[matched] == L'\\') {
+        return matched;
+    }
+    while (matched > 0) {
+        matched--;
+        if (Node->Label[matched] == L'\\') {
+            return matched;
+        }
+    }
+    return 0;
+}
+
+// Writer-side: the child of Node sharing the first component of Key, which is upcased, or NULL
+static PPATH_TRIE_NODE
+FindChildLocked(PPATH_TRIE_NODE Node, PCWCH Key, USHORT KeyCount)
+{
+    PPATH_TRIE_INDEX index = Node->Index;
+    if (index) {
+        ULONG hash = ComponentHash(Key, KeyCount, FALSE);
+        for (ULONG i = hash & index->Mask; index->Slots[i]; i = (i + 1) & index->Mask) {
+            PPATH_TRIE_NODE child = index->Slots[i];
+            if (child != &Tombstone && child->Hash == hash && SharedComponents(child, Key, KeyCount)) {
+                return child;
+            }
+        }
+        return NULL;
+    }
+
+    PPATH_TRIE_NODE child = Node->Children;
+    while (child && !SharedComponents(child, Key, KeyCount)) {
+        child = child->Sibling;
+    }
+    return child;
+}
+
+// Reader-side match of the whole label against the unfolded path
+static BOOLEAN
+LabelMatches(PPATH_TRIE_NODE Node, PCWCH Path, USHORT Count)
+{
+    if (Node->LabelLength > Count) return FALSE;
+    if (Node->LabelLength < Count && Path[Node->LabelLength] != L'\\') return FALSE;
+
+    for (USHORT i = 0; i < Node->LabelLength; i++) {
+        if (Node->Label[i] != RtlUpcaseUnicodeChar(Path[i])) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Reader-side: the child of Node whose whole label starts the unfolded path, or NULL
+static PPATH_TRIE_NODE
+FindChild(PPATH_TRIE_NODE Node, PCWCH Path, USHORT Count)
+{
+    PPATH_TRIE_INDEX index = ReadPointerAcquire((PVOID*)&Node->Index);
+    if (index) {
+        ULONG hash = ComponentHash(Path, Count, TRUE);
+        for (ULONG i = hash & index->Mask;; i = (i + 1) & index->Mask) {
+            PPATH_TRIE_NODE child = ReadPointerAcquire((PVOID*)&index->Slots[i]);
+            if (!child) return NULL;
+            if (child != &Tombstone && child->Hash == hash && LabelMatches(child, Path, Count)) {
+                return child;
+            }
+        }
+    }
+
+    PPATH_TRIE_NODE child = ReadPointerAcquire((PVOID*)&Node->Children);
+    while (child && !LabelMatches(child, Path, Count)) {
+        child = ReadPointerAcquire((PVOID*)&child->Sibling);
+    }
+    return child;
+}
+
+// Drops a node that no longer carries a rule: a leaf is unlinked, a node with a single child is merged into it.
+static VOID
+Collapse(PPATH_TRIE_NODE Parent, PPATH_TRIE_NODE Node, PPATH_TRIE_NODE* Retired)
+{
+    if (Node->Flags) return;
+
+    PPATH_TRIE_NODE child = Node->Children;
+    if (!child) {
+        RemoveChild(Parent, Node, Retired);
+        RetireNode(Node, Retired);
+        return;
+    }
+    if (child->Sibling) return;
+
+    // Merging is only an optimization; if the allocation fails the branching node simply stays
+    PPATH_TRIE_NODE merged = AllocateNode(Node->LabelLength + 1 + child->LabelLength);
+    if (!merged) return;
+
+    RtlCopyMemory(merged->Label, Node->Label, Node->LabelLength * sizeof(WCHAR));
+    merged->Label[Node->LabelLength] = L'\\';
+    RtlCopyMemory(merged->Label + Node->LabelLength + 1, child->Label, child->LabelLength * sizeof(WCHAR));
+    merged->LabelLength = Node->LabelLength + 1 + child->LabelLength;
+    merged->Flags = child->Flags;
+    merged->Hash = Node->Hash;
+    AdoptChildren(merged, child->Children, child->ChildCount);
+
+    ReplaceChild(Parent, Node, merged);
+    RetireNode(Node, Retired);
+    RetireNode(child, Retired);
+}
+
+PPATH_TRIE_NODE PathTrieCreate(VOID)
+{
+    return AllocateNode(0);
+}
+
+NTSTATUS
+PathTrieInsert(PPATH_TRIE_NODE Root, PCUNICODE_STRING Path, LONG Flags, PPATH_TRIE_NODE* Retired)
+{
+    UNICODE_STRING folded;
+    NTSTATUS status = RtlUpcaseUnicodeString(&folded, Path, TRUE);
+    if (!NT_SUCCESS(status)) return status;
+
+    PCWCH key = folded.Buffer;
+    USHORT count = folded.Length / sizeof(WCHAR);
+    TrimSeparators(&key, &count);
+    if (count == 0) {
+        RtlFreeUnicodeString(&folded);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    PPATH_TRIE_NODE node = Root;
+    USHORT pos = 0;
+    for (;;) {
+        if (pos >= count) {
+            if (node->Flags) {
+                status = STATUS_ALREADY_REGISTERED;
+            }
+            else {
+                InterlockedExchange(&node->Flags, Flags);
+            }
+            break;
+        }
+
+        PPATH_TRIE_NODE child = FindChildLocked(node, key + pos, count - pos);
+        if (!child) {
+            // The leaf is fully built before the release store makes it reachable
+            PPATH_TRIE_NODE leaf = NewNode(key + pos, count - pos, Flags);
+            if (!leaf) {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                break;
+            }
+            AddChild(node, leaf, Retired);
+            break;
+        }
+
+        USHORT shared = SharedComponents(child, key + pos, count - pos);
+        if (shared < child->LabelLength) {
+            // Split the edge: a branching node for the shared components, in front of a copy of the rest
+            PPATH_TRIE_NODE tail = NewNode(child->Label + shared + 1, child->LabelLength - shared - 1,
+                child->Flags);
+            PPATH_TRIE_NODE head = tail ? NewNode(child->Label, shared, 0) : NULL;
+            if (!head) {
+                if (tail) ExFreePool(tail);
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                break;
+            }
+            AdoptChildren(tail, child->Children, child->ChildCount);
+            AdoptChildren(head, tail, 1);
+            ReplaceChild(node, child, head);
+            RetireNode(child, Retired);
+            child = head;
+        }
+
+        node = child;
+        pos += shared + 1;
+    }
+
+    RtlFreeUnicodeString(&folded);
+    return status;
+}
+
+NTSTATUS
+PathTrieRemove(PPATH_TRIE_NODE Root, PCUNICODE_STRING Path, PPATH_TRIE_NODE* Retired, PLONG Flags)
+{
+    UNICODE_STRING folded;
+    NTSTATUS status = RtlUpcaseUnicodeString(&folded, Path, TRUE);
+    if (!NT_SUCCESS(status)) return status;
+
+    PCWCH key = folded.Buffer;
+    USHORT count = folded.Length / sizeof(WCHAR);
+    TrimSeparators(&key, &count);
+
+    PPATH_TRIE_NODE grandparent = NULL;
+    PPATH_TRIE_NODE parent = NULL;
+    PPATH_TRIE_NODE node = Root;
+    USHORT pos = 0;
+    while (node && pos < count) {
+        PPATH_TRIE_NODE child = FindChildLocked(node, key + pos, count - pos);
+        if (child && SharedComponents(child, key + pos, count - pos) != child->LabelLength) {
+            child = NULL;
+        }
+
+        grandparent = parent;
+        parent = node;
+        node = child;
+        if (child) pos += child->LabelLength + 1;
+    }
+    RtlFreeUnicodeString(&folded);
+
+    if (!node || node == Root || !node->Flags) {
+        return STATUS_NOT_FOUND;
+    }
+
+    LONG flags = InterlockedExchange(&node->Flags, 0);
+    if (Flags) *Flags = flags;
+    Collapse(parent, node, Retired);
+    if (parent != Root) {
+        Collapse(grandparent, parent, Retired);
+    }
+    return STATUS_SUCCESS;
+}
+
+LONG
+PathTrieLookup(PPATH_TRIE_NODE Root, PCUNICODE_STRING Path)
+{
+    PCWCH path = Path->Buffer;
+    USHORT count = Path->Length / sizeof(WCHAR);
+    USHORT pos = 0;
+    LONG flags = 0;
+    PPATH_TRIE_NODE node = Root;
+
+    while (pos < count && path[pos] == L'\\') pos++;
+
+    while (pos < count) {
+        PPATH_TRIE_NODE child = FindChild(node, path + pos, count - pos);
+        if (!child) break;
+
+        // The deepest rule on the way down wins
+        LONG childFlags = ReadNoFence(&child->Flags);
+        if (childFlags) flags = childFlags;
+
+        node = child;
+        pos += child->LabelLength + 1;
+    }
+    return flags;
+}
+
+typedef struct _PATH_TRIE_WALK_ENTRY {
+    PPATH_TRIE_NODE Node;  // Node still to visit
+    USHORT Prefix;         // Length in WCHARs of its parent's path
+} PATH_TRIE_WALK_ENTRY, *PPATH_TRIE_WALK_ENTRY;
+
+NTSTATUS
+PathTrieEnumerate(PPATH_TRIE_NODE Root, PPATH_TRIE_VISIT Visit, PVOID Context)
+{
+    ULONG capacity = 64;
+    ULONG depth = 0;
+    NTSTATUS status = STATUS_SUCCESS;
+    PPATH_TRIE_WALK_ENTRY stack = ExAllocatePool2(POOL_FLAG_PAGED, capacity * sizeof(PATH_TRIE_WALK_ENTRY), 'tPtL');
+    PWCH path = ExAllocatePool2(POOL_FLAG_PAGED, UNICODE_STRING_MAX_BYTES, 'tPtL');
+    if (!stack || !path) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+    }
+    else {
+        // Depth first, so the parent's path is still in the buffer when a node is popped
+        stack[depth].Node = Root;
+        stack[depth++].Prefix = 0;
+    }
+
+    while (depth > 0 && NT_SUCCESS(status)) {
+        PPATH_TRIE_WALK_ENTRY entry = &stack[--depth];
+        PPATH_TRIE_NODE node = entry->Node;
+        USHORT length = entry->Prefix;
+        if (length > 0) {
+            path[length++] = L'\\';
+        }
+        RtlCopyMemory(path + length, node->Label, node->LabelLength * sizeof(WCHAR));
+        length += node->LabelLength;
+
+        if (node->Flags) {
+            UNICODE_STRING directory;
+            directory.Buffer = path;
+            directory.Length = directory.MaximumLength = length * sizeof(WCHAR);
+            Visit(Context, &directory, node->Flags);
+        }
+
+        for (PPATH_TRIE_NODE child = node->Children; child; child = child->Sibling) {
+            if (depth == capacity) {
+                PPATH_TRIE_WALK_ENTRY larger = ExAllocatePool2(POOL_FLAG_PAGED,
+                    capacity * 2 * sizeof(PATH_TRIE_WALK_ENTRY), 'tPtL');
+                if (!larger) {
+                    status = STATUS_INSUFFICIENT_RESOURCES;
+                    break;
+                }
+                RtlCopyMemory(larger, stack, capacity * sizeof(PATH_TRIE_WALK_ENTRY));
+                ExFreePool(stack);
+                stack = larger;
+                capacity *= 2;
+            }
+            stack[depth].Node = child;
+            stack[depth++].Prefix = length;
+        }
+    }
+
+    if (stack) ExFreePool(stack);
+    if (path) ExFreePool(path);
+    return status;
+}
+
+VOID PathTrieQueryUsage(PPATH_TRIE_NODE Root, PULONG64 Nodes, PULONG64 Bytes)
+{
+    // The same walk as PathTrieDestroy, without freeing; a live node's Retired link is unused
+    PPATH_TRIE_NODE stack = Root;
+    Root->Retired = NULL;
+    *Nodes = 0;
+    *Bytes = 0;
+    while (stack) {
+        PPATH_TRIE_NODE node = stack;
+        stack = node->Retired;
+        for (PPATH_TRIE_NODE child = node->Children; child; child = child->Sibling) {
+            child->Retired = stack;
+            stack = child;
+        }
+        node->Retired = NULL;
+        (*Nodes)++;
+        *Bytes += FIELD_OFFSET(PATH_TRIE_NODE, Label) + node->LabelLength * sizeof(WCHAR);
+        if (node->Index) {
+            *Bytes += FIELD_OFFSET(PATH_TRIE_INDEX, Slots) + (node->Index->Mask + 1) * sizeof(PPATH_TRIE_NODE);
+        }
+    }
+}
+
+VOID PathTrieFreeRetired(PPATH_TRIE_NODE Retired)
+{
+    while (Retired) {
+        PPATH_TRIE_NODE next = Retired->Retired;
+        ExFreePool(Retired);
+        Retired = next;
+    }
+}
+
+VOID PathTrieDestroy(PPATH_TRIE_NODE Root)
+{
+    if (!Root) return;
+
+    // Walk with an explicit stack threaded through the Retired links rather than recursing on the kernel stack
+    PPATH_TRIE_NODE stack = Root;
+    Root->Retired = NULL;
+    while (stack) {
+        PPATH_TRIE_NODE node = stack;
+        stack = node->Retired;
+        for (PPATH_TRIE_NODE child = node->Children; child; child = child->Sibling) {
+            child->Retired = stack;
+            stack = child;
+        }
+        if (node->Index) {
+            ExFreePool(node->Index);
+        }
+        ExFreePool(node);
+    }
+}
@@ -0,0 +1,136 @@
+#pragma once
+#include <fltKernel.h>
+#include <dontuse.h>
+
+/**
+ * @def PATH_TRIE_TRACKED
+ * @brief Rule flag: deletions below the directory are logged. The other bits of a rule are RULE_* bits.
+ */
+#define PATH_TRIE_TRACKED   0x1
+
+/**
+ * @def PATH_TRIE_PROTECTED
+ * @brief Rule flag: deletions below the directory are blocked.
+ */
+#define PATH_TRIE_PROTECTED 0x2
+
+/**
+ * @struct _PATH_TRIE_NODE
+ * @brief One edge of the compressed directory trie.
+ *
+ * A node's label holds one or more upcased path components separated by '\'. The first
+ * components of siblings are always distinct, so at most one child can continue a path.
+ * Labels never change after a node is published; a split or merge publishes a replacement
+ * node and retires the old one, which the caller frees after a reader grace period. A node
+ * with many children also indexes them by the hash of their first component, so a lookup
+ * does not walk a directory's whole list of subdirectory rules.
+ */
+typedef struct _PATH_TRIE_NODE {
+    struct _PATH_TRIE_NODE* Sibling;   ///< Next child of the same parent, published with release semantics.
+    struct _PATH_TRIE_NODE* Children;  ///< First child, published with release semantics.
+    struct _PATH_TRIE_NODE* Retired;   ///< Link in the writer's retire list; never followed by readers.
+    struct _PATH_TRIE_NODE** Link;     ///< Writer's back link: the Children or Sibling field pointing here.
+    struct _PATH_TRIE_INDEX* Index;    ///< Children by first component, or NULL; published with release semantics.
+    ULONG ChildCount;                  ///< Number of children; writer only.
+    ULONG Hash;                        ///< Hash of the label's first component, the key in the parent's index.
+    LONG Flags;                        ///< PATH_TRIE_* and RULE_* bits of the rule ending here, 0 for a branching node.
+    USHORT LabelLength;                ///< Label length in WCHARs.
+    WCHAR Label[1];                    ///< Upcased components, LabelLength characters, not null-terminated.
+} PATH_TRIE_NODE, *PPATH_TRIE_NODE;
+
+/**
+ * @brief Callback of PathTrieEnumerate, called once per rule.
+ *
+ * @param[in] Context The caller's context.
+ * @param[in] Path Upcased path of the directory, without leading or trailing separators; only valid during the call.
+ * @param[in] Flags PATH_TRIE_* bits of the rule.
+ */
+typedef VOID (*PPATH_TRIE_VISIT)(PVOID Context, PCUNICODE_STRING Path, LONG Flags);
+
+/**
+ * @brief Allocates the empty root of a trie.
+ *
+ * @return PPATH_TRIE_NODE The root node, or NULL if the allocation fails.
+ */
+PPATH_TRIE_NODE PathTrieCreate(VOID);
+
+/**
+ * @brief Registers a rule for a directory and everything below it.
+ *
+ * Leading and trailing separators are ignored. Nodes displaced by an edge split are chained
+ * onto Retired. Writers must be serialized by the caller.
+ *
+ * @param[in] Root Root returned by PathTrieCreate.
+ * @param[in] Path Pointer to a UNICODE_STRING with the NT path of the directory.
+ * @param[in] Flags PATH_TRIE_* bits for the rule; must be non-zero.
+ * @param[in,out] Retired Head of the caller's retire list.
+ * @return NTSTATUS STATUS_SUCCESS on success, STATUS_ALREADY_REGISTERED if the directory already has a rule,
+ *         STATUS_INVALID_PARAMETER for an empty path, STATUS_INSUFFICIENT_RESOURCES if allocation fails.
+ */
+NTSTATUS PathTrieInsert(PPATH_TRIE_NODE Root, PCUNICODE_STRING Path, LONG Flags, PPATH_TRIE_NODE* Retired);
+
+/**
+ * @brief Removes the rule registered for a directory.
+ *
+ * Nodes that no longer carry a rule are pruned or merged with their only child, and the
+ * displaced nodes are chained onto Retired. Writers must be serialized by the caller.
+ *
+ * @param[in] Root Root returned by PathTrieCreate.
+ * @param[in] Path Pointer to a UNICODE_STRING with the NT path of the directory.
+ * @param[in,out] Retired Head of the caller's retire list.
+ * @param[out] Flags Optional; receives the flags the removed rule had.
+ * @return NTSTATUS STATUS_SUCCESS if the rule was removed, STATUS_NOT_FOUND otherwise.
+ */
+NTSTATUS PathTrieRemove(PPATH_TRIE_NODE Root, PCUNICODE_STRING Path, PPATH_TRIE_NODE* Retired, PLONG Flags);
+
+/**
+ * @brief Finds the rule of the deepest registered directory containing a path.
+ *
+ * Folds the path while walking it, so the cost depends on the path depth and not on the
+ * number of rules, however many subdirectory rules share a parent. Takes no lock; the caller
+ * must keep the nodes alive for the duration.
+ *
+ * @param[in] Root Root returned by PathTrieCreate.
+ * @param[in] Path Pointer to a UNICODE_STRING with the NT path to match.
+ * @return LONG The PATH_TRIE_* flags of the longest matching rule, 0 if no rule matches.
+ */
+LONG PathTrieLookup(PPATH_TRIE_NODE Root, PCUNICODE_STRING Path);
+
+/**
+ * @brief Calls Visit for every rule in the trie.
+ *
+ * Walks the trie without recursion; the trie must not change during the walk. Must be called at
+ * IRQL <= APC_LEVEL.
+ *
+ * @param[in] Root Root returned by PathTrieCreate.
+ * @param[in] Visit Callback receiving each rule's path and flags.
+ * @param[in] Context Passed through to Visit.
+ * @return NTSTATUS STATUS_SUCCESS, or STATUS_INSUFFICIENT_RESOURCES if the walk could not be completed.
+ */
+NTSTATUS PathTrieEnumerate(PPATH_TRIE_NODE Root, PPATH_TRIE_VISIT Visit, PVOID Context);
+
+/**
+ * @brief Counts the nodes of a trie and the bytes they and their child indexes take.
+ *
+ * Threads its walk through the Retired links, which readers never follow, so it must be called by the writer,
+ * with no retire list pending; the trie must not change during the walk.
+ *
+ * @param[in] Root Root returned by PathTrieCreate.
+ * @param[out] Nodes Receives the number of nodes, the root included.
+ * @param[out] Bytes Receives the bytes of their allocations.
+ */
+VOID PathTrieQueryUsage(PPATH_TRIE_NODE Root, PULONG64 Nodes, PULONG64 Bytes);
+
+/**
+ * @brief Frees every node on a retire list.
+ *
+ * @param[in] Retired Head of the retire list; may be NULL.
+ */
+VOID PathTrieFreeRetired(PPATH_TRIE_NODE Retired);
+
+/**
+ * @brief Frees a whole trie, including its root.
+ *
+ * @param[in] Root Root returned by PathTrieCreate; may be NULL.
+ */
+VOID PathTrieDestroy(PPATH_TRIE_NODE Root);
@@ -0,0 +1,194 @@
+#include <fltKernel.h>
+#include <dontuse.h>
+#include "perfStats.h"
+
+// The time stamp counter reads in a few cycles where the performance counter may need a call into the HAL.
+// Its frequency is measured against the performance counter when the stats are queried.
+#if defined(_M_AMD64) || defined(_M_IX86)
+#define PERF_STATS_TSC
+#endif
+
+
+/**
+ * @struct _PERF_SLOT
+ * @brief Counters and histograms updated by one processor, on cache lines of their own.
+ */
+typedef struct DECLSPEC_CACHEALIGN _PERF_SLOT {
+    volatile LONG64 Counters[PERF_COUNTER_COUNT];
+    struct {
+        volatile LONG64 Count;
+        volatile LONG64 TotalTicks;
+        volatile LONG64 Buckets[PERF_HISTOGRAM_BUCKETS];
+    } Histograms[PERF_HISTOGRAM_COUNT];
+} PERF_SLOT, *PPERF_SLOT;
+
+static PPERF_SLOT Slots;
+static ULONG SlotCount;
+
+#ifdef PERF_STATS_TSC
+// A reading of both clocks at load time, to measure the time stamp counter's frequency against
+static ULONG64 CalibrationTsc;
+static LONG64 CalibrationQpc;
+#endif
+
+
+NTSTATUS
+InitializePerfStats()
+{
+    ULONG count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    // Allocations of a page or more start on a page, so every slot starts on a cache line of its own
+    SIZE_T size = max((SIZE_T)count * sizeof(PERF_SLOT), PAGE_SIZE);
+    PPERF_SLOT slots = (PPERF_SLOT)ExAllocatePool2(POOL_FLAG_NON_PAGED, size, 'sPtL');
+    if (!slots) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+#ifdef PERF_STATS_TSC
+    CalibrationQpc = KeQueryPerformanceCounter(NULL).QuadPart;
+    CalibrationTsc = ReadTimeStampCounter();
+#endif
+    SlotCount = count;
+    Slots = slots;
+    return STATUS_SUCCESS;
+}
+
+VOID
+CleanupPerfStats()
+{
+    if (Slots) {
+        ExFreePoolWithTag(Slots, 'sPtL');
+        Slots = NULL;
+        SlotCount = 0;
+    }
+}
+
+ULONG64
+PerfTimestamp()
+{
+#ifdef PERF_STATS_TSC
+    return ReadTimeStampCounter();
+#else
+    return (ULONG64)KeQueryPerformanceCounter(NULL).QuadPart;
+#endif
+}
+
+// The slot of the processor the caller runs on. A thread moved to another processor right after reading the
+// number updates a slot it shares with that processor's threads for a moment, so updates stay interlocked; on a
+// line no other processor writes, that costs little more than a plain increment.
+static PPERF_SLOT
+CurrentSlot()
+{
+    PPERF_SLOT slots = Slots;
+    if (!slots) {
+        return NULL;
+    }
+    ULONG index = KeGetCurrentProcessorNumberEx(NULL);
+    return &slots[index < SlotCount ? index : 0];
+}
+
+static ULONG
+BucketOf(ULONG64 Ticks)
+{
+    ULONG index;
+    if (Ticks >= (1ULL << (PERF_HISTOGRAM_BUCKETS - 2))) {
+        return PERF_HISTOGRAM_BUCKETS - 1;
+    }
+    if (!BitScanReverse(&index, (ULONG)Ticks)) {
+        return 0;
+    }
+    return index + 1;
+}
+
+VOID
+PerfCount(ULONG Counter)
+{
+    PPERF_SLOT slot = CurrentSlot();
+    if (slot) {
+        InterlockedIncrement64(&slot->Counters[Counter]);
+    }
+}
+
+VOID
+PerfRecord(ULONG Histogram, ULONG64 Start)
+{
+    PPERF_SLOT slot = CurrentSlot();
+    if (!slot) {
+        return;
+    }
+
+    // A thread that moved between processors may read a counter slightly behind the one it started on
+    LONG64 ticks = (LONG64)(PerfTimestamp() - Start);
+    if (ticks < 0) {
+        ticks = 0;
+    }
+    InterlockedIncrement64(&slot->Histograms[Histogram].Count);
+    InterlockedAdd64(&slot->Histograms[Histogram].TotalTicks, ticks);
+    InterlockedIncrement64(&slot->Histograms[Histogram].Buckets[BucketOf((ULONG64)ticks)]);
+}
+
+ULONG64
+PerfCounterTotal(ULONG Counter)
+{
+    PPERF_SLOT slots = Slots;
+    ULONG64 total = 0;
+    for (ULONG i = 0; slots && i < SlotCount; i++) {
+        total += (ULONG64)ReadNoFence64(&slots[i].Counters[Counter]);
+    }
+    return total;
+}
+
+// Ticks of PerfTimestamp per second
+static ULONG64
+TicksPerSecond()
+{
+    LARGE_INTEGER frequency;
+    LONG64 qpc = KeQueryPerformanceCounter(&frequency).QuadPart;
+
+#ifdef PERF_STATS_TSC
+    ULONG64 tscElapsed = ReadTimeStampCounter() - CalibrationTsc;
+    ULONG64 qpcElapsed = (ULONG64)(qpc - CalibrationQpc);
+
+    // Scaled down far enough that the remainder times the frequency cannot overflow; the precision lost is
+    // far below that of the clocks
+    while (qpcElapsed >= (1ULL << 31)) {
+        tscElapsed >>= 1;
+        qpcElapsed >>= 1;
+    }
+    if (!qpcElapsed) {
+        return 0;
+    }
+    return tscElapsed / qpcElapsed * (ULONG64)frequency.QuadPart
+        + tscElapsed % qpcElapsed * (ULONG64)frequency.QuadPart / qpcElapsed;
+#else
+    UNREFERENCED_PARAMETER(qpc);
+    return (ULONG64)frequency.QuadPart;
+#endif
+}
+
+VOID
+QueryPerfStats(PPERF_STATS Stats)
+{
+    PPERF_SLOT slots = Slots;
+
+    RtlZeroMemory(Stats, sizeof(PERF_STATS));
+    if (!slots) {
+        return;
+    }
+
+    Stats->TicksPerSecond = TicksPerSecond();
+    Stats->Processors = SlotCount;
+    for (ULONG i = 0; i < SlotCount; i++) {
+        for (ULONG c = 0; c < PERF_COUNTER_COUNT; c++) {
+            Stats->Counters[c] += (ULONG64)ReadNoFence64(&slots[i].Counters[c]);
+        }
+        for (ULONG h = 0; h < PERF_HISTOGRAM_COUNT; h++) {
+            PPERF_HISTOGRAM histogram = &Stats->Histograms[h];
+            histogram->Count += (ULONG64)ReadNoFence64(&slots[i].Histograms[h].Count);
+            histogram->TotalTicks += (ULONG64)ReadNoFence64(&slots[i].Histograms[h].TotalTicks);
+            for (ULONG b = 0; b < PERF_HISTOGRAM_BUCKETS; b++) {
+                histogram->Buckets[b] += (ULONG64)ReadNoFence64(&slots[i].Histograms[h].Buckets[b]);
+            }
+        }
+    }
+}
@@ -0,0 +1,183 @@
+#pragma once
+#include <fltKernel.h>
+#include <dontuse.h>
+
+/**
+ * @def PERF_COUNTER_NAME_QUERY_FAILURES
+ * @brief Counter: file name queries that failed or returned no name.
+ */
+#define PERF_COUNTER_NAME_QUERY_FAILURES 0
+
+/**
+ * @def PERF_COUNTER_CACHE_HITS
+ * @brief Counter: verdicts answered from a handle's decision cache.
+ */
+#define PERF_COUNTER_CACHE_HITS          1
+
+/**
+ * @def PERF_COUNTER_CACHE_MISSES
+ * @brief Counter: verdicts that had to query the file name and consult the rules.
+ */
+#define PERF_COUNTER_CACHE_MISSES        2
+
+/**
+ * @def PERF_COUNTER_VOLUME_SKIPS
+ * @brief Counter: operations let through untouched because their volume has no rules.
+ */
+#define PERF_COUNTER_VOLUME_SKIPS        3
+
+/**
+ * @def PERF_COUNTER_DENIED
+ * @brief Counter: operations failed with STATUS_ACCESS_DENIED by a rule.
+ */
+#define PERF_COUNTER_DENIED              4
+
+/**
+ * @def PERF_COUNTER_ENQUEUED
+ * @brief Counter: messages queued for the consumer.
+ */
+#define PERF_COUNTER_ENQUEUED            5
+
+/**
+ * @def PERF_COUNTER_DROPPED
+ * @brief Counter: messages the queue had no room for.
+ */
+#define PERF_COUNTER_DROPPED             6
+
+/**
+ * @def PERF_COUNTER_FILTER_REJECTED
+ * @brief Counter: rule lookups the prefilter answered alone.
+ */
+#define PERF_COUNTER_FILTER_REJECTED     7
+
+/**
+ * @def PERF_COUNTER_FILTER_ADMITTED
+ * @brief Counter: rule lookups the prefilter passed on to the table and the directory trie.
+ */
+#define PERF_COUNTER_FILTER_ADMITTED     8
+
+/**
+ * @def PERF_COUNTER_FILTER_FALSE_POSITIVES
+ * @brief Counter: admitted rule lookups that matched neither a name nor a directory rule.
+ */
+#define PERF_COUNTER_FILTER_FALSE_POSITIVES 9
+
+/**
+ * @def PERF_COUNTER_COUNT
+ * @brief Number of PERF_COUNTER_* counters.
+ */
+#define PERF_COUNTER_COUNT               10
+
+/**
+ * @def PERF_HISTOGRAM_PRE_OPERATION
+ * @brief Histogram: time spent in the pre-operation callbacks; its count is the number of callbacks seen.
+ */
+#define PERF_HISTOGRAM_PRE_OPERATION     0
+
+/**
+ * @def PERF_HISTOGRAM_POST_OPERATION
+ * @brief Histogram: time spent in the post-operation callbacks.
+ */
+#define PERF_HISTOGRAM_POST_OPERATION    1
+
+/**
+ * @def PERF_HISTOGRAM_NAME_QUERY
+ * @brief Histogram: time spent querying file names, failures included.
+ */
+#define PERF_HISTOGRAM_NAME_QUERY        2
+
+/**
+ * @def PERF_HISTOGRAM_RULE_LOOKUP
+ * @brief Histogram: time spent looking a file name up in the rules.
+ */
+#define PERF_HISTOGRAM_RULE_LOOKUP       3
+
+/**
+ * @def PERF_HISTOGRAM_COUNT
+ * @brief Number of PERF_HISTOGRAM_* histograms.
+ */
+#define PERF_HISTOGRAM_COUNT             4
+
+/**
+ * @def PERF_HISTOGRAM_BUCKETS
+ * @brief Buckets per histogram. Bucket 0 counts samples of 0 ticks, bucket i samples of 2^(i-1) up to 2^i - 1
+ *        ticks, and the last bucket everything from 2^(PERF_HISTOGRAM_BUCKETS - 2) ticks on.
+ */
+#define PERF_HISTOGRAM_BUCKETS           32
+
+/**
+ * @struct _PERF_HISTOGRAM
+ * @brief Latency histogram with log2-sized buckets, in ticks of PERF_STATS.TicksPerSecond.
+ */
+typedef struct _PERF_HISTOGRAM {
+    ULONG64 Count;                            ///< Samples recorded.
+    ULONG64 TotalTicks;                       ///< Sum of the samples, for the mean.
+    ULONG64 Buckets[PERF_HISTOGRAM_BUCKETS];  ///< Samples per bucket.
+} PERF_HISTOGRAM, *PPERF_HISTOGRAM;
+
+/**
+ * @struct _PERF_STATS
+ * @brief Hot-path counters and latency histograms summed over all processors, as returned by IOCTL_GET_STATS.
+ *
+ * The values only grow while the driver is loaded; rates come from the difference of two snapshots.
+ */
+typedef struct _PERF_STATS {
+    ULONG64 TicksPerSecond;                            ///< Frequency of the histogram ticks.
+    ULONG Processors;                                  ///< Processor slots summed.
+    ULONG Reserved;
+    ULONG64 Counters[PERF_COUNTER_COUNT];              ///< Indexed by PERF_COUNTER_*.
+    PERF_HISTOGRAM Histograms[PERF_HISTOGRAM_COUNT];   ///< Indexed by PERF_HISTOGRAM_*.
+} PERF_STATS, *PPERF_STATS;
+
+/**
+ * @brief Allocates one slot of counters and histograms per possible processor.
+ *
+ * Every callback on the box updates the slot of the processor it runs on, so updates never contend for a cache
+ * line. Without the slots the driver works as before and reports zeros.
+ *
+ * @return NTSTATUS STATUS_SUCCESS, or STATUS_INSUFFICIENT_RESOURCES.
+ */
+NTSTATUS InitializePerfStats();
+
+/**
+ * @brief Frees the slots. No callback or IOCTL may still be updating or reading them.
+ */
+VOID CleanupPerfStats();
+
+/**
+ * @brief Reads the clock the histograms are kept in: the time stamp counter where there is one, else the
+ *        performance counter.
+ *
+ * @return ULONG64 The current tick.
+ */
+ULONG64 PerfTimestamp();
+
+/**
+ * @brief Adds one to a counter of the current processor's slot.
+ *
+ * @param[in] Counter One of the PERF_COUNTER_* values.
+ */
+VOID PerfCount(ULONG Counter);
+
+/**
+ * @brief Records the time elapsed since a PerfTimestamp reading in a histogram of the current processor's slot.
+ *
+ * @param[in] Histogram One of the PERF_HISTOGRAM_* values.
+ * @param[in] Start The reading taken when the measured work began.
+ */
+VOID PerfRecord(ULONG Histogram, ULONG64 Start);
+
+/**
+ * @brief Sums a counter over all processors.
+ *
+ * @param[in] Counter One of the PERF_COUNTER_* values.
+ * @return ULONG64 The total; it may miss updates made while it is summed.
+ */
+ULONG64 PerfCounterTotal(ULONG Counter);
+
+/**
+ * @brief Sums every counter and histogram over all processors.
+ *
+ * @param[out] Stats Receives the totals and the tick frequency.
+ */
+VOID QueryPerfStats(PPERF_STATS Stats);
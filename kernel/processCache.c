@@ -0,0 +1,216 @@
+#include <fltKernel.h>
+#include <dontuse.h>
+#include "processCache.h"
+#include "debug.h"
+
+
+// Buckets of entries; a NULL way is free. Lookups share the lock, inserts, evictions and removals take it exclusively.
+static PPROCESS_NAME_ENTRY Buckets[PROCESS_CACHE_BUCKETS][PROCESS_CACHE_WAYS];
+static EX_SPIN_LOCK BucketsLock;
+static BOOLEAN NotifyRegistered;
+
+
+// Process IDs are multiples of four
+static ULONG
+BucketOf(HANDLE ProcessId)
+{
+    return (ULONG)(((ULONG_PTR)ProcessId >> 2) % PROCESS_CACHE_BUCKETS);
+}
+
+VOID
+ReleaseProcessName(PPROCESS_NAME_ENTRY Entry)
+{
+    if (InterlockedDecrement(&Entry->References) == 0) {
+        ExFreePoolWithTag(Entry, 'pCtL');
+    }
+}
+
+// Drops the cached entries of an exited process; its ID may be reused from now on
+static VOID
+ProcessNotifyRoutine(
+    _In_ HANDLE ParentId,
+    _In_ HANDLE ProcessId,
+    _In_ BOOLEAN Create
+)
+{
+    PPROCESS_NAME_ENTRY removed[PROCESS_CACHE_WAYS];
+    ULONG removedCount = 0;
+    ULONG bucket = BucketOf(ProcessId);
+    KIRQL oldIrql;
+
+    UNREFERENCED_PARAMETER(ParentId);
+    if (Create) {
+        return;
+    }
+
+    oldIrql = ExAcquireSpinLockExclusive(&BucketsLock);
+    for (ULONG way = 0; way < PROCESS_CACHE_WAYS; way++) {
+        PPROCESS_NAME_ENTRY entry = Buckets[bucket][way];
+        if (entry && entry->ProcessId == ProcessId) {
+            Buckets[bucket][way] = NULL;
+            removed[removedCount++] = entry;
+        }
+    }
+    ExReleaseSpinLockExclusive(&BucketsLock, oldIrql);
+
+    for (ULONG i = 0; i < removedCount; i++) {
+        ReleaseProcessName(removed[i]);
+    }
+}
+
+NTSTATUS
+InitializeProcessCache()
+{
+    NTSTATUS status;
+
+    RtlZeroMemory(Buckets, sizeof(Buckets));
+    BucketsLock = 0;
+
+    status = PsSetCreateProcessNotifyRoutine(ProcessNotifyRoutine, FALSE);
+    NotifyRegistered = NT_SUCCESS(status);
+    return status;
+}
+
+VOID
+CleanupProcessCache()
+{
+    // Removal waits for notifications already running
+    if (NotifyRegistered) {
+        PsSetCreateProcessNotifyRoutine(ProcessNotifyRoutine, TRUE);
+        NotifyRegistered = FALSE;
+    }
+
+    for (ULONG bucket = 0; bucket < PROCESS_CACHE_BUCKETS; bucket++) {
+        for (ULONG way = 0; way < PROCESS_CACHE_WAYS; way++) {
+            if (Buckets[bucket][way]) {
+                ReleaseProcessName(Buckets[bucket][way]);
+                Buckets[bucket][way] = NULL;
+            }
+        }
+    }
+}
+
+// Returns the matching entry with a reference added, or NULL. Must be called with BucketsLock held.
+static PPROCESS_NAME_ENTRY
+FindEntryLocked(ULONG Bucket, HANDLE ProcessId, LONG64 CreateTime)
+{
+    for (ULONG way = 0; way < PROCESS_CACHE_WAYS; way++) {
+        PPROCESS_NAME_ENTRY entry = Buckets[Bucket][way];
+        if (entry && entry->ProcessId == ProcessId && entry->CreateTime == CreateTime) {
+            InterlockedIncrement(&entry->References);
+            WriteNoFence64(&entry->LastUse, (LONG64)KeQueryInterruptTime());
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Queries the image name into a new entry holding a reference for the caller
+static PPROCESS_NAME_ENTRY
+CreateEntry(PEPROCESS Process, HANDLE ProcessId, LONG64 CreateTime)
+{
+    PUNICODE_STRING imageName = NULL;
+    PPROCESS_NAME_ENTRY entry;
+
+    if (!NT_SUCCESS(SeLocateProcessImageName(Process, &imageName)) || !imageName) {
+        return NULL;
+    }
+
+    // Nonpaged, so the name can be copied at any IRQL a lookup is allowed at
+    entry = ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(PROCESS_NAME_ENTRY) + imageName->Length, 'pCtL');
+    if (entry) {
+        entry->ProcessId = ProcessId;
+        entry->CreateTime = CreateTime;
+        entry->References = 1;
+        entry->LastUse = (LONG64)KeQueryInterruptTime();
+        entry->Name.Buffer = (PWCH)(entry + 1);
+        entry->Name.Length = imageName->Length;
+        entry->Name.MaximumLength = imageName->Length;
+        RtlCopyMemory(entry->Name.Buffer, imageName->Buffer, imageName->Length);
+    }
+
+    // The string and its buffer are a single allocation
+    ExFreePool(imageName);
+    return entry;
+}
+
+PPROCESS_NAME_ENTRY
+LookupProcessName(PEPROCESS Process)
+{
+    HANDLE processId = PsGetProcessId(Process);
+    LONG64 createTime = PsGetProcessCreateTimeQuadPart(Process);
+    ULONG bucket = BucketOf(processId);
+    PPROCESS_NAME_ENTRY entry;
+    PPROCESS_NAME_ENTRY evicted = NULL;
+    KIRQL oldIrql;
+
+    oldIrql = ExAcquireSpinLockShared(&BucketsLock);
+    entry = FindEntryLocked(bucket, processId, createTime);
+    ExReleaseSpinLockShared(&BucketsLock, oldIrql);
+    if (entry) {
+        return entry;
+    }
+
+    if (KeGetCurrentIrql() != PASSIVE_LEVEL) {
+        return NULL;
+    }
+
+    PPROCESS_NAME_ENTRY created = CreateEntry(Process, processId, createTime);
+    if (!created) {
+        return NULL;
+    }
+
+    oldIrql = ExAcquireSpinLockExclusive(&BucketsLock);
+
+    // Another thread of the same process may have added it meanwhile
+    entry = FindEntryLocked(bucket, processId, createTime);
+    if (!entry) {
+        ULONG victim = 0;
+        for (ULONG way = 0; way < PROCESS_CACHE_WAYS; way++) {
+            if (!Buckets[bucket][way]) {
+                victim = way;
+                break;
+            }
+            if (Buckets[bucket][way]->LastUse < Buckets[bucket][victim]->LastUse) {
+                victim = way;
+            }
+        }
+
+        evicted = Buckets[bucket][victim];
+        InterlockedIncrement(&created->References);
+        Buckets[bucket][victim] = created;
+        entry = created;
+        created = NULL;
+    }
+    ExReleaseSpinLockExclusive(&BucketsLock, oldIrql);
+
+    if (created) {
+        ReleaseProcessName(created);
+    }
+    if (evicted) {
+        DEBUG("driverFlt: Evicted the cached name of process %p\n", evicted->ProcessId);
+        ReleaseProcessName(evicted);
+    }
+    return entry;
+}
+
+VOID
+QueryProcessCacheUsage(PMEMORY_USAGE Usage)
+{
+    KIRQL oldIrql;
+
+    RtlZeroMemory(Usage, sizeof(MEMORY_USAGE));
+    Usage->Tag = 'pCtL';
+    oldIrql = ExAcquireSpinLockShared(&BucketsLock);
+    for (ULONG bucket = 0; bucket < PROCESS_CACHE_BUCKETS; bucket++) {
+        for (ULONG way = 0; way < PROCESS_CACHE_WAYS; way++) {
+            PPROCESS_NAME_ENTRY entry = Buckets[bucket][way];
+            if (entry) {
+                Usage->Count++;
+                Usage->Bytes += sizeof(PROCESS_NAME_ENTRY) + entry->Name.Length;
+            }
+        }
+    }
+    ExReleaseSpinLockShared(&BucketsLock, oldIrql);
+    Usage->UsedBytes = Usage->Bytes;
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <fltKernel.h>
+#include <dontuse.h>
+#include "memoryUsage.h"
+
+/**
+ * @def PROCESS_CACHE_BUCKETS
+ * @brief Number of buckets in the process name cache, selected by process ID.
+ */
+#define PROCESS_CACHE_BUCKETS 64
+
+/**
+ * @def PROCESS_CACHE_WAYS
+ * @brief Entries per bucket. A bucket that is full evicts its least recently used entry, so the
+ *        cache never holds more than PROCESS_CACHE_BUCKETS * PROCESS_CACHE_WAYS names.
+ */
+#define PROCESS_CACHE_WAYS 4
+
+/**
+ * @struct _PROCESS_NAME_ENTRY
+ * @brief Image name of one process, identified by its ID and creation time so a reused ID never matches.
+ *
+ * Entries are reference counted: the cache holds one reference while the entry is in a bucket and every
+ * LookupProcessName caller holds one until ReleaseProcessName, so an entry evicted or removed on process
+ * exit stays valid for callers still copying its name.
+ */
+typedef struct _PROCESS_NAME_ENTRY {
+    HANDLE ProcessId;            ///< Process ID, as returned by PsGetProcessId.
+    LONG64 CreateTime;           ///< Creation time of the process, as returned by PsGetProcessCreateTimeQuadPart.
+    volatile LONG References;    ///< References held by the cache and by callers.
+    volatile LONG64 LastUse;     ///< Interrupt time of the latest lookup, for choosing what to evict.
+    UNICODE_STRING Name;         ///< Full image path; the buffer follows the entry in the same allocation.
+} PROCESS_NAME_ENTRY, *PPROCESS_NAME_ENTRY;
+
+/**
+ * @brief Initializes the cache and registers for process exit notifications.
+ *
+ * Without the notification, entries of exited processes are only dropped once they are evicted;
+ * lookups stay correct either way.
+ *
+ * @return NTSTATUS STATUS_SUCCESS, or the error of the notification registration.
+ */
+NTSTATUS InitializeProcessCache();
+
+/**
+ * @brief Unregisters the exit notification and frees every cached name.
+ *
+ * No lookup may be in progress or follow.
+ */
+VOID CleanupProcessCache();
+
+/**
+ * @brief Returns the image name of a process, querying it only the first time the process is seen.
+ *
+ * Callable at IRQL <= DISPATCH_LEVEL; a name that is not cached yet can only be queried at PASSIVE_LEVEL.
+ *
+ * @param[in] Process The process to look up.
+ * @return PPROCESS_NAME_ENTRY A referenced entry to pass to ReleaseProcessName, or NULL if the name
+ *         is unavailable.
+ */
+PPROCESS_NAME_ENTRY LookupProcessName(PEPROCESS Process);
+
+/**
+ * @brief Releases an entry returned by LookupProcessName.
+ *
+ * @param[in] Entry The entry to release.
+ */
+VOID ReleaseProcessName(PPROCESS_NAME_ENTRY Entry);
+
+/**
+ * @brief Reports the names the cache holds and the bytes of their entries.
+ *
+ * @param[out] Usage Receives the tag, the number of cached names and their bytes.
+ */
+VOID QueryProcessCacheUsage(PMEMORY_USAGE Usage);
@@ -0,0 +1,156 @@
+#include "ruleImage.h"
+
+
+#define FNV64_OFFSET 0xcbf29ce484222325ull
+#define FNV64_PRIME 0x00000100000001b3ull
+
+// Sections start 8-byte aligned in the image
+#define IS_SECTION_ALIGNED(n) (((n) & 7) == 0)
+
+// Finalizer of splitmix64: every input bit affects every output bit
+static ULONG64
+Mix64(ULONG64 x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+ULONG64
+RuleImageHash(const WCHAR* Path, USHORT Length, ULONG64 Seed, RULE_IMAGE_FOLD Fold)
+{
+    ULONG64 hash = FNV64_OFFSET ^ Seed;
+
+    for (USHORT i = 0; i < Length / sizeof(WCHAR); i++) {
+        hash = (hash ^ (Fold ? Fold(Path[i]) : Path[i])) * FNV64_PRIME;
+    }
+    return Mix64(hash);
+}
+
+ULONG
+RuleImageBucket(ULONG64 Hash, ULONG BucketCount)
+{
+    return (ULONG)((Hash >> 32) % BucketCount);
+}
+
+ULONG
+RuleImageSlot(ULONG64 Hash, ULONG Pilot, ULONG SlotCount)
+{
+    return (ULONG)(Mix64(Hash + Pilot * 0x9e3779b97f4a7c15ull) % SlotCount);
+}
+
+// Checks that Count elements of Size bytes at Offset lie within the image
+static BOOLEAN
+SectionFits(const RULE_IMAGE_HEADER* Header, ULONG Offset, ULONG Count, ULONG Size)
+{
+    return IS_SECTION_ALIGNED(Offset) && Offset >= Header->HeaderSize
+        && (ULONG64)Offset + (ULONG64)Count * Size <= Header->ImageSize;
+}
+
+static BOOLEAN
+EntryFits(const RULE_IMAGE_HEADER* Header, const RULE_IMAGE_ENTRY* Entry)
+{
+    return Entry->Length > 0 && Entry->Length % sizeof(WCHAR) == 0 && Entry->StringOffset % sizeof(WCHAR) == 0
+        && (ULONG64)Entry->StringOffset + Entry->Length <= Header->StringsSize;
+}
+
+// Index of the entry a hash selects
+static ULONG
+IndexOf(const RULE_IMAGE_VIEW* View, ULONG64 Hash)
+{
+    const RULE_IMAGE_HEADER* header = View->Header;
+    ULONG slot = RuleImageSlot(Hash, View->Pilots[RuleImageBucket(Hash, header->BucketCount)], header->SlotCount);
+    return slot < header->NameCount ? slot : View->Remap[slot - header->NameCount];
+}
+
+BOOLEAN
+RuleImageOpen(PRULE_IMAGE_VIEW View, const VOID* Image, ULONG Size)
+{
+    const RULE_IMAGE_HEADER* header = (const RULE_IMAGE_HEADER*)Image;
+    const UCHAR* base = (const UCHAR*)Image;
+
+    if (Size < sizeof(RULE_IMAGE_HEADER) || header->Magic != RULE_IMAGE_MAGIC || header->Version != RULE_IMAGE_VERSION
+        || header->HeaderSize != sizeof(RULE_IMAGE_HEADER) || header->ImageSize != Size) {
+        return FALSE;
+    }
+
+    // Names need buckets to hash to and a slot each; an image without names has neither
+    if (header->NameCount > 0 ? header->BucketCount == 0 || header->SlotCount < header->NameCount
+        : header->BucketCount != 0 || header->SlotCount != 0) {
+        return FALSE;
+    }
+
+    if (!SectionFits(header, header->PilotsOffset, header->BucketCount, sizeof(ULONG))
+        || !SectionFits(header, header->RemapOffset, header->SlotCount - header->NameCount, sizeof(ULONG))
+        || !SectionFits(header, header->NamesOffset, header->NameCount, sizeof(RULE_IMAGE_ENTRY))
+        || !SectionFits(header, header->DirectoriesOffset, header->DirectoryCount, sizeof(RULE_IMAGE_ENTRY))
+        || !SectionFits(header, header->StringsOffset, header->StringsSize, 1)) {
+        return FALSE;
+    }
+
+    View->Header = header;
+    View->Pilots = (const ULONG*)(base + header->PilotsOffset);
+    View->Remap = (const ULONG*)(base + header->RemapOffset);
+    View->Names = (const RULE_IMAGE_ENTRY*)(base + header->NamesOffset);
+    View->Directories = (const RULE_IMAGE_ENTRY*)(base + header->DirectoriesOffset);
+    View->Strings = base + header->StringsOffset;
+
+    for (ULONG i = 0; i < header->SlotCount - header->NameCount; i++) {
+        if (View->Remap[i] >= header->NameCount) {
+            return FALSE;
+        }
+    }
+    for (ULONG i = 0; i < header->DirectoryCount; i++) {
+        if (!EntryFits(header, &View->Directories[i])) {
+            return FALSE;
+        }
+    }
+
+    // Every name must be where a lookup for it goes, which also rules out two entries for one name
+    for (ULONG i = 0; i < header->NameCount; i++) {
+        const RULE_IMAGE_ENTRY* entry = &View->Names[i];
+        if (!EntryFits(header, entry)) {
+            return FALSE;
+        }
+        const WCHAR* name = (const WCHAR*)(View->Strings + entry->StringOffset);
+        if (IndexOf(View, RuleImageHash(name, entry->Length, header->Seed, NULL)) != i) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+BOOLEAN
+RuleImageLookup(const RULE_IMAGE_VIEW* View, const WCHAR* Path, USHORT Length, RULE_IMAGE_FOLD Fold, PUSHORT Flags)
+{
+    const RULE_IMAGE_HEADER* header = View->Header;
+    if (header->NameCount == 0) {
+        return FALSE;
+    }
+
+    const RULE_IMAGE_ENTRY* entry = &View->Names[IndexOf(View, RuleImageHash(Path, Length, header->Seed, Fold))];
+    if (entry->Length != Length) {
+        return FALSE;
+    }
+
+    // A path that is not in the image still lands on some entry; only the string tells them apart
+    const WCHAR* name = (const WCHAR*)(View->Strings + entry->StringOffset);
+    if (!Fold) {
+        if (!RtlEqualMemory(name, Path, Length)) {
+            return FALSE;
+        }
+    }
+    else {
+        for (USHORT i = 0; i < Length / sizeof(WCHAR); i++) {
+            if (name[i] != Fold(Path[i])) {
+                return FALSE;
+            }
+        }
+    }
+
+    if (Flags) *Flags = entry->Flags;
+    return TRUE;
+}
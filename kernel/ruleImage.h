@@ -0,0 +1,172 @@
+/**
+ * @file ruleImage.h
+ * @brief Layout and reader of a precompiled ruleset image.
+ *
+ * Shared between the driver, which loads an image at startup and looks names up in place, and ctlFlt, which
+ * compiles it; it only uses the base types both <ntddk.h> and <windows.h> define, and includes one of them.
+ *
+ * An image is one contiguous block of little-endian data, every section aligned to 8 bytes from its start:
+ *
+ *   RULE_IMAGE_HEADER
+ *   ULONG Pilots[BucketCount]               displacement of each bucket of the perfect hash
+ *   ULONG Remap[SlotCount - NameCount]      final index of the keys placed past NameCount
+ *   RULE_IMAGE_ENTRY Names[NameCount]       file names, at the index the perfect hash gives them
+ *   RULE_IMAGE_ENTRY Directories[DirectoryCount]
+ *   WCHAR Strings[]                         the upcased paths, back to back, not null-terminated
+ *
+ * A name's 64-bit hash (RuleImageHash) picks its bucket; the bucket's pilot picks its slot, which is its index
+ * in Names, or, past NameCount, indexes Remap. Every name lands on its own index, so a lookup hashes the path
+ * once and compares it with a single entry, whatever the number of rules. The compiler picks pilots that keep
+ * the names of a bucket apart, largest buckets first (hash and displace), and a new Seed if a bucket cannot be
+ * placed. Paths are upcased with RtlUpcaseUnicodeChar before they are stored and hashed.
+ */
+
+#pragma once
+#ifdef _KERNEL_MODE
+#include <fltKernel.h>
+#include <dontuse.h>
+#else
+#include <windows.h>
+#endif
+
+/**
+ * @def RULE_IMAGE_MAGIC
+ * @brief RULE_IMAGE_HEADER::Magic, "RIMG" in little-endian order.
+ */
+#define RULE_IMAGE_MAGIC 0x474D4952
+
+/**
+ * @def RULE_IMAGE_VERSION
+ * @brief Layout version stored in RULE_IMAGE_HEADER::Version.
+ */
+#define RULE_IMAGE_VERSION 1
+
+/**
+ * @def RULE_IMAGE_MAX_SIZE
+ * @brief Largest image the driver loads, in bytes; several million rules of typical length.
+ */
+#define RULE_IMAGE_MAX_SIZE (512 * 1024 * 1024)
+
+/**
+ * @def RULE_IMAGE_PROTECTED
+ * @brief RULE_IMAGE_ENTRY::Flags bit: deletions of the file, or of the files below the directory, are blocked.
+ */
+#define RULE_IMAGE_PROTECTED 0x1
+
+/**
+ * @def RULE_IMAGE_OPERATIONS
+ * @brief RULE_IMAGE_ENTRY::Flags bit: the high byte holds the rule's RULE_* mask (see ruleOps.h), which replaces
+ *        RULE_IMAGE_PROTECTED. Without it a rule logs deletions, and blocks them if it is protected.
+ */
+#define RULE_IMAGE_OPERATIONS 0x2
+
+/**
+ * @def RULE_IMAGE_OPERATIONS_SHIFT
+ * @brief Position of the RULE_* mask in RULE_IMAGE_ENTRY::Flags.
+ */
+#define RULE_IMAGE_OPERATIONS_SHIFT 8
+
+/**
+ * @struct _RULE_IMAGE_HEADER
+ * @brief Start of an image. Offsets are in bytes from the start of the image.
+ */
+typedef struct _RULE_IMAGE_HEADER {
+    ULONG Magic;             ///< RULE_IMAGE_MAGIC.
+    ULONG Version;           ///< RULE_IMAGE_VERSION.
+    ULONG HeaderSize;        ///< sizeof(RULE_IMAGE_HEADER).
+    ULONG ImageSize;         ///< Bytes in the whole image, header included.
+    ULONG64 Seed;            ///< Seeds RuleImageHash for this image.
+    ULONG NameCount;         ///< File names, the keys of the perfect hash.
+    ULONG BucketCount;       ///< Buckets of the perfect hash; 0 without names.
+    ULONG SlotCount;         ///< Slots the pilots choose from, at least NameCount.
+    ULONG DirectoryCount;    ///< Directory rules.
+    ULONG PilotsOffset;      ///< Offset of the ULONG pilots, one per bucket.
+    ULONG RemapOffset;       ///< Offset of the ULONG remap table, one per slot past NameCount.
+    ULONG NamesOffset;       ///< Offset of the RULE_IMAGE_ENTRY of each name.
+    ULONG DirectoriesOffset; ///< Offset of the RULE_IMAGE_ENTRY of each directory rule.
+    ULONG StringsOffset;     ///< Offset of the string pool.
+    ULONG StringsSize;       ///< Bytes in the string pool.
+} RULE_IMAGE_HEADER, *PRULE_IMAGE_HEADER;
+
+/**
+ * @struct _RULE_IMAGE_ENTRY
+ * @brief One rule of an image.
+ */
+typedef struct _RULE_IMAGE_ENTRY {
+    ULONG StringOffset;      ///< Offset of the upcased path in the string pool, in bytes.
+    USHORT Length;           ///< Bytes in the path. A directory's path ends in a backslash.
+    USHORT Flags;            ///< RULE_IMAGE_PROTECTED, RULE_IMAGE_OPERATIONS and its mask, or 0.
+} RULE_IMAGE_ENTRY, *PRULE_IMAGE_ENTRY;
+
+/**
+ * @brief Upcases one character the way RtlUpcaseUnicodeChar does; each environment passes its own.
+ */
+typedef WCHAR (*RULE_IMAGE_FOLD)(WCHAR Ch);
+
+/**
+ * @struct _RULE_IMAGE_VIEW
+ * @brief The sections of an image that passed RuleImageOpen; points into the image, which must outlive it.
+ */
+typedef struct _RULE_IMAGE_VIEW {
+    const RULE_IMAGE_HEADER* Header;
+    const ULONG* Pilots;
+    const ULONG* Remap;
+    const RULE_IMAGE_ENTRY* Names;
+    const RULE_IMAGE_ENTRY* Directories;
+    const UCHAR* Strings;
+} RULE_IMAGE_VIEW, *PRULE_IMAGE_VIEW;
+
+/**
+ * @brief Hashes a path for the perfect hash of an image.
+ *
+ * @param[in] Path The path, Length bytes long.
+ * @param[in] Length Bytes in Path.
+ * @param[in] Seed RULE_IMAGE_HEADER::Seed of the image.
+ * @param[in] Fold Upcases each character first, or NULL for a path that is already upcased.
+ * @return ULONG64 The hash.
+ */
+ULONG64 RuleImageHash(const WCHAR* Path, USHORT Length, ULONG64 Seed, RULE_IMAGE_FOLD Fold);
+
+/**
+ * @brief Gives the bucket a hash falls in.
+ *
+ * @param[in] Hash As returned by RuleImageHash.
+ * @param[in] BucketCount RULE_IMAGE_HEADER::BucketCount, not 0.
+ * @return ULONG The bucket.
+ */
+ULONG RuleImageBucket(ULONG64 Hash, ULONG BucketCount);
+
+/**
+ * @brief Gives the slot a pilot places a hash in.
+ *
+ * @param[in] Hash As returned by RuleImageHash.
+ * @param[in] Pilot The pilot of the hash's bucket.
+ * @param[in] SlotCount RULE_IMAGE_HEADER::SlotCount, not 0.
+ * @return ULONG The slot.
+ */
+ULONG RuleImageSlot(ULONG64 Hash, ULONG Pilot, ULONG SlotCount);
+
+/**
+ * @brief Checks an image and fills a view of its sections.
+ *
+ * Checks the header, that every section and string lies within Size bytes, and that every name hashes to its
+ * own entry, so lookups need no further checks. Takes time linear in the size of the image.
+ *
+ * @param[out] View Receives pointers into Image.
+ * @param[in] Image The image, 8-byte aligned.
+ * @param[in] Size Bytes in Image.
+ * @return BOOLEAN TRUE if the image is well formed, FALSE otherwise.
+ */
+BOOLEAN RuleImageOpen(PRULE_IMAGE_VIEW View, const VOID* Image, ULONG Size);
+
+/**
+ * @brief Looks a file name up in an image. Takes no lock and touches one entry and its string.
+ *
+ * @param[in] View The image, as filled by RuleImageOpen.
+ * @param[in] Path The path to look up, in any case.
+ * @param[in] Length Bytes in Path.
+ * @param[in] Fold Upcases the characters of Path, or NULL for a path that is already upcased.
+ * @param[out] Flags Receives the RULE_IMAGE_ENTRY::Flags of the name if it is found; may be NULL.
+ * @return BOOLEAN TRUE if the image holds the name, FALSE otherwise.
+ */
+BOOLEAN RuleImageLookup(const RULE_IMAGE_VIEW* View, const WCHAR* Path, USHORT Length, RULE_IMAGE_FOLD Fold, PUSHORT Flags);
@@ -0,0 +1,86 @@
+/**
+ * @file ruleOps.h
+ * @brief Operations a rule tracks or denies.
+ *
+ * Shared between the driver and ctlFlt, so it only holds plain defines. Every rule carries a mask of two bits per
+ * operation: RULE_TRACK logs the operation, RULE_DENY blocks it (and logs it as denied). The deletion bits are the
+ * TRACKED and PROTECTED bits rules had before they named operations, so PATH_TRIE_*, GLOB_RULE_* and the legacy
+ * flags of the rule image and the IOCTLs mean the same as a mask of deletion bits.
+ */
+
+#pragma once
+
+/**
+ * @def RULE_OP_DELETE
+ * @brief A file is marked for deletion through SetInformation.
+ */
+#define RULE_OP_DELETE          0
+
+/**
+ * @def RULE_OP_RENAME
+ * @brief A file is renamed; the rule of its current name applies.
+ */
+#define RULE_OP_RENAME          1
+
+/**
+ * @def RULE_OP_OVERWRITE
+ * @brief A file is opened for supersede or overwrite.
+ */
+#define RULE_OP_OVERWRITE       2
+
+/**
+ * @def RULE_OP_DELETE_ON_CLOSE
+ * @brief A file is opened with FILE_DELETE_ON_CLOSE.
+ */
+#define RULE_OP_DELETE_ON_CLOSE 3
+
+/**
+ * @def RULE_OP_COUNT
+ * @brief Number of operations a rule can name.
+ */
+#define RULE_OP_COUNT           4
+
+/**
+ * @def RULE_TRACK
+ * @brief Rule bit: the operation is logged.
+ */
+#define RULE_TRACK(Op)          (0x1 << (2 * (Op)))
+
+/**
+ * @def RULE_DENY
+ * @brief Rule bit: the operation is blocked.
+ */
+#define RULE_DENY(Op)           (0x2 << (2 * (Op)))
+
+/**
+ * @def RULE_OP_BITS
+ * @brief Both bits of an operation; a rule with either one cares about it.
+ */
+#define RULE_OP_BITS(Op)        (RULE_TRACK(Op) | RULE_DENY(Op))
+
+/**
+ * @def RULE_BIT_COUNT
+ * @brief Number of bits in a rule mask.
+ */
+#define RULE_BIT_COUNT          (2 * RULE_OP_COUNT)
+
+/**
+ * @def RULE_ALL
+ * @brief Every bit a rule mask may hold.
+ */
+#define RULE_ALL                ((1 << RULE_BIT_COUNT) - 1)
+
+/**
+ * @def RULE_DEFAULT
+ * @brief Mask of a rule that names no operation: deletions are logged.
+ */
+#define RULE_DEFAULT            RULE_TRACK(RULE_OP_DELETE)
+
+/**
+ * @def RULE_OP_LETTERS
+ * @brief Letter of each operation in the ":ops" suffix of a rule's path, lowercase to track, uppercase to deny.
+ *
+ * E.g. "\\Device\\HarddiskVolume3\\Data\\:dRW" logs deletions and blocks renames and overwrites below Data.
+ * The older ":p" suffix is the same as ":D".
+ */
+#define RULE_OP_LETTERS         "drwc"
@@ -0,0 +1,98 @@
+/**
+ * @file sharedQueue.h
+ * @brief Memory layout and ordering protocol of an event ring read in place by another process.
+ *
+ * Shared between the driver and its user-mode consumers, so it only uses the base types
+ * (ULONG, LONG64) that both <ntddk.h> and <windows.h> define; include one of those first.
+ *
+ * A mapped ring is two views: a QUEUE_SHARED_HEADER page the consumer may write, and a read-only
+ * data area of Capacity bytes of records. Record positions are byte offsets that only grow; a
+ * record at position P lives at offset P & (Capacity - 1) of the data area and never straddles
+ * its end.
+ *
+ * Producer (the driver), per record:
+ *   1. Reserves [P, P + Size) against its own private tail. If the consumer is a full ring
+ *      behind, the record is dropped instead; the consumer is never overtaken. Space the
+ *      consumer has released is zeroed before it is reserved again, so free space never
+ *      holds a valid stamp.
+ *   2. Writes Size, Length and the payload, then stores Stamp = P + 1 with release semantics.
+ *
+ * Consumer, in a loop:
+ *   1. Loads Stamp at Head with acquire semantics. Anything but Head + 1 means no record yet.
+ *   2. Unless Length is QUEUE_PAD_RECORD, reads Length payload bytes right after the header.
+ *   3. Stores Head + Size with release semantics. The driver reuses the space only after
+ *      that store. The consumer never writes the data area; it cannot.
+ *
+ * Every payload starts with its size and a nonzero id. A record with id 0 is a QUEUE_GAP_MARKER:
+ * Lost records were dropped since the previous marker. Records the producer had to drop were
+ * newer than everything before the marker; records overwritten to make room (only in rings the
+ * driver consumes itself) were older than everything still queued.
+ *
+ * The driver never reads the records of a mapped ring, only Head, which it clamps to the
+ * positions it has handed out; a misbehaving consumer can only lose its own events.
+ */
+
+#pragma once
+
+/**
+ * @def QUEUE_SHARED_VERSION
+ * @brief Layout version stored in QUEUE_SHARED_HEADER::Version.
+ */
+#define QUEUE_SHARED_VERSION 3
+
+/**
+ * @def QUEUE_SHARED_HEADER_SIZE
+ * @brief Bytes of the header view.
+ */
+#define QUEUE_SHARED_HEADER_SIZE 4096
+
+/**
+ * @def QUEUE_RECORD_ALIGNMENT
+ * @brief Every record, header included, occupies a multiple of this many bytes.
+ *
+ * Equal to the header size, so the filler before a wrap always has room for one.
+ */
+#define QUEUE_RECORD_ALIGNMENT 16
+
+/**
+ * @def QUEUE_PAD_RECORD
+ * @brief Length of the filler record that skips the end of the ring.
+ */
+#define QUEUE_PAD_RECORD 0xFFFFFFFF
+
+/**
+ * @struct QUEUE_RECORD_HEADER
+ * @brief Precedes every record in the ring.
+ */
+typedef struct _QUEUE_RECORD_HEADER {
+    volatile LONG64 Stamp; // Position of the record + 1 once published, 0 while free
+    ULONG Size;            // Bytes occupied in the ring, header and padding included
+    ULONG Length;          // Payload bytes, or QUEUE_PAD_RECORD for the filler before a wrap
+} QUEUE_RECORD_HEADER, * PQUEUE_RECORD_HEADER;
+
+/**
+ * @struct QUEUE_SHARED_HEADER
+ * @brief The writable page of a mapped ring. Head sits on its own cache line; only the consumer writes it.
+ */
+typedef struct _QUEUE_SHARED_HEADER {
+    ULONG Version;         // QUEUE_SHARED_VERSION
+    ULONG Capacity;        // Bytes in the data area, a power of two
+    ULONG Reserved[14];
+    volatile LONG64 Head;  // Position of the oldest record not yet consumed
+} QUEUE_SHARED_HEADER, * PQUEUE_SHARED_HEADER;
+
+/**
+ * @struct QUEUE_GAP_MARKER
+ * @brief Payload of the record that reports dropped records.
+ */
+typedef struct _QUEUE_GAP_MARKER {
+    ULONG Size;            // sizeof(QUEUE_GAP_MARKER)
+    ULONG Id;              // Always 0; the payloads of other records start with a nonzero id
+    ULONG64 Lost;          // Records dropped since the previous marker
+} QUEUE_GAP_MARKER, * PQUEUE_GAP_MARKER;
+
+/**
+ * @def QUEUE_GAP_RECORD_SIZE
+ * @brief Bytes a gap marker occupies in the ring.
+ */
+#define QUEUE_GAP_RECORD_SIZE (sizeof(QUEUE_RECORD_HEADER) + sizeof(QUEUE_GAP_MARKER))
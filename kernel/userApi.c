@@ -4,22 +4,166 @@
 #include "userApi.h"
 #include "fileList.h"
 #include "circularQ.h"
+#include "decisionCache.h"
+#include "eventEncoder.h"
+#include "processCache.h"
+#include "perfStats.h"
 #include "debug.h"
 
 
-#pragma pack(push, 1) // Ensure tight packing
-typedef struct _DELETE_MESSAGE {
-    ULONG MessageId;
-    WCHAR ProcessName[260];
-    WCHAR FilePath[260];
-    WCHAR DateTime[20];
-} DELETE_MESSAGE, * PDELETE_MESSAGE;
+#pragma pack(push, 1)
+typedef struct _DELETE_MESSAGE_BATCH {
+    ULONG Count;                // Messages following the header
+    ULONG NextMessageId;        // No deletion logged after the batch was taken has a lower MessageId, unless the queue was replaced
+    UCHAR Messages[ANYSIZE_ARRAY];
+} DELETE_MESSAGE_BATCH, * PDELETE_MESSAGE_BATCH;
+#pragma pack(pop)
+
+#pragma pack(push, 1)
+typedef struct _EVENT_RING_MAPPING {
+    ULONG64 Header;             // Where the QUEUE_SHARED_HEADER is mapped in the caller's process, writable
+    ULONG64 Data;               // Where the records are mapped, read-only
+    ULONG Capacity;             // Bytes of records
+} EVENT_RING_MAPPING, * PEVENT_RING_MAPPING;
+#pragma pack(pop)
+
+#pragma pack(push, 1)
+typedef struct _MESSAGE_QUEUE_CONFIG {
+    ULONG Size;                 // Queue bytes, rounded down to a power of two; 0 keeps the current size
+    ULONG Policy;               // QUEUE_OVERFLOW_POLICY
+} MESSAGE_QUEUE_CONFIG, * PMESSAGE_QUEUE_CONFIG;
+
+typedef struct _MESSAGE_QUEUE_STATS {
+    ULONG Size;                 // Bytes in the driver's queue; a ring mapped from now on gets as many
+    ULONG Policy;               // QUEUE_OVERFLOW_POLICY of the driver's queue
+    ULONG64 Dropped;            // Messages dropped since the driver was loaded
+    ULONG UsedBytes;            // Bytes waiting for the consumer, in the queue and the mapped ring
+    ULONG MappedSize;           // Bytes in the mapped ring, or 0 without a subscriber
+} MESSAGE_QUEUE_STATS, * PMESSAGE_QUEUE_STATS;
+#pragma pack(pop)
+
+typedef struct _MEMORY_STATS {
+    TRACKED_FILES_MEMORY Rules; // The table's entries, buckets, directory trie, prefilter, rule image and wildcard DFA
+    MEMORY_USAGE MessageQueue;  // The driver's queue
+    MEMORY_USAGE MappedRing;    // The ring mapped into the subscriber, header page included; zero without one
+    MEMORY_USAGE InternTable;   // Arena of the interned strings; Count is the strings of the current epoch
+    MEMORY_USAGE ProcessCache;  // Cached process image names
+} MEMORY_STATS, * PMEMORY_STATS;
+
+#pragma pack(push, 1)
+typedef struct _RULE_UPDATE {
+    USHORT Operation;           // RULE_UPDATE_ADD or RULE_UPDATE_REMOVE
+    USHORT Flags;               // RULE_UPDATE_PROTECTED, RULE_UPDATE_OPERATIONS and its mask, or 0
+    USHORT PathLength;          // Bytes in Path; a trailing backslash makes it a directory rule
+    WCHAR Path[ANYSIZE_ARRAY];  // NT path, not null-terminated
+} RULE_UPDATE, * PRULE_UPDATE;
+
+typedef struct _RULE_UPDATE_BATCH {
+    ULONG Count;                // Updates following the header
+    ULONG Reserved;             // Must be 0
+    UCHAR Updates[ANYSIZE_ARRAY]; // RULE_UPDATE records, each one starting 8-byte aligned from the batch
+} RULE_UPDATE_BATCH, * PRULE_UPDATE_BATCH;
+#pragma pack(pop)
+
+#define RULE_UPDATE_ADD 0
+#define RULE_UPDATE_REMOVE 1
+
+// The file, or the files below the directory, are protected from deletion
+#define RULE_UPDATE_PROTECTED 0x1
+
+// The high byte of Flags holds the rule's RULE_* bits, which replace RULE_UPDATE_PROTECTED
+#define RULE_UPDATE_OPERATIONS 0x2
+#define RULE_UPDATE_OPERATIONS_SHIFT 8
+
+// Bytes from one RULE_UPDATE to the next
+#define RULE_UPDATE_SIZE(PathLength) ((FIELD_OFFSET(RULE_UPDATE, Path) + (ULONG)(PathLength) + 7) & ~7UL)
+
+#pragma pack(push, 1)
+typedef struct _DELETE_MESSAGE_WAIT {
+    ULONG MinBytes;             // Queue bytes in use that complete the wait at once
+    ULONG MaxLatencyMs;         // How long the first message may wait for the rest; 0 completes on any message
+} DELETE_MESSAGE_WAIT, * PDELETE_MESSAGE_WAIT;
 #pragma pack(pop)
 
 
 extern TRACKED_FILES TrackedFiles;
 extern PDEVICE_OBJECT gDeviceObject;
-static CIRCULAR_QUEUE MessageQueue;
+
+// Parked IOCTL_WAIT_DELETE_MESSAGES requests, completed from NotifyDpc
+static IO_CSQ WaitQueue;
+static LIST_ENTRY WaitList;
+static KSPIN_LOCK WaitLock;
+static KDPC NotifyDpc;
+static KTIMER NotifyTimer;
+static volatile LONG Waiters;           // Parked requests, plus one while the DPC drains
+static volatile LONG TimerArmed;
+static volatile LONG WaitMinBytes = 1;
+static volatile LONG WaitLatencyMs;
+
+// The driver's queue and the ring mapped into the subscribing process, if any. Both are only used inside a
+// read section on QueueUsers, so a QueueLock holder can replace them and wait for the users of the old ones.
+static PCIRCULAR_QUEUE MessageQueue;
+static PCIRCULAR_QUEUE SharedQueue;
+static PEX_RUNDOWN_REF_CACHE_AWARE QueueUsers[2];
+static volatile LONG ActiveQueueUsers;  // Index of the reference new users enter on
+static FAST_MUTEX QueueLock;            // Serializes resizing, subscribing and unsubscribing
+static ULONG QueueSize;                 // Bytes of the driver's queue and of rings mapped from now on
+static volatile LONG64 UnmappedDropped; // Messages dropped by rings that have been unmapped
+static PFILE_OBJECT SubscriberFile;
+static PEPROCESS SubscriberProcess;
+static QUEUE_USER_MAPPING SubscriberMapping;
+static volatile HANDLE SubscriberProcessId; // Read without QueueLock by the exit notification, to skip other processes
+static BOOLEAN ExitNotifyRegistered;    // A ring is only mapped if its process is sure to unmap it before exiting
+
+// Process names and directories are sent in full once per epoch, then by id; see eventMessage.h
+static EVENT_STRINGS Strings;
+
+// Splits the ":ops" suffix off a rule: letters of RULE_OP_LETTERS, lowercase to track the operation and uppercase to
+// deny it, or the older ":p", which denies deletions. Shortens Length to the path and returns the rule's RULE_* bits,
+// or RULE_DEFAULT if the rule has no suffix.
+static LONG
+SplitRuleOperations(PCWCH Rule, SIZE_T* Length)
+{
+    const CHAR letters[] = RULE_OP_LETTERS;
+    LONG operations = 0;
+    SIZE_T i = *Length;
+
+    for (; i > 0 && Rule[i - 1] != L':'; i--) {
+        WCHAR ch = Rule[i - 1];
+        LONG op = 0;
+        while (op < RULE_OP_COUNT && ch != (WCHAR)letters[op] && ch != (WCHAR)(letters[op] - ('a' - 'A'))) {
+            op++;
+        }
+        if (op < RULE_OP_COUNT) {
+            operations |= ch == (WCHAR)letters[op] ? RULE_TRACK(op) : RULE_DENY(op);
+        }
+        else if (ch == L'p') {
+            operations |= RULE_DENY(RULE_OP_DELETE);
+        }
+        else {
+            return RULE_DEFAULT;
+        }
+    }
+
+    // The colon must follow a path and precede at least one letter
+    if (i < 2 || operations == 0) {
+        return RULE_DEFAULT;
+    }
+    *Length = i - 1;
+    return operations;
+}
+
+// RULE_* bits of a batched update, or 0 if its flags are malformed
+static LONG
+RuleUpdateOperations(USHORT Flags)
+{
+    if (Flags & RULE_UPDATE_OPERATIONS) {
+        if (Flags & ~(RULE_UPDATE_OPERATIONS | (RULE_ALL << RULE_UPDATE_OPERATIONS_SHIFT))) return 0;
+        return (Flags >> RULE_UPDATE_OPERATIONS_SHIFT) & RULE_ALL;
+    }
+    if (Flags & ~RULE_UPDATE_PROTECTED) return 0;
+    return RULE_DEFAULT | ((Flags & RULE_UPDATE_PROTECTED) ? RULE_DENY(RULE_OP_DELETE) : 0);
+}
 
 static NTSTATUS 
 IoctlAddFile(_In_ PIRP Irp, PIO_STACK_LOCATION irpSp)
@@ -28,27 +172,32 @@ IoctlAddFile(_In_ PIRP Irp, PIO_STACK_LOCATION irpSp)
     ULONG inputBufferLength = irpSp->Parameters.DeviceIoControl.InputBufferLength;
     NTSTATUS status = STATUS_SUCCESS;
 
-    if (inputBuffer && inputBufferLength > sizeof(WCHAR)) {
+    if (inputBuffer && inputBufferLength > sizeof(WCHAR) && inputBufferLength <= UNICODE_STRING_MAX_BYTES) {
         UNICODE_STRING userFilePath;
-        BOOLEAN protected = FALSE;
-        // Check for protection flag (e.g., ends with ":p")
         PWCHAR buffer = (PWCHAR)inputBuffer;
-        if (wcslen(buffer) > 2 && wcscmp(buffer + wcslen(buffer) - 2, L":p") == 0) {
-            protected = TRUE;
-            buffer[wcslen(buffer) - 2] = L'\0'; // Remove ":p" for filename
+        // Measured once and within the buffer; an unterminated path leaves length at the buffer's end
+        SIZE_T length = wcsnlen(buffer, inputBufferLength / sizeof(WCHAR));
+        if (length == inputBufferLength / sizeof(WCHAR)) {
+            length = 0;
         }
-        RtlInitUnicodeString(&userFilePath, buffer);
-        if (userFilePath.Length > 0 && userFilePath.Length <= inputBufferLength) {
-            if(!GetTrackedFile(&TrackedFiles, &userFilePath, NULL, NULL)){
-                status = AddTrackedFile(&TrackedFiles, userFilePath.Buffer, protected);
-                if (NT_SUCCESS(status)) {
-                    LOG("driverFlt: Successfully added file %wZ, Protected: %d\n", &userFilePath, protected);
-                } else {
-                    LOG("driverFlt: Failed to add file %wZ, status: 0x%08x\n", &userFilePath, status);
-                }
+        // Check for the operations of the rule (e.g., ends with ":dR")
+        LONG operations = SplitRuleOperations(buffer, &length);
+        if (length > 0) {
+            buffer[length] = L'\0'; // Remove the suffix for filename
+        }
+        userFilePath.Buffer = buffer;
+        userFilePath.Length = userFilePath.MaximumLength = (USHORT)(length * sizeof(WCHAR));
+        if (userFilePath.Length > 0) {
+            // A trailing separator registers a rule for the whole directory
+            if (userFilePath.Buffer[userFilePath.Length / sizeof(WCHAR) - 1] == L'\\') {
+                status = AddTrackedDirectory(&TrackedFiles, userFilePath.Buffer, operations);
+            } else {
+                status = AddTrackedFile(&TrackedFiles, userFilePath.Buffer, operations);
             }
-            else {
-                status = STATUS_ALREADY_REGISTERED;
+            if (NT_SUCCESS(status)) {
+                LOG("driverFlt: Successfully added file %wZ, Operations: 0x%02x\n", &userFilePath, operations);
+            } else {
+                LOG("driverFlt: Failed to add file %wZ, status: 0x%08x\n", &userFilePath, status);
             }
         } else {
             status = STATUS_INVALID_PARAMETER;
@@ -71,7 +220,12 @@ IoctlRemoveFile(_In_ PIRP Irp, PIO_STACK_LOCATION irpSp)
         UNICODE_STRING userFilePath;
         RtlInitUnicodeString(&userFilePath, (PCWSTR)inputBuffer);
         if (userFilePath.Length > 0 && userFilePath.Length <= inputBufferLength) {
-            status = RemoveTrackedFile(&TrackedFiles, userFilePath.Buffer);
+            if (userFilePath.Buffer[userFilePath.Length / sizeof(WCHAR) - 1] == L'\\') {
+                status = RemoveTrackedDirectory(&TrackedFiles, userFilePath.Buffer);
+            }
+            else {
+                status = RemoveTrackedFile(&TrackedFiles, userFilePath.Buffer);
+            }
             if (NT_SUCCESS(status)) {
                 DEBUG("driverFlt: Successfully removed file %wZ\n", &userFilePath);
             }
@@ -90,6 +244,182 @@ IoctlRemoveFile(_In_ PIRP Irp, PIO_STACK_LOCATION irpSp)
     return status;
 }
 
+static NTSTATUS
+IoctlUpdateFiles(_In_ PIRP Irp, PIO_STACK_LOCATION irpSp)
+{
+    PRULE_UPDATE_BATCH batch = (PRULE_UPDATE_BATCH)Irp->AssociatedIrp.SystemBuffer;
+    ULONG inputBufferLength = irpSp->Parameters.DeviceIoControl.InputBufferLength;
+    ULONG outputBufferLength = irpSp->Parameters.DeviceIoControl.OutputBufferLength;
+    ULONG offset = FIELD_OFFSET(RULE_UPDATE_BATCH, Updates);
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG applied = 0;
+
+    Irp->IoStatus.Information = 0;
+    if (!batch || inputBufferLength < offset || batch->Count == 0 || batch->Reserved != 0
+        || batch->Count > (inputBufferLength - offset) / RULE_UPDATE_SIZE(0)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ULONG count = batch->Count;
+    if (outputBufferLength != 0 && outputBufferLength < count * sizeof(NTSTATUS)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    PTRACKED_FILE_UPDATE updates = ExAllocatePool2(POOL_FLAG_PAGED, count * sizeof(TRACKED_FILE_UPDATE), 'bUtL');
+    if (!updates) return STATUS_INSUFFICIENT_RESOURCES;
+
+    // Every record is checked before any is applied, so a malformed batch changes nothing
+    for (ULONG i = 0; i < count && NT_SUCCESS(status); i++) {
+        PRULE_UPDATE record = (PRULE_UPDATE)((PUCHAR)batch + offset);
+        if (offset > inputBufferLength || inputBufferLength - offset < FIELD_OFFSET(RULE_UPDATE, Path)
+            || record->Operation > RULE_UPDATE_REMOVE || RuleUpdateOperations(record->Flags) == 0
+            || record->PathLength == 0 || record->PathLength % sizeof(WCHAR) != 0
+            || record->PathLength > UNICODE_STRING_MAX_BYTES - sizeof(WCHAR)
+            || inputBufferLength - offset - FIELD_OFFSET(RULE_UPDATE, Path) < record->PathLength) {
+            status = STATUS_INVALID_PARAMETER;
+        }
+        else {
+            updates[i].Path.Buffer = record->Path;
+            updates[i].Path.Length = updates[i].Path.MaximumLength = record->PathLength;
+            updates[i].Remove = record->Operation == RULE_UPDATE_REMOVE;
+            updates[i].Operations = RuleUpdateOperations(record->Flags);
+            offset += RULE_UPDATE_SIZE(record->PathLength);
+        }
+    }
+
+    if (NT_SUCCESS(status)) {
+        status = UpdateTrackedFiles(&TrackedFiles, updates, count, &applied);
+    }
+
+    if (NT_SUCCESS(status)) {
+        LOG("driverFlt: Applied %lu of %lu rule updates\n", applied, count);
+
+        // The paths have been copied, so the results may overwrite the batch they came in
+        if (outputBufferLength != 0) {
+            PNTSTATUS results = (PNTSTATUS)batch;
+            for (ULONG i = 0; i < count; i++) {
+                results[i] = updates[i].Status;
+            }
+            Irp->IoStatus.Information = count * sizeof(NTSTATUS);
+        }
+    }
+    else {
+        LOG("driverFlt: Failed to apply %lu rule updates, status: 0x%08x\n", count, status);
+    }
+
+    ExFreePoolWithTag(updates, 'bUtL');
+    return status;
+}
+
+static NTSTATUS
+IoctlSetPatterns(_In_ PIRP Irp, PIO_STACK_LOCATION irpSp)
+{
+    PWCHAR buffer = (PWCHAR)Irp->AssociatedIrp.SystemBuffer;
+    ULONG count = irpSp->Parameters.DeviceIoControl.InputBufferLength / sizeof(WCHAR);
+    ULONG patternCount = 0;
+    PGLOB_PATTERN patterns = NULL;
+    NTSTATUS status;
+
+    Irp->IoStatus.Information = 0;
+    if (count > 0 && (!buffer || buffer[count - 1] != L'\0')) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // The list is null-terminated, so wcslen cannot run past the buffer
+    for (ULONG i = 0; i < count && buffer[i]; i += (ULONG)wcslen(buffer + i) + 1) {
+        patternCount++;
+    }
+
+    if (patternCount > 0) {
+        patterns = ExAllocatePool2(POOL_FLAG_PAGED, patternCount * sizeof(GLOB_PATTERN), 'gGtL');
+        if (!patterns) return STATUS_INSUFFICIENT_RESOURCES;
+
+        ULONG i = 0;
+        for (ULONG p = 0; p < patternCount; p++) {
+            SIZE_T length = wcslen(buffer + i);
+            patterns[p].Flags = SplitRuleOperations(buffer + i, &length);
+            if (length * sizeof(WCHAR) > UNICODE_STRING_MAX_BYTES) {
+                ExFreePoolWithTag(patterns, 'gGtL');
+                return STATUS_INVALID_PARAMETER;
+            }
+            patterns[p].Pattern.Buffer = buffer + i;
+            patterns[p].Pattern.Length = (USHORT)(length * sizeof(WCHAR));
+            patterns[p].Pattern.MaximumLength = patterns[p].Pattern.Length;
+            i += (ULONG)wcslen(buffer + i) + 1;
+        }
+    }
+
+    status = SetTrackedPatterns(&TrackedFiles, patterns, patternCount);
+    if (NT_SUCCESS(status)) {
+        LOG("driverFlt: Installed %lu pattern rules\n", patternCount);
+    } else {
+        LOG("driverFlt: Failed to install %lu pattern rules, status: 0x%08x\n", patternCount, status);
+    }
+
+    if (patterns) ExFreePoolWithTag(patterns, 'gGtL');
+    return status;
+}
+
+static NTSTATUS
+IoctlGetCacheStats(_In_ PIRP Irp, PIO_STACK_LOCATION irpSp)
+{
+    PVOID outputBuffer = Irp->AssociatedIrp.SystemBuffer;
+    ULONG outputBufferLength = irpSp->Parameters.DeviceIoControl.OutputBufferLength;
+
+    if (!outputBuffer || outputBufferLength < sizeof(DECISION_CACHE_STATS)) {
+        Irp->IoStatus.Information = 0;
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    GetDecisionCacheStats((PDECISION_CACHE_STATS)outputBuffer);
+    Irp->IoStatus.Information = sizeof(DECISION_CACHE_STATS);
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+IoctlGetFilterStats(_In_ PIRP Irp, PIO_STACK_LOCATION irpSp)
+{
+    PVOID outputBuffer = Irp->AssociatedIrp.SystemBuffer;
+    ULONG outputBufferLength = irpSp->Parameters.DeviceIoControl.OutputBufferLength;
+
+    if (!outputBuffer || outputBufferLength < sizeof(PATH_FILTER_STATS)) {
+        Irp->IoStatus.Information = 0;
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    GetTrackedFilesFilterStats(&TrackedFiles, (PPATH_FILTER_STATS)outputBuffer);
+    Irp->IoStatus.Information = sizeof(PATH_FILTER_STATS);
+    return STATUS_SUCCESS;
+}
+
+// Returns the reference to leave the section with. MessageQueue and SharedQueue, as read inside it, stay valid until then.
+static PEX_RUNDOWN_REF_CACHE_AWARE
+EnterQueueSection()
+{
+    for (;;) {
+        LONG index = ReadAcquire(&ActiveQueueUsers);
+        PEX_RUNDOWN_REF_CACHE_AWARE users = QueueUsers[index];
+        if (ExAcquireRundownProtectionCacheAware(users)) {
+            // Same check as EnterReadSection in fileList.c: only stay on the reference the next resize will wait for
+            if (ReadAcquire(&ActiveQueueUsers) == index) {
+                return users;
+            }
+            ExReleaseRundownProtectionCacheAware(users);
+        }
+        YieldProcessor();
+    }
+}
+
+// Waits until every user that might still see a queue unpublished before this call has left its section.
+// Must be called with QueueLock held.
+static VOID
+SynchronizeQueueUsersLocked()
+{
+    LONG old = ActiveQueueUsers;
+    InterlockedExchange(&ActiveQueueUsers, old ^ 1);
+    ExWaitForRundownProtectionReleaseCacheAware(QueueUsers[old]);
+    ExReInitializeRundownProtectionCacheAware(QueueUsers[old]);
+}
 
 static NTSTATUS 
 IoctlGetDelMsg(_In_ PIRP Irp, PIO_STACK_LOCATION irpSp)
@@ -97,28 +427,563 @@ IoctlGetDelMsg(_In_ PIRP Irp, PIO_STACK_LOCATION irpSp)
     PVOID outputBuffer = Irp->AssociatedIrp.SystemBuffer;
     ULONG outputBufferLength = irpSp->Parameters.DeviceIoControl.OutputBufferLength;
     NTSTATUS status = STATUS_SUCCESS;
+    ULONG length = 0;
 
-    if (outputBuffer && outputBufferLength >= sizeof(DELETE_MESSAGE)) {
-        DELETE_MESSAGE msg;
-        if (Dequeue(&MessageQueue, (PUCHAR)&msg)) {
-            RtlCopyMemory(outputBuffer, &msg, sizeof(DELETE_MESSAGE));
-            Irp->IoStatus.Information = sizeof(DELETE_MESSAGE);
+    Irp->IoStatus.Information = 0;
+    if (outputBuffer && outputBufferLength >= DELETE_MESSAGE_HEADER_SIZE) {
+        SetEventStringsReader(&Strings, irpSp->FileObject);
+
+        // Messages are copied straight out of the ring; one that does not fit stays queued
+        PEX_RUNDOWN_REF_CACHE_AWARE users = EnterQueueSection();
+        status = Dequeue(ReadPointerAcquire((PVOID*)&MessageQueue), outputBuffer, outputBufferLength, &length);
+        ExReleaseRundownProtectionCacheAware(users);
+        if (NT_SUCCESS(status)) {
+            Irp->IoStatus.Information = length;
         }
-        else {
-            status = STATUS_NO_MORE_ENTRIES;
-            Irp->IoStatus.Information = 0;
+        else if (status == STATUS_BUFFER_TOO_SMALL) {
+            DEBUG("driverFlt: Buffer too small for IOCTL_GET_DELETE_MESSAGE, provided: %lu, required: %lu\n",
+                outputBufferLength, length);
         }
     }
     else {
         status = STATUS_BUFFER_TOO_SMALL;
         DEBUG("driverFlt: Buffer too small for IOCTL_GET_DELETE_MESSAGE, provided: %lu, required: %lu\n",
-            outputBufferLength, sizeof(DELETE_MESSAGE));
+            outputBufferLength, (ULONG)DELETE_MESSAGE_HEADER_SIZE);
+    }
+
+    return status;
+}
+
+static NTSTATUS
+IoctlGetDelMsgs(_In_ PIRP Irp, PIO_STACK_LOCATION irpSp)
+{
+    PDELETE_MESSAGE_BATCH batch = (PDELETE_MESSAGE_BATCH)Irp->AssociatedIrp.SystemBuffer;
+    ULONG outputBufferLength = irpSp->Parameters.DeviceIoControl.OutputBufferLength;
+    PEX_RUNDOWN_REF_CACHE_AWARE users;
+    NTSTATUS status;
+    ULONG count = 0;
+    ULONG length = 0;
+
+    Irp->IoStatus.Information = 0;
+    if (!batch || outputBufferLength < FIELD_OFFSET(DELETE_MESSAGE_BATCH, Messages) + DELETE_MESSAGE_HEADER_SIZE) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    SetEventStringsReader(&Strings, irpSp->FileObject);
+
+    // Read before draining, so every id below it is either in this batch, still queued or dropped
+    users = EnterQueueSection();
+    PCIRCULAR_QUEUE queue = ReadPointerAcquire((PVOID*)&MessageQueue);
+    ULONG nextMessageId = DeleteMessageIdAt(ReadAcquire64(&queue->Tail));
+    status = DequeueBatch(queue, batch->Messages,
+        outputBufferLength - FIELD_OFFSET(DELETE_MESSAGE_BATCH, Messages), &count, &length);
+    ExReleaseRundownProtectionCacheAware(users);
+    if (NT_SUCCESS(status)) {
+        batch->Count = count;
+        batch->NextMessageId = nextMessageId;
+        Irp->IoStatus.Information = FIELD_OFFSET(DELETE_MESSAGE_BATCH, Messages) + length;
+    }
+    else if (status == STATUS_BUFFER_TOO_SMALL) {
+        DEBUG("driverFlt: Buffer too small for IOCTL_GET_DELETE_MESSAGES, provided: %lu, required: %lu\n",
+            outputBufferLength, (ULONG)FIELD_OFFSET(DELETE_MESSAGE_BATCH, Messages) + length);
+    }
+
+    return status;
+}
+
+// Bytes queued for the consumer, in the driver's queue and in a mapped ring. Must be called inside a queue section.
+static ULONG
+PendingBytes()
+{
+    PCIRCULAR_QUEUE sharedQueue = ReadPointerAcquire((PVOID*)&SharedQueue);
+    ULONG used = QueueUsedBytes(ReadPointerAcquire((PVOID*)&MessageQueue));
+
+    if (sharedQueue) {
+        used += QueueUsedBytes(sharedQueue);
+    }
+    return used;
+}
+
+// Must be called with QueueLock held
+static VOID
+UnsubscribeLocked()
+{
+    PCIRCULAR_QUEUE queue = SharedQueue;
+    KAPC_STATE apcState;
+
+    // New events go back to the driver's queue; wait for the producers still writing to the ring
+    WritePointerRelease((PVOID*)&SharedQueue, NULL);
+    SynchronizeQueueUsersLocked();
+
+    // The mapping belongs to the subscriber's address space, which need not be the current one
+    KeStackAttachProcess(SubscriberProcess, &apcState);
+    UnmapQueue(queue, &SubscriberMapping);
+    KeUnstackDetachProcess(&apcState);
+    ObDereferenceObject(SubscriberProcess);
+
+    InterlockedAdd64(&UnmappedDropped, queue->Dropped);
+    DetachEventStrings(&Strings, queue);
+    CleanupQueue(queue);
+    ExFreePoolWithTag(queue, 'sQtL');
+    SubscriberFile = NULL;
+    SubscriberProcess = NULL;
+    WritePointerNoFence((PVOID*)&SubscriberProcessId, NULL);
+    RtlZeroMemory(&SubscriberMapping, sizeof(SubscriberMapping));
+    LOG("driverFlt: Event ring unmapped\n");
+}
+
+// Must be called with QueueLock held, in the context of the subscribing process
+static NTSTATUS
+SubscribeLocked(PFILE_OBJECT FileObject, PEVENT_RING_MAPPING Mapping)
+{
+    PCIRCULAR_QUEUE queue;
+    NTSTATUS status;
+
+    if (SubscriberFile) {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    // Locked pages still mapped into an exiting process bring the system down; the handle can outlive the process
+    // through a duplicate, so only the exit notification is sure to unmap in time
+    if (!ExitNotifyRegistered) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    queue = ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED, sizeof(CIRCULAR_QUEUE), 'sQtL');
+    if (!queue) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    status = InitializeSharedQueue(queue, QueueSize);
+    if (!NT_SUCCESS(status)) {
+        ExFreePoolWithTag(queue, 'sQtL');
+        return status;
+    }
+
+    status = MapQueue(queue, &SubscriberMapping);
+    if (!NT_SUCCESS(status)) {
+        CleanupQueue(queue);
+        ExFreePoolWithTag(queue, 'sQtL');
+        return status;
+    }
+
+    SubscriberFile = FileObject;
+    SubscriberProcess = PsGetCurrentProcess();
+    ObReferenceObject(SubscriberProcess);
+    WritePointerNoFence((PVOID*)&SubscriberProcessId, PsGetCurrentProcessId());
+    WritePointerRelease((PVOID*)&SharedQueue, queue);
+
+    Mapping->Header = (ULONG64)(ULONG_PTR)SubscriberMapping.Header;
+    Mapping->Data = (ULONG64)(ULONG_PTR)SubscriberMapping.Data;
+    Mapping->Capacity = queue->Capacity;
+    LOG("driverFlt: Event ring mapped, %lu bytes\n", queue->Capacity);
+    return STATUS_SUCCESS;
+}
+
+// Unmaps the ring before its process goes away, whoever still holds a handle to the subscription. Runs at
+// PASSIVE_LEVEL in the context of the exiting process, while its address space is still there.
+static VOID
+SubscriberExitRoutine(
+    _In_ HANDLE ParentId,
+    _In_ HANDLE ProcessId,
+    _In_ BOOLEAN Create
+)
+{
+    UNREFERENCED_PARAMETER(ParentId);
+    if (Create || ReadPointerNoFence((PVOID*)&SubscriberProcessId) != ProcessId) {
+        return;
+    }
+
+    ExAcquireFastMutex(&QueueLock);
+    if (SubscriberProcess && PsGetProcessId(SubscriberProcess) == ProcessId) {
+        UnsubscribeLocked();
+    }
+    ExReleaseFastMutex(&QueueLock);
+}
+
+static NTSTATUS
+IoctlMapRing(_In_ PIRP Irp, PIO_STACK_LOCATION irpSp)
+{
+    PEVENT_RING_MAPPING mapping = (PEVENT_RING_MAPPING)Irp->AssociatedIrp.SystemBuffer;
+    ULONG outputBufferLength = irpSp->Parameters.DeviceIoControl.OutputBufferLength;
+    NTSTATUS status;
+
+    Irp->IoStatus.Information = 0;
+    if (!mapping || outputBufferLength < sizeof(EVENT_RING_MAPPING)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    // Device IOCTLs run in the caller's context, so the ring is mapped into the caller's process
+    ExAcquireFastMutex(&QueueLock);
+    status = SubscribeLocked(irpSp->FileObject, mapping);
+    ExReleaseFastMutex(&QueueLock);
+
+    if (NT_SUCCESS(status)) {
+        SetEventStringsReader(&Strings, irpSp->FileObject);
+        Irp->IoStatus.Information = sizeof(EVENT_RING_MAPPING);
+    }
+    return status;
+}
+
+// Allocates the driver's queue; returns NULL if the pool cannot hold Size bytes
+static PCIRCULAR_QUEUE
+AllocateMessageQueue(ULONG Size, QUEUE_OVERFLOW_POLICY Policy)
+{
+    PCIRCULAR_QUEUE queue = ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED, sizeof(CIRCULAR_QUEUE), 'mQtL');
+
+    if (!queue) {
+        return NULL;
+    }
+    if (!NT_SUCCESS(InitializeQueue(queue, Size))) {
+        ExFreePoolWithTag(queue, 'mQtL');
+        return NULL;
+    }
+    SetQueuePolicy(queue, Policy);
+    return queue;
+}
+
+static VOID
+FreeMessageQueue(PCIRCULAR_QUEUE Queue)
+{
+    CleanupQueue(Queue);
+    ExFreePoolWithTag(Queue, 'mQtL');
+}
+
+// Must be called with QueueLock held
+static NTSTATUS
+ResizeQueueLocked(ULONG Size, QUEUE_OVERFLOW_POLICY Policy)
+{
+    PCIRCULAR_QUEUE oldQueue = MessageQueue;
+    PCIRCULAR_QUEUE newQueue = AllocateMessageQueue(Size, Policy);
+
+    if (!newQueue) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // Move the backlog before publishing, so events arriving meanwhile queue up behind it; the few
+    // published to the old queue after the first move may then arrive out of order
+    MoveQueue(newQueue, oldQueue);
+    WritePointerRelease((PVOID*)&MessageQueue, newQueue);
+    SynchronizeQueueUsersLocked();
+    MoveQueue(newQueue, oldQueue);
+
+    DetachEventStrings(&Strings, oldQueue);
+    FreeMessageQueue(oldQueue);
+    QueueSize = newQueue->Capacity;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+IoctlSetQueueConfig(_In_ PIRP Irp, PIO_STACK_LOCATION irpSp)
+{
+    PMESSAGE_QUEUE_CONFIG config = (PMESSAGE_QUEUE_CONFIG)Irp->AssociatedIrp.SystemBuffer;
+    ULONG inputBufferLength = irpSp->Parameters.DeviceIoControl.InputBufferLength;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    Irp->IoStatus.Information = 0;
+    if (!config || inputBufferLength < sizeof(MESSAGE_QUEUE_CONFIG) || config->Policy >= QueueOverflowPolicyCount
+        || (config->Size != 0 && (config->Size < MESSAGE_QUEUE_MIN_SIZE || config->Size > MESSAGE_QUEUE_MAX_SIZE))) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ExAcquireFastMutex(&QueueLock);
+    if (config->Size != 0 && config->Size != QueueSize) {
+        status = ResizeQueueLocked(config->Size, (QUEUE_OVERFLOW_POLICY)config->Policy);
+    }
+    else {
+        SetQueuePolicy(MessageQueue, (QUEUE_OVERFLOW_POLICY)config->Policy);
+    }
+    ExReleaseFastMutex(&QueueLock);
+
+    if (NT_SUCCESS(status)) {
+        LOG("driverFlt: Message queue set to %lu bytes, overflow policy %lu\n", QueueSize, config->Policy);
+    }
+    else {
+        LOG("driverFlt: Failed to resize the message queue to %lu bytes, status: 0x%08x\n", config->Size, status);
+    }
+    return status;
+}
+
+// Fills the records of the message queue, the mapped ring and the intern table; the queues count the bytes of the
+// records waiting for the consumer as used
+static VOID
+QueryQueueMemory(PMEMORY_STATS Stats)
+{
+    PEX_RUNDOWN_REF_CACHE_AWARE users = EnterQueueSection();
+    PCIRCULAR_QUEUE messageQueue = ReadPointerAcquire((PVOID*)&MessageQueue);
+    PCIRCULAR_QUEUE sharedQueue = ReadPointerAcquire((PVOID*)&SharedQueue);
+    Stats->MessageQueue.Tag = 'cQ';
+    Stats->MessageQueue.Count = 1;
+    Stats->MessageQueue.Bytes = messageQueue->Capacity;
+    Stats->MessageQueue.UsedBytes = QueueUsedBytes(messageQueue);
+    if (sharedQueue) {
+        Stats->MappedRing.Tag = 'cQ';
+        Stats->MappedRing.Count = 1;
+        Stats->MappedRing.Bytes = QUEUE_SHARED_HEADER_SIZE + sharedQueue->Capacity;
+        Stats->MappedRing.UsedBytes = sizeof(QUEUE_SHARED_HEADER) + QueueUsedBytes(sharedQueue);
+    }
+    ExReleaseRundownProtectionCacheAware(users);
+
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&Strings.Table.Lock, &oldIrql);
+    Stats->InternTable.Tag = 'iTtL';
+    Stats->InternTable.Count = Strings.Table.Count;
+    Stats->InternTable.Bytes = INTERN_TABLE_ARENA_ALLOCATION;
+    Stats->InternTable.UsedBytes = Strings.Table.ArenaUsed;
+    KeReleaseSpinLock(&Strings.Table.Lock, oldIrql);
+}
+
+static NTSTATUS
+IoctlGetMemoryStats(_In_ PIRP Irp, PIO_STACK_LOCATION irpSp)
+{
+    PMEMORY_STATS stats = (PMEMORY_STATS)Irp->AssociatedIrp.SystemBuffer;
+    ULONG outputBufferLength = irpSp->Parameters.DeviceIoControl.OutputBufferLength;
+
+    if (!stats || outputBufferLength < sizeof(MEMORY_STATS)) {
         Irp->IoStatus.Information = 0;
+        return STATUS_BUFFER_TOO_SMALL;
     }
 
+    RtlZeroMemory(stats, sizeof(MEMORY_STATS));
+    GetTrackedFilesMemory(&TrackedFiles, &stats->Rules);
+    QueryQueueMemory(stats);
+    QueryProcessCacheUsage(&stats->ProcessCache);
+    Irp->IoStatus.Information = sizeof(MEMORY_STATS);
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+IoctlGetStats(_In_ PIRP Irp, PIO_STACK_LOCATION irpSp)
+{
+    PPERF_STATS stats = (PPERF_STATS)Irp->AssociatedIrp.SystemBuffer;
+    ULONG outputBufferLength = irpSp->Parameters.DeviceIoControl.OutputBufferLength;
+
+    if (!stats || outputBufferLength < sizeof(PERF_STATS)) {
+        Irp->IoStatus.Information = 0;
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    QueryPerfStats(stats);
+    Irp->IoStatus.Information = sizeof(PERF_STATS);
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+IoctlGetQueueStats(_In_ PIRP Irp, PIO_STACK_LOCATION irpSp)
+{
+    PMESSAGE_QUEUE_STATS stats = (PMESSAGE_QUEUE_STATS)Irp->AssociatedIrp.SystemBuffer;
+    ULONG outputBufferLength = irpSp->Parameters.DeviceIoControl.OutputBufferLength;
+    PEX_RUNDOWN_REF_CACHE_AWARE users;
+
+    if (!stats || outputBufferLength < sizeof(MESSAGE_QUEUE_STATS)) {
+        Irp->IoStatus.Information = 0;
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    users = EnterQueueSection();
+    PCIRCULAR_QUEUE messageQueue = ReadPointerAcquire((PVOID*)&MessageQueue);
+    PCIRCULAR_QUEUE sharedQueue = ReadPointerAcquire((PVOID*)&SharedQueue);
+    stats->Size = messageQueue->Capacity;
+    stats->Policy = (ULONG)ReadNoFence(&messageQueue->Policy);
+    stats->Dropped = (ULONG64)(ReadNoFence64(&messageQueue->Dropped) + ReadNoFence64(&UnmappedDropped));
+    stats->UsedBytes = PendingBytes();
+    stats->MappedSize = 0;
+    if (sharedQueue) {
+        stats->Dropped += (ULONG64)ReadNoFence64(&sharedQueue->Dropped);
+        stats->MappedSize = sharedQueue->Capacity;
+    }
+    ExReleaseRundownProtectionCacheAware(users);
+
+    Irp->IoStatus.Information = sizeof(MESSAGE_QUEUE_STATS);
+    return STATUS_SUCCESS;
+}
+
+static VOID
+WaitCsqInsertIrp(_In_ PIO_CSQ Csq, _In_ PIRP Irp)
+{
+    UNREFERENCED_PARAMETER(Csq);
+    InsertTailList(&WaitList, &Irp->Tail.Overlay.ListEntry);
+    InterlockedIncrement(&Waiters);
+}
+
+static VOID
+WaitCsqRemoveIrp(_In_ PIO_CSQ Csq, _In_ PIRP Irp)
+{
+    UNREFERENCED_PARAMETER(Csq);
+    RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+    InterlockedDecrement(&Waiters);
+}
+
+// With a file object as the peek context, only the requests sent through it are returned
+static PIRP
+WaitCsqPeekNextIrp(_In_ PIO_CSQ Csq, _In_opt_ PIRP Irp, _In_opt_ PVOID PeekContext)
+{
+    PLIST_ENTRY next = Irp ? Irp->Tail.Overlay.ListEntry.Flink : WaitList.Flink;
+
+    UNREFERENCED_PARAMETER(Csq);
+    for (; next != &WaitList; next = next->Flink) {
+        PIRP nextIrp = CONTAINING_RECORD(next, IRP, Tail.Overlay.ListEntry);
+        if (!PeekContext || IoGetCurrentIrpStackLocation(nextIrp)->FileObject == PeekContext) {
+            return nextIrp;
+        }
+    }
+    return NULL;
+}
+
+_IRQL_raises_(DISPATCH_LEVEL)
+_Acquires_lock_(WaitLock)
+static VOID
+WaitCsqAcquireLock(_In_ PIO_CSQ Csq, _Out_ PKIRQL Irql)
+{
+    UNREFERENCED_PARAMETER(Csq);
+    KeAcquireSpinLock(&WaitLock, Irql);
+}
+
+_IRQL_requires_(DISPATCH_LEVEL)
+_Releases_lock_(WaitLock)
+static VOID
+WaitCsqReleaseLock(_In_ PIO_CSQ Csq, _In_ KIRQL Irql)
+{
+    UNREFERENCED_PARAMETER(Csq);
+    KeReleaseSpinLock(&WaitLock, Irql);
+}
+
+static VOID
+WaitCsqCompleteCanceledIrp(_In_ PIO_CSQ Csq, _In_ PIRP Irp)
+{
+    UNREFERENCED_PARAMETER(Csq);
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    Irp->IoStatus.Information = 0;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+// Drains the kernel queue into a wait request; with a subscriber, completes it empty once the mapped ring has a record
+static NTSTATUS
+CompleteWait(_In_ PIRP Irp, PIO_STACK_LOCATION irpSp)
+{
+    NTSTATUS status = IoctlGetDelMsgs(Irp, irpSp);
+
+    if (status == STATUS_NO_MORE_ENTRIES) {
+        PEX_RUNDOWN_REF_CACHE_AWARE users = EnterQueueSection();
+        PCIRCULAR_QUEUE queue = ReadPointerAcquire((PVOID*)&SharedQueue);
+        if (queue && QueueHasRecord(queue)) {
+            // IoctlGetDelMsgs has checked the buffer has room for the header
+            PDELETE_MESSAGE_BATCH batch = (PDELETE_MESSAGE_BATCH)Irp->AssociatedIrp.SystemBuffer;
+            batch->Count = 0;
+            batch->NextMessageId = DeleteMessageIdAt(ReadAcquire64(&queue->Tail));
+            Irp->IoStatus.Information = FIELD_OFFSET(DELETE_MESSAGE_BATCH, Messages);
+            status = STATUS_SUCCESS;
+        }
+        ExReleaseRundownProtectionCacheAware(users);
+    }
     return status;
 }
 
+// Completes parked requests with whatever is queued; runs when the threshold is reached or the timer fires
+static VOID
+NotifyDpcRoutine(
+    _In_ PKDPC Dpc,
+    _In_opt_ PVOID DeferredContext,
+    _In_opt_ PVOID SystemArgument1,
+    _In_opt_ PVOID SystemArgument2
+)
+{
+    PIRP irp;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(DeferredContext);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    KeCancelTimer(&NotifyTimer);
+    InterlockedExchange(&TimerArmed, 0);
+
+    // Counted as a waiter while draining, so a message published meanwhile queues the DPC again
+    InterlockedIncrement(&Waiters);
+    while ((irp = IoCsqRemoveNextIrp(&WaitQueue, NULL)) != NULL) {
+        NTSTATUS status = CompleteWait(irp, IoGetCurrentIrpStackLocation(irp));
+        if (status == STATUS_NO_MORE_ENTRIES) {
+            // Another reader got there first, or the message is not published yet
+            IoCsqInsertIrp(&WaitQueue, irp, NULL);
+            break;
+        }
+        irp->IoStatus.Status = status;
+        IoCompleteRequest(irp, IO_NO_INCREMENT);
+    }
+    InterlockedDecrement(&Waiters);
+}
+
+// Wakes the parked requests now if the batch threshold is reached, otherwise once the latency timer fires.
+// Must be called inside a queue section.
+static VOID
+NotifyWaiters()
+{
+    ULONG used = PendingBytes();
+    LONG latencyMs = ReadNoFence(&WaitLatencyMs);
+
+    if (used == 0) {
+        return;
+    }
+
+    if (latencyMs == 0 || used >= (ULONG)ReadNoFence(&WaitMinBytes)) {
+        KeInsertQueueDpc(&NotifyDpc, NULL, NULL);
+    }
+    else if (!InterlockedExchange(&TimerArmed, 1)) {
+        LARGE_INTEGER dueTime;
+        dueTime.QuadPart = -10000LL * latencyMs;  // Relative, in 100ns units
+        KeSetTimer(&NotifyTimer, dueTime, &NotifyDpc);
+    }
+}
+
+static NTSTATUS
+IoctlWaitDelMsgs(_In_ PIRP Irp, PIO_STACK_LOCATION irpSp)
+{
+    PDELETE_MESSAGE_WAIT wait = (PDELETE_MESSAGE_WAIT)Irp->AssociatedIrp.SystemBuffer;
+    ULONG inputBufferLength = irpSp->Parameters.DeviceIoControl.InputBufferLength;
+    ULONG outputBufferLength = irpSp->Parameters.DeviceIoControl.OutputBufferLength;
+    ULONG minBytes = 1;
+    ULONG latencyMs = 0;
+    PEX_RUNDOWN_REF_CACHE_AWARE users;
+    BOOLEAN due;
+
+    Irp->IoStatus.Information = 0;
+    if (inputBufferLength != 0 && inputBufferLength != sizeof(DELETE_MESSAGE_WAIT)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    if (!wait || outputBufferLength < FIELD_OFFSET(DELETE_MESSAGE_BATCH, Messages) + DELETE_MESSAGE_HEADER_SIZE) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    // The input shares the system buffer with the output, so read it before anything is drained into it
+    if (inputBufferLength) {
+        minBytes = max(wait->MinBytes, 1);
+        latencyMs = wait->MaxLatencyMs;
+    }
+    SetEventStringsReader(&Strings, irpSp->FileObject);
+
+    // The parameters apply to every parked request; there is normally a single consumer
+    InterlockedExchange(&WaitMinBytes, (LONG)min(minBytes, (ULONG)MAXLONG));
+    InterlockedExchange(&WaitLatencyMs, (LONG)min(latencyMs, (ULONG)MAXLONG / 10000));
+
+    users = EnterQueueSection();
+    due = latencyMs == 0 || PendingBytes() >= minBytes;
+    ExReleaseRundownProtectionCacheAware(users);
+    if (due) {
+        NTSTATUS status = CompleteWait(Irp, irpSp);
+        if (status != STATUS_NO_MORE_ENTRIES) {
+            return status;
+        }
+    }
+
+    IoCsqInsertIrp(&WaitQueue, Irp, NULL);
+
+    // Messages published before the request was parked did not wake anyone
+    users = EnterQueueSection();
+    NotifyWaiters();
+    ExReleaseRundownProtectionCacheAware(users);
+    return STATUS_PENDING;
+}
+
 // IOCTL handler
 NTSTATUS 
 IoctlControl(
@@ -139,17 +1004,53 @@ IoctlControl(
     case IOCTL_REMOVE_TRACKED_FILE:
         status = IoctlRemoveFile(Irp, irpSp);
         break;
+    case IOCTL_UPDATE_TRACKED_FILES:
+        status = IoctlUpdateFiles(Irp, irpSp);
+        break;
     case IOCTL_GET_DELETE_MESSAGE:
         status = IoctlGetDelMsg(Irp, irpSp);
         break;
+    case IOCTL_GET_DELETE_MESSAGES:
+        status = IoctlGetDelMsgs(Irp, irpSp);
+        break;
+    case IOCTL_WAIT_DELETE_MESSAGES:
+        status = IoctlWaitDelMsgs(Irp, irpSp);
+        break;
+    case IOCTL_MAP_EVENT_RING:
+        status = IoctlMapRing(Irp, irpSp);
+        break;
+    case IOCTL_SET_QUEUE_CONFIG:
+        status = IoctlSetQueueConfig(Irp, irpSp);
+        break;
+    case IOCTL_GET_QUEUE_STATS:
+        status = IoctlGetQueueStats(Irp, irpSp);
+        break;
+    case IOCTL_SET_PATTERN_RULES:
+        status = IoctlSetPatterns(Irp, irpSp);
+        break;
+    case IOCTL_GET_CACHE_STATS:
+        status = IoctlGetCacheStats(Irp, irpSp);
+        break;
+    case IOCTL_GET_FILTER_STATS:
+        status = IoctlGetFilterStats(Irp, irpSp);
+        break;
+    case IOCTL_GET_MEMORY_STATS:
+        status = IoctlGetMemoryStats(Irp, irpSp);
+        break;
+    case IOCTL_GET_STATS:
+        status = IoctlGetStats(Irp, irpSp);
+        break;
     default:
         status = STATUS_INVALID_DEVICE_REQUEST;
         DEBUG("driverFlt: Unknown IOCTL code\n");
         break;
     }
 
-    Irp->IoStatus.Status = status;
-    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    // A parked wait is completed later by NotifyDpcRoutine or by cancellation
+    if (status != STATUS_PENDING) {
+        Irp->IoStatus.Status = status;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
     return status;
 }
 
@@ -169,72 +1070,223 @@ IoctlCreateDispatch(
     return STATUS_SUCCESS;
 }
 
-NTSTATUS 
-IoctlInit() 
+// Handle IRP_MJ_CLEANUP: the last handle to a file object is closed, in the closing process
+NTSTATUS
+IoctlCleanupDispatch(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp
+)
 {
-    // Initialize delete event
-    return InitializeQueue(&MessageQueue, sizeof(DELETE_MESSAGE), MAX_MESSAGES);
-}
+    PIO_STACK_LOCATION irpSp = IoGetCurrentIrpStackLocation(Irp);
+    PIRP waitIrp;
 
-static NTSTATUS 
-SafeCopyUnicodeString(PWCHAR dest, size_t destSize, PUNICODE_STRING src) {
-    if (!dest || !src || !src->Buffer) {
-        return STATUS_INVALID_PARAMETER;
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    // Requests still parked through this handle go with it
+    while ((waitIrp = IoCsqRemoveNextIrp(&WaitQueue, irpSp->FileObject)) != NULL) {
+        waitIrp->IoStatus.Status = STATUS_CANCELLED;
+        waitIrp->IoStatus.Information = 0;
+        IoCompleteRequest(waitIrp, IO_NO_INCREMENT);
     }
 
-    // Ensure the destination buffer is large enough to hold at least one character and a null terminator
-    if (destSize < sizeof(WCHAR)) {
-        return STATUS_BUFFER_TOO_SMALL;
+    ExAcquireFastMutex(&QueueLock);
+    if (SubscriberFile == irpSp->FileObject) {
+        UnsubscribeLocked();
     }
+    ExReleaseFastMutex(&QueueLock);
 
-    // Copy the string, ensuring null-termination
-    size_t bytesToCopy = min(src->Length, destSize - sizeof(WCHAR));
-    RtlCopyMemory(dest, src->Buffer, bytesToCopy);
-    dest[bytesToCopy / sizeof(WCHAR)] = L'\0'; // Null-terminate the string
+    // Whoever reads next lacks the definitions this reader was sent
+    ReleaseEventStringsReader(&Strings, irpSp->FileObject);
 
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = 0;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
     return STATUS_SUCCESS;
 }
 
-NTSTATUS 
-SendToUser(PUNICODE_STRING processName, PUNICODE_STRING name, PUNICODE_STRING timeString) {
-    NTSTATUS status = STATUS_SUCCESS;
-    DELETE_MESSAGE message = { 0 }; // Initialize the message structure to zero
+// Reads QueueSize and OverflowPolicy from the service's Parameters key; missing or invalid values keep the defaults
+static VOID
+ReadQueueParameters(PUNICODE_STRING RegistryPath, PULONG Size, PQUEUE_OVERFLOW_POLICY Policy)
+{
+    RTL_QUERY_REGISTRY_TABLE query[4];
+    UNICODE_STRING path;
+    ULONG size = MESSAGE_QUEUE_SIZE;
+    ULONG policy = QueueDropOldest;
+    NTSTATUS status;
 
-    // Validate input parameters
-    if (!processName || !name || !timeString) {
-        return STATUS_INVALID_PARAMETER;
+    *Size = MESSAGE_QUEUE_SIZE;
+    *Policy = QueueDropOldest;
+
+    // RtlQueryRegistryValues takes a null-terminated path, which RegistryPath need not be
+    path.Length = 0;
+    path.MaximumLength = RegistryPath->Length + sizeof(WCHAR);
+    path.Buffer = ExAllocatePool2(POOL_FLAG_PAGED, path.MaximumLength, 'rQtL');
+    if (!path.Buffer) {
+        return;
     }
+    RtlCopyUnicodeString(&path, RegistryPath);
+
+    RtlZeroMemory(query, sizeof(query));
+    query[0].Flags = RTL_QUERY_REGISTRY_SUBKEY;
+    query[0].Name = L"Parameters";
+    query[1].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+    query[1].Name = L"QueueSize";
+    query[1].EntryContext = &size;
+    query[1].DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
+    query[2].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+    query[2].Name = L"OverflowPolicy";
+    query[2].EntryContext = &policy;
+    query[2].DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
 
-    // Copy process name
-    status = SafeCopyUnicodeString(message.ProcessName, sizeof(message.ProcessName), processName);
+    status = RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE, path.Buffer, query, NULL, NULL);
+    ExFreePoolWithTag(path.Buffer, 'rQtL');
+    if (!NT_SUCCESS(status)) {
+        DEBUG("driverFlt: No queue parameters in the registry, status: 0x%08x\n", status);
+        return;
+    }
+
+    if (size >= MESSAGE_QUEUE_MIN_SIZE && size <= MESSAGE_QUEUE_MAX_SIZE) {
+        *Size = size;
+    } else {
+        LOG("driverFlt: Ignoring QueueSize %lu, outside %lu to %lu bytes\n", size, MESSAGE_QUEUE_MIN_SIZE, MESSAGE_QUEUE_MAX_SIZE);
+    }
+    if (policy < QueueOverflowPolicyCount) {
+        *Policy = (QUEUE_OVERFLOW_POLICY)policy;
+    } else {
+        LOG("driverFlt: Ignoring unknown OverflowPolicy %lu\n", policy);
+    }
+}
+
+NTSTATUS 
+IoctlInit(_In_ PUNICODE_STRING RegistryPath) 
+{
+    NTSTATUS status;
+    ULONG size;
+    QUEUE_OVERFLOW_POLICY policy;
+
+    // IoctlClear takes the lock even after a failed initialization
+    ExInitializeFastMutex(&QueueLock);
+
+    // Initialize the wait queue before any request can be parked on it
+    InitializeListHead(&WaitList);
+    KeInitializeSpinLock(&WaitLock);
+    KeInitializeDpc(&NotifyDpc, NotifyDpcRoutine, NULL);
+    KeInitializeTimer(&NotifyTimer);
+    status = IoCsqInitialize(&WaitQueue, WaitCsqInsertIrp, WaitCsqRemoveIrp, WaitCsqPeekNextIrp,
+        WaitCsqAcquireLock, WaitCsqReleaseLock, WaitCsqCompleteCanceledIrp);
     if (!NT_SUCCESS(status)) {
-        DbgPrint("Failed to copy process name: 0x%X\n", status);
         return status;
     }
 
-    // Copy file path
-    status = SafeCopyUnicodeString(message.FilePath, sizeof(message.FilePath), name);
+    for (ULONG i = 0; i < ARRAYSIZE(QueueUsers); i++) {
+        QueueUsers[i] = ExAllocateCacheAwareRundownProtection(NonPagedPoolNx, 'uQtL');
+        if (!QueueUsers[i]) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    status = InitializeEventStrings(&Strings);
     if (!NT_SUCCESS(status)) {
-        DbgPrint("Failed to copy file path: 0x%X\n", status);
         return status;
     }
 
-    // Copy timestamp
-    status = SafeCopyUnicodeString(message.DateTime, sizeof(message.DateTime), timeString);
+    // A size the pool cannot satisfy falls back to the default rather than failing the load
+    ReadQueueParameters(RegistryPath, &size, &policy);
+    MessageQueue = AllocateMessageQueue(size, policy);
+    if (!MessageQueue && size != MESSAGE_QUEUE_SIZE) {
+        LOG("driverFlt: Failed to allocate a message queue of %lu bytes, using %lu\n", size, MESSAGE_QUEUE_SIZE);
+        MessageQueue = AllocateMessageQueue(MESSAGE_QUEUE_SIZE, policy);
+    }
+    if (!MessageQueue) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    QueueSize = MessageQueue->Capacity;
+
+    // Without it the driver still queues messages, it just cannot map the ring into a process
+    status = PsSetCreateProcessNotifyRoutine(SubscriberExitRoutine, FALSE);
+    ExitNotifyRegistered = NT_SUCCESS(status);
+    if (!ExitNotifyRegistered) {
+        LOG("driverFlt: Process exit notification unavailable, event ring disabled, 0x%08x\n", status);
+    }
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS 
+SendToUser(PUNICODE_STRING processName, HANDLE processId, LONG64 processCreateTime, PUNICODE_STRING name, LONG operation,
+    BOOLEAN denied) {
+    PEX_RUNDOWN_REF_CACHE_AWARE users;
+    NTSTATUS status;
+
+    // Validate input parameters
+    if (!processName || !name) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Events go to the subscriber's mapped ring while there is one
+    users = EnterQueueSection();
+    PCIRCULAR_QUEUE queue = ReadPointerAcquire((PVOID*)&SharedQueue);
+    if (!queue) {
+        queue = ReadPointerAcquire((PVOID*)&MessageQueue);
+    }
+
+    status = QueueDeleteMessage(&Strings, queue, processName, processId, processCreateTime, name, operation, denied);
     if (!NT_SUCCESS(status)) {
-        DbgPrint("Failed to copy timestamp: 0x%X\n", status);
+        // Counted by the queue and reported to the consumer by a gap marker
+        ExReleaseRundownProtectionCacheAware(users);
+        PerfCount(PERF_COUNTER_DROPPED);
+        DEBUG("Dropped a message for a path of %hu bytes\n", name->Length);
         return status;
     }
+    PerfCount(PERF_COUNTER_ENQUEUED);
 
-    // Enqueue the message
-    Enqueue(&MessageQueue, (PUCHAR)&message);
+    // Pairs with the interlocked increment that parks a request: either this sees the waiter or it sees the message
+    KeMemoryBarrier();
+    if (ReadNoFence(&Waiters)) {
+        NotifyWaiters();
+    }
+
+    ExReleaseRundownProtectionCacheAware(users);
 
     return STATUS_SUCCESS;
 }
 
 NTSTATUS
 IoctlClear() {
+    PIRP irp;
+
+    // Nothing may wake up and read the queue once it is freed
+    KeCancelTimer(&NotifyTimer);
+    KeFlushQueuedDpcs();
+    while ((irp = IoCsqRemoveNextIrp(&WaitQueue, NULL)) != NULL) {
+        irp->IoStatus.Status = STATUS_CANCELLED;
+        irp->IoStatus.Information = 0;
+        IoCompleteRequest(irp, IO_NO_INCREMENT);
+    }
+
+    // Removal waits for notifications already running, which may be unsubscribing
+    if (ExitNotifyRegistered) {
+        PsSetCreateProcessNotifyRoutine(SubscriberExitRoutine, TRUE);
+        ExitNotifyRegistered = FALSE;
+    }
 
-    CleanupQueue(&MessageQueue);
+    // Unload waits for every handle to be closed, so a subscriber is normally gone by now
+    ExAcquireFastMutex(&QueueLock);
+    if (SubscriberFile) {
+        UnsubscribeLocked();
+    }
+    ExReleaseFastMutex(&QueueLock);
+
+    for (ULONG i = 0; i < ARRAYSIZE(QueueUsers); i++) {
+        if (QueueUsers[i]) {
+            ExFreeCacheAwareRundownProtection(QueueUsers[i]);
+            QueueUsers[i] = NULL;
+        }
+    }
+
+    if (MessageQueue) {
+        FreeMessageQueue(MessageQueue);
+        MessageQueue = NULL;
+    }
+    CleanupEventStrings(&Strings);
     return STATUS_SUCCESS;
 }
\ No newline at end of file
@@ -8,25 +8,152 @@
  * @brief IOCTL code to add a file to the tracking list.
  *
  * This control code is used by user-mode applications to instruct the driver to start tracking a specified file.
+ * The handle must have been opened for writing, which the device allows SYSTEM and administrators only.
  */
-#define IOCTL_ADD_TRACKED_FILE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_ADD_TRACKED_FILE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_WRITE_ACCESS)
 
 /**
  * @def IOCTL_REMOVE_TRACKED_FILE
  * @brief IOCTL code to remove a file from the tracking list.
  *
- * This control code is used by user-mode applications to stop tracking a specified file.
+ * This control code is used by user-mode applications to stop tracking a specified file. The handle must have been
+ * opened for writing, like that of IOCTL_ADD_TRACKED_FILE.
  */
-#define IOCTL_REMOVE_TRACKED_FILE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_REMOVE_TRACKED_FILE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_WRITE_ACCESS)
 
 /**
  * @def IOCTL_GET_DELETE_MESSAGE
  * @brief IOCTL code to retrieve a deletion message from the queue.
  *
  * This control code is used by user-mode applications to fetch the oldest deletion event from the driver’s circular queue.
+ * Messages are variable-length; a message larger than the output buffer fails with STATUS_BUFFER_TOO_SMALL and stays
+ * queued. A record whose MessageId is 0 is a QUEUE_GAP_MARKER (see sharedQueue.h) counting the messages dropped since
+ * the previous one; all message-draining IOCTLs return them in line with the messages. Other MessageIds follow the
+ * messages' positions in the queue, so they increase but are not consecutive; a queue that replaces another one
+ * numbers its messages afresh, under a new string epoch.
+ *
+ * The message layout is in eventMessage.h. The process name and the directory of the file path are interned: the
+ * first message of a string epoch that carries a string sends it in full along with its id, later ones of the same
+ * epoch send the id alone. A consumer keeps the strings of the newest epoch it has seen and ignores the ids of older
+ * ones. The driver starts a new epoch whenever a definition may not have reached the consumer: when the queue
+ * overwrites messages or is replaced, when the ring is mapped or unmapped, when the table is full, and when messages
+ * are read through another handle than before, so only one consumer may drain the queue at a time.
  */
 #define IOCTL_GET_DELETE_MESSAGE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
+/**
+ * @def IOCTL_SET_PATTERN_RULES
+ * @brief IOCTL code to replace the wildcard ruleset.
+ *
+ * The input buffer is a list of null-terminated patterns ended by an empty string; a pattern ending in ":p"
+ * is protected. The whole list is compiled into one matcher and replaces the previous ruleset; an empty
+ * list removes it. The handle must have been opened for writing, like that of IOCTL_ADD_TRACKED_FILE.
+ */
+#define IOCTL_SET_PATTERN_RULES CTL_CODE(FILE_DEVICE_UNKNOWN, 0x803, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+/**
+ * @def IOCTL_GET_CACHE_STATS
+ * @brief IOCTL code to read the hit and miss counters of the per-handle decision cache.
+ *
+ * The output buffer receives a DECISION_CACHE_STATS structure.
+ */
+#define IOCTL_GET_CACHE_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x804, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/**
+ * @def IOCTL_GET_FILTER_STATS
+ * @brief IOCTL code to read the counters and size of the negative-lookup prefilter.
+ *
+ * The output buffer receives a PATH_FILTER_STATS structure.
+ */
+#define IOCTL_GET_FILTER_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/**
+ * @def IOCTL_GET_DELETE_MESSAGES
+ * @brief IOCTL code to drain as many deletion messages as fit into the output buffer.
+ *
+ * The output buffer receives a DELETE_MESSAGE_BATCH header followed by Count messages in queue order. Each message
+ * starts at a multiple of 8 bytes from the start of the buffer; step from one to the next by its Size rounded up to 8.
+ * Fails with STATUS_NO_MORE_ENTRIES if the queue is empty and with STATUS_BUFFER_TOO_SMALL if not even the oldest
+ * message fits.
+ */
+#define IOCTL_GET_DELETE_MESSAGES CTL_CODE(FILE_DEVICE_UNKNOWN, 0x806, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/**
+ * @def IOCTL_WAIT_DELETE_MESSAGES
+ * @brief IOCTL code to wait for deletion messages and drain them as a batch.
+ *
+ * Completes like IOCTL_GET_DELETE_MESSAGES, but instead of failing on an empty queue the request stays pending
+ * until messages arrive. The optional input buffer is a DELETE_MESSAGE_WAIT structure: the request then completes
+ * once MinBytes of the queue are in use, or MaxLatencyMs after the first message arrived, whichever comes first.
+ * Without it, or with MaxLatencyMs 0, any message completes the request. Pending requests are cancelled when the
+ * calling thread exits.
+ */
+#define IOCTL_WAIT_DELETE_MESSAGES CTL_CODE(FILE_DEVICE_UNKNOWN, 0x807, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/**
+ * @def IOCTL_MAP_EVENT_RING
+ * @brief IOCTL code to subscribe to deletion messages through a ring mapped into the caller's process.
+ *
+ * The output buffer receives an EVENT_RING_MAPPING with the addresses of the ring's writable header page and of its
+ * read-only records, laid out as described in sharedQueue.h. From then on messages are written there instead of to
+ * the driver's queue, and the consumer reads them in place; IOCTL_WAIT_DELETE_MESSAGES completes with an empty batch
+ * once the ring has a message to read. There is one subscriber at a time (STATUS_DEVICE_BUSY otherwise); the ring is
+ * unmapped when its handle is closed or its process exits, whichever comes first. The handle must have been opened
+ * for writing, which the device allows SYSTEM and administrators only.
+ */
+#define IOCTL_MAP_EVENT_RING CTL_CODE(FILE_DEVICE_UNKNOWN, 0x808, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+/**
+ * @def IOCTL_SET_QUEUE_CONFIG
+ * @brief IOCTL code to resize the message queue and choose what it drops when full.
+ *
+ * The input buffer is a MESSAGE_QUEUE_CONFIG structure. A new Size, between MESSAGE_QUEUE_MIN_SIZE and
+ * MESSAGE_QUEUE_MAX_SIZE, replaces the queue with one of that size and carries the queued messages over;
+ * rings mapped afterwards get the same size. The Policy applies to the driver's queue only: a mapped ring
+ * always drops new messages, so its consumer is never overtaken. The queue is nonpaged pool, so the handle
+ * must have been opened for writing, which the device allows SYSTEM and administrators only.
+ */
+#define IOCTL_SET_QUEUE_CONFIG CTL_CODE(FILE_DEVICE_UNKNOWN, 0x809, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+/**
+ * @def IOCTL_GET_QUEUE_STATS
+ * @brief IOCTL code to read the size, overflow policy and drop count of the message queue.
+ *
+ * The output buffer receives a MESSAGE_QUEUE_STATS structure.
+ */
+#define IOCTL_GET_QUEUE_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/**
+ * @def IOCTL_UPDATE_TRACKED_FILES
+ * @brief IOCTL code to add and remove many file names and directory rules at once.
+ *
+ * The input buffer is a RULE_UPDATE_BATCH followed by its RULE_UPDATE records, each one starting at a multiple of
+ * 8 bytes from the batch. The records are applied in order under a single writer section, as the single-rule
+ * IOCTLs would apply them; a malformed batch fails with STATUS_INVALID_PARAMETER before any record is applied.
+ * If there is an output buffer, it receives one NTSTATUS per record. The handle must have been opened for writing,
+ * like that of the single-rule IOCTLs.
+ */
+#define IOCTL_UPDATE_TRACKED_FILES CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80B, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+/**
+ * @def IOCTL_GET_MEMORY_STATS
+ * @brief IOCTL code to read the memory held by each part of the driver.
+ *
+ * The output buffer receives a MEMORY_STATS structure: one MEMORY_USAGE record, with its pool tag, object count
+ * and bytes, per part of the rules, for the message queue and mapped ring, the intern table and the process cache.
+ */
+#define IOCTL_GET_MEMORY_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/**
+ * @def IOCTL_GET_STATS
+ * @brief IOCTL code to read the hot-path counters and latency histograms.
+ *
+ * The output buffer receives a PERF_STATS structure: the PERF_COUNTER_* counters and PERF_HISTOGRAM_* histograms
+ * summed over all processors, and the frequency of the histogram ticks. Nothing is reset; rates are up to the caller.
+ */
+#define IOCTL_GET_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80D, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+
 /**
  * @def DEVICE_NAME
  * @brief Kernel-mode device name for the driver.
@@ -44,21 +171,49 @@
 #define SYMLINK_NAME L"\\DosDevices\\FileTracker"
 
 /**
- * @def MAX_MESSAGES
- * @brief Maximum number of messages in the circular queue.
+ * @def DEVICE_SDDL
+ * @brief Security of the device: SYSTEM and administrators may open it for writing, everyone else for reading.
+ *
+ * IOCTLs declared with FILE_WRITE_ACCESS, which reconfigure the queue or map memory into the caller, are thus
+ * refused to everyone else. The default security of a device would let everyone write.
+ */
+#define DEVICE_SDDL L"D:P(A;;GA;;;SY)(A;;GA;;;BA)(A;;GR;;;WD)"
+
+/**
+ * @def MESSAGE_QUEUE_SIZE
+ * @brief Default size of the circular queue in bytes.
  *
- * Defines the fixed size of the circular queue used to store deletion messages (10 messages).
+ * Deletion messages carry the file name in full and the process name and directory once per string epoch,
+ * so the number of messages the queue holds depends on the paths. Half of it bounds the largest single
+ * message, enough for a full-length process name and path. The QueueSize value of the service's Parameters
+ * key overrides it at load time, IOCTL_SET_QUEUE_CONFIG later on.
  */
-#define MAX_MESSAGES 10
+#define MESSAGE_QUEUE_SIZE (256 * 1024)
+
+/**
+ * @def MESSAGE_QUEUE_MIN_SIZE
+ * @brief Smallest configurable queue size in bytes.
+ */
+#define MESSAGE_QUEUE_MIN_SIZE (64 * 1024)
+
+/**
+ * @def MESSAGE_QUEUE_MAX_SIZE
+ * @brief Largest configurable queue size in bytes, several hundred thousand messages of typical length.
+ *
+ * The queue, and a mapped ring of the same size, are nonpaged memory; a resize briefly holds the old and the new one.
+ */
+#define MESSAGE_QUEUE_MAX_SIZE (64 * 1024 * 1024)
 
 /**
  * @brief Handles IOCTL requests from user-mode applications.
  *
  * Processes control codes such as adding/removing tracked files or retrieving deletion messages.
+ * A request to wait for messages is left pending and completed later by the queue's notification DPC.
  *
  * @param[in] DeviceObject Pointer to the device object associated with the driver.
  * @param[in] Irp Pointer to the I/O Request Packet (IRP) containing the IOCTL request.
- * @return NTSTATUS STATUS_SUCCESS on success, or an appropriate error code (e.g., STATUS_INVALID_DEVICE_REQUEST).
+ * @return NTSTATUS STATUS_SUCCESS on success, STATUS_PENDING for a parked wait, or an appropriate error code
+ *         (e.g., STATUS_INVALID_DEVICE_REQUEST).
  */
 NTSTATUS 
 IoctlControl(
@@ -82,36 +237,67 @@ IoctlCreateDispatch(
 );
 
 /**
- * @brief Sends a deletion message to the user-mode queue.
+ * @brief Handles the closing of the last handle to a file object.
+ *
+ * Cancels the wait requests still parked through it and, if it mapped the event ring, unmaps it.
+ *
+ * @param[in] DeviceObject Pointer to the device object.
+ * @param[in] Irp Pointer to the IRP for the cleanup request.
+ * @return NTSTATUS STATUS_SUCCESS.
+ */
+NTSTATUS
+IoctlCleanupDispatch(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp
+);
+
+/**
+ * @brief Sends a message about a tracked operation to the user-mode queue.
  *
- * Constructs and enqueues a deletion message containing process name, file path, and timestamp.
+ * Constructs and enqueues a message containing process name, file path, operation, and the system and
+ * interrupt time it was queued at, into the subscriber's mapped ring if there is one, and wakes a waiting
+ * consumer if its batch threshold is reached. The process name and the directory of the path are sent by
+ * id once the current string epoch has defined them.
  *
- * @param[in] processName Pointer to a UNICODE_STRING with the process name that performed the deletion.
- * @param[in] name Pointer to a UNICODE_STRING with the file path that was deleted.
- * @param[in] timeString Pointer to a UNICODE_STRING with the timestamp of the deletion.
- * @return NTSTATUS STATUS_SUCCESS if enqueued, STATUS_INSUFFICIENT_RESOURCES if queue is full.
+ * @param[in] processName Pointer to a UNICODE_STRING with the process name that performed the operation.
+ * @param[in] processId ID of that process.
+ * @param[in] processCreateTime Creation time of that process, telling it apart from later ones with the same ID.
+ * @param[in] name Pointer to a UNICODE_STRING with the file path the operation was performed on.
+ * @param[in] operation RULE_OP_* of the operation.
+ * @param[in] denied TRUE if the operation was blocked; such messages are kept in preference under QueuePreferPriority.
+ * @return NTSTATUS STATUS_SUCCESS if enqueued, possibly after the overflow policy dropped older messages,
+ *         STATUS_INSUFFICIENT_RESOURCES if the message itself was dropped.
  */
 NTSTATUS 
 SendToUser(
     PUNICODE_STRING processName, 
+    HANDLE processId,
+    LONG64 processCreateTime,
     PUNICODE_STRING name, 
-    PUNICODE_STRING timeString
+    LONG operation,
+    BOOLEAN denied
 );
 
 /**
  * @brief Initializes the IOCTL handling subsystem.
  *
- * Sets up necessary structures (e.g., circular queue) for IOCTL operations.
+ * Sets up necessary structures (e.g., circular queue, wait queue) for IOCTL operations. The queue size and
+ * overflow policy are read from the QueueSize and OverflowPolicy values of the service's Parameters key.
+ * Must be called before any deletion is logged; call IoctlClear even if it fails.
  *
+ * @param[in] RegistryPath The service key passed to DriverEntry.
  * @return NTSTATUS STATUS_SUCCESS on success, or an appropriate error code.
  */
 NTSTATUS 
-IoctlInit();
+IoctlInit(
+    _In_ PUNICODE_STRING RegistryPath
+);
 
 /**
  * @brief Clears the IOCTL subsystem state.
  *
- * Resets the circular queue and any associated resources, freeing memory as needed.
+ * Cancels pending wait requests, then resets the circular queue and any associated resources,
+ * freeing memory as needed.
  *
  * @return NTSTATUS STATUS_SUCCESS on success, or an appropriate error code.
  */
@@ -0,0 +1,94 @@
+#include <fltKernel.h>
+#include <dontuse.h>
+#include "volumeRules.h"
+#include "foldedName.h"
+
+
+BOOLEAN
+VolumeOfPath(PCUNICODE_STRING Path, PUNICODE_STRING Volume)
+{
+    USHORT count = Path->Length / sizeof(WCHAR);
+    USHORT separators = 0;
+    USHORT end = 0;
+
+    if (count == 0 || Path->Buffer[0] != L'\\') {
+        return FALSE;
+    }
+
+    // \Device\HarddiskVolume3\Dir\file.txt ends its volume at the third separator, or at the end of the path
+    for (end = 1; end < count; end++) {
+        WCHAR ch = Path->Buffer[end];
+        if (ch == L'*' || ch == L'?') {
+            return FALSE;
+        }
+        if (ch == L'\\') {
+            if (++separators == 2) break;
+            if (Path->Buffer[end - 1] == L'\\') return FALSE;
+        }
+    }
+    if (separators == 0 || Path->Buffer[end - 1] == L'\\') {
+        return FALSE;
+    }
+
+    Volume->Buffer = Path->Buffer;
+    Volume->Length = Volume->MaximumLength = end * sizeof(WCHAR);
+    return TRUE;
+}
+
+PVOLUME_RULE_SLOT
+VolumeRulesSlot(PVOLUME_RULES Rules, PCUNICODE_STRING Path)
+{
+    UNICODE_STRING volume;
+    if (!VolumeOfPath(Path, &volume) || volume.Length > sizeof(Rules->Unscoped.Name)) {
+        return &Rules->Unscoped;
+    }
+
+    WCHAR folded[VOLUME_NAME_MAX_CHARS];
+    FoldNameChars(folded, volume.Buffer, volume.Length / sizeof(WCHAR));
+    volume.Buffer = folded;
+
+    LONG slotCount = Rules->SlotCount;
+    for (LONG i = 0; i < slotCount; i++) {
+        PVOLUME_RULE_SLOT slot = &Rules->Volumes[i];
+        UNICODE_STRING name = { slot->Length, slot->Length, slot->Name };
+        if (FoldedNamesEqual(&name, &volume)) {
+            return slot;
+        }
+    }
+    if (slotCount == VOLUME_RULES_MAX_VOLUMES) {
+        return &Rules->Unscoped;
+    }
+
+    // The name is in place before the release store makes the slot visible to readers
+    PVOLUME_RULE_SLOT slot = &Rules->Volumes[slotCount];
+    RtlCopyMemory(slot->Name, folded, volume.Length);
+    slot->Length = volume.Length;
+    slot->Rules = 0;
+    slot->Patterns = 0;
+    WriteRelease(&Rules->SlotCount, slotCount + 1);
+    return slot;
+}
+
+VOID
+VolumeRulesAdd(PVOLUME_RULES Rules, PCUNICODE_STRING Path, LONG Delta)
+{
+    InterlockedAdd(&VolumeRulesSlot(Rules, Path)->Rules, Delta);
+}
+
+BOOLEAN
+VolumeRulesAny(PVOLUME_RULES Rules, PCUNICODE_STRING VolumeName)
+{
+    if (ReadNoFence(&Rules->Unscoped.Rules) > 0) {
+        return TRUE;
+    }
+
+    LONG slotCount = ReadAcquire(&Rules->SlotCount);
+    for (LONG i = 0; i < slotCount; i++) {
+        PVOLUME_RULE_SLOT slot = &Rules->Volumes[i];
+        UNICODE_STRING name = { slot->Length, slot->Length, slot->Name };
+        if (FoldedNamesEqual(&name, VolumeName)) {
+            return ReadNoFence(&slot->Rules) > 0;
+        }
+    }
+    return FALSE;
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <fltKernel.h>
+#include <dontuse.h>
+
+/**
+ * @def VOLUME_RULES_MAX_VOLUMES
+ * @brief Volumes whose rules are counted apart; rules on further volumes count as unscoped.
+ */
+#define VOLUME_RULES_MAX_VOLUMES 64
+
+/**
+ * @def VOLUME_NAME_MAX_CHARS
+ * @brief Longest NT device name of a volume that gets a slot of its own, e.g. \\Device\\HarddiskVolume3.
+ */
+#define VOLUME_NAME_MAX_CHARS 64
+
+/**
+ * @struct _VOLUME_RULE_SLOT
+ * @brief Number of rules that can match on one volume.
+ */
+typedef struct _VOLUME_RULE_SLOT {
+    USHORT Length;                       ///< Bytes of Name; 0 for the unscoped slot.
+    volatile LONG Rules;                 ///< Names, directory rules and patterns on the volume, the patterns included.
+    LONG Patterns;                       ///< Share of Rules that comes from the wildcard ruleset; written by writers only.
+    WCHAR Name[VOLUME_NAME_MAX_CHARS];   ///< Upcased NT device name of the volume; immutable once the slot is published.
+} VOLUME_RULE_SLOT, *PVOLUME_RULE_SLOT;
+
+/**
+ * @struct _VOLUME_RULES
+ * @brief Rule counts per volume, so a volume without rules can let its operations pass untouched.
+ *
+ * A rule is counted on the volume its path starts with. Rules whose path names no volume, like patterns that
+ * do not start with a literal device name, or that belong to a volume past VOLUME_RULES_MAX_VOLUMES, count as
+ * unscoped and make every volume look ruled. Slots are only ever appended, so readers take no lock; writers are
+ * serialized by the caller.
+ */
+typedef struct _VOLUME_RULES {
+    volatile LONG SlotCount;                        ///< Slots of Volumes published, with release semantics.
+    VOLUME_RULE_SLOT Unscoped;                      ///< Rules that may match on any volume.
+    VOLUME_RULE_SLOT Volumes[VOLUME_RULES_MAX_VOLUMES]; ///< One slot per volume that has had a rule.
+} VOLUME_RULES, *PVOLUME_RULES;
+
+/**
+ * @brief Finds the volume an NT path starts with: its first two components, e.g. \\Device\\HarddiskVolume3.
+ *
+ * @param[in] Path The NT path of a file, a directory or a pattern.
+ * @param[out] Volume Receives the volume part of Path, pointing into Path's buffer.
+ * @return BOOLEAN FALSE if Path names no literal volume, i.e. it does not start with two components free of
+ *         wildcard characters.
+ */
+BOOLEAN VolumeOfPath(PCUNICODE_STRING Path, PUNICODE_STRING Volume);
+
+/**
+ * @brief Returns the slot counting the rules of a path, adding a slot for a volume seen the first time.
+ *
+ * Must be called with the caller's writer lock held.
+ *
+ * @param[in,out] Rules The rule counts.
+ * @param[in] Path The NT path of a rule.
+ * @return PVOLUME_RULE_SLOT The volume's slot, or the unscoped slot.
+ */
+PVOLUME_RULE_SLOT VolumeRulesSlot(PVOLUME_RULES Rules, PCUNICODE_STRING Path);
+
+/**
+ * @brief Counts a rule in or out on the volume of its path.
+ *
+ * Must be called with the caller's writer lock held; count a rule in before it is published and out after it
+ * is unpublished, so the count never says less than the readers can find.
+ *
+ * @param[in,out] Rules The rule counts.
+ * @param[in] Path The NT path of the rule.
+ * @param[in] Delta 1 for an added rule, -1 for a removed one.
+ */
+VOID VolumeRulesAdd(PVOLUME_RULES Rules, PCUNICODE_STRING Path, LONG Delta);
+
+/**
+ * @brief Checks whether any rule can match a file on a volume. Takes no lock.
+ *
+ * @param[in] Rules The rule counts.
+ * @param[in] VolumeName The volume's NT device name, upcased.
+ * @return BOOLEAN TRUE if the volume has rules or some rule is unscoped.
+ */
+BOOLEAN VolumeRulesAny(PVOLUME_RULES Rules, PCUNICODE_STRING VolumeName);
@@ -0,0 +1,71 @@
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include "eventDecoder.h"
+
+void ClearEventStrings(PEVENT_STRING_TABLE Table) {
+    for (int i = 0; i < EVENT_STRING_TABLE_SIZE; i++) {
+        free(Table->Text[i]);
+    }
+    memset(Table, 0, sizeof(*Table));
+}
+
+// Follows the driver's string epochs: a newer one replaces the table, while a message of an older one can only use
+// the strings it sends in full. Epochs start at 1 and are compared with wraparound.
+static void EnterStringEpoch(PEVENT_STRING_TABLE table, ULONG epoch) {
+    if ((LONG)(epoch - table->Epoch) <= 0) {
+        return;
+    }
+    for (int i = 0; i < EVENT_STRING_TABLE_SIZE; i++) {
+        free(table->Text[i]);
+        table->Text[i] = NULL;
+    }
+    table->Epoch = epoch;
+}
+
+// Returns a string of a message, sent in full or by id, and keeps the ones sent in full with an id of the current
+// epoch. Returns NULL if the id is of an older epoch or its definition was lost.
+static const WCHAR* ResolveString(PEVENT_STRING_TABLE table, ULONG epoch, USHORT id, const WCHAR* sent, USHORT length,
+    USHORT* textLength) {
+    if (length || !id) {
+        *textLength = length;
+        if (id && id <= EVENT_STRING_TABLE_SIZE && epoch == table->Epoch) {
+            PWSTR copy = (PWSTR)malloc(length);
+            if (copy) {
+                memcpy(copy, sent, length);
+            }
+            free(table->Text[id - 1]);
+            table->Text[id - 1] = copy;
+            table->Length[id - 1] = copy ? length : 0;
+        }
+        return sent;
+    }
+
+    if (id > EVENT_STRING_TABLE_SIZE || epoch != table->Epoch || !table->Text[id - 1]) {
+        *textLength = 0;
+        return NULL;
+    }
+    *textLength = table->Length[id - 1];
+    return table->Text[id - 1];
+}
+
+BOOL DecodeDeleteMessage(PEVENT_STRING_TABLE Table, const DELETE_MESSAGE* Message, ULONG Length, PDECODED_EVENT Event) {
+    if (Length < DELETE_MESSAGE_HEADER_SIZE || Message->Size > Length
+        || Message->Size < DELETE_MESSAGE_HEADER_SIZE + (ULONG)Message->ProcessNameLength + Message->DirectoryLength
+            + Message->FileNameLength) {
+        return FALSE;
+    }
+
+    // Names sent by id resolve against the strings sent in full before, in queue order: process name first
+    const WCHAR* names = Message->Names;
+    EnterStringEpoch(Table, Message->StringEpoch);
+    Event->ProcessName = ResolveString(Table, Message->StringEpoch, Message->ProcessNameId, names,
+        Message->ProcessNameLength, &Event->ProcessNameLength);
+    names += Message->ProcessNameLength / sizeof(WCHAR);
+    Event->Directory = ResolveString(Table, Message->StringEpoch, Message->DirectoryId, names,
+        Message->DirectoryLength, &Event->DirectoryLength);
+    names += Message->DirectoryLength / sizeof(WCHAR);
+    Event->FileName = names;
+    Event->FileNameLength = Message->FileNameLength;
+    return TRUE;
+}
@@ -0,0 +1,61 @@
+/**
+ * @file eventDecoder.h
+ * @brief Resolves the interned names of deletion messages, the consumer's half of the protocol in
+ *        kernel/eventMessage.h.
+ *
+ * Portable C with no calls into Windows, so the host build can measure it; include <windows.h> first.
+ */
+
+#pragma once
+#include "../kernel/eventMessage.h"
+
+/**
+ * @def EVENT_STRING_TABLE_SIZE
+ * @brief Ids the driver hands out in one string epoch.
+ */
+#define EVENT_STRING_TABLE_SIZE DELETE_MESSAGE_MAX_STRING_ID
+
+/**
+ * @struct _EVENT_STRING_TABLE
+ * @brief The strings defined in the newest string epoch seen so far. Start from a zeroed table.
+ */
+typedef struct _EVENT_STRING_TABLE {
+    ULONG Epoch;                                ///< Newest epoch seen, 0 before the first message.
+    PWSTR Text[EVENT_STRING_TABLE_SIZE];        ///< Strings defined in it by id - 1, NULL if not defined.
+    USHORT Length[EVENT_STRING_TABLE_SIZE];     ///< Their lengths in bytes.
+} EVENT_STRING_TABLE, *PEVENT_STRING_TABLE;
+
+/**
+ * @struct _DECODED_EVENT
+ * @brief The names of a message. They point into the message or the table, so they are valid until the next
+ *        message is decoded.
+ */
+typedef struct _DECODED_EVENT {
+    const WCHAR* ProcessName;                   ///< NULL if the process name's id could not be resolved.
+    const WCHAR* Directory;                     ///< NULL if the directory's id could not be resolved.
+    const WCHAR* FileName;
+    USHORT ProcessNameLength;                   ///< Bytes, 0 if ProcessName is NULL.
+    USHORT DirectoryLength;                     ///< Bytes, 0 if Directory is NULL.
+    USHORT FileNameLength;                      ///< Bytes.
+} DECODED_EVENT, *PDECODED_EVENT;
+
+/**
+ * @brief Checks a message and resolves its names, keeping the strings it defines. Messages must be decoded in
+ *        queue order. A gap marker is not a message; test MessageId first.
+ *
+ * An id of an older epoch, or one whose definition was lost, resolves to NULL: the name is unknown, never wrong.
+ *
+ * @param[in,out] Table The consumer's strings.
+ * @param[in] Message The message.
+ * @param[in] Length Bytes readable at Message.
+ * @param[out] Event Receives the names.
+ * @return BOOL FALSE if the message is malformed.
+ */
+BOOL DecodeDeleteMessage(PEVENT_STRING_TABLE Table, const DELETE_MESSAGE* Message, ULONG Length, PDECODED_EVENT Event);
+
+/**
+ * @brief Frees the strings of the table and zeroes it.
+ *
+ * @param[in,out] Table The table to clear.
+ */
+void ClearEventStrings(PEVENT_STRING_TABLE Table);
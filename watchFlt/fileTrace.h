@@ -0,0 +1,61 @@
+/**
+ * @file fileTrace.h
+ * @brief Binary trace of filter events, written by watchFlt -t, replayed or generated by ctlFlt and by the host
+ *        replayBench.
+ *
+ * A trace is a FILE_TRACE_HEADER followed by FILE_TRACE_RECORDs back to back, each one carrying its names after
+ * the fixed part. Shared between the tools, so it only needs the basic types of <windows.h>.
+ */
+
+#pragma once
+
+/**
+ * @def FILE_TRACE_MAGIC
+ * @brief First bytes of a trace, "FTRC" in a hex dump.
+ */
+#define FILE_TRACE_MAGIC 0x43525446
+
+/**
+ * @def FILE_TRACE_VERSION
+ * @brief Layout of the records that follow the header.
+ */
+#define FILE_TRACE_VERSION 1
+
+/**
+ * @def FILE_TRACE_DENIED
+ * @brief Record flag: the driver blocked the operation.
+ */
+#define FILE_TRACE_DENIED 0x1
+
+#pragma pack(push, 1)
+/**
+ * @struct _FILE_TRACE_HEADER
+ * @brief Start of a trace file.
+ */
+typedef struct _FILE_TRACE_HEADER {
+    ULONG Magic;                 ///< FILE_TRACE_MAGIC.
+    ULONG Version;               ///< FILE_TRACE_VERSION.
+} FILE_TRACE_HEADER, *PFILE_TRACE_HEADER;
+
+/**
+ * @struct _FILE_TRACE_RECORD
+ * @brief One operation the driver reported. The operation stands for the information class: a deletion is a
+ *        disposition, a rename a rename, the other two are creates.
+ */
+typedef struct _FILE_TRACE_RECORD {
+    LONG64 Time;                 ///< Interrupt time of the operation, in 100ns units since boot.
+    ULONG ProcessId;             ///< Process that performed it.
+    UCHAR Operation;             ///< RULE_OP_* of kernel/ruleOps.h.
+    UCHAR Flags;                 ///< FILE_TRACE_* flags.
+    USHORT ProcessNameLength;    ///< Bytes of the process image name at the start of Names.
+    USHORT PathLength;           ///< Bytes of the file's NT path following it.
+    WCHAR Names[ANYSIZE_ARRAY];  ///< Process name, then path, neither null-terminated.
+} FILE_TRACE_RECORD, *PFILE_TRACE_RECORD;
+#pragma pack(pop)
+
+/**
+ * @def FILE_TRACE_RECORD_SIZE
+ * @brief Bytes of a record with names of the given lengths in bytes.
+ */
+#define FILE_TRACE_RECORD_SIZE(ProcessNameLength, PathLength) \
+    (FIELD_OFFSET(FILE_TRACE_RECORD, Names) + (ULONG)(ProcessNameLength) + (ULONG)(PathLength))
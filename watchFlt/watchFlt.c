@@ -1,19 +1,340 @@
 #include <windows.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../kernel/sharedQueue.h"
+#include "eventDecoder.h"
+#include "fileTrace.h"
 
 #define DEVICE_NAME L"\\\\.\\FileTracker"
-#define IOCTL_GET_DELETE_MESSAGE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_WAIT_DELETE_MESSAGES CTL_CODE(FILE_DEVICE_UNKNOWN, 0x807, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_MAP_EVENT_RING CTL_CODE(FILE_DEVICE_UNKNOWN, 0x808, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+// Names of the operations a message reports, by the number in its Flags
+static const wchar_t* OperationNames[] = { L"DELETE", L"RENAME", L"OVERWRITE", L"DELETE_ON_CLOSE" };
 
 #pragma pack(push, 1)
-typedef struct _DELETE_MESSAGE {
-    ULONG MessageId;
-    WCHAR ProcessName[260];
-    WCHAR FilePath[260];
-    WCHAR DateTime[20];
-} DELETE_MESSAGE, * PDELETE_MESSAGE;
+typedef struct _DELETE_MESSAGE_BATCH {
+    ULONG Count;
+    ULONG NextMessageId;
+    UCHAR Messages[ANYSIZE_ARRAY];
+} DELETE_MESSAGE_BATCH, * PDELETE_MESSAGE_BATCH;
+
+typedef struct _DELETE_MESSAGE_WAIT {
+    ULONG MinBytes;             // Queue bytes in use that complete the wait at once
+    ULONG MaxLatencyMs;         // How long the first message may wait for the rest
+} DELETE_MESSAGE_WAIT, * PDELETE_MESSAGE_WAIT;
+
+typedef struct _EVENT_RING_MAPPING {
+    ULONG64 Header;             // Where the QUEUE_SHARED_HEADER is mapped in this process, writable
+    ULONG64 Data;               // Where the records are mapped, read-only
+    ULONG Capacity;             // Bytes of records
+} EVENT_RING_MAPPING, * PEVENT_RING_MAPPING;
 #pragma pack(pop)
 
-int wmain() {
+// Room for thousands of typical messages per call, and for any single message the driver queues
+#define MESSAGE_BUFFER_SIZE (1024 * 1024)
+
+// A burst is delivered in batches of 16 KB, a lone event at most 10 ms late
+#define WAIT_MIN_BYTES (16 * 1024)
+#define WAIT_MAX_LATENCY_MS 10
+
+#define TICKS_PER_MINUTE (60LL * 10000000)
+#define TICKS_PER_HOUR (60 * TICKS_PER_MINUTE)
+#define SECONDS_PER_DAY 86400
+
+// Days from 0000-03-01 to 1601-01-01 in the proleptic Gregorian calendar
+#define DAYS_TO_1601 584694
+
+// "00" to "99", so two digits are converted per division
+static WCHAR DigitPairs[200];
+
+// Offset from UTC to local time, in 100ns units, for events in [OffsetFrom, OffsetUntil)
+static LONG64 Offset;
+static LONG64 OffsetFrom;
+static LONG64 OffsetUntil;
+
+// Strings defined in the newest string epoch seen so far
+static EVENT_STRING_TABLE Strings;
+
+// Trace the events are also recorded to, see fileTrace.h; NULL without -t
+static FILE* Trace;
+
+static void InitDigitPairs(void) {
+    for (int i = 0; i < 100; i++) {
+        DigitPairs[2 * i] = L'0' + i / 10;
+        DigitPairs[2 * i + 1] = L'0' + i % 10;
+    }
+}
+
+// Returns the local time offset for a system time. The time zone is only queried again once an event falls
+// outside the hour the offset was taken for, which is also how daylight saving changes are picked up.
+static LONG64 LocalTimeOffset(LONG64 systemTime) {
+    if (systemTime < OffsetFrom || systemTime >= OffsetUntil) {
+        TIME_ZONE_INFORMATION zone;
+        LONG bias;
+
+        switch (GetTimeZoneInformation(&zone)) {
+        case TIME_ZONE_ID_DAYLIGHT:
+            bias = zone.Bias + zone.DaylightBias;
+            break;
+        case TIME_ZONE_ID_STANDARD:
+            bias = zone.Bias + zone.StandardBias;
+            break;
+        case TIME_ZONE_ID_UNKNOWN:
+            bias = zone.Bias;
+            break;
+        default:
+            bias = 0;
+            break;
+        }
+
+        Offset = -(LONG64)bias * TICKS_PER_MINUTE;
+        OffsetFrom = systemTime - systemTime % TICKS_PER_HOUR;
+        OffsetUntil = OffsetFrom + TICKS_PER_HOUR;
+    }
+    return Offset;
+}
+
+// Writes value as width digits, most significant first; returns the position after them
+static PWCHAR PutDigits(PWCHAR out, ULONG value, int width) {
+    for (int i = width; i >= 2; i -= 2) {
+        const WCHAR* pair = DigitPairs + 2 * (value % 100);
+        out[i - 2] = pair[0];
+        out[i - 1] = pair[1];
+        value /= 100;
+    }
+    if (width & 1) {
+        out[0] = L'0' + value % 10;
+    }
+    return out + width;
+}
+
+// Formats a system time as local "YYYY-MM-DD hh:mm:ss.mmm"
+static void FormatSystemTime(LONG64 systemTime, WCHAR text[24]) {
+    LONG64 local = max(systemTime + LocalTimeOffset(systemTime), 0);
+    ULONG64 seconds = (ULONG64)local / 10000000;
+    ULONG millis = (ULONG)((ULONG64)local / 10000 % 1000);
+    ULONG secondOfDay = (ULONG)(seconds % SECONDS_PER_DAY);
+
+    // Civil date from a day count, counting years from March so the leap day comes last
+    ULONG64 days = seconds / SECONDS_PER_DAY + DAYS_TO_1601;
+    ULONG era = (ULONG)(days / 146097);
+    ULONG dayOfEra = (ULONG)(days % 146097);
+    ULONG yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    ULONG dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    ULONG monthIndex = (5 * dayOfYear + 2) / 153;
+    ULONG day = dayOfYear - (153 * monthIndex + 2) / 5 + 1;
+    ULONG month = monthIndex < 10 ? monthIndex + 3 : monthIndex - 9;
+    ULONG year = era * 400 + yearOfEra + (month <= 2);
+
+    PWCHAR out = PutDigits(text, year, 4);
+    *out++ = L'-';
+    out = PutDigits(out, month, 2);
+    *out++ = L'-';
+    out = PutDigits(out, day, 2);
+    *out++ = L' ';
+    out = PutDigits(out, secondOfDay / 3600, 2);
+    *out++ = L':';
+    out = PutDigits(out, secondOfDay / 60 % 60, 2);
+    *out++ = L':';
+    out = PutDigits(out, secondOfDay % 60, 2);
+    *out++ = L'.';
+    out = PutDigits(out, millis, 3);
+    *out = L'\0';
+}
+
+// Appends an event to the trace. Records are buffered and flushed whenever the watcher waits for events.
+static void TraceMessage(PDELETE_MESSAGE msg, ULONG operation, const WCHAR* processName, USHORT processNameLength,
+    const WCHAR* directory, USHORT directoryLength, const WCHAR* fileName) {
+    FILE_TRACE_RECORD record;
+    USHORT pathLength = (USHORT)min((ULONG)directoryLength + msg->FileNameLength, MAXUSHORT & ~1UL);
+
+    record.Time = (LONG64)msg->InterruptTime;
+    record.ProcessId = msg->ProcessId;
+    record.Operation = (UCHAR)operation;
+    record.Flags = (msg->Flags & DELETE_MESSAGE_DENIED) ? FILE_TRACE_DENIED : 0;
+    record.ProcessNameLength = processNameLength;
+    record.PathLength = pathLength;
+    fwrite(&record, FIELD_OFFSET(FILE_TRACE_RECORD, Names), 1, Trace);
+    fwrite(processName, 1, processNameLength, Trace);
+    fwrite(directory, 1, min(directoryLength, pathLength), Trace);
+    if (pathLength > directoryLength) {
+        fwrite(fileName, 1, pathLength - directoryLength, Trace);
+    }
+}
+
+// Prints one message, or the number of messages lost at that point; returns FALSE if it is malformed
+static BOOL PrintMessage(PDELETE_MESSAGE msg, ULONG length) {
+    if (length >= sizeof(QUEUE_GAP_MARKER) && msg->MessageId == 0) {
+        PQUEUE_GAP_MARKER marker = (PQUEUE_GAP_MARKER)msg;
+        if (marker->Size != sizeof(QUEUE_GAP_MARKER)) {
+            return FALSE;
+        }
+        wprintf(L"FileLogger: %llu events lost, the queue was full\n", marker->Lost);
+        return TRUE;
+    }
+
+    DECODED_EVENT event;
+    if (!DecodeDeleteMessage(&Strings, msg, length, &event)) {
+        return FALSE;
+    }
+
+    // A name whose definition was lost prints as its id
+    WCHAR unknownProcess[32];
+    WCHAR unknownDirectory[32];
+    if (!event.ProcessName) {
+        event.ProcessNameLength = (USHORT)(swprintf_s(unknownProcess, _countof(unknownProcess), L"<unknown #%u>", msg->ProcessNameId) * sizeof(WCHAR));
+        event.ProcessName = unknownProcess;
+    }
+    if (!event.Directory) {
+        event.DirectoryLength = (USHORT)(swprintf_s(unknownDirectory, _countof(unknownDirectory), L"<unknown #%u>\\", msg->DirectoryId) * sizeof(WCHAR));
+        event.Directory = unknownDirectory;
+    }
+
+    WCHAR dateTime[24];
+    FormatSystemTime(msg->SystemTime, dateTime);
+    ULONG operation = (msg->Flags >> DELETE_MESSAGE_OPERATION_SHIFT) & 0xFF;
+    wprintf(L"FileLogger: Operation=%s%s, Process=%.*s, PID=%lu, Path=%.*s%.*s, DateTime=%s\n",
+        operation < _countof(OperationNames) ? OperationNames[operation] : L"UNKNOWN",
+        (msg->Flags & DELETE_MESSAGE_DENIED) ? L"_DENIED" : L"",
+        event.ProcessNameLength / (int)sizeof(WCHAR), event.ProcessName, msg->ProcessId,
+        event.DirectoryLength / (int)sizeof(WCHAR), event.Directory,
+        event.FileNameLength / (int)sizeof(WCHAR), event.FileName,
+        dateTime);
+    if (Trace) {
+        TraceMessage(msg, operation, event.ProcessName, event.ProcessNameLength, event.Directory, event.DirectoryLength,
+            event.FileName);
+    }
+    return TRUE;
+}
+
+// Prints the messages of one batch; returns FALSE if the batch is malformed
+static BOOL PrintBatch(PDELETE_MESSAGE_BATCH batch, DWORD bytesReturned) {
+    DWORD offset = FIELD_OFFSET(DELETE_MESSAGE_BATCH, Messages);
+
+    for (ULONG i = 0; i < batch->Count; i++) {
+        PDELETE_MESSAGE msg = (PDELETE_MESSAGE)((PUCHAR)batch + offset);
+        if (offset > bytesReturned || !PrintMessage(msg, bytesReturned - offset)) {
+            return FALSE;
+        }
+
+        // Messages start 8-byte aligned relative to the messages area, which itself is 8-byte aligned
+        offset += (msg->Size + 7) & ~7UL;
+    }
+    return TRUE;
+}
+
+// Waits until a batch is due; returns FALSE on failure
+static BOOL WaitForMessages(HANDLE hDevice, PDELETE_MESSAGE_WAIT wait, PDELETE_MESSAGE_BATCH batch) {
+    DWORD bytesReturned;
+
+    // A watcher stopped while it waits loses no recorded event
+    if (Trace) {
+        fflush(Trace);
+    }
+
+    BOOL success = DeviceIoControl(hDevice,
+        IOCTL_WAIT_DELETE_MESSAGES,
+        wait, sizeof(*wait),
+        batch, MESSAGE_BUFFER_SIZE,
+        &bytesReturned,
+        NULL);
+
+    if (!success || bytesReturned < FIELD_OFFSET(DELETE_MESSAGE_BATCH, Messages)) {
+        wprintf(L"Failed to get message: %d\n", GetLastError());
+        return FALSE;
+    }
+
+    // Messages queued before the ring was mapped still arrive this way
+    if (!PrintBatch(batch, bytesReturned)) {
+        wprintf(L"Received a malformed batch of %lu messages\n", batch->Count);
+    }
+    return TRUE;
+}
+
+// Reads messages in place from the ring the driver maps into this process, following sharedQueue.h
+static int RunMapped(HANDLE hDevice, PDELETE_MESSAGE_WAIT wait, PDELETE_MESSAGE_BATCH batch) {
+    EVENT_RING_MAPPING mapping;
+    DWORD bytesReturned;
+
+    if (!DeviceIoControl(hDevice, IOCTL_MAP_EVENT_RING, NULL, 0, &mapping, sizeof(mapping), &bytesReturned, NULL)) {
+        wprintf(L"Failed to map the event ring: %d\n", GetLastError());
+        return 1;
+    }
+
+    PQUEUE_SHARED_HEADER header = (PQUEUE_SHARED_HEADER)(ULONG_PTR)mapping.Header;
+    if (header->Version != QUEUE_SHARED_VERSION) {
+        wprintf(L"Unsupported event ring version %lu\n", header->Version);
+        return 1;
+    }
+
+    const UCHAR* data = (const UCHAR*)(ULONG_PTR)mapping.Data;
+    ULONG capacity = mapping.Capacity;
+
+    wprintf(L"Connected to FileTracker device. Reading delete events in place... (Ring size: %lu bytes)\n", capacity);
+
+    while (TRUE) {
+        LONG64 head = header->Head;
+        ULONG offset = (ULONG)head & (capacity - 1);
+        const QUEUE_RECORD_HEADER* record = (const QUEUE_RECORD_HEADER*)(data + offset);
+
+        if (ReadAcquire64(&record->Stamp) != head + 1) {
+            // Nothing published at Head; sleep in the driver until there is
+            if (!WaitForMessages(hDevice, wait, batch)) {
+                return 1;
+            }
+            continue;
+        }
+
+        ULONG size = record->Size;
+        if (size < sizeof(QUEUE_RECORD_HEADER) || size % QUEUE_RECORD_ALIGNMENT || size > capacity - offset) {
+            wprintf(L"Event ring is corrupt at position %lld\n", head);
+            return 1;
+        }
+        if (record->Length != QUEUE_PAD_RECORD
+            && (record->Length > size - sizeof(QUEUE_RECORD_HEADER) || !PrintMessage((PDELETE_MESSAGE)(record + 1), record->Length))) {
+            wprintf(L"Received a malformed message at position %lld\n", head);
+        }
+
+        // The records are read-only here; the driver zeroes the space before reusing it
+        WriteRelease64(&header->Head, head + size);
+    }
+}
+
+int wmain(int argc, wchar_t* argv[]) {
+    BOOL mapped = FALSE;
+    const wchar_t* traceName = NULL;
+    DELETE_MESSAGE_WAIT wait = { WAIT_MIN_BYTES, WAIT_MAX_LATENCY_MS };
+    int result = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (wcscmp(argv[i], L"-m") == 0) {
+            mapped = TRUE;
+        }
+        else if (wcscmp(argv[i], L"-t") == 0 && i + 1 < argc) {
+            traceName = argv[++i];
+        }
+        else {
+            wprintf(L"Usage: %s [-m] [-t <trace_file>]\n", argv[0]);
+            wprintf(L"  -m: Read the events in place from a ring mapped into this process\n");
+            wprintf(L"  -t: Also record the events to a binary trace that ctlFlt -l can replay\n");
+            return 1;
+        }
+    }
+
+    InitDigitPairs();
+
+    if (traceName) {
+        FILE_TRACE_HEADER header = { FILE_TRACE_MAGIC, FILE_TRACE_VERSION };
+        if (_wfopen_s(&Trace, traceName, L"wb") != 0) {
+            wprintf(L"Failed to create %s\n", traceName);
+            return 1;
+        }
+        setvbuf(Trace, NULL, _IOFBF, 256 * 1024);
+        fwrite(&header, sizeof(header), 1, Trace);
+    }
+
     HANDLE hDevice = CreateFileW(DEVICE_NAME,
         GENERIC_READ | GENERIC_WRITE,
         0,
@@ -27,35 +348,29 @@ int wmain() {
         return 1;
     }
 
-    wprintf(L"Connected to FileTracker device. Polling for delete events... (Buffer size: %zu bytes)\n", sizeof(DELETE_MESSAGE));
+    PDELETE_MESSAGE_BATCH batch = (PDELETE_MESSAGE_BATCH)malloc(MESSAGE_BUFFER_SIZE);
+    if (!batch) {
+        wprintf(L"Failed to allocate message buffer\n");
+        CloseHandle(hDevice);
+        return 1;
+    }
 
-    while (TRUE) {
-        DELETE_MESSAGE msg = { 0 };
-        DWORD bytesReturned;
-        BOOL success = DeviceIoControl(hDevice,
-            IOCTL_GET_DELETE_MESSAGE,
-            NULL, 0,
-            &msg, sizeof(DELETE_MESSAGE),
-            &bytesReturned,
-            NULL);
-
-        if (success && bytesReturned == sizeof(DELETE_MESSAGE)) {
-            wprintf(L"FileLogger: Operation=DELETE, Process=%s, Path=%s, DateTime=%s\n",
-                msg.ProcessName, msg.FilePath, msg.DateTime);
-        }
-        else {
-            DWORD error = GetLastError();
-            if (error == ERROR_NO_MORE_ITEMS) {
-                // No messages, wait and retry
-                Sleep(100); // Simple polling delay
-            }
-            else {
-                wprintf(L"Failed to get message: %d\n", error);
-                break;
-            }
+    if (mapped) {
+        result = RunMapped(hDevice, &wait, batch);
+    }
+    else {
+        wprintf(L"Connected to FileTracker device. Waiting for delete events... (Buffer size: %d bytes)\n", MESSAGE_BUFFER_SIZE);
+
+        // Blocks in the driver until a batch is due
+        while (WaitForMessages(hDevice, &wait, batch)) {
         }
+        result = 1;
     }
 
+    free(batch);
     CloseHandle(hDevice);
-    return 0;
-}
\ No newline at end of file
+    if (Trace) {
+        fclose(Trace);
+    }
+    return result;
+}